@@ -21,6 +21,9 @@
 
 #include "fastertransformer/common.h"
 #include "fastertransformer/common_structure.h"
+#include "fastertransformer/cuda/constraint_kernels.h"
+#include "fastertransformer/cuda/stop_criteria_kernels.h"
+#include "fastertransformer/request_metrics.h"
 #include <cuda_runtime.h>
 #include <stdlib.h>
 
@@ -52,6 +55,43 @@ public:
   int *output_ids = nullptr;
   int *parent_ids = nullptr;
   int *sequence_length = nullptr;
+
+  /* optional outputs of beam search */
+  float *output_log_probs = nullptr;     // [seq_len, batch_size * beam_width], log prob of the token chosen at each step
+  int *nbest_ids = nullptr;              // [batch_size, beam_width, seq_len], finalized hypotheses sorted by normed score
+  float *nbest_log_probs = nullptr;      // [batch_size, beam_width, seq_len], per-token log probs of nbest_ids
+  float *nbest_cum_log_probs = nullptr;  // [batch_size, beam_width]
+  float *nbest_normed_scores = nullptr;  // [batch_size, beam_width], cum_log_prob / length^nbest_length_penalty
+  int *nbest_lengths = nullptr;          // [batch_size, beam_width], including the end_id
+  float nbest_length_penalty = 1.0f;
+
+  /* inputs and outputs of the teacher-forced scoring, see DecodingScoring */
+  const int *target_ids = nullptr;              // [batch_size, seq_len]
+  const int *target_sequence_length = nullptr;  // [batch_size], number of scored tokens of each sentence
+  float *target_log_probs = nullptr;            // [batch_size, seq_len], 0 after target_sequence_length
+  float *target_cum_log_probs = nullptr;        // [batch_size]
+
+  /* host inputs of the speculative greedy sampling, the drafts are also looked up in the prompt */
+  const int *prompt_ids = nullptr;              // [batch_size, prompt_max_len], optional
+  const int *prompt_length = nullptr;           // [batch_size], nullptr means prompt_max_len
+  int prompt_max_len = 0;
+
+  /* constrained decoding, see TokenConstraint. The states are advanced in place, over the prompt
+     first in DecodingGpt2. */
+  int *constraint_states = nullptr;             // [batch_size * beam_width], -1 for an unconstrained row
+  TokenConstraintTable constraint_table;
+
+  /* per-sentence stop criteria checked on the device after every step, see stop_criteria_kernels.h */
+  const int *stop_words = nullptr;              // [batch_size, 2, stop_words_len], see pack_stop_words
+  int stop_words_len = 0;
+  const int *max_new_tokens = nullptr;          // [batch_size]
+
+  /* request-level metrics, see RequestMetrics, nullptr disables them. enqueue_us is the arrival of
+     the batch on the RequestMetrics::now_us() clock (0 for the start of forward), the origin of the
+     time to first token and of the request time. The queueing time is recorded by the front end. */
+  RequestMetrics *metrics = nullptr;
+  int64_t enqueue_us = 0;
+
   cublasHandle_t cublas_handle;
   cudaStream_t stream;
 };
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Output heads of the BERT encoder
+ *
+ * Runs after the last BertEncoderTransformer layer: pooling (CLS or mean over
+ * the valid tokens, also on the compact output of the padding removal), the
+ * optional pooler dense + tanh and the optional classification dense. Only
+ * [batch_size, num_labels], or [batch_size, hidden_units] without classifier,
+ * is written to the output, the encoder output never leaves the device.
+ *
+ * In the embedding mode (embedding_type is not NONE, no classifier) the pooled
+ * vectors are L2-normalized and written to embedding in FP32, FP16 or INT8,
+ * ready for EmbeddingSearch.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/common_structure.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/cuda/pooling_kernels.h"
+#include <cuda_runtime.h>
+
+namespace fastertransformer
+{
+
+template <typename T>
+class EncoderHeadInitParam
+{
+public:
+  const T *encoder_out = nullptr;      // output of the last layer
+  const int *sequence_length = nullptr;
+  const int *sequence_id_offset = nullptr;
+  int valid_word_num = -1;
+
+  DenseWeight<T> pooler;               // kernel [hidden_units, hidden_units], optional
+  DenseWeight<T> classifier;           // kernel [hidden_units, num_labels], needed if num_labels > 0
+
+  T *output = nullptr;                 // [batch_size, num_labels] or [batch_size, hidden_units]
+  void *embedding = nullptr;           // [batch_size, hidden_units] of embedding_type, replaces output
+  cublasHandle_t cublas_handle = nullptr;
+  cudaStream_t stream = 0;
+};
+
+template <OperationType OpType_>
+class BertEncoderHead
+{
+private:
+  typedef TransformerTraits<OpType_> Traits_;
+  typedef typename Traits_::DataType DataType_;
+  const IAllocator &allocator_;
+
+  const cudaDataType_t computeType_ = Traits_::computeType;
+  const cudaDataType_t AType_ = Traits_::AType;
+  const cudaDataType_t BType_ = Traits_::BType;
+  const cudaDataType_t CType_ = Traits_::CType;
+  const cublasGemmAlgo_t cublasAlgo_ = OpType_ == OperationType::FP32 ? CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+
+  const int batch_size_;
+  const int max_seq_len_;
+  const int hidden_units_;
+  const int num_labels_;
+  const PoolingType pooling_type_;
+  const EmbeddingType embedding_type_;
+
+  DataType_ *pooled_buf_;
+  DataType_ *pooler_out_buf_;
+  void *buf_;
+
+  /* out[m, n] = in[m, k] * kernel[k, n] + bias, followed by tanh if use_tanh */
+  void dense(const DataType_ *in, const DenseWeight<DataType_> &weight, DataType_ *out,
+             const int m, const int n, const int k, const bool use_tanh,
+             cublasHandle_t cublas_handle, cudaStream_t stream)
+  {
+    DataType_ alpha = (DataType_)1.0f;
+    DataType_ beta = (DataType_)0.0f;
+    check_cuda_error(cublasGemmEx(cublas_handle,
+                                  CUBLAS_OP_N, CUBLAS_OP_N,
+                                  n, m, k,
+                                  &alpha,
+                                  weight.kernel, AType_, n,
+                                  in, BType_, k,
+                                  &beta,
+                                  out, CType_, n,
+                                  computeType_,
+                                  cublasAlgo_));
+    encoder_head_add_bias_kernelLauncher(out, weight.bias, m, n, use_tanh, stream);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+  }
+
+public:
+  /* num_labels = 0 disables the classifier, the output is then the pooled (and pooler) result.
+     embedding_type other than NONE enables the embedding mode, it needs num_labels = 0. */
+  BertEncoderHead(const IAllocator &allocator, const int batch_size, const int max_seq_len,
+                  const int hidden_units, const int num_labels,
+                  const PoolingType pooling_type,
+                  const EmbeddingType embedding_type = EmbeddingType::NONE) : allocator_(allocator),
+                                                                             batch_size_(batch_size),
+                                                                             max_seq_len_(max_seq_len),
+                                                                             hidden_units_(hidden_units),
+                                                                             num_labels_(num_labels),
+                                                                             pooling_type_(pooling_type),
+                                                                             embedding_type_(embedding_type)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    if (batch_size <= 0 || max_seq_len <= 0 || hidden_units <= 0 || num_labels < 0 ||
+        (embedding_type != EmbeddingType::NONE && num_labels != 0))
+    {
+      printf("[ERROR][BertEncoderHead] invalid shape (batch_size %d, max_seq_len %d, hidden_units %d, num_labels %d) "
+             "or num_labels is not 0 in the embedding mode. \n",
+             batch_size, max_seq_len, hidden_units, num_labels);
+      exit(-1);
+    }
+
+    int pooled_buf_size = batch_size_ * hidden_units_;
+    pooled_buf_size = (int)(ceil(pooled_buf_size / 4.)) * 4;
+
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(sizeof(DataType_) * pooled_buf_size * 2));
+    pooled_buf_ = (DataType_ *)buf_;
+    pooler_out_buf_ = pooled_buf_ + pooled_buf_size;
+  }
+
+  int output_size() const
+  {
+    return batch_size_ * (num_labels_ > 0 ? num_labels_ : hidden_units_);
+  }
+
+  bool is_embedding_mode() const { return embedding_type_ != EmbeddingType::NONE; }
+
+  void forward(const EncoderHeadInitParam<DataType_> &param)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    const bool embedding_mode = is_embedding_mode();
+    if (param.encoder_out == nullptr || (embedding_mode ? param.embedding == nullptr : param.output == nullptr) ||
+        (num_labels_ > 0 && param.classifier.kernel == nullptr) ||
+        (param.sequence_id_offset != nullptr && param.valid_word_num < 0))
+    {
+      printf("[ERROR][BertEncoderHead] encoder_out, output (embedding in the embedding mode), classifier.kernel "
+             "(if num_labels > 0) and valid_word_num (if the padding is removed) are needed. \n");
+      exit(-1);
+    }
+    const bool use_pooler = param.pooler.kernel != nullptr;
+    const bool use_classifier = num_labels_ > 0;
+
+    /* every stage writes to the output directly when it is the last one,
+       in the embedding mode the last stage is the normalization */
+    DataType_ *pooled = use_pooler || use_classifier || embedding_mode ? pooled_buf_ : param.output;
+    encoder_pooling_kernelLauncher(pooled, param.encoder_out,
+                                   param.sequence_length, param.sequence_id_offset, param.valid_word_num,
+                                   pooling_type_, batch_size_, max_seq_len_, hidden_units_, param.stream);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+
+    /*
+      User can check the pooling by encoder_pooling_kernel_check.
+      encoder_pooling_kernel_check will compare the results of GPU and CPU.
+      Note that encoder_pooling_kernel_check contains encoder_pooling_kernelLauncher and uses do not need to call it again.
+    */
+    // encoder_pooling_kernel_check(pooled, param.encoder_out, param.sequence_length, param.sequence_id_offset,
+    //                              param.valid_word_num, pooling_type_, batch_size_, max_seq_len_, hidden_units_, param.stream);
+#endif
+
+    if (use_pooler)
+    {
+      DataType_ *pooler_out = use_classifier || embedding_mode ? pooler_out_buf_ : param.output;
+      dense(pooled, param.pooler, pooler_out, batch_size_, hidden_units_, hidden_units_, true,
+            param.cublas_handle, param.stream);
+      pooled = pooler_out;
+    }
+
+    if (use_classifier)
+      dense(pooled, param.classifier, param.output, batch_size_, num_labels_, hidden_units_, false,
+            param.cublas_handle, param.stream);
+
+    if (embedding_mode)
+    {
+      l2_normalize_kernelLauncher(param.embedding, pooled, batch_size_, hidden_units_, embedding_type_, param.stream);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+#endif
+    }
+  }
+
+  virtual ~BertEncoderHead()
+  {
+    allocator_.free(buf_);
+  }
+};
+
+} // namespace fastertransformer
@@ -26,6 +26,7 @@
 #include "fastertransformer/cuda/cuda_int8_kernels.h"
 #include "fastertransformer/cuda/open_attention.h"
 #include "fastertransformer/common_structure.h"
+#include "fastertransformer/memory_planner.h"
 #include "fastertransformer/gemm_test/encoder_gemm_func.h"
 #include "fastertransformer/gemm_test/encoder_igemm_func.h"
 
@@ -105,10 +106,14 @@ class BertEncoderTransformer
   DataType_ *attr_out_buf_;
   DataType_ *attr_matmul_buf_;
   DataType_ *inter_matmul_buf_;
-  DataType_ *attr_out_tmp_buf_;
-  
-  DataType_ *out_tmp_buf_;
-  DataType_ *from_tensor_tmp_buf_;
+
+  /* the buffers without int8, registered by plan_encoder_workspace (memory_planner.h) in this order */
+  enum EncoderBuffer
+  {
+    ATTR_OUT_BUF = 0,
+    ATTR_MATMUL_BUF,
+    INTER_MATMUL_BUF
+  };
 
   int batch_size_;
   int from_seq_len_;
@@ -130,6 +135,7 @@ class BertEncoderTransformer
   int int8_mode_;
   int layer_idx_;
   int layer_num_;
+  int layernorm_variant_ = -1;  // resolved by select_kernel_variants, -1 runs the default one
   const int8_t *int8_from_tensor_;
   const DataType_ * transA_from_tensor_;
   int32_t *int_buf_;
@@ -163,7 +169,9 @@ public:
                          m*n*sizeof(DataType_);
     }
     else{
-      normal_buf_size = sizeof(DataType_) * (m*n) * (6 + 3);
+      WorkspacePlanner planner;
+      plan_encoder_workspace(planner, sizeof(DataType_), m, n);
+      normal_buf_size = (int)planner.total_bytes();
     }
     return normal_buf_size;  
   }
@@ -500,13 +508,11 @@ public:
           if (buf_ == nullptr)
             throw std::runtime_error(std::string("Allocator failed to allocate internal buffer."));
 
-          attr_out_buf_ = buf_;
-          attr_matmul_buf_ = attr_out_buf_ + buf_size;
-          inter_matmul_buf_ = attr_matmul_buf_ + buf_size;
-
-          attr_out_tmp_buf_ = inter_matmul_buf_ + 4 * buf_size;
-          out_tmp_buf_ = attr_out_tmp_buf_ + buf_size;
-          from_tensor_tmp_buf_ = out_tmp_buf_ + buf_size;
+          WorkspacePlanner planner;
+          plan_encoder_workspace(planner, sizeof(DataType_), m, n);
+          attr_out_buf_ = planner.get<DataType_>(buf_, ATTR_OUT_BUF);
+          attr_matmul_buf_ = planner.get<DataType_>(buf_, ATTR_MATMUL_BUF);
+          inter_matmul_buf_ = planner.get<DataType_>(buf_, INTER_MATMUL_BUF);
         }
       }
 
@@ -532,6 +538,8 @@ public:
       //allocate buffer for attention_
       attention_->allocateBuffer(allocator, batch_size_, from_seq_len_, to_seq_len,
                                  head_num_, size_per_head_, hasChangedConfig, use_trt_kernel);
+      layernorm_variant_ = select_layernorm_variant<DataType_>(batch_size_ * from_seq_len_, head_num_ * size_per_head_,
+                                                               KernelVariantTable::instance().online_tuning());
     }
     catch (std::runtime_error &error)
     {
@@ -539,6 +547,14 @@ public:
     }  
   }
 
+  //resolve the kernel variants of the layer and its attention once, forward does no lookup
+  //tune == true times the variants missing from KERNEL_CONFIG, call it to warm up before serving
+  void select_kernel_variants(const bool tune)
+  {
+    layernorm_variant_ = select_layernorm_variant<DataType_>(batch_size_ * from_seq_len_, head_num_ * size_per_head_, tune);
+    attention_->select_kernel_variants(tune);
+  }
+
 
   BertEncoderTransformer(int int8_mode=0, bool allow_gemm_test=false) : 
     int8_mode_(int8_mode), allow_gemm_test_(allow_gemm_test)
@@ -832,7 +848,8 @@ public:
         add_bias_input_layernorm_kernelLauncher<DataType_>(attr_matmul_buf_,
                                                            param_.from_tensor, param_.self_attention.attention_output_weight.bias,
                                                            param_.self_layernorm.gamma,
-                                                           param_.self_layernorm.beta, m, n, param_.stream);
+                                                           param_.self_layernorm.beta, m, n, param_.stream,
+                                                           layernorm_variant_);
       
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -877,7 +894,7 @@ public:
                                                             param_.ffn.output_weight.bias,
                                                             param_.ffn_layernorm.gamma,
                                                             param_.ffn_layernorm.beta,
-                                                            m, n, param_.stream);
+                                                            m, n, param_.stream, layernorm_variant_);
                                                          
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Chunked prefill scheduler of the GPT-2 serving
+ *
+ * Every step runs a packed batch of at most token_budget tokens: one token of
+ * every decoding sequence first, then chunks of at most chunk_size prompt
+ * tokens of the sequences in prefill, the oldest first, and new sequences
+ * take the free KV cache slots while the budget lasts. A long prompt is spread
+ * over several steps, so the decoding sequences get a token every step and a
+ * step never exceeds the budget.
+ *
+ * The scheduler keeps the tokens of the sequences and builds the rows of the
+ * step (token, position and slot of every row) that Gpt2ChunkedServing runs.
+ * It does not depend on CUDA, StepCostModel estimates the time of a step to
+ * simulate a schedule on the host.
+ *
+ * The slots are kept by a KVSwapScheduler. With host_slot_num > 0, a sequence
+ * of higher priority that finds no free slot preempts the running sequence of
+ * the lowest priority: the plan of the step swaps its cache out to the host,
+ * and a later step swaps it back in and the sequence continues where it
+ * stopped. Gpt2ChunkedServing issues the copies before the rows of the step.
+ **/
+
+#pragma once
+#include "fastertransformer/kv_swap_scheduler.h"
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+struct ChunkedPrefillConfig
+{
+  int slot_num = 8;         // sequences in the KV cache at once
+  int token_budget = 256;   // tokens of a step, at least slot_num
+  int chunk_size = 64;      // prompt tokens of a sequence in a step
+  int max_seq_len = 1024;   // positions of a slot
+  int host_slot_num = 0;    // host slots of the preempted sequences, 0 disables the preemption
+};
+
+enum class ChunkedSequenceState{WAITING, PREFILL, DECODE, SWAPPED, FINISHED};
+
+struct ChunkedSequence
+{
+  std::vector<int> tokens;   // the prompt, then the generated tokens
+  int prompt_len;
+  int max_new_tokens;
+  int prefilled;             // prompt tokens in the cache
+  int generated;
+  int priority;              // a larger value is more important
+  int slot;
+  ChunkedSequenceState state;
+};
+
+/* the consecutive tokens of a sequence in a step, starting at position */
+struct StepEntry
+{
+  int seq_id;
+  int slot;
+  int position;
+  int token_num;
+  bool prefill;
+  bool sample;   // the last row gives the next token: a decode or the last chunk of the prompt
+};
+
+struct StepPlan
+{
+  std::vector<StepEntry> entries;
+  std::vector<int> row_ids;         // [token_num], the rows of the entries one after the other
+  std::vector<int> row_positions;
+  std::vector<int> row_slots;
+  std::vector<int> sample_rows;     // the rows to sample, in the order of the sampling entries
+  std::vector<SwapOp> swaps;        // the copies to issue before the rows, in order
+  int prefill_tokens = 0;
+  int decode_tokens = 0;
+  long long context_positions = 0;  // cached positions the rows attend to
+
+  int token_num() const { return (int)row_ids.size(); }
+  bool empty() const { return row_ids.empty() && swaps.empty(); }
+};
+
+/* time of a step: a fixed cost, a cost per row (the GEMMs) and per attended position */
+struct StepCostModel
+{
+  double step_ms = 2.0;
+  double token_ms = 0.02;
+  double context_ms = 0.00002;
+
+  double cost(const StepPlan &plan) const
+  {
+    return step_ms + token_ms * plan.token_num() + context_ms * plan.context_positions;
+  }
+};
+
+class ChunkedPrefillScheduler
+{
+private:
+  ChunkedPrefillConfig config_;
+  std::vector<ChunkedSequence> seqs_;
+  KVSwapScheduler slots_;       // the ids of its sequences are the ones of seqs_
+  std::vector<int> waiting_;    // ids of the waiting and swapped sequences
+  std::vector<int> running_;    // ids in admission order
+  int finished_num_;
+
+  ChunkedSequence &get(const int seq_id)
+  {
+    if (seq_id < 0 || seq_id >= (int)seqs_.size())
+    {
+      printf("[ERROR][ChunkedPrefillScheduler] sequence %d does not exist. \n", seq_id);
+      exit(-1);
+    }
+    return seqs_[seq_id];
+  }
+
+  void add_entry(StepPlan &plan, const int seq_id, const int token_num, const bool prefill)
+  {
+    const ChunkedSequence &seq = seqs_[seq_id];
+    StepEntry entry;
+    entry.seq_id = seq_id;
+    entry.slot = seq.slot;
+    entry.position = prefill ? seq.prefilled : seq.prompt_len + seq.generated - 1;
+    entry.token_num = token_num;
+    entry.prefill = prefill;
+    entry.sample = !prefill || seq.prefilled + token_num == seq.prompt_len;
+    for (int i = 0; i < token_num; i++)
+    {
+      plan.row_ids.push_back(seq.tokens[entry.position + i]);
+      plan.row_positions.push_back(entry.position + i);
+      plan.row_slots.push_back(seq.slot);
+    }
+    if (entry.sample)
+      plan.sample_rows.push_back(plan.token_num() - 1);
+    if (prefill)
+      plan.prefill_tokens += token_num;
+    else
+      plan.decode_tokens += token_num;
+    // the row at position p attends to the positions 0..p
+    plan.context_positions += (long long)token_num * entry.position + (long long)token_num * (token_num + 1) / 2;
+    plan.entries.push_back(entry);
+  }
+
+  /* the budget left by the rows of the running sequences, in the order schedule() adds them */
+  int left_budget() const
+  {
+    int budget = config_.token_budget;
+    for (size_t i = 0; i < running_.size(); i++)
+      budget -= seqs_[running_[i]].state == ChunkedSequenceState::DECODE;
+    for (size_t i = 0; i < running_.size() && budget > 0; i++)
+    {
+      const ChunkedSequence &seq = seqs_[running_[i]];
+      if (seq.state == ChunkedSequenceState::PREFILL)
+        budget -= std::min(std::min(config_.chunk_size, seq.prompt_len - seq.prefilled), budget);
+    }
+    return budget;
+  }
+
+  /* follow the ops of KVSwapScheduler::admit */
+  void apply_swaps(const std::vector<SwapOp> &ops, const size_t first)
+  {
+    for (size_t i = first; i < ops.size(); i++)
+    {
+      ChunkedSequence &seq = seqs_[ops[i].seq_id];
+      if (ops[i].type == SwapOpType::SWAP_OUT)
+      {
+        seq.state = ChunkedSequenceState::SWAPPED;
+        seq.slot = -1;
+        running_.erase(std::find(running_.begin(), running_.end(), ops[i].seq_id));
+        waiting_.push_back(ops[i].seq_id);
+      }
+      else
+      {
+        // a swapped sequence continues its prompt or its decode
+        seq.state = seq.prefilled < seq.prompt_len ? ChunkedSequenceState::PREFILL : ChunkedSequenceState::DECODE;
+        seq.slot = ops[i].device_slot;
+        waiting_.erase(std::find(waiting_.begin(), waiting_.end(), ops[i].seq_id));
+        running_.push_back(ops[i].seq_id);
+      }
+    }
+  }
+
+public:
+  explicit ChunkedPrefillScheduler(const ChunkedPrefillConfig &config) : config_(config),
+                                                                          slots_(std::max(config.slot_num, 1),
+                                                                                 std::max(config.host_slot_num, 0)),
+                                                                          finished_num_(0)
+  {
+    if (config.slot_num <= 0 || config.chunk_size <= 0 || config.max_seq_len <= 0 ||
+        config.token_budget < config.slot_num || config.host_slot_num < 0)
+    {
+      printf("[ERROR][ChunkedPrefillScheduler] invalid config (slot_num %d, token_budget %d, chunk_size %d, max_seq_len %d, "
+             "host_slot_num %d), the budget should hold a decode token of every slot. \n",
+             config.slot_num, config.token_budget, config.chunk_size, config.max_seq_len, config.host_slot_num);
+      exit(-1);
+    }
+  }
+
+  const ChunkedPrefillConfig &config() const { return config_; }
+
+  /* return the id of the sequence, it waits for a slot */
+  int add_sequence(const int *prompt, const int prompt_len, const int max_new_tokens, const int priority = 0)
+  {
+    if (prompt_len <= 0 || max_new_tokens <= 0 || prompt_len + max_new_tokens > config_.max_seq_len)
+    {
+      printf("[ERROR][ChunkedPrefillScheduler] prompt_len %d + max_new_tokens %d should be in [2, %d]. \n",
+             prompt_len, max_new_tokens, config_.max_seq_len);
+      exit(-1);
+    }
+    ChunkedSequence seq;
+    seq.tokens.assign(prompt, prompt + prompt_len);
+    seq.prompt_len = prompt_len;
+    seq.max_new_tokens = max_new_tokens;
+    seq.prefilled = 0;
+    seq.generated = 0;
+    seq.priority = priority;
+    seq.slot = -1;
+    seq.state = ChunkedSequenceState::WAITING;
+    seqs_.push_back(seq);
+    slots_.add_sequence(priority, prompt_len + max_new_tokens);
+    waiting_.push_back((int)seqs_.size() - 1);
+    return (int)seqs_.size() - 1;
+  }
+
+  const ChunkedSequence &sequence(const int seq_id) { return get(seq_id); }
+
+  int sequence_num() const { return (int)seqs_.size(); }
+
+  bool idle() const { return waiting_.empty() && running_.empty(); }
+
+  int running_num() const { return (int)running_.size(); }
+
+  int waiting_num() const { return (int)waiting_.size(); }
+
+  const SwapStats &swap_stats() const { return slots_.stats(); }
+
+  /* the swaps and the rows of the next step, empty if there is nothing to run */
+  StepPlan schedule()
+  {
+    StepPlan plan;
+    // admit new sequences only when their first chunk runs in this step, a preempted sequence
+    // leaves the step before its rows are added
+    while (left_budget() > 0)
+    {
+      const size_t first = plan.swaps.size();
+      if (!slots_.admit(plan.swaps))
+        break;
+      apply_swaps(plan.swaps, first);
+    }
+
+    int budget = config_.token_budget;
+    // the decoding sequences first, they are never delayed by a prompt
+    for (size_t i = 0; i < running_.size(); i++)
+    {
+      if (seqs_[running_[i]].state == ChunkedSequenceState::DECODE)
+      {
+        add_entry(plan, running_[i], 1, false);
+        budget--;
+      }
+    }
+    for (size_t i = 0; i < running_.size() && budget > 0; i++)
+    {
+      const ChunkedSequence &seq = seqs_[running_[i]];
+      if (seq.state != ChunkedSequenceState::PREFILL)
+        continue;
+      const int chunk = std::min(std::min(config_.chunk_size, seq.prompt_len - seq.prefilled), budget);
+      add_entry(plan, running_[i], chunk, true);
+      budget -= chunk;
+    }
+    return plan;
+  }
+
+  /* After the step ran: sampled_ids [plan.sample_rows.size()] are the next tokens. A sequence
+     finishes at end_id or at max_new_tokens and frees its slot. Return the finished ids. */
+  std::vector<int> complete(const StepPlan &plan, const int *sampled_ids, const int end_id)
+  {
+    std::vector<int> finished;
+    int sample = 0;
+    for (size_t i = 0; i < plan.entries.size(); i++)
+    {
+      const StepEntry &entry = plan.entries[i];
+      ChunkedSequence &seq = get(entry.seq_id);
+      slots_.advance(entry.seq_id, entry.token_num);
+      if (entry.prefill)
+        seq.prefilled += entry.token_num;
+      if (!entry.sample)
+        continue;
+      const int token = sampled_ids[sample++];
+      seq.tokens.push_back(token);
+      seq.generated++;
+      seq.state = ChunkedSequenceState::DECODE;
+      if (token == end_id || seq.generated == seq.max_new_tokens)
+      {
+        seq.state = ChunkedSequenceState::FINISHED;
+        slots_.finish(entry.seq_id);
+        seq.slot = -1;
+        running_.erase(std::find(running_.begin(), running_.end(), entry.seq_id));
+        finished_num_++;
+        finished.push_back(entry.seq_id);
+      }
+    }
+    return finished;
+  }
+
+  int finished_num() const { return finished_num_; }
+};
+
+} // namespace fastertransformer
@@ -42,6 +42,16 @@ struct FFNWeight{
     DenseWeight<T> output_weight;
 };
 
+/* Weights of a mixture-of-experts FFN.
+   gating_weight.kernel is [hidden_units, expert_num], gating_weight.bias is optional.
+   The kernels/biases of experts are stacked along the first dimension, e.g.
+   experts.intermediate_weight.kernel is [expert_num, hidden_units, inner_size]. */
+template<typename T>
+struct MoEFFNWeight{
+    DenseWeight<T> gating_weight;
+    FFNWeight<T> experts;
+};
+
 namespace fastertransformer{
 
 enum class ActivationType{RELU, GELU};
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/cuda/constraint_kernels.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include "cub/cub.cuh"
+#include <float.h>
+#include <type_traits>
+
+namespace fastertransformer
+{
+
+#define CONSTRAINT_BLOCK_SIZE 256
+
+/* grid (m, blocks per row), a thread reads one 32 bit word of the bitset for 32 tokens */
+template <typename T>
+__global__
+void apply_token_constraint_kernel(T* logits, const int* states, const TokenConstraintTable table,
+                                   const bool* finished, const int n)
+{
+  const bool IS_FP16 = std::is_same<T, half>::value;
+  const T MAX_T_VAL = (IS_FP16)? HALF_FLT_MAX : 1e20f;
+  const int row = blockIdx.x;
+  const int state = states[row];
+  const bool dead = state == TOKEN_AUTOMATON_DEAD_STATE;
+  if((!dead && (state < 0 || state >= table.num_states)) || (finished != nullptr && finished[row]))
+    return;
+
+  const unsigned int* bits = table.allowed_bits + (size_t)(dead ? 0 : state) * table.words_per_state;
+  T* row_logits = logits + (size_t)row * n;
+  const int words = (n + 31) / 32;
+  for(int word = blockIdx.y * blockDim.x + threadIdx.x; word < words; word += gridDim.y * blockDim.x)
+  {
+    unsigned int allowed;
+    if(dead)
+      allowed = word == (table.end_id >> 5) ? 1u << (table.end_id & 31) : 0u;
+    else
+      allowed = word < table.words_per_state ? __ldg(&bits[word]) : 0u;
+    if(allowed == 0xffffffffu)
+      continue;
+    const int end = min(n, (word + 1) * 32);
+    for(int id = word * 32; id < end; id++)
+    {
+      if(id >= table.vocab_size || ((allowed >> (id & 31)) & 1u) == 0)
+        row_logits[id] = -MAX_T_VAL;
+    }
+  }
+}
+
+template <typename T>
+void apply_token_constraint_kernelLauncher(T* logits, const int* states, const TokenConstraintTable table,
+                                           const bool* finished, const int m, const int n,
+                                           cudaStream_t stream)
+{
+  const int words = (n + 31) / 32;
+  dim3 grid(m, min((words + CONSTRAINT_BLOCK_SIZE - 1) / CONSTRAINT_BLOCK_SIZE, 8));
+  dim3 block(CONSTRAINT_BLOCK_SIZE);
+  apply_token_constraint_kernel<T><<<grid, block, 0, stream>>>(logits, states, table, finished, n);
+}
+
+/* binary search of the token in the sorted transitions of the state */
+__device__ __forceinline__
+int next_token_constraint_state(const TokenConstraintTable& table, const int state, const int token)
+{
+  if(state < 0 || state >= table.num_states || token == table.end_id)
+    return state;
+  int low = table.offsets[state], high = table.offsets[state + 1];
+  while(low < high)
+  {
+    const int mid = (low + high) >> 1;
+    if(table.tokens[mid] < token)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if(low < table.offsets[state + 1] && table.tokens[low] == token)
+    return table.next_states[low];
+  return TOKEN_AUTOMATON_DEAD_STATE;
+}
+
+/* one block, the new states are written after all the old ones are read since the
+   beam search reorders the rows */
+__global__
+void advance_token_constraint_kernel(int* states, const int* ids, const int* parent_ids,
+                                     const TokenConstraintTable table, const int m)
+{
+  extern __shared__ int s_states[];
+  for(int i = threadIdx.x; i < m; i += blockDim.x)
+    s_states[i] = next_token_constraint_state(table, states[parent_ids != nullptr ? parent_ids[i] : i], ids[i]);
+  __syncthreads();
+  for(int i = threadIdx.x; i < m; i += blockDim.x)
+    states[i] = s_states[i];
+}
+
+void advance_token_constraint_kernelLauncher(int* states, const int* ids, const int* parent_ids,
+                                             const TokenConstraintTable table, const int m,
+                                             cudaStream_t stream)
+{
+  dim3 block(min(m, 1024));
+  advance_token_constraint_kernel<<<1, block, sizeof(int) * m, stream>>>(states, ids, parent_ids, table, m);
+}
+
+/* one thread per row walks all the tokens of the prompt */
+__global__
+void advance_token_constraint_prompt_kernel(int* states, const int* ids, const TokenConstraintTable table,
+                                            const int m, const int length)
+{
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  if(row >= m)
+    return;
+  int state = states[row];
+  for(int i = 0; i < length && state >= 0; i++)
+    state = next_token_constraint_state(table, state, ids[i * m + row]);
+  states[row] = state;
+}
+
+void advance_token_constraint_prompt_kernelLauncher(int* states, const int* ids, const TokenConstraintTable table,
+                                                    const int m, const int length, cudaStream_t stream)
+{
+  dim3 block(min(m, CONSTRAINT_BLOCK_SIZE));
+  dim3 grid((m + block.x - 1) / block.x);
+  advance_token_constraint_prompt_kernel<<<grid, block, 0, stream>>>(states, ids, table, m, length);
+}
+
+template void apply_token_constraint_kernelLauncher(float* logits, const int* states, const TokenConstraintTable table,
+                                                    const bool* finished, const int m, const int n,
+                                                    cudaStream_t stream);
+
+template void apply_token_constraint_kernelLauncher(half* logits, const int* states, const TokenConstraintTable table,
+                                                    const bool* finished, const int m, const int n,
+                                                    cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Kernels of the constrained decoding
+ *
+ * Every row of the decoding carries the state of a token automaton compiled by
+ * TokenAutomaton::compile(), or -1 if it is not constrained. Before the
+ * top-k / top-p sampling or the beam search, the logits of the tokens that the
+ * state does not allow are masked. After it, the state advances with the chosen
+ * token, a token without transition leads to TOKEN_AUTOMATON_DEAD_STATE and
+ * the row can then only finish. Both stay on the device, no logits go back to
+ * the host.
+ **/
+
+#pragma once
+#include "fastertransformer/token_automaton.h"
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+
+namespace fastertransformer
+{
+
+/* device copy of a TokenAutomatonTable, see TokenConstraint */
+struct TokenConstraintTable
+{
+  const unsigned int* allowed_bits = nullptr;  // [num_states, words_per_state]
+  const int* offsets = nullptr;                // [num_states + 1]
+  const int* tokens = nullptr;                 // sorted in each state
+  const int* next_states = nullptr;
+  int num_states = 0;
+  int words_per_state = 0;
+  int vocab_size = 0;
+  int end_id = 0;
+};
+
+/* logits is [m, n], n can be a padded vocabulary. The logits of the tokens that states[i]
+   does not allow (all the tokens >= table.vocab_size) are set to -MAX, a dead row keeps
+   end_id only. A row is skipped if its state is -1 or it is finished (finished can be
+   nullptr). */
+template <typename T>
+void apply_token_constraint_kernelLauncher(T* logits, const int* states, const TokenConstraintTable table,
+                                           const bool* finished, const int m, const int n,
+                                           cudaStream_t stream);
+
+/* states[i] = next(states[parent_ids[i]], ids[i]) for the m rows, parent_ids is nullptr when
+   the rows are not reordered (sampling) and the row index of the beam search otherwise.
+   A negative state (-1 or dead) stays as it is, end_id keeps the state and any other token
+   without transition leads to the dead state. */
+void advance_token_constraint_kernelLauncher(int* states, const int* ids, const int* parent_ids,
+                                             const TokenConstraintTable table, const int m,
+                                             cudaStream_t stream);
+
+/* advance the m states over the tokens of a prompt, ids is [length, m] */
+void advance_token_constraint_prompt_kernelLauncher(int* states, const int* ids, const TokenConstraintTable table,
+                                                    const int m, const int length, cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -17,6 +17,8 @@
 #include "fastertransformer/common.h"
 
 #include "cuda_kernels.h"
+#include "layernorm_kernels.h"
+#include "kernel_tuner.h"
 #include <assert.h>
 #include <cstdio>
 #include <cstdlib>
@@ -344,37 +346,116 @@ void add_bias_input_layernorm_v2(half* out, const half* __restrict input, const
 template <typename T>
 void add_bias_act_kernelLauncher(T* out, const T* bias, int m, int n, cudaStream_t stream)
 {
+  // add_bias_act needs n / 4 threads per block, the other sizes use the generic kernel
+  if(n % 4 != 0 || n / 4 > 1024)
+  {
+    add_bias_act_generic_kernelLauncher<T>(out, bias, m, n, ActivationType::GELU, stream);
+    return;
+  }
   dim3 grid(ceil(m / 4.));
   dim3 block(n / 4);
-  assert(block.x <= 1024);
   add_bias_act<T><<<grid, block, 0, stream>>>(out, bias, m, n);
 }
 
-template<typename T>
-void add_bias_input_layernorm_kernelLauncher(T* out, const T* input, const T* bias, 
-  const T* gamma, const T* beta, int m, int n, cudaStream_t stream)
+/* variants of add_bias_input_layernorm_kernelLauncher, see register_layernorm_variants */
+#define LAYERNORM_VARIANT_V1 0       // one float (half2) per thread
+#define LAYERNORM_VARIANT_V2 1       // four floats (half2) per thread
+#define LAYERNORM_VARIANT_GENERIC 2  // layernorm_kernels.h
+#define LAYERNORM_VARIANT_NUM 3
+
+template <typename T>
+bool layernorm_variant_supported(const int variant, const int n)
 {
-  dim3 grid(m);
-  dim3 block(n);
-  assert(n <= 1024);
+  // floats or half2 of a row, the blocks should be multiples of 32 threads
+  const int units = n / (4 / sizeof(T));
+  if(n % (4 / sizeof(T)) != 0 && variant != LAYERNORM_VARIANT_GENERIC)
+    return false;
+  if(variant == LAYERNORM_VARIANT_V1)
+    return units % 32 == 0 && units <= 1024;
+  if(variant == LAYERNORM_VARIANT_V2)
+    return units % 128 == 0 && units / 4 <= 1024;
+  return variant == LAYERNORM_VARIANT_GENERIC;
+}
+
+/* the choice before the variants were tuned */
+template <typename T>
+int layernorm_default_variant(const int m, const int n)
+{
+  const bool is_fp16 = sizeof(T) == sizeof(half);
   if(n == 768 || n == 1024)
-    add_bias_input_layernorm_v2<T><<<grid, n / 4, 0, stream>>>(out, input, bias, gamma, beta, n);
-  else
-    add_bias_input_layernorm<T><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, m, n);
+    return !is_fp16 || m >= 512 ? LAYERNORM_VARIANT_V2 : LAYERNORM_VARIANT_V1;
+  return LAYERNORM_VARIANT_GENERIC;
 }
 
-template <>
-void add_bias_input_layernorm_kernelLauncher(half* out, const half* input, const half* bias, 
-  const half* gamma, const half* beta, int m, int n, cudaStream_t stream)
+template <typename T>
+void add_bias_input_layernorm_variant(const int variant, T* out, const T* input, const T* bias,
+  const T* gamma, const T* beta, int m, int n, cudaStream_t stream)
 {
   dim3 grid(m);
-  dim3 block(n / 2);
-  assert(n / 2 <= 1024);
-  
-  if(m >= 512 && (n == 768 || n == 1024))
-    add_bias_input_layernorm_v2<half><<<grid, n / 8, 0, stream>>>(out, input, bias, gamma, beta, n);
+  const int units = n / (4 / sizeof(T));
+  if(variant == LAYERNORM_VARIANT_V1)
+    add_bias_input_layernorm<T><<<grid, units, 0, stream>>>(out, input, bias, gamma, beta, m, n);
+  else if(variant == LAYERNORM_VARIANT_V2)
+    add_bias_input_layernorm_v2<T><<<grid, units / 4, 0, stream>>>(out, input, bias, gamma, beta, n);
   else
-    add_bias_input_layernorm<half><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, m, n);
+    add_bias_input_layernorm_generic_kernelLauncher<T>(out, input, bias, gamma, beta, m, n, stream);
+}
+
+template <typename T>
+float layernorm_variant_time(const int variant, const int m, const int n)
+{
+  if(!layernorm_variant_supported<T>(variant, n))
+    return -1.0f;
+  KernelBenchmarkBuffer buf(sizeof(T) * (2 * (size_t)m * n + 3 * n) + 16 * 5);
+  T* out = buf.take<T>((size_t)m * n);
+  T* input = buf.take<T>((size_t)m * n);
+  T* bias = buf.take<T>(n);
+  T* gamma = buf.take<T>(n);
+  T* beta = buf.take<T>(n);
+  cudaStream_t stream;
+  check_cuda_error(cudaStreamCreate(&stream));
+  const float time = time_kernel_variant([&]() {
+    add_bias_input_layernorm_variant<T>(variant, out, input, bias, gamma, beta, m, n, stream);
+  }, stream);
+  check_cuda_error(cudaStreamDestroy(stream));
+  return time;
+}
+
+float layernorm_variant_benchmark(const int variant, const KernelShape& shape, const int is_fp16)
+{
+  return is_fp16 ? layernorm_variant_time<half>(variant, shape.d0, shape.d1) :
+                   layernorm_variant_time<float>(variant, shape.d0, shape.d1);
+}
+
+bool layernorm_variant_support(const int variant, const KernelShape& shape, const int is_fp16)
+{
+  return is_fp16 ? layernorm_variant_supported<half>(variant, shape.d1) :
+                   layernorm_variant_supported<float>(variant, shape.d1);
+}
+
+bool register_layernorm_variants()
+{
+  KernelVariantTable::instance().register_kernel("layernorm", LAYERNORM_VARIANT_NUM, layernorm_variant_benchmark,
+                                                 layernorm_variant_support);
+  return true;
+}
+
+template<typename T>
+int select_layernorm_variant(const int m, const int n, const bool tune)
+{
+  static const bool registered = register_layernorm_variants();
+  (void)registered;
+  return select_kernel_variant("layernorm", sizeof(T) == sizeof(half), KernelShape(kernel_shape_bucket(m), n),
+                               layernorm_default_variant<T>(m, n), tune);
+}
+
+template<typename T>
+void add_bias_input_layernorm_kernelLauncher(T* out, const T* input, const T* bias, 
+  const T* gamma, const T* beta, int m, int n, cudaStream_t stream, const int variant)
+{
+  // the variant is selected for the largest m of the op, it should still support n
+  const int v = variant >= 0 && layernorm_variant_supported<T>(variant, n) ? variant : layernorm_default_variant<T>(m, n);
+  add_bias_input_layernorm_variant<T>(v, out, input, bias, gamma, beta, m, n, stream);
 }
 
 template <typename T>
@@ -642,14 +723,18 @@ template void add_bias_act_kernelLauncher<float>(
 
 template void add_bias_input_layernorm_kernelLauncher<float>(
   float* out, const float* input, const float* bias, const float* gamma, const float* beta, 
-  int m, int n, cudaStream_t stream);
+  int m, int n, cudaStream_t stream, const int variant);
+
+template int select_layernorm_variant<float>(const int m, const int n, const bool tune);
 
 template void add_bias_act_kernelLauncher<half>(
   half* out, const half* bias, int m, int n, cudaStream_t stream);
 
 template void add_bias_input_layernorm_kernelLauncher<half>(
   half* out, const half* input, const half* bias, const half* gamma, const half* beta, 
-  int m, int n, cudaStream_t stream);
+  int m, int n, cudaStream_t stream, const int variant);
+
+template int select_layernorm_variant<half>(const int m, const int n, const bool tune);
 
 /* *********************************** Debug tools *********************************** */
 
@@ -36,11 +36,22 @@ void init_kernelLauncher(bool* finished, int* sequence_length, int* word_ids,
 template <typename T>
 void add_bias_act_kernelLauncher(T* out, const T* bias, int m, int n, cudaStream_t stream);
 
+/* variant comes from select_layernorm_variant, -1 (or a variant that does not support n) runs
+   the default one without a lookup */
 template <typename T>
 void add_bias_input_layernorm_kernelLauncher(T *out, const T *input_tensor,
                                              const T *bias, const T *gamma,
                                              const T *beta, int m, int n,
-                                             cudaStream_t stream);
+                                             cudaStream_t stream, const int variant = -1);
+
+/* Registers the variants of add_bias_input_layernorm_kernelLauncher in KernelVariantTable as
+   "layernorm", the shape is (m rounded up to a power of 2, n). select_layernorm_variant calls it once. */
+bool register_layernorm_variants();
+
+/* the variant of add_bias_input_layernorm_kernelLauncher for (m, n), tune times it on a miss.
+   An op calls it when it is built, not once per launch. */
+template <typename T>
+int select_layernorm_variant(const int m, const int n, const bool tune);
 
 template <typename T>
 void embedding_lookup_sine_position_encoding_kernel_launcher(T *from_tensor,
@@ -79,6 +90,40 @@ void apply_temperature_penalty_kernelLauncher(T* logits,
                                               const int n,
                                               cudaStream_t stream);
 
+/* logits are [m, n_padded], the columns n..n_padded-1 are masked to -inf */
+template <typename T>
+void apply_temperature_penalty_kernelLauncher(T* logits,
+                                              const T temperature,
+                                              const int m,
+                                              const int n,
+                                              const int n_padded,
+                                              cudaStream_t stream);
+
+template <typename T>
+void transpose_pad_embedding_kernelLauncher(T* out,
+                                            const T* in,
+                                            const int n,
+                                            const int n_padded,
+                                            const int hidden_units,
+                                            cudaStream_t stream);
+
+/* [hidden_units, n] to [hidden_units, n_padded], the padded columns are 0 */
+template <typename T>
+void pad_embedding_kernelLauncher(T* out,
+                                  const T* in,
+                                  const int n,
+                                  const int n_padded,
+                                  const int hidden_units,
+                                  cudaStream_t stream);
+
+/* in (nullptr for no bias) padded to n_padded with the lowest value of T */
+template <typename T>
+void pad_embedding_bias_kernelLauncher(T* out,
+                                       const T* in,
+                                       const int n,
+                                       const int n_padded,
+                                       cudaStream_t stream);
+
 template <typename T>
 void transpose(T *out, const T *in, int batch, 
                int height, int width, int stride, cudaStream_t stream);
@@ -135,8 +180,89 @@ void gather_tree_kernel_launcher(int max_time, int batch_size, int beam_width,
                                   int* step_ids, int* parent_ids, int* max_sequence_lengths,
                                   int end_token, int* beams, cudaStream_t stream);
 
+/* log prob of the token chosen at this step: cum_log_probs[i] - prev_cum_log_probs[parent_ids[i]] */
+void update_step_log_probs_kernelLauncher(const float* cum_log_probs, const float* prev_cum_log_probs,
+                                          const int* parent_ids, float* step_log_probs,
+                                          const int batch_size, const int beam_width,
+                                          cudaStream_t stream);
+
+/* Backtrack every beam after max_time steps, and write the hypotheses of each sentence
+   sorted by cum_log_prob / length^length_penalty. */
+void beam_search_nbest_kernelLauncher(const int* output_ids, const int* parent_ids,
+                                      const float* step_log_probs,
+                                      int* nbest_ids, float* nbest_log_probs,
+                                      float* nbest_cum_log_probs, float* nbest_normed_scores,
+                                      int* nbest_lengths,
+                                      const int max_time, const int batch_size,
+                                      const int beam_width, const int seq_len,
+                                      const int end_id, const float length_penalty,
+                                      cudaStream_t stream);
+
+/* tile the encoder output [batch_size, mem_max_seq_len, hidden_units] to the beams */
+template <typename T>
+void tile_encoder_output_kernelLauncher(const T* encoder_output, const int* sequence_length,
+                                        T* memory_tensor, int* memory_sequence_length,
+                                        const int batch_size, const int beam_width,
+                                        const int mem_max_seq_len, const int hidden_units,
+                                        cudaStream_t stream);
+
 /* *************************** end of BeamSearch kernel *********************************** */
 
+/* ********************************** Scoring kernel *********************************** */
+
+/* embedding of the teacher-forced inputs [batch_size, seq_len], start_id followed by target_ids[:, :-1] */
+template <typename T>
+void teacher_forcing_embedding_kernel_launcher(T* from_tensor,
+                                               const T* embedding_table,
+                                               const T* position_encoding_table,
+                                               const int* target_ids,
+                                               const int batch_size,
+                                               const int seq_len,
+                                               const int hidden_units,
+                                               const int start_id,
+                                               cudaStream_t stream);
+
+/* embedding of the rows of a multi-token decoder pass, row r is word_ids[r] at positions[r] */
+template <typename T>
+void multi_token_embedding_kernel_launcher(T* from_tensor,
+                                           const T* embedding_table,
+                                           const T* position_encoding_table,
+                                           const int* word_ids,
+                                           const int* positions,
+                                           const int rows,
+                                           const int hidden_units,
+                                           cudaStream_t stream);
+
+/* embedding of the packed rows of GPT-2, row r is word_ids[r] at positions[r] */
+template <typename T>
+void packed_embedding_position_lookups_kernel_launcher(T* from_tensor,
+                                                       const T* embedding_table,
+                                                       const T* pos_table,
+                                                       const int* word_ids,
+                                                       const int* positions,
+                                                       const int rows,
+                                                       const int hidden_units,
+                                                       cudaStream_t stream);
+
+/* dst [row_num, hidden_units] = the rows of src */
+template <typename T>
+void gather_rows_kernelLauncher(T* dst, const T* src, const int* rows, const int row_num, const int hidden_units,
+                                cudaStream_t stream);
+
+/* ids[i] = argmax(logits[i] + bias), bias can be nullptr */
+template <typename T>
+void greedy_ids_kernelLauncher(const T* logits, const T* bias, int* ids, const int m, const int n, cudaStream_t stream);
+
+/* log_probs[b, t] = log_softmax(logits[b, t] + bias)[target_ids[b, t]], 0 after target_length[b].
+   cum_log_probs can be nullptr. */
+void target_log_probs_kernelLauncher(const float* logits, const float* bias,
+                                     const int* target_ids, const int* target_length,
+                                     float* log_probs, float* cum_log_probs,
+                                     const int batch_size, const int seq_len, const int vocab_size,
+                                     cudaStream_t stream);
+
+/* *************************** end of Scoring kernel *********************************** */
+
 /* ********************************** Sampling kernel *********************************** */
 
 template <typename T>
@@ -154,6 +280,15 @@ void sampling_init_kernelLauncher(bool* finished,
                                   const int start_id, 
                                   const int batch_size, 
                                   cudaStream_t stream);
+
+/* After the sampling of a step, ids is [m]: a finished row emits end_id, the others count the
+   token in sequence_length (can be nullptr) and are finished by end_id. For the decodings whose
+   sampling kernels do not track the finished rows. */
+void update_finished_kernelLauncher(bool* finished, int* sequence_length, int* ids,
+                                    const int end_id, const int m, cudaStream_t stream);
+
+/* ids[0, n) = id */
+void set_ids_kernelLauncher(int* ids, const int id, const int n, cudaStream_t stream);
                                 
 void topp_initialization_kernelLauncher(bool* finished,
                                         int* sequence_length, 
@@ -15,6 +15,9 @@ limitations under the License.
 */
 
 #include "decoding_kernel_check.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
 
 namespace fastertransformer
 {
@@ -434,4 +437,878 @@ void update_kernel_check(float *log_probs, float *cum_log_probs, int *ids, bool
     printf("[INFO] decoding update check finish. \n");
 }
 
-} // end of namespace fastertransformer
\ No newline at end of file
+void beam_search_nbest_kernel_check(const int *output_ids, const int *parent_ids, const float *step_log_probs,
+                                    int *nbest_ids, float *nbest_log_probs, float *nbest_cum_log_probs, float *nbest_normed_scores, int *nbest_lengths,
+                                    const int max_time, const int batch_size, const int beam_width, const int seq_len,
+                                    const int end_id, const float length_penalty, cudaStream_t stream)
+{
+    printf("[INFO] decoding beam search n-best check. \n");
+    const int m = batch_size * beam_width;
+    int *h_output_ids = new int[max_time * m];
+    int *h_parent_ids = new int[max_time * m];
+    float *h_step_log_probs = new float[max_time * m];
+
+    check_cuda_error(cudaMemcpy(h_output_ids, output_ids, sizeof(int) * max_time * m, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_parent_ids, parent_ids, sizeof(int) * max_time * m, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_step_log_probs, step_log_probs, sizeof(float) * max_time * m, cudaMemcpyDeviceToHost));
+
+    beam_search_nbest_kernelLauncher(output_ids, parent_ids, step_log_probs, nbest_ids, nbest_log_probs,
+                                     nbest_cum_log_probs, nbest_normed_scores, nbest_lengths,
+                                     max_time, batch_size, beam_width, seq_len, end_id, length_penalty, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+
+    int *h_nbest_ids = new int[m * seq_len];
+    float *h_nbest_log_probs = new float[m * seq_len];
+    float *h_nbest_cum_log_probs = new float[m];
+    float *h_nbest_normed_scores = new float[m];
+    int *h_nbest_lengths = new int[m];
+    check_cuda_error(cudaMemcpy(h_nbest_ids, nbest_ids, sizeof(int) * m * seq_len, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_nbest_log_probs, nbest_log_probs, sizeof(float) * m * seq_len, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_nbest_cum_log_probs, nbest_cum_log_probs, sizeof(float) * m, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_nbest_normed_scores, nbest_normed_scores, sizeof(float) * m, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_nbest_lengths, nbest_lengths, sizeof(int) * m, cudaMemcpyDeviceToHost));
+
+    int *ids_cpu = new int[m * seq_len];
+    float *log_probs_cpu = new float[m * seq_len];
+    float *cum_log_probs_cpu = new float[m];
+    float *normed_scores_cpu = new float[m];
+    int *lengths_cpu = new int[m];
+
+    for (int b = 0; b < batch_size; b++)
+    {
+        // backtrack every beam from the last step
+        for (int beam = 0; beam < beam_width; beam++)
+        {
+            const int row = b * beam_width + beam;
+            int cur = beam;
+            for (int t = max_time - 1; t >= 0; t--)
+            {
+                ids_cpu[row * seq_len + t] = h_output_ids[t * m + b * beam_width + cur];
+                log_probs_cpu[row * seq_len + t] = h_step_log_probs[t * m + b * beam_width + cur];
+                cur = h_parent_ids[t * m + b * beam_width + cur] % beam_width;
+            }
+            int length = max_time;
+            for (int t = 0; t < max_time; t++)
+            {
+                if (ids_cpu[row * seq_len + t] == end_id)
+                {
+                    length = t + 1;
+                    break;
+                }
+            }
+            float cum_log_prob = 0.0f;
+            for (int t = 0; t < seq_len; t++)
+            {
+                if (t < length)
+                    cum_log_prob += log_probs_cpu[row * seq_len + t];
+                else
+                {
+                    ids_cpu[row * seq_len + t] = end_id;
+                    log_probs_cpu[row * seq_len + t] = 0.0f;
+                }
+            }
+            lengths_cpu[row] = length;
+            cum_log_probs_cpu[row] = cum_log_prob;
+            normed_scores_cpu[row] = cum_log_prob / powf((float)length, length_penalty);
+        }
+
+        // sort the beams by the normalized score, ties keep the beam order
+        for (int beam = 0; beam < beam_width; beam++)
+        {
+            const int row = b * beam_width + beam;
+            int rank = 0;
+            for (int i = 0; i < beam_width; i++)
+            {
+                const float other = normed_scores_cpu[b * beam_width + i];
+                if (other > normed_scores_cpu[row] || (other == normed_scores_cpu[row] && i < beam))
+                    rank++;
+            }
+            const int out = b * beam_width + rank;
+            if (h_nbest_lengths[out] != lengths_cpu[row])
+            {
+                printf("[ERROR] n-best length fail on batch %d rank %d with %d vs %d. \n",
+                       b, rank, lengths_cpu[row], h_nbest_lengths[out]);
+                exit(-1);
+            }
+            if (fabs(h_nbest_cum_log_probs[out] - cum_log_probs_cpu[row]) > 1e-4 ||
+                fabs(h_nbest_normed_scores[out] - normed_scores_cpu[row]) > 1e-4)
+            {
+                printf("[ERROR] n-best score fail on batch %d rank %d with (%f, %f) vs (%f, %f). \n",
+                       b, rank, cum_log_probs_cpu[row], normed_scores_cpu[row],
+                       h_nbest_cum_log_probs[out], h_nbest_normed_scores[out]);
+                exit(-1);
+            }
+            for (int t = 0; t < seq_len; t++)
+            {
+                if (h_nbest_ids[out * seq_len + t] != ids_cpu[row * seq_len + t] ||
+                    fabs(h_nbest_log_probs[out * seq_len + t] - log_probs_cpu[row * seq_len + t]) > 1e-5)
+                {
+                    printf("[ERROR] n-best token fail on batch %d rank %d step %d with (%d, %f) vs (%d, %f). \n",
+                           b, rank, t, ids_cpu[row * seq_len + t], log_probs_cpu[row * seq_len + t],
+                           h_nbest_ids[out * seq_len + t], h_nbest_log_probs[out * seq_len + t]);
+                    exit(-1);
+                }
+            }
+        }
+    }
+
+    delete[] h_output_ids;
+    delete[] h_parent_ids;
+    delete[] h_step_log_probs;
+    delete[] h_nbest_ids;
+    delete[] h_nbest_log_probs;
+    delete[] h_nbest_cum_log_probs;
+    delete[] h_nbest_normed_scores;
+    delete[] h_nbest_lengths;
+    delete[] ids_cpu;
+    delete[] log_probs_cpu;
+    delete[] cum_log_probs_cpu;
+    delete[] normed_scores_cpu;
+    delete[] lengths_cpu;
+    printf("[INFO] decoding beam search n-best check finish. \n");
+}
+
+void target_log_probs_kernel_check(const float *logits, const float *bias, const int *target_ids, const int *target_length,
+                                   float *log_probs, float *cum_log_probs, const int batch_size, const int seq_len, const int vocab_size, cudaStream_t stream)
+{
+    printf("[INFO] decoding target log probs check. \n");
+    const int rows = batch_size * seq_len;
+    float *h_logits = new float[rows * vocab_size];
+    float *h_bias = new float[vocab_size];
+    int *h_target_ids = new int[rows];
+    int *h_target_length = new int[batch_size];
+    float *h_log_probs = new float[rows];
+    float *h_cum_log_probs = new float[batch_size];
+
+    check_cuda_error(cudaMemcpy(h_logits, logits, sizeof(float) * rows * vocab_size, cudaMemcpyDeviceToHost));
+    if (bias != nullptr)
+        check_cuda_error(cudaMemcpy(h_bias, bias, sizeof(float) * vocab_size, cudaMemcpyDeviceToHost));
+    else
+        memset(h_bias, 0, sizeof(float) * vocab_size);
+    check_cuda_error(cudaMemcpy(h_target_ids, target_ids, sizeof(int) * rows, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_target_length, target_length, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+
+    target_log_probs_kernelLauncher(logits, bias, target_ids, target_length, log_probs, cum_log_probs,
+                                    batch_size, seq_len, vocab_size, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    check_cuda_error(cudaMemcpy(h_log_probs, log_probs, sizeof(float) * rows, cudaMemcpyDeviceToHost));
+    if (cum_log_probs != nullptr)
+        check_cuda_error(cudaMemcpy(h_cum_log_probs, cum_log_probs, sizeof(float) * batch_size, cudaMemcpyDeviceToHost));
+
+    for (int b = 0; b < batch_size; b++)
+    {
+        double cum_log_prob = 0.0;
+        for (int t = 0; t < seq_len; t++)
+        {
+            const int row = b * seq_len + t;
+            double log_prob = 0.0;
+            if (t < h_target_length[b])
+            {
+                double max_val = -1e20;
+                for (int i = 0; i < vocab_size; i++)
+                    max_val = std::max(max_val, (double)h_logits[row * vocab_size + i] + h_bias[i]);
+                double sum = 0.0;
+                for (int i = 0; i < vocab_size; i++)
+                    sum += exp((double)h_logits[row * vocab_size + i] + h_bias[i] - max_val);
+                const int id = h_target_ids[row];
+                log_prob = (double)h_logits[row * vocab_size + id] + h_bias[id] - max_val - log(sum);
+            }
+            cum_log_prob += log_prob;
+            if (fabs(log_prob - h_log_probs[row]) > 1e-3)
+            {
+                printf("[ERROR] target log probs fail on batch %d position %d with | %f - %f | = %f. \n",
+                       b, t, (float)log_prob, h_log_probs[row], (float)fabs(log_prob - h_log_probs[row]));
+                exit(-1);
+            }
+        }
+        if (cum_log_probs != nullptr && fabs(cum_log_prob - h_cum_log_probs[b]) > 1e-2)
+        {
+            printf("[ERROR] target cum log probs fail on batch %d with | %f - %f |. \n",
+                   b, (float)cum_log_prob, h_cum_log_probs[b]);
+            exit(-1);
+        }
+    }
+
+    delete[] h_logits;
+    delete[] h_bias;
+    delete[] h_target_ids;
+    delete[] h_target_length;
+    delete[] h_log_probs;
+    delete[] h_cum_log_probs;
+    printf("[INFO] decoding target log probs check finish. \n");
+}
+
+/* Sort by value in descending order (ties keep the smaller id), take the softmax over the
+   top k and return the token of the inverse CDF at uniform * prob_threshold. */
+int topk_sampling_cpu(const float *logits, const int vocab_size, const int k, const float prob_threshold, const float uniform)
+{
+    int *order = new int[vocab_size];
+    for (int i = 0; i < vocab_size; i++)
+        order[i] = i;
+    std::stable_sort(order, order + vocab_size, [logits](const int a, const int b) { return logits[a] > logits[b]; });
+
+    const float max_val = logits[order[0]];
+    double sum = 0.0;
+    for (int i = 0; i < k; i++)
+        sum += exp((double)logits[order[i]] - max_val);
+
+    double rand_num = (double)uniform * prob_threshold * sum;
+    int id = order[0];
+    for (int i = 0; i < k; i++)
+    {
+        id = order[i];
+        rand_num -= exp((double)logits[order[i]] - max_val);
+        if (rand_num <= 0.0)
+            break;
+    }
+    delete[] order;
+    return id;
+}
+
+void topK_sampling_kernel_check(void *workspace, size_t &workspace_size, float *logits, int *ids,
+                                DecodingSamplingArguments args, const int trials, cudaStream_t stream)
+{
+    printf("[INFO] decoding top-k sampling check with candidate_num %d. \n", args.candidate_num_);
+    const int batch_size = args.batch_size_;
+    const int vocab_size = args.vocab_size_;
+    const int k = args.candidate_num_;
+    float *h_logits = new float[batch_size * vocab_size];
+    int *h_ids = new int[batch_size];
+    int *order = new int[vocab_size];
+    double *probs = new double[batch_size * k];
+    int *topk_ids = new int[batch_size * k];
+    int *counts = new int[batch_size * k];
+
+    check_cuda_error(cudaMemcpy(h_logits, logits, sizeof(float) * batch_size * vocab_size, cudaMemcpyDeviceToHost));
+
+    // the top k and their probabilities on CPU
+    for (int b = 0; b < batch_size; b++)
+    {
+        const float *row = h_logits + b * vocab_size;
+        for (int i = 0; i < vocab_size; i++)
+            order[i] = i;
+        std::stable_sort(order, order + vocab_size, [row](const int x, const int y) { return row[x] > row[y]; });
+        double sum = 0.0;
+        for (int i = 0; i < k; i++)
+        {
+            topk_ids[b * k + i] = order[i];
+            probs[b * k + i] = exp((double)row[order[i]] - row[order[0]]);
+            sum += probs[b * k + i];
+            counts[b * k + i] = 0;
+        }
+        for (int i = 0; i < k; i++)
+            probs[b * k + i] /= sum;
+    }
+
+    // sample on GPU with different seeds, the logits are not modified by the kernel
+    for (int trial = 0; trial < trials; trial++)
+    {
+        topK_sampling_kernel_kernelLauncher(workspace, workspace_size, logits, ids, nullptr, nullptr, trial, args, stream);
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+        check_cuda_error(cudaMemcpy(h_ids, ids, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+        for (int b = 0; b < batch_size; b++)
+        {
+            int pos = -1;
+            for (int i = 0; i < k; i++)
+                if (topk_ids[b * k + i] == h_ids[b])
+                    pos = i;
+            // a token equal to the k-th value may be chosen by the GPU in place of another one
+            if (pos == -1 && (h_ids[b] < 0 || h_ids[b] >= vocab_size ||
+                              h_logits[b * vocab_size + h_ids[b]] != h_logits[b * vocab_size + topk_ids[b * k + k - 1]]))
+            {
+                printf("[ERROR] top-k sampling fail on batch %d trial %d, id %d is not in the top %d. \n", b, trial, h_ids[b], k);
+                exit(-1);
+            }
+            counts[b * k + (pos == -1 ? k - 1 : pos)]++;
+        }
+    }
+
+    // the frequencies should follow the softmax over the top k
+    for (int b = 0; b < batch_size; b++)
+    {
+        for (int i = 0; i < k; i++)
+        {
+            const double p = probs[b * k + i];
+            const double freq = (double)counts[b * k + i] / trials;
+            const double tol = std::max(0.05, 4.0 * sqrt(p * (1.0 - p) / trials));
+            if (fabs(freq - p) > tol)
+            {
+                printf("[ERROR] top-k sampling fail on batch %d, id %d has frequency %f but probability %f. \n",
+                       b, topk_ids[b * k + i], (float)freq, (float)p);
+                exit(-1);
+            }
+        }
+    }
+
+    delete[] h_logits;
+    delete[] h_ids;
+    delete[] order;
+    delete[] probs;
+    delete[] topk_ids;
+    delete[] counts;
+    printf("[INFO] decoding top-k sampling check finish. \n");
+}
+
+/* logits is [batch_size, args.vocab_size_], where args.vocab_size_ is the padded vocab size and
+   vocab_size is the real one. The padded columns get the largest logits, so they would be
+   sampled if the mask did not work. */
+void padded_vocab_sampling_check(void *workspace, size_t &workspace_size, float *logits, int *ids,
+                                 const int vocab_size, DecodingSamplingArguments args, const int trials, cudaStream_t stream)
+{
+    printf("[INFO] decoding padded vocab sampling check. \n");
+    const int batch_size = args.batch_size_;
+    const int vocab_size_padded = args.vocab_size_;
+    float *h_logits = new float[batch_size * vocab_size_padded];
+    int *h_ids = new int[batch_size];
+
+    srand(0);
+    for (int i = 0; i < batch_size * vocab_size_padded; i++)
+        h_logits[i] = i % vocab_size_padded < vocab_size ? (float)(rand() % 1000) / 100.f : 1e4f;
+    check_cuda_error(cudaMemcpy(logits, h_logits, sizeof(float) * batch_size * vocab_size_padded, cudaMemcpyHostToDevice));
+
+    apply_temperature_penalty_kernelLauncher(logits, 1.0f, batch_size, vocab_size, vocab_size_padded, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    check_cuda_error(cudaMemcpy(h_logits, logits, sizeof(float) * batch_size * vocab_size_padded, cudaMemcpyDeviceToHost));
+    for (int i = 0; i < batch_size * vocab_size_padded; i++)
+    {
+        if (i % vocab_size_padded >= vocab_size && !(std::isinf(h_logits[i]) && h_logits[i] < 0))
+        {
+            printf("[ERROR] padded logit %d of batch %d is %f instead of -inf. \n",
+                   i % vocab_size_padded, i / vocab_size_padded, h_logits[i]);
+            exit(-1);
+        }
+    }
+
+    for (int trial = 0; trial < trials; trial++)
+    {
+        topK_sampling_kernel_kernelLauncher(workspace, workspace_size, logits, ids, nullptr, nullptr, trial, args, stream);
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+        check_cuda_error(cudaMemcpy(h_ids, ids, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+        for (int b = 0; b < batch_size; b++)
+        {
+            if (h_ids[b] < 0 || h_ids[b] >= vocab_size)
+            {
+                printf("[ERROR] padded vocab sampling fail on batch %d trial %d, id %d is not in [0, %d). \n",
+                       b, trial, h_ids[b], vocab_size);
+                exit(-1);
+            }
+        }
+    }
+
+    delete[] h_logits;
+    delete[] h_ids;
+    printf("[INFO] decoding padded vocab sampling check finish. \n");
+}
+
+void encoder_pooling_cpu(const float *encoder_out, float *pooled, const int *sequence_length, const bool remove_padding,
+                         const PoolingType pooling_type, const int batch_size, const int max_seq_len, const int hidden_units)
+{
+    int begin = 0;
+    for (int b = 0; b < batch_size; b++)
+    {
+        const int length = std::min(std::max(sequence_length[b], 0), max_seq_len);
+        if (!remove_padding)
+            begin = b * max_seq_len;
+        const int count = pooling_type == PoolingType::CLS ? std::min(length, 1) : length;
+        for (int j = 0; j < hidden_units; j++)
+        {
+            float sum = 0.0f;
+            for (int t = 0; t < count; t++)
+                sum += encoder_out[(begin + t) * hidden_units + j];
+            pooled[b * hidden_units + j] = count > 0 ? sum / count : 0.0f;
+        }
+        begin += length;
+    }
+}
+
+void embedding_search_cpu(const float *queries, const float *candidates, int *ids, float *scores,
+                          const int batch_size, const int candidate_num, const int hidden_units, const int k)
+{
+    float *row_scores = new float[candidate_num];
+    int *order = new int[candidate_num];
+    for (int b = 0; b < batch_size; b++)
+    {
+        for (int c = 0; c < candidate_num; c++)
+        {
+            float dot = 0.0f;
+            for (int j = 0; j < hidden_units; j++)
+                dot += queries[b * hidden_units + j] * candidates[c * hidden_units + j];
+            row_scores[c] = dot;
+            order[c] = c;
+        }
+        std::partial_sort(order, order + k, order + candidate_num, [row_scores](const int a, const int c) {
+            return row_scores[a] > row_scores[c] || (row_scores[a] == row_scores[c] && a < c);
+        });
+        for (int i = 0; i < k; i++)
+        {
+            ids[b * k + i] = order[i];
+            scores[b * k + i] = row_scores[order[i]];
+        }
+    }
+    delete[] row_scores;
+    delete[] order;
+}
+
+/* convert float embeddings to the embedding type, and back to float with the same rounding */
+static void *quantize_embeddings(const float *in, float *rounded, const int size, const EmbeddingType embedding_type)
+{
+    if (embedding_type == EmbeddingType::FP16)
+    {
+        half *out = new half[size];
+        for (int i = 0; i < size; i++)
+        {
+            out[i] = __float2half(in[i]);
+            rounded[i] = __half2float(out[i]);
+        }
+        return out;
+    }
+    if (embedding_type == EmbeddingType::INT8)
+    {
+        int8_t *out = new int8_t[size];
+        for (int i = 0; i < size; i++)
+        {
+            out[i] = (int8_t)std::min(std::max(std::nearbyint(in[i] * EMBEDDING_INT8_SCALE), -127.0f), 127.0f);
+            rounded[i] = out[i] / EMBEDDING_INT8_SCALE;
+        }
+        return out;
+    }
+    float *out = new float[size];
+    memcpy(out, in, sizeof(float) * size);
+    memcpy(rounded, in, sizeof(float) * size);
+    return out;
+}
+
+void embedding_search_check(EmbeddingSearch &search, const float *h_queries, const float *h_candidates,
+                            const int batch_size, const int candidate_num, const int hidden_units,
+                            cublasHandle_t cublas_handle, cudaStream_t stream)
+{
+    printf("[INFO] embedding search check. \n");
+    const int k = search.k();
+    const EmbeddingType embedding_type = search.embedding_type();
+    const size_t type_size = embedding_type_size(embedding_type);
+
+    float *h_queries_rounded = new float[batch_size * hidden_units];
+    float *h_candidates_rounded = new float[candidate_num * hidden_units];
+    void *h_queries_typed = quantize_embeddings(h_queries, h_queries_rounded, batch_size * hidden_units, embedding_type);
+    void *h_candidates_typed = quantize_embeddings(h_candidates, h_candidates_rounded, candidate_num * hidden_units, embedding_type);
+
+    void *d_queries;
+    int *d_ids;
+    float *d_scores;
+    check_cuda_error(cudaMalloc(&d_queries, type_size * batch_size * hidden_units));
+    check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * batch_size * k));
+    check_cuda_error(cudaMalloc((void **)&d_scores, sizeof(float) * batch_size * k));
+    check_cuda_error(cudaMemcpy(d_queries, h_queries_typed, type_size * batch_size * hidden_units, cudaMemcpyHostToDevice));
+
+    // compute on GPU and copy the result to CPU
+    search.set_candidates(h_candidates_typed, candidate_num, stream);
+    search.search(d_queries, batch_size, d_ids, d_scores, cublas_handle, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    int *h_ids = new int[batch_size * k];
+    float *h_scores = new float[batch_size * k];
+    check_cuda_error(cudaMemcpy(h_ids, d_ids, sizeof(int) * batch_size * k, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_scores, d_scores, sizeof(float) * batch_size * k, cudaMemcpyDeviceToHost));
+
+    // compute on CPU with the rounded embeddings. Nearly equal scores may be ordered differently,
+    // so the scores of the ranks and the CPU score of the candidate chosen by the GPU are compared.
+    int *h_ids_cpu = new int[batch_size * k];
+    float *h_scores_cpu = new float[batch_size * k];
+    embedding_search_cpu(h_queries_rounded, h_candidates_rounded, h_ids_cpu, h_scores_cpu,
+                         batch_size, candidate_num, hidden_units, k);
+    const float tolerance = embedding_type == EmbeddingType::FP32 ? 1e-4f : 2e-3f;
+    for (int b = 0; b < batch_size; b++)
+    {
+        for (int i = 0; i < k; i++)
+        {
+            const int id = h_ids[b * k + i];
+            float chosen_score = -FLT_MAX;
+            if (id >= 0 && id < candidate_num)
+            {
+                chosen_score = 0.0f;
+                for (int j = 0; j < hidden_units; j++)
+                    chosen_score += h_queries_rounded[b * hidden_units + j] * h_candidates_rounded[id * hidden_units + j];
+            }
+            const float cpu_score = h_scores_cpu[b * k + i];
+            if (fabs(h_scores[b * k + i] - cpu_score) > tolerance || fabs(chosen_score - cpu_score) > tolerance)
+            {
+                printf("[ERROR] embedding search fail on batch %d rank %d, GPU id %d score %f, CPU id %d score %f. \n",
+                       b, i, id, h_scores[b * k + i], h_ids_cpu[b * k + i], cpu_score);
+                exit(-1);
+            }
+        }
+    }
+
+    delete[] h_queries_rounded;
+    delete[] h_candidates_rounded;
+    if (embedding_type == EmbeddingType::FP16)
+    {
+        delete[] (half *)h_queries_typed;
+        delete[] (half *)h_candidates_typed;
+    }
+    else if (embedding_type == EmbeddingType::INT8)
+    {
+        delete[] (int8_t *)h_queries_typed;
+        delete[] (int8_t *)h_candidates_typed;
+    }
+    else
+    {
+        delete[] (float *)h_queries_typed;
+        delete[] (float *)h_candidates_typed;
+    }
+    delete[] h_ids;
+    delete[] h_scores;
+    delete[] h_ids_cpu;
+    delete[] h_scores_cpu;
+    check_cuda_error(cudaFree(d_queries));
+    check_cuda_error(cudaFree(d_ids));
+    check_cuda_error(cudaFree(d_scores));
+    printf("[INFO] embedding search check finish. \n");
+}
+
+void token_constraint_kernel_check(const TokenAutomaton &automaton, const TokenConstraint &constraint,
+                                   const int *h_states, const int *h_ids, const int *h_parent_ids,
+                                   const int m, const int n, cudaStream_t stream)
+{
+    printf("[INFO] token constraint check. \n");
+    float *h_logits = new float[m * n];
+    for (int i = 0; i < m * n; i++)
+        h_logits[i] = (float)(rand() % 1000) / 100.0f;
+
+    float *d_logits;
+    int *d_states, *d_ids, *d_parent_ids = nullptr;
+    check_cuda_error(cudaMalloc((void **)&d_logits, sizeof(float) * m * n));
+    check_cuda_error(cudaMalloc((void **)&d_states, sizeof(int) * m));
+    check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * m));
+    check_cuda_error(cudaMemcpy(d_logits, h_logits, sizeof(float) * m * n, cudaMemcpyHostToDevice));
+    check_cuda_error(cudaMemcpy(d_states, h_states, sizeof(int) * m, cudaMemcpyHostToDevice));
+    check_cuda_error(cudaMemcpy(d_ids, h_ids, sizeof(int) * m, cudaMemcpyHostToDevice));
+    if (h_parent_ids != nullptr)
+    {
+        check_cuda_error(cudaMalloc((void **)&d_parent_ids, sizeof(int) * m));
+        check_cuda_error(cudaMemcpy(d_parent_ids, h_parent_ids, sizeof(int) * m, cudaMemcpyHostToDevice));
+    }
+
+    // compute on GPU and copy the result to CPU
+    apply_token_constraint_kernelLauncher(d_logits, d_states, constraint.table(), (const bool *)nullptr, m, n, stream);
+    advance_token_constraint_kernelLauncher(d_states, d_ids, d_parent_ids, constraint.table(), m, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    float *h_logits_gpu = new float[m * n];
+    int *h_states_gpu = new int[m];
+    check_cuda_error(cudaMemcpy(h_logits_gpu, d_logits, sizeof(float) * m * n, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_states_gpu, d_states, sizeof(int) * m, cudaMemcpyDeviceToHost));
+
+    // compute on CPU and compare
+    for (int i = 0; i < m; i++)
+    {
+        const int state = h_states[i];
+        for (int j = 0; j < n; j++)
+        {
+            const bool allowed = (state < 0 && state != TOKEN_AUTOMATON_DEAD_STATE) ||
+                                 (j < automaton.vocab_size() && automaton.is_allowed(state, j));
+            const bool kept = h_logits_gpu[i * n + j] == h_logits[i * n + j];
+            if (allowed != kept || (!kept && h_logits_gpu[i * n + j] > -1e19f))
+            {
+                printf("[ERROR] token constraint mask fail on row %d (state %d) token %d, allowed %d, GPU logit %f. \n",
+                       i, state, j, (int)allowed, h_logits_gpu[i * n + j]);
+                exit(-1);
+            }
+        }
+
+        const int old_state = h_states[h_parent_ids != nullptr ? h_parent_ids[i] : i];
+        const int new_state = old_state < 0 ? old_state : automaton.next(old_state, h_ids[i]);
+        if (new_state != h_states_gpu[i])
+        {
+            printf("[ERROR] token constraint advance fail on row %d, GPU state %d, CPU state %d. \n",
+                   i, h_states_gpu[i], new_state);
+            exit(-1);
+        }
+    }
+
+    delete[] h_logits;
+    delete[] h_logits_gpu;
+    delete[] h_states_gpu;
+    check_cuda_error(cudaFree(d_logits));
+    check_cuda_error(cudaFree(d_states));
+    check_cuda_error(cudaFree(d_ids));
+    if (d_parent_ids != nullptr)
+        check_cuda_error(cudaFree(d_parent_ids));
+    printf("[INFO] token constraint check finish. \n");
+}
+
+void stop_criteria_cpu(bool *finished, const int *output_ids, const int *parent_ids,
+                       const int *stop_words, const int stop_words_len, const int *max_new_tokens, const int step,
+                       const int batch_size, const int beam_width)
+{
+    const int rows = batch_size * beam_width;
+    for (int row = 0; row < rows; row++)
+    {
+        const int batch_id = row / beam_width;
+        bool stop = max_new_tokens != nullptr && step >= max_new_tokens[batch_id];
+        const int *ids = stop_words != nullptr ? stop_words + batch_id * 2 * stop_words_len : nullptr;
+        for (int w = 0; ids != nullptr && !stop && w < stop_words_len && ids[stop_words_len + w] >= 0; w++)
+        {
+            const int begin = w == 0 ? 0 : ids[stop_words_len + w - 1];
+            const int end = ids[stop_words_len + w];
+            if (end - begin > step)
+                continue;
+            // rebuild the history of the row, then compare its suffix
+            std::vector<int> history(step);
+            int r = row;
+            for (int s = step - 1; s >= 0; s--)
+            {
+                history[s] = output_ids[s * rows + r];
+                if (parent_ids != nullptr)
+                    r = batch_id * beam_width + parent_ids[s * rows + r] % beam_width;
+            }
+            stop = std::equal(ids + begin, ids + end, history.end() - (end - begin));
+        }
+        if (stop)
+            finished[row] = true;
+    }
+}
+
+void stop_criteria_kernel_check(const bool *h_finished, const int *h_output_ids, const int *h_parent_ids,
+                                const int *h_stop_words, const int stop_words_len, const int *h_max_new_tokens, const int step,
+                                const int batch_size, const int beam_width, cudaStream_t stream)
+{
+    printf("[INFO] stop criteria check. \n");
+    const int rows = batch_size * beam_width;
+    bool *d_finished;
+    int *d_output_ids, *d_parent_ids = nullptr, *d_stop_words = nullptr, *d_max_new_tokens = nullptr;
+    check_cuda_error(cudaMalloc((void **)&d_finished, sizeof(bool) * rows));
+    check_cuda_error(cudaMalloc((void **)&d_output_ids, sizeof(int) * step * rows));
+    check_cuda_error(cudaMemcpy(d_finished, h_finished, sizeof(bool) * rows, cudaMemcpyHostToDevice));
+    check_cuda_error(cudaMemcpy(d_output_ids, h_output_ids, sizeof(int) * step * rows, cudaMemcpyHostToDevice));
+    if (h_parent_ids != nullptr)
+    {
+        check_cuda_error(cudaMalloc((void **)&d_parent_ids, sizeof(int) * step * rows));
+        check_cuda_error(cudaMemcpy(d_parent_ids, h_parent_ids, sizeof(int) * step * rows, cudaMemcpyHostToDevice));
+    }
+    if (h_stop_words != nullptr)
+    {
+        check_cuda_error(cudaMalloc((void **)&d_stop_words, sizeof(int) * batch_size * 2 * stop_words_len));
+        check_cuda_error(cudaMemcpy(d_stop_words, h_stop_words, sizeof(int) * batch_size * 2 * stop_words_len, cudaMemcpyHostToDevice));
+    }
+    if (h_max_new_tokens != nullptr)
+    {
+        check_cuda_error(cudaMalloc((void **)&d_max_new_tokens, sizeof(int) * batch_size));
+        check_cuda_error(cudaMemcpy(d_max_new_tokens, h_max_new_tokens, sizeof(int) * batch_size, cudaMemcpyHostToDevice));
+    }
+
+    // compute on GPU and copy the result to CPU
+    stop_criteria_kernelLauncher(d_finished, d_output_ids, d_parent_ids, d_stop_words, stop_words_len,
+                                 d_max_new_tokens, step, batch_size, beam_width, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    bool *h_finished_gpu = new bool[rows];
+    check_cuda_error(cudaMemcpy(h_finished_gpu, d_finished, sizeof(bool) * rows, cudaMemcpyDeviceToHost));
+
+    // compute on CPU and compare
+    bool *h_finished_cpu = new bool[rows];
+    memcpy(h_finished_cpu, h_finished, sizeof(bool) * rows);
+    stop_criteria_cpu(h_finished_cpu, h_output_ids, h_parent_ids, h_stop_words, stop_words_len,
+                      h_max_new_tokens, step, batch_size, beam_width);
+    for (int i = 0; i < rows; i++)
+    {
+        if (h_finished_gpu[i] != h_finished_cpu[i])
+        {
+            printf("[ERROR] stop criteria fail on row %d at step %d, GPU %d, CPU %d. \n",
+                   i, step, (int)h_finished_gpu[i], (int)h_finished_cpu[i]);
+            exit(-1);
+        }
+    }
+
+    delete[] h_finished_gpu;
+    delete[] h_finished_cpu;
+    check_cuda_error(cudaFree(d_finished));
+    check_cuda_error(cudaFree(d_output_ids));
+    if (d_parent_ids != nullptr)
+        check_cuda_error(cudaFree(d_parent_ids));
+    if (d_stop_words != nullptr)
+        check_cuda_error(cudaFree(d_stop_words));
+    if (d_max_new_tokens != nullptr)
+        check_cuda_error(cudaFree(d_max_new_tokens));
+    printf("[INFO] stop criteria check finish. \n");
+}
+
+void add_bias_input_layernorm_cpu(float *out, const float *input, const float *bias, const float *gamma, const float *beta,
+                                  const int m, const int n)
+{
+    double *row = new double[n];
+    for (int i = 0; i < m; i++)
+    {
+        double mean = 0.0;
+        for (int j = 0; j < n; j++)
+        {
+            row[j] = (double)out[i * n + j] + (input != nullptr ? input[i * n + j] : 0.0f) + (bias != nullptr ? bias[j] : 0.0f);
+            mean += row[j];
+        }
+        mean /= n;
+        double variance = 0.0;
+        for (int j = 0; j < n; j++)
+            variance += (row[j] - mean) * (row[j] - mean);
+        const double inv_std = 1.0 / sqrt(variance / n + 1e-6);
+        for (int j = 0; j < n; j++)
+            out[i * n + j] = (float)((row[j] - mean) * inv_std * gamma[j] + beta[j]);
+    }
+    delete[] row;
+}
+
+void add_bias_act_cpu(float *out, const float *bias, const int m, const int n, const ActivationType activation_type)
+{
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            const float x = out[i * n + j] + bias[j];
+            if (activation_type == ActivationType::RELU)
+                out[i * n + j] = x > 0.0f ? x : 0.0f;
+            else
+                out[i * n + j] = x * 0.5f * (1.0f + tanhf(0.7978845608028654f * (x + 0.044715f * x * x * x)));
+        }
+    }
+}
+
+static float to_float(const float x) { return x; }
+static float to_float(const half x) { return __half2float(x); }
+static void from_float(const float x, float &y) { y = x; }
+static void from_float(const float x, half &y) { y = __float2half(x); }
+
+/* random values in [lo, hi) of type T, rounded is their float value */
+template <typename T>
+static T *random_typed(float *rounded, const int size, const float lo, const float hi)
+{
+    T *out = new T[size];
+    for (int i = 0; i < size; i++)
+    {
+        from_float(lo + (hi - lo) * (rand() / (RAND_MAX + 1.0f)), out[i]);
+        rounded[i] = to_float(out[i]);
+    }
+    return out;
+}
+
+template <typename T>
+static T *to_device(const T *h_buf, const int size)
+{
+    T *d_buf;
+    check_cuda_error(cudaMalloc((void **)&d_buf, sizeof(T) * size));
+    check_cuda_error(cudaMemcpy(d_buf, h_buf, sizeof(T) * size, cudaMemcpyHostToDevice));
+    return d_buf;
+}
+
+/* compare the [size] T of d_buf with the CPU result */
+template <typename T>
+static float max_abs_diff(const T *d_buf, const float *h_cpu, const int size)
+{
+    T *h_gpu = new T[size];
+    check_cuda_error(cudaMemcpy(h_gpu, d_buf, sizeof(T) * size, cudaMemcpyDeviceToHost));
+    float max_diff = 0.0f;
+    for (int i = 0; i < size; i++)
+        max_diff = std::max(max_diff, fabsf(to_float(h_gpu[i]) - h_cpu[i]));
+    delete[] h_gpu;
+    return max_diff;
+}
+
+template <typename T>
+void layernorm_kernel_check(const int m, const int n, cudaStream_t stream)
+{
+    const bool is_fp16 = sizeof(T) == sizeof(half);
+    printf("[INFO] layernorm and bias act check for m %d, n %d, %s. \n", m, n, is_fp16 ? "FP16" : "FP32");
+    const float threshold = is_fp16 ? 5e-2f : 1e-3f;
+
+    float *h_out = new float[m * n];
+    float *h_input = new float[m * n];
+    float *h_bias = new float[n];
+    float *h_gamma = new float[n];
+    float *h_beta = new float[n];
+    T *h_out_typed = random_typed<T>(h_out, m * n, -2.0f, 2.0f);
+    T *h_input_typed = random_typed<T>(h_input, m * n, -2.0f, 2.0f);
+    T *h_bias_typed = random_typed<T>(h_bias, n, -1.0f, 1.0f);
+    T *h_gamma_typed = random_typed<T>(h_gamma, n, 0.5f, 1.5f);
+    T *h_beta_typed = random_typed<T>(h_beta, n, -0.5f, 0.5f);
+    T *d_out = to_device(h_out_typed, m * n);
+    T *d_input = to_device(h_input_typed, m * n);
+    T *d_bias = to_device(h_bias_typed, n);
+    T *d_gamma = to_device(h_gamma_typed, n);
+    T *d_beta = to_device(h_beta_typed, n);
+
+    // add_bias_input_layernorm_kernelLauncher, with the tuned kernels and the generic ones
+    float *h_cpu = new float[m * n];
+    memcpy(h_cpu, h_out, sizeof(float) * m * n);
+    add_bias_input_layernorm_cpu(h_cpu, h_input, h_bias, h_gamma, h_beta, m, n);
+    add_bias_input_layernorm_kernelLauncher<T>(d_out, d_input, d_bias, d_gamma, d_beta, m, n, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    float diff = max_abs_diff(d_out, h_cpu, m * n);
+    if (diff > threshold)
+    {
+        printf("[ERROR] add_bias_input_layernorm fail with max diff %f. \n", diff);
+        exit(-1);
+    }
+
+    // the generic layernorm without input and bias
+    check_cuda_error(cudaMemcpy(d_out, h_out_typed, sizeof(T) * m * n, cudaMemcpyHostToDevice));
+    memcpy(h_cpu, h_out, sizeof(float) * m * n);
+    add_bias_input_layernorm_cpu(h_cpu, nullptr, nullptr, h_gamma, h_beta, m, n);
+    add_bias_input_layernorm_generic_kernelLauncher<T>(d_out, nullptr, nullptr, d_gamma, d_beta, m, n, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    diff = max_abs_diff(d_out, h_cpu, m * n);
+    if (diff > threshold)
+    {
+        printf("[ERROR] generic layernorm fail with max diff %f. \n", diff);
+        exit(-1);
+    }
+
+    // GELU of add_bias_act_kernelLauncher and RELU of the generic kernel
+    for (int act = 0; act < 2; act++)
+    {
+        const ActivationType activation_type = act == 0 ? ActivationType::GELU : ActivationType::RELU;
+        check_cuda_error(cudaMemcpy(d_out, h_out_typed, sizeof(T) * m * n, cudaMemcpyHostToDevice));
+        memcpy(h_cpu, h_out, sizeof(float) * m * n);
+        add_bias_act_cpu(h_cpu, h_bias, m, n, activation_type);
+        if (activation_type == ActivationType::GELU)
+            add_bias_act_kernelLauncher<T>(d_out, d_bias, m, n, stream);
+        else
+            add_bias_act_generic_kernelLauncher<T>(d_out, d_bias, m, n, activation_type, stream);
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+        diff = max_abs_diff(d_out, h_cpu, m * n);
+        if (diff > threshold)
+        {
+            printf("[ERROR] add_bias_act fail with max diff %f. \n", diff);
+            exit(-1);
+        }
+    }
+
+    delete[] h_out;
+    delete[] h_input;
+    delete[] h_bias;
+    delete[] h_gamma;
+    delete[] h_beta;
+    delete[] h_cpu;
+    delete[] h_out_typed;
+    delete[] h_input_typed;
+    delete[] h_bias_typed;
+    delete[] h_gamma_typed;
+    delete[] h_beta_typed;
+    check_cuda_error(cudaFree(d_out));
+    check_cuda_error(cudaFree(d_input));
+    check_cuda_error(cudaFree(d_bias));
+    check_cuda_error(cudaFree(d_gamma));
+    check_cuda_error(cudaFree(d_beta));
+    printf("[INFO] layernorm and bias act check finish. \n");
+}
+
+template void layernorm_kernel_check<float>(const int m, const int n, cudaStream_t stream);
+
+template void layernorm_kernel_check<half>(const int m, const int n, cudaStream_t stream);
+
+} // end of namespace fastertransformer
@@ -16,6 +16,13 @@ limitations under the License.
 
 #pragma once
 #include "cuda_kernels.h"
+#include "moe_kernels.h"
+#include "pooling_kernels.h"
+#include "stop_criteria_kernels.h"
+#include "layernorm_kernels.h"
+#include "fastertransformer/open_decoder.h"
+#include "fastertransformer/embedding_search.h"
+#include "fastertransformer/token_constraint.h"
 #include "fastertransformer/common.h"
 #include <cuda_runtime.h>
 #include <math.h>
@@ -40,6 +47,63 @@ void update_kernel_check(float* log_probs, float* cum_log_probs, int* ids, bool*
   const int vocab_size, cudaStream_t stream,
   const int end_id, int* finished_count);
 
+void beam_search_nbest_kernel_check(const int* output_ids, const int* parent_ids, const float* step_log_probs,
+  int* nbest_ids, float* nbest_log_probs, float* nbest_cum_log_probs, float* nbest_normed_scores, int* nbest_lengths,
+  const int max_time, const int batch_size, const int beam_width, const int seq_len,
+  const int end_id, const float length_penalty, cudaStream_t stream);
+
+void target_log_probs_kernel_check(const float* logits, const float* bias, const int* target_ids, const int* target_length,
+  float* log_probs, float* cum_log_probs, const int batch_size, const int seq_len, const int vocab_size, cudaStream_t stream);
+
+int topk_sampling_cpu(const float* logits, const int vocab_size, const int k, const float prob_threshold, const float uniform);
+
+void topK_sampling_kernel_check(void* workspace, size_t& workspace_size, float* logits, int* ids,
+  DecodingSamplingArguments args, const int trials, cudaStream_t stream);
+
+void padded_vocab_sampling_check(void* workspace, size_t& workspace_size, float* logits, int* ids,
+  const int vocab_size, DecodingSamplingArguments args, const int trials, cudaStream_t stream);
+
+/* encoder_out is compact ([sum of sequence_length, hidden_units]) if remove_padding, else padded. */
+void encoder_pooling_cpu(const float* encoder_out, float* pooled, const int* sequence_length, const bool remove_padding,
+  const PoolingType pooling_type, const int batch_size, const int max_seq_len, const int hidden_units);
+
+/* the k candidates of the largest dot products with each query, in descending order, equal scores prefer the smaller id */
+void embedding_search_cpu(const float* queries, const float* candidates, int* ids, float* scores,
+  const int batch_size, const int candidate_num, const int hidden_units, const int k);
+
+/* h_queries and h_candidates are L2-normalized float embeddings on the host, they are converted
+   to the embedding type of search. search.set_candidates() is called with h_candidates. */
+void embedding_search_check(EmbeddingSearch& search, const float* h_queries, const float* h_candidates,
+  const int batch_size, const int candidate_num, const int hidden_units, cublasHandle_t cublas_handle, cudaStream_t stream);
+
+/* CPU reference of stop_criteria_kernelLauncher, the arguments are on the host. */
+void stop_criteria_cpu(bool* finished, const int* output_ids, const int* parent_ids,
+  const int* stop_words, const int stop_words_len, const int* max_new_tokens, const int step,
+  const int batch_size, const int beam_width);
+
+/* runs stop_criteria_kernelLauncher on copies of the host arguments and compares with stop_criteria_cpu */
+void stop_criteria_kernel_check(const bool* h_finished, const int* h_output_ids, const int* h_parent_ids,
+  const int* h_stop_words, const int stop_words_len, const int* h_max_new_tokens, const int step,
+  const int batch_size, const int beam_width, cudaStream_t stream);
+
+/* Masks random [m, n] logits with the h_states of automaton and advances them with h_ids (and
+   h_parent_ids if not nullptr) on the GPU, then compares with TokenAutomaton::is_allowed and next.
+   constraint is the device copy of automaton.compile(). */
+void token_constraint_kernel_check(const TokenAutomaton& automaton, const TokenConstraint& constraint,
+  const int* h_states, const int* h_ids, const int* h_parent_ids, const int m, const int n, cudaStream_t stream);
+
+/* CPU references of the layernorm and bias + activation kernels, see layernorm_kernels.h.
+   input and bias of add_bias_input_layernorm_cpu can be nullptr. */
+void add_bias_input_layernorm_cpu(float* out, const float* input, const float* bias, const float* gamma, const float* beta,
+  const int m, const int n);
+
+void add_bias_act_cpu(float* out, const float* bias, const int m, const int n, const ActivationType activation_type);
+
+/* runs add_bias_input_layernorm_kernelLauncher, add_bias_act_kernelLauncher and the generic
+   kernels on random [m, n] inputs and compares with the CPU references, T is float or half */
+template <typename T>
+void layernorm_kernel_check(const int m, const int n, cudaStream_t stream);
+
 template <typename T>
 void update_KV_cache_kernel_check(T** key_cache, T** value_cache, const int* beam_ids, const int batch_size, const int beam_width, const int hidden_dim,
   const int step, const int cache_size, const int decoder_layers, cudaStream_t stream){
@@ -115,4 +179,293 @@ void update_KV_cache_kernel_check(T** key_cache, T** value_cache, const int* bea
     printf("[INFO] decoding update KV cache check for step %d finish. \n", step);
 }
 
+template <typename T>
+void cross_attention_kernel_check(T* query_buf, const T* Q_bias, T* key_cache, const T* K_bias, T* value_cache, const T* V_bias,
+  const int* length, T* context_buf, const int batch_size, const int head_num, const int size_per_head, const int step,
+  const int seq_len, cudaStream_t stream){
+
+    printf("[INFO] decoding cross attention check for step %d. \n", step);
+    const int hidden_units = head_num * size_per_head;
+    const int cache_size = batch_size * seq_len * hidden_units;
+
+    T *h_query = new T[batch_size * hidden_units];
+    T *h_Q_bias = new T[hidden_units];
+    T *h_K_bias = new T[hidden_units];
+    T *h_V_bias = new T[hidden_units];
+    T *h_key_cache = new T[cache_size];
+    T *h_value_cache = new T[cache_size];
+    int *h_length = new int[batch_size];
+    T *h_context = new T[batch_size * hidden_units];
+    float *logits = new float[seq_len];
+
+    check_cuda_error(cudaMemcpy(h_query, query_buf, sizeof(T) * batch_size * hidden_units, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_Q_bias, Q_bias, sizeof(T) * hidden_units, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_K_bias, K_bias, sizeof(T) * hidden_units, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_V_bias, V_bias, sizeof(T) * hidden_units, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_key_cache, key_cache, sizeof(T) * cache_size, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_value_cache, value_cache, sizeof(T) * cache_size, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_length, length, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+
+    // compute on GPU and copy the result to CPU
+    cross_attention_dispatch<T>(query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,
+                                batch_size, head_num, size_per_head, step, seq_len, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    check_cuda_error(cudaMemcpy(h_context, context_buf, sizeof(T) * batch_size * hidden_units, cudaMemcpyDeviceToHost));
+
+    // compute on CPU, only the first length[b] positions of the memory are used
+    const float scalar = 1.f / sqrtf(size_per_head * 1.0f);
+    const float tolerance = sizeof(T) == 2 ? 5e-2f : 1e-3f;
+    for(int b = 0; b < batch_size; b++){
+        for(int h = 0; h < head_num; h++){
+            float max_val = -1e20f;
+            for(int t = 0; t < h_length[b]; t++){
+                float qk = 0.0f;
+                for(int i = 0; i < size_per_head; i++){
+                    const int hid = h * size_per_head + i;
+                    float key = (float)h_key_cache[(b * seq_len + t) * hidden_units + hid];
+                    if(step == 1) key += (float)h_K_bias[hid];
+                    qk += ((float)h_query[b * hidden_units + hid] + (float)h_Q_bias[hid]) * key;
+                }
+                logits[t] = qk * scalar;
+                max_val = logits[t] > max_val ? logits[t] : max_val;
+            }
+            float sum = 0.0f;
+            for(int t = 0; t < h_length[b]; t++){
+                logits[t] = expf(logits[t] - max_val);
+                sum += logits[t];
+            }
+            for(int i = 0; i < size_per_head; i++){
+                const int hid = h * size_per_head + i;
+                float context = 0.0f;
+                for(int t = 0; t < h_length[b]; t++){
+                    float value = (float)h_value_cache[(b * seq_len + t) * hidden_units + hid];
+                    if(step == 1) value += (float)h_V_bias[hid];
+                    context += value * logits[t] / (sum + 1e-6f);
+                }
+                float diff = context - (float)h_context[b * hidden_units + hid];
+                if(diff < 0) diff = diff * -1;
+                if(diff > tolerance){
+                    printf("[ERROR] cross attention fail on batch %d head %d element %d with | %f - %f | = %f. \n",
+                           b, h, i, context, (float)h_context[b * hidden_units + hid], diff);
+                    exit(-1);
+                }
+            }
+        }
+    }
+
+    delete [] h_query;
+    delete [] h_Q_bias;
+    delete [] h_K_bias;
+    delete [] h_V_bias;
+    delete [] h_key_cache;
+    delete [] h_value_cache;
+    delete [] h_length;
+    delete [] h_context;
+    delete [] logits;
+    printf("[INFO] decoding cross attention check for step %d finish. \n", step);
+}
+
+template <typename T>
+void moe_routing_kernel_check(const T* gating_logits, const T* gating_bias, int* expert_ids, float* gate_weights,
+  int* expanded_slots, int* expert_counts, const int m, const int expert_num, const int moe_k, const int capacity,
+  cudaStream_t stream){
+
+    printf("[INFO] moe routing check. \n");
+
+    T *h_logits = new T[m * expert_num];
+    T *h_bias = new T[expert_num];
+    check_cuda_error(cudaMemcpy(h_logits, gating_logits, sizeof(T) * m * expert_num, cudaMemcpyDeviceToHost));
+    if(gating_bias != nullptr)
+        check_cuda_error(cudaMemcpy(h_bias, gating_bias, sizeof(T) * expert_num, cudaMemcpyDeviceToHost));
+
+    // compute on GPU and copy the result to CPU
+    moe_topk_gating_kernelLauncher(gating_logits, gating_bias, expert_ids, gate_weights, m, expert_num, moe_k, stream);
+    moe_permute_indices_kernelLauncher(expert_ids, expanded_slots, expert_counts, m, expert_num, moe_k, capacity, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+
+    int *h_expert_ids = new int[m * moe_k];
+    float *h_gate_weights = new float[m * moe_k];
+    int *h_expanded_slots = new int[m * moe_k];
+    int *h_expert_counts = new int[expert_num];
+    check_cuda_error(cudaMemcpy(h_expert_ids, expert_ids, sizeof(int) * m * moe_k, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_gate_weights, gate_weights, sizeof(float) * m * moe_k, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_expanded_slots, expanded_slots, sizeof(int) * m * moe_k, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_expert_counts, expert_counts, sizeof(int) * expert_num, cudaMemcpyDeviceToHost));
+
+    // compute on CPU
+    int *h_expert_ids_cpu = new int[m * moe_k];
+    float *h_gate_weights_cpu = new float[m * moe_k];
+    int *h_expanded_slots_cpu = new int[m * moe_k];
+    int *h_expert_counts_cpu = new int[expert_num];
+    float *val = new float[expert_num];
+    bool *selected = new bool[expert_num];
+
+    for(int i = 0; i < m; i++){
+        float max_val = -FLT_MAX;
+        for(int e = 0; e < expert_num; e++){
+            val[e] = (float)h_logits[i * expert_num + e] + (gating_bias != nullptr ? (float)h_bias[e] : 0.0f);
+            max_val = val[e] > max_val ? val[e] : max_val;
+            selected[e] = false;
+        }
+        float sum = 0.0f;
+        for(int e = 0; e < expert_num; e++) sum += expf(val[e] - max_val);
+
+        float selected_sum = 0.0f;
+        for(int k = 0; k < moe_k; k++){
+            int best = -1;
+            for(int e = 0; e < expert_num; e++)
+                if(!selected[e] && (best == -1 || val[e] > val[best])) best = e;
+            selected[best] = true;
+            h_expert_ids_cpu[i * moe_k + k] = best;
+            h_gate_weights_cpu[i * moe_k + k] = expf(val[best] - max_val) / sum;
+            selected_sum += h_gate_weights_cpu[i * moe_k + k];
+        }
+        if(moe_k > 1)
+            for(int k = 0; k < moe_k; k++) h_gate_weights_cpu[i * moe_k + k] /= selected_sum;
+    }
+
+    for(int e = 0; e < expert_num; e++) h_expert_counts_cpu[e] = 0;
+    for(int k = 0; k < moe_k; k++){
+        for(int i = 0; i < m; i++){
+            const int expert = h_expert_ids_cpu[i * moe_k + k];
+            const int pos = h_expert_counts_cpu[expert]++;
+            h_expanded_slots_cpu[i * moe_k + k] = pos < capacity ? expert * capacity + pos : -1;
+        }
+    }
+    for(int e = 0; e < expert_num; e++)
+        h_expert_counts_cpu[e] = h_expert_counts_cpu[e] < capacity ? h_expert_counts_cpu[e] : capacity;
+
+    // check
+    for(int i = 0; i < m * moe_k; i++){
+        if(h_expert_ids[i] != h_expert_ids_cpu[i]){
+            printf("[ERROR] moe expert id fail on %d with %d (gpu) vs %d (cpu). \n", i, h_expert_ids[i], h_expert_ids_cpu[i]);
+            exit(-1);
+        }
+        float diff = h_gate_weights[i] - h_gate_weights_cpu[i];
+        if(diff < 0) diff = diff * -1;
+        if(diff > 1e-4){
+            printf("[ERROR] moe gate weight fail on %d with | %f - %f | = %f. \n", i, h_gate_weights[i], h_gate_weights_cpu[i], diff);
+            exit(-1);
+        }
+        if(h_expanded_slots[i] != h_expanded_slots_cpu[i]){
+            printf("[ERROR] moe expanded slot fail on %d with %d (gpu) vs %d (cpu). \n", i, h_expanded_slots[i], h_expanded_slots_cpu[i]);
+            exit(-1);
+        }
+    }
+    for(int e = 0; e < expert_num; e++){
+        if(h_expert_counts[e] != h_expert_counts_cpu[e]){
+            printf("[ERROR] moe expert count fail on expert %d with %d (gpu) vs %d (cpu). \n", e, h_expert_counts[e], h_expert_counts_cpu[e]);
+            exit(-1);
+        }
+    }
+
+    delete [] h_logits;
+    delete [] h_bias;
+    delete [] h_expert_ids;
+    delete [] h_gate_weights;
+    delete [] h_expanded_slots;
+    delete [] h_expert_counts;
+    delete [] h_expert_ids_cpu;
+    delete [] h_gate_weights_cpu;
+    delete [] h_expanded_slots_cpu;
+    delete [] h_expert_counts_cpu;
+    delete [] val;
+    delete [] selected;
+    printf("[INFO] moe routing check finish. \n");
+}
+
+template <typename T>
+void moe_gather_kernel_check(const T* input, const int* expanded_slots, T* permuted_input,
+  const int m, const int n, const int moe_k, cudaStream_t stream){
+
+    printf("[INFO] moe permutation check. \n");
+
+    moe_gather_kernelLauncher(input, expanded_slots, permuted_input, m, n, moe_k, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+
+    T *h_input = new T[m * n];
+    int *h_expanded_slots = new int[m * moe_k];
+    T *h_row = new T[n];
+    check_cuda_error(cudaMemcpy(h_input, input, sizeof(T) * m * n, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_expanded_slots, expanded_slots, sizeof(int) * m * moe_k, cudaMemcpyDeviceToHost));
+
+    for(int i = 0; i < m * moe_k; i++){
+        const int slot = h_expanded_slots[i];
+        if(slot < 0) continue;
+        check_cuda_error(cudaMemcpy(h_row, permuted_input + slot * n, sizeof(T) * n, cudaMemcpyDeviceToHost));
+        for(int j = 0; j < n; j++){
+            if((float)h_row[j] != (float)h_input[(i / moe_k) * n + j]){
+                printf("[ERROR] moe permutation fail on token %d, slot %d, column %d. \n", i / moe_k, slot, j);
+                exit(-1);
+            }
+        }
+    }
+
+    delete [] h_input;
+    delete [] h_expanded_slots;
+    delete [] h_row;
+    printf("[INFO] moe permutation check finish. \n");
+}
+
+template <typename T>
+void encoder_pooling_kernel_check(T* pooled, const T* encoder_out, const int* sequence_length, const int* sequence_id_offset,
+  const int valid_word_num, const PoolingType pooling_type, const int batch_size, const int max_seq_len, const int hidden_units,
+  cudaStream_t stream){
+
+    printf("[INFO] encoder %s pooling check. \n", pooling_type == PoolingType::CLS ? "cls" : "mean");
+    const bool remove_padding = sequence_id_offset != nullptr;
+    int *h_sequence_length = new int[batch_size];
+    if(sequence_length != nullptr)
+        check_cuda_error(cudaMemcpy(h_sequence_length, sequence_length, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+    else
+        for(int b = 0; b < batch_size; b++) h_sequence_length[b] = max_seq_len;
+
+    int rows = batch_size * max_seq_len;
+    if(remove_padding){
+        rows = 0;
+        for(int b = 0; b < batch_size; b++) rows += h_sequence_length[b];
+        if(rows != valid_word_num){
+            printf("[ERROR] encoder pooling check needs the sequence_length of the compact output (%d != %d rows). \n", rows, valid_word_num);
+            exit(-1);
+        }
+    }
+
+    T *h_encoder_out = new T[rows * hidden_units];
+    float *h_encoder_out_float = new float[rows * hidden_units];
+    float *h_pooled_cpu = new float[batch_size * hidden_units];
+    T *h_pooled = new T[batch_size * hidden_units];
+    check_cuda_error(cudaMemcpy(h_encoder_out, encoder_out, sizeof(T) * rows * hidden_units, cudaMemcpyDeviceToHost));
+    for(int i = 0; i < rows * hidden_units; i++) h_encoder_out_float[i] = (float)h_encoder_out[i];
+
+    // compute on GPU and copy the result to CPU
+    encoder_pooling_kernelLauncher(pooled, encoder_out, sequence_length, sequence_id_offset, valid_word_num,
+                                   pooling_type, batch_size, max_seq_len, hidden_units, stream);
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    check_cuda_error(cudaMemcpy(h_pooled, pooled, sizeof(T) * batch_size * hidden_units, cudaMemcpyDeviceToHost));
+
+    // compute on CPU, the compact rows are located by the lengths instead of sequence_id_offset
+    encoder_pooling_cpu(h_encoder_out_float, h_pooled_cpu, h_sequence_length, remove_padding,
+                        pooling_type, batch_size, max_seq_len, hidden_units);
+    const float tolerance = sizeof(T) == 2 ? 1e-2f : 1e-5f;
+    for(int i = 0; i < batch_size * hidden_units; i++){
+        float diff = fabs(h_pooled_cpu[i] - (float)h_pooled[i]);
+        if(diff > tolerance * (1.0f + fabs(h_pooled_cpu[i]))){
+            printf("[ERROR] encoder pooling fail on batch %d column %d with | %f - %f | = %f. \n",
+                   i / hidden_units, i % hidden_units, h_pooled_cpu[i], (float)h_pooled[i], diff);
+            exit(-1);
+        }
+    }
+
+    delete [] h_sequence_length;
+    delete [] h_encoder_out;
+    delete [] h_encoder_out_float;
+    delete [] h_pooled_cpu;
+    delete [] h_pooled;
+    printf("[INFO] encoder pooling check finish. \n");
+}
+
 } // end of namespace fastertransformer
@@ -97,6 +97,43 @@ namespace fastertransformer
                                                      start_id);
   }
 
+  __global__ void update_finished_kernel(bool* finished, int* sequence_length, int* ids,
+                                         const int end_id, const int m)
+  {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if(i >= m)
+      return;
+    if(finished[i])
+      ids[i] = end_id;
+    else
+    {
+      if(sequence_length != nullptr)
+        sequence_length[i] += 1;
+      finished[i] = ids[i] == end_id;
+    }
+  }
+
+  void update_finished_kernelLauncher(bool* finished, int* sequence_length, int* ids,
+                                      const int end_id, const int m, cudaStream_t stream)
+  {
+    dim3 block(min(m, 256));
+    dim3 grid((m + block.x - 1) / block.x);
+    update_finished_kernel<<<grid, block, 0, stream>>>(finished, sequence_length, ids, end_id, m);
+  }
+
+  __global__ void set_ids_kernel(int* ids, const int id, const int n)
+  {
+    for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x)
+      ids[i] = id;
+  }
+
+  void set_ids_kernelLauncher(int* ids, const int id, const int n, cudaStream_t stream)
+  {
+    dim3 block(256);
+    dim3 grid(min((n + 255) / 256, 1024));
+    set_ids_kernel<<<grid, block, 0, stream>>>(ids, id, n);
+  }
+
   template <typename T>
   __global__ void embedding_lookup_sine_position_encoding_kernel(T* from_tensor,
                                                                 const T* embedding_table, 
@@ -178,15 +215,21 @@ namespace fastertransformer
                                                                        step);
   }
 
+  /* The logits are [m, n_padded], the padded columns n..n_padded-1 are set to -inf so that
+     they are never chosen by the softmax, top-k or top-p sampling. */
   template <typename T>
   __global__ void apply_temperature_penalty_kernel(T* logits,
                                                    const T temperature_inverse,
                                                    const int m,
-                                                   const int n)
+                                                   const int n,
+                                                   const int n_padded)
   {
-      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < m * n; index += blockDim.x * gridDim.x)
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < m * n_padded; index += blockDim.x * gridDim.x)
       {
-          logits[index] = logits[index] * temperature_inverse;
+          if(index % n_padded < n)
+              logits[index] = logits[index] * temperature_inverse;
+          else
+              logits[index] = (T)(-INFINITY);
       }
   }
 
@@ -195,15 +238,119 @@ namespace fastertransformer
                                                 const T temperature,
                                                 const int m,
                                                 const int n,
+                                                const int n_padded,
                                                 cudaStream_t stream)
   {
       dim3 grid(min(m, 65536));
-      dim3 block(min(n, 1024));
+      dim3 block(min(n_padded, 1024));
       const T temperature_inverse = (T)(1.f / (float) temperature);
       apply_temperature_penalty_kernel<T><<<grid, block, 0, stream>>>(logits,
                                                                       temperature_inverse,
                                                                       m,
-                                                                      n);
+                                                                      n,
+                                                                      n_padded);
+  }
+
+  template <typename T>
+  void apply_temperature_penalty_kernelLauncher(T* logits,
+                                                const T temperature,
+                                                const int m,
+                                                const int n,
+                                                cudaStream_t stream)
+  {
+      apply_temperature_penalty_kernelLauncher(logits, temperature, m, n, n, stream);
+  }
+
+  /* in is the [n, hidden_units] embedding kernel, out is its transpose [hidden_units, n_padded]
+     with zeros in the padded columns. */
+  template <typename T>
+  __global__ void transpose_pad_embedding_kernel(T* out,
+                                                 const T* in,
+                                                 const int n,
+                                                 const int n_padded,
+                                                 const int hidden_units)
+  {
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < hidden_units * n_padded; index += blockDim.x * gridDim.x)
+      {
+          const int row = index / n_padded;
+          const int col = index % n_padded;
+          out[index] = col < n ? in[col * hidden_units + row] : (T)(0.0f);
+      }
+  }
+
+  template <typename T>
+  void transpose_pad_embedding_kernelLauncher(T* out,
+                                              const T* in,
+                                              const int n,
+                                              const int n_padded,
+                                              const int hidden_units,
+                                              cudaStream_t stream)
+  {
+      dim3 grid(min(hidden_units, 65536));
+      dim3 block(min(n_padded, 1024));
+      transpose_pad_embedding_kernel<T><<<grid, block, 0, stream>>>(out, in, n, n_padded, hidden_units);
+  }
+
+  /* in is the [hidden_units, n] embedding kernel, out is [hidden_units, n_padded] with zeros in
+     the padded columns. */
+  template <typename T>
+  __global__ void pad_embedding_kernel(T* out,
+                                       const T* in,
+                                       const int n,
+                                       const int n_padded,
+                                       const int hidden_units)
+  {
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < hidden_units * n_padded; index += blockDim.x * gridDim.x)
+      {
+          const int row = index / n_padded;
+          const int col = index % n_padded;
+          out[index] = col < n ? in[row * n + col] : (T)(0.0f);
+      }
+  }
+
+  template <typename T>
+  void pad_embedding_kernelLauncher(T* out,
+                                    const T* in,
+                                    const int n,
+                                    const int n_padded,
+                                    const int hidden_units,
+                                    cudaStream_t stream)
+  {
+      dim3 grid(min(hidden_units, 65536));
+      dim3 block(min(n_padded, 1024));
+      pad_embedding_kernel<T><<<grid, block, 0, stream>>>(out, in, n, n_padded, hidden_units);
+  }
+
+  /* The bias of the padded logits: the bias (or 0 without bias) of the n real columns and the
+     lowest value in the padded ones, so that the padded ids are never chosen by the sampling or
+     the beam search kernels that add the bias. */
+  template <typename T>
+  __global__ void pad_embedding_bias_kernel(T* out,
+                                            const T* in,
+                                            const int n,
+                                            const int n_padded)
+  {
+      const bool IS_FP16 = std::is_same<T, half>::value;
+      const T MAX_T_VAL = (IS_FP16)? HALF_FLT_MAX : FLT_MAX;
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < n_padded; index += blockDim.x * gridDim.x)
+      {
+          if(index < n)
+              out[index] = in != nullptr ? in[index] : (T)(0.0f);
+          else
+              out[index] = -MAX_T_VAL;
+      }
+  }
+
+  template <typename T>
+  void pad_embedding_bias_kernelLauncher(T* out,
+                                         const T* in,
+                                         const int n,
+                                         const int n_padded,
+                                         cudaStream_t stream)
+  {
+      dim3 grid((n_padded + 255) / 256);
+      dim3 block(256);
+      pad_embedding_bias_kernel<T><<<grid, block, 0, stream>>>(out, in, n, n_padded);
   }
 
   /* *************************** end of common kernel *********************************** */
@@ -721,6 +868,402 @@ namespace fastertransformer
   }
 
 
+  __global__ void update_step_log_probs_kernel(const float* cum_log_probs, const float* prev_cum_log_probs,
+                                               const int* parent_ids, float* step_log_probs, const int m)
+  {
+    for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < m; i += gridDim.x * blockDim.x)
+      step_log_probs[i] = cum_log_probs[i] - prev_cum_log_probs[parent_ids[i]];
+  }
+
+  void update_step_log_probs_kernelLauncher(const float* cum_log_probs, const float* prev_cum_log_probs,
+                                            const int* parent_ids, float* step_log_probs,
+                                            const int batch_size, const int beam_width,
+                                            cudaStream_t stream)
+  {
+    const int m = batch_size * beam_width;
+    dim3 block(min(m, 1024));
+    dim3 grid((m + block.x - 1) / block.x);
+    update_step_log_probs_kernel<<<grid, block, 0, stream>>>(cum_log_probs, prev_cum_log_probs,
+                                                            parent_ids, step_log_probs, m);
+  }
+
+  // one block per sentence and one thread per beam
+  __global__ void beam_search_nbest_kernel(const int* output_ids, const int* parent_ids,
+                                           const float* step_log_probs,
+                                           int* nbest_ids, float* nbest_log_probs,
+                                           float* nbest_cum_log_probs, float* nbest_normed_scores,
+                                           int* nbest_lengths,
+                                           const int max_time, const int batch_size,
+                                           const int beam_width, const int seq_len,
+                                           const int end_id, const float length_penalty)
+  {
+    extern __shared__ float s_normed_scores[];
+    const int batch = blockIdx.x;
+    const int beam = threadIdx.x;
+    const int m = batch_size * beam_width;
+
+  #define GET_IX(time_ix, beam_ix) (m * (time_ix) + beam_width * batch + (beam_ix))
+
+    // the hypothesis ends at the first end_id
+    int length = max_time;
+    int cur = beam;
+    for(int t = max_time - 1; t >= 0; t--)
+    {
+      if(output_ids[GET_IX(t, cur)] == end_id) length = t + 1;
+      cur = parent_ids[GET_IX(t, cur)] % beam_width;
+    }
+
+    float cum_log_prob = 0.0f;
+    cur = beam;
+    for(int t = max_time - 1; t >= 0; t--)
+    {
+      if(t < length) cum_log_prob += step_log_probs[GET_IX(t, cur)];
+      cur = parent_ids[GET_IX(t, cur)] % beam_width;
+    }
+    const float normed_score = cum_log_prob / powf((float)length, length_penalty);
+    s_normed_scores[beam] = normed_score;
+    __syncthreads();
+
+    int rank = 0;
+    for(int i = 0; i < beam_width; i++)
+    {
+      if(s_normed_scores[i] > normed_score || (s_normed_scores[i] == normed_score && i < beam))
+        rank++;
+    }
+
+    const int out_ix = batch * beam_width + rank;
+    nbest_cum_log_probs[out_ix] = cum_log_prob;
+    nbest_normed_scores[out_ix] = normed_score;
+    nbest_lengths[out_ix] = length;
+    for(int t = max_time; t < seq_len; t++)
+    {
+      nbest_ids[out_ix * seq_len + t] = end_id;
+      nbest_log_probs[out_ix * seq_len + t] = 0.0f;
+    }
+    cur = beam;
+    for(int t = max_time - 1; t >= 0; t--)
+    {
+      nbest_ids[out_ix * seq_len + t] = t < length ? output_ids[GET_IX(t, cur)] : end_id;
+      nbest_log_probs[out_ix * seq_len + t] = t < length ? step_log_probs[GET_IX(t, cur)] : 0.0f;
+      cur = parent_ids[GET_IX(t, cur)] % beam_width;
+    }
+  #undef GET_IX
+  }
+
+  void beam_search_nbest_kernelLauncher(const int* output_ids, const int* parent_ids,
+                                        const float* step_log_probs,
+                                        int* nbest_ids, float* nbest_log_probs,
+                                        float* nbest_cum_log_probs, float* nbest_normed_scores,
+                                        int* nbest_lengths,
+                                        const int max_time, const int batch_size,
+                                        const int beam_width, const int seq_len,
+                                        const int end_id, const float length_penalty,
+                                        cudaStream_t stream)
+  {
+    assert(beam_width <= 1024);
+    beam_search_nbest_kernel<<<batch_size, beam_width, sizeof(float) * beam_width, stream>>>(
+      output_ids, parent_ids, step_log_probs, nbest_ids, nbest_log_probs,
+      nbest_cum_log_probs, nbest_normed_scores, nbest_lengths,
+      max_time, batch_size, beam_width, seq_len, end_id, length_penalty);
+  }
+
+  template <typename T>
+  __global__ void tile_encoder_output_kernel(const T* encoder_output,
+                                             const int* sequence_length,
+                                             T* memory_tensor,
+                                             int* memory_sequence_length,
+                                             const int batch_size,
+                                             const int beam_width,
+                                             const int mem_size)
+  {
+    // grid: batch_size * beam_width, each block copies one sentence
+    const int bid = blockIdx.x;
+    const int src_id = bid / beam_width;
+    for(int index = threadIdx.x; index < mem_size; index += blockDim.x)
+      memory_tensor[bid * mem_size + index] = encoder_output[src_id * mem_size + index];
+    if(threadIdx.x == 0)
+      memory_sequence_length[bid] = sequence_length[src_id];
+  }
+
+  template <typename T>
+  void tile_encoder_output_kernelLauncher(const T* encoder_output,
+                                          const int* sequence_length,
+                                          T* memory_tensor,
+                                          int* memory_sequence_length,
+                                          const int batch_size,
+                                          const int beam_width,
+                                          const int mem_max_seq_len,
+                                          const int hidden_units,
+                                          cudaStream_t stream)
+  {
+    dim3 grid(batch_size * beam_width);
+    dim3 block(min(mem_max_seq_len * hidden_units, 1024));
+    tile_encoder_output_kernel<T><<<grid, block, 0, stream>>>(encoder_output, sequence_length,
+                                                             memory_tensor, memory_sequence_length,
+                                                             batch_size, beam_width,
+                                                             mem_max_seq_len * hidden_units);
+  }
+
+
+  /* ********************************** Scoring kernel *********************************** */
+
+  template <typename T>
+  __global__ void teacher_forcing_embedding_kernel(T* from_tensor,
+                                                   const T* embedding_table,
+                                                   const T* position_encoding_table,
+                                                   const int* target_ids,
+                                                   const int batch_size,
+                                                   const int seq_len,
+                                                   const int hidden_units,
+                                                   const int start_id)
+  {
+      // the input at position t is the target token of position t - 1
+      T scale = (T)sqrtf(float(hidden_units));
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < batch_size * seq_len * hidden_units; index += blockDim.x * gridDim.x)
+      {
+        const int row_index = index / hidden_units;
+        const int col_index = index % hidden_units;
+        const int t = row_index % seq_len;
+        const int word_id = t == 0 ? start_id : target_ids[row_index - 1];
+        from_tensor[index] = embedding_table[word_id * hidden_units + col_index] * scale
+                             + position_encoding_table[t * hidden_units + col_index];
+      }
+  }
+
+  template <typename T>
+  void teacher_forcing_embedding_kernel_launcher(T* from_tensor,
+                                                 const T* embedding_table,
+                                                 const T* position_encoding_table,
+                                                 const int* target_ids,
+                                                 const int batch_size,
+                                                 const int seq_len,
+                                                 const int hidden_units,
+                                                 const int start_id,
+                                                 cudaStream_t stream)
+  {
+      dim3 grid(min(batch_size * seq_len, 65536));
+      dim3 block(min(hidden_units, 1024));
+      teacher_forcing_embedding_kernel<T><<<grid, block, 0, stream>>>(from_tensor,
+                                                                      embedding_table,
+                                                                      position_encoding_table,
+                                                                      target_ids,
+                                                                      batch_size,
+                                                                      seq_len,
+                                                                      hidden_units,
+                                                                      start_id);
+  }
+
+  /* the rows of a multi-token pass, the position of an inactive row (< 0) is clamped to 0 */
+  template <typename T>
+  __global__ void multi_token_embedding_kernel(T* from_tensor,
+                                               const T* embedding_table,
+                                               const T* position_encoding_table,
+                                               const int* word_ids,
+                                               const int* positions,
+                                               const int rows,
+                                               const int hidden_units)
+  {
+      T scale = (T)sqrtf(float(hidden_units));
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < rows * hidden_units; index += blockDim.x * gridDim.x)
+      {
+        const int row_index = index / hidden_units;
+        const int col_index = index % hidden_units;
+        const int position = max(positions[row_index], 0);
+        from_tensor[index] = embedding_table[word_ids[row_index] * hidden_units + col_index] * scale
+                             + position_encoding_table[position * hidden_units + col_index];
+      }
+  }
+
+  template <typename T>
+  void multi_token_embedding_kernel_launcher(T* from_tensor,
+                                             const T* embedding_table,
+                                             const T* position_encoding_table,
+                                             const int* word_ids,
+                                             const int* positions,
+                                             const int rows,
+                                             const int hidden_units,
+                                             cudaStream_t stream)
+  {
+      dim3 grid(min(rows, 65536));
+      dim3 block(min(hidden_units, 1024));
+      multi_token_embedding_kernel<T><<<grid, block, 0, stream>>>(from_tensor,
+                                                                  embedding_table,
+                                                                  position_encoding_table,
+                                                                  word_ids,
+                                                                  positions,
+                                                                  rows,
+                                                                  hidden_units);
+  }
+
+  /* the packed rows of GPT-2, the embedding is not scaled and row r is at positions[r] */
+  template <typename T>
+  __global__ void packed_embedding_position_lookups_kernel(T* from_tensor,
+                                                           const T* embedding_table,
+                                                           const T* pos_table,
+                                                           const int* word_ids,
+                                                           const int* positions,
+                                                           const int rows,
+                                                           const int hidden_units)
+  {
+      for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < rows * hidden_units; index += blockDim.x * gridDim.x)
+      {
+          const int row_index = index / hidden_units;
+          const int col_index = index % hidden_units;
+          from_tensor[index] = embedding_table[word_ids[row_index] * hidden_units + col_index]
+                              + pos_table[positions[row_index] * hidden_units + col_index];
+      }
+  }
+
+  template <typename T>
+  void packed_embedding_position_lookups_kernel_launcher(T* from_tensor,
+                                                         const T* embedding_table,
+                                                         const T* pos_table,
+                                                         const int* word_ids,
+                                                         const int* positions,
+                                                         const int rows,
+                                                         const int hidden_units,
+                                                         cudaStream_t stream)
+  {
+      dim3 grid(min(rows, 65536));
+      dim3 block(min(hidden_units, 1024));
+      packed_embedding_position_lookups_kernel<T><<<grid, block, 0, stream>>>(from_tensor,
+                                                                              embedding_table,
+                                                                              pos_table,
+                                                                              word_ids,
+                                                                              positions,
+                                                                              rows,
+                                                                              hidden_units);
+  }
+
+  template <typename T>
+  __global__ void gather_rows_kernel(T* dst, const T* src, const int* rows, const int hidden_units)
+  {
+      const T* src_row = src + (size_t)rows[blockIdx.x] * hidden_units;
+      for(int i = threadIdx.x; i < hidden_units; i += blockDim.x)
+          dst[(size_t)blockIdx.x * hidden_units + i] = src_row[i];
+  }
+
+  template <typename T>
+  void gather_rows_kernelLauncher(T* dst, const T* src, const int* rows, const int row_num, const int hidden_units,
+                                  cudaStream_t stream)
+  {
+      if(row_num <= 0)
+          return;
+      gather_rows_kernel<T><<<row_num, min(hidden_units, 1024), 0, stream>>>(dst, src, rows, hidden_units);
+  }
+
+  struct GreedyPair
+  {
+    float val;
+    int id;
+  };
+
+  struct GreedyPairMax
+  {
+    __device__ __forceinline__ GreedyPair operator()(const GreedyPair& a, const GreedyPair& b) const
+    {
+      if(a.id == -1) return b;
+      if(b.id == -1) return a;
+      return (a.val > b.val || (a.val == b.val && a.id < b.id)) ? a : b;
+    }
+  };
+
+  /* one block per row, equal logits prefer the smaller id like the top-1 sampling */
+  template <typename T, int BLOCK_SIZE>
+  __global__ void greedy_ids_kernel(const T* logits, const T* bias, int* ids, const int n)
+  {
+    typedef cub::BlockReduce<GreedyPair, BLOCK_SIZE> BlockReduce;
+    __shared__ typename BlockReduce::TempStorage temp_storage;
+
+    const T* row_logits = logits + (size_t)blockIdx.x * n;
+    GreedyPair best;
+    best.val = -FLT_MAX;
+    best.id = -1;
+    for(int i = threadIdx.x; i < n; i += BLOCK_SIZE)
+    {
+      const float val = (float)row_logits[i] + (bias != nullptr ? (float)bias[i] : 0.0f);
+      if(val > best.val)
+      {
+        best.val = val;
+        best.id = i;
+      }
+    }
+    best = BlockReduce(temp_storage).Reduce(best, GreedyPairMax());
+    if(threadIdx.x == 0)
+      ids[blockIdx.x] = best.id < 0 ? 0 : best.id;
+  }
+
+  template <typename T>
+  void greedy_ids_kernelLauncher(const T* logits, const T* bias, int* ids, const int m, const int n, cudaStream_t stream)
+  {
+    greedy_ids_kernel<T, 256><<<m, 256, 0, stream>>>(logits, bias, ids, n);
+  }
+
+  /* one block per target position, log_softmax(logits + bias)[target_id] */
+  template <int BLOCK_SIZE>
+  __global__ void target_log_probs_kernel(const float* logits, const float* bias,
+                                          const int* target_ids, const int* target_length,
+                                          float* log_probs, const int seq_len, const int vocab_size)
+  {
+    typedef cub::BlockReduce<float, BLOCK_SIZE> BlockReduce;
+    __shared__ typename BlockReduce::TempStorage temp_storage;
+    __shared__ float s_max_val, s_sum;
+
+    const int row = blockIdx.x;
+    if(row % seq_len >= target_length[row / seq_len])
+    {
+      if(threadIdx.x == 0)
+        log_probs[row] = 0.0f;
+      return;
+    }
+
+    const float* row_logits = logits + (size_t)row * vocab_size;
+    float local_max = -FLT_MAX;
+    for(int i = threadIdx.x; i < vocab_size; i += BLOCK_SIZE)
+      local_max = fmaxf(local_max, row_logits[i] + (bias != nullptr ? bias[i] : 0.0f));
+    float max_val = BlockReduce(temp_storage).Reduce(local_max, cub::Max());
+    if(threadIdx.x == 0)
+      s_max_val = max_val;
+    __syncthreads();
+
+    float local_sum = 0.0f;
+    for(int i = threadIdx.x; i < vocab_size; i += BLOCK_SIZE)
+      local_sum += __expf(row_logits[i] + (bias != nullptr ? bias[i] : 0.0f) - s_max_val);
+    float sum = BlockReduce(temp_storage).Sum(local_sum);
+    if(threadIdx.x == 0)
+    {
+      s_sum = sum;
+      const int id = target_ids[row];
+      log_probs[row] = row_logits[id] + (bias != nullptr ? bias[id] : 0.0f) - s_max_val - __logf(s_sum);
+    }
+  }
+
+  __global__ void sum_target_log_probs_kernel(const float* log_probs, float* cum_log_probs,
+                                              const int batch_size, const int seq_len)
+  {
+    const int batch = blockIdx.x * blockDim.x + threadIdx.x;
+    if(batch >= batch_size) return;
+    float sum = 0.0f;
+    for(int t = 0; t < seq_len; t++)
+      sum += log_probs[batch * seq_len + t];
+    cum_log_probs[batch] = sum;
+  }
+
+  void target_log_probs_kernelLauncher(const float* logits, const float* bias,
+                                       const int* target_ids, const int* target_length,
+                                       float* log_probs, float* cum_log_probs,
+                                       const int batch_size, const int seq_len, const int vocab_size,
+                                       cudaStream_t stream)
+  {
+    const int block_size = 256;
+    target_log_probs_kernel<block_size><<<batch_size * seq_len, block_size, 0, stream>>>(
+      logits, bias, target_ids, target_length, log_probs, seq_len, vocab_size);
+    if(cum_log_probs != nullptr)
+      sum_target_log_probs_kernel<<<(batch_size + 127) / 128, 128, 0, stream>>>(
+        log_probs, cum_log_probs, batch_size, seq_len);
+  }
+
+  /* *************************** end of Scoring kernel *********************************** */
 
   /* ********************************** Instantiation *********************************** */
   template 
@@ -773,6 +1316,60 @@ namespace fastertransformer
                                                          const int n,
                                                          cudaStream_t stream);
 
+  template void apply_temperature_penalty_kernelLauncher(float* logits,
+                                                         const float temperature,
+                                                         const int m,
+                                                         const int n,
+                                                         const int n_padded,
+                                                         cudaStream_t stream);
+
+  template void apply_temperature_penalty_kernelLauncher(half* logits,
+                                                         const half temperature,
+                                                         const int m,
+                                                         const int n,
+                                                         const int n_padded,
+                                                         cudaStream_t stream);
+
+  template void transpose_pad_embedding_kernelLauncher(float* out,
+                                                       const float* in,
+                                                       const int n,
+                                                       const int n_padded,
+                                                       const int hidden_units,
+                                                       cudaStream_t stream);
+
+  template void transpose_pad_embedding_kernelLauncher(half* out,
+                                                       const half* in,
+                                                       const int n,
+                                                       const int n_padded,
+                                                       const int hidden_units,
+                                                       cudaStream_t stream);
+
+  template void pad_embedding_kernelLauncher(float* out,
+                                             const float* in,
+                                             const int n,
+                                             const int n_padded,
+                                             const int hidden_units,
+                                             cudaStream_t stream);
+
+  template void pad_embedding_kernelLauncher(half* out,
+                                             const half* in,
+                                             const int n,
+                                             const int n_padded,
+                                             const int hidden_units,
+                                             cudaStream_t stream);
+
+  template void pad_embedding_bias_kernelLauncher(float* out,
+                                                  const float* in,
+                                                  const int n,
+                                                  const int n_padded,
+                                                  cudaStream_t stream);
+
+  template void pad_embedding_bias_kernelLauncher(half* out,
+                                                  const half* in,
+                                                  const int n,
+                                                  const int n_padded,
+                                                  cudaStream_t stream);
+
   template void update_KV_cache_kernelLauncher(float** key_cache,
                                                float** value_cache,
                                                const int* beam_ids,
@@ -855,6 +1452,94 @@ namespace fastertransformer
                                    const int batch_size,
                                    const int beam_width,
                                    cudaStream_t stream);
+
+  template void tile_encoder_output_kernelLauncher(const float* encoder_output,
+                                                   const int* sequence_length,
+                                                   float* memory_tensor,
+                                                   int* memory_sequence_length,
+                                                   const int batch_size,
+                                                   const int beam_width,
+                                                   const int mem_max_seq_len,
+                                                   const int hidden_units,
+                                                   cudaStream_t stream);
+
+  template void tile_encoder_output_kernelLauncher(const half* encoder_output,
+                                                   const int* sequence_length,
+                                                   half* memory_tensor,
+                                                   int* memory_sequence_length,
+                                                   const int batch_size,
+                                                   const int beam_width,
+                                                   const int mem_max_seq_len,
+                                                   const int hidden_units,
+                                                   cudaStream_t stream);
+
+  template void teacher_forcing_embedding_kernel_launcher(float* from_tensor,
+                                                          const float* embedding_table,
+                                                          const float* position_encoding_table,
+                                                          const int* target_ids,
+                                                          const int batch_size,
+                                                          const int seq_len,
+                                                          const int hidden_units,
+                                                          const int start_id,
+                                                          cudaStream_t stream);
+
+  template void teacher_forcing_embedding_kernel_launcher(half* from_tensor,
+                                                          const half* embedding_table,
+                                                          const half* position_encoding_table,
+                                                          const int* target_ids,
+                                                          const int batch_size,
+                                                          const int seq_len,
+                                                          const int hidden_units,
+                                                          const int start_id,
+                                                          cudaStream_t stream);
+
+  template void multi_token_embedding_kernel_launcher(float* from_tensor,
+                                                      const float* embedding_table,
+                                                      const float* position_encoding_table,
+                                                      const int* word_ids,
+                                                      const int* positions,
+                                                      const int rows,
+                                                      const int hidden_units,
+                                                      cudaStream_t stream);
+
+  template void multi_token_embedding_kernel_launcher(half* from_tensor,
+                                                      const half* embedding_table,
+                                                      const half* position_encoding_table,
+                                                      const int* word_ids,
+                                                      const int* positions,
+                                                      const int rows,
+                                                      const int hidden_units,
+                                                      cudaStream_t stream);
+
+  template void packed_embedding_position_lookups_kernel_launcher(float* from_tensor,
+                                                                  const float* embedding_table,
+                                                                  const float* pos_table,
+                                                                  const int* word_ids,
+                                                                  const int* positions,
+                                                                  const int rows,
+                                                                  const int hidden_units,
+                                                                  cudaStream_t stream);
+
+  template void gather_rows_kernelLauncher(float* dst, const float* src, const int* rows, const int row_num,
+                                           const int hidden_units, cudaStream_t stream);
+
+  template void packed_embedding_position_lookups_kernel_launcher(half* from_tensor,
+                                                                  const half* embedding_table,
+                                                                  const half* pos_table,
+                                                                  const int* word_ids,
+                                                                  const int* positions,
+                                                                  const int rows,
+                                                                  const int hidden_units,
+                                                                  cudaStream_t stream);
+
+  template void gather_rows_kernelLauncher(half* dst, const half* src, const int* rows, const int row_num,
+                                           const int hidden_units, cudaStream_t stream);
+
+  template void greedy_ids_kernelLauncher(const float* logits, const float* bias, int* ids,
+                                          const int m, const int n, cudaStream_t stream);
+
+  template void greedy_ids_kernelLauncher(const half* logits, const half* bias, int* ids,
+                                          const int m, const int n, cudaStream_t stream);
   /* *************************** end of Instantiation *********************************** */
 
 } // end of name space fastertransformer
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Device side helpers of KernelVariantTable: the SM of the key and the timing
+ * of the variant benchmarks.
+ **/
+
+#pragma once
+#include "fastertransformer/common.h"
+#include "fastertransformer/kernel_variant_table.h"
+#include <cuda_runtime.h>
+
+namespace fastertransformer
+{
+
+/* SM version of the current device */
+inline int current_sm_version()
+{
+  int device, major, minor;
+  check_cuda_error(cudaGetDevice(&device));
+  check_cuda_error(cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, device));
+  check_cuda_error(cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor, device));
+  return major * 10 + minor;
+}
+
+/* The variant of the key on the current device, tune times it on a miss. It is called when an op
+   is built or warmed up and the op passes the result to its launches, never once per launch. */
+inline int select_kernel_variant(const char *kernel, const int is_fp16, const KernelShape &shape,
+                                 const int default_variant, const bool tune = false)
+{
+  return KernelVariantTable::instance().resolve(kernel, current_sm_version(), is_fp16, shape, default_variant, tune);
+}
+
+/* average ms of ite calls of launch on stream, after a warm up call */
+template <typename F>
+float time_kernel_variant(F launch, cudaStream_t stream, const int ite = 20)
+{
+  cudaEvent_t start, stop;
+  check_cuda_error(cudaEventCreate(&start));
+  check_cuda_error(cudaEventCreate(&stop));
+  launch();
+  check_cuda_error(cudaEventRecord(start, stream));
+  for (int i = 0; i < ite; i++)
+    launch();
+  check_cuda_error(cudaEventRecord(stop, stream));
+  check_cuda_error(cudaEventSynchronize(stop));
+  check_cuda_error(cudaGetLastError());
+  float time = 0.0f;
+  check_cuda_error(cudaEventElapsedTime(&time, start, stop));
+  check_cuda_error(cudaEventDestroy(start));
+  check_cuda_error(cudaEventDestroy(stop));
+  return time / ite;
+}
+
+/* zeroed device scratch of a benchmark, the sub-buffers are 16 byte aligned */
+class KernelBenchmarkBuffer
+{
+private:
+  char *buf_;
+  size_t size_;
+  size_t offset_;
+
+public:
+  KernelBenchmarkBuffer(const size_t size) : size_(size), offset_(0)
+  {
+    check_cuda_error(cudaMalloc((void **)&buf_, size_));
+    check_cuda_error(cudaMemset(buf_, 0, size_));
+  }
+
+  /* the next num elements of T, size should count 16 bytes of padding per sub-buffer */
+  template <typename T>
+  T *take(const size_t num)
+  {
+    T *ptr = (T *)(buf_ + offset_);
+    offset_ += (sizeof(T) * num + 15) / 16 * 16;
+    if (offset_ > size_)
+    {
+      printf("[ERROR][KernelBenchmarkBuffer] %ld bytes are needed, but only %ld bytes are allocated. \n", offset_, size_);
+      exit(-1);
+    }
+    return ptr;
+  }
+
+  ~KernelBenchmarkBuffer()
+  {
+    check_cuda_error(cudaFree(buf_));
+  }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/cuda/layernorm_kernels.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include <assert.h>
+
+namespace fastertransformer
+{
+
+#define LAYERNORM_EPSILON 1e-6f
+#define LAYERNORM_MAX_ITEMS 8     // 16 byte vectors per thread of the vectorized kernel
+
+/* The specialization table, X(hidden size, 16 byte vectors per thread). The blocks of a
+   specialized kernel have hidden size / (vector width * vectors per thread) threads, which
+   should be a multiple of 32. */
+#define LAYERNORM_FLOAT_SPECIALIZATIONS(X) \
+  X(768, 2) X(1024, 2) X(1280, 2) X(1536, 2) X(2048, 2) X(2560, 4) X(3072, 4) \
+  X(4096, 4) X(5120, 4) X(8192, 8) X(12288, 8)
+
+#define LAYERNORM_HALF_SPECIALIZATIONS(X) \
+  X(768, 1) X(1024, 1) X(1280, 1) X(1536, 1) X(2048, 2) X(2560, 2) X(3072, 2) \
+  X(4096, 2) X(5120, 4) X(8192, 4) X(12288, 4)
+
+/* 16 byte vector of T, converted to and from float */
+template <typename T>
+struct Vec16;
+
+template <>
+struct Vec16<float>
+{
+  typedef float4 Type;
+  static const int ELEMS = 4;
+
+  static __device__ __forceinline__ void to_float(const float4 v, float* dst)
+  {
+    dst[0] = v.x; dst[1] = v.y; dst[2] = v.z; dst[3] = v.w;
+  }
+
+  static __device__ __forceinline__ float4 from_float(const float* src)
+  {
+    return make_float4(src[0], src[1], src[2], src[3]);
+  }
+};
+
+template <>
+struct Vec16<half>
+{
+  typedef uint4 Type;
+  static const int ELEMS = 8;
+
+  static __device__ __forceinline__ void to_float(const uint4 v, float* dst)
+  {
+    const half2* h = reinterpret_cast<const half2*>(&v);
+    #pragma unroll
+    for(int i = 0; i < 4; i++)
+    {
+      float2 f = __half22float2(h[i]);
+      dst[2 * i] = f.x;
+      dst[2 * i + 1] = f.y;
+    }
+  }
+
+  static __device__ __forceinline__ uint4 from_float(const float* src)
+  {
+    uint4 v;
+    half2* h = reinterpret_cast<half2*>(&v);
+    #pragma unroll
+    for(int i = 0; i < 4; i++)
+      h[i] = __floats2half2_rn(src[2 * i], src[2 * i + 1]);
+    return v;
+  }
+};
+
+template <typename T>
+__inline__ __device__
+T warpReduceSum(T val)
+{
+  for(int mask = 16; mask > 0; mask >>= 1)
+    val += __shfl_xor_sync(FINAL_MASK, val, mask, 32);
+  return val;
+}
+
+/* blockDim.x should be a multiple of 32 */
+template <typename T>
+__inline__ __device__
+T blockReduceSum(T val)
+{
+  static __shared__ T shared[32];
+  int lane = threadIdx.x & 0x1f;
+  int wid = threadIdx.x >> 5;
+
+  val = warpReduceSum<T>(val);
+
+  if(lane == 0)
+    shared[wid] = val;
+  __syncthreads();
+
+  val = (threadIdx.x < (blockDim.x >> 5 )) ? shared[lane] : (T)0.0f;
+  val = warpReduceSum(val);
+  return val;
+}
+
+/* merge the Welford state (b_count, b_mean, b_m2) into (count, mean, m2) */
+__inline__ __device__
+void welfordCombine(float& count, float& mean, float& m2, const float b_count, const float b_mean, const float b_m2)
+{
+  const float new_count = count + b_count;
+  if(new_count == 0.0f)
+    return;
+  const float delta = b_mean - mean;
+  const float b_ratio = b_count / new_count;
+  mean += delta * b_ratio;
+  m2 += b_m2 + delta * delta * count * b_ratio;
+  count = new_count;
+}
+
+__inline__ __device__
+void warpReduceWelford(float& count, float& mean, float& m2)
+{
+  for(int mask = 16; mask > 0; mask >>= 1)
+  {
+    const float b_count = __shfl_xor_sync(FINAL_MASK, count, mask, 32);
+    const float b_mean = __shfl_xor_sync(FINAL_MASK, mean, mask, 32);
+    const float b_m2 = __shfl_xor_sync(FINAL_MASK, m2, mask, 32);
+    welfordCombine(count, mean, m2, b_count, b_mean, b_m2);
+  }
+}
+
+/* the result is valid in the first warp, blockDim.x should be a multiple of 32 */
+__inline__ __device__
+void blockReduceWelford(float& count, float& mean, float& m2)
+{
+  static __shared__ float s_count[32];
+  static __shared__ float s_mean[32];
+  static __shared__ float s_m2[32];
+  int lane = threadIdx.x & 0x1f;
+  int wid = threadIdx.x >> 5;
+
+  warpReduceWelford(count, mean, m2);
+  if(lane == 0)
+  {
+    s_count[wid] = count;
+    s_mean[wid] = mean;
+    s_m2[wid] = m2;
+  }
+  __syncthreads();
+
+  if(wid == 0)
+  {
+    const bool valid = threadIdx.x < (blockDim.x >> 5);
+    count = valid ? s_count[lane] : 0.0f;
+    mean = valid ? s_mean[lane] : 0.0f;
+    m2 = valid ? s_m2[lane] : 0.0f;
+    warpReduceWelford(count, mean, m2);
+  }
+}
+
+/**
+ * One block per row, each thread keeps ITEMS 16 byte vectors of the row in registers.
+ * N > 0 is a size of the specialization table: the block is exactly N / (ELEMS * ITEMS)
+ * threads and there is no bounds check. N == 0 uses n and checks the bounds.
+ **/
+template <typename T, int ITEMS, int N>
+__global__
+void add_bias_input_layernorm_vec(T* out, const T* __restrict input, const T* __restrict bias,
+                                  const T* __restrict gamma, const T* __restrict beta, const int n_)
+{
+  typedef typename Vec16<T>::Type VecT;
+  const int ELEMS = Vec16<T>::ELEMS;
+  const int n = N > 0 ? N : n_;
+  const int vec_n = n / ELEMS;
+  const int block = N > 0 ? N / (ELEMS * ITEMS) : blockDim.x;
+  const int tid = threadIdx.x;
+
+  VecT* out_ptr = reinterpret_cast<VecT*>(out + (size_t)blockIdx.x * n);
+  const VecT* input_ptr = input != nullptr ? reinterpret_cast<const VecT*>(input + (size_t)blockIdx.x * n) : nullptr;
+  const VecT* bias_ptr = reinterpret_cast<const VecT*>(bias);
+  const VecT* gamma_ptr = reinterpret_cast<const VecT*>(gamma);
+  const VecT* beta_ptr = reinterpret_cast<const VecT*>(beta);
+
+  __shared__ float s_mean;
+  __shared__ float s_variance;
+  float local_out[ITEMS * ELEMS];
+  float tmp[ELEMS];
+
+  float sum = 0.0f;
+  #pragma unroll
+  for(int i = 0; i < ITEMS; i++)
+  {
+    const int col_id = i * block + tid;
+    if(N > 0 || col_id < vec_n)
+    {
+      Vec16<T>::to_float(out_ptr[col_id], local_out + i * ELEMS);
+      if(input_ptr != nullptr)
+      {
+        Vec16<T>::to_float(__ldg(&input_ptr[col_id]), tmp);
+        #pragma unroll
+        for(int j = 0; j < ELEMS; j++)
+          local_out[i * ELEMS + j] += tmp[j];
+      }
+      if(bias_ptr != nullptr)
+      {
+        Vec16<T>::to_float(__ldg(&bias_ptr[col_id]), tmp);
+        #pragma unroll
+        for(int j = 0; j < ELEMS; j++)
+          local_out[i * ELEMS + j] += tmp[j];
+      }
+      #pragma unroll
+      for(int j = 0; j < ELEMS; j++)
+        sum += local_out[i * ELEMS + j];
+    }
+  }
+
+  const float mean = blockReduceSum<float>(sum);
+  if(tid == 0)
+    s_mean = mean / n;
+  __syncthreads();
+
+  float var = 0.0f;
+  #pragma unroll
+  for(int i = 0; i < ITEMS; i++)
+  {
+    if(N > 0 || i * block + tid < vec_n)
+    {
+      #pragma unroll
+      for(int j = 0; j < ELEMS; j++)
+      {
+        const float diff = local_out[i * ELEMS + j] - s_mean;
+        var += diff * diff;
+      }
+    }
+  }
+
+  const float variance = blockReduceSum<float>(var);
+  if(tid == 0)
+    s_variance = rsqrtf(variance / n + LAYERNORM_EPSILON);
+  __syncthreads();
+
+  float reg_gamma[ELEMS];
+  float reg_beta[ELEMS];
+  #pragma unroll
+  for(int i = 0; i < ITEMS; i++)
+  {
+    const int col_id = i * block + tid;
+    if(N > 0 || col_id < vec_n)
+    {
+      Vec16<T>::to_float(__ldg(&gamma_ptr[col_id]), reg_gamma);
+      Vec16<T>::to_float(__ldg(&beta_ptr[col_id]), reg_beta);
+      #pragma unroll
+      for(int j = 0; j < ELEMS; j++)
+        tmp[j] = (local_out[i * ELEMS + j] - s_mean) * s_variance * reg_gamma[j] + reg_beta[j];
+      out_ptr[col_id] = Vec16<T>::from_float(tmp);
+    }
+  }
+}
+
+/* Any n and alignment: a loop over the row with a Welford reduction, the row is read twice. */
+template <typename T>
+__global__
+void add_bias_input_layernorm_welford(T* out, const T* __restrict input, const T* __restrict bias,
+                                      const T* __restrict gamma, const T* __restrict beta, const int n)
+{
+  T* row_out = out + (size_t)blockIdx.x * n;
+  const T* row_input = input != nullptr ? input + (size_t)blockIdx.x * n : nullptr;
+
+  __shared__ float s_mean;
+  __shared__ float s_variance;
+
+  float count = 0.0f;
+  float mean = 0.0f;
+  float m2 = 0.0f;
+  for(int i = threadIdx.x; i < n; i += blockDim.x)
+  {
+    float val = (float)row_out[i];
+    if(row_input != nullptr)
+      val += (float)__ldg(&row_input[i]);
+    if(bias != nullptr)
+      val += (float)__ldg(&bias[i]);
+    count += 1.0f;
+    const float delta = val - mean;
+    mean += delta / count;
+    m2 += delta * (val - mean);
+  }
+
+  blockReduceWelford(count, mean, m2);
+  if(threadIdx.x == 0)
+  {
+    s_mean = mean;
+    s_variance = rsqrtf(m2 / n + LAYERNORM_EPSILON);
+  }
+  __syncthreads();
+
+  for(int i = threadIdx.x; i < n; i += blockDim.x)
+  {
+    float val = (float)row_out[i];
+    if(row_input != nullptr)
+      val += (float)__ldg(&row_input[i]);
+    if(bias != nullptr)
+      val += (float)__ldg(&bias[i]);
+    row_out[i] = (T)((val - s_mean) * s_variance * (float)__ldg(&gamma[i]) + (float)__ldg(&beta[i]));
+  }
+}
+
+template <ActivationType ACT>
+__inline__ __device__
+float activation(const float x);
+
+template <>
+__inline__ __device__
+float activation<ActivationType::GELU>(const float x)
+{
+  float cdf = 0.5f * (1.0f + tanhf((0.7978845608028654f * (x + 0.044715f * x * x * x))));
+  return x * cdf;
+}
+
+template <>
+__inline__ __device__
+float activation<ActivationType::RELU>(const float x)
+{
+  return x > 0.0f ? x : 0.0f;
+}
+
+/* grid-stride loop over the 16 byte vectors of out, vec_n vectors per row */
+template <typename T, ActivationType ACT>
+__global__
+void add_bias_act_vec(T* out, const T* __restrict bias, const int m, const int vec_n)
+{
+  typedef typename Vec16<T>::Type VecT;
+  const int ELEMS = Vec16<T>::ELEMS;
+  VecT* out_ptr = reinterpret_cast<VecT*>(out);
+  const VecT* bias_ptr = reinterpret_cast<const VecT*>(bias);
+
+  float val[ELEMS];
+  float reg_bias[ELEMS];
+  const size_t size = (size_t)m * vec_n;
+  for(size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < size; id += (size_t)blockDim.x * gridDim.x)
+  {
+    Vec16<T>::to_float(out_ptr[id], val);
+    Vec16<T>::to_float(__ldg(&bias_ptr[id % vec_n]), reg_bias);
+    #pragma unroll
+    for(int j = 0; j < ELEMS; j++)
+      val[j] = activation<ACT>(val[j] + reg_bias[j]);
+    out_ptr[id] = Vec16<T>::from_float(val);
+  }
+}
+
+template <typename T, ActivationType ACT>
+__global__
+void add_bias_act_scalar(T* out, const T* __restrict bias, const int m, const int n)
+{
+  const size_t size = (size_t)m * n;
+  for(size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < size; id += (size_t)blockDim.x * gridDim.x)
+    out[id] = (T)activation<ACT>((float)out[id] + (float)__ldg(&bias[id % n]));
+}
+
+template <typename T>
+bool is_aligned16(const T* ptr)
+{
+  return ((size_t)ptr & 15) == 0;
+}
+
+#define LAYERNORM_ITEMS(N, ITEMS) \
+  case N: \
+    return ITEMS;
+
+#define LAYERNORM_LAUNCH(N, ITEMS) \
+  case N: \
+    add_bias_input_layernorm_vec<T, ITEMS, N><<<m, N / (Vec16<T>::ELEMS * ITEMS), 0, stream>>>( \
+      out, input, bias, gamma, beta, n); \
+    break;
+
+/* vectors per thread of the kernel specialized for n, 0 if n is not in the table */
+template <typename T>
+int layernorm_specialization_items(const int n);
+
+template <>
+int layernorm_specialization_items<float>(const int n)
+{
+  switch(n)
+  {
+    LAYERNORM_FLOAT_SPECIALIZATIONS(LAYERNORM_ITEMS)
+    default:
+      return 0;
+  }
+}
+
+template <>
+int layernorm_specialization_items<half>(const int n)
+{
+  switch(n)
+  {
+    LAYERNORM_HALF_SPECIALIZATIONS(LAYERNORM_ITEMS)
+    default:
+      return 0;
+  }
+}
+
+/* n should be in the specialization table of T */
+template <typename T>
+void add_bias_input_layernorm_specialized(T* out, const T* input, const T* bias, const T* gamma, const T* beta,
+                                          const int m, const int n, cudaStream_t stream);
+
+template <>
+void add_bias_input_layernorm_specialized(float* out, const float* input, const float* bias,
+                                          const float* gamma, const float* beta,
+                                          const int m, const int n, cudaStream_t stream)
+{
+  typedef float T;
+  switch(n)
+  {
+    LAYERNORM_FLOAT_SPECIALIZATIONS(LAYERNORM_LAUNCH)
+    default:
+      assert(false);
+  }
+}
+
+template <>
+void add_bias_input_layernorm_specialized(half* out, const half* input, const half* bias,
+                                          const half* gamma, const half* beta,
+                                          const int m, const int n, cudaStream_t stream)
+{
+  typedef half T;
+  switch(n)
+  {
+    LAYERNORM_HALF_SPECIALIZATIONS(LAYERNORM_LAUNCH)
+    default:
+      assert(false);
+  }
+}
+
+template <typename T>
+bool is_layernorm_specialized(const int n)
+{
+  return layernorm_specialization_items<T>(n) > 0;
+}
+
+template <typename T>
+void add_bias_input_layernorm_generic_kernelLauncher(T* out, const T* input, const T* bias,
+                                                     const T* gamma, const T* beta, const int m, const int n,
+                                                     cudaStream_t stream)
+{
+  const int elems = Vec16<T>::ELEMS;
+  const bool vectorized = n % elems == 0 && is_aligned16(out) && is_aligned16(input) && is_aligned16(bias) &&
+                          is_aligned16(gamma) && is_aligned16(beta);
+  const int vec_n = n / elems;
+  dim3 grid(m);
+
+  if(vectorized && is_layernorm_specialized<T>(n))
+  {
+    add_bias_input_layernorm_specialized<T>(out, input, bias, gamma, beta, m, n, stream);
+  }
+  else if(vectorized && vec_n <= LAYERNORM_MAX_ITEMS * 1024)
+  {
+    // the fewest vectors per thread that keep the block within 256 threads
+    int items = 1;
+    while(items < LAYERNORM_MAX_ITEMS && vec_n > items * 256)
+      items *= 2;
+    dim3 block((vec_n + items - 1) / items);
+    block.x = (block.x + 31) / 32 * 32;
+
+    if(items == 1)
+      add_bias_input_layernorm_vec<T, 1, 0><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, n);
+    else if(items == 2)
+      add_bias_input_layernorm_vec<T, 2, 0><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, n);
+    else if(items == 4)
+      add_bias_input_layernorm_vec<T, 4, 0><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, n);
+    else
+      add_bias_input_layernorm_vec<T, 8, 0><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, n);
+  }
+  else
+  {
+    dim3 block(min((n + 31) / 32 * 32, 1024));
+    add_bias_input_layernorm_welford<T><<<grid, block, 0, stream>>>(out, input, bias, gamma, beta, n);
+  }
+#ifndef NDEBUG
+  cudaDeviceSynchronize();
+  check_cuda_error(cudaGetLastError());
+#endif
+}
+
+template <typename T>
+void add_bias_act_generic_kernelLauncher(T* out, const T* bias, const int m, const int n,
+                                         const ActivationType activation_type, cudaStream_t stream)
+{
+  const int elems = Vec16<T>::ELEMS;
+  const bool vectorized = n % elems == 0 && is_aligned16(out) && is_aligned16(bias);
+  const size_t size = vectorized ? (size_t)m * n / elems : (size_t)m * n;
+  dim3 block(256);
+  dim3 grid((unsigned int)((size + block.x - 1) / block.x < 65536 ? (size + block.x - 1) / block.x : 65536));
+
+  if(vectorized)
+  {
+    if(activation_type == ActivationType::RELU)
+      add_bias_act_vec<T, ActivationType::RELU><<<grid, block, 0, stream>>>(out, bias, m, n / elems);
+    else
+      add_bias_act_vec<T, ActivationType::GELU><<<grid, block, 0, stream>>>(out, bias, m, n / elems);
+  }
+  else
+  {
+    if(activation_type == ActivationType::RELU)
+      add_bias_act_scalar<T, ActivationType::RELU><<<grid, block, 0, stream>>>(out, bias, m, n);
+    else
+      add_bias_act_scalar<T, ActivationType::GELU><<<grid, block, 0, stream>>>(out, bias, m, n);
+  }
+#ifndef NDEBUG
+  cudaDeviceSynchronize();
+  check_cuda_error(cudaGetLastError());
+#endif
+}
+
+template bool is_layernorm_specialized<float>(const int n);
+
+template bool is_layernorm_specialized<half>(const int n);
+
+template void add_bias_input_layernorm_generic_kernelLauncher(float* out, const float* input, const float* bias,
+                                                              const float* gamma, const float* beta,
+                                                              const int m, const int n, cudaStream_t stream);
+
+template void add_bias_input_layernorm_generic_kernelLauncher(half* out, const half* input, const half* bias,
+                                                              const half* gamma, const half* beta,
+                                                              const int m, const int n, cudaStream_t stream);
+
+template void add_bias_act_generic_kernelLauncher(float* out, const float* bias, const int m, const int n,
+                                                  const ActivationType activation_type, cudaStream_t stream);
+
+template void add_bias_act_generic_kernelLauncher(half* out, const half* bias, const int m, const int n,
+                                                  const ActivationType activation_type, cudaStream_t stream);
+
+} // namespace fastertransformer
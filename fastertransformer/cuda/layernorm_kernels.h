@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Layer normalization and bias + activation kernels of any hidden size
+ *
+ * A row is processed by one block with 128-bit loads (4 floats or 8 halves)
+ * and several vectors per thread kept in registers, the mean and the variance
+ * are reduced in two passes in float. The common hidden sizes are listed in a
+ * specialization table and get kernels compiled for their exact size, without
+ * bounds checks. Other sizes use the same kernel with a runtime size, and the
+ * sizes that are not a multiple of the vector width (or too large for the
+ * registers) fall back to a loop with a Welford reduction.
+ **/
+
+#pragma once
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include "fastertransformer/common.h"
+#include "fastertransformer/common_structure.h"
+
+namespace fastertransformer
+{
+
+/* out = layernorm(out + input + bias) * gamma + beta for each of the m rows of n elements,
+   input and bias can be nullptr. */
+template <typename T>
+void add_bias_input_layernorm_generic_kernelLauncher(T* out, const T* input, const T* bias,
+                                                     const T* gamma, const T* beta, const int m, const int n,
+                                                     cudaStream_t stream);
+
+/* out = act(out + bias), out is [m, n] and bias is [n]. */
+template <typename T>
+void add_bias_act_generic_kernelLauncher(T* out, const T* bias, const int m, const int n,
+                                         const ActivationType activation_type, cudaStream_t stream);
+
+/* whether add_bias_input_layernorm_generic_kernelLauncher has a kernel specialized for n */
+template <typename T>
+bool is_layernorm_specialized(const int n);
+
+} // namespace fastertransformer
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/cuda/moe_kernels.h"
+#include "cub/cub.cuh"
+#include <cfloat>
+
+namespace fastertransformer
+{
+
+#define MOE_FINAL_MASK 0xffffffff
+#define MOE_GATING_WARPS_PER_BLOCK 4
+#define MOE_PERMUTE_BLOCK_SIZE 256
+
+__inline__ __device__
+void moe_warp_argmax(float& val, int& idx)
+{
+  for(int mask = 16; mask > 0; mask >>= 1)
+  {
+    float other_val = __shfl_xor_sync(MOE_FINAL_MASK, val, mask, 32);
+    int other_idx = __shfl_xor_sync(MOE_FINAL_MASK, idx, mask, 32);
+    if(other_val > val || (other_val == val && other_idx < idx))
+    {
+      val = other_val;
+      idx = other_idx;
+    }
+  }
+}
+
+__inline__ __device__
+float moe_warp_sum(float val)
+{
+  for(int mask = 16; mask > 0; mask >>= 1)
+    val += __shfl_xor_sync(MOE_FINAL_MASK, val, mask, 32);
+  return val;
+}
+
+/* one warp per token */
+template <typename T>
+__global__
+void moe_topk_gating_kernel(const T* gating_logits, const T* gating_bias,
+                            int* expert_ids, float* gate_weights,
+                            const int m, const int expert_num, const int moe_k)
+{
+  const int lane = threadIdx.x % 32;
+  const int token = blockIdx.x * MOE_GATING_WARPS_PER_BLOCK + threadIdx.x / 32;
+  if(token >= m) return;
+
+  const T* logits = gating_logits + token * expert_num;
+
+  float max_val = -FLT_MAX;
+  for(int e = lane; e < expert_num; e += 32)
+  {
+    float val = (float)logits[e] + (gating_bias != nullptr ? (float)gating_bias[e] : 0.0f);
+    max_val = fmaxf(max_val, val);
+  }
+  int unused_idx = 0;
+  moe_warp_argmax(max_val, unused_idx);
+
+  float sum = 0.0f;
+  for(int e = lane; e < expert_num; e += 32)
+  {
+    float val = (float)logits[e] + (gating_bias != nullptr ? (float)gating_bias[e] : 0.0f);
+    sum += __expf(val - max_val);
+  }
+  sum = moe_warp_sum(sum);
+
+  int selected[MOE_MAX_K];
+  float selected_val[MOE_MAX_K];
+  for(int k = 0; k < moe_k; k++)
+  {
+    float best_val = -FLT_MAX;
+    int best_idx = expert_num;
+    for(int e = lane; e < expert_num; e += 32)
+    {
+      bool is_selected = false;
+      for(int j = 0; j < k; j++)
+        if(selected[j] == e) is_selected = true;
+      if(is_selected) continue;
+
+      float val = (float)logits[e] + (gating_bias != nullptr ? (float)gating_bias[e] : 0.0f);
+      if(val > best_val || (val == best_val && e < best_idx))
+      {
+        best_val = val;
+        best_idx = e;
+      }
+    }
+    moe_warp_argmax(best_val, best_idx);
+    selected[k] = best_idx;
+    selected_val[k] = __expf(best_val - max_val) / sum;
+  }
+
+  float selected_sum = 0.0f;
+  for(int k = 0; k < moe_k; k++)
+    selected_sum += selected_val[k];
+
+  if(lane == 0)
+  {
+    for(int k = 0; k < moe_k; k++)
+    {
+      expert_ids[token * moe_k + k] = selected[k];
+      gate_weights[token * moe_k + k] = moe_k > 1 ? selected_val[k] / selected_sum : selected_val[k];
+    }
+  }
+}
+
+template <typename T>
+void moe_topk_gating_kernelLauncher(const T* gating_logits, const T* gating_bias,
+                                    int* expert_ids, float* gate_weights,
+                                    const int m, const int expert_num, const int moe_k,
+                                    cudaStream_t stream)
+{
+  dim3 grid((m + MOE_GATING_WARPS_PER_BLOCK - 1) / MOE_GATING_WARPS_PER_BLOCK);
+  dim3 block(MOE_GATING_WARPS_PER_BLOCK * 32);
+  moe_topk_gating_kernel<T><<<grid, block, 0, stream>>>(gating_logits, gating_bias, expert_ids, gate_weights,
+                                                        m, expert_num, moe_k);
+}
+
+/* A single block walks the (k, token) pairs in chunks. The rank of a pair in its expert
+   is the number of earlier pairs routed to the same expert, which keeps the permutation
+   deterministic. */
+__global__
+void moe_permute_indices_kernel(const int* expert_ids, int* expanded_slots, int* expert_counts,
+                                const int m, const int expert_num, const int moe_k, const int capacity)
+{
+  typedef cub::BlockScan<int, MOE_PERMUTE_BLOCK_SIZE> BlockScan;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  extern __shared__ int s_expert_counts[];
+
+  const int tid = threadIdx.x;
+  for(int e = tid; e < expert_num; e += blockDim.x)
+    s_expert_counts[e] = 0;
+  __syncthreads();
+
+  const int total = m * moe_k;
+  for(int base = 0; base < total; base += MOE_PERMUTE_BLOCK_SIZE)
+  {
+    const int pair = base + tid;
+    const int token = pair % m;
+    const int k = pair / m;
+    const int expert = pair < total ? expert_ids[token * moe_k + k] : -1;
+
+    int slot = -1;
+    for(int e = 0; e < expert_num; e++)
+    {
+      int flag = expert == e ? 1 : 0;
+      int rank, aggregate;
+      BlockScan(temp_storage).ExclusiveSum(flag, rank, aggregate);
+      if(flag)
+      {
+        int pos = s_expert_counts[e] + rank;
+        slot = pos < capacity ? e * capacity + pos : -1;
+      }
+      __syncthreads();
+      if(tid == 0)
+        s_expert_counts[e] += aggregate;
+      __syncthreads();
+    }
+    if(pair < total)
+      expanded_slots[token * moe_k + k] = slot;
+  }
+
+  for(int e = tid; e < expert_num; e += blockDim.x)
+    expert_counts[e] = min(s_expert_counts[e], capacity);
+}
+
+void moe_permute_indices_kernelLauncher(const int* expert_ids, int* expanded_slots, int* expert_counts,
+                                        const int m, const int expert_num, const int moe_k,
+                                        const int capacity, cudaStream_t stream)
+{
+  moe_permute_indices_kernel<<<1, MOE_PERMUTE_BLOCK_SIZE, sizeof(int) * expert_num, stream>>>(
+    expert_ids, expanded_slots, expert_counts, m, expert_num, moe_k, capacity);
+}
+
+template <typename T>
+__global__
+void moe_gather_kernel(const T* input, const int* expanded_slots, T* permuted_input,
+                       const int m, const int n, const int moe_k)
+{
+  for(int row = blockIdx.x; row < m * moe_k; row += gridDim.x)
+  {
+    const int slot = expanded_slots[row];
+    if(slot < 0) continue;
+    const T* src = input + (row / moe_k) * n;
+    T* dst = permuted_input + slot * n;
+    for(int col = threadIdx.x; col < n; col += blockDim.x)
+      dst[col] = __ldg(&src[col]);
+  }
+}
+
+template <typename T>
+void moe_gather_kernelLauncher(const T* input, const int* expanded_slots, T* permuted_input,
+                               const int m, const int n, const int moe_k, cudaStream_t stream)
+{
+  dim3 grid(min(m * moe_k, 65536));
+  dim3 block(min(n, 1024));
+  moe_gather_kernel<T><<<grid, block, 0, stream>>>(input, expanded_slots, permuted_input, m, n, moe_k);
+}
+
+__inline__ __device__
+float moe_gelu(float x)
+{
+  float cdf = 0.5f * (1.0f + tanhf((0.7978845608028654f * (x + 0.044715f * x * x * x))));
+  return x * cdf;
+}
+
+template <typename T>
+__global__
+void moe_add_bias_act_kernel(T* out, const T* bias, const int capacity, const int rows, const int n,
+                             ActivationType activation_type)
+{
+  for(int row = blockIdx.x; row < rows; row += gridDim.x)
+  {
+    const T* expert_bias = bias + (row / capacity) * n;
+    for(int col = threadIdx.x; col < n; col += blockDim.x)
+    {
+      float val = (float)out[row * n + col] + (float)__ldg(&expert_bias[col]);
+      if(activation_type == ActivationType::RELU)
+        val = val > 0.0f ? val : 0.0f;
+      else
+        val = moe_gelu(val);
+      out[row * n + col] = (T)val;
+    }
+  }
+}
+
+template <typename T>
+void moe_add_bias_act_kernelLauncher(T* out, const T* bias, const int expert_num, const int capacity,
+                                     const int n, ActivationType activation_type, cudaStream_t stream)
+{
+  const int rows = expert_num * capacity;
+  dim3 grid(min(rows, 65536));
+  dim3 block(min(n, 1024));
+  moe_add_bias_act_kernel<T><<<grid, block, 0, stream>>>(out, bias, capacity, rows, n, activation_type);
+}
+
+template <typename T>
+__global__
+void moe_combine_kernel(const T* expert_output, const T* bias, const T* residual,
+                        const int* expert_ids, const int* expanded_slots, const float* gate_weights,
+                        T* output, const int m, const int n, const int moe_k)
+{
+  for(int token = blockIdx.x; token < m; token += gridDim.x)
+  {
+    for(int col = threadIdx.x; col < n; col += blockDim.x)
+    {
+      float val = (float)residual[token * n + col];
+      for(int k = 0; k < moe_k; k++)
+      {
+        const int slot = expanded_slots[token * moe_k + k];
+        if(slot < 0) continue;
+        const int expert = expert_ids[token * moe_k + k];
+        val += gate_weights[token * moe_k + k] *
+               ((float)expert_output[slot * n + col] + (float)__ldg(&bias[expert * n + col]));
+      }
+      output[token * n + col] = (T)val;
+    }
+  }
+}
+
+template <typename T>
+void moe_combine_kernelLauncher(const T* expert_output, const T* bias, const T* residual,
+                                const int* expert_ids, const int* expanded_slots, const float* gate_weights,
+                                T* output, const int m, const int n, const int moe_k,
+                                cudaStream_t stream)
+{
+  dim3 grid(min(m, 65536));
+  dim3 block(min(n, 1024));
+  moe_combine_kernel<T><<<grid, block, 0, stream>>>(expert_output, bias, residual, expert_ids, expanded_slots,
+                                                    gate_weights, output, m, n, moe_k);
+}
+
+template void moe_topk_gating_kernelLauncher(const float* gating_logits, const float* gating_bias,
+                                             int* expert_ids, float* gate_weights,
+                                             const int m, const int expert_num, const int moe_k,
+                                             cudaStream_t stream);
+
+template void moe_topk_gating_kernelLauncher(const half* gating_logits, const half* gating_bias,
+                                             int* expert_ids, float* gate_weights,
+                                             const int m, const int expert_num, const int moe_k,
+                                             cudaStream_t stream);
+
+template void moe_gather_kernelLauncher(const float* input, const int* expanded_slots, float* permuted_input,
+                                        const int m, const int n, const int moe_k, cudaStream_t stream);
+
+template void moe_gather_kernelLauncher(const half* input, const int* expanded_slots, half* permuted_input,
+                                        const int m, const int n, const int moe_k, cudaStream_t stream);
+
+template void moe_add_bias_act_kernelLauncher(float* out, const float* bias, const int expert_num, const int capacity,
+                                              const int n, ActivationType activation_type, cudaStream_t stream);
+
+template void moe_add_bias_act_kernelLauncher(half* out, const half* bias, const int expert_num, const int capacity,
+                                              const int n, ActivationType activation_type, cudaStream_t stream);
+
+template void moe_combine_kernelLauncher(const float* expert_output, const float* bias, const float* residual,
+                                         const int* expert_ids, const int* expanded_slots, const float* gate_weights,
+                                         float* output, const int m, const int n, const int moe_k,
+                                         cudaStream_t stream);
+
+template void moe_combine_kernelLauncher(const half* expert_output, const half* bias, const half* residual,
+                                         const int* expert_ids, const int* expanded_slots, const float* gate_weights,
+                                         half* output, const int m, const int n, const int moe_k,
+                                         cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Kernels of the mixture-of-experts FFN
+ *
+ * Each token (row of the FFN input) is routed to moe_k experts. The routed
+ * rows are permuted into [expert_num, capacity, hidden_units] so that all
+ * experts can be computed by one strided batched GEMM, and rows exceeding
+ * the capacity of an expert are dropped (they only keep the residual).
+ **/
+
+#pragma once
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include <math.h>
+#include "fastertransformer/common.h"
+#include "fastertransformer/common_structure.h"
+
+namespace fastertransformer
+{
+
+#define MOE_MAX_K 8
+
+/* Number of rows each expert can process for m tokens. */
+inline int moe_expert_capacity(const int m, const int expert_num, const int moe_k, const float capacity_factor)
+{
+  int capacity = (int)ceil(capacity_factor * m * moe_k / expert_num);
+  return capacity < 1 ? 1 : capacity;
+}
+
+/* softmax over the gating logits (+ bias) and select the top moe_k experts of each token.
+   expert_ids and gate_weights are [m, moe_k]. When moe_k > 1, the gate weights are
+   renormalized over the selected experts. Ties prefer the smaller expert id. */
+template <typename T>
+void moe_topk_gating_kernelLauncher(const T* gating_logits, const T* gating_bias,
+                                    int* expert_ids, float* gate_weights,
+                                    const int m, const int expert_num, const int moe_k,
+                                    cudaStream_t stream);
+
+/* Assign every (token, k) pair a row in the permuted buffer. Pairs are served in the
+   order of (k, token), so all first choices are placed before the second choices.
+   expanded_slots[token * moe_k + k] is expert * capacity + rank, or -1 if dropped. */
+void moe_permute_indices_kernelLauncher(const int* expert_ids, int* expanded_slots, int* expert_counts,
+                                        const int m, const int expert_num, const int moe_k,
+                                        const int capacity, cudaStream_t stream);
+
+template <typename T>
+void moe_gather_kernelLauncher(const T* input, const int* expanded_slots, T* permuted_input,
+                               const int m, const int n, const int moe_k, cudaStream_t stream);
+
+/* out is [expert_num, capacity, n] and bias is [expert_num, n] */
+template <typename T>
+void moe_add_bias_act_kernelLauncher(T* out, const T* bias, const int expert_num, const int capacity,
+                                     const int n, ActivationType activation_type, cudaStream_t stream);
+
+/* output = residual + sum_k gate_weight_k * (expert_output[slot_k] + bias[expert_k]) */
+template <typename T>
+void moe_combine_kernelLauncher(const T* expert_output, const T* bias, const T* residual,
+                                const int* expert_ids, const int* expanded_slots, const float* gate_weights,
+                                T* output, const int m, const int n, const int moe_k,
+                                cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -20,6 +20,7 @@
 #include "fastertransformer/allocator.h"
 #include "fastertransformer/cuda/multi_head_attention.h"
 #include "fastertransformer/cuda/open_attention.h"
+#include "fastertransformer/cuda/kernel_tuner.h"
 #include <cuda_runtime.h>
 #include <cuda_fp16.h>
 #include <cmath>
@@ -1619,6 +1620,113 @@ void softmax_kernel_v3_LE32(T* qk_buf_, const T* attr_mask, const int batch_size
   }
 }
 
+/* variants of the softmax of the unfused attention, see register_attention_softmax_variants */
+#define ATTN_SOFTMAX_VARIANT_ROW 0   // a block per row: softmax_kernel_v2 (odd seq_len), v3 with grid.x = seq_len
+#define ATTN_SOFTMAX_VARIANT_LOOP 1  // blocks loop over rows: softmax_kernel (odd seq_len), v3 with grid.x = seq_len / 32
+#define ATTN_SOFTMAX_VARIANT_NUM 2
+
+/* the choice before the variants were tuned */
+int attention_softmax_default_variant(const int batch_size, const int head_num, const int seq_len)
+{
+  if(seq_len % 2 != 0)
+    return batch_size * head_num <= 120 ? ATTN_SOFTMAX_VARIANT_ROW : ATTN_SOFTMAX_VARIANT_LOOP;
+  return batch_size * head_num > 360 ? ATTN_SOFTMAX_VARIANT_LOOP : ATTN_SOFTMAX_VARIANT_ROW;
+}
+
+template <typename T>
+void attention_softmax_variant(const int variant, T* qk_buf_, const T* attr_mask, const int batch_size,
+  const int head_num, const int seq_len, const T scalar, cudaStream_t stream)
+{
+  dim3 grid, block;
+  //deal with odd seq_len
+  if (seq_len % 2 != 0){
+    if(seq_len <= 32)
+      block.x = 32;
+    else if(seq_len > 32 && seq_len <= 64)
+      block.x = 64;
+    else if(seq_len > 64 && seq_len <= 128)
+      block.x = 128;
+    else if(seq_len > 128 && seq_len <= 256)
+      block.x = 256;
+    else if(seq_len > 256 && seq_len <= 512)
+      block.x = 512;
+    else
+      block.x = 1024;
+
+    if(variant == ATTN_SOFTMAX_VARIANT_ROW)
+    {
+      grid.x = batch_size * head_num * seq_len;
+      softmax_kernel_v2<T><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
+    }
+    else
+    {
+      grid.x = batch_size * head_num;
+      softmax_kernel<T><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
+    }
+  }
+  //deal with even seq_len 
+  else{
+    grid.x = seq_len;
+    if (variant == ATTN_SOFTMAX_VARIANT_LOOP)
+      grid.x = ceil(float(seq_len)/32.0f);
+    grid.y = batch_size;
+    grid.z = head_num;
+    if (seq_len <= 32){
+      block.x = 32;
+      softmax_kernel_v3_LE32<T><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
+    }
+    else{
+      if (sizeof(T) == sizeof(half)){
+        block.x = (seq_len/2 + 31)/32*32;
+        softmax_kernel_v3<<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
+      }
+      else{
+        block.x = (seq_len + 31)/32*32;
+        softmax_kernel_v3<T><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
+      }
+    }
+  }
+}
+
+/* the benchmark has batch_size 1 and shape.d0 heads */
+template <typename T>
+float attention_softmax_variant_time(const int variant, const int batch_head_num, const int seq_len)
+{
+  const size_t qk_size = (size_t)batch_head_num * seq_len * seq_len;
+  KernelBenchmarkBuffer buf(sizeof(T) * (qk_size + (size_t)seq_len * seq_len) + 16 * 2);
+  T* qk_buf = buf.take<T>(qk_size);
+  T* attr_mask = buf.take<T>((size_t)seq_len * seq_len);
+  cudaStream_t stream;
+  check_cuda_error(cudaStreamCreate(&stream));
+  const float time = time_kernel_variant([&]() {
+    attention_softmax_variant<T>(variant, qk_buf, attr_mask, 1, batch_head_num, seq_len, (T)0.125f, stream);
+  }, stream);
+  check_cuda_error(cudaStreamDestroy(stream));
+  return time;
+}
+
+float attention_softmax_variant_benchmark(const int variant, const KernelShape& shape, const int is_fp16)
+{
+  return is_fp16 ? attention_softmax_variant_time<half>(variant, shape.d0, shape.d1) :
+                   attention_softmax_variant_time<float>(variant, shape.d0, shape.d1);
+}
+
+bool register_attention_softmax_variants()
+{
+  KernelVariantTable::instance().register_kernel("attn_softmax", ATTN_SOFTMAX_VARIANT_NUM,
+                                                 attention_softmax_variant_benchmark);
+  return true;
+}
+
+int select_attention_softmax_variant(const int batch_size, const int head_num, const int seq_len,
+                                     const int is_fp16, const bool tune)
+{
+  static const bool registered = register_attention_softmax_variants();
+  (void)registered;
+  return select_kernel_variant("attn_softmax", is_fp16, KernelShape(kernel_shape_bucket(batch_size * head_num), seq_len),
+                               attention_softmax_default_variant(batch_size, head_num, seq_len), tune);
+}
+
 //int_buf are a series of sub-matrixes of m = seq_len, n = seq_len, CUBLASLT_ORDER_COL32
 //grid = (seq_len, batch_size, head_num)
 //block.x = max(32, (seq_len/4 + 31)/32*32)
@@ -2478,55 +2586,9 @@ void OpenMultiHeadAttention<OpType_>::multiHeadAttr_nofuse_kernelLauncher(
         computeType_,
         static_cast<cublasGemmAlgo_t>(cublasAlgo_[1])));
         
-      //deal with odd seq_len
-      if (seq_len % 2 != 0){
-        if(seq_len <= 32)
-          block.x = 32;
-        else if(seq_len > 32 && seq_len <= 64)
-          block.x = 64;
-        else if(seq_len > 64 && seq_len <= 128)
-          block.x = 128;
-        else if(seq_len > 128 && seq_len <= 256)
-          block.x = 256;
-        else if(seq_len > 256 && seq_len <= 512)
-          block.x = 512;
-        else
-          block.x = 1024;
-
-        if(batch_size * head_num <= 120)
-        {
-          grid.x = batch_size * head_num * seq_len;
-          softmax_kernel_v2<DataType_><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
-        }
-        else
-        {
-          grid.x = batch_size * head_num;
-          softmax_kernel<DataType_><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
-        }
-      }
-      //deal with even seq_len 
-      else{
-        grid.x = seq_len;
-        if (batch_size * head_num > 360)
-          grid.x = ceil(float(seq_len)/32.0f);
-        grid.y = batch_size;
-        grid.z = head_num;
-        if (seq_len <= 32){
-          block.x = 32;
-          softmax_kernel_v3_LE32<DataType_><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
-        }
-        else{
-          if (OpType_ == OperationType::FP16){
-            block.x = (seq_len/2 + 31)/32*32;
-            softmax_kernel_v3<<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
-          }
-          else{
-            block.x = (seq_len + 31)/32*32;
-            softmax_kernel_v3<DataType_><<<grid, block, 0, stream>>>(qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar);
-          }
-        }
-        grid.x = grid.y = grid.z = 1;
-      }
+      const int variant = softmax_variant_ >= 0 ? softmax_variant_ :
+                          attention_softmax_default_variant(batch_size, head_num, seq_len);
+      attention_softmax_variant<DataType_>(variant, qk_buf_, attr_mask, batch_size, head_num, seq_len, scalar, stream);
 
       check_cuda_error(cublasGemmStridedBatchedEx(cublas_handle,
         CUBLAS_OP_N, CUBLAS_OP_N,
@@ -22,6 +22,7 @@
 #include "fastertransformer/allocator.h"
 #include "fastertransformer/cuda/multi_head_attention.h"
 #include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/kernel_variant_table.h"
 #include "fastertransformer/cuda/cuda_int8_kernels.h"
 #include "fastertransformer/gemm_test/encoder_gemm_func.h"
 #include "fastertransformer/gemm_test/encoder_igemm_func.h"
@@ -33,6 +34,15 @@
 namespace fastertransformer{
 namespace cuda{
 
+/* Registers the launch variants of the softmax of the unfused attention in KernelVariantTable as
+   "attn_softmax", the shape is (batch_size * head_num rounded up to a power of 2, seq_len).
+   select_attention_softmax_variant calls it once. */
+bool register_attention_softmax_variants();
+
+/* the softmax variant of the unfused attention, tune times it on a miss */
+int select_attention_softmax_variant(const int batch_size, const int head_num, const int seq_len,
+                                     const int is_fp16, const bool tune);
+
 template<OperationType OpType_>
 class OpenMultiHeadAttentionTraits;
 
@@ -106,6 +116,7 @@ class OpenMultiHeadAttention: IMultiHeadAttention<OpType_>
   int head_num_;
   int size_per_head_;
   int mSM_;
+  int softmax_variant_ = -1;  // resolved by select_kernel_variants, -1 runs the default one
   //int8_mode == 0 -- not use int8
   //int8_mode == 1 -- use int8 without quantized residual
   //int8_mode == 2 -- use int8 with quantized residual
@@ -396,6 +407,7 @@ class OpenMultiHeadAttention: IMultiHeadAttention<OpType_>
         int is_fp16 = (sizeof(DataType_) == sizeof(half) ? 1 : 0);
         getBestAlgoFromMap(batch_size_, from_seq_len_, head_num_, size_per_head_, is_fp16);
       }
+      select_kernel_variants(KernelVariantTable::instance().online_tuning());
     }
     catch(std::runtime_error& error)
     {
@@ -403,6 +415,14 @@ class OpenMultiHeadAttention: IMultiHeadAttention<OpType_>
     }
   }
 
+  //resolve the kernel variants of the current sizes once, forward does no lookup
+  //tune == true times the variants missing from KERNEL_CONFIG, call it to warm up before serving
+  void select_kernel_variants(const bool tune)
+  {
+    softmax_variant_ = select_attention_softmax_variant(batch_size_, head_num_, from_seq_len_,
+                                                        OpType_ == OperationType::FP16, tune);
+  }
+
   //Ctor
   OpenMultiHeadAttention(int int8_mode=0, bool allow_gemm_test=false, bool use_ORDER_COL32_2R_4R4=false) : 
     int8_mode_(int8_mode), allow_gemm_test_(allow_gemm_test), use_ORDER_COL32_2R_4R4_(use_ORDER_COL32_2R_4R4)
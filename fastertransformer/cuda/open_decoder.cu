@@ -1085,6 +1085,197 @@ void cross_attention_kernel_opt(
   }
 }
 
+// only use for compile 
+template <int size_per_head, int block_sz>
+__global__ 
+void cross_attention_kernel_opt_half2(
+  float* __restrict query_buf, const float* __restrict Q_bias, 
+  float* __restrict key_cache, const float* __restrict K_bias, 
+  float* __restrict value_cache, const float* __restrict V_bias,
+  const int* length_per_sample, float* __restrict context_buf, 
+  int batch_size, int head_num, const int step, const int seq_len, const float scalar) {}
+
+/* Same as cross_attention_kernel_opt, but loads and adds the bias with half2. The dot
+   products and the weighted sum of the values are accumulated in float since the memory
+   can be much longer than the target. Each warp handles the positions ite, ite + warp_num, ...
+   below the source length of the sentence, the padded positions are never read. */
+template <int size_per_head, int block_sz>
+__global__ 
+void cross_attention_kernel_opt_half2(
+  half* __restrict query_buf, const half* __restrict Q_bias, 
+  half* __restrict key_cache, const half* __restrict K_bias, 
+  half* __restrict value_cache, const half* __restrict V_bias,
+  const int* length_per_sample, half* __restrict context_buf, 
+  int batch_size, int head_num, const int step, const int seq_len, const float scalar)
+{
+  typedef Copy_t<half2, size_per_head/2> copy_t;
+  const int elems_per_thread = size_per_head / 2 / WARP_SIZE;
+
+  union Access_t
+  {
+    copy_t v;
+    half2 x[elems_per_thread]; // supported size 1,2
+  };
+  typedef struct Float2_n_t
+  {
+    float2 x[elems_per_thread]; // supported size 1,2
+  } float2_n_t;
+
+  __shared__ float2_n_t sq[block_sz];
+  extern __shared__ float logits[]; // use to store the logits from [0~length)
+
+  const int tid = threadIdx.x;
+  const int warp_num = block_sz / WARP_SIZE;
+  const int bid = blockIdx.x / head_num;
+  const int head_id = blockIdx.x % head_num;
+  const int warp_id = tid / WARP_SIZE; // warp_id in block
+  const int lane_id = tid % WARP_SIZE; // lane_id in warp
+
+  typedef cub::BlockReduce<float, block_sz> MaxValBlockReduce;
+  typedef cub::BlockReduce<float, block_sz> BlockReduce;
+  __shared__ typename MaxValBlockReduce::TempStorage max_val_block_temp_storage;
+  __shared__ typename BlockReduce::TempStorage block_temp_storage;
+  __shared__ typename cub::WarpReduce<float>::TempStorage temp_storage[warp_num];
+
+  const int length = __ldg(&length_per_sample[bid]);
+
+  const int qkv_id = (bid * head_num * size_per_head + head_id * size_per_head) / 2;
+  const int qkv_bias_id = head_id * size_per_head / 2;
+  const int key_value_id = (bid * (seq_len * head_num * size_per_head) + head_id * size_per_head) / 2;
+
+  const half2* query_buf_ptr = (const half2*)query_buf + qkv_id;
+  const half2* Q_bias_ptr = (const half2*)Q_bias + qkv_bias_id;
+  const half2* K_bias_ptr = (const half2*)K_bias + qkv_bias_id;
+  const half2* V_bias_ptr = (const half2*)V_bias + qkv_bias_id;
+  half2* key_cache_ptr = (half2*)key_cache + key_value_id;
+  half2* value_cache_ptr = (half2*)value_cache + key_value_id;
+  half2* context_buf_ptr = (half2*)context_buf + qkv_id;
+
+  Access_t bias_r, key_val_r, query_buf_r;
+
+  // each warp will have its own copy of the query
+  query_buf_r.v = *((copy_t *)query_buf_ptr + lane_id);
+  bias_r.v = *((copy_t *)Q_bias_ptr + lane_id);
+  float2 qb_r[elems_per_thread];
+  for (int i = 0; i < elems_per_thread; ++i)
+  {
+    qb_r[i] = __half22float2(__hadd2(query_buf_r.x[i], bias_r.x[i]));
+    qb_r[i].x *= scalar;
+    qb_r[i].y *= scalar;
+  }
+
+  //offset for each position of the memory
+  const int offset = head_num * size_per_head / 2;
+
+  bias_r.v = *((copy_t *)K_bias_ptr + lane_id);
+  for(int ite = warp_id; ite < length; ite += warp_num)
+  {
+    key_val_r.v = *((copy_t *)&key_cache_ptr[ite * offset] + lane_id);
+
+    //The KV memory cache only need to be updated at the first step.
+    if (step == 1)
+    {
+      for (int i = 0; i < elems_per_thread; i++)
+      {
+        key_val_r.x[i] = __hadd2(key_val_r.x[i], bias_r.x[i]);
+      }
+      *((copy_t *)&key_cache_ptr[ite * offset] + lane_id) = key_val_r.v;
+    }
+    float val = 0.f;
+    for (int i = 0; i < elems_per_thread; i++)
+    {
+      float2 key2 = __half22float2(key_val_r.x[i]);
+      val = val + key2.x * qb_r[i].x + key2.y * qb_r[i].y;
+    }
+    float qk = cub::WarpReduce<float>(temp_storage[warp_id]).Sum(val);
+    if (lane_id == 0)
+    {
+      logits[ite] = qk; 
+    }
+  }
+  __syncthreads();
+
+  __shared__ float s_max_val, s_sum;
+  float local_i = -1e20f;
+  for(int i = tid; i < length; i += blockDim.x)
+    local_i = max(local_i, logits[i]);
+
+  float max_val = MaxValBlockReduce(max_val_block_temp_storage).Reduce(local_i, cub::Max());
+  if(tid == 0)
+    s_max_val = max_val;
+  __syncthreads();
+
+  float local_o = 0.0f;
+  for(int i = tid; i < length; i += blockDim.x)
+  {
+    logits[i] = __expf(logits[i] - s_max_val);
+    local_o += logits[i];
+  }
+  float val = BlockReduce(block_temp_storage).Sum(local_o);
+
+  if(tid == 0)
+    s_sum = val + 1e-6;
+  __syncthreads();
+
+  float s_sum_inverse = __fdividef(1.0f, s_sum);
+  for(int i = tid; i < length; i += blockDim.x)
+  {
+    logits[i] = logits[i] * s_sum_inverse;
+  }
+  __syncthreads(); 
+
+  float2 sum_r[elems_per_thread];
+  for(int i = 0; i < elems_per_thread; i++)
+  {
+    sum_r[i].x = 0.f;
+    sum_r[i].y = 0.f;
+  }
+  bias_r.v = *((copy_t *)V_bias_ptr + lane_id);
+  for(int ite = warp_id; ite < length; ite += warp_num)
+  {
+    key_val_r.v = *((copy_t *)&value_cache_ptr[ite * offset] + lane_id);
+
+    if(step == 1)
+    {
+      for (int i = 0; i < elems_per_thread; i++)
+      {
+        key_val_r.x[i] = __hadd2(key_val_r.x[i], bias_r.x[i]);
+      }
+      *((copy_t *)&value_cache_ptr[ite * offset] + lane_id) = key_val_r.v;
+    }
+    const float logit = logits[ite];
+    for (int i = 0; i < elems_per_thread; ++i)
+    {
+      float2 value2 = __half22float2(key_val_r.x[i]);
+      sum_r[i].x += value2.x * logit;
+      sum_r[i].y += value2.y * logit;
+    }
+  }
+  for (int i = 0; i < elems_per_thread; i++)
+  {
+    sq[warp_id * WARP_SIZE + lane_id].x[i] = sum_r[i];
+  }
+  __syncthreads();
+  if (warp_id == 0)
+  {
+    #pragma unroll
+    for (int j = 1; j < warp_num; j++)
+    {
+      for (int i = 0; i < elems_per_thread; ++i)
+      {
+        sum_r[i].x += sq[j * WARP_SIZE + lane_id].x[i].x;
+        sum_r[i].y += sq[j * WARP_SIZE + lane_id].x[i].y;
+      }
+    }
+    #pragma unroll
+    for (int i = 0; i < elems_per_thread; i++)
+    {
+      key_val_r.x[i] = __float22half2_rn(sum_r[i]);
+    }
+    *((copy_t *)context_buf_ptr + lane_id) = key_val_r.v;
+  }
+}
+
 template<typename T>
 void print_tensor_new(int dim, T tensor, std::string output, bool everyone=true) {
     float *data = new float[dim];
@@ -1170,21 +1361,29 @@ void cross_attention_kernel(
 
   __shared__ float s_max_val, s_sum;
 
-  float local_i = tid < length ? (float)logits[tid] : -1e20f; 
+  float local_i = -1e20f;
+  for(int i = tid; i < length; i += blockDim.x)
+    local_i = max(local_i, (float)logits[i]);
   float max_val = blockReduceMax<float>(local_i);
   if(tid == 0)
     s_max_val = max_val;
   __syncthreads();
 
-  local_i -= s_max_val;
-  float local_o = tid < length ? __expf(local_i) : 0.0f;
+  float local_o = 0.0f;
+  for(int i = tid; i < length; i += blockDim.x)
+  {
+    float logit = __expf((float)logits[i] - s_max_val);
+    logits[i] = (T)logit;
+    local_o += logit;
+  }
   float val = blockReduceSum<float>(local_o);
 
   if(tid == 0)
     s_sum = val + 1e-6;
   __syncthreads();
-  if(tid < length)
-    logits[tid] = local_o / s_sum;
+  float s_sum_inverse = __fdividef(1.0f, s_sum);
+  for(int i = tid; i < length; i += blockDim.x)
+    logits[i] = (T)((float)logits[i] * s_sum_inverse);
   __syncthreads();
 
   if(tid < size_per_head)
@@ -1227,49 +1426,37 @@ void cross_attention_dispatch(T* query_buf, const T* Q_bias,
           query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,  
           batch_size, head_num, step, seq_len, scalar);
         break;
-//      case 64:
-//        cross_attention_kernel_opt<T, 64, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
-//          query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,
-//          batch_size, head_num, step, seq_len, scalar);
-//        break;
+      case 64:
+        if(sizeof(T) == 2)
+          cross_attention_kernel_opt_half2<64, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
+            query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,
+            batch_size, head_num, step, seq_len, scalar);
+        else
+          cross_attention_kernel_opt<T, 64, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
+            query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,
+            batch_size, head_num, step, seq_len, scalar);
+        break;
       case 128:
-        cross_attention_kernel_opt<T, 128, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
-          query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,  
-          batch_size, head_num, step, seq_len, scalar);
+        if(sizeof(T) == 2)
+          cross_attention_kernel_opt_half2<128, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
+            query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,
+            batch_size, head_num, step, seq_len, scalar);
+        else
+          cross_attention_kernel_opt<T, 128, block_sz><<<grid, block_sz, sizeof(float)*seq_len, stream>>>(
+            query_buf, Q_bias, key_cache, K_bias, value_cache, V_bias, length, context_buf,  
+            batch_size, head_num, step, seq_len, scalar);
         break;
       default:
         // default path
-
-        int block_size = 128;
-
-        if(seq_len <= 64)
+        // The softmax loops over the source length, so the block only needs to cover size_per_head.
+        int block_size = (size_per_head + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE;
+        if(block_size < 64)
           block_size = 64;
-        else if(seq_len <= 128 && seq_len > size_per_head)
-          block_size = 128;
-        else if(seq_len > 128 && seq_len <= 256)
-          block_size = 256;
-        else if(seq_len > 256 && seq_len <= 512)
-          block_size = 512;
-        else
-          block_size = 1024;
-
-        if(block_size < size_per_head)
-          block_size = size_per_head;
 
         assert(block_size <= 1024);
         dim3 block(block_size);
         int shared_size = sizeof(T) * (size_per_head + seq_len);
 
-        /*std::cout<<"*********+decoder.cu*********"<<std::endl;
-//        std::cout<<"length: "<<*length<<std::endl;
-        std::cout<<"batch_size: "<<batch_size<<std::endl;
-        std::cout<<"head_num: "<<head_num<<std::endl;
-        std::cout<<"size_per_head: "<<size_per_head<<std::endl;
-        std::cout<<"step: "<<step<<std::endl;
-        std::cout<<"scalar: "<<scalar<<std::endl;
-        std::cout<<"grid(batch_size * head_num): "<<batch_size * head_num<<std::endl;
-        std::cout<<"*********-decoder.cu*********"<<std::endl;*/
-
         cross_attention_kernel<T><<<grid, block, shared_size, stream>>>(
           query_buf, Q_bias, 
           key_cache, K_bias,
@@ -1280,6 +1467,14 @@ void cross_attention_dispatch(T* query_buf, const T* Q_bias,
     }
   }
 
+template void cross_attention_dispatch(float* query_buf, const float* Q_bias, 
+  float* key_cache, const float* K_bias, float* value_cache, const float* V_bias, const int* length,
+  float* context_buf, int batch_size, int head_num, int size_per_head, int step, int seq_len, cudaStream_t stream);
+
+template void cross_attention_dispatch(half* query_buf, const half* Q_bias, 
+  half* key_cache, const half* K_bias, half* value_cache, const half* V_bias, const int* length,
+  half* context_buf, int batch_size, int head_num, int size_per_head, int step, int seq_len, cudaStream_t stream);
+
 /* attention with source sentence */
 template<OperationType OpType_>
 void OpenDecoder<OpType_>::cross_multi_head_attention(
@@ -1353,6 +1548,21 @@ void OpenDecoder<OpType_>::cross_multi_head_attention(
     value_mem_cache, param_.cross_attention.value_weight.bias,
     length, context_buf_, batch_size_,
     head_num_, size_per_head_, step, seq_len, param_.stream);
+#ifndef NDEBUG
+  cudaDeviceSynchronize();
+  check_cuda_error(cudaGetLastError());
+
+  /*
+    User can check the cross attention by cross_attention_kernel_check.
+    cross_attention_kernel_check will compare the results of GPU and CPU.
+    Note that cross_attention_kernel_check contains cross_attention_dispatch and uses do not need to call it again,
+    since the memory caches get the K/V bias at step 1.
+  */
+  // cross_attention_kernel_check<DataType_>(query_buf_, param_.cross_attention.query_weight.bias,
+  //                                         key_mem_cache, param_.cross_attention.key_weight.bias,
+  //                                         value_mem_cache, param_.cross_attention.value_weight.bias,
+  //                                         length, context_buf_, batch_size_, head_num_, size_per_head_, step, seq_len, param_.stream);
+#endif
 
     print_tensor(batch_size_*1*head_num_*size_per_head_,context_buf_,"cpp_context_buf_in_cross.txt");
 
@@ -1375,6 +1585,464 @@ void OpenDecoder<OpType_>::cross_multi_head_attention(
     static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
 }
 
+/**
+  attention of all the target positions at once, used by the teacher-forced scoring
+ */
+/* Q, K or V + bias from [sentences, len, head_num, size_per_head] to
+   [sentences, head_num, len, size_per_head], one block per token. */
+template <typename T>
+__global__
+void context_add_bias_transpose(const T* src, const T* bias, T* dst,
+  const int len, const int head_num, const int size_per_head)
+{
+  const int sentence = blockIdx.x / len;
+  const int token = blockIdx.x % len;
+  const int hidden_units = head_num * size_per_head;
+  for(int i = threadIdx.x; i < hidden_units; i += blockDim.x)
+  {
+    const int head_id = i / size_per_head;
+    const int id_in_head = i % size_per_head;
+    dst[((sentence * head_num + head_id) * len + token) * size_per_head + id_in_head] =
+      (T)((float)src[blockIdx.x * hidden_units + i] + (float)bias[i]);
+  }
+}
+
+/* [sentences, head_num, len, size_per_head] back to [sentences, len, head_num, size_per_head] */
+template <typename T>
+__global__
+void context_transpose(const T* src, T* dst, const int len, const int head_num, const int size_per_head)
+{
+  const int sentence = blockIdx.x / len;
+  const int token = blockIdx.x % len;
+  const int hidden_units = head_num * size_per_head;
+  for(int i = threadIdx.x; i < hidden_units; i += blockDim.x)
+  {
+    const int head_id = i / size_per_head;
+    const int id_in_head = i % size_per_head;
+    dst[blockIdx.x * hidden_units + i] = src[((sentence * head_num + head_id) * len + token) * size_per_head + id_in_head];
+  }
+}
+
+/* One block per row of the scores [sentences, head_num, query_len, kv_len]. The self
+   attention is causal, the query at position t attends to the keys 0..t of its sentence.
+   The cross attention attends to the first length_per_sample[sentence] keys of the memory.
+   The masked keys get a probability of 0. */
+template <typename T>
+__global__
+void context_softmax_kernel(T* qk_buf, const int* length_per_sample, const int head_num,
+  const int query_len, const int kv_len, const float scalar)
+{
+  const int sentence = blockIdx.x / (head_num * query_len);
+  const int query_id = blockIdx.x % query_len;
+  const int length = length_per_sample == nullptr ? query_id + 1 : min(__ldg(&length_per_sample[sentence]), kv_len);
+  T* qk = qk_buf + (size_t)blockIdx.x * kv_len;
+
+  __shared__ float s_max_val, s_sum;
+  float local_max = -1e20f;
+  for(int ite = threadIdx.x; ite < length; ite += blockDim.x)
+    local_max = fmaxf(local_max, (float)qk[ite] * scalar);
+  float max_val = blockReduceMax<float>(local_max);
+  if(threadIdx.x == 0)
+    s_max_val = max_val;
+  __syncthreads();
+
+  float local_sum = 0.0f;
+  for(int ite = threadIdx.x; ite < length; ite += blockDim.x)
+    local_sum += __expf((float)qk[ite] * scalar - s_max_val);
+  float sum = blockReduceSum<float>(local_sum);
+  if(threadIdx.x == 0)
+    s_sum = sum + 1e-6f;
+  __syncthreads();
+
+  for(int ite = threadIdx.x; ite < kv_len; ite += blockDim.x)
+    qk[ite] = ite < length ? (T)(__expf((float)qk[ite] * scalar - s_max_val) / s_sum) : (T)0.0f;
+}
+
+/* Q·K^T and the scores·V are strided batched GEMMs over (sentence, head) like
+   multiHeadAttr_nofuse_kernelLauncher, the context is written to context_buf_. */
+template<OperationType OpType_>
+void OpenDecoder<OpType_>::context_attention(
+  const DataType_* query, const DataType_* Q_bias,
+  const DataType_* key, const DataType_* K_bias,
+  const DataType_* value, const DataType_* V_bias,
+  const int* length_per_sample, const int query_len, const int kv_len)
+{
+  if(query_len != context_query_len_ || kv_len > std::max(context_query_len_, max_seq_len_))
+  {
+    printf("[ERROR] the batched attention of %d queries and %d keys is not planned, call set_context_query_len. \n",
+      query_len, kv_len);
+    exit(-1);
+  }
+  const int sentences = batch_size_ / query_len;
+  const int batch_head_num = sentences * head_num_;
+  const float scalar = 1.f / sqrtf(size_per_head_ * 1.0f);
+  const int gemm_algo = OpType_ == OperationType::FP32 ? CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+  DataType_ alpha = (DataType_)1.0f, beta = (DataType_)0.0f;
+
+  dim3 block(min(hidden_units_, 1024));
+  context_add_bias_transpose<DataType_><<<sentences * query_len, block, 0, param_.stream>>>(
+    query, Q_bias, attention_q_buf_, query_len, head_num_, size_per_head_);
+  context_add_bias_transpose<DataType_><<<sentences * kv_len, block, 0, param_.stream>>>(
+    key, K_bias, attention_k_buf_, kv_len, head_num_, size_per_head_);
+  context_add_bias_transpose<DataType_><<<sentences * kv_len, block, 0, param_.stream>>>(
+    value, V_bias, attention_v_buf_, kv_len, head_num_, size_per_head_);
+
+  check_cuda_error(cublasGemmStridedBatchedEx(param_.cublas_handle,
+    CUBLAS_OP_T, CUBLAS_OP_N,
+    kv_len, query_len, size_per_head_,
+    &alpha,
+    attention_k_buf_, AType_, size_per_head_, kv_len * size_per_head_,
+    attention_q_buf_, BType_, size_per_head_, query_len * size_per_head_,
+    &beta,
+    attention_qk_buf_, CType_, kv_len, query_len * kv_len,
+    batch_head_num,
+    computeType_,
+    static_cast<cublasGemmAlgo_t>(gemm_algo)));
+
+  context_softmax_kernel<DataType_><<<batch_head_num * query_len, kv_len <= 64 ? 64 : 128, 0, param_.stream>>>(
+    attention_qk_buf_, length_per_sample, head_num_, query_len, kv_len, scalar);
+
+  /* the transposed queries are not needed anymore, the context goes to their buffer */
+  check_cuda_error(cublasGemmStridedBatchedEx(param_.cublas_handle,
+    CUBLAS_OP_N, CUBLAS_OP_N,
+    size_per_head_, query_len, kv_len,
+    &alpha,
+    attention_v_buf_, AType_, size_per_head_, kv_len * size_per_head_,
+    attention_qk_buf_, BType_, kv_len, query_len * kv_len,
+    &beta,
+    attention_q_buf_, CType_, size_per_head_, query_len * size_per_head_,
+    batch_head_num,
+    computeType_,
+    static_cast<cublasGemmAlgo_t>(gemm_algo)));
+
+  context_transpose<DataType_><<<sentences * query_len, block, 0, param_.stream>>>(
+    attention_q_buf_, context_buf_, query_len, head_num_, size_per_head_);
+}
+
+template<OperationType OpType_>
+void OpenDecoder<OpType_>::masked_context_attention(
+  const DataType_* from_tensor,
+  DataType_* decoder_output,
+  const int query_len)
+{
+  int m = batch_size_;
+  int n = hidden_units_;
+  int k = hidden_units_;
+
+  DataType_ alpha = (DataType_)1.0f, beta = (DataType_)0.0f;
+
+  if(is_fuse_QKV == true)
+  {
+    check_cuda_error(cublasGemmBatchedEx(param_.cublas_handle, 
+      CUBLAS_OP_N, CUBLAS_OP_N, 
+      n, m, k, 
+      &alpha, 
+      (const void* const*) qkv_kernel_, AType_, n,
+      (const void* const*) qkv_input_, BType_, k,
+      &beta,
+      (void* const*)qkv_buf_, CType_, n,
+      3, 
+      computeType_,
+      static_cast<cublasGemmAlgo_t>(cublasAlgo_[4])));
+  }
+  else
+  {
+    const DataType_* kernels[3] = {param_.self_attention.query_weight.kernel,
+                                   param_.self_attention.key_weight.kernel,
+                                   param_.self_attention.value_weight.kernel};
+    DataType_* outputs[3] = {query_buf_, key_buf_, value_buf_};
+    for(int i = 0; i < 3; i++)
+    {
+      check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+        CUBLAS_OP_N, CUBLAS_OP_N, 
+        n, m, k, 
+        &alpha, 
+        kernels[i], AType_, n, 
+        from_tensor, BType_, k, 
+        &beta, 
+        outputs[i], CType_, n, 
+        computeType_, 
+        static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+    }
+  }
+
+  context_attention(
+    query_buf_, param_.self_attention.query_weight.bias,
+    key_buf_, param_.self_attention.key_weight.bias,
+    value_buf_, param_.self_attention.value_weight.bias,
+    nullptr, query_len, query_len);
+
+  check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+    CUBLAS_OP_N, CUBLAS_OP_N, 
+    n, m, k, 
+    &alpha, 
+    param_.self_attention.attention_output_weight.kernel, AType_, n, 
+    context_buf_, BType_, k, 
+    &beta, 
+    decoder_output, CType_, n, 
+    computeType_, 
+    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+}
+
+template<OperationType OpType_>
+void OpenDecoder<OpType_>::cross_context_attention(
+  const DataType_* from_tensor,
+  const DataType_* memory_tensor,
+  DataType_* key_mem_cache,
+  DataType_* value_mem_cache,
+  DataType_* decoder_output,
+  const int* length,
+  const int seq_len,
+  const int query_len,
+  const bool project_memory)
+{
+  int m = batch_size_;
+  int n = hidden_units_;
+  int k = hidden_units_;
+
+  DataType_ alpha = (DataType_)1.0f, beta = (DataType_)0.0f;
+
+  check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+    CUBLAS_OP_N, CUBLAS_OP_N, 
+    n, m, k, 
+    &alpha, 
+    param_.cross_attention.query_weight.kernel, AType_, n, 
+    from_tensor, BType_, k, 
+    &beta, 
+    query_buf_, CType_, n, 
+    computeType_, 
+    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+
+  /* the memory is projected once per sentence, not once per target position,
+     and only once per decoding if the caller keeps the projections */
+  const int mem_m = batch_size_ / query_len * seq_len;
+  if(project_memory)
+  {
+    check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+      CUBLAS_OP_N, CUBLAS_OP_N, 
+      n, mem_m, memory_hidden_units_, 
+      &alpha, 
+      param_.cross_attention.key_weight.kernel, AType_, n, 
+      memory_tensor, BType_, memory_hidden_units_, 
+      &beta, 
+      key_mem_cache, CType_, n, 
+      computeType_, 
+      static_cast<cublasGemmAlgo_t>(cublasAlgo_[1])));
+
+    check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+      CUBLAS_OP_N, CUBLAS_OP_N, 
+      n, mem_m, memory_hidden_units_, 
+      &alpha, 
+      param_.cross_attention.value_weight.kernel, AType_, n, 
+      memory_tensor, BType_, memory_hidden_units_, 
+      &beta, 
+      value_mem_cache, CType_, n, 
+      computeType_, 
+      static_cast<cublasGemmAlgo_t>(cublasAlgo_[1])));
+  }
+
+  context_attention(
+    query_buf_, param_.cross_attention.query_weight.bias,
+    key_mem_cache, param_.cross_attention.key_weight.bias,
+    value_mem_cache, param_.cross_attention.value_weight.bias,
+    length, query_len, seq_len);
+
+  check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+    CUBLAS_OP_N, CUBLAS_OP_N, 
+    n, m, k, 
+    &alpha, 
+    param_.cross_attention.attention_output_weight.kernel, AType_, n, 
+    context_buf_, BType_, k, 
+    &beta, 
+    decoder_output, CType_, n, 
+    computeType_, 
+    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+}
+
+/**
+  self attention of a multi-token pass over the KV cache, used to verify the drafts
+  of the speculative decoding
+ */
+/* Row r belongs to the sentence r / tokens_per_row, or row_slots[r] for packed rows, and
+   is at positions[r] of it, a row with a negative position is inactive. K + bias and V + bias
+   of the active rows are written to the cache of layout [max_cache_len, cache_batch,
+   hidden_units], like masked_attention_kernel does for one step. */
+template <typename T>
+__global__
+void update_multi_token_cache_kernel(
+  const T* key_buf, const T* K_bias,
+  const T* value_buf, const T* V_bias,
+  T* key_cache, T* value_cache, const int* positions, const int* row_slots,
+  const int tokens_per_row, const int cache_batch, const int max_cache_len, const int hidden_units)
+{
+  const int row = blockIdx.x;
+  const int position = positions[row];
+  if(position < 0 || position >= max_cache_len)
+    return;
+  const int sentence = row_slots != nullptr ? row_slots[row] : row / tokens_per_row;
+  const int cache_offset = (position * cache_batch + sentence) * hidden_units;
+  for(int i = threadIdx.x; i < hidden_units; i += blockDim.x)
+  {
+    key_cache[cache_offset + i] = (T)((float)key_buf[row * hidden_units + i] + (float)K_bias[i]);
+    value_cache[cache_offset + i] = (T)((float)value_buf[row * hidden_units + i] + (float)V_bias[i]);
+  }
+}
+
+/* One block per (row, head). The query at position p attends to the cached positions
+   0..p of its sentence, so the rows of a sentence see each other causally once the
+   cache is updated. The output of an inactive row is 0. */
+template <typename T>
+__global__
+void multi_token_attention_kernel(
+  const T* query_buf, const T* Q_bias,
+  const T* key_cache, const T* value_cache, const int* positions, const int* row_slots, T* context_buf,
+  const int tokens_per_row, const int cache_batch, const int max_cache_len,
+  const int head_num, const int size_per_head, const float scalar)
+{
+  extern __shared__ float s_multi_token_buf[];
+  float* sq = s_multi_token_buf;
+  float* logits = sq + size_per_head;
+
+  const int row = blockIdx.x / head_num;
+  const int head_id = blockIdx.x % head_num;
+  const int sentence = row_slots != nullptr ? row_slots[row] : row / tokens_per_row;
+  const int hidden_units = head_num * size_per_head;
+  const int head_offset = head_id * size_per_head;
+  const int position = positions[row];
+
+  if(position < 0)
+  {
+    for(int i = threadIdx.x; i < size_per_head; i += blockDim.x)
+      context_buf[row * hidden_units + head_offset + i] = (T)0.0f;
+    return;
+  }
+  const int length = min(position + 1, max_cache_len);
+
+  for(int i = threadIdx.x; i < size_per_head; i += blockDim.x)
+    sq[i] = ((float)query_buf[row * hidden_units + head_offset + i] + (float)Q_bias[head_offset + i]) * scalar;
+  __syncthreads();
+
+  __shared__ float s_max_val, s_sum;
+  float local_max = -1e20f;
+  for(int ite = threadIdx.x; ite < length; ite += blockDim.x)
+  {
+    const T* key = key_cache + (ite * cache_batch + sentence) * hidden_units + head_offset;
+    float qk = 0.0f;
+    for(int i = 0; i < size_per_head; i++)
+      qk += sq[i] * (float)key[i];
+    logits[ite] = qk;
+    local_max = fmaxf(local_max, qk);
+  }
+  float max_val = blockReduceMax<float>(local_max);
+  if(threadIdx.x == 0)
+    s_max_val = max_val;
+  __syncthreads();
+
+  float local_sum = 0.0f;
+  for(int ite = threadIdx.x; ite < length; ite += blockDim.x)
+  {
+    float val = __expf(logits[ite] - s_max_val);
+    logits[ite] = val;
+    local_sum += val;
+  }
+  float sum = blockReduceSum<float>(local_sum);
+  if(threadIdx.x == 0)
+    s_sum = sum + 1e-6f;
+  __syncthreads();
+
+  for(int i = threadIdx.x; i < size_per_head; i += blockDim.x)
+  {
+    const T* value = value_cache + sentence * hidden_units + head_offset + i;
+    float val = 0.0f;
+    for(int ite = 0; ite < length; ++ite)
+      val += logits[ite] * (float)value[ite * cache_batch * hidden_units];
+    context_buf[row * hidden_units + head_offset + i] = (T)(val / s_sum);
+  }
+}
+
+template<OperationType OpType_>
+void OpenDecoder<OpType_>::masked_multi_token_attention(
+  const DataType_* from_tensor,
+  DataType_* key_cache,
+  DataType_* value_cache,
+  DataType_* decoder_output,
+  const int* positions,
+  const int tokens_per_row,
+  const int max_cache_len,
+  const int* row_slots,
+  const int row_num,
+  const int cache_batch)
+{
+  int m = row_num > 0 ? row_num : batch_size_;
+  int n = hidden_units_;
+  int k = hidden_units_;
+
+  DataType_ alpha = (DataType_)1.0f, beta = (DataType_)0.0f;
+
+  if(is_fuse_QKV == true)
+  {
+    check_cuda_error(cublasGemmBatchedEx(param_.cublas_handle, 
+      CUBLAS_OP_N, CUBLAS_OP_N, 
+      n, m, k, 
+      &alpha, 
+      (const void* const*) qkv_kernel_, AType_, n,
+      (const void* const*) qkv_input_, BType_, k,
+      &beta,
+      (void* const*)qkv_buf_, CType_, n,
+      3, 
+      computeType_,
+      static_cast<cublasGemmAlgo_t>(cublasAlgo_[4])));
+  }
+  else
+  {
+    const DataType_* kernels[3] = {param_.self_attention.query_weight.kernel,
+                                   param_.self_attention.key_weight.kernel,
+                                   param_.self_attention.value_weight.kernel};
+    DataType_* outputs[3] = {query_buf_, key_buf_, value_buf_};
+    for(int i = 0; i < 3; i++)
+    {
+      check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+        CUBLAS_OP_N, CUBLAS_OP_N, 
+        n, m, k, 
+        &alpha, 
+        kernels[i], AType_, n, 
+        from_tensor, BType_, k, 
+        &beta, 
+        outputs[i], CType_, n, 
+        computeType_, 
+        static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+    }
+  }
+
+  const int batch = cache_batch > 0 ? cache_batch : m / tokens_per_row;
+  update_multi_token_cache_kernel<DataType_><<<m, min(n, 1024), 0, param_.stream>>>(
+    key_buf_, param_.self_attention.key_weight.bias,
+    value_buf_, param_.self_attention.value_weight.bias,
+    key_cache, value_cache, positions, row_slots,
+    tokens_per_row, batch, max_cache_len, n);
+
+  const float scalar = 1.f / sqrtf(size_per_head_ * 1.0f);
+  dim3 grid(m * head_num_);
+  dim3 block(max_cache_len <= 64 ? 64 : 128);
+  const int shared_size = sizeof(float) * (size_per_head_ + max_cache_len);
+  multi_token_attention_kernel<DataType_><<<grid, block, shared_size, param_.stream>>>(
+    query_buf_, param_.self_attention.query_weight.bias,
+    key_cache, value_cache, positions, row_slots, context_buf_,
+    tokens_per_row, batch, max_cache_len,
+    head_num_, size_per_head_, scalar);
+
+  check_cuda_error(cublasGemmEx(param_.cublas_handle, 
+    CUBLAS_OP_N, CUBLAS_OP_N, 
+    n, m, k, 
+    &alpha, 
+    param_.self_attention.attention_output_weight.kernel, AType_, n, 
+    context_buf_, BType_, k, 
+    &beta, 
+    decoder_output, CType_, n, 
+    computeType_, 
+    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+}
+
 template <typename T>
 __global__
 void decoder_norm1_kernel_generalize(const T* __restrict input, 
@@ -1771,6 +2439,88 @@ void OpenDecoder<OpType_>::ffn(
     static_cast<cublasGemmAlgo_t>(cublasAlgo_[3])));
 }
 
+template<OperationType OpType_>
+void OpenDecoder<OpType_>::moe_ffn(
+  const DataType_* input,
+  const DataType_* residual,
+  DataType_* output,
+  const int m,
+  const int inner_size,
+  const int n,
+  ActivationType activation_type)
+{
+  const int expert_num = moe_expert_num_;
+  const int capacity = moe_capacity_;
+  DataType_ alpha = (DataType_)1.0f;
+  DataType_ beta = (DataType_)0.0f;
+  const cublasGemmAlgo_t default_algo = Traits_::OpType == OperationType::FP32 ?
+                                        CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+
+  /* gating logits: [m, n] x [n, expert_num] */
+  check_cuda_error(cublasGemmEx(param_.cublas_handle,
+    CUBLAS_OP_N, CUBLAS_OP_N,
+    expert_num, m, n,
+    &alpha,
+    param_.moe_ffn.gating_weight.kernel, AType_, expert_num,
+    input, BType_, n,
+    &beta,
+    moe_gating_buf_, CType_, expert_num,
+    computeType_,
+    default_algo));
+
+  moe_topk_gating_kernelLauncher(moe_gating_buf_, param_.moe_ffn.gating_weight.bias,
+                                 moe_expert_ids_, moe_gate_weights_,
+                                 m, expert_num, moe_k_, param_.stream);
+
+  moe_permute_indices_kernelLauncher(moe_expert_ids_, moe_expanded_slots_, moe_expert_counts_,
+                                     m, expert_num, moe_k_, capacity, param_.stream);
+
+#ifndef NDEBUG
+  cudaDeviceSynchronize();
+  check_cuda_error(cudaGetLastError());
+  // moe_routing_kernel_check(moe_gating_buf_, param_.moe_ffn.gating_weight.bias, moe_expert_ids_, moe_gate_weights_,
+  //                          moe_expanded_slots_, moe_expert_counts_, m, expert_num, moe_k_, capacity, param_.stream);
+#endif
+
+  moe_gather_kernelLauncher(input, moe_expanded_slots_, moe_permuted_input_buf_, m, n, moe_k_, param_.stream);
+#ifndef NDEBUG
+  // moe_gather_kernel_check(input, moe_expanded_slots_, moe_permuted_input_buf_, m, n, moe_k_, param_.stream);
+#endif
+
+  /* Every expert computes capacity rows, so that all experts run in one strided batched GEMM.
+     The rows behind expert_counts are never gathered back by moe_combine. */
+  check_cuda_error(cublasGemmStridedBatchedEx(param_.cublas_handle,
+    CUBLAS_OP_N, CUBLAS_OP_N,
+    inner_size, capacity, n,
+    &alpha,
+    param_.moe_ffn.experts.intermediate_weight.kernel, AType_, inner_size, (long long)n * inner_size,
+    moe_permuted_input_buf_, BType_, n, (long long)capacity * n,
+    &beta,
+    moe_inner_buf_, CType_, inner_size, (long long)capacity * inner_size,
+    expert_num,
+    computeType_,
+    default_algo));
+
+  moe_add_bias_act_kernelLauncher(moe_inner_buf_, param_.moe_ffn.experts.intermediate_weight.bias,
+                                  expert_num, capacity, inner_size, activation_type, param_.stream);
+
+  check_cuda_error(cublasGemmStridedBatchedEx(param_.cublas_handle,
+    CUBLAS_OP_N, CUBLAS_OP_N,
+    n, capacity, inner_size,
+    &alpha,
+    param_.moe_ffn.experts.output_weight.kernel, AType_, n, (long long)inner_size * n,
+    moe_inner_buf_, BType_, inner_size, (long long)capacity * inner_size,
+    &beta,
+    moe_permuted_output_buf_, CType_, n, (long long)capacity * n,
+    expert_num,
+    computeType_,
+    default_algo));
+
+  moe_combine_kernelLauncher(moe_permuted_output_buf_, param_.moe_ffn.experts.output_weight.bias, residual,
+                             moe_expert_ids_, moe_expanded_slots_, moe_gate_weights_,
+                             output, m, n, moe_k_, param_.stream);
+}
+
 template <typename T>
 __global__ 
 void add_bias_input_kernel(T* output, const T* input, const T* bias, const int m, const int n)
@@ -1841,6 +2591,62 @@ template void OpenDecoder<OperationType::FP16>::cross_multi_head_attention(
   const int max_seq_len,
   const int step);
 
+template void OpenDecoder<OperationType::FP32>::masked_context_attention(
+  const float* from_tensor,
+  float* decoder_output,
+  const int query_len);
+
+template void OpenDecoder<OperationType::FP16>::masked_context_attention(
+  const half* from_tensor,
+  half* decoder_output,
+  const int query_len);
+
+template void OpenDecoder<OperationType::FP32>::cross_context_attention(
+  const float* from_tensor,
+  const float* memory_tensor,
+  float* key_mem_cache,
+  float* value_mem_cache,
+  float* decoder_output,
+  const int* length,
+  const int max_seq_len,
+  const int query_len,
+  const bool project_memory);
+
+template void OpenDecoder<OperationType::FP16>::cross_context_attention(
+  const half* from_tensor,
+  const half* memory_tensor,
+  half* key_mem_cache,
+  half* value_mem_cache,
+  half* decoder_output,
+  const int* length,
+  const int max_seq_len,
+  const int query_len,
+  const bool project_memory);
+
+template void OpenDecoder<OperationType::FP32>::masked_multi_token_attention(
+  const float* from_tensor,
+  float* key_cache,
+  float* value_cache,
+  float* decoder_output,
+  const int* positions,
+  const int tokens_per_row,
+  const int max_cache_len,
+  const int* row_slots,
+  const int row_num,
+  const int cache_batch);
+
+template void OpenDecoder<OperationType::FP16>::masked_multi_token_attention(
+  const half* from_tensor,
+  half* key_cache,
+  half* value_cache,
+  half* decoder_output,
+  const int* positions,
+  const int tokens_per_row,
+  const int max_cache_len,
+  const int* row_slots,
+  const int row_num,
+  const int cache_batch);
+
 template void OpenDecoder<OperationType::FP32>::ffn(
   const float* input,
   float* ffn_inner, 
@@ -1859,6 +2665,24 @@ template void OpenDecoder<OperationType::FP16>::ffn(
   const int n,
   ActivationType activation_type);
 
+template void OpenDecoder<OperationType::FP32>::moe_ffn(
+  const float* input,
+  const float* residual,
+  float* output,
+  const int m,
+  const int inner_size,
+  const int n,
+  ActivationType activation_type);
+
+template void OpenDecoder<OperationType::FP16>::moe_ffn(
+  const half* input,
+  const half* residual,
+  half* output,
+  const int m,
+  const int inner_size,
+  const int n,
+  ActivationType activation_type);
+
 template void OpenDecoder<OperationType::FP32>::decoder_norm1(
   const float* input,
   const float* gamma,
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/cuda/pooling_kernels.h"
+#include "cub/cub.cuh"
+
+namespace fastertransformer
+{
+
+#define POOLING_BLOCK_SIZE 256
+#define L2_NORMALIZE_EPS 1e-12f
+
+/* first compact row whose padded position is not less than padded_pos */
+__device__ __forceinline__
+int compact_row_lower_bound(const int* sequence_id_offset, const int valid_word_num, const int padded_pos)
+{
+  int low = 0, high = valid_word_num;
+  while(low < high)
+  {
+    const int mid = (low + high) >> 1;
+    if(mid + __ldg(&sequence_id_offset[mid]) < padded_pos)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* grid: (batch_size, ceil(hidden_units / POOLING_BLOCK_SIZE)), one thread per column */
+template <typename T>
+__global__
+void encoder_pooling_kernel(T* pooled, const T* encoder_out,
+                            const int* sequence_length, const int* sequence_id_offset,
+                            const int valid_word_num, const PoolingType pooling_type,
+                            const int max_seq_len, const int hidden_units)
+{
+  const int batch_id = blockIdx.x;
+  const int col = blockIdx.y * blockDim.x + threadIdx.x;
+  __shared__ int s_begin, s_end;
+
+  if(threadIdx.x == 0)
+  {
+    int begin, end;
+    if(sequence_id_offset != nullptr)
+    {
+      begin = compact_row_lower_bound(sequence_id_offset, valid_word_num, batch_id * max_seq_len);
+      end = compact_row_lower_bound(sequence_id_offset, valid_word_num, (batch_id + 1) * max_seq_len);
+    }
+    else
+    {
+      begin = batch_id * max_seq_len;
+      end = begin + (sequence_length != nullptr ? min(max(sequence_length[batch_id], 0), max_seq_len) : max_seq_len);
+    }
+    if(pooling_type == PoolingType::CLS)
+      end = min(end, begin + 1);
+    s_begin = begin;
+    s_end = end;
+  }
+  __syncthreads();
+
+  if(col >= hidden_units) return;
+
+  float sum = 0.0f;
+  for(int row = s_begin; row < s_end; row++)
+    sum += (float)encoder_out[row * hidden_units + col];
+  const int count = s_end - s_begin;
+  pooled[batch_id * hidden_units + col] = (T)(count > 0 ? sum / count : 0.0f);
+}
+
+template <typename T>
+__global__
+void encoder_head_add_bias(T* out, const T* bias, const int m, const int n, const bool use_tanh)
+{
+  for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < m * n; index += gridDim.x * blockDim.x)
+  {
+    float val = (float)out[index] + (bias != nullptr ? (float)__ldg(&bias[index % n]) : 0.0f);
+    out[index] = (T)(use_tanh ? tanhf(val) : val);
+  }
+}
+
+__device__ __forceinline__ void store_embedding(float* out, const float val) { *out = val; }
+__device__ __forceinline__ void store_embedding(half* out, const float val) { *out = __float2half(val); }
+__device__ __forceinline__ void store_embedding(int8_t* out, const float val)
+{
+  *out = (int8_t)fminf(fmaxf(rintf(val * EMBEDDING_INT8_SCALE), -127.0f), 127.0f);
+}
+
+/* one block per row */
+template <typename T, typename OutT>
+__global__
+void l2_normalize_kernel(OutT* embedding, const T* in, const int n)
+{
+  typedef cub::BlockReduce<float, POOLING_BLOCK_SIZE> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_inv_norm;
+
+  const T* row = in + blockIdx.x * n;
+  float sum = 0.0f;
+  for(int i = threadIdx.x; i < n; i += blockDim.x)
+  {
+    const float val = (float)row[i];
+    sum += val * val;
+  }
+  sum = BlockReduce(temp_storage).Sum(sum);
+  if(threadIdx.x == 0)
+    s_inv_norm = 1.0f / fmaxf(sqrtf(sum), L2_NORMALIZE_EPS);
+  __syncthreads();
+
+  for(int i = threadIdx.x; i < n; i += blockDim.x)
+    store_embedding(embedding + blockIdx.x * n + i, (float)row[i] * s_inv_norm);
+}
+
+template <typename T>
+void encoder_pooling_kernelLauncher(T* pooled, const T* encoder_out,
+                                    const int* sequence_length, const int* sequence_id_offset,
+                                    const int valid_word_num, const PoolingType pooling_type,
+                                    const int batch_size, const int max_seq_len, const int hidden_units,
+                                    cudaStream_t stream)
+{
+  dim3 grid(batch_size, (hidden_units + POOLING_BLOCK_SIZE - 1) / POOLING_BLOCK_SIZE);
+  dim3 block(POOLING_BLOCK_SIZE);
+  encoder_pooling_kernel<T><<<grid, block, 0, stream>>>(pooled, encoder_out, sequence_length, sequence_id_offset,
+                                                        valid_word_num, pooling_type, max_seq_len, hidden_units);
+}
+
+template <typename T>
+void encoder_head_add_bias_kernelLauncher(T* out, const T* bias, const int m, const int n,
+                                          const bool use_tanh, cudaStream_t stream)
+{
+  dim3 block(256);
+  dim3 grid(min((m * n + 255) / 256, 65536));
+  encoder_head_add_bias<T><<<grid, block, 0, stream>>>(out, bias, m, n, use_tanh);
+}
+
+template <typename T>
+void l2_normalize_kernelLauncher(void* embedding, const T* in, const int m, const int n,
+                                 const EmbeddingType embedding_type, cudaStream_t stream)
+{
+  dim3 grid(m);
+  dim3 block(POOLING_BLOCK_SIZE);
+  switch(embedding_type)
+  {
+    case EmbeddingType::FP32:
+      l2_normalize_kernel<T, float><<<grid, block, 0, stream>>>((float*)embedding, in, n);
+      break;
+    case EmbeddingType::FP16:
+      l2_normalize_kernel<T, half><<<grid, block, 0, stream>>>((half*)embedding, in, n);
+      break;
+    case EmbeddingType::INT8:
+      l2_normalize_kernel<T, int8_t><<<grid, block, 0, stream>>>((int8_t*)embedding, in, n);
+      break;
+    default:
+      printf("[ERROR] l2_normalize_kernelLauncher needs the type of the embedding. \n");
+      exit(-1);
+  }
+}
+
+template void encoder_pooling_kernelLauncher(float* pooled, const float* encoder_out,
+                                             const int* sequence_length, const int* sequence_id_offset,
+                                             const int valid_word_num, const PoolingType pooling_type,
+                                             const int batch_size, const int max_seq_len, const int hidden_units,
+                                             cudaStream_t stream);
+
+template void encoder_pooling_kernelLauncher(half* pooled, const half* encoder_out,
+                                             const int* sequence_length, const int* sequence_id_offset,
+                                             const int valid_word_num, const PoolingType pooling_type,
+                                             const int batch_size, const int max_seq_len, const int hidden_units,
+                                             cudaStream_t stream);
+
+template void encoder_head_add_bias_kernelLauncher(float* out, const float* bias, const int m, const int n,
+                                                   const bool use_tanh, cudaStream_t stream);
+
+template void encoder_head_add_bias_kernelLauncher(half* out, const half* bias, const int m, const int n,
+                                                   const bool use_tanh, cudaStream_t stream);
+
+template void l2_normalize_kernelLauncher(void* embedding, const float* in, const int m, const int n,
+                                          const EmbeddingType embedding_type, cudaStream_t stream);
+
+template void l2_normalize_kernelLauncher(void* embedding, const half* in, const int m, const int n,
+                                          const EmbeddingType embedding_type, cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Kernels of the output heads of the encoder
+ *
+ * The encoder output is either padded, [batch_size, max_seq_len, hidden_units],
+ * or compact when the padding is removed, [valid_word_num, hidden_units] with
+ * sequence_id_offset from remove_sequence_length_padding_kernelLauncher. The
+ * compact row r is the token at padded position r + sequence_id_offset[r], so
+ * the rows of a sentence are found without the sequence lengths.
+ *
+ * In the embedding mode the pooled vectors are L2-normalized and stored in
+ * FP32, FP16 or INT8. An INT8 embedding is the normalized vector scaled by
+ * EMBEDDING_INT8_SCALE, so the dot product of two of them divided by the
+ * square of the scale is the cosine similarity.
+ **/
+
+#pragma once
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include "fastertransformer/common.h"
+#include "fastertransformer/common_structure.h"
+
+namespace fastertransformer
+{
+
+#define EMBEDDING_INT8_SCALE 127.0f
+
+enum class PoolingType{CLS, MEAN};
+
+enum class EmbeddingType{NONE, FP32, FP16, INT8};
+
+inline size_t embedding_type_size(const EmbeddingType embedding_type)
+{
+  return embedding_type == EmbeddingType::FP32 ? sizeof(float) :
+         embedding_type == EmbeddingType::FP16 ? sizeof(half) :
+         embedding_type == EmbeddingType::INT8 ? sizeof(int8_t) : 0;
+}
+
+/* pooled is [batch_size, hidden_units]. CLS takes the first token of each sentence, MEAN
+   averages the valid tokens of each sentence in float.
+   If sequence_id_offset is not nullptr, encoder_out is compact and has valid_word_num rows.
+   Otherwise encoder_out is padded and sequence_length gives the valid tokens of MEAN
+   (all max_seq_len tokens if it is nullptr). An empty sentence is pooled to zeros. */
+template <typename T>
+void encoder_pooling_kernelLauncher(T* pooled, const T* encoder_out,
+                                    const int* sequence_length, const int* sequence_id_offset,
+                                    const int valid_word_num, const PoolingType pooling_type,
+                                    const int batch_size, const int max_seq_len, const int hidden_units,
+                                    cudaStream_t stream);
+
+/* out = out + bias, followed by tanh if use_tanh (the dense of the BERT pooler). */
+template <typename T>
+void encoder_head_add_bias_kernelLauncher(T* out, const T* bias, const int m, const int n,
+                                          const bool use_tanh, cudaStream_t stream);
+
+/* embedding[m, n] = in / max(|in|, eps) for every row, stored as embedding_type. */
+template <typename T>
+void l2_normalize_kernelLauncher(void* embedding, const T* in, const int m, const int n,
+                                 const EmbeddingType embedding_type, cudaStream_t stream);
+
+} // namespace fastertransformer
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/cuda/stop_criteria_kernels.h"
+
+namespace fastertransformer
+{
+
+/* one block per row, one thread per stop sequence, which is matched backwards from the
+   token of this step */
+__global__
+void stop_criteria_kernel(bool* finished, const int* output_ids, const int* parent_ids,
+                          const int* stop_words, const int stop_words_len,
+                          const int* max_new_tokens, const int step,
+                          const int batch_size, const int beam_width)
+{
+  const int row = blockIdx.x;
+  const int batch_id = row / beam_width;
+  const int rows = batch_size * beam_width;
+  __shared__ bool s_stop;
+  if(threadIdx.x == 0)
+    s_stop = max_new_tokens != nullptr && step >= max_new_tokens[batch_id];
+  __syncthreads();
+
+  if(stop_words != nullptr && !s_stop)
+  {
+    const int* ids = stop_words + batch_id * 2 * stop_words_len;
+    const int* offsets = ids + stop_words_len;
+    for(int w = threadIdx.x; w < stop_words_len; w += blockDim.x)
+    {
+      const int end = offsets[w];
+      if(end < 0)
+        break;
+      const int begin = w == 0 ? 0 : offsets[w - 1];
+      if(end - begin > step)
+        continue;
+
+      bool match = true;
+      int r = row;
+      for(int t = end - 1, s = step - 1; t >= begin; t--, s--)
+      {
+        if(output_ids[s * rows + r] != ids[t])
+        {
+          match = false;
+          break;
+        }
+        if(parent_ids != nullptr)
+          r = batch_id * beam_width + parent_ids[s * rows + r] % beam_width;
+      }
+      if(match)
+        s_stop = true;
+    }
+  }
+  __syncthreads();
+  if(threadIdx.x == 0 && s_stop)
+    finished[row] = true;
+}
+
+void stop_criteria_kernelLauncher(bool* finished, const int* output_ids, const int* parent_ids,
+                                  const int* stop_words, const int stop_words_len,
+                                  const int* max_new_tokens, const int step,
+                                  const int batch_size, const int beam_width, cudaStream_t stream)
+{
+  if(stop_words == nullptr && max_new_tokens == nullptr)
+    return;
+  stop_criteria_kernel<<<batch_size * beam_width, 32, 0, stream>>>(finished, output_ids, parent_ids,
+                                                                   stop_words, stop_words_len,
+                                                                   max_new_tokens, step,
+                                                                   batch_size, beam_width);
+}
+
+} // namespace fastertransformer
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Per-sentence stop criteria of the decoding
+ *
+ * After every step a row is finished if its latest tokens end with one of the
+ * stop sequences of its sentence, or if its sentence has generated
+ * max_new_tokens tokens. The finished rows then only emit end_id, and the
+ * decoding ends as soon as all the rows are finished.
+ *
+ * The stop sequences of the sentences are packed in stop_words, of shape
+ * [batch_size, 2, stop_words_len]: the concatenated token ids of the stop
+ * sequences of a sentence, then the exclusive end offsets of the sequences in
+ * these ids, padded with -1.
+ **/
+
+#pragma once
+#include <cuda_runtime.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+/* Pack stop_words[b] (the stop sequences of sentence b) in the layout above, stop_words_len
+   is the most ids of a sentence. */
+inline std::vector<int> pack_stop_words(const std::vector<std::vector<std::vector<int>>> &stop_words,
+                                        int &stop_words_len)
+{
+  stop_words_len = 1;
+  for (size_t b = 0; b < stop_words.size(); b++)
+  {
+    int len = 0;
+    for (size_t i = 0; i < stop_words[b].size(); i++)
+      len += (int)stop_words[b][i].size();
+    stop_words_len = len > stop_words_len ? len : stop_words_len;
+  }
+
+  std::vector<int> packed(stop_words.size() * 2 * stop_words_len, -1);
+  for (size_t b = 0; b < stop_words.size(); b++)
+  {
+    int *ids = packed.data() + b * 2 * stop_words_len;
+    int *offsets = ids + stop_words_len;
+    int len = 0, num = 0;
+    for (size_t i = 0; i < stop_words[b].size(); i++)
+    {
+      if (stop_words[b][i].empty())
+        continue;
+      for (size_t j = 0; j < stop_words[b][i].size(); j++)
+        ids[len++] = stop_words[b][i][j];
+      offsets[num++] = len;
+    }
+  }
+  return packed;
+}
+
+/* The rows are [batch_size, beam_width], output_ids and parent_ids are [seq_len, rows] and
+   the tokens of step (1-based) are at output_ids + (step - 1) * rows. parent_ids is nullptr
+   for the sampling, the history of a beam follows it otherwise. stop_words and
+   max_new_tokens ([batch_size]) can be nullptr. finished is only set, never cleared. */
+void stop_criteria_kernelLauncher(bool* finished, const int* output_ids, const int* parent_ids,
+                                  const int* stop_words, const int stop_words_len,
+                                  const int* max_new_tokens, const int step,
+                                  const int batch_size, const int beam_width, cudaStream_t stream);
+
+} // namespace fastertransformer
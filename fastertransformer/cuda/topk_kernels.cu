@@ -16,6 +16,8 @@
 
 #include "fastertransformer/cuda/topk_kernels.cuh"
 #include "cub/cub.cuh"
+#include <stdexcept>
+#include <string>
 
 namespace fastertransformer
 {
@@ -543,6 +545,285 @@ __global__ void sampling(int* topk_tmp_id_buf,
     }
 }
 
+/* ************************** top-k sampling for any k *************************** */
+
+/* order preserving map from float to unsigned int, a larger key is a larger value */
+__device__ __forceinline__ unsigned int topk_float_to_key(const float val)
+{
+    const unsigned int bits = __float_as_uint(val);
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+__device__ __forceinline__ float topk_key_to_float(const unsigned int key)
+{
+    return __uint_as_float((key & 0x80000000u) ? (key & 0x7fffffffu) : ~key);
+}
+
+template<typename T>
+struct TopKLogitsKey
+{
+    const T* logits;
+    __device__ __forceinline__ unsigned int operator()(const int i) const { return topk_float_to_key((float)logits[i]); }
+};
+
+struct TopKCandidateKey
+{
+    const unsigned int* keys;
+    __device__ __forceinline__ unsigned int operator()(const int i) const { return keys[i]; }
+};
+
+/* Radix select over 8-bit digits from the most significant one. threshold is the key of
+   the k-th largest element, and num_equal is the number of elements equal to threshold
+   that belong to the top k. */
+template<int BLOCK_SIZE, typename GetKey>
+__device__ void block_radix_select(const GetKey& get_key, const int len, const int k,
+                                   unsigned int& threshold, int& num_equal)
+{
+    __shared__ int s_hist[256];
+    __shared__ unsigned int s_prefix;
+    __shared__ int s_remain;
+    if(threadIdx.x == 0)
+    {
+        s_prefix = 0u;
+        s_remain = k;
+    }
+    for(int shift = 24; shift >= 0; shift -= 8)
+    {
+        for(int i = threadIdx.x; i < 256; i += BLOCK_SIZE)
+            s_hist[i] = 0;
+        __syncthreads();
+
+        const unsigned int prefix = s_prefix;
+        const unsigned int mask = shift == 24 ? 0u : (0xffffffffu << (shift + 8));
+        for(int i = threadIdx.x; i < len; i += BLOCK_SIZE)
+        {
+            const unsigned int key = get_key(i);
+            if((key & mask) == prefix)
+                atomicAdd(&s_hist[(key >> shift) & 0xff], 1);
+        }
+        __syncthreads();
+
+        if(threadIdx.x == 0)
+        {
+            int remain = s_remain;
+            int digit = 255;
+            for(; digit > 0; digit--)
+            {
+                if(s_hist[digit] >= remain)
+                    break;
+                remain -= s_hist[digit];
+            }
+            s_prefix = prefix | ((unsigned int)digit << shift);
+            s_remain = remain;
+        }
+        __syncthreads();
+    }
+    threshold = s_prefix;
+    num_equal = s_remain;
+    __syncthreads();
+}
+
+/* Write the top k elements in index order. Among the elements equal to threshold the
+   ones with smaller index are kept, so the result does not depend on the scheduling. */
+template<int BLOCK_SIZE, typename GetKey>
+__device__ void block_select_compact(const GetKey& get_key, const int len,
+                                     const unsigned int threshold, const int num_equal,
+                                     const int* src_ids, const int id_offset,
+                                     unsigned int* out_keys, int* out_ids)
+{
+    typedef cub::BlockScan<int, BLOCK_SIZE> BlockScan;
+    __shared__ typename BlockScan::TempStorage temp_storage;
+
+    int taken_base = 0;
+    int equal_base = 0;
+    for(int base = 0; base < len; base += BLOCK_SIZE)
+    {
+        const int i = base + threadIdx.x;
+        const unsigned int key = i < len ? get_key(i) : 0u;
+        const int is_equal = (i < len && key == threshold) ? 1 : 0;
+        int equal_rank, equal_total;
+        BlockScan(temp_storage).ExclusiveSum(is_equal, equal_rank, equal_total);
+        __syncthreads();
+
+        const int taken = ((i < len && key > threshold) || (is_equal && equal_base + equal_rank < num_equal)) ? 1 : 0;
+        int taken_rank, taken_total;
+        BlockScan(temp_storage).ExclusiveSum(taken, taken_rank, taken_total);
+        __syncthreads();
+
+        if(taken)
+        {
+            out_keys[taken_base + taken_rank] = key;
+            out_ids[taken_base + taken_rank] = src_ids != nullptr ? src_ids[i] : id_offset + i;
+        }
+        taken_base += taken_total;
+        equal_base += equal_total;
+    }
+}
+
+/* blocks_per_row blocks per row, each one writes the top k of its part of the vocab */
+template<typename T, int BLOCK_SIZE>
+__launch_bounds__(BLOCK_SIZE)
+__global__ void topk_sampling_stage_1(const T* logits, unsigned int* topk_tmp_keys, int* topk_tmp_ids,
+                                      const int vocab_size, const int k, const int blocks_per_row)
+{
+    const int row = blockIdx.x / blocks_per_row;
+    const int part = blockIdx.x % blocks_per_row;
+    const int chunk = (vocab_size + blocks_per_row - 1) / blocks_per_row;
+    const int start = part * chunk;
+    const int len = max(0, min(chunk, vocab_size - start));
+    const int k_part = min(k, len);
+
+    unsigned int* out_keys = topk_tmp_keys + (size_t)blockIdx.x * k;
+    int* out_ids = topk_tmp_ids + (size_t)blockIdx.x * k;
+
+    if(k_part > 0)
+    {
+        TopKLogitsKey<T> get_key = {logits + (size_t)row * vocab_size + start};
+        unsigned int threshold;
+        int num_equal;
+        block_radix_select<BLOCK_SIZE>(get_key, len, k_part, threshold, num_equal);
+        block_select_compact<BLOCK_SIZE>(get_key, len, threshold, num_equal, nullptr, start, out_keys, out_ids);
+    }
+    // the part has less than k elements
+    for(int i = k_part + threadIdx.x; i < k; i += BLOCK_SIZE)
+    {
+        out_keys[i] = 0u;
+        out_ids[i] = -1;
+    }
+}
+
+/* Merge the candidate_len candidates of the parts of a row: the top k are written to s_keys
+   and s_ids [BLOCK_SIZE * ITEMS_PER_THREAD] in descending order (ties keep the smaller id
+   first), the slots after k get the id -1. */
+template<int BLOCK_SIZE, int ITEMS_PER_THREAD>
+__device__ void block_topk_merge_sort(const unsigned int* keys, const int* ids, const int candidate_len,
+                                      const int k, unsigned int* s_keys, int* s_ids)
+{
+    typedef cub::BlockRadixSort<unsigned int, BLOCK_SIZE, ITEMS_PER_THREAD, int> BlockRadixSort;
+    __shared__ typename BlockRadixSort::TempStorage sort_storage;
+
+    TopKCandidateKey get_key = {keys};
+    unsigned int threshold;
+    int num_equal;
+    block_radix_select<BLOCK_SIZE>(get_key, candidate_len, k, threshold, num_equal);
+    block_select_compact<BLOCK_SIZE>(get_key, candidate_len, threshold, num_equal, ids, 0, s_keys, s_ids);
+    for(int i = k + threadIdx.x; i < BLOCK_SIZE * ITEMS_PER_THREAD; i += BLOCK_SIZE)
+    {
+        s_keys[i] = 0u;
+        s_ids[i] = -1;
+    }
+    __syncthreads();
+
+    // blocked arrangement, the radix sort is stable so the ties stay in index order
+    unsigned int thread_keys[ITEMS_PER_THREAD];
+    int thread_ids[ITEMS_PER_THREAD];
+    #pragma unroll
+    for(int i = 0; i < ITEMS_PER_THREAD; i++)
+    {
+        thread_keys[i] = s_keys[threadIdx.x * ITEMS_PER_THREAD + i];
+        thread_ids[i] = s_ids[threadIdx.x * ITEMS_PER_THREAD + i];
+    }
+    __syncthreads();
+    BlockRadixSort(sort_storage).SortDescending(thread_keys, thread_ids);
+    #pragma unroll
+    for(int i = 0; i < ITEMS_PER_THREAD; i++)
+    {
+        s_keys[threadIdx.x * ITEMS_PER_THREAD + i] = thread_keys[i];
+        s_ids[threadIdx.x * ITEMS_PER_THREAD + i] = thread_ids[i];
+    }
+    __syncthreads();
+}
+
+/* One block per row. Merge the candidates of the parts, sort the top k in descending order
+   (ties keep the smaller id first) and sample from the first prob_threshold of the mass. */
+template<int BLOCK_SIZE, int ITEMS_PER_THREAD>
+__launch_bounds__(BLOCK_SIZE)
+__global__ void topk_sampling_stage_2(const unsigned int* topk_tmp_keys, const int* topk_tmp_ids,
+                                      int* ids, int* sequence_length, bool* finished_buf,
+                                      const int k, const int candidate_len, const int random_num,
+                                      const float prob_threshold, const int end_id)
+{
+    __shared__ unsigned int s_keys[BLOCK_SIZE * ITEMS_PER_THREAD];
+    __shared__ int s_ids[BLOCK_SIZE * ITEMS_PER_THREAD];
+
+    const int row = blockIdx.x;
+    block_topk_merge_sort<BLOCK_SIZE, ITEMS_PER_THREAD>(topk_tmp_keys + (size_t)row * candidate_len,
+                                                        topk_tmp_ids + (size_t)row * candidate_len,
+                                                        candidate_len, k, s_keys, s_ids);
+
+    if(threadIdx.x == 0)
+    {
+        const float max_val = topk_key_to_float(s_keys[0]);
+        float sum = 0.0f;
+        for(int i = 0; i < k; i++)
+        {
+            if(s_ids[i] >= 0)
+                sum += __expf(topk_key_to_float(s_keys[i]) - max_val);
+        }
+
+        curandState_t local_state;
+        curand_init(random_num, row, 0, &local_state);
+        float rand_num = curand_uniform(&local_state) * prob_threshold * sum;
+
+        int id = s_ids[0];
+        for(int i = 0; i < k; i++)
+        {
+            if(s_ids[i] < 0)
+                continue;
+            id = s_ids[i];
+            rand_num = rand_num - __expf(topk_key_to_float(s_keys[i]) - max_val);
+            if(rand_num <= 0.0f)
+                break;
+        }
+        ids[row] = id;
+
+        if(sequence_length != nullptr && finished_buf != nullptr)
+        {
+            sequence_length[row] = finished_buf[row] ? sequence_length[row] : sequence_length[row] + 1;
+            finished_buf[row] = ids[row] == end_id ? 1 : 0;
+        }
+    }
+}
+
+static const int TOPK_SAMPLING_BLOCK_SIZE = 256;
+static const int TOPK_SAMPLING_ITEMS_PER_THREAD = TOPK_SAMPLING_MAX_K / TOPK_SAMPLING_BLOCK_SIZE;
+
+size_t get_topk_sampling_general_workspace_size(const int batch_size, const int vocab_size, const int k)
+{
+    int topk_tmp_buf_size = batch_size * topk_sampling_blocks_per_row(vocab_size) * k; // type unsigned int and int
+    topk_tmp_buf_size = (int)(ceil(topk_tmp_buf_size / 4.)) * 4;
+    return sizeof(unsigned int) * topk_tmp_buf_size + sizeof(int) * topk_tmp_buf_size;
+}
+
+template<typename T>
+void topk_sampling_general_kernelLauncher(void* workspace, const T* logits, int* ids,
+                                          int* sequence_length, bool* finished_buf,
+                                          const int batch_size, const int vocab_size, const int k,
+                                          const int random_num, const float prob_threshold,
+                                          const int end_id, cudaStream_t stream)
+{
+    const int blocks_per_row = topk_sampling_blocks_per_row(vocab_size);
+    int topk_tmp_buf_size = batch_size * blocks_per_row * k;
+    topk_tmp_buf_size = (int)(ceil(topk_tmp_buf_size / 4.)) * 4;
+    unsigned int* topk_tmp_keys = (unsigned int*)workspace;
+    int* topk_tmp_ids = (int*)(topk_tmp_keys + topk_tmp_buf_size);
+
+    topk_sampling_stage_1<T, TOPK_SAMPLING_BLOCK_SIZE><<<batch_size * blocks_per_row, TOPK_SAMPLING_BLOCK_SIZE, 0, stream>>>(
+        logits, topk_tmp_keys, topk_tmp_ids, vocab_size, k, blocks_per_row);
+    topk_sampling_stage_2<TOPK_SAMPLING_BLOCK_SIZE, TOPK_SAMPLING_ITEMS_PER_THREAD><<<batch_size, TOPK_SAMPLING_BLOCK_SIZE, 0, stream>>>(
+        topk_tmp_keys, topk_tmp_ids, ids, sequence_length, finished_buf,
+        k, blocks_per_row * k, random_num, prob_threshold, end_id);
+}
+
+void check_topk_sampling_args(const int candidate_num, const int vocab_size)
+{
+    if(!is_topk_sampling_supported(candidate_num, vocab_size))
+        throw std::runtime_error(std::string("[FT][ERROR] Top-k sampling does not support candidate_num = ") +
+                                 std::to_string(candidate_num) + " with vocab_size = " + std::to_string(vocab_size) +
+                                 ", candidate_num should be in [1, min(" + std::to_string(TOPK_SAMPLING_MAX_K) +
+                                 ", vocab_size)]. ");
+}
+
 #define CASE_K(K) \
   case K : \
     beam_topK_kernel<T, K, block_size><<<batch_size, block_size, 0, stream>>>(log_probs, \
@@ -565,7 +846,25 @@ void topK_sampling_kernel_kernelLauncher(void* workspace,
     const int candidate_num = args.candidate_num_;
     const int end_id = args.end_id_;
     const int block_size = 256;
-    
+
+    if(workspace == nullptr && candidate_num == 0)
+    {
+        // top p sampling also queries the size, it does not use the top k kernels
+        workspace_size = 0;
+        return;
+    }
+    check_topk_sampling_args(candidate_num, vocab_size);
+    if(!is_topk_sampling_register_k(candidate_num))
+    {
+        if(workspace == nullptr)
+            workspace_size = get_topk_sampling_general_workspace_size(batch_size, vocab_size, candidate_num);
+        else
+            topk_sampling_general_kernelLauncher(workspace, log_probs, ids, sequence_length, finished_buf,
+                                                 batch_size, vocab_size, candidate_num, random_num, 1.0f,
+                                                 end_id, stream);
+        return;
+    }
+
     int topk_tmp_ids_buf_size = args.batch_size_ * args.candidate_num_; // type int
     int topk_tmp_val_buf_size = args.batch_size_ * args.candidate_num_; // type T
     topk_tmp_ids_buf_size = (int)(ceil(topk_tmp_ids_buf_size / 4.)) * 4;
@@ -585,10 +884,8 @@ void topK_sampling_kernel_kernelLauncher(void* workspace,
             CASE_K(1);
             CASE_K(2);
             CASE_K(4);
-            default:
-                printf("[ERROR] Topk kernel does not support candidate_num = %d \n", candidate_num);
-                exit(0);
-                break;
+            CASE_K(8);
+            CASE_K(16);
         }
         sampling<T> <<< batch_size, candidate_num, 0, stream>>> (topk_tmp_id_buf, topk_tmp_val_buf, 
             ids, sequence_length, finished_buf,
@@ -670,16 +967,17 @@ __global__ void top_p_sampling(T* sorted_log_probs,
     curandState_t local_state;
     curand_init((T)random_num, tid, 0, &local_state);
     T rand_num = (T)curand_uniform(&local_state) * (T)prob_threshold;
-    ids[tid] = sorted_id_vals[vocab_size - 1];
+    ids[tid] = sorted_id_vals[tid * vocab_size];
 
+    // If the rounding error leaves rand_num above the total, fall back to the last token
+    // with a non-zero probability. The masked tokens (probability 0) are never chosen.
     for(int i = tid * vocab_size; i < tid * vocab_size + vocab_size; i++)
     {
+        if(sorted_log_probs[i] > (T)0.0)
+            ids[tid] = sorted_id_vals[i];
         rand_num = rand_num - sorted_log_probs[i];
         if(rand_num <= (T)0.0)
-        {
-            ids[tid] = sorted_id_vals[i];
             break;
-        }
     }
     if(sequence_length != nullptr && finished_buf != nullptr)
     {
@@ -900,14 +1198,22 @@ void topK_topP_sampling_kernel_kernelLauncher(void* workspace,
                                               DecodingSamplingArguments& args,
                                               cudaStream_t stream)
 {
+    const int batch_size = args.batch_size_;
+    const int vocab_size = args.vocab_size_padded_;
+    check_topk_sampling_args(args.candidate_num_, vocab_size);
     if(workspace == nullptr)
     {
-        workspace_size = 0;
+        workspace_size = is_topk_sampling_register_k(args.candidate_num_) ? 0 :
+                         get_topk_sampling_general_workspace_size(batch_size, vocab_size, args.candidate_num_);
+    }
+    else if(!is_topk_sampling_register_k(args.candidate_num_))
+    {
+        topk_sampling_general_kernelLauncher(workspace, logits, output_ids, (int*)nullptr, (bool*)nullptr,
+                                             batch_size, vocab_size, args.candidate_num_, random_num,
+                                             args.probability_threshold_, args.end_id_, stream);
     }
     else
     {
-        const int batch_size = args.batch_size_;
-        const int vocab_size = args.vocab_size_padded_;
         const int block_size = 256;
         const T prob_threshold = args.probability_threshold_;
         switch(args.candidate_num_)
@@ -915,10 +1221,8 @@ void topK_topP_sampling_kernel_kernelLauncher(void* workspace,
             CASE_K(1);
             CASE_K(2);
             CASE_K(4);
-            default:
-                printf("[ERROR] Topk kernel does not support candidate_num = %d \n", args.candidate_num_);
-                exit(0);
-                break;
+            CASE_K(8);
+            CASE_K(16);
         }
     }
 }
@@ -941,4 +1245,66 @@ template void topK_topP_sampling_kernel_kernelLauncher(void* workspace,
                                                        const int random_num,
                                                        DecodingSamplingArguments& args,
                                                        cudaStream_t stream);
+
+// Similarity search kernels
+
+/* One block per row. The candidates of the parts selected by topk_sampling_stage_1 are merged
+   like topk_sampling_stage_2, then the top k are written instead of sampled. */
+template<int BLOCK_SIZE, int ITEMS_PER_THREAD>
+__launch_bounds__(BLOCK_SIZE)
+__global__ void topk_similarity_stage_2(const unsigned int* topk_tmp_keys, const int* topk_tmp_ids,
+                                        int* ids, float* topk_scores, const int k, const int candidate_len)
+{
+    __shared__ unsigned int s_keys[BLOCK_SIZE * ITEMS_PER_THREAD];
+    __shared__ int s_ids[BLOCK_SIZE * ITEMS_PER_THREAD];
+
+    const int row = blockIdx.x;
+    block_topk_merge_sort<BLOCK_SIZE, ITEMS_PER_THREAD>(topk_tmp_keys + (size_t)row * candidate_len,
+                                                        topk_tmp_ids + (size_t)row * candidate_len,
+                                                        candidate_len, k, s_keys, s_ids);
+    for(int i = threadIdx.x; i < k; i += BLOCK_SIZE)
+    {
+        ids[(size_t)row * k + i] = s_ids[i];
+        if(topk_scores != nullptr)
+            topk_scores[(size_t)row * k + i] = s_ids[i] < 0 ? -FLT_MAX : topk_key_to_float(s_keys[i]);
+    }
+}
+
+size_t get_topk_similarity_workspace_size(const int batch_size, const int candidate_num, const int k)
+{
+    return get_topk_sampling_general_workspace_size(batch_size, candidate_num, k);
+}
+
+void topk_similarity_kernelLauncher(void* workspace,
+                                    size_t& workspace_size,
+                                    const float* scores,
+                                    int* ids,
+                                    float* topk_scores,
+                                    const int batch_size,
+                                    const int candidate_num,
+                                    const int k,
+                                    cudaStream_t stream)
+{
+    if(workspace == nullptr)
+    {
+        workspace_size = get_topk_similarity_workspace_size(batch_size, candidate_num, k);
+        return;
+    }
+    if(k < 1 || k > TOPK_SIMILARITY_MAX_K || k > candidate_num)
+        throw std::runtime_error(std::string("[FT][ERROR] topk_similarity_kernelLauncher supports 1 <= k <= min(") +
+                                 std::to_string(TOPK_SIMILARITY_MAX_K) + ", candidate_num), but k is " + std::to_string(k) + ". ");
+
+    // the same radix select as the top-k sampling for any k
+    const int blocks_per_row = topk_sampling_blocks_per_row(candidate_num);
+    int topk_tmp_buf_size = batch_size * blocks_per_row * k;
+    topk_tmp_buf_size = (int)(ceil(topk_tmp_buf_size / 4.)) * 4;
+    unsigned int* topk_tmp_keys = (unsigned int*)workspace;
+    int* topk_tmp_ids = (int*)(topk_tmp_keys + topk_tmp_buf_size);
+
+    topk_sampling_stage_1<float, TOPK_SAMPLING_BLOCK_SIZE><<<batch_size * blocks_per_row, TOPK_SAMPLING_BLOCK_SIZE, 0, stream>>>(
+        scores, topk_tmp_keys, topk_tmp_ids, candidate_num, k, blocks_per_row);
+    topk_similarity_stage_2<TOPK_SAMPLING_BLOCK_SIZE, TOPK_SAMPLING_ITEMS_PER_THREAD><<<batch_size, TOPK_SAMPLING_BLOCK_SIZE, 0, stream>>>(
+        topk_tmp_keys, topk_tmp_ids, ids, topk_scores, k, blocks_per_row * k);
+}
+
 } // end of namespace fastertransformer
@@ -33,6 +33,30 @@ static const int MAX_K = 4;
 
 static const float HALF_FLT_MAX = 65504.F;
 
+/* Top-k sampling keeps the candidates in registers for the k of the dispatch table
+   (1, 2, 4, 8, 16). Other k up to TOPK_SAMPLING_MAX_K use a radix select on several
+   blocks per row followed by a merge. */
+static const int TOPK_SAMPLING_MAX_K = 1024;
+static const int TOPK_SAMPLING_MAX_BLOCKS_PER_ROW = 8;
+static const int TOPK_SAMPLING_MIN_ELEMENTS_PER_BLOCK = 4096;
+
+inline bool is_topk_sampling_supported(const int candidate_num, const int vocab_size)
+{
+    return candidate_num >= 1 && candidate_num <= TOPK_SAMPLING_MAX_K && candidate_num <= vocab_size;
+}
+
+inline bool is_topk_sampling_register_k(const int candidate_num)
+{
+    return candidate_num == 1 || candidate_num == 2 || candidate_num == 4 ||
+           candidate_num == 8 || candidate_num == 16;
+}
+
+inline int topk_sampling_blocks_per_row(const int vocab_size)
+{
+    int blocks = vocab_size / TOPK_SAMPLING_MIN_ELEMENTS_PER_BLOCK;
+    return blocks < 1 ? 1 : (blocks > TOPK_SAMPLING_MAX_BLOCKS_PER_ROW ? TOPK_SAMPLING_MAX_BLOCKS_PER_ROW : blocks);
+}
+
 template<typename T, int MAX_K>
 struct TopK
 {
@@ -186,4 +210,27 @@ void topK_topP_sampling_kernel_kernelLauncher(void* workspace,
 
 /* *************************** end of Sampling kernel *********************************** */
 
+/* ****************************** Similarity search kernel ****************************** */
+
+/* Top-k over the scores of batch_size rows of candidate_num candidates, e.g. the cosine
+   similarities of EmbeddingSearch. The radix select of the top-k sampling for any k: several
+   blocks per row select k candidates each, then one block per row merges and sorts them.
+   ids and topk_scores are [batch_size, k] in descending order, equal scores prefer the
+   smaller id. */
+static const int TOPK_SIMILARITY_MAX_K = TOPK_SAMPLING_MAX_K;
+
+size_t get_topk_similarity_workspace_size(const int batch_size, const int candidate_num, const int k);
+
+void topk_similarity_kernelLauncher(void* workspace,
+                                    size_t& workspace_size,
+                                    const float* scores,
+                                    int* ids,
+                                    float* topk_scores,
+                                    const int batch_size,
+                                    const int candidate_num,
+                                    const int k,
+                                    cudaStream_t stream);
+
+/* *************************** end of Similarity search kernel ************************** */
+
 }//namespace fastertransformer
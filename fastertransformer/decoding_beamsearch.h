@@ -24,6 +24,7 @@
 #include "fastertransformer/open_decoder.h"
 #include "fastertransformer/cuda/cuda_kernels.h"
 #include "fastertransformer/arguments.h"
+#include "fastertransformer/pinned_staging_pool.h"
 #include <cuda_runtime.h>
 
 namespace fastertransformer
@@ -54,14 +55,28 @@ private:
   DataType_ *decoder_normed_result_buf_;
   float *logits_buf_;
   float *cum_log_buf_;
+  float *prev_cum_log_buf_;
+  float *step_log_probs_buf_;
   int *word_ids_buf_;
   bool *finished_buf_;
   void *buf_;
   int *finished_count_buf_;
-  bool *h_finished_buf_;
+  FinishedFlagsReader *finished_reader_;
   float *temp_storage_;
 
+  /* args_ with vocab_size_ = vocab_size_padded_, the beam search kernels see the padded logits */
+  struct DecodingBeamsearchArguments beam_args_;
+  /* The vocab is padded to a multiple of 8 so that the logits GEMM runs on aligned leading
+     dimensions. The padded copies of the embedding kernel and bias are only used when the
+     vocab is not a multiple of 8, the bias of the padded ids is the lowest value so that
+     their log probs are -inf. */
+  DataType_ *embedding_kernel_padded_;
+  float *embedding_bias_padded_;
+  const DataType_ *embedding_kernel_src_ = nullptr;
+  const float *embedding_bias_src_ = nullptr;
+
   bool is_fuse_topk_softMax_;
+  DecodingMetricsTracker metrics_tracker_;
 
   void *topK_kernel_workspace = nullptr;
   size_t topk_workspace_size_ = 0;
@@ -75,7 +90,8 @@ public:
                      const int start_id, const int end_id,
                      const float beam_search_diversity_rate = -0.0f,
                      const bool is_fuse_topk_softMax = false) : allocator_(allocator),
-                                                                is_fuse_topk_softMax_(is_fuse_topk_softMax)
+                                                                is_fuse_topk_softMax_(is_fuse_topk_softMax),
+                                                                metrics_tracker_(batch_size, beam_width)
   {
 #ifndef NDEBUG
     PRINT_FUNC_NAME_();
@@ -91,6 +107,7 @@ public:
     args_.start_id_ = start_id;
     args_.end_id_ = end_id;
     args_.beam_search_diversity_rate_ = beam_search_diversity_rate;
+    args_.vocab_size_padded_ = div_up(vocab_size, 8) * 8;
 
     K_cache_ = new DataType_ *[2];
     V_cache_ = new DataType_ *[2];
@@ -107,8 +124,12 @@ public:
     int cache_size = args_.batch_size_ * args_.beam_width_ * args_.seq_len_ * args_.hidden_units_;         // type T
     int mem_cache_size = args_.batch_size_ * args_.beam_width_ * memory_max_seq_len * args_.hidden_units_; // type T
 
-    int logits_buf_size = args_.batch_size_ * args_.beam_width_ * args_.vocab_size_;         // type float
+    int logits_buf_size = args_.batch_size_ * args_.beam_width_ * args_.vocab_size_padded_;  // type float
+    const bool padded = args_.vocab_size_padded_ != args_.vocab_size_;
+    int embedding_kernel_padded_size = padded ? args_.hidden_units_ * args_.vocab_size_padded_ : 0; // type T
+    int embedding_bias_padded_size = padded ? args_.vocab_size_padded_ : 0;                         // type float
     int cum_log_buf_size = args_.batch_size_ * args_.beam_width_;                            // type float
+    int step_log_probs_buf_size = args_.seq_len_ * args_.batch_size_ * args_.beam_width_;    // type float
     int word_ids_buf_size = args_.batch_size_ * args_.beam_width_;                           //type int
     int finished_buf_size = args_.batch_size_ * args_.beam_width_;                           //type bool
     int finished_count_size = (int)(ceil(1 / 32.)) * 32;                                     // type int
@@ -119,24 +140,30 @@ public:
     // prevent memory misalinged address
     logits_buf_size = (int)(ceil(logits_buf_size / 4.)) * 4;
     cum_log_buf_size = (int)(ceil(cum_log_buf_size / 4.)) * 4;
+    step_log_probs_buf_size = (int)(ceil(step_log_probs_buf_size / 4.)) * 4;
     word_ids_buf_size = (int)(ceil(word_ids_buf_size / 4.)) * 4;
     finished_buf_size = (int)(ceil(finished_buf_size / 32.)) * 32;
     args_.temp_storage_size_ = (int)(ceil(args_.temp_storage_size_ / 4.)) * 4;
+    embedding_kernel_padded_size = (int)(ceil(embedding_kernel_padded_size / 4.)) * 4;
+    embedding_bias_padded_size = (int)(ceil(embedding_bias_padded_size / 4.)) * 4;
+    beam_args_ = args_;
+    beam_args_.vocab_size_ = args_.vocab_size_padded_;
 
     // get workspace size of topk kernel
     topK_kernelLauncher(topK_kernel_workspace,
                         topk_workspace_size_,
                         logits_buf_,
                         word_ids_buf_,
-                        args_,
+                        beam_args_,
                         0);
 
     int datatype_buf_size = from_tensor_size * 2 + decoder_workspace_size +
-                            (cache_size * 4 + mem_cache_size * 2) * args_.decoder_layers_ + decoder_normed_result_buffer_size;
+                            (cache_size * 4 + mem_cache_size * 2) * args_.decoder_layers_ + decoder_normed_result_buffer_size +
+                            embedding_kernel_padded_size;
 
     buf_ = reinterpret_cast<void *>(allocator_.malloc(
         sizeof(DataType_) * datatype_buf_size +
-        sizeof(float) * (logits_buf_size + cum_log_buf_size) +
+        sizeof(float) * (logits_buf_size + cum_log_buf_size * 2 + step_log_probs_buf_size + embedding_bias_padded_size) +
         sizeof(int) * word_ids_buf_size +
         sizeof(bool) * finished_buf_size +
         topk_workspace_size_ +
@@ -160,15 +187,19 @@ public:
 
     decoder_buf_ = V_cache_[1] + cache_size * args_.decoder_layers_;
     decoder_normed_result_buf_ = (decoder_buf_ + decoder_workspace_size);
-    logits_buf_ = (float *)(decoder_normed_result_buf_ + decoder_normed_result_buffer_size);
+    embedding_kernel_padded_ = decoder_normed_result_buf_ + decoder_normed_result_buffer_size;
+    logits_buf_ = (float *)(embedding_kernel_padded_ + embedding_kernel_padded_size);
     cum_log_buf_ = (float *)(logits_buf_ + logits_buf_size);
-    word_ids_buf_ = (int *)(cum_log_buf_ + cum_log_buf_size);
+    prev_cum_log_buf_ = (float *)(cum_log_buf_ + cum_log_buf_size);
+    step_log_probs_buf_ = (float *)(prev_cum_log_buf_ + cum_log_buf_size);
+    embedding_bias_padded_ = step_log_probs_buf_ + step_log_probs_buf_size;
+    word_ids_buf_ = (int *)(embedding_bias_padded_ + embedding_bias_padded_size);
     finished_buf_ = (bool *)(word_ids_buf_ + word_ids_buf_size);
     temp_storage_ = (float *)(finished_buf_ + finished_buf_size);
     finished_count_buf_ = (int *)(temp_storage_ + args_.temp_storage_size_);
     topK_kernel_workspace = (void*)(finished_count_buf_ + finished_count_size);
 
-    h_finished_buf_ = new bool[finished_buf_size];
+    finished_reader_ = new FinishedFlagsReader(PinnedStagingPool::instance(), args_.batch_size_ * args_.beam_width_);
 
     FILE *fd = fopen("decoding_gemm_config.in", "r");
     int err = 0;
@@ -215,6 +246,24 @@ public:
     }
   }
 
+  /**
+   * Build the padded copies of the embedding kernel and bias. forward builds them when it gets
+   * other pointers, so this is only required when the weights are reloaded in place.
+   **/
+  void set_embedding_kernel(const DataType_ *embedding_kernel, const float *embedding_bias,
+                            cudaStream_t stream)
+  {
+    if (args_.vocab_size_padded_ != args_.vocab_size_)
+    {
+      pad_embedding_kernelLauncher(embedding_kernel_padded_, embedding_kernel,
+                                   args_.vocab_size_, args_.vocab_size_padded_, args_.hidden_units_, stream);
+      pad_embedding_bias_kernelLauncher(embedding_bias_padded_, embedding_bias,
+                                        args_.vocab_size_, args_.vocab_size_padded_, stream);
+    }
+    embedding_kernel_src_ = embedding_kernel;
+    embedding_bias_src_ = embedding_bias;
+  }
+
   void forward(const DecoderInitParam<DataType_> *param,
                DecodingInitParam<DataType_> decoding_params)
   {
@@ -224,7 +273,14 @@ public:
 #endif
     const int m = args_.batch_size_ * args_.beam_width_;
     const int k = args_.hidden_units_;
-    const int n = args_.vocab_size_;
+    const int n = args_.vocab_size_padded_;
+
+    if (embedding_kernel_src_ != decoding_params.embedding_kernel ||
+        embedding_bias_src_ != decoding_params.embedding_bias)
+      set_embedding_kernel(decoding_params.embedding_kernel, decoding_params.embedding_bias, decoding_params.stream);
+    const bool padded = args_.vocab_size_padded_ != args_.vocab_size_;
+    const DataType_ *embedding_kernel = padded ? embedding_kernel_padded_ : decoding_params.embedding_kernel;
+    const float *embedding_bias = padded ? embedding_bias_padded_ : decoding_params.embedding_bias;
 
     /*
       sequence_length initialize to 0
@@ -250,8 +306,18 @@ public:
 
     int cache_size = m * args_.seq_len_ * args_.hidden_units_; // type T
 
+    /* The log-prob of the token chosen at each step is the difference of the cumulative
+       log-probs of the beam and its parent, so it is only computed when it is requested. */
+    const bool return_log_probs = decoding_params.output_log_probs != nullptr || decoding_params.nbest_ids != nullptr;
+    float *step_log_probs = decoding_params.output_log_probs != nullptr ? decoding_params.output_log_probs : step_log_probs_buf_;
+    int decoded_steps = 0;
+    bool all_finished = false;
+    metrics_tracker_.begin(decoding_params.metrics, decoding_params.enqueue_us);
+    finished_reader_->reset();
+
     for (int step = 1; step <= args_.seq_len_; ++step)
     {
+      decoded_steps = step;
       //we use two-way buffer
       int kv_cache_id = step & 0x1;
 
@@ -309,7 +375,7 @@ public:
                                     CUBLAS_OP_N, CUBLAS_OP_N,
                                     n, m, k,
                                     &alpha,
-                                    decoding_params.embedding_kernel, AType_, n,
+                                    embedding_kernel, AType_, n,
                                     decoder_normed_result_buf_, BType_, k,
                                     &beta,
                                     logits_buf_, CUDA_R_32F, n,
@@ -325,16 +391,28 @@ public:
       check_cuda_error(cudaGetLastError());
 #endif
 
+      if (return_log_probs)
+        check_cuda_error(cudaMemcpyAsync(prev_cum_log_buf_, cum_log_buf_, sizeof(float) * m,
+                                         cudaMemcpyDeviceToDevice, decoding_params.stream));
+
+      if (decoding_params.constraint_states != nullptr)
+      {
+        // mask the tokens the automaton states do not allow, before the log softmax
+        apply_token_constraint_kernelLauncher(logits_buf_, decoding_params.constraint_states,
+                                              decoding_params.constraint_table, finished_buf_,
+                                              m, n, decoding_params.stream);
+      }
+
       // Beamsearch
       if (is_fuse_topk_softMax_ == true)
       {
         topK_softMax(logits_buf_,
-                     decoding_params.embedding_bias,
+                     embedding_bias,
                      finished_buf_,
                      cum_log_buf_,
                      word_ids_buf_,
                      reinterpret_cast<void *>(temp_storage_),
-                     args_,
+                     beam_args_,
                      decoding_params.stream);
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -347,7 +425,7 @@ public:
                                  word_ids_buf_,
                                  decoding_params.output_ids + (step - 1) * m,
                                  finished_count_buf_,
-                                 args_,
+                                 beam_args_,
                                  decoding_params.stream);
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -356,7 +434,7 @@ public:
       }
       else
       {
-        update_logits(logits_buf_, decoding_params.embedding_bias, args_.end_id_, finished_buf_, m, n, decoding_params.stream);
+        update_logits(logits_buf_, embedding_bias, args_.end_id_, finished_buf_, m, n, decoding_params.stream);
 
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -372,7 +450,7 @@ public:
 
         /* adding cum_log_buf_ to logits_buf_ */
         broadcast_kernelLauncher(logits_buf_, cum_log_buf_, args_.batch_size_,
-                                 args_.beam_width_, args_.vocab_size_, decoding_params.stream);
+                                 args_.beam_width_, args_.vocab_size_padded_, decoding_params.stream);
 #ifndef NDEBUG
         cudaDeviceSynchronize();
         check_cuda_error(cudaGetLastError());
@@ -389,7 +467,7 @@ public:
                             topk_workspace_size_,
                             logits_buf_,
                             word_ids_buf_,
-                            args_,
+                            beam_args_,
                             decoding_params.stream);
 #ifndef NDEBUG
         cudaDeviceSynchronize();
@@ -401,7 +479,7 @@ public:
                               decoding_params.sequence_length,
                               word_ids_buf_,
                               decoding_params.output_ids + (step - 1) * m,
-                              args_.batch_size_, args_.beam_width_, args_.vocab_size_,
+                              args_.batch_size_, args_.beam_width_, args_.vocab_size_padded_,
                               decoding_params.stream, args_.end_id_, finished_count_buf_);
       }
 
@@ -410,6 +488,46 @@ public:
       check_cuda_error(cudaGetLastError());
 #endif
 
+      if (return_log_probs)
+      {
+        update_step_log_probs_kernelLauncher(cum_log_buf_, prev_cum_log_buf_,
+                                             decoding_params.parent_ids + (step - 1) * m,
+                                             step_log_probs + (step - 1) * m,
+                                             args_.batch_size_, args_.beam_width_, decoding_params.stream);
+#ifndef NDEBUG
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+#endif
+      }
+
+      if (decoding_params.constraint_states != nullptr)
+      {
+        // the beams are reordered, a beam continues the state of its parent
+        advance_token_constraint_kernelLauncher(decoding_params.constraint_states,
+                                                decoding_params.output_ids + (step - 1) * m,
+                                                decoding_params.parent_ids + (step - 1) * m,
+                                                decoding_params.constraint_table, m, decoding_params.stream);
+      }
+
+      stop_criteria_kernelLauncher(finished_buf_, decoding_params.output_ids, decoding_params.parent_ids,
+                                   decoding_params.stop_words, decoding_params.stop_words_len,
+                                   decoding_params.max_new_tokens, step,
+                                   args_.batch_size_, args_.beam_width_, decoding_params.stream);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+
+      /*
+        User can check the stop criteria by stop_criteria_kernel_check.
+        stop_criteria_kernel_check will compare the results of GPU and CPU, the histories of the beams
+        are rebuilt through parent_ids. It takes host copies of finished_buf_ (before stop_criteria_kernelLauncher),
+        the first step rows of output_ids and parent_ids, stop_words and max_new_tokens.
+        Note that stop_criteria_kernel_check contains stop_criteria_kernelLauncher and uses do not need to call it again.
+      */
+      // stop_criteria_kernel_check(h_finished, h_output_ids, h_parent_ids, h_stop_words, decoding_params.stop_words_len,
+      //                            h_max_new_tokens, step, args_.batch_size_, args_.beam_width_, decoding_params.stream);
+#endif
+
       update_KV_cache_kernelLauncher(K_cache_, V_cache_,
                                      decoding_params.parent_ids + (step - 1) * m,
                                      args_.batch_size_, args_.beam_width_, args_.hidden_units_, step,
@@ -426,16 +544,46 @@ public:
       // update_KV_cache_kernel_check(K_cache_, V_cache_, decoding_params.parent_ids + (step - 1) * batch_size_ * beam_width_, batch_size_, beam_width_, hidden_units_, step, cache_size, decoder_layers_, decoding_params.stream);
 #endif
 
-      // TODO Find a better method to check the is_finished
-      cudaMemcpy(h_finished_buf_, finished_buf_, sizeof(bool) * m, cudaMemcpyDeviceToHost);
-      int sum = 0;
-      for (int i = 0; i < m; i++)
+      // The flags of the previous step are read while this step runs, the stream is not drained.
+      const bool *finished = finished_reader_->push(finished_buf_, decoding_params.stream);
+      if (finished != nullptr)
       {
-        sum += (int)h_finished_buf_[i];
+        metrics_tracker_.step(finished);
+        all_finished = FinishedFlagsReader::all(finished, m);
+        if (all_finished)
+          break;
       }
-      if (sum == m)
-        break;
     } // end for decoding step for llop
+    if (!all_finished && finished_reader_->last() != nullptr)
+      metrics_tracker_.step(finished_reader_->last());
+    metrics_tracker_.end();
+
+    if (decoding_params.nbest_ids != nullptr)
+    {
+      beam_search_nbest_kernelLauncher(decoding_params.output_ids, decoding_params.parent_ids, step_log_probs,
+                                       decoding_params.nbest_ids, decoding_params.nbest_log_probs,
+                                       decoding_params.nbest_cum_log_probs, decoding_params.nbest_normed_scores,
+                                       decoding_params.nbest_lengths, decoded_steps,
+                                       args_.batch_size_, args_.beam_width_, args_.seq_len_,
+                                       args_.end_id_, decoding_params.nbest_length_penalty,
+                                       decoding_params.stream);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+
+      /*
+        User can check the n-best outputs by beam_search_nbest_kernel_check.
+        beam_search_nbest_kernel_check backtracks the beams on CPU and compares the results.
+        Note that beam_search_nbest_kernel_check contains beam_search_nbest_kernelLauncher and uses do not need to call it again.
+      */
+      // beam_search_nbest_kernel_check(decoding_params.output_ids, decoding_params.parent_ids, step_log_probs,
+      //                                decoding_params.nbest_ids, decoding_params.nbest_log_probs,
+      //                                decoding_params.nbest_cum_log_probs, decoding_params.nbest_normed_scores,
+      //                                decoding_params.nbest_lengths, decoded_steps,
+      //                                args_.batch_size_, args_.beam_width_, args_.seq_len_,
+      //                                args_.end_id_, decoding_params.nbest_length_penalty, decoding_params.stream);
+#endif
+    }
   }   // end of forward
 
   virtual ~DecodingBeamsearch()
@@ -444,7 +592,7 @@ public:
     delete[] V_cache_;
     delete[] K_mem_cache_;
     delete[] V_mem_cache_;
-    delete[] h_finished_buf_;
+    delete finished_reader_;
     delete decoder_;
     allocator_.free(buf_);
   }
@@ -24,7 +24,12 @@
 #include "fastertransformer/open_decoder.h"
 #include "fastertransformer/cuda/cuda_kernels.h"
 #include "fastertransformer/arguments.h"
+#include "fastertransformer/pinned_staging_pool.h"
+#include "fastertransformer/ngram_drafter.h"
+#include "fastertransformer/logits_aggregator.h"
 #include <cuda_runtime.h>
+#include <algorithm>
+#include <vector>
 
 namespace fastertransformer
 {
@@ -37,6 +42,8 @@ private:
   typedef typename Traits_::DataType DataType_;
   const IAllocator &allocator_;
   struct DecodingSamplingArguments args_;
+  /* args_ with vocab_size_ = vocab_size_padded_, the sampling kernels see the padded logits */
+  struct DecodingSamplingArguments sampling_args_;
 
   const cudaDataType_t computeType_ = Traits_::computeType;
   const cudaDataType_t AType_ = Traits_::AType;
@@ -55,10 +62,20 @@ private:
   DataType_ *logits_buf_;
   int *word_ids_buf_;
   bool *finished_buf_;
+
+  /* The vocab is padded to a multiple of 8 so that the logits GEMM runs on aligned leading
+     dimensions. The padded copies of the embedding kernel and bias are only used when the
+     vocab is not a multiple of 8, the bias of the padded ids is the lowest value so that they
+     are never sampled. */
+  DataType_ *embedding_kernel_padded_;
+  DataType_ *embedding_bias_padded_;
+  const DataType_ *embedding_kernel_src_ = nullptr;
+  const DataType_ *embedding_bias_src_ = nullptr;
   
   void *buf_;
   int *finished_count_buf_;
-  bool *h_finished_buf_;
+  FinishedFlagsReader *finished_reader_;
+  PinnedStagingPool *staging_pool_;
 
   void *topk_workspace_ = nullptr;
   size_t topk_workspace_size_ = 0;
@@ -67,6 +84,19 @@ private:
   int *topp_id_vals_buf_;
   int *topp_offset_buf_;
 
+  /* speculative greedy decoding, enabled when max_draft_len > 0 */
+  OpenDecoder<OpType_> *verify_decoder_ = nullptr;
+  NGramDrafter *drafter_ = nullptr;
+  int *verify_ids_buf_;      // [batch_size * (max_draft_len + 1)]
+  int *verify_inputs_buf_;   // word ids and positions of the verified rows
+  int *h_verify_ids_buf_;
+
+  DecodingMetricsTracker metrics_tracker_;
+
+  /* the logits GEMM and the top k sampling are shared with other instances when set */
+  LogitsAggregator<OpType_> *logits_aggregator_ = nullptr;
+  cudaEvent_t logits_ready_event_ = nullptr;
+
 public:
   DecodingSampling(const IAllocator &allocator, const int batch_size,
                    const int seq_len,
@@ -75,7 +105,9 @@ public:
                    const int memory_hidden_units, const int memory_max_seq_len,
                    const int start_id, const int end_id,
                    const int candidate_num = 0,
-                   const float probability_threshold = 0.0) : allocator_(allocator)
+                   const float probability_threshold = 0.0,
+                   const int max_draft_len = 0) : allocator_(allocator),
+                                                  metrics_tracker_(batch_size)
   {
     args_.batch_size_ = batch_size;
     args_.seq_len_ = seq_len;
@@ -88,6 +120,9 @@ public:
     args_.probability_threshold_ = probability_threshold;
     args_.start_id_ = start_id;
     args_.end_id_ = end_id;
+    args_.vocab_size_padded_ = div_up(vocab_size, 8) * 8;
+    sampling_args_ = args_;
+    sampling_args_.vocab_size_ = args_.vocab_size_padded_;
 
     if (args_.candidate_num_ == 0 && args_.probability_threshold_ == 0.0)
     {
@@ -99,6 +134,11 @@ public:
       printf("[ERROR] Candidate_num for topk is not 0 and probability threshold for top p is not 0.0 \n");
       exit(-1);
     }
+    if (max_draft_len < 0 || (max_draft_len > 0 && args_.candidate_num_ != 1))
+    {
+      printf("[ERROR] max_draft_len should not be negative, and the speculative decoding needs candidate_num 1 (greedy) \n");
+      exit(-1);
+    }
 #ifndef NDEBUG
     PRINT_FUNC_NAME_();
 #endif
@@ -111,27 +151,45 @@ public:
     decoder_ = new OpenDecoder<OpType_>(batch_size, memory_max_seq_len,
                                         head_num, size_per_head, memory_hidden_units);
 
-    int from_tensor_size = args_.batch_size_ * args_.hidden_units_;                    // type T
+    /* a verification pass has the last token and the draft of every sentence */
+    const int max_rows = args_.batch_size_ * (max_draft_len + 1);
     int decoder_workspace_size = decoder_->getWorkspaceSize();                         // type T
-    int decoder_normed_result_buffer_size = args_.batch_size_ * args_.hidden_units_;   // type T
+    if (max_draft_len > 0)
+    {
+      verify_decoder_ = new OpenDecoder<OpType_>(max_rows, memory_max_seq_len,
+                                                 head_num, size_per_head, memory_hidden_units);
+      verify_decoder_->set_context_query_len(max_draft_len + 1);
+      drafter_ = new NGramDrafter(batch_size, max_draft_len);
+      decoder_workspace_size = std::max(decoder_workspace_size, verify_decoder_->getWorkspaceSize());
+    }
+
+    int from_tensor_size = max_rows * args_.hidden_units_;                             // type T
+    int decoder_normed_result_buffer_size = max_rows * args_.hidden_units_;            // type T
     int cache_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_;         // type T
     int mem_cache_size = args_.batch_size_ * memory_max_seq_len * args_.hidden_units_; // type T
-    int logits_buf_size = args_.batch_size_ * args_.vocab_size_; // type T
+    int logits_buf_size = max_rows * args_.vocab_size_padded_; // type T
+    const bool padded = args_.vocab_size_padded_ != args_.vocab_size_;
+    int embedding_kernel_padded_size = padded ? args_.hidden_units_ * args_.vocab_size_padded_ : 0; // type T
+    int embedding_bias_padded_size = padded ? args_.vocab_size_padded_ : 0;                         // type T
 
     int word_ids_buf_size = args_.batch_size_;                   //type int
+    int verify_buf_size = max_draft_len > 0 ? max_rows * 3 : 0;  //type int
     int finished_buf_size = args_.batch_size_;                   //type bool
     int finished_count_size = (int)(ceil(1 / 32.)) * 32;         // type int
 
-    int topp_id_vals_buf_size = args_.batch_size_ * args_.vocab_size_; // type int
+    int topp_id_vals_buf_size = args_.batch_size_ * args_.vocab_size_padded_; // type int
     int topp_offset_buf_size = args_.batch_size_ + 1; // type int
 
     // prevent memory misalinged address
     logits_buf_size = (int)(ceil(logits_buf_size / 4.)) * 4;
+    embedding_kernel_padded_size = (int)(ceil(embedding_kernel_padded_size / 4.)) * 4;
+    embedding_bias_padded_size = (int)(ceil(embedding_bias_padded_size / 4.)) * 4;
     word_ids_buf_size = (int)(ceil(word_ids_buf_size / 4.)) * 4;
     finished_buf_size = (int)(ceil(finished_buf_size / 32.)) * 32;
 
     topp_id_vals_buf_size = (int)(ceil(topp_id_vals_buf_size / 4.)) * 4;
     topp_offset_buf_size = (int)(ceil(topp_offset_buf_size / 4.)) * 4;
+    verify_buf_size = (int)(ceil(verify_buf_size / 4.)) * 4;
     topP_sampling_kernel_kernelLauncher(topp_workspace_,
                                         topp_workspace_size_,
                                         logits_buf_,
@@ -139,10 +197,10 @@ public:
                                         topp_offset_buf_,
                                         finished_buf_,
                                         0,
-                                        args_,
+                                        sampling_args_,
                                         nullptr, 
                                         nullptr, 
-                                        args_.vocab_size_,
+                                        args_.vocab_size_padded_,
                                         0);
     topK_sampling_kernel_kernelLauncher(topk_workspace_,
                                         topk_workspace_size_,
@@ -151,18 +209,20 @@ public:
                                         nullptr,
                                         finished_buf_,
                                         0,
-                                        args_,
+                                        sampling_args_,
                                         0);
 
+    // one K and one V cache, unlike the two-way caches of beam search
     int datatype_buf_size = from_tensor_size * 2 + decoder_workspace_size +
-                            (cache_size * 4 + mem_cache_size * 2) * args_.decoder_layers_ + decoder_normed_result_buffer_size;
+                            (cache_size * 2 + mem_cache_size * 2) * args_.decoder_layers_ + decoder_normed_result_buffer_size;
 
     buf_ = reinterpret_cast<void *>(allocator_.malloc(
-        sizeof(DataType_) * (datatype_buf_size + logits_buf_size) + 
+        sizeof(DataType_) * (datatype_buf_size + logits_buf_size +
+                             embedding_kernel_padded_size + embedding_bias_padded_size) +
         sizeof(int) * word_ids_buf_size +
         sizeof(bool) * finished_buf_size +
         sizeof(int) * finished_count_size +
-        sizeof(int) * (topp_id_vals_buf_size + topp_offset_buf_size) +
+        sizeof(int) * (topp_id_vals_buf_size + topp_offset_buf_size + verify_buf_size) +
         topp_workspace_size_ + topk_workspace_size_));
 
     from_tensor_[0] = (DataType_ *)buf_;
@@ -181,15 +241,21 @@ public:
     decoder_buf_ = V_cache_[0] + cache_size * args_.decoder_layers_;
     decoder_normed_result_buf_ = (decoder_buf_ + decoder_workspace_size);
     logits_buf_ = decoder_normed_result_buf_ + decoder_normed_result_buffer_size;
-    word_ids_buf_ = (int *)(logits_buf_ + logits_buf_size);
+    embedding_kernel_padded_ = logits_buf_ + logits_buf_size;
+    embedding_bias_padded_ = embedding_kernel_padded_ + embedding_kernel_padded_size;
+    word_ids_buf_ = (int *)(embedding_bias_padded_ + embedding_bias_padded_size);
     finished_buf_ = (bool *)(word_ids_buf_ + word_ids_buf_size);
     finished_count_buf_ = (int *)(finished_buf_ + finished_buf_size);
     topp_id_vals_buf_ = (int *)(finished_count_buf_ + finished_count_size);
     topp_offset_buf_ = (int *)(topp_id_vals_buf_ + topp_id_vals_buf_size);
-    topp_workspace_ = (void*)(topp_offset_buf_ + topp_offset_buf_size);
+    verify_ids_buf_ = topp_offset_buf_ + topp_offset_buf_size;
+    verify_inputs_buf_ = verify_ids_buf_ + max_rows;
+    topp_workspace_ = (void*)(verify_ids_buf_ + verify_buf_size);
     topk_workspace_ = (void*)(topp_workspace_ + topp_workspace_size_);
 
-    h_finished_buf_ = new bool[finished_buf_size];
+    staging_pool_ = &PinnedStagingPool::instance();
+    finished_reader_ = new FinishedFlagsReader(*staging_pool_, args_.batch_size_);
+    h_verify_ids_buf_ = max_draft_len > 0 ? (int *)staging_pool_->acquire(sizeof(int) * max_rows) : nullptr;
 
     FILE *fd = fopen("decoding_gemm_config.in", "r");
     int err = 0;
@@ -236,6 +302,24 @@ public:
     }
   }
 
+  /**
+   * Build the padded copies of the embedding kernel and bias. forward builds them when it gets
+   * other pointers, so this is only required when the weights are reloaded in place.
+   **/
+  void set_embedding_kernel(const DataType_ *embedding_kernel, const DataType_ *embedding_bias,
+                            cudaStream_t stream)
+  {
+    if (args_.vocab_size_padded_ != args_.vocab_size_)
+    {
+      pad_embedding_kernelLauncher(embedding_kernel_padded_, embedding_kernel,
+                                   args_.vocab_size_, args_.vocab_size_padded_, args_.hidden_units_, stream);
+      pad_embedding_bias_kernelLauncher(embedding_bias_padded_, embedding_bias,
+                                        args_.vocab_size_, args_.vocab_size_padded_, stream);
+    }
+    embedding_kernel_src_ = embedding_kernel;
+    embedding_bias_src_ = embedding_bias;
+  }
+
   void forward(const DecoderInitParam<DataType_> *param,
                DecodingInitParam<DataType_> decoding_params)
   {
@@ -243,9 +327,21 @@ public:
 #ifndef NDEBUG
     PRINT_FUNC_NAME_();
 #endif
+    if (embedding_kernel_src_ != decoding_params.embedding_kernel ||
+        embedding_bias_src_ != decoding_params.embedding_bias_T)
+      set_embedding_kernel(decoding_params.embedding_kernel, decoding_params.embedding_bias_T, decoding_params.stream);
+    const bool padded = args_.vocab_size_padded_ != args_.vocab_size_;
+    const DataType_ *embedding_kernel = padded ? embedding_kernel_padded_ : decoding_params.embedding_kernel;
+    const DataType_ *embedding_bias = padded ? embedding_bias_padded_ : decoding_params.embedding_bias_T;
+
+    if (drafter_ != nullptr)
+    {
+      forward_speculative(param, decoding_params, embedding_kernel, embedding_bias);
+      return;
+    }
     const int m = args_.batch_size_;
     const int k = args_.hidden_units_;
-    const int n = args_.vocab_size_;
+    const int n = args_.vocab_size_padded_;
 
     /*
       sequence_length initialize to 0
@@ -265,8 +361,8 @@ public:
                                          word_ids_buf_,
                                          topp_id_vals_buf_,
                                          topp_offset_buf_,
-                                         args_.vocab_size_,
-                                         args_,
+                                         args_.vocab_size_padded_,
+                                         sampling_args_,
                                          decoding_params.stream);
     }
 
@@ -275,7 +371,20 @@ public:
     check_cuda_error(cudaGetLastError());
 #endif
 
+    if (logits_aggregator_ != nullptr &&
+        (decoding_params.embedding_kernel != logits_aggregator_->embedding() ||
+         decoding_params.embedding_bias_T != logits_aggregator_->bias() || decoding_params.constraint_states != nullptr))
+    {
+      printf("[ERROR][DecodingSampling] the logits aggregator needs the embedding and bias it was set with "
+             "and no token constraint. \n");
+      exit(-1);
+    }
+    typename LogitsAggregator<OpType_>::Participant participant(logits_aggregator_);
+
     int cache_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_; // type T
+    bool all_finished = false;
+    metrics_tracker_.begin(decoding_params.metrics, decoding_params.enqueue_us);
+    finished_reader_->reset();
 
     for (int step = 1; step <= args_.seq_len_; ++step)
     {
@@ -326,84 +435,311 @@ public:
       decoder_->decoder_norm1(from_tensor_[out_id], decoding_params.layernorm.gamma,
                               decoding_params.layernorm.beta, decoder_normed_result_buf_, m, k);
 
-      DataType_ alpha = (DataType_)1.0f;
-      DataType_ beta = (DataType_)0.0f;
+      if (logits_aggregator_ != nullptr)
+      {
+        // one GEMM and one sampling for the rows of all the instances of the step
+        check_cuda_error(cudaEventRecord(logits_ready_event_, decoding_params.stream));
+        logits_aggregator_->submit(decoder_normed_result_buf_, m,
+                                   decoding_params.output_ids + (step - 1) * args_.batch_size_,
+                                   decoding_params.sequence_length, finished_buf_,
+                                   decoding_params.stream, logits_ready_event_);
+      }
+      else
+      {
+        DataType_ alpha = (DataType_)1.0f;
+        DataType_ beta = (DataType_)0.0f;
+
+        check_cuda_error(cublasGemmEx(decoding_params.cublas_handle,
+                                      CUBLAS_OP_N, CUBLAS_OP_N,
+                                      n, m, k,
+                                      &alpha,
+                                      embedding_kernel, AType_, n,
+                                      decoder_normed_result_buf_, BType_, k,
+                                      &beta,
+                                      logits_buf_, CType_, n,
+                                      computeType_,
+                                      static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
 
-      check_cuda_error(cublasGemmEx(decoding_params.cublas_handle,
-                                    CUBLAS_OP_N, CUBLAS_OP_N,
-                                    n, m, k,
-                                    &alpha,
-                                    decoding_params.embedding_kernel, AType_, n,
-                                    decoder_normed_result_buf_, BType_, k,
-                                    &beta,
-                                    logits_buf_, CType_, n,
-                                    computeType_,
-                                    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+#ifndef NDEBUG
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+#endif
+
+        if (decoding_params.constraint_states != nullptr)
+        {
+          // mask the tokens the automaton states do not allow, before the bias and the sampling
+          apply_token_constraint_kernelLauncher(logits_buf_, decoding_params.constraint_states,
+                                                decoding_params.constraint_table, finished_buf_,
+                                                m, n, decoding_params.stream);
+        }
+
+        if (args_.candidate_num_ != 0)
+        {
+          // top k sampling
+          update_logits_without_softmax(logits_buf_,
+                                        embedding_bias,
+                                        args_.end_id_,
+                                        finished_buf_,
+                                        m, n, decoding_params.stream);
+
+          topK_sampling_kernel_kernelLauncher(topk_workspace_,
+                                              topk_workspace_size_,
+                                              logits_buf_,
+                                              decoding_params.output_ids + (step - 1) * args_.batch_size_,
+                                              decoding_params.sequence_length,
+                                              finished_buf_,
+                                              step, // used as random number
+                                              sampling_args_,
+                                              decoding_params.stream);
+        }
+        else if (args_.probability_threshold_ != 0.0)
+        {
+          // top p sampling
+          softmax_kernelLauncher(logits_buf_,
+                                 embedding_bias,
+                                 args_.end_id_,
+                                 finished_buf_,
+                                 m, n, decoding_params.stream);
+
+          topP_sampling_kernel_kernelLauncher(topp_workspace_,
+                                              topp_workspace_size_,
+                                              logits_buf_,
+                                              topp_id_vals_buf_,
+                                              topp_offset_buf_,
+                                              finished_buf_,
+                                              step,
+                                              sampling_args_,
+                                              decoding_params.output_ids + (step - 1) * args_.batch_size_,
+                                              decoding_params.sequence_length,
+                                              n,
+                                              decoding_params.stream);
+        }
+      }
+
+      if (decoding_params.constraint_states != nullptr)
+        advance_token_constraint_kernelLauncher(decoding_params.constraint_states,
+                                                decoding_params.output_ids + (step - 1) * args_.batch_size_,
+                                                nullptr, decoding_params.constraint_table, m, decoding_params.stream);
+
+      stop_criteria_kernelLauncher(finished_buf_, decoding_params.output_ids, nullptr,
+                                   decoding_params.stop_words, decoding_params.stop_words_len,
+                                   decoding_params.max_new_tokens, step, m, 1, decoding_params.stream);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+
+      /*
+        User can check the stop criteria by stop_criteria_kernel_check.
+        stop_criteria_kernel_check will compare the results of GPU and CPU. It takes host copies of
+        finished_buf_ (before stop_criteria_kernelLauncher), the first step rows of output_ids, stop_words
+        and max_new_tokens.
+        Note that stop_criteria_kernel_check contains stop_criteria_kernelLauncher and uses do not need to call it again.
+      */
+      // stop_criteria_kernel_check(h_finished, h_output_ids, nullptr, h_stop_words, decoding_params.stop_words_len,
+      //                            h_max_new_tokens, step, m, 1, decoding_params.stream);
+#endif
+
+      word_ids_buf_ = decoding_params.output_ids + (step - 1) * args_.batch_size_;
 
 #ifndef NDEBUG
       cudaDeviceSynchronize();
       check_cuda_error(cudaGetLastError());
 #endif
 
-      if (args_.candidate_num_ != 0)
+      // The flags of the previous step are read while this step runs, the stream is not drained.
+      const bool *finished = finished_reader_->push(finished_buf_, decoding_params.stream);
+      if (finished != nullptr)
       {
-        // top k sampling
-        update_logits_without_softmax(logits_buf_,
-                                      decoding_params.embedding_bias_T,
-                                      args_.end_id_,
-                                      finished_buf_,
-                                      m, n, decoding_params.stream);
-
-        topK_sampling_kernel_kernelLauncher(topk_workspace_,
-                                            topk_workspace_size_,
-                                            logits_buf_,
-                                            decoding_params.output_ids + (step - 1) * args_.batch_size_,
-                                            decoding_params.sequence_length,
-                                            finished_buf_,
-                                            step, // used as random number
-                                            args_,
-                                            decoding_params.stream);
+        metrics_tracker_.step(finished);
+        all_finished = FinishedFlagsReader::all(finished, args_.batch_size_);
+        if (all_finished)
+          break;
       }
-      else if (args_.probability_threshold_ != 0.0)
+    }
+    if (!all_finished && finished_reader_->last() != nullptr)
+      metrics_tracker_.step(finished_reader_->last());
+    metrics_tracker_.end();
+  }
+
+  /**
+   * Greedy decoding with n-gram drafts (prompt lookup). Every pass feeds the last token and
+   * the draft of each unfinished sentence through the decoder at once, the draft is accepted
+   * up to the first token that differs from the greedy choice, so the output ids and
+   * sequence lengths are the ones of the greedy decoding, with fewer passes when the output
+   * repeats the prompt or itself. The drafting and the acceptance run on the host.
+   **/
+  void forward_speculative(const DecoderInitParam<DataType_> *param,
+                           DecodingInitParam<DataType_> decoding_params,
+                           const DataType_ *embedding_kernel, const DataType_ *embedding_bias)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    const int m = args_.batch_size_;
+    const int k = args_.hidden_units_;
+    const int n = args_.vocab_size_padded_;
+    const int seq_len = args_.seq_len_;
+    const int tokens_per_row = drafter_->max_draft_len() + 1;
+    const int rows = m * tokens_per_row;
+    const int cache_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_; // type T
+
+    if (decoding_params.constraint_states != nullptr || decoding_params.stop_words != nullptr ||
+        decoding_params.max_new_tokens != nullptr)
+    {
+      printf("[ERROR] the speculative decoding does not support the constrained decoding and the stop criteria \n");
+      exit(-1);
+    }
+    drafter_->reset(decoding_params.prompt_ids, decoding_params.prompt_length, decoding_params.prompt_max_len);
+
+    std::vector<int> output_ids(seq_len * m, args_.end_id_);
+    std::vector<int> sequence_length(m, 0);
+    std::vector<int> last_ids(m, args_.start_id_);
+    std::vector<bool> finished(m, false);
+    std::vector<int> inputs(rows * 2);   // word ids, then positions
+    std::vector<int> drafts(rows);
+    std::vector<int> draft_length(m);
+    std::vector<int> accepted(tokens_per_row);
+    std::vector<int> step_tokens(m, 0);
+    metrics_tracker_.begin(decoding_params.metrics, decoding_params.enqueue_us);
+
+    for (bool first_pass = true;; first_pass = false)
+    {
+      int active_num = 0;
+      for (int b = 0; b < m; b++)
       {
-        // top p sampling
-        softmax_kernelLauncher(logits_buf_,
-                               decoding_params.embedding_bias_T,
-                               args_.end_id_,
-                               finished_buf_,
-                               m, n, decoding_params.stream);
-
-        topP_sampling_kernel_kernelLauncher(topp_workspace_,
-                                            topp_workspace_size_,
-                                            logits_buf_,
-                                            topp_id_vals_buf_,
-                                            topp_offset_buf_,
-                                            finished_buf_,
-                                            step,
-                                            args_,
-                                            decoding_params.output_ids + (step - 1) * args_.batch_size_,
-                                            decoding_params.sequence_length,
-                                            n,
+        int *ids = inputs.data() + b * tokens_per_row;
+        int *positions = inputs.data() + rows + b * tokens_per_row;
+        for (int j = 0; j < tokens_per_row; j++)
+        {
+          ids[j] = last_ids[b];
+          positions[j] = -1;
+        }
+        draft_length[b] = 0;
+        if (finished[b] || sequence_length[b] >= seq_len)
+          continue;
+        active_num++;
+
+        // the draft positions should stay in the cache
+        const int length = sequence_length[b];
+        draft_length[b] = drafter_->propose(b, seq_len - length - 1, drafts.data() + b * tokens_per_row);
+        positions[0] = length;
+        for (int j = 0; j < draft_length[b]; j++)
+        {
+          ids[j + 1] = drafts[b * tokens_per_row + j];
+          positions[j + 1] = length + j + 1;
+        }
+      }
+      if (active_num == 0)
+        break;
+
+      staging_pool_->upload_async(verify_inputs_buf_, inputs.data(), sizeof(int) * rows * 2, decoding_params.stream);
+      multi_token_embedding_kernel_launcher(from_tensor_[0],
+                                            decoding_params.embedding_table,
+                                            decoding_params.position_encoding_table,
+                                            verify_inputs_buf_,
+                                            verify_inputs_buf_ + rows,
+                                            rows,
+                                            args_.hidden_units_,
                                             decoding_params.stream);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+#endif
+
+      int from_id, out_id;
+      for (int layer = 0; layer < args_.decoder_layers_; ++layer)
+      {
+        from_id = layer & 0x1;
+        out_id = 1 - from_id;
+        verify_decoder_->initialize(param[layer], decoder_buf_);
+        verify_decoder_->forward_multi_token(from_tensor_[from_id], decoding_params.memory_tensor,
+                                             K_cache_[0] + layer * cache_size,
+                                             V_cache_[0] + layer * cache_size,
+                                             K_mem_cache_[layer], V_mem_cache_[layer],
+                                             decoding_params.memory_sequence_length, from_tensor_[out_id],
+                                             verify_inputs_buf_ + rows, tokens_per_row, seq_len, first_pass);
+#ifndef NDEBUG
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+#endif
       }
+      verify_decoder_->decoder_norm1(from_tensor_[out_id], decoding_params.layernorm.gamma,
+                                     decoding_params.layernorm.beta, decoder_normed_result_buf_, rows, k);
 
-      word_ids_buf_ = decoding_params.output_ids + (step - 1) * args_.batch_size_;
+      DataType_ alpha = (DataType_)1.0f;
+      DataType_ beta = (DataType_)0.0f;
 
+      check_cuda_error(cublasGemmEx(decoding_params.cublas_handle,
+                                    CUBLAS_OP_N, CUBLAS_OP_N,
+                                    n, rows, k,
+                                    &alpha,
+                                    embedding_kernel, AType_, n,
+                                    decoder_normed_result_buf_, BType_, k,
+                                    &beta,
+                                    logits_buf_, CType_, n,
+                                    computeType_,
+                                    static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+
+      greedy_ids_kernelLauncher(logits_buf_, embedding_bias, verify_ids_buf_, rows, n,
+                                decoding_params.stream);
 #ifndef NDEBUG
       cudaDeviceSynchronize();
       check_cuda_error(cudaGetLastError());
 #endif
 
-      // TODO Find a better method to check the is_finished
-      cudaMemcpy(h_finished_buf_, finished_buf_, sizeof(bool) * args_.batch_size_, cudaMemcpyDeviceToHost);
-      int sum = 0;
-      for (int i = 0; i < args_.batch_size_; i++)
+      check_cuda_error(cudaMemcpyAsync(h_verify_ids_buf_, verify_ids_buf_, sizeof(int) * rows, cudaMemcpyDeviceToHost, decoding_params.stream));
+      check_cuda_error(cudaStreamSynchronize(decoding_params.stream));
+      drafter_->count_pass();
+
+      for (int b = 0; b < m; b++)
       {
-        sum += (int)h_finished_buf_[i];
+        step_tokens[b] = 0;
+        if (finished[b] || sequence_length[b] >= seq_len)
+          continue;
+        const int num = drafter_->accept(b, drafts.data() + b * tokens_per_row, draft_length[b],
+                                         h_verify_ids_buf_ + b * tokens_per_row, args_.end_id_,
+                                         seq_len - sequence_length[b], accepted.data());
+        for (int i = 0; i < num; i++)
+          output_ids[(sequence_length[b] + i) * m + b] = accepted[i];
+        sequence_length[b] += num;
+        step_tokens[b] = num;
+        last_ids[b] = accepted[num - 1];
+        finished[b] = last_ids[b] == args_.end_id_;
       }
-      if (sum == args_.batch_size_)
-        break;
+      metrics_tracker_.step(finished, step_tokens);
+    }
+    metrics_tracker_.end();
+
+    staging_pool_->upload_async(decoding_params.output_ids, output_ids.data(), sizeof(int) * seq_len * m, decoding_params.stream);
+    staging_pool_->upload_async(decoding_params.sequence_length, sequence_length.data(), sizeof(int) * m, decoding_params.stream);
+  }
+
+  /**
+   * Share the logits GEMM and the top k sampling of every step with the other instances of
+   * the aggregator, which has the vocabulary, end_id and candidate_num of this instance.
+   * nullptr runs them alone again.
+   **/
+  void set_logits_aggregator(LogitsAggregator<OpType_> *aggregator)
+  {
+    if (aggregator != nullptr &&
+        (drafter_ != nullptr || args_.candidate_num_ == 0 || aggregator->gpt2_layout() ||
+         aggregator->hidden_units() != args_.hidden_units_ || aggregator->vocab_size() != args_.vocab_size_ ||
+         aggregator->end_id() != args_.end_id_ || aggregator->candidate_num() != args_.candidate_num_ ||
+         aggregator->max_rows() < args_.batch_size_))
+    {
+      printf("[ERROR][DecodingSampling] the logits aggregator needs top k sampling without speculative decoding "
+             "and the same hidden_units, vocab_size, end_id and candidate_num, with at least batch_size rows. \n");
+      exit(-1);
     }
+    if (aggregator != nullptr && logits_ready_event_ == nullptr)
+      check_cuda_error(cudaEventCreateWithFlags(&logits_ready_event_, cudaEventDisableTiming));
+    logits_aggregator_ = aggregator;
+  }
+
+  /* nullptr if the speculative decoding is disabled */
+  const SpeculativeStats *speculative_stats() const
+  {
+    return drafter_ != nullptr ? &drafter_->stats() : nullptr;
   }
 
   virtual ~DecodingSampling()
@@ -412,8 +748,14 @@ public:
     delete[] V_cache_;
     delete[] K_mem_cache_;
     delete[] V_mem_cache_;
-    delete[] h_finished_buf_;
+    delete finished_reader_;
+    if (h_verify_ids_buf_ != nullptr)
+      staging_pool_->release(h_verify_ids_buf_);
     delete decoder_;
+    delete verify_decoder_;
+    delete drafter_;
+    if (logits_ready_event_ != nullptr)
+      cudaEventDestroy(logits_ready_event_);
     allocator_.free(buf_);
   }
 };
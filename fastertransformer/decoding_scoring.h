@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Teacher-forced scoring with the decoding weights
+ *
+ * Computes the log-prob of every token of given target sentences. The input of
+ * position t is the target token of position t - 1 (start_id for t = 0), so all
+ * positions are known in advance and each layer processes the whole target at
+ * once with causal self attention, instead of seq_len incremental steps.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/open_decoder.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/arguments.h"
+#include <cuda_runtime.h>
+
+namespace fastertransformer
+{
+
+template <OperationType OpType_>
+class DecodingScoring
+{
+private:
+  typedef DecoderTransformerTraits<OpType_> Traits_;
+  typedef typename Traits_::DataType DataType_;
+  const IAllocator &allocator_;
+  struct DecodingArguments args_;
+
+  const cudaDataType_t computeType_ = Traits_::computeType;
+  const cudaDataType_t AType_ = Traits_::AType;
+  const cudaDataType_t BType_ = Traits_::BType;
+  const cudaDataType_t CType_ = Traits_::CType;
+  int cublasAlgo_[1] = {20};
+
+  OpenDecoder<OpType_> *decoder_;
+  DataType_ *K_mem_cache_;
+  DataType_ *V_mem_cache_;
+  DataType_ *from_tensor_[2];
+  DataType_ *decoder_buf_;
+  DataType_ *decoder_normed_result_buf_;
+  float *logits_buf_;
+  void *buf_;
+
+public:
+  /* seq_len is the max target length. The logits of all the target positions are kept,
+     so the workspace holds batch_size * seq_len * vocab_size floats. */
+  DecodingScoring(const IAllocator &allocator, const int batch_size,
+                  const int seq_len, const int head_num, const int size_per_head,
+                  const int vocab_size, const int decoder_layers,
+                  const int memory_hidden_units, const int memory_max_seq_len,
+                  const int start_id, const int end_id) : allocator_(allocator)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    args_.batch_size_ = batch_size;
+    args_.seq_len_ = seq_len;
+    args_.head_num_ = head_num;
+    args_.size_per_head_ = size_per_head;
+    args_.hidden_units_ = head_num * size_per_head;
+    args_.decoder_layers_ = decoder_layers;
+    args_.vocab_size_ = vocab_size;
+    args_.start_id_ = start_id;
+    args_.end_id_ = end_id;
+
+    /* every target position is a row of the decoder */
+    decoder_ = new OpenDecoder<OpType_>(batch_size * seq_len, memory_max_seq_len,
+                                        head_num, size_per_head, memory_hidden_units);
+    decoder_->set_context_query_len(seq_len);
+
+    int from_tensor_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_;                   // type T
+    int decoder_workspace_size = decoder_->getWorkspaceSize();                                          // type T
+    int decoder_normed_result_buffer_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_;  // type T
+    int mem_cache_size = args_.batch_size_ * memory_max_seq_len * args_.hidden_units_;                  // type T
+    int logits_buf_size = args_.batch_size_ * args_.seq_len_ * args_.vocab_size_;                       // type float
+
+    // prevent memory misalinged address
+    from_tensor_size = (int)(ceil(from_tensor_size / 4.)) * 4;
+    decoder_workspace_size = (int)(ceil(decoder_workspace_size / 4.)) * 4;
+    decoder_normed_result_buffer_size = (int)(ceil(decoder_normed_result_buffer_size / 4.)) * 4;
+    mem_cache_size = (int)(ceil(mem_cache_size / 4.)) * 4;
+    logits_buf_size = (int)(ceil(logits_buf_size / 4.)) * 4;
+
+    /* The memory keys and values are recomputed by every layer, one pair is shared by all layers. */
+    int datatype_buf_size = from_tensor_size * 2 + decoder_workspace_size +
+                            mem_cache_size * 2 + decoder_normed_result_buffer_size;
+
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(
+        sizeof(DataType_) * datatype_buf_size +
+        sizeof(float) * logits_buf_size));
+
+    from_tensor_[0] = (DataType_ *)buf_;
+    from_tensor_[1] = (DataType_ *)(from_tensor_[0] + from_tensor_size);
+    K_mem_cache_ = from_tensor_[1] + from_tensor_size;
+    V_mem_cache_ = K_mem_cache_ + mem_cache_size;
+    decoder_buf_ = V_mem_cache_ + mem_cache_size;
+    decoder_normed_result_buf_ = decoder_buf_ + decoder_workspace_size;
+    logits_buf_ = (float *)(decoder_normed_result_buf_ + decoder_normed_result_buffer_size);
+
+    FILE *fd = fopen("decoding_gemm_config.in", "r");
+    int err = 0;
+    if (fd == NULL)
+      printf("[WARNING] decoding_gemm_config.in is not found\n");
+    else
+    {
+      err = fscanf(fd, "%d", &cublasAlgo_[0]);
+      fclose(fd);
+    }
+    if (err != 1)
+    {
+      printf("[WARNING] decoding loading GEMM algorithms error, using default GEMM algorithms!\n");
+      if (Traits_::OpType == OperationType::FP32)
+      {
+        cublasAlgo_[0] = CUBLAS_GEMM_DEFAULT;
+      }
+      else
+      {
+        cublasAlgo_[0] = CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+      }
+    }
+    else
+    {
+      // check that the gemm_config setting is runnable
+      if (Traits_::OpType == OperationType::FP32)
+      {
+        if (cublasAlgo_[0] > CUBLAS_GEMM_ALGO23 || cublasAlgo_[0] < CUBLAS_GEMM_DEFAULT)
+        {
+          // the algorithm is not for FP32
+          printf("[ERROR] cuBLAS Algorithm %d is not used in FP32. \n", (int)cublasAlgo_[0]);
+          exit(-1);
+        }
+      }
+      else
+      {
+        if (cublasAlgo_[0] > CUBLAS_GEMM_ALGO15_TENSOR_OP || cublasAlgo_[0] < CUBLAS_GEMM_DEFAULT_TENSOR_OP)
+        {
+          // the algorithm is not for FP16
+          printf("[ERROR] cuBLAS Algorithm %d is not used in FP16. \n", (int)cublasAlgo_[0]);
+          exit(-1);
+        }
+      }
+    }
+  }
+
+  /**
+   * decoding_params.target_ids and target_sequence_length are the sentences to score,
+   * the results are written to target_log_probs and target_cum_log_probs (optional).
+   * The memory_tensor is [batch_size, memory_max_seq_len, memory_hidden_units], it is
+   * not tiled to beams.
+   **/
+  void forward(const DecoderInitParam<DataType_> *param,
+               DecodingInitParam<DataType_> decoding_params)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    if (decoding_params.target_ids == nullptr || decoding_params.target_sequence_length == nullptr ||
+        decoding_params.target_log_probs == nullptr)
+    {
+      printf("[ERROR] DecodingScoring needs target_ids, target_sequence_length and target_log_probs. \n");
+      exit(-1);
+    }
+
+    const int m = args_.batch_size_ * args_.seq_len_;
+    const int k = args_.hidden_units_;
+    const int n = args_.vocab_size_;
+
+    teacher_forcing_embedding_kernel_launcher(from_tensor_[0],
+                                              decoding_params.embedding_table,
+                                              decoding_params.position_encoding_table,
+                                              decoding_params.target_ids,
+                                              args_.batch_size_,
+                                              args_.seq_len_,
+                                              args_.hidden_units_,
+                                              args_.start_id_,
+                                              decoding_params.stream);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+
+    int from_id, out_id;
+    for (int layer = 0; layer < args_.decoder_layers_; ++layer)
+    {
+      from_id = layer & 0x1;
+      out_id = 1 - from_id;
+
+      decoder_->initialize(param[layer], decoder_buf_);
+      decoder_->forward_context(from_tensor_[from_id], decoding_params.memory_tensor,
+                                K_mem_cache_, V_mem_cache_,
+                                decoding_params.memory_sequence_length, from_tensor_[out_id],
+                                args_.seq_len_, true);
+#ifndef NDEBUG
+      cudaDeviceSynchronize();
+      check_cuda_error(cudaGetLastError());
+#endif
+    }
+    decoder_->decoder_norm1(from_tensor_[out_id], decoding_params.layernorm.gamma,
+                            decoding_params.layernorm.beta, decoder_normed_result_buf_, m, k);
+
+    float alpha = (float)1.0f;
+    float beta = (float)0.0f;
+
+    check_cuda_error(cublasGemmEx(decoding_params.cublas_handle,
+                                  CUBLAS_OP_N, CUBLAS_OP_N,
+                                  n, m, k,
+                                  &alpha,
+                                  decoding_params.embedding_kernel, AType_, n,
+                                  decoder_normed_result_buf_, BType_, k,
+                                  &beta,
+                                  logits_buf_, CUDA_R_32F, n,
+#ifdef CUDA11_MODE
+                                  CUBLAS_COMPUTE_32F_PEDANTIC,
+#else
+                                  CUDA_R_32F,
+#endif
+                                  static_cast<cublasGemmAlgo_t>(cublasAlgo_[0])));
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+
+    target_log_probs_kernelLauncher(logits_buf_, decoding_params.embedding_bias,
+                                    decoding_params.target_ids, decoding_params.target_sequence_length,
+                                    decoding_params.target_log_probs, decoding_params.target_cum_log_probs,
+                                    args_.batch_size_, args_.seq_len_, args_.vocab_size_,
+                                    decoding_params.stream);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+
+    /*
+      User can check the log probs by target_log_probs_kernel_check.
+      target_log_probs_kernel_check computes log_softmax on CPU and compares the results.
+      Note that target_log_probs_kernel_check contains target_log_probs_kernelLauncher and uses do not need to call it again.
+    */
+    // target_log_probs_kernel_check(logits_buf_, decoding_params.embedding_bias,
+    //                               decoding_params.target_ids, decoding_params.target_sequence_length,
+    //                               decoding_params.target_log_probs, decoding_params.target_cum_log_probs,
+    //                               args_.batch_size_, args_.seq_len_, args_.vocab_size_, decoding_params.stream);
+#endif
+  }
+
+  virtual ~DecodingScoring()
+  {
+    delete decoder_;
+    allocator_.free(buf_);
+  }
+};
+
+} //namespace fastertransformer
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Batched top-k similarity search against resident candidate embeddings
+ *
+ * The candidates are L2-normalized embeddings kept on the device, the queries
+ * are the embeddings of BertEncoderHead in the embedding mode, of the same
+ * type. One GEMM computes the cosine similarities of all queries and all
+ * candidates in float, then topk_similarity_kernelLauncher selects the k best
+ * candidates of every query. So encoding and retrieval run in one pass on the
+ * device, only [batch_size, k] ids and scores are returned.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/cuda/pooling_kernels.h"
+#include "fastertransformer/cuda/topk_kernels.cuh"
+#include <cuda_runtime.h>
+
+namespace fastertransformer
+{
+
+class EmbeddingSearch
+{
+private:
+  const IAllocator &allocator_;
+  const int max_batch_size_;
+  const int hidden_units_;
+  const int max_candidate_num_;
+  const int k_;
+  const EmbeddingType embedding_type_;
+  int candidate_num_;
+
+  void *candidates_;     // [max_candidate_num, hidden_units] of embedding_type
+  float *scores_buf_;    // [max_batch_size, max_candidate_num]
+  void *topk_workspace_;
+  size_t topk_workspace_size_;
+  void *buf_;
+
+  cudaDataType_t data_type() const
+  {
+    return embedding_type_ == EmbeddingType::FP32 ? CUDA_R_32F : (embedding_type_ == EmbeddingType::FP16 ? CUDA_R_16F : CUDA_R_8I);
+  }
+
+public:
+  EmbeddingSearch(const IAllocator &allocator, const int max_batch_size, const int hidden_units,
+                  const int max_candidate_num, const int k,
+                  const EmbeddingType embedding_type) : allocator_(allocator),
+                                                        max_batch_size_(max_batch_size),
+                                                        hidden_units_(hidden_units),
+                                                        max_candidate_num_(max_candidate_num),
+                                                        k_(k),
+                                                        embedding_type_(embedding_type),
+                                                        candidate_num_(0)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    if (embedding_type == EmbeddingType::NONE || max_batch_size <= 0 || hidden_units <= 0 ||
+        k < 1 || k > TOPK_SIMILARITY_MAX_K || k > max_candidate_num)
+    {
+      printf("[ERROR][EmbeddingSearch] invalid arguments (max_batch_size %d, hidden_units %d, max_candidate_num %d, k %d), "
+             "k should be in [1, min(%d, max_candidate_num)]. \n",
+             max_batch_size, hidden_units, max_candidate_num, k, TOPK_SIMILARITY_MAX_K);
+      exit(-1);
+    }
+    if (embedding_type == EmbeddingType::INT8 && hidden_units % 4 != 0)
+    {
+      // the leading dimensions of an INT8 GEMM should be multiples of 4
+      printf("[ERROR][EmbeddingSearch] INT8 embeddings need hidden_units %% 4 == 0, but hidden_units is %d. \n", hidden_units);
+      exit(-1);
+    }
+
+    size_t candidates_size = embedding_type_size(embedding_type_) * max_candidate_num_ * hidden_units_;  // bytes
+    size_t scores_buf_size = sizeof(float) * max_batch_size_ * max_candidate_num_;                      // bytes
+    topk_workspace_size_ = get_topk_similarity_workspace_size(max_batch_size_, max_candidate_num_, k_);
+
+    // prevent memory misalinged address
+    candidates_size = (size_t)(ceil(candidates_size / 16.)) * 16;
+    scores_buf_size = (size_t)(ceil(scores_buf_size / 16.)) * 16;
+
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(candidates_size + scores_buf_size + topk_workspace_size_));
+    candidates_ = buf_;
+    scores_buf_ = (float *)((char *)candidates_ + candidates_size);
+    topk_workspace_ = (void *)((char *)scores_buf_ + scores_buf_size);
+  }
+
+  /* Copy candidate_num normalized embeddings of embedding_type (host or device memory)
+     to the resident candidates. */
+  void set_candidates(const void *candidates, const int candidate_num, cudaStream_t stream)
+  {
+    if (candidate_num < k_ || candidate_num > max_candidate_num_)
+    {
+      printf("[ERROR][EmbeddingSearch] candidate_num %d should be in [k = %d, %d]. \n", candidate_num, k_, max_candidate_num_);
+      exit(-1);
+    }
+    check_cuda_error(cudaMemcpyAsync(candidates_, candidates,
+                                     embedding_type_size(embedding_type_) * candidate_num * hidden_units_,
+                                     cudaMemcpyDefault, stream));
+    candidate_num_ = candidate_num;
+  }
+
+  /**
+   * queries is [batch_size, hidden_units] of embedding_type on the device, ids and scores
+   * (optional) are [batch_size, k]. The scores are the cosine similarities, in descending
+   * order.
+   **/
+  void search(const void *queries, const int batch_size, int *ids, float *scores,
+              cublasHandle_t cublas_handle, cudaStream_t stream)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    if (candidate_num_ == 0 || batch_size <= 0 || batch_size > max_batch_size_)
+    {
+      printf("[ERROR][EmbeddingSearch] set_candidates() should be called and batch_size %d should be in [1, %d]. \n",
+             batch_size, max_batch_size_);
+      exit(-1);
+    }
+
+    /* scores[batch_size, candidate_num] = queries * candidates^T, the INT8 embeddings
+       are scaled by EMBEDDING_INT8_SCALE */
+    const float alpha = embedding_type_ == EmbeddingType::INT8 ? 1.0f / (EMBEDDING_INT8_SCALE * EMBEDDING_INT8_SCALE) : 1.0f;
+    const float beta = 0.0f;
+    check_cuda_error(cublasGemmEx(cublas_handle,
+                                  CUBLAS_OP_T, CUBLAS_OP_N,
+                                  candidate_num_, batch_size, hidden_units_,
+                                  &alpha,
+                                  candidates_, data_type(), hidden_units_,
+                                  queries, data_type(), hidden_units_,
+                                  &beta,
+                                  scores_buf_, CUDA_R_32F, candidate_num_,
+#ifdef CUDA11_MODE
+                                  CUBLAS_COMPUTE_32F,
+#else
+                                  CUDA_R_32F,
+#endif
+                                  embedding_type_ == EmbeddingType::FP32 ? CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+
+    size_t workspace_size = topk_workspace_size_;
+    topk_similarity_kernelLauncher(topk_workspace_, workspace_size, scores_buf_, ids, scores,
+                                   batch_size, candidate_num_, k_, stream);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+  }
+
+  int k() const { return k_; }
+  int candidate_num() const { return candidate_num_; }
+  EmbeddingType embedding_type() const { return embedding_type_; }
+
+  ~EmbeddingSearch()
+  {
+    allocator_.free(buf_);
+  }
+};
+
+} // namespace fastertransformer
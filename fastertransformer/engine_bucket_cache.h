@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Cache of engines built for buckets of (batch_size, seq_len)
+ *
+ * An engine built for a fixed shape (e.g. a TRT_Transformer) serves the
+ * requests of a smaller shape with padding. EngineBuckets picks the smallest
+ * bucket of the grid that fits a request, a batch larger than the largest
+ * bucket is split. EngineBucketCache builds the engine of a bucket the first
+ * time it is used, or loads it from the cache directory, where the
+ * serialized engines are kept in files named after the model hash, the GPU
+ * architecture and the bucket. A file written for another model, another
+ * architecture or truncated is rebuilt.
+ *
+ * The engine type is given by its build, serialize and load functions, so
+ * the cache does not depend on CUDA or TensorRT.
+ **/
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+namespace fastertransformer
+{
+
+struct EngineBucket
+{
+  int batch_size;
+  int seq_len;
+};
+
+/* rows [offset, offset + batch_size) of a request run in bucket */
+struct EngineBucketSlice
+{
+  EngineBucket bucket;
+  int offset;
+  int batch_size;
+};
+
+/* 1, 2, 4, ... up to max_value, max_value included */
+inline std::vector<int> power_of_two_buckets(const int min_value, const int max_value)
+{
+  std::vector<int> buckets;
+  for (int value = min_value; value < max_value; value *= 2)
+    buckets.push_back(value);
+  buckets.push_back(max_value);
+  return buckets;
+}
+
+class EngineBuckets
+{
+private:
+  std::vector<int> batch_buckets_;
+  std::vector<int> seq_buckets_;
+
+  static bool valid(const std::vector<int> &buckets)
+  {
+    if (buckets.empty() || buckets[0] <= 0)
+      return false;
+    for (size_t i = 1; i < buckets.size(); i++)
+    {
+      if (buckets[i] <= buckets[i - 1])
+        return false;
+    }
+    return true;
+  }
+
+  static int smallest_fit(const std::vector<int> &buckets, const int value)
+  {
+    std::vector<int>::const_iterator it = std::lower_bound(buckets.begin(), buckets.end(), value);
+    return it == buckets.end() ? -1 : *it;
+  }
+
+public:
+  /* the buckets are increasing */
+  EngineBuckets(const std::vector<int> &batch_buckets, const std::vector<int> &seq_buckets)
+      : batch_buckets_(batch_buckets), seq_buckets_(seq_buckets)
+  {
+    if (!valid(batch_buckets) || !valid(seq_buckets))
+    {
+      printf("[ERROR][EngineBuckets] the batch and sequence length buckets should be positive and increasing. \n");
+      exit(-1);
+    }
+  }
+
+  const std::vector<int> &batch_buckets() const { return batch_buckets_; }
+  const std::vector<int> &seq_buckets() const { return seq_buckets_; }
+  int bucket_num() const { return (int)(batch_buckets_.size() * seq_buckets_.size()); }
+
+  /* the smallest bucket that holds the request, false if it is too large */
+  bool select(const int batch_size, const int seq_len, EngineBucket &bucket) const
+  {
+    if (batch_size <= 0 || seq_len <= 0)
+      return false;
+    bucket.batch_size = smallest_fit(batch_buckets_, batch_size);
+    bucket.seq_len = smallest_fit(seq_buckets_, seq_len);
+    return bucket.batch_size > 0 && bucket.seq_len > 0;
+  }
+
+  /* the slices of a request, the rows beyond the largest batch bucket go to more slices;
+     empty if seq_len does not fit */
+  std::vector<EngineBucketSlice> split(const int batch_size, const int seq_len) const
+  {
+    std::vector<EngineBucketSlice> slices;
+    const int max_batch = batch_buckets_.back();
+    for (int offset = 0; offset < batch_size; offset += max_batch)
+    {
+      EngineBucketSlice slice;
+      slice.offset = offset;
+      slice.batch_size = std::min(max_batch, batch_size - offset);
+      if (!select(slice.batch_size, seq_len, slice.bucket))
+        return std::vector<EngineBucketSlice>();
+      slices.push_back(slice);
+    }
+    return slices;
+  }
+};
+
+/* FNV-1a, to hash the weights and the shapes of a model */
+inline uint64_t fnv1a_hash(const void *data, const size_t bytes, uint64_t hash = 0xcbf29ce484222325ull)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < bytes; i++)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+struct EngineCacheStats
+{
+  int hits = 0;     // in memory
+  int loads = 0;    // from the cache directory
+  int builds = 0;
+  int rejected_files = 0;
+};
+
+template <typename Engine>
+class EngineBucketCache
+{
+public:
+  typedef std::function<Engine *(const EngineBucket &)> BuildFunc;
+  typedef std::function<void(Engine &, std::vector<char> &)> SerializeFunc;
+  typedef std::function<Engine *(const EngineBucket &, const void *, size_t)> LoadFunc;
+
+private:
+  struct FileHeader
+  {
+    char magic[8];
+    uint64_t model_hash;
+    int32_t gpu_arch;
+    int32_t batch_size;
+    int32_t seq_len;
+    int32_t reserved;
+    uint64_t bytes;
+  };
+
+  const EngineBuckets buckets_;
+  const std::string dir_;
+  const uint64_t model_hash_;
+  const int gpu_arch_;
+  BuildFunc build_;
+  SerializeFunc serialize_;
+  LoadFunc load_;
+  std::map<std::pair<int, int>, std::unique_ptr<Engine>> engines_;
+  EngineCacheStats stats_;
+
+  static void set_magic(FileHeader &header) { memcpy(header.magic, "FTENGINE", 8); }
+
+  bool read_file(const EngineBucket &bucket, std::vector<char> &data)
+  {
+    FILE *fd = fopen(path(bucket).c_str(), "rb");
+    if (fd == NULL)
+      return false;
+    FileHeader header, expected;
+    set_magic(expected);
+    bool ok = fread(&header, sizeof(header), 1, fd) == 1 && memcmp(header.magic, expected.magic, 8) == 0 &&
+              header.model_hash == model_hash_ && header.gpu_arch == gpu_arch_ &&
+              header.batch_size == bucket.batch_size && header.seq_len == bucket.seq_len;
+    if (ok)
+    {
+      data.resize(header.bytes);
+      ok = header.bytes > 0 && fread(data.data(), 1, header.bytes, fd) == header.bytes;
+    }
+    fclose(fd);
+    if (!ok)
+    {
+      printf("[WARNING] the cached engine %s is not valid for this model and GPU, it is rebuilt\n", path(bucket).c_str());
+      stats_.rejected_files++;
+    }
+    return ok;
+  }
+
+  /* written to a temporary file and renamed, a reader never sees a partial engine */
+  void write_file(const EngineBucket &bucket, const std::vector<char> &data)
+  {
+    if (dir_.empty())
+      return;
+    const std::string file = path(bucket);
+    const std::string tmp = file + ".tmp" + std::to_string(getpid());
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (fd == NULL)
+    {
+      printf("[WARNING] cannot write the engine cache file %s\n", tmp.c_str());
+      return;
+    }
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    set_magic(header);
+    header.model_hash = model_hash_;
+    header.gpu_arch = gpu_arch_;
+    header.batch_size = bucket.batch_size;
+    header.seq_len = bucket.seq_len;
+    header.bytes = data.size();
+    const bool ok = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+                    fwrite(data.data(), 1, data.size(), fd) == data.size();
+    if (fclose(fd) != 0 || !ok || rename(tmp.c_str(), file.c_str()) != 0)
+    {
+      printf("[WARNING] cannot write the engine cache file %s\n", file.c_str());
+      remove(tmp.c_str());
+    }
+  }
+
+public:
+  /* dir empty keeps the engines in memory only */
+  EngineBucketCache(const EngineBuckets &buckets, const std::string &dir, const uint64_t model_hash,
+                    const int gpu_arch, BuildFunc build, SerializeFunc serialize, LoadFunc load)
+      : buckets_(buckets), dir_(dir), model_hash_(model_hash), gpu_arch_(gpu_arch),
+        build_(build), serialize_(serialize), load_(load)
+  {
+  }
+
+  const EngineBuckets &buckets() const { return buckets_; }
+  const EngineCacheStats &stats() const { return stats_; }
+  int engine_num() const { return (int)engines_.size(); }
+
+  /* the file of the engine of bucket in the cache directory */
+  std::string path(const EngineBucket &bucket) const
+  {
+    char name[128];
+    snprintf(name, sizeof(name), "%016llx_sm%d_b%d_s%d.engine", (unsigned long long)model_hash_, gpu_arch_,
+             bucket.batch_size, bucket.seq_len);
+    return dir_ + "/" + name;
+  }
+
+  /* the engine of bucket, loaded or built the first time */
+  Engine &get(const EngineBucket &bucket)
+  {
+    const std::pair<int, int> key(bucket.batch_size, bucket.seq_len);
+    typename std::map<std::pair<int, int>, std::unique_ptr<Engine>>::iterator it = engines_.find(key);
+    if (it != engines_.end())
+    {
+      stats_.hits++;
+      return *it->second;
+    }
+    std::vector<char> data;
+    Engine *engine = nullptr;
+    if (!dir_.empty() && read_file(bucket, data))
+    {
+      engine = load_(bucket, data.data(), data.size());
+      if (engine != nullptr)
+        stats_.loads++;
+      else
+        stats_.rejected_files++;
+    }
+    if (engine == nullptr)
+    {
+      engine = build_(bucket);
+      stats_.builds++;
+      if (!dir_.empty())
+      {
+        data.clear();
+        serialize_(*engine, data);
+        write_file(bucket, data);
+      }
+    }
+    engines_[key].reset(engine);
+    return *engine;
+  }
+
+  /* the smallest engine that holds the request, nullptr if it is too large */
+  Engine *route(const int batch_size, const int seq_len, EngineBucket &bucket)
+  {
+    if (!buckets_.select(batch_size, seq_len, bucket))
+      return nullptr;
+    return &get(bucket);
+  }
+};
+
+} // namespace fastertransformer
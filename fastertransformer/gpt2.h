@@ -24,10 +24,17 @@
 #include "fastertransformer/open_decoder.h"
 #include "fastertransformer/cuda/cuda_kernels.h"
 #include "fastertransformer/arguments.h"
+#include "fastertransformer/pinned_staging_pool.h"
+#include "fastertransformer/host_processing.h"
+#include "fastertransformer/logits_aggregator.h"
 #include <cuda_runtime.h>
 #include <stdlib.h>
+#include <memory>
 
-#define EMBEDDING_TRANSPOSE_OPT 0 // TODO This feature has bug.
+/* Pad the vocab to a multiple of 8 and transpose the embedding kernel once, so that the
+   logits GEMM runs with CUBLAS_OP_N on aligned leading dimensions. The padded logits are
+   masked to -inf before sampling. */
+#define EMBEDDING_TRANSPOSE_OPT 1
 
 namespace fastertransformer
 {
@@ -40,6 +47,8 @@ private:
     typedef typename Traits_::DataType DataType_;
     const IAllocator &allocator_;
     struct Gpt2Arguments args_;
+    /* args_ with vocab_size_ = vocab_size_padded_, the sampling kernels see the padded logits */
+    struct DecodingSamplingArguments sampling_args_;
 
     const cudaDataType_t computeType_ = Traits_::computeType;
     const cudaDataType_t AType_ = Traits_::AType;
@@ -48,6 +57,7 @@ private:
     int cublasAlgo_[1] = {20};
 
     DataType_ *embedding_kernel_transposed_padded_;
+    const DataType_ *embedding_kernel_src_ = nullptr;
 
     OpenDecoder<OpType_> *decoder_;
     DataType_ **K_cache_;
@@ -67,6 +77,22 @@ private:
     int *topp_id_vals_buf_;
     int *topp_offset_buf_;
 
+    int *start_ids_buf_;
+    int *h_start_ids_;
+    PinnedStagingPool *staging_pool_;
+
+    /* a row is finished by end_id or by the stop criteria, forward ends once all are finished */
+    bool *finished_buf_;
+    FinishedFlagsReader *finished_reader_;
+
+    /* the steps do not synchronize, the token times come from the start, first token and end events */
+    DecodingMetricsTracker metrics_tracker_;
+    cudaEvent_t metrics_events_[3];
+
+    /* the logits GEMM and the top k sampling of the sampled steps are shared with other instances when set */
+    LogitsAggregator<OpType_> *logits_aggregator_ = nullptr;
+    cudaEvent_t logits_ready_event_ = nullptr;
+
 public:
     DecodingGpt2(const IAllocator &allocator, const int batch_size,
                  const int seq_len,
@@ -76,7 +102,8 @@ public:
                  const int *start_ids = nullptr, const int start_len = -1,
                  const int candidate_num = 1,
                  const float probability_threshold = 0.0,
-                 const float temperature = 1.0) : allocator_(allocator)
+                 const float temperature = 1.0) : allocator_(allocator),
+                                                  metrics_tracker_(batch_size)
     {
 #ifndef NDEBUG
         PRINT_FUNC_NAME_();
@@ -104,19 +131,23 @@ public:
             args_.start_len_ = start_len;
             args_.start_ids_ = new int*[start_len];
             for(int i = 0; i < start_len; i++)
-            {
                 args_.start_ids_[i] = new int[batch_size];
-                for(int j = 0; j < batch_size; j++)
+            // the rows are independent, large batches are transposed on the host thread pool
+            parallel_for(0, start_len, std::max(1, HOST_PROCESSING_GRAIN / batch_size), [&](const int begin, const int end) {
+                for(int i = begin; i < end; i++)
                 {
-                    args_.start_ids_[i][j] = start_ids[j * start_len + i];
+                    for(int j = 0; j < batch_size; j++)
+                    {
+                        args_.start_ids_[i][j] = start_ids[j * start_len + i];
+                    }
                 }
-            }
+            });
         }
         else
         {
             // fill the start_ids by start_id
             args_.start_len_ = 1;
-            args_.start_ids_ = new int*[start_len];
+            args_.start_ids_ = new int*[1];
             args_.start_ids_[0] = new int[batch_size];
             for(int j = 0; j < batch_size; j++)
             {
@@ -135,6 +166,8 @@ public:
 #else  
         args_.vocab_size_padded_ = args_.vocab_size_;
 #endif
+        sampling_args_ = args_;
+        sampling_args_.vocab_size_ = args_.vocab_size_padded_;
 
         int from_tensor_size = args_.batch_size_ * args_.hidden_units_;                    // type T
         int decoder_workspace_size = decoder_->getWorkspaceSize();                                             // type T
@@ -142,8 +175,10 @@ public:
         int cache_size = args_.batch_size_ * args_.seq_len_ * args_.hidden_units_;         // type T
         int logits_buf_size = args_.batch_size_ * args_.vocab_size_padded_; // type T
 
-        int topp_id_vals_buf_size = args_.batch_size_ * args_.vocab_size_; // type int
+        int topp_id_vals_buf_size = args_.batch_size_ * args_.vocab_size_padded_; // type int
         int topp_offset_buf_size = args_.batch_size_ + 1;
+        int start_ids_buf_size = args_.start_len_ * args_.batch_size_; // type int
+        int finished_buf_size = args_.batch_size_; // type bool
 
         const int MEM_C = 128;
         /*from_tensor_size = div_up(from_tensor_size, MEM_C) * MEM_C;
@@ -167,6 +202,8 @@ public:
         
         topp_id_vals_buf_size = (int)(ceil(topp_id_vals_buf_size / 4.)) * 4;
         topp_offset_buf_size = (int)(ceil(topp_offset_buf_size / 4.)) * 4;
+        start_ids_buf_size = (int)(ceil(start_ids_buf_size / 4.)) * 4;
+        finished_buf_size = (int)(ceil(finished_buf_size / 16.)) * 16;
 
         topP_sampling_kernel_kernelLauncher(topp_workspace_,
                                             topp_workspace_size_,
@@ -175,10 +212,10 @@ public:
                                             topp_offset_buf_,
                                             nullptr,
                                             0,
-                                            args_,
+                                            sampling_args_,
                                             nullptr, 
                                             nullptr, 
-                                            args_.vocab_size_,
+                                            args_.vocab_size_padded_,
                                             0);
         topK_sampling_kernel_kernelLauncher(topk_workspace_,
                                             topk_workspace_size_,
@@ -187,14 +224,14 @@ public:
                                             nullptr,
                                             nullptr,
                                             0,
-                                            args_,
+                                            sampling_args_,
                                             0);
         topK_topP_sampling_kernel_kernelLauncher(topk_topp_workspace_,
                                                  topk_topp_workspace_size_,
                                                  nullptr,
                                                  logits_buf_,
                                                  0,
-                                                 args_,
+                                                 sampling_args_,
                                                  0);
 
         int datatype_buf_size = from_tensor_size * 2 + decoder_workspace_size +
@@ -205,7 +242,8 @@ public:
             sizeof(DataType_) * embedding_kernel_transposed_padded_size +
 #endif
             sizeof(DataType_) * (datatype_buf_size + logits_buf_size) + 
-            sizeof(int) * (topp_id_vals_buf_size + topp_offset_buf_size) +
+            sizeof(int) * (topp_id_vals_buf_size + topp_offset_buf_size + start_ids_buf_size) +
+            sizeof(bool) * finished_buf_size +
             topp_workspace_size_ + topk_workspace_size_ + topk_topp_workspace_size_));
 
 #if EMBEDDING_TRANSPOSE_OPT == 1
@@ -225,16 +263,24 @@ public:
         logits_buf_ = decoder_normed_result_buf_ + decoder_normed_result_buffer_size;
         topp_id_vals_buf_ = (int *)(logits_buf_ + logits_buf_size);
         topp_offset_buf_ = (int *)(topp_id_vals_buf_ + topp_id_vals_buf_size);
-        topp_workspace_ = (void *)(topp_offset_buf_ + topp_offset_buf_size);
+        start_ids_buf_ = (int *)(topp_offset_buf_ + topp_offset_buf_size);
+        finished_buf_ = (bool *)(start_ids_buf_ + start_ids_buf_size);
+        topp_workspace_ = (void *)(finished_buf_ + finished_buf_size);
         topk_workspace_ = (void *)(topp_workspace_ + topp_workspace_size_);
         topk_topp_workspace_ = (void *)(topk_workspace_ + topk_workspace_size_);
 
-#if EMBEDDING_TRANSPOSE_OPT == 1
-        cudaMemset(embedding_kernel_transposed_padded_, 0, embedding_kernel_transposed_padded_size * sizeof(DataType_));
-#endif
-
         cudaDeviceSynchronize();
 
+        // Keep the [start_len, batch_size] start ids in pinned memory, so that forward
+        // uploads them with one asynchronous copy.
+        staging_pool_ = &PinnedStagingPool::instance();
+        h_start_ids_ = (int *)staging_pool_->acquire(sizeof(int) * start_ids_buf_size);
+        for (int i = 0; i < args_.start_len_; i++)
+            memcpy(h_start_ids_ + i * args_.batch_size_, args_.start_ids_[i], sizeof(int) * args_.batch_size_);
+        finished_reader_ = new FinishedFlagsReader(*staging_pool_, args_.batch_size_);
+        for (int i = 0; i < 3; i++)
+            check_cuda_error(cudaEventCreate(&metrics_events_[i]));
+
         FILE *fd = fopen("decoding_gemm_config.in", "r");
         int err = 0;
         if (fd == NULL)
@@ -280,6 +326,20 @@ public:
         }
     }
 
+    /**
+     * Build the transposed and padded copy of the embedding kernel. forward builds it when it
+     * gets another pointer, so this is only required when the weights are reloaded in place.
+     **/
+    void set_embedding_kernel(const DataType_ *embedding_kernel, cudaStream_t stream)
+    {
+#if EMBEDDING_TRANSPOSE_OPT == 1
+        transpose_pad_embedding_kernelLauncher(embedding_kernel_transposed_padded_, embedding_kernel,
+                                               args_.vocab_size_, args_.vocab_size_padded_, args_.hidden_units_,
+                                               stream);
+#endif
+        embedding_kernel_src_ = embedding_kernel;
+    }
+
     void forward(const DecoderInitParam<DataType_> *param,
                  DecodingInitParam<DataType_> decoding_params)
     {
@@ -300,7 +360,12 @@ public:
 
         /* Initialize the first output_ids */
 
-        check_cuda_error(cudaMemcpyAsync(decoding_params.output_ids, args_.start_ids_[0], m*sizeof(int), cudaMemcpyHostToDevice, decoding_params.stream));
+        check_cuda_error(cudaMemcpyAsync(start_ids_buf_, h_start_ids_, args_.start_len_ * m * sizeof(int), cudaMemcpyHostToDevice, decoding_params.stream));
+        check_cuda_error(cudaMemcpyAsync(decoding_params.output_ids, start_ids_buf_, m*sizeof(int), cudaMemcpyDeviceToDevice, decoding_params.stream));
+        check_cuda_error(cudaMemsetAsync(finished_buf_, 0, sizeof(bool) * m, decoding_params.stream));
+        if (decoding_params.sequence_length != nullptr)
+            check_cuda_error(cudaMemsetAsync(decoding_params.sequence_length, 0, sizeof(int) * m, decoding_params.stream));
+        finished_reader_->reset();
         if (args_.probability_threshold_ != 0.0)
         {
             topp_initialization_kernelLauncher(nullptr,
@@ -308,15 +373,18 @@ public:
                                                nullptr,
                                                topp_id_vals_buf_,
                                                topp_offset_buf_,
-                                               args_.candidate_num_ > 0 ? args_.candidate_num_ : args_.vocab_size_, 
-                                               args_,
+                                               args_.candidate_num_ > 0 ? args_.candidate_num_ : args_.vocab_size_padded_, 
+                                               sampling_args_,
                                                decoding_params.stream);
         }
 
-#if EMBEDDING_TRANSPOSE_OPT == 1
-        transpose(embedding_kernel_transposed_padded_, decoding_params.embedding_kernel, 1,
-                  args_.vocab_size_, args_.hidden_units_, 0, decoding_params.stream);
-#endif
+        if (embedding_kernel_src_ != decoding_params.embedding_kernel)
+            set_embedding_kernel(decoding_params.embedding_kernel, decoding_params.stream);
+        // the constraint covers the whole sentence, the states start after the prompt
+        if (decoding_params.constraint_states != nullptr)
+            advance_token_constraint_prompt_kernelLauncher(decoding_params.constraint_states, start_ids_buf_,
+                                                           decoding_params.constraint_table, m, args_.start_len_,
+                                                           decoding_params.stream);
 #ifndef NDEBUG
         cudaDeviceSynchronize();
         check_cuda_error(cudaGetLastError());
@@ -324,7 +392,26 @@ public:
 
         int cache_size = m * args_.seq_len_ * args_.hidden_units_; // type T
 
+        // the first token is sampled at step start_len_
+        const bool measure = decoding_params.metrics != nullptr && args_.start_len_ < args_.seq_len_;
+        if (measure)
+        {
+            metrics_tracker_.begin(decoding_params.metrics, decoding_params.enqueue_us);
+            check_cuda_error(cudaEventRecord(metrics_events_[0], decoding_params.stream));
+        }
+
+        if (logits_aggregator_ != nullptr &&
+            (decoding_params.embedding_kernel != logits_aggregator_->embedding() || decoding_params.constraint_states != nullptr))
+        {
+            printf("[ERROR][DecodingGpt2] the logits aggregator needs the embedding it was set with and no token constraint. \n");
+            exit(-1);
+        }
+        // the instance joins the aggregator at its first sampled step, the other instances do not wait for its prompt
+        std::unique_ptr<typename LogitsAggregator<OpType_>::Participant> participant;
+
         bool do_beamsearch = false;
+        bool all_finished = false;
+        int last_step = args_.seq_len_ - 1;
         for (int step = 1; step < args_.seq_len_; ++step)
         {
             int *word_ids_buf_ = decoding_params.output_ids + (step - 1) * m;
@@ -387,6 +474,24 @@ public:
             cudaDeviceSynchronize();
             check_cuda_error(cudaGetLastError());
 #endif
+            if (logits_aggregator_ != nullptr && do_beamsearch)
+            {
+                // one GEMM and one sampling for the rows of all the instances of the step
+                if (!participant)
+                    participant.reset(new typename LogitsAggregator<OpType_>::Participant(logits_aggregator_));
+                check_cuda_error(cudaEventRecord(logits_ready_event_, decoding_params.stream));
+                logits_aggregator_->submit(decoder_normed_result_buf_, m, decoding_params.output_ids + step * m,
+                                           nullptr, nullptr, decoding_params.stream, logits_ready_event_);
+                all_finished = finish_step(decoding_params, step);
+                if (measure && step == args_.start_len_)
+                    check_cuda_error(cudaEventRecord(metrics_events_[1], decoding_params.stream));
+                if (all_finished)
+                {
+                    last_step = step;
+                    break;
+                }
+                continue;
+            }
 
             DataType_ alpha = DataType_(1.0f);
             DataType_ beta = DataType_(0.0f);
@@ -426,10 +531,18 @@ public:
                                                      (DataType_) args_.temperature_,
                                                      m,
                                                      n,
+                                                     args_.vocab_size_padded_,
                                                      decoding_params.stream);
             int random_num = rand();
             if (do_beamsearch)
             {
+                if (decoding_params.constraint_states != nullptr)
+                {
+                    // mask the tokens the automaton states do not allow, the padded vocabulary included
+                    apply_token_constraint_kernelLauncher(logits_buf_, decoding_params.constraint_states,
+                                                          decoding_params.constraint_table, finished_buf_,
+                                                          m, args_.vocab_size_padded_, decoding_params.stream);
+                }
                 // Sampling
                 if(args_.candidate_num_ > 0 && args_.probability_threshold_ == 0.0)
                 {
@@ -441,7 +554,7 @@ public:
                                                         nullptr,
                                                         nullptr,
                                                         random_num,
-                                                        args_,
+                                                        sampling_args_,
                                                         decoding_params.stream);
                 }
                 else if(args_.candidate_num_ == 0 && args_.probability_threshold_ > 0.0f)
@@ -452,7 +565,7 @@ public:
                                            args_.end_id_,
                                            nullptr,
                                            m,
-                                           n,
+                                           args_.vocab_size_padded_,
                                            decoding_params.stream);
 #ifndef NDEBUG
                     cudaDeviceSynchronize();
@@ -465,10 +578,10 @@ public:
                                                         topp_offset_buf_,
                                                         nullptr,
                                                         random_num,
-                                                        args_,
+                                                        sampling_args_,
                                                         decoding_params.output_ids + step * m,
                                                         nullptr,
-                                                        n,
+                                                        args_.vocab_size_padded_,
                                                         decoding_params.stream);
                 }
                 else if(args_.candidate_num_ > 0 && args_.probability_threshold_ > 0.0f)
@@ -478,9 +591,10 @@ public:
                                                              decoding_params.output_ids + step * m,
                                                              logits_buf_,
                                                              random_num,
-                                                             args_,
+                                                             sampling_args_,
                                                              decoding_params.stream);
                 }
+                all_finished = finish_step(decoding_params, step);
 #ifndef NDEBUG
                 cudaDeviceSynchronize();
                 check_cuda_error(cudaGetLastError());
@@ -489,18 +603,97 @@ public:
             else
             {
                 // else of do_beamsearch (set pre-determined word ids)
-                check_cuda_error(cudaMemcpyAsync(decoding_params.output_ids + step*m, args_.start_ids_[step], 
-                                m*sizeof(int), cudaMemcpyHostToDevice, decoding_params.stream));
+                check_cuda_error(cudaMemcpyAsync(decoding_params.output_ids + step*m, start_ids_buf_ + step*m,
+                                m*sizeof(int), cudaMemcpyDeviceToDevice, decoding_params.stream));
+            }
+            if (measure && step == args_.start_len_)
+                check_cuda_error(cudaEventRecord(metrics_events_[1], decoding_params.stream));
+            if (all_finished)
+            {
+                last_step = step;
+                break;
             }
         } // end for decoding step for llop
+
+        // the steps after an early end only emit end_id
+        if (last_step < args_.seq_len_ - 1)
+            set_ids_kernelLauncher(decoding_params.output_ids + (last_step + 1) * m, args_.end_id_,
+                                   (args_.seq_len_ - 1 - last_step) * m, decoding_params.stream);
+
+        if (measure)
+        {
+            // forward waits for the last token only when the metrics are enabled
+            check_cuda_error(cudaEventRecord(metrics_events_[2], decoding_params.stream));
+            check_cuda_error(cudaEventSynchronize(metrics_events_[2]));
+            float first_ms = 0.0f;
+            float last_ms = 0.0f;
+            check_cuda_error(cudaEventElapsedTime(&first_ms, metrics_events_[0], metrics_events_[1]));
+            check_cuda_error(cudaEventElapsedTime(&last_ms, metrics_events_[0], metrics_events_[2]));
+            const int64_t start_us = metrics_tracker_.start_us();
+            const int rest = last_step - args_.start_len_;
+            metrics_tracker_.step_all(1, 1, start_us + (int64_t)(first_ms * 1000.0f));
+            metrics_tracker_.step_all(rest, rest, start_us + (int64_t)(last_ms * 1000.0f));
+            metrics_tracker_.end(start_us + (int64_t)(last_ms * 1000.0f));
+        }
     } // end of forward
 
+    /**
+     * After the ids of a sampled step: the finished rows emit end_id, the constraint states
+     * advance and the stop criteria count the tokens from the first sampled one. Return true
+     * once all the rows are finished. The flags are read one step late, the stream is not
+     * drained.
+     **/
+    bool finish_step(const DecodingInitParam<DataType_> &decoding_params, const int step)
+    {
+        const int m = args_.batch_size_;
+        int *ids = decoding_params.output_ids + step * m;
+        update_finished_kernelLauncher(finished_buf_, decoding_params.sequence_length, ids, args_.end_id_, m,
+                                       decoding_params.stream);
+        if (decoding_params.constraint_states != nullptr)
+            advance_token_constraint_kernelLauncher(decoding_params.constraint_states, ids, nullptr,
+                                                    decoding_params.constraint_table, m, decoding_params.stream);
+        stop_criteria_kernelLauncher(finished_buf_, decoding_params.output_ids + args_.start_len_ * m, nullptr,
+                                     decoding_params.stop_words, decoding_params.stop_words_len,
+                                     decoding_params.max_new_tokens, step - args_.start_len_ + 1, m, 1,
+                                     decoding_params.stream);
+        const bool *finished = finished_reader_->push(finished_buf_, decoding_params.stream);
+        return finished != nullptr && FinishedFlagsReader::all(finished, m);
+    }
+
+    /**
+     * Share the logits GEMM and the top k sampling of the sampled steps with the other instances
+     * of the aggregator, which has gpt2_layout and the vocabulary, candidate_num and temperature
+     * of this instance. nullptr runs them alone again.
+     **/
+    void set_logits_aggregator(LogitsAggregator<OpType_> *aggregator)
+    {
+        if (aggregator != nullptr &&
+            (args_.candidate_num_ == 0 || args_.probability_threshold_ != 0.0 || !aggregator->gpt2_layout() ||
+             aggregator->hidden_units() != args_.hidden_units_ || aggregator->vocab_size() != args_.vocab_size_ ||
+             aggregator->candidate_num() != args_.candidate_num_ || aggregator->temperature() != args_.temperature_ ||
+             aggregator->max_rows() < args_.batch_size_))
+        {
+            printf("[ERROR][DecodingGpt2] the logits aggregator needs top k sampling, gpt2_layout and the same hidden_units, "
+                   "vocab_size, candidate_num and temperature, with at least batch_size rows. \n");
+            exit(-1);
+        }
+        if (aggregator != nullptr && logits_ready_event_ == nullptr)
+            check_cuda_error(cudaEventCreateWithFlags(&logits_ready_event_, cudaEventDisableTiming));
+        logits_aggregator_ = aggregator;
+    }
+
     virtual ~DecodingGpt2()
     {
         delete[] K_cache_;
         delete[] V_cache_;
         delete decoder_;
         allocator_.free(buf_);
+        staging_pool_->release(h_start_ids_);
+        delete finished_reader_;
+        for (int i = 0; i < 3; i++)
+            cudaEventDestroy(metrics_events_[i]);
+        if (logits_ready_event_ != nullptr)
+            cudaEventDestroy(logits_ready_event_);
         for(int i = 0; i < args_.start_len_; i++)
         {
             delete [] args_.start_ids_[i];
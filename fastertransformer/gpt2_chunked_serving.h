@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * GPT-2 serving with chunked prefill
+ *
+ * The sequences of a ChunkedPrefillScheduler share one KV cache of
+ * [max_seq_len, slot_num, hidden_units] per layer. A step runs the packed rows
+ * of the plan, prompt chunks and decode tokens together, through the layers
+ * with OpenDecoder::forward_packed, and samples the next token of the rows
+ * that end a prompt or decode with top-k sampling on the padded logits, like
+ * DecodingGpt2. Only the sampled rows go through the logits GEMM.
+ *
+ * With config.host_slot_num > 0, the swaps of the plan (the preemption and the
+ * resume of sequences) are issued by a KVCacheSwapper on its own stream before
+ * the rows, they overlap the upload and the embedding lookup of the step.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/open_decoder.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/arguments.h"
+#include "fastertransformer/pinned_staging_pool.h"
+#include "fastertransformer/chunked_prefill_scheduler.h"
+#include "fastertransformer/kv_cache_swapper.h"
+#include <cuda_runtime.h>
+#include <stdlib.h>
+#include <cstring>
+
+namespace fastertransformer
+{
+
+template <OperationType OpType_>
+class Gpt2ChunkedServing
+{
+private:
+    typedef DecoderTransformerTraits<OpType_> Traits_;
+    typedef typename Traits_::DataType DataType_;
+    const IAllocator &allocator_;
+    const ChunkedPrefillConfig config_;
+    /* batch_size_ is the number of slots, vocab_size_ is padded to a multiple of 8 */
+    DecodingSamplingArguments args_;
+    int vocab_size_;
+    float temperature_;
+
+    const cudaDataType_t computeType_ = Traits_::computeType;
+    const cudaDataType_t AType_ = Traits_::AType;
+    const cudaDataType_t BType_ = Traits_::BType;
+    const cudaDataType_t CType_ = Traits_::CType;
+
+    OpenDecoder<OpType_> *decoder_;
+    DataType_ *embedding_kernel_transposed_padded_;
+    const DataType_ *embedding_kernel_src_ = nullptr;
+    DataType_ *from_tensor_[2];
+    DataType_ *K_cache_;
+    DataType_ *V_cache_;
+    DataType_ *decoder_buf_;
+    DataType_ *sample_buf_;
+    DataType_ *normed_buf_;
+    DataType_ *logits_buf_;
+    void *topk_workspace_;
+    size_t topk_workspace_size_ = 0;
+    int *rows_buf_;       // [ids, positions, slots, sample rows] of a step
+    int *sampled_ids_buf_;
+    void *buf_;
+
+    KVCacheSwapper<DataType_> *swapper_ = nullptr;
+
+    PinnedStagingPool *staging_pool_;
+    int *h_rows_;
+    int *h_sampled_ids_;
+    /* recorded after the upload of h_rows_, a step without sampling returns before the
+       stream is drained, so the next step waits on it before refilling h_rows_ */
+    cudaEvent_t rows_uploaded_event_;
+
+public:
+    Gpt2ChunkedServing(const IAllocator &allocator, const ChunkedPrefillConfig &config,
+                       const int head_num, const int size_per_head,
+                       const int vocab_size, const int decoder_layers, const int end_id,
+                       const int candidate_num = 1, const float temperature = 1.0) : allocator_(allocator),
+                                                                                     config_(config),
+                                                                                     vocab_size_(vocab_size),
+                                                                                     temperature_(temperature)
+    {
+#ifndef NDEBUG
+        PRINT_FUNC_NAME_();
+#endif
+        if (candidate_num <= 0 || temperature == 0.0f)
+        {
+            printf("[ERROR][Gpt2ChunkedServing] candidate_num should be positive (get %d) and temperature non zero. \n",
+                   candidate_num);
+            exit(-1);
+        }
+        args_.batch_size_ = config.slot_num;
+        args_.seq_len_ = config.max_seq_len;
+        args_.head_num_ = head_num;
+        args_.size_per_head_ = size_per_head;
+        args_.hidden_units_ = head_num * size_per_head;
+        args_.decoder_layers_ = decoder_layers;
+        args_.vocab_size_padded_ = div_up(vocab_size, 8) * 8;
+        args_.vocab_size_ = args_.vocab_size_padded_;
+        args_.start_id_ = end_id;
+        args_.end_id_ = end_id;
+        args_.candidate_num_ = candidate_num;
+        args_.probability_threshold_ = 0.0f;
+
+        decoder_ = new OpenDecoder<OpType_>(config.token_budget, 0 /* memory_max_seq_len */,
+                                            head_num, size_per_head, 0 /* memory_hidden_units */);
+
+        const int hidden_units = args_.hidden_units_;
+        const int from_tensor_size = config.token_budget * hidden_units;                    // type T
+        const int decoder_workspace_size = decoder_->getWorkspaceSize();                    // type T
+        const int cache_size = config.max_seq_len * config.slot_num * hidden_units;         // type T
+        const int sample_buf_size = config.slot_num * hidden_units;                         // type T
+        const int logits_buf_size = (int)(ceil(config.slot_num * args_.vocab_size_padded_ / 4.)) * 4; // type T
+        const int embedding_size = div_up(hidden_units * args_.vocab_size_padded_, 128) * 128; // type T
+        const int rows_buf_size = (int)(ceil((3 * config.token_budget + config.slot_num) / 4.)) * 4; // type int
+        const int sampled_ids_buf_size = (int)(ceil(config.slot_num / 4.)) * 4;               // type int
+
+        topK_sampling_kernel_kernelLauncher(nullptr, topk_workspace_size_, (DataType_ *)nullptr, nullptr, nullptr,
+                                            nullptr, 0, args_, 0);
+
+        const size_t datatype_buf_size = (size_t)embedding_size + 2 * from_tensor_size + decoder_workspace_size +
+                                         (size_t)cache_size * 2 * decoder_layers + 2 * sample_buf_size + logits_buf_size;
+        buf_ = reinterpret_cast<void *>(allocator_.malloc(sizeof(DataType_) * datatype_buf_size +
+                                                          sizeof(int) * (rows_buf_size + sampled_ids_buf_size) +
+                                                          topk_workspace_size_));
+        embedding_kernel_transposed_padded_ = (DataType_ *)buf_;
+        from_tensor_[0] = embedding_kernel_transposed_padded_ + embedding_size;
+        from_tensor_[1] = from_tensor_[0] + from_tensor_size;
+        K_cache_ = from_tensor_[1] + from_tensor_size;
+        V_cache_ = K_cache_ + (size_t)cache_size * decoder_layers;
+        decoder_buf_ = V_cache_ + (size_t)cache_size * decoder_layers;
+        sample_buf_ = decoder_buf_ + decoder_workspace_size;
+        normed_buf_ = sample_buf_ + sample_buf_size;
+        logits_buf_ = normed_buf_ + sample_buf_size;
+        rows_buf_ = (int *)(logits_buf_ + logits_buf_size);
+        sampled_ids_buf_ = rows_buf_ + rows_buf_size;
+        topk_workspace_ = (void *)(sampled_ids_buf_ + sampled_ids_buf_size);
+
+        staging_pool_ = &PinnedStagingPool::instance();
+        h_rows_ = (int *)staging_pool_->acquire(sizeof(int) * (rows_buf_size + sampled_ids_buf_size));
+        h_sampled_ids_ = h_rows_ + rows_buf_size;
+        check_cuda_error(cudaEventCreateWithFlags(&rows_uploaded_event_, cudaEventDisableTiming));
+
+        if (config.host_slot_num > 0)
+            swapper_ = new KVCacheSwapper<DataType_>(K_cache_, V_cache_, decoder_layers, config.max_seq_len,
+                                                     config.slot_num, hidden_units, config.host_slot_num);
+    }
+
+    const ChunkedPrefillConfig &config() const { return config_; }
+
+    /* Run the rows of plan and write the next token of its sampling entries to sampled_ids
+       [plan.sample_rows.size()], waits for the stream if the plan samples. */
+    void forward(const DecoderInitParam<DataType_> *param, DecodingInitParam<DataType_> decoding_params,
+                 const StepPlan &plan, int *sampled_ids)
+    {
+#ifndef NDEBUG
+        PRINT_FUNC_NAME_();
+#endif
+        const int rows = plan.token_num();
+        const int samples = (int)plan.sample_rows.size();
+        const int k = args_.hidden_units_;
+        if (!plan.swaps.empty())
+        {
+            if (swapper_ == nullptr)
+            {
+                printf("[ERROR][Gpt2ChunkedServing] the plan swaps sequences, config.host_slot_num is 0. \n");
+                exit(-1);
+            }
+            swapper_->apply(plan.swaps, decoding_params.stream);
+        }
+        if (rows == 0)
+            return;
+        if (rows > config_.token_budget)
+        {
+            printf("[ERROR][Gpt2ChunkedServing] the step has %d rows, the budget is %d. \n", rows, config_.token_budget);
+            exit(-1);
+        }
+
+        // one upload of the rows, once the upload of the previous step has read h_rows_
+        check_cuda_error(cudaEventSynchronize(rows_uploaded_event_));
+        memcpy(h_rows_, plan.row_ids.data(), sizeof(int) * rows);
+        memcpy(h_rows_ + rows, plan.row_positions.data(), sizeof(int) * rows);
+        memcpy(h_rows_ + 2 * rows, plan.row_slots.data(), sizeof(int) * rows);
+        memcpy(h_rows_ + 3 * rows, plan.sample_rows.data(), sizeof(int) * samples);
+        check_cuda_error(cudaMemcpyAsync(rows_buf_, h_rows_, sizeof(int) * (3 * rows + samples),
+                                         cudaMemcpyHostToDevice, decoding_params.stream));
+        check_cuda_error(cudaEventRecord(rows_uploaded_event_, decoding_params.stream));
+        const int *ids_buf = rows_buf_;
+        const int *positions_buf = rows_buf_ + rows;
+        const int *slots_buf = rows_buf_ + 2 * rows;
+        const int *sample_rows_buf = rows_buf_ + 3 * rows;
+
+        if (embedding_kernel_src_ != decoding_params.embedding_kernel)
+        {
+            transpose_pad_embedding_kernelLauncher(embedding_kernel_transposed_padded_, decoding_params.embedding_kernel,
+                                                   vocab_size_, args_.vocab_size_padded_, k, decoding_params.stream);
+            embedding_kernel_src_ = decoding_params.embedding_kernel;
+        }
+
+        packed_embedding_position_lookups_kernel_launcher(from_tensor_[0], decoding_params.embedding_table,
+                                                          decoding_params.position_encoding_table,
+                                                          ids_buf, positions_buf, rows, k, decoding_params.stream);
+#ifndef NDEBUG
+        cudaDeviceSynchronize();
+        check_cuda_error(cudaGetLastError());
+#endif
+        // the rows read the swapped in caches and write the slots of the swapped out ones
+        if (!plan.swaps.empty())
+            swapper_->wait(decoding_params.stream);
+        const size_t cache_size = (size_t)config_.max_seq_len * config_.slot_num * k;
+        int out_id = 0;
+        for (int layer = 0; layer < args_.decoder_layers_; ++layer)
+        {
+            const int from_id = layer & 0x1;
+            out_id = 1 - from_id;
+            decoder_->initialize(param[layer], decoder_buf_);
+            decoder_->forward_packed(from_tensor_[from_id], K_cache_ + layer * cache_size, V_cache_ + layer * cache_size,
+                                     from_tensor_[out_id], positions_buf, slots_buf, rows,
+                                     config_.slot_num, config_.max_seq_len);
+        }
+        if (samples == 0)
+            return;
+
+        // only the last row of the entries that sample goes through the logits GEMM
+        gather_rows_kernelLauncher(sample_buf_, from_tensor_[out_id], sample_rows_buf, samples, k, decoding_params.stream);
+        decoder_->decoder_norm1(sample_buf_, decoding_params.layernorm.gamma, decoding_params.layernorm.beta,
+                                normed_buf_, samples, k);
+
+        DataType_ alpha = DataType_(1.0f);
+        DataType_ beta = DataType_(0.0f);
+        const cublasGemmAlgo_t algo = OpType_ == OperationType::FP16 ? CUBLAS_GEMM_DEFAULT_TENSOR_OP : CUBLAS_GEMM_DEFAULT;
+        check_cuda_error(cublasGemmEx(decoding_params.cublas_handle,
+                                      CUBLAS_OP_N, CUBLAS_OP_N,
+                                      args_.vocab_size_padded_, samples, k,
+                                      &alpha,
+                                      embedding_kernel_transposed_padded_, AType_, args_.vocab_size_padded_,
+                                      normed_buf_, BType_, k,
+                                      &beta,
+                                      logits_buf_, CType_, args_.vocab_size_padded_,
+                                      computeType_,
+                                      algo));
+        apply_temperature_penalty_kernelLauncher(logits_buf_, (DataType_)temperature_, samples, vocab_size_,
+                                                 args_.vocab_size_padded_, decoding_params.stream);
+
+        DecodingSamplingArguments sampling_args = args_;
+        sampling_args.batch_size_ = samples;
+        topK_sampling_kernel_kernelLauncher(topk_workspace_, topk_workspace_size_, logits_buf_, sampled_ids_buf_,
+                                            nullptr, nullptr, rand(), sampling_args, decoding_params.stream);
+        check_cuda_error(cudaMemcpyAsync(h_sampled_ids_, sampled_ids_buf_, sizeof(int) * samples,
+                                         cudaMemcpyDeviceToHost, decoding_params.stream));
+        check_cuda_error(cudaStreamSynchronize(decoding_params.stream));
+        memcpy(sampled_ids, h_sampled_ids_, sizeof(int) * samples);
+    }
+
+    /* One step of the scheduler: schedule, run and complete. Return the ids of the sequences
+       that finished, the sequences of the scheduler should fit the config of the engine. */
+    std::vector<int> step(ChunkedPrefillScheduler &scheduler, const DecoderInitParam<DataType_> *param,
+                          DecodingInitParam<DataType_> decoding_params)
+    {
+        const StepPlan plan = scheduler.schedule();
+        std::vector<int> sampled_ids(plan.sample_rows.size() + 1);
+        forward(param, decoding_params, plan, sampled_ids.data());
+        return scheduler.complete(plan, sampled_ids.data(), args_.end_id_);
+    }
+
+    ~Gpt2ChunkedServing()
+    {
+        delete swapper_;
+        delete decoder_;
+        allocator_.free(buf_);
+        cudaEventSynchronize(rows_uploaded_event_);
+        cudaEventDestroy(rows_uploaded_event_);
+        staging_pool_->release(h_rows_);
+    }
+};
+
+} // namespace fastertransformer
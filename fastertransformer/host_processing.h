@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Host stages around the engines on the ThreadPool
+ *
+ * The offsets of the remove padding encoder, the transpose of the start ids
+ * and gather_tree on the outputs of the beam search, computed on the host
+ * with the same results as the kernels. Building the offsets on the host
+ * gives valid_word_num without waiting for the device. for_each_sentence runs
+ * a callback of the user, e.g. the detokenizer, on the sentences in parallel.
+ **/
+
+#pragma once
+#include "fastertransformer/thread_pool.h"
+#include <algorithm>
+#include <vector>
+
+namespace fastertransformer
+{
+
+/* indices a task of the host stages handles at least */
+const int HOST_PROCESSING_GRAIN = 16384;
+
+/* tmp_mask_offset [valid_word_num] of build_sequence_length_padding_offset_kernelLauncher, the
+   number of padding words before each word. Return valid_word_num. */
+inline int build_padding_offset_host(const int *sequence_length, const int batch_size, const int max_seq_len,
+                                     int *tmp_mask_offset, ThreadPool &pool = ThreadPool::global())
+{
+  std::vector<int> word_offset(batch_size + 1, 0);
+  for (int i = 0; i < batch_size; i++)
+    word_offset[i + 1] = word_offset[i] + sequence_length[i];
+  const int valid_word_num = word_offset[batch_size];
+  const int grain = std::max(1, (int)((long long)HOST_PROCESSING_GRAIN * batch_size / std::max(valid_word_num, 1)));
+  parallel_for(0, batch_size, grain, [&](const int begin, const int end) {
+    for (int i = begin; i < end; i++)
+    {
+      // the words of the sentences before i are word_offset[i] out of i * max_seq_len
+      const int cum_offset = i * max_seq_len - word_offset[i];
+      std::fill(tmp_mask_offset + word_offset[i], tmp_mask_offset + word_offset[i + 1], cum_offset);
+    }
+  }, pool);
+  return valid_word_num;
+}
+
+/* The sequence offsets of the TensorRT fused attention: [batch_size + 1] prefix sums of the
+   lengths with remove_padding, else [2 * batch_size + 1] with the end of every sentence followed
+   by the start of the next padded one. Return the size. */
+inline int build_trt_seqlen_offset_host(const int *sequence_length, const int batch_size, const int max_seq_len,
+                                        const bool remove_padding, int *trt_seqlen_offset)
+{
+  trt_seqlen_offset[0] = 0;
+  if (remove_padding)
+  {
+    for (int i = 0; i < batch_size; i++)
+      trt_seqlen_offset[i + 1] = trt_seqlen_offset[i] + sequence_length[i];
+    return batch_size + 1;
+  }
+  for (int i = 0; i < batch_size; i++)
+  {
+    trt_seqlen_offset[2 * i + 1] = max_seq_len * i + sequence_length[i];
+    trt_seqlen_offset[2 * i + 2] = max_seq_len * (i + 1);
+  }
+  return 2 * batch_size + 1;
+}
+
+/* dst [cols, rows] = transpose of src [rows, cols] */
+template <typename T>
+void transpose_host(const T *src, const int rows, const int cols, T *dst, ThreadPool &pool = ThreadPool::global())
+{
+  const int grain = std::max(1, HOST_PROCESSING_GRAIN / std::max(rows, 1));
+  parallel_for(0, cols, grain, [&](const int begin, const int end) {
+    for (int j = begin; j < end; j++)
+      for (int i = 0; i < rows; i++)
+        dst[(long long)j * rows + i] = src[(long long)i * cols + j];
+  }, pool);
+}
+
+/* gather_tree_kernel_launcher on the host. step_ids, parent_ids and beams are [max_time, batch_size,
+   beam_width], max_sequence_lengths is [batch_size]. */
+inline void gather_tree_host(const int max_time, const int batch_size, const int beam_width,
+                             const int *step_ids, const int *parent_ids, const int *max_sequence_lengths,
+                             const int end_token, int *beams, ThreadPool &pool = ThreadPool::global())
+{
+  const int grain = std::max(1, HOST_PROCESSING_GRAIN / std::max(max_time, 1));
+  parallel_for(0, batch_size * beam_width, grain, [&](const int begin, const int end) {
+    for (int i = begin; i < end; i++)
+    {
+      const int batch = i / beam_width;
+      const int beam = i % beam_width;
+      const int max_seq_len_b = std::min(max_time, max_sequence_lengths[batch]);
+      if (max_seq_len_b <= 0)
+        continue;
+      const int stride = batch_size * beam_width;
+      const int base = beam_width * batch;
+
+      const int initial_beam_ix = stride * (max_seq_len_b - 1) + base + beam;
+      beams[initial_beam_ix] = step_ids[initial_beam_ix];
+      int parent = parent_ids[initial_beam_ix] % beam_width;
+      bool found_bad = false;
+      for (int level = max_seq_len_b - 2; level >= 0; --level)
+      {
+        const int level_beam_ix = stride * level + base + beam;
+        const int level_parent_ix = stride * level + base + parent;
+        if (parent < 0 || parent > beam_width)
+        {
+          beams[level_beam_ix] = -1;
+          parent = -1;
+          found_bad = true;
+        }
+        else
+        {
+          beams[level_beam_ix] = step_ids[level_parent_ix];
+          parent = parent_ids[level_parent_ix] % beam_width;
+        }
+      }
+      // the words after the end token of a beam are end tokens
+      if (!found_bad)
+      {
+        bool finished = false;
+        for (int time = 0; time < max_seq_len_b; ++time)
+        {
+          const int level_beam_ix = stride * time + base + beam;
+          if (finished)
+            beams[level_beam_ix] = end_token;
+          else if (beams[level_beam_ix] == end_token)
+            finished = true;
+        }
+      }
+    }
+  }, pool);
+}
+
+/**
+ * callback(sentence, ids, length) for every sentence of ids [max_time, sentence_num], the time major
+ * output of the decodings, with the ids of the sentence gathered in a contiguous buffer. The length
+ * of a sentence is up to its first end_token, excluded. The callbacks run concurrently.
+ **/
+template <typename F>
+void for_each_sentence(const int *ids, const int max_time, const int sentence_num, const int end_token, F callback,
+                       ThreadPool &pool = ThreadPool::global())
+{
+  parallel_for(0, sentence_num, 1, [&](const int begin, const int end) {
+    std::vector<int> sentence(max_time);
+    for (int s = begin; s < end; s++)
+    {
+      int length = 0;
+      while (length < max_time && ids[(long long)length * sentence_num + s] != end_token)
+      {
+        sentence[length] = ids[(long long)length * sentence_num + s];
+        length++;
+      }
+      callback(s, sentence.data(), length);
+    }
+  }, pool);
+}
+
+} // namespace fastertransformer
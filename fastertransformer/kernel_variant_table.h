@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Autotuned selection among kernel variants
+ *
+ * Some launchers can run a problem with several kernel variants, and the best
+ * one depends on the GPU and on the shape. Such a launcher registers a
+ * benchmark of its variants under a short kernel name, and the op that owns
+ * the launches resolves the variant of its (kernel, SM, data type, shape) key
+ * once, when it is built, then passes it to every launch:
+ *  - the table is read from KERNEL_CONFIG in the working directory when it is
+ *    first used. The offline tuner (tools/gemm_test/kernel_tune, next to the
+ *    GEMM tuners) writes this file;
+ *  - a key that is missing, or whose variant is out of range or does not
+ *    support the shape (a stale config), gets the default variant, the former
+ *    hard-coded choice;
+ *  - resolve() with tune times the variants of a missing key and keeps the
+ *    winner. The ops tune when they are built if set_online_tuning() or the
+ *    FT_ONLINE_KERNEL_TUNING environment variable enables it, or in their
+ *    explicit warm-up call. The tuning synchronizes the device, it never runs
+ *    inside a forward.
+ * Everything here runs on the host and does not depend on CUDA.
+ **/
+
+#pragma once
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <cstdio>
+#include <cstdlib>
+
+#define KERNEL_CONFIG "kernel_config.in"
+
+namespace fastertransformer
+{
+
+/* up to three dimensions of the problem, the unused ones are 0 */
+struct KernelShape
+{
+  int d0;
+  int d1;
+  int d2;
+
+  KernelShape(const int d0_ = 0, const int d1_ = 0, const int d2_ = 0) : d0(d0_), d1(d1_), d2(d2_) {}
+};
+
+/* Time of one run of variant in ms on the current device, negative if the variant does not
+   support the shape. A benchmark launches its variants directly, never through select(). */
+typedef float (*KernelVariantBenchmark)(const int variant, const KernelShape &shape, const int is_fp16);
+
+/* whether variant can run the shape, a variant of the table that cannot is not selected */
+typedef bool (*KernelVariantSupport)(const int variant, const KernelShape &shape, const int is_fp16);
+
+struct KernelVariantKey
+{
+  std::string kernel;
+  int sm;
+  int is_fp16;
+  KernelShape shape;
+
+  KernelVariantKey(const char *kernel_, const int sm_, const int is_fp16_, const KernelShape &shape_)
+      : kernel(kernel_), sm(sm_), is_fp16(is_fp16_), shape(shape_) {}
+
+  bool operator<(const KernelVariantKey &other) const
+  {
+    return std::tie(kernel, sm, is_fp16, shape.d0, shape.d1, shape.d2) <
+           std::tie(other.kernel, other.sm, other.is_fp16, other.shape.d0, other.shape.d1, other.shape.d2);
+  }
+};
+
+struct KernelVariantRecord
+{
+  int variant;
+  float time;  // ms per run when it was tuned
+};
+
+/* the shape dimension of a key that varies with the batch, rounded up to a power of 2 */
+inline int kernel_shape_bucket(const int x)
+{
+  int bucket = 1;
+  while (bucket < x)
+    bucket <<= 1;
+  return bucket;
+}
+
+class KernelVariantTable
+{
+private:
+  struct KernelInfo
+  {
+    int variant_num;
+    KernelVariantBenchmark benchmark;
+    KernelVariantSupport supported;
+  };
+
+  std::mutex mutex_;
+  std::map<KernelVariantKey, KernelVariantRecord> table_;
+  std::map<std::string, KernelInfo> kernels_;
+  bool online_tuning_;
+
+  KernelVariantTable() : online_tuning_(false)
+  {
+    const char *env = getenv("FT_ONLINE_KERNEL_TUNING");
+    online_tuning_ = env != nullptr && atoi(env) != 0;
+    load_locked(KERNEL_CONFIG);
+  }
+
+  KernelVariantTable(const KernelVariantTable &) = delete;
+  KernelVariantTable &operator=(const KernelVariantTable &) = delete;
+
+  int load_locked(const char *path)
+  {
+    FILE *fd = fopen(path, "r");
+    if (fd == NULL)
+      return 0;
+    char kernel[64];
+    int sm, is_fp16, d0, d1, d2, variant;
+    float time;
+    int num = 0;
+    // a later line of the same key replaces an earlier one, so a file can be appended to
+    while (fscanf(fd, "%63s %d %d %d %d %d ### %d %f\n", kernel, &sm, &is_fp16, &d0, &d1, &d2, &variant, &time) == 8)
+    {
+      KernelVariantRecord record = {variant, time};
+      table_[KernelVariantKey(kernel, sm, is_fp16, KernelShape(d0, d1, d2))] = record;
+      num++;
+    }
+    fclose(fd);
+    return num;
+  }
+
+  /* the variant of a registered kernel should be in range and support the shape */
+  bool valid_locked(const KernelVariantKey &key, const int variant) const
+  {
+    std::map<std::string, KernelInfo>::const_iterator info = kernels_.find(key.kernel);
+    if (info == kernels_.end())
+      return variant >= 0;
+    return variant >= 0 && variant < info->second.variant_num &&
+           (info->second.supported == nullptr || info->second.supported(variant, key.shape, key.is_fp16));
+  }
+
+  int tune_locked(const KernelVariantKey &key)
+  {
+    std::map<std::string, KernelInfo>::const_iterator info = kernels_.find(key.kernel);
+    if (info == kernels_.end())
+      return -1;
+    int best = -1;
+    float best_time = 0.0f;
+    for (int v = 0; v < info->second.variant_num; v++)
+    {
+      if (info->second.supported != nullptr && !info->second.supported(v, key.shape, key.is_fp16))
+        continue;
+      const float time = info->second.benchmark(v, key.shape, key.is_fp16);
+      if (time >= 0.0f && (best < 0 || time < best_time))
+      {
+        best = v;
+        best_time = time;
+      }
+    }
+    if (best < 0)
+      return -1;
+    KernelVariantRecord record = {best, best_time};
+    table_[key] = record;
+    printf("[INFO] kernel %s sm %d is_fp16 %d shape (%d, %d, %d) selects variant %d (%.4f ms) \n",
+           key.kernel.c_str(), key.sm, key.is_fp16, key.shape.d0, key.shape.d1, key.shape.d2, best, best_time);
+    return best;
+  }
+
+public:
+  static KernelVariantTable &instance()
+  {
+    static KernelVariantTable table;
+    return table;
+  }
+
+  /* The variants of kernel are [0, variant_num), supported can be nullptr if they all run every
+     shape. Registering a kernel again replaces it. */
+  void register_kernel(const char *kernel, const int variant_num, KernelVariantBenchmark benchmark,
+                       KernelVariantSupport supported = nullptr)
+  {
+    if (variant_num <= 0 || benchmark == nullptr)
+    {
+      printf("[ERROR][KernelVariantTable] kernel %s needs variants and a benchmark. \n", kernel);
+      exit(-1);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    KernelInfo info = {variant_num, benchmark, supported};
+    kernels_[kernel] = info;
+  }
+
+  /* The variant of the key in the table, default_variant if it is missing or not valid. Nothing
+     is tuned or stored. */
+  int select(const char *kernel, const int sm, const int is_fp16, const KernelShape &shape, const int default_variant)
+  {
+    return resolve(kernel, sm, is_fp16, shape, default_variant, false);
+  }
+
+  /* select(), and if tune a missing or not valid key of a registered kernel is tuned first */
+  int resolve(const char *kernel, const int sm, const int is_fp16, const KernelShape &shape,
+              const int default_variant, const bool tune)
+  {
+    const KernelVariantKey key(kernel, sm, is_fp16, shape);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<KernelVariantKey, KernelVariantRecord>::const_iterator it = table_.find(key);
+    if (it != table_.end() && valid_locked(key, it->second.variant))
+      return it->second.variant;
+    if (tune)
+    {
+      const int variant = tune_locked(key);
+      if (variant >= 0)
+        return variant;
+    }
+    return default_variant;
+  }
+
+  /* time the variants of the key on the current device and store the winner, return it (-1 if
+     the kernel is not registered or no variant supports the shape) */
+  int tune(const char *kernel, const int sm, const int is_fp16, const KernelShape &shape)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tune_locked(KernelVariantKey(kernel, sm, is_fp16, shape));
+  }
+
+  /* merge the entries of a config file, return their number */
+  int load(const char *path = KERNEL_CONFIG)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return load_locked(path);
+  }
+
+  /* write the whole table, it can be read back by load() */
+  bool save(const char *path = KERNEL_CONFIG)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FILE *fd = fopen(path, "w+");
+    if (fd == NULL)
+    {
+      printf("[WARNING] cannot write %s \n", path);
+      return false;
+    }
+    for (std::map<KernelVariantKey, KernelVariantRecord>::const_iterator it = table_.begin(); it != table_.end(); ++it)
+      fprintf(fd, "%s %d %d %d %d %d ### %d %f\n", it->first.kernel.c_str(), it->first.sm, it->first.is_fp16,
+              it->first.shape.d0, it->first.shape.d1, it->first.shape.d2, it->second.variant, it->second.time);
+    fclose(fd);
+    return true;
+  }
+
+  void set_online_tuning(const bool online_tuning)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    online_tuning_ = online_tuning;
+  }
+
+  bool online_tuning()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return online_tuning_;
+  }
+
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    table_.clear();
+  }
+
+  int size()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)table_.size();
+  }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Asynchronous swap of KV cache rows between the device and pinned host memory
+ *
+ * The caches have the layout of DecodingGpt2 and DecodingSampling, each layer is
+ * [max_seq_len, batch_slots, hidden_units]. A device slot is one batch row, and
+ * only the first length positions of the row are copied. The copies run on a
+ * dedicated stream, so they overlap the compute of the other sequences. A
+ * cached position is never written again, so a swap out only waits for the
+ * compute issued before it, and the compute only has to wait for the copies
+ * before it reads a swapped in row or reuses a swapped out slot.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/kv_swap_scheduler.h"
+#include <cuda_runtime.h>
+#include <vector>
+
+namespace fastertransformer
+{
+
+template <typename T>
+class KVCacheSwapper
+{
+private:
+  T *key_cache_;
+  T *value_cache_;
+  const int layers_;
+  const int max_seq_len_;
+  const int batch_slots_;
+  const int hidden_units_;
+  const int host_slot_num_;
+
+  T *host_buf_;
+  cudaStream_t copy_stream_;
+  cudaEvent_t compute_event_;
+  cudaEvent_t copy_event_;
+
+  /* host slot layout: [2 (key, value), layers, max_seq_len, hidden_units] */
+  T *host_row(const int host_slot, const int kv, const int layer) const
+  {
+    return host_buf_ + (((size_t)host_slot * 2 + kv) * layers_ + layer) * max_seq_len_ * hidden_units_;
+  }
+
+  T *device_row(const int device_slot, const int kv, const int layer) const
+  {
+    T *cache = kv == 0 ? key_cache_ : value_cache_;
+    return cache + (size_t)layer * max_seq_len_ * batch_slots_ * hidden_units_ + (size_t)device_slot * hidden_units_;
+  }
+
+  void copy(const SwapOp &op)
+  {
+    const size_t width = sizeof(T) * hidden_units_;
+    const size_t device_pitch = sizeof(T) * batch_slots_ * hidden_units_;
+    for (int kv = 0; kv < 2; kv++)
+    {
+      for (int layer = 0; layer < layers_; layer++)
+      {
+        if (op.type == SwapOpType::SWAP_OUT)
+          check_cuda_error(cudaMemcpy2DAsync(host_row(op.host_slot, kv, layer), width,
+                                             device_row(op.device_slot, kv, layer), device_pitch,
+                                             width, op.length, cudaMemcpyDeviceToHost, copy_stream_));
+        else
+          check_cuda_error(cudaMemcpy2DAsync(device_row(op.device_slot, kv, layer), device_pitch,
+                                             host_row(op.host_slot, kv, layer), width,
+                                             width, op.length, cudaMemcpyHostToDevice, copy_stream_));
+      }
+    }
+  }
+
+public:
+  KVCacheSwapper(T *key_cache, T *value_cache, const int layers, const int max_seq_len,
+                 const int batch_slots, const int hidden_units, const int host_slot_num) : key_cache_(key_cache),
+                                                                                          value_cache_(value_cache),
+                                                                                          layers_(layers),
+                                                                                          max_seq_len_(max_seq_len),
+                                                                                          batch_slots_(batch_slots),
+                                                                                          hidden_units_(hidden_units),
+                                                                                          host_slot_num_(host_slot_num),
+                                                                                          host_buf_(nullptr)
+  {
+    if (host_slot_num_ > 0)
+      check_cuda_error(cudaHostAlloc((void **)&host_buf_, host_bytes(), cudaHostAllocDefault));
+    check_cuda_error(cudaStreamCreateWithFlags(&copy_stream_, cudaStreamNonBlocking));
+    check_cuda_error(cudaEventCreateWithFlags(&compute_event_, cudaEventDisableTiming));
+    check_cuda_error(cudaEventCreateWithFlags(&copy_event_, cudaEventDisableTiming));
+  }
+
+  size_t host_bytes() const
+  {
+    return sizeof(T) * 2 * (size_t)host_slot_num_ * layers_ * max_seq_len_ * hidden_units_;
+  }
+
+  /* Issue the copies of the ops returned by KVSwapScheduler::schedule(). The copies start
+     after the work already issued to compute_stream. A START op needs no copy. */
+  void apply(const std::vector<SwapOp> &ops, cudaStream_t compute_stream)
+  {
+    bool has_copy = false;
+    for (size_t i = 0; i < ops.size(); i++)
+      has_copy = has_copy || (ops[i].type != SwapOpType::START && ops[i].length > 0);
+    if (!has_copy)
+      return;
+
+    check_cuda_error(cudaEventRecord(compute_event_, compute_stream));
+    check_cuda_error(cudaStreamWaitEvent(copy_stream_, compute_event_, 0));
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+      if (ops[i].type == SwapOpType::START || ops[i].length == 0)
+        continue;
+      if (ops[i].host_slot < 0 || ops[i].host_slot >= host_slot_num_ ||
+          ops[i].device_slot < 0 || ops[i].device_slot >= batch_slots_ || ops[i].length > max_seq_len_)
+      {
+        printf("[ERROR][KVCacheSwapper] invalid swap of sequence %d (device slot %d, host slot %d, length %d). \n",
+               ops[i].seq_id, ops[i].device_slot, ops[i].host_slot, ops[i].length);
+        exit(-1);
+      }
+      copy(ops[i]);
+    }
+    check_cuda_error(cudaEventRecord(copy_event_, copy_stream_));
+  }
+
+  /* compute_stream waits for the copies issued by the last apply(), call it before the step
+     that reads a swapped in row or writes a reused slot. */
+  void wait(cudaStream_t compute_stream)
+  {
+    check_cuda_error(cudaStreamWaitEvent(compute_stream, copy_event_, 0));
+  }
+
+  ~KVCacheSwapper()
+  {
+    cudaStreamSynchronize(copy_stream_);
+    cudaEventDestroy(compute_event_);
+    cudaEventDestroy(copy_event_);
+    cudaStreamDestroy(copy_stream_);
+    if (host_buf_ != nullptr)
+      cudaFreeHost(host_buf_);
+  }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Priority scheduler of the KV cache slots
+ *
+ * The KV cache has device_slot_num rows (the batch of the decoding), and a
+ * pinned host area has host_slot_num rows. A sequence runs on a device slot.
+ * When a sequence of higher priority is waiting and no device slot is free,
+ * the running sequence of the lowest priority is preempted: its cache is
+ * swapped out to a host slot and it is resumed later by a swap in. The
+ * scheduler only does the bookkeeping and returns the copies to issue, so it
+ * does not depend on CUDA. ChunkedPrefillScheduler keeps the slots of the GPT-2
+ * serving with it and Gpt2ChunkedServing issues the copies with KVCacheSwapper.
+ **/
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+enum class SequenceState{WAITING, RUNNING, SWAPPED, FINISHED};
+
+enum class SwapOpType{START, SWAP_OUT, SWAP_IN};
+
+struct SwapOp
+{
+  SwapOpType type;
+  int seq_id;
+  int device_slot;
+  int host_slot;   // -1 for START
+  int length;      // number of cached positions to copy
+};
+
+struct SequenceInfo
+{
+  int priority;    // a larger value is more important
+  int arrival;
+  int length;      // number of positions in the cache
+  int max_length;
+  SequenceState state;
+  int device_slot;
+  int host_slot;
+};
+
+struct SwapStats
+{
+  long long swap_out_num = 0;
+  long long swap_in_num = 0;
+  long long swapped_positions = 0;   // positions copied in both directions
+};
+
+class KVSwapScheduler
+{
+private:
+  std::vector<SequenceInfo> seqs_;
+  std::vector<int> free_device_slots_;
+  std::vector<int> free_host_slots_;
+  SwapStats stats_;
+
+  SequenceInfo &get(const int seq_id)
+  {
+    if (seq_id < 0 || seq_id >= (int)seqs_.size())
+    {
+      printf("[ERROR][KVSwapScheduler] sequence %d does not exist. \n", seq_id);
+      exit(-1);
+    }
+    return seqs_[seq_id];
+  }
+
+  static int pop_slot(std::vector<int> &slots)
+  {
+    // always hand out the smallest slot, so the result does not depend on the release order
+    std::vector<int>::iterator it = std::min_element(slots.begin(), slots.end());
+    const int slot = *it;
+    slots.erase(it);
+    return slot;
+  }
+
+  /* the running sequence that is preempted first: lowest priority, then the latest arrival */
+  int find_victim() const
+  {
+    int victim = -1;
+    for (int i = 0; i < (int)seqs_.size(); i++)
+    {
+      if (seqs_[i].state != SequenceState::RUNNING)
+        continue;
+      if (victim == -1 || seqs_[i].priority < seqs_[victim].priority ||
+          (seqs_[i].priority == seqs_[victim].priority && seqs_[i].arrival > seqs_[victim].arrival))
+        victim = i;
+    }
+    return victim;
+  }
+
+public:
+  KVSwapScheduler(const int device_slot_num, const int host_slot_num)
+  {
+    if (device_slot_num <= 0 || host_slot_num < 0)
+    {
+      printf("[ERROR][KVSwapScheduler] invalid slot numbers (device %d, host %d). \n", device_slot_num, host_slot_num);
+      exit(-1);
+    }
+    for (int i = 0; i < device_slot_num; i++)
+      free_device_slots_.push_back(i);
+    for (int i = 0; i < host_slot_num; i++)
+      free_host_slots_.push_back(i);
+  }
+
+  /* return the id of the sequence, it waits until schedule() gives it a device slot */
+  int add_sequence(const int priority, const int max_length)
+  {
+    SequenceInfo seq;
+    seq.priority = priority;
+    seq.arrival = (int)seqs_.size();
+    seq.length = 0;
+    seq.max_length = max_length;
+    seq.state = SequenceState::WAITING;
+    seq.device_slot = -1;
+    seq.host_slot = -1;
+    seqs_.push_back(seq);
+    return seq.arrival;
+  }
+
+  /* the running sequence wrote tokens more positions into its cache */
+  void advance(const int seq_id, const int tokens = 1)
+  {
+    SequenceInfo &seq = get(seq_id);
+    if (seq.state != SequenceState::RUNNING || seq.length + tokens > seq.max_length)
+    {
+      printf("[ERROR][KVSwapScheduler] sequence %d cannot advance %d tokens. \n", seq_id, tokens);
+      exit(-1);
+    }
+    seq.length += tokens;
+  }
+
+  void finish(const int seq_id)
+  {
+    SequenceInfo &seq = get(seq_id);
+    if (seq.state == SequenceState::RUNNING)
+      free_device_slots_.push_back(seq.device_slot);
+    else if (seq.state == SequenceState::SWAPPED)
+      free_host_slots_.push_back(seq.host_slot);
+    seq.state = SequenceState::FINISHED;
+    seq.device_slot = -1;
+    seq.host_slot = -1;
+  }
+
+  /* Admit the next waiting or swapped sequence by priority (then arrival) and append its ops.
+     It takes a free device slot, or preempts the running sequence of the lowest priority if
+     that one has a strictly lower priority and a host slot is free. Return false if there is
+     no candidate or it cannot be admitted, the candidates behind it are not tried. */
+  bool admit(std::vector<SwapOp> &ops)
+  {
+    int seq_id = -1;
+    for (int i = 0; i < (int)seqs_.size(); i++)
+    {
+      if (seqs_[i].state != SequenceState::WAITING && seqs_[i].state != SequenceState::SWAPPED)
+        continue;
+      if (seq_id == -1 || seqs_[i].priority > seqs_[seq_id].priority)
+        seq_id = i;
+    }
+    if (seq_id == -1)
+      return false;
+
+    SequenceInfo &seq = seqs_[seq_id];
+    if (free_device_slots_.empty())
+    {
+      const int victim_id = find_victim();
+      if (victim_id == -1 || seqs_[victim_id].priority >= seq.priority || free_host_slots_.empty())
+        return false;
+      SequenceInfo &victim = seqs_[victim_id];
+      SwapOp op;
+      op.type = SwapOpType::SWAP_OUT;
+      op.seq_id = victim_id;
+      op.device_slot = victim.device_slot;
+      op.host_slot = pop_slot(free_host_slots_);
+      op.length = victim.length;
+      ops.push_back(op);
+      free_device_slots_.push_back(victim.device_slot);
+      victim.state = SequenceState::SWAPPED;
+      victim.device_slot = -1;
+      victim.host_slot = op.host_slot;
+      stats_.swap_out_num++;
+      stats_.swapped_positions += victim.length;
+    }
+
+    SwapOp op;
+    op.seq_id = seq_id;
+    op.device_slot = pop_slot(free_device_slots_);
+    op.length = seq.length;
+    if (seq.state == SequenceState::SWAPPED)
+    {
+      op.type = SwapOpType::SWAP_IN;
+      op.host_slot = seq.host_slot;
+      // the copies are issued in order on one stream, so the host slot can be reused at once
+      free_host_slots_.push_back(seq.host_slot);
+      stats_.swap_in_num++;
+      stats_.swapped_positions += seq.length;
+    }
+    else
+    {
+      op.type = SwapOpType::START;
+      op.host_slot = -1;
+    }
+    ops.push_back(op);
+    seq.state = SequenceState::RUNNING;
+    seq.device_slot = op.device_slot;
+    seq.host_slot = -1;
+    return true;
+  }
+
+  /* Admit the sequences while admit() succeeds. The ops should be issued in order, a SWAP_OUT
+     always comes before the op that reuses its device slot. */
+  std::vector<SwapOp> schedule()
+  {
+    std::vector<SwapOp> ops;
+    while (admit(ops))
+      ;
+    return ops;
+  }
+
+  /* the running sequences ordered by device slot */
+  std::vector<int> running() const
+  {
+    std::vector<int> ids;
+    for (int i = 0; i < (int)seqs_.size(); i++)
+      if (seqs_[i].state == SequenceState::RUNNING)
+        ids.push_back(i);
+    std::sort(ids.begin(), ids.end(), [this](const int a, const int b) {
+      return seqs_[a].device_slot < seqs_[b].device_slot;
+    });
+    return ids;
+  }
+
+  const SequenceInfo &sequence(const int seq_id) const { return seqs_.at(seq_id); }
+  int free_device_slot_num() const { return (int)free_device_slots_.size(); }
+  int free_host_slot_num() const { return (int)free_host_slots_.size(); }
+  const SwapStats &stats() const { return stats_; }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Shared logits GEMM and top-k sampling of concurrent decodings
+ *
+ * The DecodingSampling or DecodingGpt2 instances that share an embedding
+ * (each on its own thread and stream, on one device) submit the normalized
+ * rows of a step instead of running their own [m, vocab] GEMM and sampling.
+ * A StepAggregator gathers the parts of the instances, then the rows are
+ * copied into one buffer, go through one GEMM, the temperature or the bias
+ * and one top-k sampling on the stream of the aggregator, and the ids (and
+ * the finished flags and sequence lengths of DecodingSampling) are copied
+ * back. The streams of the instances wait for the ready event of their part
+ * and the aggregator waits for the done event of the batch, no host
+ * synchronization is added.
+ *
+ * The embedding is a [hidden_units, vocab_size] kernel with a [vocab_size]
+ * bias like DecodingSampling, or with gpt2_layout the [vocab_size,
+ * hidden_units] table of DecodingGpt2, which is transposed and padded once.
+ * The random numbers of the sampling depend on the row of the batch, the
+ * sampled ids follow the same distribution as the ones of an instance alone.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/open_decoder.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/arguments.h"
+#include "fastertransformer/step_aggregator.h"
+#include <cuda_runtime.h>
+#include <vector>
+
+namespace fastertransformer
+{
+
+template <typename T>
+struct LogitsPart
+{
+  const T *normed;         // [rows, hidden_units], written before the ready event
+  int *ids;                // [rows]
+  int *sequence_length;    // [rows] or nullptr
+  bool *finished;          // [rows] or nullptr
+  cudaStream_t stream;
+  cudaEvent_t ready;
+};
+
+template <OperationType OpType_>
+class LogitsAggregator
+{
+private:
+  typedef DecoderTransformerTraits<OpType_> Traits_;
+  typedef typename Traits_::DataType DataType_;
+  const IAllocator &allocator_;
+
+  const cudaDataType_t computeType_ = Traits_::computeType;
+  const cudaDataType_t AType_ = Traits_::AType;
+  const cudaDataType_t BType_ = Traits_::BType;
+  const cudaDataType_t CType_ = Traits_::CType;
+  cublasGemmAlgo_t cublasAlgo_;
+
+  /* batch_size_ is max_rows, vocab_size_ is the leading dimension of the logits */
+  DecodingSamplingArguments args_;
+  const int vocab_size_;
+  const float temperature_;
+  const bool gpt2_layout_;
+
+  const DataType_ *embedding_src_ = nullptr;
+  const DataType_ *embedding_ = nullptr;
+  const DataType_ *bias_ = nullptr;
+  DataType_ *embedding_transposed_padded_ = nullptr;
+  DataType_ *normed_buf_;
+  DataType_ *logits_buf_;
+  int *ids_buf_;
+  int *sequence_length_buf_;
+  bool *finished_buf_;
+  void *topk_workspace_;
+  size_t topk_workspace_size_ = 0;
+  void *buf_;
+
+  cudaStream_t stream_;
+  cublasHandle_t cublas_handle_;
+  cudaEvent_t done_event_;
+  int random_num_ = 0;
+
+  StepAggregator<LogitsPart<DataType_>> *aggregator_;
+
+  /* runs on the thread that closes the batch, under the lock of the StepAggregator */
+  void flush(const std::vector<LogitsPart<DataType_>> &parts, const std::vector<int> &offsets, const int rows)
+  {
+    const int k = args_.hidden_units_;
+    const int n = args_.vocab_size_;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+      const LogitsPart<DataType_> &part = parts[i];
+      const int offset = offsets[i];
+      const int part_rows = (i + 1 < parts.size() ? offsets[i + 1] : rows) - offset;
+      check_cuda_error(cudaStreamWaitEvent(stream_, part.ready, 0));
+      check_cuda_error(cudaMemcpyAsync(normed_buf_ + (size_t)offset * k, part.normed, sizeof(DataType_) * part_rows * k,
+                                       cudaMemcpyDeviceToDevice, stream_));
+      if (part.finished != nullptr)
+        check_cuda_error(cudaMemcpyAsync(finished_buf_ + offset, part.finished, sizeof(bool) * part_rows,
+                                         cudaMemcpyDeviceToDevice, stream_));
+      else
+        check_cuda_error(cudaMemsetAsync(finished_buf_ + offset, 0, sizeof(bool) * part_rows, stream_));
+      if (part.sequence_length != nullptr)
+        check_cuda_error(cudaMemcpyAsync(sequence_length_buf_ + offset, part.sequence_length, sizeof(int) * part_rows,
+                                         cudaMemcpyDeviceToDevice, stream_));
+      else
+        check_cuda_error(cudaMemsetAsync(sequence_length_buf_ + offset, 0, sizeof(int) * part_rows, stream_));
+    }
+
+    DataType_ alpha = (DataType_)1.0f;
+    DataType_ beta = (DataType_)0.0f;
+    check_cuda_error(cublasGemmEx(cublas_handle_,
+                                  CUBLAS_OP_N, CUBLAS_OP_N,
+                                  n, rows, k,
+                                  &alpha,
+                                  embedding_, AType_, n,
+                                  normed_buf_, BType_, k,
+                                  &beta,
+                                  logits_buf_, CType_, n,
+                                  computeType_,
+                                  cublasAlgo_));
+
+    if (gpt2_layout_)
+      apply_temperature_penalty_kernelLauncher(logits_buf_, (DataType_)temperature_, rows, vocab_size_, n, stream_);
+    else
+      update_logits_without_softmax(logits_buf_, bias_, args_.end_id_, finished_buf_, rows, n, stream_);
+
+    DecodingSamplingArguments args = args_;
+    args.batch_size_ = rows;
+    topK_sampling_kernel_kernelLauncher(topk_workspace_,
+                                        topk_workspace_size_,
+                                        logits_buf_,
+                                        ids_buf_,
+                                        sequence_length_buf_,
+                                        finished_buf_,
+                                        random_num_++,
+                                        args,
+                                        stream_);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+      const LogitsPart<DataType_> &part = parts[i];
+      const int offset = offsets[i];
+      const int part_rows = (i + 1 < parts.size() ? offsets[i + 1] : rows) - offset;
+      check_cuda_error(cudaMemcpyAsync(part.ids, ids_buf_ + offset, sizeof(int) * part_rows,
+                                       cudaMemcpyDeviceToDevice, stream_));
+      if (part.finished != nullptr)
+        check_cuda_error(cudaMemcpyAsync(part.finished, finished_buf_ + offset, sizeof(bool) * part_rows,
+                                         cudaMemcpyDeviceToDevice, stream_));
+      if (part.sequence_length != nullptr)
+        check_cuda_error(cudaMemcpyAsync(part.sequence_length, sequence_length_buf_ + offset, sizeof(int) * part_rows,
+                                         cudaMemcpyDeviceToDevice, stream_));
+    }
+    // the waits are queued before the event is recorded again by the next batch
+    check_cuda_error(cudaEventRecord(done_event_, stream_));
+    for (size_t i = 0; i < parts.size(); i++)
+      check_cuda_error(cudaStreamWaitEvent(parts[i].stream, done_event_, 0));
+  }
+
+public:
+  /* keeps an instance in the aggregator for the scope of its forward */
+  class Participant
+  {
+  private:
+    LogitsAggregator *aggregator_;
+
+  public:
+    explicit Participant(LogitsAggregator *aggregator) : aggregator_(aggregator)
+    {
+      if (aggregator_ != nullptr)
+        aggregator_->aggregator_->join();
+    }
+    ~Participant()
+    {
+      if (aggregator_ != nullptr)
+        aggregator_->aggregator_->leave();
+    }
+  };
+
+  LogitsAggregator(const IAllocator &allocator, const StepAggregatorConfig &config,
+                   const int hidden_units, const int vocab_size, const int end_id,
+                   const int candidate_num = 1, const float temperature = 1.0,
+                   const bool gpt2_layout = false) : allocator_(allocator),
+                                                     vocab_size_(vocab_size),
+                                                     temperature_(temperature),
+                                                     gpt2_layout_(gpt2_layout)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    if (candidate_num <= 0 || temperature == 0.0f || (!gpt2_layout && temperature != 1.0f))
+    {
+      printf("[ERROR][LogitsAggregator] candidate_num should be positive (get %d), "
+             "the temperature non zero and 1 without gpt2_layout (get %f). \n",
+             candidate_num, temperature);
+      exit(-1);
+    }
+    args_.batch_size_ = config.max_rows;
+    args_.hidden_units_ = hidden_units;
+    args_.vocab_size_padded_ = gpt2_layout ? div_up(vocab_size, 8) * 8 : vocab_size;
+    args_.vocab_size_ = args_.vocab_size_padded_;
+    args_.start_id_ = end_id;
+    args_.end_id_ = end_id;
+    args_.candidate_num_ = candidate_num;
+    args_.probability_threshold_ = 0.0f;
+    cublasAlgo_ = Traits_::OpType == OperationType::FP32 ? CUBLAS_GEMM_DEFAULT : CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+
+    topK_sampling_kernel_kernelLauncher(nullptr, topk_workspace_size_, (DataType_ *)nullptr, nullptr, nullptr,
+                                        nullptr, 0, args_, 0);
+
+    const int n = args_.vocab_size_;
+    const int embedding_size = gpt2_layout ? div_up(hidden_units * n, 128) * 128 : 0;     // type T
+    const int normed_buf_size = (int)(ceil(config.max_rows * hidden_units / 4.)) * 4;     // type T
+    const int logits_buf_size = (int)(ceil(config.max_rows * n / 4.)) * 4;                // type T
+    const int rows_buf_size = (int)(ceil(config.max_rows / 4.)) * 4;                      // type int
+    const int finished_buf_size = (int)(ceil(config.max_rows / 32.)) * 32;                // type bool
+
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(
+        sizeof(DataType_) * ((size_t)embedding_size + normed_buf_size + logits_buf_size) +
+        sizeof(int) * rows_buf_size * 2 + sizeof(bool) * finished_buf_size + topk_workspace_size_));
+    embedding_transposed_padded_ = gpt2_layout ? (DataType_ *)buf_ : nullptr;
+    normed_buf_ = (DataType_ *)buf_ + embedding_size;
+    logits_buf_ = normed_buf_ + normed_buf_size;
+    ids_buf_ = (int *)(logits_buf_ + logits_buf_size);
+    sequence_length_buf_ = ids_buf_ + rows_buf_size;
+    finished_buf_ = (bool *)(sequence_length_buf_ + rows_buf_size);
+    topk_workspace_ = (void *)(finished_buf_ + finished_buf_size);
+
+    check_cuda_error(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    check_cuda_error(cublasCreate(&cublas_handle_));
+    check_cuda_error(cublasSetStream(cublas_handle_, stream_));
+    check_cuda_error(cudaEventCreateWithFlags(&done_event_, cudaEventDisableTiming));
+
+    aggregator_ = new StepAggregator<LogitsPart<DataType_>>(config,
+        [this](const std::vector<LogitsPart<DataType_>> &parts, const std::vector<int> &offsets, const int rows) {
+          flush(parts, offsets, rows);
+        });
+  }
+
+  LogitsAggregator(const LogitsAggregator &) = delete;
+  LogitsAggregator &operator=(const LogitsAggregator &) = delete;
+
+  /**
+   * embedding is the embedding_kernel of the DecodingInitParam of the instances, bias the
+   * embedding_bias_T without gpt2_layout. Set before the first submit.
+   **/
+  void set_embedding(const DataType_ *embedding, const DataType_ *bias = nullptr)
+  {
+    if (embedding == nullptr || (!gpt2_layout_ && bias == nullptr))
+    {
+      printf("[ERROR][LogitsAggregator] the embedding and, without gpt2_layout, the bias are required. \n");
+      exit(-1);
+    }
+    embedding_src_ = embedding;
+    bias_ = bias;
+    if (gpt2_layout_)
+    {
+      transpose_pad_embedding_kernelLauncher(embedding_transposed_padded_, embedding, vocab_size_,
+                                             args_.vocab_size_, args_.hidden_units_, stream_);
+      check_cuda_error(cudaStreamSynchronize(stream_));
+      embedding_ = embedding_transposed_padded_;
+    }
+    else
+      embedding_ = embedding;
+  }
+
+  const DataType_ *embedding() const { return embedding_src_; }
+  const DataType_ *bias() const { return bias_; }
+  int hidden_units() const { return args_.hidden_units_; }
+  int vocab_size() const { return vocab_size_; }
+  int end_id() const { return args_.end_id_; }
+  int candidate_num() const { return args_.candidate_num_; }
+  float temperature() const { return temperature_; }
+  bool gpt2_layout() const { return gpt2_layout_; }
+  int max_rows() const { return aggregator_->config().max_rows; }
+
+  /**
+   * Sample the next ids of the rows of an instance. ready is recorded on stream after the
+   * normalized rows; when submit returns, stream waits for the ids, the other buffers of the
+   * part can be reused at once.
+   **/
+  void submit(const DataType_ *normed, const int rows, int *ids, int *sequence_length, bool *finished,
+              cudaStream_t stream, cudaEvent_t ready)
+  {
+    if (embedding_ == nullptr)
+    {
+      printf("[ERROR][LogitsAggregator] set_embedding should be called before submit. \n");
+      exit(-1);
+    }
+    LogitsPart<DataType_> part = {normed, ids, sequence_length, finished, stream, ready};
+    aggregator_->submit(part, rows);
+  }
+
+  StepAggregatorStats stats() { return aggregator_->stats(); }
+
+  ~LogitsAggregator()
+  {
+    delete aggregator_;
+    cudaStreamSynchronize(stream_);
+    cudaEventDestroy(done_event_);
+    cublasDestroy(cublas_handle_);
+    cudaStreamDestroy(stream_);
+    allocator_.free(buf_);
+  }
+};
+
+} // namespace fastertransformer
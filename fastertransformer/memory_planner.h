@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Device memory capacity planner
+ *
+ * The plan functions return the device memory of a model at a (batch_size,
+ * seq_len) as named components:
+ *  - WEIGHT and INPUT_OUTPUT are allocated by the caller, in the layout of
+ *    the samples;
+ *  - WORKSPACE is allocated by the class through its IAllocator, the sum is
+ *    the exact size of its malloc calls;
+ *  - TRANSIENT is freed before the next allocation, e.g. the buffer of the
+ *    gemm test of the encoder.
+ * The arithmetic follows BertEncoderTransformer::calBufSizeInByte,
+ * OpenMultiHeadAttention::allocateBuffer, calGemmTestBufSizeInByte and the
+ * constructors of DecodingBeamsearch and DecodingSampling. The sizes that the
+ * constructors query from the top-k / top-p launchers are computed from the
+ * same formulas, the constants below mirror topk_kernels.cuh and the
+ * segmented radix sort of CUB. sample/cpp/memory_plan_sample compares the
+ * plans with the real allocations.
+ *
+ * The solvers search the largest batch sizes and sequence lengths whose peak
+ * memory fits a budget. The budget should leave room for the CUDA context and
+ * the cuBLAS workspace, which are not planned. Everything here runs on the
+ * host and does not depend on CUDA.
+ **/
+
+#pragma once
+#include "fastertransformer/workspace_planner.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+/* mirror topk_kernels.cuh and topK_kernelLauncher */
+static const int PLAN_SMALL_TOP_K_SOFTMAX_MAX_VOC_PARTS = 128;
+static const int PLAN_MAX_K = 4;
+static const int PLAN_BEAM_TOPK_MAX_BLOCK_PER_BEAM = 8;
+static const int PLAN_TOPK_SAMPLING_MAX_BLOCKS_PER_ROW = 8;
+static const int PLAN_TOPK_SAMPLING_MIN_ELEMENTS_PER_BLOCK = 4096;
+/* alignment of the temporaries of CUB (AliasTemporaries) */
+static const size_t PLAN_CUB_ALIGN_BYTES = 256;
+
+/* The stages of OpenDecoder::forward and forward_context, they are the live ranges of the
+   workspace buffers. */
+enum DecoderStage
+{
+  SELF_NORM_STAGE = 0,
+  SELF_ATTENTION_STAGE,
+  CROSS_NORM_STAGE,
+  CROSS_ATTENTION_STAGE,
+  FFN_NORM_STAGE,
+  FFN_STAGE,
+  RESIDUAL_STAGE
+};
+
+/* Register the buffers of OpenDecoder in the order of OpenDecoder::DecoderBuffer and plan them.
+   The residual of the FFN is masked_output_buf_ without cross attention and cross_output_buf_
+   with it, and norm_masked_output_buf_ is the FFN input without cross attention, so both are
+   kept until the FFN is done. The pointer arrays of the fused QKV GEMM are written by
+   initialize and live for the whole layer. The buffers of the batched attention of
+   forward_context are only reserved with context_query_len > 0, the batch is made of
+   sentences of context_query_len rows that attend to at most context_kv_len keys. */
+inline void plan_decoder_workspace(WorkspacePlanner &planner, const size_t data_size, const int batch_size,
+                                   const int hidden_units, const int moe_expert_num = 0, const int moe_k = 1,
+                                   const int moe_capacity = 0, const int head_num = 1,
+                                   const int context_query_len = 0, const int context_kv_len = 0)
+{
+  const int buf_size = batch_size * hidden_units;
+  const int rows = moe_expert_num * moe_capacity;
+  const int routed = moe_expert_num > 0 ? batch_size * moe_k : 0;
+  const size_t sentences = context_query_len > 0 ? batch_size / context_query_len : 0;
+  const size_t kv_size = sentences * context_kv_len * hidden_units;
+  const size_t qk_size = context_query_len > 0 ? (size_t)batch_size * head_num * context_kv_len : 0;
+  planner.add("norm_from_tensor", data_size * buf_size, SELF_NORM_STAGE, SELF_ATTENTION_STAGE);
+  planner.add("query", data_size * buf_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("key", data_size * buf_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("value", data_size * buf_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("context", data_size * buf_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("masked_output", data_size * buf_size, SELF_ATTENTION_STAGE, RESIDUAL_STAGE);
+  planner.add("norm_masked_output", data_size * buf_size, CROSS_NORM_STAGE, FFN_STAGE);
+  planner.add("cross_output", data_size * buf_size, CROSS_ATTENTION_STAGE, RESIDUAL_STAGE);
+  planner.add("norm_cross_output", data_size * buf_size, FFN_NORM_STAGE, FFN_STAGE);
+  planner.add("ffn_inner", data_size * (moe_expert_num > 0 ? 0 : 4 * buf_size), FFN_STAGE, FFN_STAGE);
+  planner.add<void *>("qkv_pointer", 9, SELF_NORM_STAGE, RESIDUAL_STAGE);
+  planner.add("moe_gating", data_size * (batch_size * moe_expert_num), FFN_STAGE, FFN_STAGE);
+  planner.add("moe_permuted_input", data_size * (rows * hidden_units), FFN_STAGE, FFN_STAGE);
+  planner.add("moe_permuted_output", data_size * (rows * hidden_units), FFN_STAGE, FFN_STAGE);
+  planner.add("moe_inner", data_size * (rows * 4 * hidden_units), FFN_STAGE, FFN_STAGE);
+  planner.add<float>("moe_gate_weights", routed, FFN_STAGE, FFN_STAGE);
+  planner.add<int>("moe_expert_ids", routed, FFN_STAGE, FFN_STAGE);
+  planner.add<int>("moe_expanded_slots", routed, FFN_STAGE, FFN_STAGE);
+  planner.add<int>("moe_expert_counts", moe_expert_num, FFN_STAGE, FFN_STAGE);
+  planner.add("attention_query", data_size * (context_query_len > 0 ? buf_size : 0), SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("attention_key", data_size * kv_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("attention_value", data_size * kv_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.add("attention_qk", data_size * qk_size, SELF_ATTENTION_STAGE, CROSS_ATTENTION_STAGE);
+  planner.plan();
+  if (!planner.validate())
+  {
+    printf("[ERROR] OpenDecoder workspace plan is invalid. \n");
+    exit(-1);
+  }
+}
+
+/* OpenDecoder::getWorkspaceSize in bytes, it is rounded up to whole elements */
+inline size_t decoder_workspace_bytes(const size_t data_size, const int batch_size, const int hidden_units,
+                                      const int head_num = 1, const int context_query_len = 0,
+                                      const int context_kv_len = 0)
+{
+  WorkspacePlanner planner;
+  plan_decoder_workspace(planner, data_size, batch_size, hidden_units, 0, 1, 0,
+                         head_num, context_query_len, context_kv_len);
+  return (planner.total_bytes() + data_size - 1) / data_size * data_size;
+}
+
+/* The stages of BertEncoderTransformer::forward without int8 */
+enum EncoderStage
+{
+  ENCODER_ATTENTION_STAGE = 0,
+  ENCODER_ATTENTION_OUTPUT_STAGE,
+  ENCODER_FFN_STAGE
+};
+
+/* Register the buffers of BertEncoderTransformer without int8 in the order of
+   BertEncoderTransformer::EncoderBuffer and plan them. attr_out is read by the output GEMM of
+   the attention before the FFN starts, so it shares memory with the FFN inner buffer, attr_matmul
+   is the residual of the FFN. m is the number of rows, n the hidden units. */
+inline void plan_encoder_workspace(WorkspacePlanner &planner, const size_t data_size, const size_t m, const size_t n)
+{
+  planner.add("attr_out", data_size * m * n, ENCODER_ATTENTION_STAGE, ENCODER_ATTENTION_OUTPUT_STAGE);
+  planner.add("attr_matmul", data_size * m * n, ENCODER_ATTENTION_OUTPUT_STAGE, ENCODER_FFN_STAGE);
+  planner.add("inter_matmul", data_size * 4 * m * n, ENCODER_FFN_STAGE, ENCODER_FFN_STAGE);
+  planner.plan();
+  if (!planner.validate())
+  {
+    printf("[ERROR] BertEncoderTransformer workspace plan is invalid. \n");
+    exit(-1);
+  }
+}
+
+enum class MemoryKind
+{
+  WEIGHT,
+  INPUT_OUTPUT,
+  WORKSPACE,
+  TRANSIENT
+};
+
+struct MemoryComponent
+{
+  std::string name;
+  MemoryKind kind;
+  size_t bytes;
+};
+
+class MemoryPlan
+{
+private:
+  std::vector<MemoryComponent> components_;
+  bool int_overflow_;
+
+public:
+  MemoryPlan() : int_overflow_(false) {}
+
+  void add(const std::string &name, const MemoryKind kind, const size_t bytes)
+  {
+    MemoryComponent component = {name, kind, bytes};
+    components_.push_back(component);
+  }
+
+  /* num is computed in int by the class, a larger one overflows */
+  void check_int(const size_t num)
+  {
+    if (num > (size_t)INT_MAX)
+      int_overflow_ = true;
+  }
+
+  size_t bytes(const MemoryKind kind) const
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < components_.size(); i++)
+      if (components_[i].kind == kind)
+        bytes += components_[i].bytes;
+    return bytes;
+  }
+
+  /* the bytes of the component, 0 if it is not in the plan */
+  size_t bytes(const std::string &name) const
+  {
+    for (size_t i = 0; i < components_.size(); i++)
+      if (components_[i].name == name)
+        return components_[i].bytes;
+    return 0;
+  }
+
+  /* everything but the transient buffers, plus the largest transient one */
+  size_t peak_bytes() const
+  {
+    size_t resident = 0;
+    size_t transient = 0;
+    for (size_t i = 0; i < components_.size(); i++)
+    {
+      if (components_[i].kind == MemoryKind::TRANSIENT)
+        transient = std::max(transient, components_[i].bytes);
+      else
+        resident += components_[i].bytes;
+    }
+    return resident + transient;
+  }
+
+  /* true if an int size of the class overflows, such a configuration cannot run */
+  bool int_overflow() const { return int_overflow_; }
+
+  bool fits(const size_t budget) const { return !int_overflow_ && peak_bytes() <= budget; }
+
+  const std::vector<MemoryComponent> &components() const { return components_; }
+
+  void print() const
+  {
+    static const char *kind_names[] = {"weight", "input/output", "workspace", "transient"};
+    for (size_t i = 0; i < components_.size(); i++)
+      printf("[INFO] memory %-28s %-12s %14zu bytes \n", components_[i].name.c_str(),
+             kind_names[(int)components_[i].kind], components_[i].bytes);
+    printf("[INFO] memory weight %zu, input/output %zu, workspace %zu, transient %zu, peak %zu bytes%s \n",
+           bytes(MemoryKind::WEIGHT), bytes(MemoryKind::INPUT_OUTPUT), bytes(MemoryKind::WORKSPACE),
+           bytes(MemoryKind::TRANSIENT), peak_bytes(), int_overflow_ ? " (int overflow)" : "");
+  }
+};
+
+struct MemoryPlanConfig
+{
+  int head_num;
+  int size_per_head;
+  int layer_num;
+  int is_fp16;
+  int int8_mode;             // encoder, 0, 1 or 2. The weights are counted in the data type.
+  bool allow_gemm_test;      // encoder, counts the gemm test buffer
+  int vocab_size;            // decoding
+  int memory_hidden_units;   // decoding
+  int memory_max_seq_len;    // decoding, 0 uses the seq_len of the plan
+  int beam_width;            // beam search
+  int candidate_num;         // sampling, 0 for top p sampling
+  int max_draft_len;         // sampling, speculative greedy decoding
+
+  MemoryPlanConfig() : head_num(0), size_per_head(0), layer_num(0), is_fp16(0), int8_mode(0), allow_gemm_test(false),
+                       vocab_size(0), memory_hidden_units(0), memory_max_seq_len(0), beam_width(1), candidate_num(1),
+                       max_draft_len(0) {}
+
+  size_t data_size() const { return is_fp16 ? 2 : 4; }
+  int hidden_units() const { return head_num * size_per_head; }
+};
+
+/* round up num to a multiple of align, like (int)(ceil(num / 4.)) * 4 in the classes */
+inline size_t plan_round_up(const size_t num, const size_t align)
+{
+  return (num + align - 1) / align * align;
+}
+
+/* temp_storage_bytes of cub::DeviceSegmentedRadixSort::SortPairsDescending with the alternate
+   key and value buffers */
+inline size_t plan_cub_segmented_sort_bytes(const size_t num_items, const size_t key_size, const size_t value_size)
+{
+  const size_t bytes = plan_round_up(num_items * key_size, PLAN_CUB_ALIGN_BYTES) +
+                       plan_round_up(num_items * value_size, PLAN_CUB_ALIGN_BYTES) + PLAN_CUB_ALIGN_BYTES - 1;
+  return bytes == 0 ? 1 : bytes;
+}
+
+/* a [batch_size, seq_len] input and output of BertEncoderTransformer, the weights of layer_num
+   layers, its buffer and the buffer of OpenMultiHeadAttention */
+inline MemoryPlan plan_encoder_memory(const MemoryPlanConfig &config, const int batch_size, const int seq_len)
+{
+  MemoryPlan plan;
+  const size_t ts = config.data_size();
+  const size_t m = (size_t)batch_size * seq_len;
+  const size_t n = config.hidden_units();
+  const size_t k = n;
+  const size_t buf = m * n;  // = batch_size * head_num * seq_len * size_per_head
+  const size_t qk = (size_t)batch_size * config.head_num * seq_len * seq_len;
+
+  plan.add("encoder_weights", MemoryKind::WEIGHT, ts * config.layer_num * (12 * n * n + 13 * n));
+  plan.add("from_tensor", MemoryKind::INPUT_OUTPUT, ts * buf);
+  plan.add("attr_mask", MemoryKind::INPUT_OUTPUT, ts * batch_size * seq_len * seq_len);
+  plan.add("transformer_out", MemoryKind::INPUT_OUTPUT, ts * buf);
+
+  plan.check_int(buf);
+  plan.check_int(qk);
+  if (config.int8_mode != 0)
+  {
+    plan.add("transA_from_tensor", MemoryKind::WORKSPACE, ts * m * k);
+    plan.add("int8_from_tensor", MemoryKind::WORKSPACE, m * k);
+    plan.add("int8_qkv_weight", MemoryKind::WORKSPACE, 3 * n * k);
+    plan.add("int_buf", MemoryKind::WORKSPACE, sizeof(int) * 4 * m * k);
+    plan.add("attr_out_matmul_inter", MemoryKind::WORKSPACE, ts * 6 * m * n);
+    plan.add("encoder_tmp", MemoryKind::WORKSPACE, ts * m * n);
+    // calBufSizeInByte returns int
+    plan.check_int(ts * m * k + m * k + 3 * n * k + sizeof(int) * 4 * m * k + ts * 7 * m * n);
+
+    plan.add("attn_int_buf", MemoryKind::WORKSPACE, sizeof(int) * (4 * buf + qk));
+    plan.add("attn_qkv_qk_buf", MemoryKind::WORKSPACE, ts * (3 * buf + qk));
+    plan.add("attn_qkv_pointer", MemoryKind::WORKSPACE, sizeof(void *) * 9);
+    plan.add("attn_sequence_id_map", MemoryKind::WORKSPACE, sizeof(int) * m);
+  }
+  else
+  {
+    WorkspacePlanner planner;
+    plan_encoder_workspace(planner, ts, m, n);
+    plan.add("encoder_workspace", MemoryKind::WORKSPACE, planner.total_bytes());
+    plan.check_int(planner.total_bytes());
+
+    plan.add("attn_query_key_value", MemoryKind::WORKSPACE, ts * 3 * buf);
+    plan.add("attn_q_k_v", MemoryKind::WORKSPACE, ts * 3 * buf);
+    plan.add("attn_qk", MemoryKind::WORKSPACE, ts * qk);
+    plan.add("attn_transpose_dst", MemoryKind::WORKSPACE, ts * buf);
+    plan.add("attn_qkv_pointer", MemoryKind::WORKSPACE, sizeof(void *) * 9);
+    // FusedMHARunnerFP16v2::getWorkspaceSize() is 0, the fused kernels only use the buffers above
+  }
+
+  if (config.allow_gemm_test)
+  {
+    const size_t b = batch_size, h = config.head_num, s = seq_len, d = config.size_per_head;
+    size_t bytes;
+    if (config.int8_mode != 0)
+    {
+      const size_t size1 = 3 * (m * k + k * n + m * n * sizeof(int));
+      const size_t size2 = b * h * (s * d + d * s + s * s * sizeof(int));
+      const size_t size3 = b * h * (s * s + s * d + s * d * sizeof(int));
+      const size_t size4 = m * k + k * 4 * n + 4 * m * n * sizeof(int);
+      bytes = std::max(std::max(size1, size2), std::max(size3, size4));
+    }
+    else
+    {
+      const size_t size1 = 3 * (m * k + k * n + m * n) * ts;
+      const size_t size2 = b * h * (s * s + s * d + s * d) * ts;
+      const size_t size3 = (m * k + k * 4 * n + m * 4 * n) * ts;
+      bytes = std::max(std::max(size1, size2), size3);
+    }
+    plan.add("gemm_test_buffer", MemoryKind::TRANSIENT, bytes);
+  }
+  return plan;
+}
+
+/* DecodingSampling and DecodingBeamsearch pad the vocab to a multiple of 8 */
+inline size_t plan_vocab_size_padded(const MemoryPlanConfig &config)
+{
+  return plan_round_up(config.vocab_size, 8);
+}
+
+/* the padded copies of the embedding kernel and bias, only when the vocab is not a multiple of 8 */
+inline void plan_embedding_padded(MemoryPlan &plan, const MemoryPlanConfig &config, const size_t embedding_bias_size)
+{
+  const size_t vocab_padded = plan_vocab_size_padded(config);
+  if (vocab_padded == (size_t)config.vocab_size)
+    return;
+  plan.add("embedding_kernel_padded", MemoryKind::WORKSPACE,
+           config.data_size() * plan_round_up(config.hidden_units() * vocab_padded, 4));
+  plan.add("embedding_bias_padded", MemoryKind::WORKSPACE, embedding_bias_size * plan_round_up(vocab_padded, 4));
+}
+
+/* the weights of the decoder layers and of the embedding, the memory tensor */
+inline void plan_decoding_weights(MemoryPlan &plan, const MemoryPlanConfig &config, const size_t rows,
+                                  const int seq_len, const int memory_max_seq_len, const size_t embedding_bias_size)
+{
+  const size_t ts = config.data_size();
+  const size_t h = config.hidden_units();
+  const size_t mh = config.memory_hidden_units;
+  // self attention 4 h * h, cross attention 2 h * h + 2 mh * h, FFN 8 h * h, 19 h of biases and layernorms
+  plan.add("decoder_weights", MemoryKind::WEIGHT, ts * config.layer_num * (14 * h * h + 2 * mh * h + 19 * h));
+  plan.add("embedding_table", MemoryKind::WEIGHT, ts * config.vocab_size * h);
+  plan.add("embedding_kernel", MemoryKind::WEIGHT, ts * config.vocab_size * h);
+  plan.add("embedding_bias", MemoryKind::WEIGHT, embedding_bias_size * config.vocab_size);
+  plan.add("position_encoding_table", MemoryKind::WEIGHT, ts * seq_len * h);
+  plan.add("decoding_layernorm", MemoryKind::WEIGHT, ts * 2 * h);
+  plan.add("memory_tensor", MemoryKind::INPUT_OUTPUT, ts * rows * memory_max_seq_len * mh);
+  plan.add("memory_sequence_length", MemoryKind::INPUT_OUTPUT, sizeof(int) * rows);
+}
+
+/* DecodingBeamsearch of batch_size * beam_width sentences of at most seq_len tokens */
+inline MemoryPlan plan_decoding_beamsearch_memory(const MemoryPlanConfig &config, const int batch_size, const int seq_len)
+{
+  MemoryPlan plan;
+  const size_t ts = config.data_size();
+  const size_t h = config.hidden_units();
+  const size_t beam = config.beam_width;
+  const size_t bb = (size_t)batch_size * beam;
+  const size_t mem_seq = config.memory_max_seq_len > 0 ? config.memory_max_seq_len : seq_len;
+  const size_t layers = config.layer_num;
+  const size_t vocab = plan_vocab_size_padded(config);
+
+  plan_decoding_weights(plan, config, bb, seq_len, (int)mem_seq, sizeof(float));
+  plan.add("output_ids", MemoryKind::INPUT_OUTPUT, sizeof(int) * seq_len * bb);
+  plan.add("parent_ids", MemoryKind::INPUT_OUTPUT, sizeof(int) * seq_len * bb);
+  plan.add("sequence_length", MemoryKind::INPUT_OUTPUT, sizeof(int) * bb);
+
+  const size_t from_tensor = bb * h;
+  const size_t decoder_workspace = decoder_workspace_bytes(ts, (int)bb, (int)h);
+  const size_t cache = bb * seq_len * h;
+  const size_t mem_cache = bb * mem_seq * h;
+  plan.add("from_tensor", MemoryKind::WORKSPACE, ts * 2 * from_tensor);
+  plan.add("decoder_workspace", MemoryKind::WORKSPACE, decoder_workspace);
+  plan.add("mem_cache", MemoryKind::WORKSPACE, ts * layers * 2 * mem_cache);
+  plan.add("cache", MemoryKind::WORKSPACE, ts * layers * 4 * cache);
+  plan.add("decoder_normed_result", MemoryKind::WORKSPACE, ts * from_tensor);
+  plan_embedding_padded(plan, config, sizeof(float));
+  plan.check_int(from_tensor * 2 + decoder_workspace / ts + (cache * 4 + mem_cache * 2) * layers + from_tensor);
+
+  plan.add("logits", MemoryKind::WORKSPACE, sizeof(float) * plan_round_up(bb * vocab, 4));
+  plan.add("cum_log_probs", MemoryKind::WORKSPACE, sizeof(float) * 2 * plan_round_up(bb, 4));
+  plan.add("step_log_probs", MemoryKind::WORKSPACE, sizeof(float) * plan_round_up(seq_len * bb, 4));
+  plan.add("word_ids", MemoryKind::WORKSPACE, sizeof(int) * plan_round_up(bb, 4));
+  plan.add("finished", MemoryKind::WORKSPACE, sizeof(bool) * plan_round_up(bb, 32));
+  const size_t storage_per_beam = 2 * beam + PLAN_SMALL_TOP_K_SOFTMAX_MAX_VOC_PARTS * (2 * PLAN_MAX_K + 2);
+  plan.add("topk_softmax_storage", MemoryKind::WORKSPACE, sizeof(float) * plan_round_up(bb * storage_per_beam, 4));
+  plan.add("finished_count", MemoryKind::WORKSPACE, sizeof(int) * 32);
+  const size_t topk_tmp = plan_round_up(bb * beam * PLAN_BEAM_TOPK_MAX_BLOCK_PER_BEAM, 4);
+  plan.add("topk_workspace", MemoryKind::WORKSPACE,
+           sizeof(float) * plan_round_up(bb * vocab, 4) + sizeof(int) * topk_tmp + sizeof(float) * topk_tmp);
+  plan.check_int(bb * vocab);
+  plan.check_int(seq_len * bb);
+  return plan;
+}
+
+/* DecodingSampling of batch_size sentences of at most seq_len tokens */
+inline MemoryPlan plan_decoding_sampling_memory(const MemoryPlanConfig &config, const int batch_size, const int seq_len)
+{
+  MemoryPlan plan;
+  const size_t ts = config.data_size();
+  const size_t h = config.hidden_units();
+  const size_t b = batch_size;
+  const size_t rows = b * (config.max_draft_len + 1);
+  const size_t mem_seq = config.memory_max_seq_len > 0 ? config.memory_max_seq_len : seq_len;
+  const size_t layers = config.layer_num;
+  const size_t vocab = plan_vocab_size_padded(config);
+
+  plan_decoding_weights(plan, config, b, seq_len, (int)mem_seq, ts);
+  plan.add("output_ids", MemoryKind::INPUT_OUTPUT, sizeof(int) * seq_len * b);
+  plan.add("sequence_length", MemoryKind::INPUT_OUTPUT, sizeof(int) * b);
+
+  const size_t from_tensor = rows * h;
+  size_t decoder_workspace = decoder_workspace_bytes(ts, (int)b, (int)h);
+  if (config.max_draft_len > 0)
+    decoder_workspace = std::max(decoder_workspace,
+                                 decoder_workspace_bytes(ts, (int)rows, (int)h, config.head_num,
+                                                         config.max_draft_len + 1,
+                                                         std::max((int)mem_seq, config.max_draft_len + 1)));
+  const size_t cache = b * seq_len * h;
+  const size_t mem_cache = b * mem_seq * h;
+  plan.add("from_tensor", MemoryKind::WORKSPACE, ts * 2 * from_tensor);
+  plan.add("decoder_workspace", MemoryKind::WORKSPACE, decoder_workspace);
+  plan.add("mem_cache", MemoryKind::WORKSPACE, ts * layers * 2 * mem_cache);
+  plan.add("cache", MemoryKind::WORKSPACE, ts * layers * 2 * cache);
+  plan.add("decoder_normed_result", MemoryKind::WORKSPACE, ts * from_tensor);
+  plan.add("logits", MemoryKind::WORKSPACE, ts * plan_round_up(rows * vocab, 4));
+  plan_embedding_padded(plan, config, ts);
+  plan.check_int(from_tensor * 2 + decoder_workspace / ts + (cache * 2 + mem_cache * 2) * layers + from_tensor);
+
+  plan.add("word_ids", MemoryKind::WORKSPACE, sizeof(int) * plan_round_up(b, 4));
+  plan.add("finished", MemoryKind::WORKSPACE, sizeof(bool) * plan_round_up(b, 32));
+  plan.add("finished_count", MemoryKind::WORKSPACE, sizeof(int) * 32);
+  plan.add("topp_id_vals", MemoryKind::WORKSPACE, sizeof(int) * plan_round_up(b * vocab, 4));
+  plan.add("topp_offset", MemoryKind::WORKSPACE, sizeof(int) * plan_round_up(b + 1, 4));
+  plan.add("verify_ids", MemoryKind::WORKSPACE, sizeof(int) * plan_round_up(config.max_draft_len > 0 ? rows * 3 : 0, 4));
+  plan.check_int(rows * vocab);
+
+  // the constructor always queries the top p workspace, the top k one only with candidate_num > 0
+  const size_t sort_items = b * vocab;
+  plan.add("topp_workspace", MemoryKind::WORKSPACE,
+           ts * plan_round_up(sort_items, 4) + sizeof(int) * plan_round_up(sort_items, 4) +
+               plan_round_up(plan_cub_segmented_sort_bytes(sort_items, ts, sizeof(int)), 4));
+  const size_t k = config.candidate_num;
+  size_t topk_workspace = 0;
+  if (k == 1 || k == 2 || k == 4 || k == 8 || k == 16)
+    topk_workspace = sizeof(int) * 2 * plan_round_up(b * k, 4);
+  else if (k > 0)
+  {
+    const int blocks = std::min(std::max((int)vocab / PLAN_TOPK_SAMPLING_MIN_ELEMENTS_PER_BLOCK, 1),
+                                PLAN_TOPK_SAMPLING_MAX_BLOCKS_PER_ROW);
+    topk_workspace = (sizeof(unsigned int) + sizeof(int)) * plan_round_up(b * blocks * k, 4);
+  }
+  plan.add("topk_workspace", MemoryKind::WORKSPACE, topk_workspace);
+  return plan;
+}
+
+typedef MemoryPlan (*MemoryPlanFunction)(const MemoryPlanConfig &config, const int batch_size, const int seq_len);
+
+/* the largest batch size in [0, max_batch_size] whose plan at seq_len fits the budget */
+inline int solve_max_batch_size(MemoryPlanFunction plan, const MemoryPlanConfig &config, const int seq_len,
+                                const size_t budget, const int max_batch_size = 65536)
+{
+  // the memory grows with the batch size, so the feasible ones are [0, answer]
+  int lo = 0;
+  int hi = max_batch_size;
+  while (lo < hi)
+  {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (plan(config, mid, seq_len).fits(budget))
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* the largest multiple of seq_step in [0, max_seq_len] whose plan at batch_size fits the budget */
+inline int solve_max_seq_len(MemoryPlanFunction plan, const MemoryPlanConfig &config, const int batch_size,
+                             const size_t budget, const int max_seq_len, const int seq_step = 1)
+{
+  int lo = 0;
+  int hi = max_seq_len / seq_step;
+  while (lo < hi)
+  {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (plan(config, batch_size, mid * seq_step).fits(budget))
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo * seq_step;
+}
+
+struct MemoryFrontierPoint
+{
+  int batch_size;
+  int seq_len;
+  size_t peak_bytes;
+};
+
+/* The maximal (batch_size, seq_len) configurations under the budget, by increasing seq_len. For
+   seq_len = seq_step, 2 * seq_step, ..., max_seq_len the largest batch size that fits is taken,
+   and a point is dropped if a longer seq_len fits the same batch size. */
+inline std::vector<MemoryFrontierPoint> solve_memory_frontier(MemoryPlanFunction plan, const MemoryPlanConfig &config,
+                                                              const size_t budget, const int max_seq_len,
+                                                              const int seq_step = 1, const int max_batch_size = 65536)
+{
+  std::vector<MemoryFrontierPoint> points;
+  for (int seq_len = seq_step; seq_len <= max_seq_len; seq_len += seq_step)
+  {
+    const int batch_size = solve_max_batch_size(plan, config, seq_len, budget, max_batch_size);
+    if (batch_size == 0)
+      break;
+    if (!points.empty() && points.back().batch_size == batch_size)
+      points.pop_back();
+    MemoryFrontierPoint point = {batch_size, seq_len, plan(config, batch_size, seq_len).peak_bytes()};
+    points.push_back(point);
+  }
+  return points;
+}
+
+} // namespace fastertransformer
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * N-gram drafting of the speculative greedy decoding
+ *
+ * The drafts are looked up in the prompt and in the tokens generated so far:
+ * the latest earlier occurrence of the last n tokens (n from max_n down to
+ * min_n) proposes the tokens that followed it. The decoder verifies the draft
+ * in one multi-token pass, and accept_draft() keeps the longest prefix that
+ * matches its greedy tokens plus the token after it, so the output is the one
+ * of step by step greedy decoding. Everything here runs on the host and does
+ * not depend on CUDA.
+ **/
+
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+class NGramIndex
+{
+private:
+  int min_n_;
+  int max_n_;
+  std::vector<int> tokens_;
+  /* tables_[n - min_n] maps the hash of an n-gram to the position of the token that
+     followed its latest occurrence */
+  std::vector<std::unordered_map<unsigned long long, int>> tables_;
+
+  static unsigned long long hash(const int *tokens, const int n)
+  {
+    unsigned long long h = 1469598103934665603ULL;
+    for (int i = 0; i < n; i++)
+    {
+      h ^= (unsigned long long)(unsigned int)tokens[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  bool same_ngram(const int a, const int b, const int n) const
+  {
+    for (int i = 0; i < n; i++)
+      if (tokens_[a + i] != tokens_[b + i])
+        return false;
+    return true;
+  }
+
+public:
+  NGramIndex(const int min_n = 1, const int max_n = 3) : min_n_(min_n), max_n_(max_n)
+  {
+    if (min_n < 1 || max_n < min_n)
+    {
+      printf("[ERROR][NGramIndex] invalid n-gram range [%d, %d]. \n", min_n, max_n);
+      exit(-1);
+    }
+    tables_.resize(max_n - min_n + 1);
+  }
+
+  void clear()
+  {
+    tokens_.clear();
+    for (size_t i = 0; i < tables_.size(); i++)
+      tables_[i].clear();
+  }
+
+  /* Append a token. Now that its successor is known, the n-grams ending just before it
+     are registered, a later occurrence replaces an earlier one. */
+  void append(const int token)
+  {
+    const int pos = (int)tokens_.size();
+    tokens_.push_back(token);
+    for (int n = min_n_; n <= max_n_ && n <= pos; n++)
+      tables_[n - min_n_][hash(&tokens_[pos - n], n)] = pos;
+  }
+
+  void append(const int *tokens, const int num)
+  {
+    for (int i = 0; i < num; i++)
+      append(tokens[i]);
+  }
+
+  /* Write at most max_draft_len tokens that followed the latest earlier occurrence of the
+     longest matching suffix to draft, return the draft length. */
+  int propose(const int max_draft_len, int *draft) const
+  {
+    const int len = (int)tokens_.size();
+    for (int n = max_n_; n >= min_n_; n--)
+    {
+      if (n > len)
+        continue;
+      const std::unordered_map<unsigned long long, int> &table = tables_[n - min_n_];
+      std::unordered_map<unsigned long long, int>::const_iterator it = table.find(hash(&tokens_[len - n], n));
+      if (it == table.end() || !same_ngram(it->second - n, len - n, n))
+        continue;
+      int draft_len = 0;
+      for (int pos = it->second; pos < len && draft_len < max_draft_len; pos++)
+        draft[draft_len++] = tokens_[pos];
+      if (draft_len > 0)
+        return draft_len;
+    }
+    return 0;
+  }
+
+  int size() const { return (int)tokens_.size(); }
+};
+
+/**
+ * The decoder was fed the last token followed by draft[0, draft_len). verified[j] is its
+ * greedy token after input j, so verified[j] is the true next token if draft[0, j) is
+ * accepted. The matched prefix of the draft and the first verified token after it are
+ * written to accepted, at most max_new_tokens and up to the first end_id. Return the
+ * number of accepted tokens (at least 1 if max_new_tokens > 0).
+ **/
+inline int accept_draft(const int *draft, const int draft_len, const int *verified,
+                        const int end_id, const int max_new_tokens, int *accepted)
+{
+  int num = 0;
+  for (int j = 0; j <= draft_len && num < max_new_tokens; j++)
+  {
+    accepted[num++] = verified[j];
+    if (verified[j] == end_id || j == draft_len || draft[j] != verified[j])
+      break;
+  }
+  return num;
+}
+
+struct SpeculativeStats
+{
+  long long passes = 0;           // multi-token decoder passes
+  long long drafted_tokens = 0;
+  long long accepted_tokens = 0;  // drafted tokens accepted by the verification
+  long long generated_tokens = 0;
+};
+
+/* One NGramIndex per sentence of the batch. */
+class NGramDrafter
+{
+private:
+  std::vector<NGramIndex> indexes_;
+  int max_draft_len_;
+  SpeculativeStats stats_;
+
+public:
+  NGramDrafter(const int batch_size, const int max_draft_len, const int min_n = 1, const int max_n = 3)
+      : indexes_(batch_size, NGramIndex(min_n, max_n)), max_draft_len_(max_draft_len)
+  {
+    if (max_draft_len < 0)
+    {
+      printf("[ERROR][NGramDrafter] max_draft_len %d should not be negative. \n", max_draft_len);
+      exit(-1);
+    }
+  }
+
+  /* prompt_ids is [batch_size, prompt_max_len], it can be nullptr */
+  void reset(const int *prompt_ids, const int *prompt_length, const int prompt_max_len)
+  {
+    stats_ = SpeculativeStats();
+    for (int b = 0; b < (int)indexes_.size(); b++)
+    {
+      indexes_[b].clear();
+      if (prompt_ids != nullptr)
+        indexes_[b].append(prompt_ids + b * prompt_max_len, prompt_length != nullptr ? prompt_length[b] : prompt_max_len);
+    }
+  }
+
+  /* the draft of sentence b, at most limit tokens */
+  int propose(const int b, const int limit, int *draft)
+  {
+    const int draft_len = indexes_[b].propose(limit < max_draft_len_ ? limit : max_draft_len_, draft);
+    stats_.drafted_tokens += draft_len;
+    return draft_len;
+  }
+
+  /* verify the draft of sentence b and append the accepted tokens to its index */
+  int accept(const int b, const int *draft, const int draft_len, const int *verified,
+             const int end_id, const int max_new_tokens, int *accepted)
+  {
+    const int num = accept_draft(draft, draft_len, verified, end_id, max_new_tokens, accepted);
+    indexes_[b].append(accepted, num);
+    int matched = 0;
+    while (matched < num && matched < draft_len && accepted[matched] == draft[matched])
+      matched++;
+    stats_.accepted_tokens += matched;
+    stats_.generated_tokens += num;
+    return num;
+  }
+
+  void count_pass() { stats_.passes++; }
+  int max_draft_len() const { return max_draft_len_; }
+  const SpeculativeStats &stats() const { return stats_; }
+};
+
+} // namespace fastertransformer
@@ -21,6 +21,9 @@
 #include "fastertransformer/allocator.h"
 #include "fastertransformer/common.h"
 #include "fastertransformer/common_structure.h"
+#include "fastertransformer/cuda/moe_kernels.h"
+#include "fastertransformer/workspace_planner.h"
+#include "fastertransformer/memory_planner.h"
 #include <assert.h>
 #include <cuda_runtime.h>
 #include <cuda_fp16.h>
@@ -44,6 +47,8 @@ namespace fastertransformer
 
         LayerNormWeight<T> ffn_layernorm;
         FFNWeight<T> ffn;
+        /* only used when the decoder is built with moe_expert_num > 0 */
+        MoEFFNWeight<T> moe_ffn;
         cublasHandle_t cublas_handle;
         cudaStream_t stream;
     };
@@ -61,6 +66,15 @@ namespace fastertransformer
     {
     };
 
+    /* Attention of one target position with the memory. Each (batch, head) only reads the
+       first length[batch] positions of the key and value caches, seq_len is the max memory
+       length. At step 1 the bias of K and V is added to the caches in place. */
+    template <typename T>
+    void cross_attention_dispatch(T *query_buf, const T *Q_bias,
+                                  T *key_cache, const T *K_bias, T *value_cache, const T *V_bias, const int *length,
+                                  T *context_buf, int batch_size, int head_num, int size_per_head, int step, int seq_len,
+                                  cudaStream_t stream);
+
     template <OperationType OpType_>
     class OpenDecoder
     {
@@ -94,13 +108,75 @@ namespace fastertransformer
 
         bool is_fuse_QKV;
 
+        /* mixture-of-experts FFN, disabled when moe_expert_num_ == 0 */
+        int moe_expert_num_;
+        int moe_k_;
+        int moe_capacity_;
+        DataType_ *moe_gating_buf_, *moe_permuted_input_buf_;
+        DataType_ *moe_inner_buf_, *moe_permuted_output_buf_;
+        float *moe_gate_weights_;
+        int *moe_expert_ids_, *moe_expanded_slots_, *moe_expert_counts_;
+
+        /* batched attention of forward_context and forward_multi_token, disabled when
+           context_query_len_ == 0. Q, K and V + bias are transposed to [sentences, head_num,
+           len, size_per_head] and the scores are [sentences, head_num, query_len, kv_len]. */
+        int context_query_len_;
+        DataType_ *attention_q_buf_, *attention_k_buf_, *attention_v_buf_, *attention_qk_buf_;
+
+        enum DecoderBuffer
+        {
+            NORM_FROM_TENSOR_BUF = 0,
+            QUERY_BUF,
+            KEY_BUF,
+            VALUE_BUF,
+            CONTEXT_BUF,
+            MASKED_OUTPUT_BUF,
+            NORM_MASKED_OUTPUT_BUF,
+            CROSS_OUTPUT_BUF,
+            NORM_CROSS_OUTPUT_BUF,
+            FFN_INNER_BUF,
+            QKV_POINTER_BUF,
+            MOE_GATING_BUF,
+            MOE_PERMUTED_INPUT_BUF,
+            MOE_PERMUTED_OUTPUT_BUF,
+            MOE_INNER_BUF,
+            MOE_GATE_WEIGHTS_BUF,
+            MOE_EXPERT_IDS_BUF,
+            MOE_EXPANDED_SLOTS_BUF,
+            MOE_EXPERT_COUNTS_BUF,
+            ATTENTION_QUERY_BUF,
+            ATTENTION_KEY_BUF,
+            ATTENTION_VALUE_BUF,
+            ATTENTION_QK_BUF
+        };
+
+        WorkspacePlanner workspace_planner_;
+
+        /* the buffers are registered by plan_decoder_workspace (memory_planner.h) in the order of
+           DecoderBuffer, so that the capacity planner computes the same workspace */
+        void plan_workspace()
+        {
+            plan_decoder_workspace(workspace_planner_, sizeof(DataType_), batch_size_, hidden_units_,
+                                   moe_expert_num_, moe_k_, moe_capacity_, head_num_, context_query_len_,
+                                   std::max(context_query_len_, max_seq_len_));
+        }
+
+        void context_attention(const DataType_ *query, const DataType_ *Q_bias,
+                               const DataType_ *key, const DataType_ *K_bias,
+                               const DataType_ *value, const DataType_ *V_bias,
+                               const int *length_per_sample, const int query_len, const int kv_len);
+
     public:
         OpenDecoder(int batch_size, int seq_len,
                     int head_num, int size_per_head,
-                    int memory_hidden_units) : batch_size_(batch_size),
+                    int memory_hidden_units,
+                    int moe_expert_num = 0, int moe_k = 1,
+                    float moe_capacity_factor = 1.0f) : batch_size_(batch_size),
                                                max_seq_len_(seq_len), head_num_(head_num),
                                                size_per_head_(size_per_head),
-                                               memory_hidden_units_(memory_hidden_units)
+                                               memory_hidden_units_(memory_hidden_units),
+                                               moe_expert_num_(moe_expert_num), moe_k_(moe_k),
+                                               context_query_len_(0)
         {
 #ifndef NDEBUG
             PRINT_FUNC_NAME_();
@@ -113,6 +189,23 @@ namespace fastertransformer
 
             hidden_units_ = head_num_ * size_per_head_;
 
+            moe_capacity_ = 0;
+            if (moe_expert_num_ > 0)
+            {
+                if (moe_k_ < 1 || moe_k_ > MOE_MAX_K || moe_k_ > moe_expert_num_)
+                {
+                    printf("[ERROR] moe_k should be in [1, min(%d, moe_expert_num)], but get %d. \n", MOE_MAX_K, moe_k_);
+                    exit(-1);
+                }
+                if (moe_capacity_factor <= 0.0f)
+                {
+                    printf("[ERROR] moe_capacity_factor should be larger than 0, but get %f. \n", moe_capacity_factor);
+                    exit(-1);
+                }
+                moe_capacity_ = moe_expert_capacity(batch_size_, moe_expert_num_, moe_k_, moe_capacity_factor);
+            }
+            plan_workspace();
+
             FILE *fd = fopen("decoding_gemm_config.in", "r");
             int err = 0;
             if (fd == NULL)
@@ -176,10 +269,26 @@ namespace fastertransformer
             }
         }
 
+        /**
+         * Reserve the buffers of the batched attention of forward_context and forward_multi_token,
+         * the rows are sentences of query_len tokens. It should be called before getWorkspaceSize.
+         **/
+        void set_context_query_len(const int query_len)
+        {
+            if (query_len <= 0 || batch_size_ % query_len != 0)
+            {
+                printf("[ERROR] the %d rows of the decoder are not sentences of %d tokens. \n", batch_size_, query_len);
+                exit(-1);
+            }
+            context_query_len_ = query_len;
+            workspace_planner_ = WorkspacePlanner();
+            plan_workspace();
+        }
+
+        /* in number of DataType_ */
         int getWorkspaceSize()
         {
-            int buf_size = batch_size_ * hidden_units_;
-            return 13 * buf_size + sizeof(DataType_ *) * 9;
+            return (int)((workspace_planner_.total_bytes() + sizeof(DataType_) - 1) / sizeof(DataType_));
         }
 
         void initialize(DecoderInitParam<DataType_> param, DataType_ *buf)
@@ -188,24 +297,44 @@ namespace fastertransformer
             // PRINT_FUNC_NAME_();
 #endif
             param_ = param;
-            const int buf_size = batch_size_ * hidden_units_;
-            norm_from_tensor_buf_ = buf;
-            query_buf_ = buf + buf_size; //store the query values (from_tensor * Q) in both masked and multi-head attention
-            key_buf_ = buf + 2 * buf_size;
-            value_buf_ = buf + 3 * buf_size;
-            context_buf_ = buf + 4 * buf_size; //store the context result (softmax(qk)v) in both masked and multi-head attention
+            const WorkspacePlanner &planner = workspace_planner_;
+            norm_from_tensor_buf_ = planner.get<DataType_>(buf, NORM_FROM_TENSOR_BUF);
+            query_buf_ = planner.get<DataType_>(buf, QUERY_BUF); //store the query values (from_tensor * Q) in both masked and multi-head attention
+            key_buf_ = planner.get<DataType_>(buf, KEY_BUF);
+            value_buf_ = planner.get<DataType_>(buf, VALUE_BUF);
+            context_buf_ = planner.get<DataType_>(buf, CONTEXT_BUF); //store the context result (softmax(qk)v) in both masked and multi-head attention
 
-            masked_output_buf_ = buf + 5 * buf_size;      //masked_attention_output
-            norm_masked_output_buf_ = buf + 6 * buf_size; //norm(masked_attention_output)
+            masked_output_buf_ = planner.get<DataType_>(buf, MASKED_OUTPUT_BUF);           //masked_attention_output
+            norm_masked_output_buf_ = planner.get<DataType_>(buf, NORM_MASKED_OUTPUT_BUF); //norm(masked_attention_output)
 
-            cross_output_buf_ = buf + 7 * buf_size;         //mutli-head attention_output
-            norm_cross_output_buf_ = buf + 8 * buf_size; //norm(multi-head attention_output)
-            ffn_inner_buf_ = buf + 9 * buf_size;         //4 buf size to store inner product
+            cross_output_buf_ = planner.get<DataType_>(buf, CROSS_OUTPUT_BUF);           //mutli-head attention_output
+            norm_cross_output_buf_ = planner.get<DataType_>(buf, NORM_CROSS_OUTPUT_BUF); //norm(multi-head attention_output)
+            ffn_inner_buf_ = planner.get<DataType_>(buf, FFN_INNER_BUF);                 //4 buf size to store inner product
 
-            qkv_kernel_ = (DataType_ **)(ffn_inner_buf_ + 4 * buf_size);
+            qkv_kernel_ = planner.get<DataType_ *>(buf, QKV_POINTER_BUF);
             qkv_input_ = qkv_kernel_ + 3;
             qkv_buf_ = qkv_input_ + 3;
 
+            if (moe_expert_num_ > 0)
+            {
+                moe_gating_buf_ = planner.get<DataType_>(buf, MOE_GATING_BUF);
+                moe_permuted_input_buf_ = planner.get<DataType_>(buf, MOE_PERMUTED_INPUT_BUF);
+                moe_permuted_output_buf_ = planner.get<DataType_>(buf, MOE_PERMUTED_OUTPUT_BUF);
+                moe_inner_buf_ = planner.get<DataType_>(buf, MOE_INNER_BUF);
+                moe_gate_weights_ = planner.get<float>(buf, MOE_GATE_WEIGHTS_BUF);
+                moe_expert_ids_ = planner.get<int>(buf, MOE_EXPERT_IDS_BUF);
+                moe_expanded_slots_ = planner.get<int>(buf, MOE_EXPANDED_SLOTS_BUF);
+                moe_expert_counts_ = planner.get<int>(buf, MOE_EXPERT_COUNTS_BUF);
+            }
+
+            if (context_query_len_ > 0)
+            {
+                attention_q_buf_ = planner.get<DataType_>(buf, ATTENTION_QUERY_BUF);
+                attention_k_buf_ = planner.get<DataType_>(buf, ATTENTION_KEY_BUF);
+                attention_v_buf_ = planner.get<DataType_>(buf, ATTENTION_VALUE_BUF);
+                attention_qk_buf_ = planner.get<DataType_>(buf, ATTENTION_QK_BUF);
+            }
+
             if (is_fuse_QKV == true)
             {
                 const DataType_ *hA[]{param_.self_attention.query_weight.kernel,
@@ -360,14 +489,21 @@ namespace fastertransformer
                     check_cuda_error(cudaGetLastError());
 #endif
                     print_tensor(batch_size_*1*head_num_*size_per_head_,decoder_output,"cpp_decoder_output_before.txt");
-                    ffn(norm_cross_output_buf_, ffn_inner_buf_, decoder_output, m, 4 * n, n, ActivationType::RELU);
-                    print_tensor(batch_size_*1*head_num_*size_per_head_,decoder_output,"cpp_decoder_output.txt");
+                    if (moe_expert_num_ > 0)
+                    {
+                        moe_ffn(norm_cross_output_buf_, cross_output_buf_, decoder_output, m, 4 * n, n, ActivationType::RELU);
+                    }
+                    else
+                    {
+                        ffn(norm_cross_output_buf_, ffn_inner_buf_, decoder_output, m, 4 * n, n, ActivationType::RELU);
+                        print_tensor(batch_size_*1*head_num_*size_per_head_,decoder_output,"cpp_decoder_output.txt");
 
 #ifndef NDEBUG
-                    cudaDeviceSynchronize();
-                    check_cuda_error(cudaGetLastError());
+                        cudaDeviceSynchronize();
+                        check_cuda_error(cudaGetLastError());
 #endif
-                    add_bias_input(decoder_output, cross_output_buf_, m, n);
+                        add_bias_input(decoder_output, cross_output_buf_, m, n);
+                    }
                     print_tensor(batch_size_*1*head_num_*size_per_head_,cross_output_buf_,"cpp_cross_output_buf_last.txt");
 
                 }
@@ -384,6 +520,251 @@ namespace fastertransformer
                     check_cuda_error(cudaGetLastError());
 #endif
                     // For GPT-2 decoder
+                    if (moe_expert_num_ > 0)
+                    {
+                        moe_ffn(norm_masked_output_buf_, masked_output_buf_, decoder_output, m, 4 * n, n, ActivationType::GELU);
+                    }
+                    else
+                    {
+                        ffn(norm_masked_output_buf_, ffn_inner_buf_, decoder_output, m, 4 * n, n, ActivationType::GELU);
+#ifndef NDEBUG
+                        cudaDeviceSynchronize();
+                        check_cuda_error(cudaGetLastError());
+#endif
+                        add_bias_input(decoder_output, masked_output_buf_, m, n);
+                    }
+                }
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+            }
+
+            catch (std::runtime_error &error)
+            {
+                throw error;
+            }
+        }
+        /**
+         * Teacher-forced forward of one layer. The decoder should be created with
+         * batch_size * query_len rows, and all the target positions of a sentence
+         * are processed at once with causal self attention instead of step by step,
+         * set_context_query_len(query_len) should be called before getWorkspaceSize.
+         * key_mem_cache and value_mem_cache are workspaces of
+         * [batch_size, max_seq_len, hidden_units], they are recomputed in every call.
+         **/
+        void forward_context(const DataType_ *from_tensor, const DataType_ *memory_tensor,
+                             DataType_ *key_mem_cache_, DataType_ *value_mem_cache_,
+                             const int *memory_sequence_length, DataType_ *decoder_output,
+                             const int query_len, const bool is_cross_attention)
+        {
+#ifndef NDEBUG
+            // PRINT_FUNC_NAME_();
+#endif
+            const int m = batch_size_;
+            const int n = hidden_units_;
+
+            try
+            {
+                decoder_norm1(from_tensor, param_.self_layernorm.gamma, param_.self_layernorm.beta,
+                              norm_from_tensor_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                masked_context_attention(norm_from_tensor_buf_, masked_output_buf_, query_len);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+
+                const DataType_ *ffn_input = norm_masked_output_buf_;
+                DataType_ *ffn_residual = masked_output_buf_;
+                if (is_cross_attention == true)
+                {
+                    decoder_norm2(from_tensor, param_.cross_layernorm.gamma, param_.cross_layernorm.beta,
+                                  param_.self_attention.attention_output_weight.bias,
+                                  masked_output_buf_, norm_masked_output_buf_, m, n);
+#ifndef NDEBUG
+                    cudaDeviceSynchronize();
+                    check_cuda_error(cudaGetLastError());
+#endif
+                    cross_context_attention(norm_masked_output_buf_, memory_tensor,
+                                            key_mem_cache_, value_mem_cache_, cross_output_buf_,
+                                            memory_sequence_length, max_seq_len_, query_len);
+#ifndef NDEBUG
+                    cudaDeviceSynchronize();
+                    check_cuda_error(cudaGetLastError());
+#endif
+                    decoder_norm2(masked_output_buf_, param_.ffn_layernorm.gamma, param_.ffn_layernorm.beta,
+                                  param_.cross_attention.attention_output_weight.bias,
+                                  cross_output_buf_, norm_cross_output_buf_, m, n);
+                    ffn_input = norm_cross_output_buf_;
+                    ffn_residual = cross_output_buf_;
+                }
+                else
+                {
+                    decoder_norm2(from_tensor, param_.ffn_layernorm.gamma, param_.ffn_layernorm.beta,
+                                  param_.self_attention.attention_output_weight.bias,
+                                  masked_output_buf_, norm_masked_output_buf_, m, n);
+                }
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+
+                const ActivationType act = is_cross_attention ? ActivationType::RELU : ActivationType::GELU;
+                if (moe_expert_num_ > 0)
+                {
+                    moe_ffn(ffn_input, ffn_residual, decoder_output, m, 4 * n, n, act);
+                }
+                else
+                {
+                    ffn(ffn_input, ffn_inner_buf_, decoder_output, m, 4 * n, n, act);
+#ifndef NDEBUG
+                    cudaDeviceSynchronize();
+                    check_cuda_error(cudaGetLastError());
+#endif
+                    add_bias_input(decoder_output, ffn_residual, m, n);
+                }
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+            }
+            catch (std::runtime_error &error)
+            {
+                throw error;
+            }
+        }
+
+        /**
+         * Forward of one layer over several tokens per sentence, used to verify the drafts
+         * of the speculative decoding. The decoder should be created with
+         * batch_size * tokens_per_row rows, row r is at positions[r] (device, < 0 for an
+         * inactive row) of the sentence r / tokens_per_row, set_context_query_len(tokens_per_row)
+         * should be called before getWorkspaceSize. The self attention writes the
+         * rows to key_cache_ and value_cache_ ([max_cache_len, batch_size, hidden_units]),
+         * then every row attends to the cached positions up to its own. key_mem_cache and
+         * value_mem_cache keep the memory projections of forward_context, they are only
+         * computed if project_memory is true.
+         **/
+        void forward_multi_token(const DataType_ *from_tensor, const DataType_ *memory_tensor,
+                                 DataType_ *key_cache_, DataType_ *value_cache_,
+                                 DataType_ *key_mem_cache_, DataType_ *value_mem_cache_,
+                                 const int *memory_sequence_length, DataType_ *decoder_output,
+                                 const int *positions, const int tokens_per_row,
+                                 const int max_cache_len, const bool project_memory)
+        {
+#ifndef NDEBUG
+            // PRINT_FUNC_NAME_();
+#endif
+            const int m = batch_size_;
+            const int n = hidden_units_;
+
+            try
+            {
+                decoder_norm1(from_tensor, param_.self_layernorm.gamma, param_.self_layernorm.beta,
+                              norm_from_tensor_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                masked_multi_token_attention(norm_from_tensor_buf_, key_cache_, value_cache_, masked_output_buf_,
+                                             positions, tokens_per_row, max_cache_len);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                decoder_norm2(from_tensor, param_.cross_layernorm.gamma, param_.cross_layernorm.beta,
+                              param_.self_attention.attention_output_weight.bias,
+                              masked_output_buf_, norm_masked_output_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                cross_context_attention(norm_masked_output_buf_, memory_tensor,
+                                        key_mem_cache_, value_mem_cache_, cross_output_buf_,
+                                        memory_sequence_length, max_seq_len_, tokens_per_row, project_memory);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                decoder_norm2(masked_output_buf_, param_.ffn_layernorm.gamma, param_.ffn_layernorm.beta,
+                              param_.cross_attention.attention_output_weight.bias,
+                              cross_output_buf_, norm_cross_output_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                if (moe_expert_num_ > 0)
+                {
+                    moe_ffn(norm_cross_output_buf_, cross_output_buf_, decoder_output, m, 4 * n, n, ActivationType::RELU);
+                }
+                else
+                {
+                    ffn(norm_cross_output_buf_, ffn_inner_buf_, decoder_output, m, 4 * n, n, ActivationType::RELU);
+#ifndef NDEBUG
+                    cudaDeviceSynchronize();
+                    check_cuda_error(cudaGetLastError());
+#endif
+                    add_bias_input(decoder_output, cross_output_buf_, m, n);
+                }
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+            }
+            catch (std::runtime_error &error)
+            {
+                throw error;
+            }
+        }
+
+        /**
+         * GPT-2 layer over packed rows, used by the chunked prefill. The decoder should be
+         * created with at least row_num rows, row r is at positions[r] of the cache slot
+         * row_slots[r] (both device). The rows of a slot are consecutive and increasing, a
+         * prompt chunk and a decode token of other slots run in the same call.
+         * key_cache_ and value_cache_ are [max_cache_len, cache_batch, hidden_units].
+         **/
+        void forward_packed(const DataType_ *from_tensor, DataType_ *key_cache_, DataType_ *value_cache_,
+                            DataType_ *decoder_output, const int *positions, const int *row_slots,
+                            const int row_num, const int cache_batch, const int max_cache_len)
+        {
+#ifndef NDEBUG
+            // PRINT_FUNC_NAME_();
+#endif
+            const int m = row_num;
+            const int n = hidden_units_;
+
+            try
+            {
+                decoder_norm1(from_tensor, param_.self_layernorm.gamma, param_.self_layernorm.beta,
+                              norm_from_tensor_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                masked_multi_token_attention(norm_from_tensor_buf_, key_cache_, value_cache_, masked_output_buf_,
+                                             positions, 1, max_cache_len, row_slots, row_num, cache_batch);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                decoder_norm2(from_tensor, param_.ffn_layernorm.gamma, param_.ffn_layernorm.beta,
+                              param_.self_attention.attention_output_weight.bias,
+                              masked_output_buf_, norm_masked_output_buf_, m, n);
+#ifndef NDEBUG
+                cudaDeviceSynchronize();
+                check_cuda_error(cudaGetLastError());
+#endif
+                if (moe_expert_num_ > 0)
+                {
+                    moe_ffn(norm_masked_output_buf_, masked_output_buf_, decoder_output, m, 4 * n, n, ActivationType::GELU);
+                }
+                else
+                {
                     ffn(norm_masked_output_buf_, ffn_inner_buf_, decoder_output, m, 4 * n, n, ActivationType::GELU);
 #ifndef NDEBUG
                     cudaDeviceSynchronize();
@@ -396,12 +777,12 @@ namespace fastertransformer
                 check_cuda_error(cudaGetLastError());
 #endif
             }
-
             catch (std::runtime_error &error)
             {
                 throw error;
             }
         }
+
         void masked_multi_head_attention(const DataType_ *from_tensor, DataType_ *key_cache_,
                                          DataType_ *value_cache_, DataType_ *decoder_output, const int step);
 
@@ -410,9 +791,29 @@ namespace fastertransformer
                                         DataType_ *decoder_output, const int *memory_sequence_length,
                                         const int max_seq_len, const int step);
 
+        void masked_context_attention(const DataType_ *from_tensor, DataType_ *decoder_output, const int query_len);
+
+        /* project_memory = false reuses the memory projections already in key_mem_cache_
+           and value_mem_cache_ */
+        void cross_context_attention(const DataType_ *from_tensor, const DataType_ *memory_tensor,
+                                     DataType_ *key_mem_cache_, DataType_ *value_mem_cache_,
+                                     DataType_ *decoder_output, const int *memory_sequence_length,
+                                     const int max_seq_len, const int query_len,
+                                     const bool project_memory = true);
+
+        void masked_multi_token_attention(const DataType_ *from_tensor, DataType_ *key_cache_,
+                                          DataType_ *value_cache_, DataType_ *decoder_output,
+                                          const int *positions, const int tokens_per_row,
+                                          const int max_cache_len, const int *row_slots = nullptr,
+                                          const int row_num = -1, const int cache_batch = -1);
+
         void ffn(const DataType_ *input, DataType_ *ffn_inner, DataType_ *output,
                  const int m, const int inner_size, const int n, ActivationType activation_type);
 
+        /* mixture-of-experts FFN, the residual is added by the un-permute kernel. */
+        void moe_ffn(const DataType_ *input, const DataType_ *residual, DataType_ *output,
+                     const int m, const int inner_size, const int n, ActivationType activation_type);
+
         void decoder_norm1(const DataType_ *from_tensor, const DataType_ *gamma,
                            const DataType_ *beta, DataType_ *norm_from_tensor_buf_, const int m, const int n);
 
@@ -437,6 +838,20 @@ namespace fastertransformer
             cross_output_buf_ = nullptr;
             norm_cross_output_buf_ = nullptr;
             ffn_inner_buf_ = nullptr;
+
+            moe_gating_buf_ = nullptr;
+            moe_permuted_input_buf_ = nullptr;
+            moe_inner_buf_ = nullptr;
+            moe_permuted_output_buf_ = nullptr;
+            moe_gate_weights_ = nullptr;
+            moe_expert_ids_ = nullptr;
+            moe_expanded_slots_ = nullptr;
+            moe_expert_counts_ = nullptr;
+
+            attention_q_buf_ = nullptr;
+            attention_k_buf_ = nullptr;
+            attention_v_buf_ = nullptr;
+            attention_qk_buf_ = nullptr;
         }
     };
 } //namespace fastertransformer
\ No newline at end of file
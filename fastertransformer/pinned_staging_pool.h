@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Pinned host memory pool for asynchronous host <-> device copies
+ *
+ * Copies from pageable memory are staged by the driver and block the host, so
+ * inputs and outputs go through page-locked buffers of this pool instead. There
+ * is one pool per device, shared by every op of the process (instance()), it
+ * grows by pinned arenas up to a maximum capacity. A buffer used by an
+ * asynchronous copy is released with release_after(), which records an event
+ * on the stream. The buffer is reused once the event is done.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/staging_arena.h"
+#include <cuda_runtime.h>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace fastertransformer
+{
+
+class PinnedStagingPool
+{
+private:
+  StagingHeap heap_;
+  std::vector<char *> host_bufs_;   // one per arena of the heap
+  size_t max_capacity_;
+  std::map<unsigned long long, cudaEvent_t> pending_events_;
+  std::vector<cudaEvent_t> idle_events_;
+  unsigned long long next_fence_;
+  std::mutex mutex_;
+
+  int reclaim_completed()
+  {
+    return heap_.reclaim([this](unsigned long long fence) { return is_fence_done(fence, false); });
+  }
+
+  bool is_fence_done(const unsigned long long fence, const bool wait)
+  {
+    std::map<unsigned long long, cudaEvent_t>::iterator it = pending_events_.find(fence);
+    if (it == pending_events_.end())
+      return true;
+    if (wait)
+      check_cuda_error(cudaEventSynchronize(it->second));
+    else if (cudaEventQuery(it->second) != cudaSuccess)
+      return false;
+    idle_events_.push_back(it->second);
+    pending_events_.erase(it);
+    return true;
+  }
+
+  StagingBlock block_of(const void *ptr) const
+  {
+    const char *p = (const char *)ptr;
+    for (size_t i = 0; i < host_bufs_.size(); i++)
+    {
+      if (p >= host_bufs_[i] && p < host_bufs_[i] + heap_.arena_capacity((int)i))
+      {
+        StagingBlock block;
+        block.arena = (int)i;
+        block.offset = (size_t)(p - host_bufs_[i]);
+        return block;
+      }
+    }
+    printf("[ERROR][PinnedStagingPool] %p is not allocated by the pool. \n", ptr);
+    exit(-1);
+  }
+
+public:
+  /* arenas of arena_size bytes (or of the request when it is larger), at most max_capacity bytes in total */
+  PinnedStagingPool(const size_t arena_size = (size_t)1 << 20, const size_t max_capacity = (size_t)256 << 20)
+      : heap_(arena_size), max_capacity_(max_capacity), next_fence_(0)
+  {
+  }
+
+  PinnedStagingPool(const PinnedStagingPool &) = delete;
+  PinnedStagingPool &operator=(const PinnedStagingPool &) = delete;
+
+  /* the pool of device_id (the current device for -1), shared by all the ops of the process;
+     it lives until the end of the process, the CUDA context may be gone at static destruction */
+  static PinnedStagingPool &instance(int device_id = -1)
+  {
+    static std::mutex mutex;
+    static std::map<int, PinnedStagingPool *> pools;
+    if (device_id < 0)
+      check_cuda_error(cudaGetDevice(&device_id));
+    std::lock_guard<std::mutex> lock(mutex);
+    PinnedStagingPool *&pool = pools[device_id];
+    if (pool == nullptr)
+      pool = new PinnedStagingPool();
+    return *pool;
+  }
+
+  /* Return a pinned buffer of at least bytes. If no arena has room, add one, or wait for the
+     oldest asynchronous copy that still holds a buffer when the pool is at its capacity. */
+  void *acquire(const size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    StagingBlock block;
+    reclaim_completed();
+    while (!heap_.allocate(bytes, block))
+    {
+      unsigned long long fence;
+      const size_t size = heap_.arena_size_for(bytes);
+      if (heap_.capacity() + size <= max_capacity_)
+      {
+        char *host_buf = nullptr;
+        check_cuda_error(cudaHostAlloc((void **)&host_buf, size, cudaHostAllocPortable));
+        host_bufs_.push_back(host_buf);
+        heap_.grow(bytes);
+      }
+      else if (heap_.oldest_fence(fence))
+      {
+        is_fence_done(fence, true);
+        reclaim_completed();
+      }
+      else
+        throw std::runtime_error(std::string("[FT][ERROR] PinnedStagingPool is out of memory. "));
+    }
+    return host_bufs_[block.arena] + block.offset;
+  }
+
+  void release(void *ptr)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    heap_.free(block_of(ptr));
+  }
+
+  /* release ptr after all work issued to stream so far is finished */
+  void release_after(void *ptr, cudaStream_t stream)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cudaEvent_t event;
+    if (idle_events_.empty())
+      check_cuda_error(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    else
+    {
+      event = idle_events_.back();
+      idle_events_.pop_back();
+    }
+    check_cuda_error(cudaEventRecord(event, stream));
+    const unsigned long long fence = next_fence_++;
+    pending_events_[fence] = event;
+    heap_.free_after(block_of(ptr), fence);
+  }
+
+  /* stage src into a pinned buffer and copy it to dst asynchronously,
+     src can be reused as soon as the function returns. */
+  void upload_async(void *dst, const void *src, const size_t bytes, cudaStream_t stream)
+  {
+    void *staging = acquire(bytes);
+    memcpy(staging, src, bytes);
+    check_cuda_error(cudaMemcpyAsync(dst, staging, bytes, cudaMemcpyHostToDevice, stream));
+    release_after(staging, stream);
+  }
+
+  size_t capacity() const { return heap_.capacity(); }
+  size_t used_bytes() const { return heap_.used_bytes(); }
+  size_t peak_bytes() const { return heap_.peak_bytes(); }
+  int arena_num() const { return heap_.arena_num(); }
+
+  ~PinnedStagingPool()
+  {
+    for (std::map<unsigned long long, cudaEvent_t>::iterator it = pending_events_.begin(); it != pending_events_.end(); ++it)
+    {
+      cudaEventSynchronize(it->second);
+      cudaEventDestroy(it->second);
+    }
+    for (size_t i = 0; i < idle_events_.size(); i++)
+      cudaEventDestroy(idle_events_[i]);
+    for (size_t i = 0; i < host_bufs_.size(); i++)
+      cudaFreeHost(host_bufs_[i]);
+  }
+};
+
+/**
+ * Reads the finished flags of a decoding loop without draining the stream every step. The
+ * flags of step t are copied into one of two pinned slots, and the host only waits for the
+ * copy of step t - 1, which is done while the kernels of step t run. The loop stops one step
+ * after all sentences finished, that step leaves the finished sentences unchanged.
+ **/
+class FinishedFlagsReader
+{
+private:
+  PinnedStagingPool *pool_;
+  int size_;
+  bool *h_flags_[2];
+  cudaEvent_t events_[2];
+  int issued_;
+
+public:
+  FinishedFlagsReader(PinnedStagingPool &pool, const int size) : pool_(&pool), size_(size), issued_(0)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      h_flags_[i] = (bool *)pool_->acquire(sizeof(bool) * size);
+      check_cuda_error(cudaEventCreateWithFlags(&events_[i], cudaEventDisableTiming));
+    }
+  }
+
+  FinishedFlagsReader(const FinishedFlagsReader &) = delete;
+  FinishedFlagsReader &operator=(const FinishedFlagsReader &) = delete;
+
+  /* before the first step of a loop */
+  void reset() { issued_ = 0; }
+
+  /* copy the flags of the step, return the flags of the previous step (nullptr at the first step) */
+  const bool *push(const bool *d_flags, cudaStream_t stream)
+  {
+    const int slot = issued_ % 2;
+    check_cuda_error(cudaMemcpyAsync(h_flags_[slot], d_flags, sizeof(bool) * size_, cudaMemcpyDeviceToHost, stream));
+    check_cuda_error(cudaEventRecord(events_[slot], stream));
+    issued_++;
+    if (issued_ == 1)
+      return nullptr;
+    check_cuda_error(cudaEventSynchronize(events_[1 - slot]));
+    return h_flags_[1 - slot];
+  }
+
+  /* the flags of the last pushed step, after the loop */
+  const bool *last()
+  {
+    if (issued_ == 0)
+      return nullptr;
+    const int slot = (issued_ - 1) % 2;
+    check_cuda_error(cudaEventSynchronize(events_[slot]));
+    return h_flags_[slot];
+  }
+
+  static bool all(const bool *flags, const int size)
+  {
+    for (int i = 0; i < size; i++)
+    {
+      if (!flags[i])
+        return false;
+    }
+    return true;
+  }
+
+  ~FinishedFlagsReader()
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      cudaEventSynchronize(events_[i]);
+      cudaEventDestroy(events_[i]);
+      pool_->release(h_flags_[i]);
+    }
+  }
+};
+
+} // namespace fastertransformer
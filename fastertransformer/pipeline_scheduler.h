@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Host side scheduler of the encoder-decoder pipeline
+ *
+ * The encoder of batch i + 1 runs on its own stream while batch i is decoded.
+ * Encoder outputs are written into slot_num memory slots (double buffer by
+ * default). The scheduler only decides the issue order, the slot of each batch
+ * and the dependencies between the stages, so it does not depend on CUDA and
+ * can be checked with simulated stage durations.
+ **/
+
+#pragma once
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+enum class PipelineStage{ENCODE, DECODE};
+
+struct PipelineOp
+{
+  PipelineStage stage;
+  int batch_id;
+  int slot;
+  /* ENCODE waits until the decode of wait_batch_id releases the slot,
+     DECODE waits until the encoder of the same batch finished. -1 means no wait. */
+  int wait_batch_id;
+};
+
+struct PipelineTimeline
+{
+  std::vector<float> encode_start, encode_end;
+  std::vector<float> decode_start, decode_end;
+  float makespan;
+  float serial_makespan;
+  /* the decodes that wait for their encoder after the previous decode ended, and the total wait */
+  int bubble_num;
+  float bubble_time;
+};
+
+class PipelineScheduler
+{
+private:
+  int slot_num_;
+
+public:
+  PipelineScheduler(const int slot_num = 2) : slot_num_(slot_num)
+  {
+    if(slot_num_ < 2)
+    {
+      printf("[ERROR] PipelineScheduler needs at least 2 memory slots, but get %d. \n", slot_num_);
+      exit(-1);
+    }
+  }
+
+  int slot_num() const { return slot_num_; }
+
+  /* Issue order on the host. The encoder runs slot_num - 1 batches ahead, and the encoder
+     of the next batch is always issued before the decoding of the current batch, since
+     decoding blocks the host to check whether all sentences are finished. */
+  std::vector<PipelineOp> schedule(const int batch_num) const
+  {
+    std::vector<PipelineOp> ops;
+    const int prefetch = slot_num_ - 1;
+    for(int i = 0; i < prefetch && i < batch_num; i++)
+      ops.push_back(encode_op(i));
+    for(int i = 0; i < batch_num; i++)
+    {
+      if(i + prefetch < batch_num)
+        ops.push_back(encode_op(i + prefetch));
+      PipelineOp op;
+      op.stage = PipelineStage::DECODE;
+      op.batch_id = i;
+      op.slot = i % slot_num_;
+      op.wait_batch_id = i;
+      ops.push_back(op);
+    }
+    return ops;
+  }
+
+  /* Replay the schedule with the given stage durations. Each stage runs on its own stream
+     in issue order, an op starts after its dependency, and the host cannot issue anything
+     before the previous decode returns. */
+  PipelineTimeline simulate(const std::vector<float> &encode_time,
+                            const std::vector<float> &decode_time) const
+  {
+    const int batch_num = (int)encode_time.size();
+    if((int)decode_time.size() != batch_num)
+    {
+      printf("[ERROR] encode_time and decode_time should have the same size (%d vs %d). \n",
+             batch_num, (int)decode_time.size());
+      exit(-1);
+    }
+
+    PipelineTimeline timeline;
+    timeline.encode_start.assign(batch_num, 0.0f);
+    timeline.encode_end.assign(batch_num, 0.0f);
+    timeline.decode_start.assign(batch_num, 0.0f);
+    timeline.decode_end.assign(batch_num, 0.0f);
+    timeline.serial_makespan = 0.0f;
+    timeline.bubble_num = 0;
+    timeline.bubble_time = 0.0f;
+
+    float host_time = 0.0f;
+    float encoder_stream_time = 0.0f;
+    float decoder_stream_time = 0.0f;
+    std::vector<PipelineOp> ops = schedule(batch_num);
+    for(size_t i = 0; i < ops.size(); i++)
+    {
+      const PipelineOp &op = ops[i];
+      const int b = op.batch_id;
+      if(op.stage == PipelineStage::ENCODE)
+      {
+        float start = host_time > encoder_stream_time ? host_time : encoder_stream_time;
+        if(op.wait_batch_id >= 0 && timeline.decode_end[op.wait_batch_id] > start)
+          start = timeline.decode_end[op.wait_batch_id];
+        timeline.encode_start[b] = start;
+        timeline.encode_end[b] = start + encode_time[b];
+        encoder_stream_time = timeline.encode_end[b];
+      }
+      else
+      {
+        float start = host_time > decoder_stream_time ? host_time : decoder_stream_time;
+        if(timeline.encode_end[op.wait_batch_id] > start)
+          start = timeline.encode_end[op.wait_batch_id];
+        if(b > 0 && start > decoder_stream_time)
+        {
+          timeline.bubble_num++;
+          timeline.bubble_time += start - decoder_stream_time;
+        }
+        timeline.decode_start[b] = start;
+        timeline.decode_end[b] = start + decode_time[b];
+        decoder_stream_time = timeline.decode_end[b];
+        host_time = timeline.decode_end[b];
+      }
+      timeline.serial_makespan += op.stage == PipelineStage::ENCODE ? encode_time[b] : decode_time[b];
+    }
+    timeline.makespan = encoder_stream_time > decoder_stream_time ? encoder_stream_time : decoder_stream_time;
+    return timeline;
+  }
+
+private:
+  PipelineOp encode_op(const int batch_id) const
+  {
+    PipelineOp op;
+    op.stage = PipelineStage::ENCODE;
+    op.batch_id = batch_id;
+    op.slot = batch_id % slot_num_;
+    op.wait_batch_id = batch_id >= slot_num_ ? batch_id - slot_num_ : -1;
+    return op;
+  }
+};
+
+} // namespace fastertransformer
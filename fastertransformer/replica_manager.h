@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Replicas of an engine on several devices
+ *
+ * The weights are given once as a host blob and copied to every device. The
+ * factory builds one engine per device from a ReplicaContext (device,
+ * allocator, stream, cuBLAS handles and the device copy of the blob), e.g. a
+ * DecodingBeamsearch whose DecoderInitParam points into the weights.
+ *
+ * run() can be called from any number of threads: ReplicaRouter picks the
+ * replica, the work runs on it under the lock of the replica with the device
+ * set, and a failure (a std::runtime_error, which is what check_cuda_error
+ * throws) is accounted to the replica and the request is retried on another
+ * one. With set_metrics(), the time a request waits for its replica is
+ * recorded as its queueing time.
+ **/
+
+#pragma once
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/replica_router.h"
+#include "fastertransformer/request_metrics.h"
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <cublasLt.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fastertransformer
+{
+
+struct ReplicaContext
+{
+  int device_id;
+  IAllocator *allocator;
+  cudaStream_t stream;
+  cublasHandle_t cublas_handle;
+  cublasLtHandle_t cublaslt_handle;
+  const void *weights;   // the device copy of the host weights, 256 byte aligned
+};
+
+template <typename Engine>
+class ReplicaManager
+{
+public:
+  typedef std::function<Engine *(const ReplicaContext &)> EngineFactory;
+
+private:
+  struct Replica
+  {
+    ReplicaContext context;
+    Allocator<AllocatorType::CUDA> allocator;
+    void *weights;
+    Engine *engine;
+    std::mutex mutex;
+
+    Replica(const int device_id) : allocator(device_id), weights(nullptr), engine(nullptr) {}
+  };
+
+  std::vector<std::unique_ptr<Replica>> replicas_;
+  ReplicaRouter router_;
+  RequestMetrics *metrics_;
+  const std::chrono::steady_clock::time_point start_;
+
+  double now_ms() const
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+public:
+  ReplicaManager(const void *host_weights, const size_t weight_bytes, const std::vector<int> &devices,
+                 EngineFactory factory, const ReplicaRouterConfig &config = ReplicaRouterConfig())
+      : router_((int)devices.size(), config), metrics_(nullptr), start_(std::chrono::steady_clock::now())
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    // pinned so that the copies to the devices run at full bandwidth and in parallel
+    const bool registered = weight_bytes > 0 &&
+                            cudaHostRegister(const_cast<void *>(host_weights), weight_bytes, cudaHostRegisterPortable) == cudaSuccess;
+    if (!registered)
+      cudaGetLastError();
+
+    int o_device = 0;
+    check_cuda_error(cudaGetDevice(&o_device));
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+      Replica *replica = new Replica(devices[i]);
+      replicas_.push_back(std::unique_ptr<Replica>(replica));
+      check_cuda_error(cudaSetDevice(devices[i]));
+      ReplicaContext &context = replica->context;
+      context.device_id = devices[i];
+      context.allocator = &replica->allocator;
+      check_cuda_error(cudaStreamCreateWithFlags(&context.stream, cudaStreamNonBlocking));
+      check_cuda_error(cublasCreate(&context.cublas_handle));
+      check_cuda_error(cublasLtCreate(&context.cublaslt_handle));
+      check_cuda_error(cublasSetStream(context.cublas_handle, context.stream));
+      if (weight_bytes > 0)
+      {
+        replica->weights = replica->allocator.malloc(weight_bytes, false);
+        check_cuda_error(cudaMemcpyAsync(replica->weights, host_weights, weight_bytes, cudaMemcpyHostToDevice, context.stream));
+      }
+      context.weights = replica->weights;
+    }
+    for (size_t i = 0; i < replicas_.size(); i++)
+    {
+      Replica &replica = *replicas_[i];
+      check_cuda_error(cudaSetDevice(replica.context.device_id));
+      check_cuda_error(cudaStreamSynchronize(replica.context.stream));
+      replica.engine = factory(replica.context);
+    }
+    check_cuda_error(cudaSetDevice(o_device));
+    if (registered)
+      check_cuda_error(cudaHostUnregister(const_cast<void *>(host_weights)));
+  }
+
+  ReplicaManager(const ReplicaManager &) = delete;
+  ReplicaManager &operator=(const ReplicaManager &) = delete;
+
+  int replica_num() const { return (int)replicas_.size(); }
+
+  ReplicaRouter &router() { return router_; }
+
+  const ReplicaContext &context(const int replica) const { return replicas_[replica]->context; }
+
+  /* nullptr disables the metrics */
+  void set_metrics(RequestMetrics *metrics) { metrics_ = metrics; }
+
+  /* Run work(Engine &, const ReplicaContext &) on a replica and wait for its stream. Return the
+     replica that succeeded, or -1 if no replica is available or the request failed max_retries + 1
+     times. */
+  template <typename Work>
+  int run(const ReplicaRequestCost &request, Work work, const int max_retries = 1)
+  {
+    int exclude = -1;
+    const int64_t arrival_us = metrics_ != nullptr ? RequestMetrics::now_us() : 0;
+    for (int attempt = 0; attempt <= max_retries; attempt++)
+    {
+      const int id = router_.route(request, now_ms(), exclude);
+      if (id < 0)
+        return -1;
+      Replica &replica = *replicas_[id];
+      bool success = true;
+      double elapsed = 0.0;
+      int64_t start_us = 0;
+      {
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        int o_device = 0;
+        check_cuda_error(get_set_device(replica.context.device_id, &o_device));
+        if (metrics_ != nullptr)
+          start_us = RequestMetrics::now_us();
+        const double start = now_ms();
+        try
+        {
+          work(*replica.engine, replica.context);
+          check_cuda_error(cudaStreamSynchronize(replica.context.stream));
+        }
+        catch (std::runtime_error &error)
+        {
+          printf("[WARNING] replica %d on device %d fails: %s \n", id, replica.context.device_id, error.what());
+          cudaGetLastError();
+          success = false;
+        }
+        elapsed = now_ms() - start;
+        check_cuda_error(get_set_device(o_device));
+      }
+      router_.complete(id, request, now_ms(), elapsed, success);
+      if (success)
+      {
+        if (metrics_ != nullptr)
+          metrics_->record(RequestMetric::QUEUE_TIME, (uint64_t)(start_us - arrival_us));
+        return id;
+      }
+      exclude = id;
+    }
+    return -1;
+  }
+
+  ~ReplicaManager()
+  {
+    int o_device = 0;
+    cudaGetDevice(&o_device);
+    for (size_t i = 0; i < replicas_.size(); i++)
+    {
+      Replica &replica = *replicas_[i];
+      cudaSetDevice(replica.context.device_id);
+      delete replica.engine;
+      if (replica.weights != nullptr)
+        replica.allocator.free(replica.weights);
+      cublasLtDestroy(replica.context.cublaslt_handle);
+      cublasDestroy(replica.context.cublas_handle);
+      cudaStreamDestroy(replica.context.stream);
+    }
+    cudaSetDevice(o_device);
+  }
+};
+
+} // namespace fastertransformer
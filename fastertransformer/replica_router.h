@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Request router of the replicas of an engine on several devices
+ *
+ * A request is charged its estimated cost in tokens: the input tokens are
+ * cheaper than the generated ones, since the encoder (or the context of a
+ * decoder) processes them in parallel, and every beam generates its tokens.
+ * route() sends the request to the replica that would finish the outstanding
+ * tokens first, i.e. the least outstanding tokens divided by the measured
+ * throughput of the device, so slower or busier devices get less work.
+ *
+ * Each replica keeps health accounting. A failed request marks the replica
+ * SUSPECT, max_failures failures in a row take it DOWN for cooldown_ms, after
+ * which it gets one probe request at a time until a request succeeds. The
+ * router only does the bookkeeping and takes the time as an argument, so it
+ * does not depend on CUDA and simulate_replicas() can replay a workload on
+ * simulated devices. ReplicaManager runs the engines.
+ **/
+
+#pragma once
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+enum class ReplicaHealth{HEALTHY, SUSPECT, DOWN};
+
+struct ReplicaRequestCost
+{
+  int input_tokens;
+  int output_tokens;   // max new tokens per beam
+  int beam_width;
+
+  ReplicaRequestCost(const int input_tokens_ = 0, const int output_tokens_ = 0, const int beam_width_ = 1)
+      : input_tokens(input_tokens_), output_tokens(output_tokens_), beam_width(beam_width_) {}
+};
+
+struct ReplicaRouterConfig
+{
+  float input_token_cost = 0.1f;      // cost of an input token, a generated token costs 1
+  int max_outstanding_requests = 64;  // per replica, route() returns -1 when every replica is full
+  int max_failures = 3;               // failures in a row that take a replica down
+  double cooldown_ms = 5000.0;        // time a replica stays down before it is probed
+  float throughput_decay = 0.8f;      // weight of the history in the throughput estimate
+  float initial_throughput = 1.0f;    // tokens per ms before the first request of a replica finishes
+};
+
+struct ReplicaStats
+{
+  ReplicaHealth health = ReplicaHealth::HEALTHY;
+  bool enabled = true;
+  int outstanding_requests = 0;
+  float outstanding_tokens = 0.0f;
+  float throughput = 0.0f;            // tokens per ms
+  long long routed_requests = 0;
+  long long completed_requests = 0;
+  long long failed_requests = 0;
+  int consecutive_failures = 0;
+  double down_since_ms = 0.0;
+};
+
+class ReplicaRouter
+{
+private:
+  ReplicaRouterConfig config_;
+  std::vector<ReplicaStats> replicas_;
+  mutable std::mutex mutex_;
+
+  void check_replica(const int replica) const
+  {
+    if (replica < 0 || replica >= (int)replicas_.size())
+    {
+      printf("[ERROR][ReplicaRouter] replica %d does not exist. \n", replica);
+      exit(-1);
+    }
+  }
+
+  /* a DOWN replica comes back as SUSPECT after the cooldown, a SUSPECT one only takes a single
+     probe request at a time */
+  bool available(ReplicaStats &replica, const double now_ms) const
+  {
+    if (!replica.enabled || replica.outstanding_requests >= config_.max_outstanding_requests)
+      return false;
+    if (replica.health == ReplicaHealth::DOWN)
+    {
+      if (now_ms - replica.down_since_ms < config_.cooldown_ms)
+        return false;
+      replica.health = ReplicaHealth::SUSPECT;
+    }
+    if (replica.health == ReplicaHealth::SUSPECT && replica.consecutive_failures > 0)
+      return replica.outstanding_requests == 0;
+    return true;
+  }
+
+public:
+  ReplicaRouter(const int replica_num, const ReplicaRouterConfig &config = ReplicaRouterConfig()) : config_(config)
+  {
+    if (replica_num <= 0 || config_.max_outstanding_requests <= 0 || config_.max_failures <= 0 ||
+        config_.initial_throughput <= 0.0f)
+    {
+      printf("[ERROR][ReplicaRouter] invalid configuration of %d replicas. \n", replica_num);
+      exit(-1);
+    }
+    replicas_.resize(replica_num);
+    for (int i = 0; i < replica_num; i++)
+      replicas_[i].throughput = config_.initial_throughput;
+  }
+
+  int replica_num() const { return (int)replicas_.size(); }
+
+  const ReplicaRouterConfig &config() const { return config_; }
+
+  float request_cost(const ReplicaRequestCost &request) const
+  {
+    return config_.input_token_cost * request.input_tokens + (float)request.output_tokens * request.beam_width;
+  }
+
+  /* Pick the replica of the request and charge it the cost, return -1 if no replica is available.
+     The earliest estimated finish wins, then the fewest outstanding requests. A replica in exclude
+     (e.g. the one that just failed the request) is only used if nothing else is available. */
+  int route(const ReplicaRequestCost &request, const double now_ms, const int exclude = -1)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const float cost = request_cost(request);
+    int best = -1;
+    float best_finish = 0.0f;
+    for (int pass = 0; pass < 2 && best < 0; pass++)
+    {
+      for (int i = 0; i < (int)replicas_.size(); i++)
+      {
+        ReplicaStats &replica = replicas_[i];
+        if ((pass == 0 && i == exclude) || !available(replica, now_ms))
+          continue;
+        const float finish = (replica.outstanding_tokens + cost) / replica.throughput;
+        if (best < 0)
+        {
+          best = i;
+          best_finish = finish;
+          continue;
+        }
+        if (finish < best_finish ||
+            (finish == best_finish && replica.outstanding_requests < replicas_[best].outstanding_requests))
+        {
+          best = i;
+          best_finish = finish;
+        }
+      }
+    }
+    if (best >= 0)
+    {
+      replicas_[best].outstanding_requests++;
+      replicas_[best].outstanding_tokens += cost;
+      replicas_[best].routed_requests++;
+    }
+    return best;
+  }
+
+  /* Release the cost charged by route(). elapsed_ms is the service time of a successful request,
+     it updates the throughput estimate of the replica. */
+  void complete(const int replica_id, const ReplicaRequestCost &request, const double now_ms,
+                const double elapsed_ms, const bool success)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check_replica(replica_id);
+    ReplicaStats &replica = replicas_[replica_id];
+    const float cost = request_cost(request);
+    replica.outstanding_requests--;
+    replica.outstanding_tokens = std::max(0.0f, replica.outstanding_tokens - cost);
+    if (success)
+    {
+      replica.completed_requests++;
+      replica.consecutive_failures = 0;
+      replica.health = ReplicaHealth::HEALTHY;
+      if (elapsed_ms > 0.0 && cost > 0.0f)
+        replica.throughput = config_.throughput_decay * replica.throughput +
+                             (1.0f - config_.throughput_decay) * (float)(cost / elapsed_ms);
+    }
+    else
+    {
+      replica.failed_requests++;
+      replica.consecutive_failures++;
+      if (replica.consecutive_failures >= config_.max_failures)
+      {
+        if (replica.health != ReplicaHealth::DOWN)
+          printf("[WARNING] replica %d is down after %d failures in a row \n", replica_id, replica.consecutive_failures);
+        replica.health = ReplicaHealth::DOWN;
+        replica.down_since_ms = now_ms;
+      }
+      else
+        replica.health = ReplicaHealth::SUSPECT;
+    }
+  }
+
+  /* a disabled replica finishes its requests but does not get new ones */
+  void set_enabled(const int replica_id, const bool enabled)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check_replica(replica_id);
+    replicas_[replica_id].enabled = enabled;
+  }
+
+  ReplicaStats stats(const int replica_id) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check_replica(replica_id);
+    return replicas_[replica_id];
+  }
+};
+
+/* A device of simulate_replicas(). It runs its requests one after the other at tokens_per_ms
+   of the real cost, and every request that finishes in [fail_from_ms, fail_until_ms) fails. */
+struct SimulatedDevice
+{
+  float tokens_per_ms;
+  double fail_from_ms;
+  double fail_until_ms;
+
+  SimulatedDevice(const float tokens_per_ms_ = 1.0f, const double fail_from_ms_ = 0.0, const double fail_until_ms_ = 0.0)
+      : tokens_per_ms(tokens_per_ms_), fail_from_ms(fail_from_ms_), fail_until_ms(fail_until_ms_) {}
+};
+
+struct SimulatedRequest
+{
+  double arrival_ms;
+  ReplicaRequestCost estimate;   // what the router sees
+  float real_tokens;             // the work done on the device, e.g. the tokens until the end id
+};
+
+struct SimulatedResult
+{
+  std::vector<int> replica;      // the replica of the last attempt of each request, -1 if rejected
+  std::vector<double> finish_ms;
+  std::vector<bool> success;
+  std::vector<double> busy_ms;   // per device
+  double makespan_ms;
+  int retried_requests;
+};
+
+/* Replay the requests through router on simulated devices, a failed request is routed again
+   (away from the failed device) at most max_retries times. */
+inline SimulatedResult simulate_replicas(ReplicaRouter &router, const std::vector<SimulatedDevice> &devices,
+                                         const std::vector<SimulatedRequest> &requests, const int max_retries = 1)
+{
+  if ((int)devices.size() != router.replica_num())
+  {
+    printf("[ERROR] simulate_replicas needs one device per replica (%d vs %d). \n",
+           (int)devices.size(), router.replica_num());
+    exit(-1);
+  }
+  struct Event
+  {
+    double time;
+    int request;
+    int replica;      // -1 for an arrival
+    double elapsed;
+    bool operator>(const Event &other) const
+    {
+      return time > other.time || (time == other.time && request > other.request);
+    }
+  };
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+  for (int i = 0; i < (int)requests.size(); i++)
+  {
+    Event arrival = {requests[i].arrival_ms, i, -1, 0.0};
+    events.push(arrival);
+  }
+
+  SimulatedResult result;
+  result.replica.assign(requests.size(), -1);
+  result.finish_ms.assign(requests.size(), 0.0);
+  result.success.assign(requests.size(), false);
+  result.busy_ms.assign(devices.size(), 0.0);
+  result.makespan_ms = 0.0;
+  result.retried_requests = 0;
+  std::vector<int> attempts(requests.size(), 0);
+  std::vector<double> device_free(devices.size(), 0.0);
+
+  while (!events.empty())
+  {
+    const Event event = events.top();
+    events.pop();
+    const SimulatedRequest &request = requests[event.request];
+    if (event.replica >= 0)
+    {
+      const SimulatedDevice &device = devices[event.replica];
+      const bool success = event.time < device.fail_from_ms || event.time >= device.fail_until_ms;
+      router.complete(event.replica, request.estimate, event.time, event.elapsed, success);
+      result.finish_ms[event.request] = event.time;
+      result.success[event.request] = success;
+      result.makespan_ms = std::max(result.makespan_ms, event.time);
+      if (success || attempts[event.request] > max_retries)
+        continue;
+      result.retried_requests++;
+    }
+
+    const int replica = router.route(request.estimate, event.time, event.replica);
+    attempts[event.request]++;
+    result.replica[event.request] = replica;
+    if (replica < 0)
+      continue;
+    const double start = std::max(event.time, device_free[replica]);
+    const double elapsed = request.real_tokens / devices[replica].tokens_per_ms;
+    device_free[replica] = start + elapsed;
+    result.busy_ms[replica] += elapsed;
+    // the router measures the service time, without the time in the queue of the device
+    Event done = {start + elapsed, event.request, replica, elapsed};
+    events.push(done);
+  }
+  return result;
+}
+
+} // namespace fastertransformer
@@ -0,0 +1,537 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Request-level latency metrics
+ *
+ * RequestMetrics keeps histograms of the queueing time, the encoder time, the
+ * time to first token, the time per output token, the request time and the
+ * tokens per second of the requests, and a few counters. Every thread records
+ * into its own shard with relaxed atomics, so recording takes no lock and the
+ * threads do not share cache lines; snapshot() sums the shards.
+ *
+ * The histograms are HDR-style: values below 2^LATENCY_SUB_BUCKET_BITS are
+ * exact, and every larger power of two is split into 2^LATENCY_SUB_BUCKET_BITS
+ * linear buckets, so a value is known within 1/16 of itself from 1 us to days.
+ *
+ * The decoding classes record into DecodingInitParam::metrics, which is
+ * nullptr by default, and then nothing is measured. DecodingMetricsTracker
+ * turns the times of the decoding steps into per-sentence metrics. It takes
+ * the time as an optional argument, so it does not depend on CUDA.
+ **/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace fastertransformer
+{
+
+enum class RequestMetric{QUEUE_TIME, ENCODE_TIME, FIRST_TOKEN_TIME, TOKEN_TIME, REQUEST_TIME, TOKENS_PER_SECOND};
+const int REQUEST_METRIC_NUM = 6;
+
+enum class RequestCounter{REQUESTS, GENERATED_TOKENS, DECODING_STEPS, BATCHES};
+const int REQUEST_COUNTER_NUM = 4;
+
+const int LATENCY_SUB_BUCKET_BITS = 4;
+const int LATENCY_SUB_BUCKET_NUM = 1 << LATENCY_SUB_BUCKET_BITS;
+const int LATENCY_MAX_BITS = 40;   // larger values are clamped, 2^40 us is 12 days
+const int LATENCY_BUCKET_NUM = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKET_NUM;
+
+inline int latency_bucket(uint64_t value)
+{
+  const uint64_t max_value = (1ULL << LATENCY_MAX_BITS) - 1;
+  if (value > max_value)
+    value = max_value;
+  if (value < (uint64_t)LATENCY_SUB_BUCKET_NUM)
+    return (int)value;
+#if defined(__GNUC__)
+  const int log2 = 63 - __builtin_clzll(value);
+#else
+  int log2 = 0;
+  while ((value >> (log2 + 1)) != 0)
+    log2++;
+#endif
+  const int shift = log2 - LATENCY_SUB_BUCKET_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKET_NUM + (int)(value >> shift) - LATENCY_SUB_BUCKET_NUM;
+}
+
+inline uint64_t latency_bucket_lower(const int bucket)
+{
+  if (bucket < LATENCY_SUB_BUCKET_NUM)
+    return (uint64_t)bucket;
+  const int shift = bucket / LATENCY_SUB_BUCKET_NUM - 1;
+  return (uint64_t)(LATENCY_SUB_BUCKET_NUM + bucket % LATENCY_SUB_BUCKET_NUM) << shift;
+}
+
+inline uint64_t latency_bucket_upper(const int bucket)
+{
+  if (bucket < LATENCY_SUB_BUCKET_NUM)
+    return (uint64_t)bucket;
+  const int shift = bucket / LATENCY_SUB_BUCKET_NUM - 1;
+  return latency_bucket_lower(bucket) + (1ULL << shift) - 1;
+}
+
+struct HistogramSnapshot
+{
+  std::vector<uint64_t> counts;   // [LATENCY_BUCKET_NUM]
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = 0;
+  uint64_t max = 0;
+
+  HistogramSnapshot() : counts(LATENCY_BUCKET_NUM, 0) {}
+
+  double mean() const { return count == 0 ? 0.0 : (double)sum / count; }
+
+  /* the highest value of the bucket of the q-quantile (at most the max), so the
+     true quantile is at most 1/16 lower */
+  uint64_t percentile(const double q) const
+  {
+    if (count == 0)
+      return 0;
+    uint64_t rank = (uint64_t)(q * count + 0.999999);
+    rank = std::min(std::max(rank, (uint64_t)1), count);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKET_NUM; i++)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(latency_bucket_upper(i), max);
+    }
+    return max;
+  }
+
+  /* number of values <= value, exact when value is the upper bound of a bucket */
+  uint64_t count_below(const uint64_t value) const
+  {
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKET_NUM && latency_bucket_upper(i) <= value; i++)
+      seen += counts[i];
+    return seen;
+  }
+
+  void merge(const HistogramSnapshot &other)
+  {
+    if (other.count == 0)
+      return;
+    for (int i = 0; i < LATENCY_BUCKET_NUM; i++)
+      counts[i] += other.counts[i];
+    min = count == 0 ? other.min : std::min(min, other.min);
+    max = count == 0 ? other.max : std::max(max, other.max);
+    count += other.count;
+    sum += other.sum;
+  }
+};
+
+/* A histogram written with relaxed atomics, see RequestMetrics for the sharding */
+class LatencyHistogram
+{
+private:
+  std::atomic<uint64_t> counts_[LATENCY_BUCKET_NUM];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+
+public:
+  LatencyHistogram() { reset(); }
+
+  /* count values equal to value */
+  void record(const uint64_t value, const uint64_t count = 1)
+  {
+    if (count == 0)
+      return;
+    counts_[latency_bucket(value)].fetch_add(count, std::memory_order_relaxed);
+    count_.fetch_add(count, std::memory_order_relaxed);
+    sum_.fetch_add(value * count, std::memory_order_relaxed);
+    uint64_t old = min_.load(std::memory_order_relaxed);
+    while (value < old && !min_.compare_exchange_weak(old, value, std::memory_order_relaxed))
+      ;
+    old = max_.load(std::memory_order_relaxed);
+    while (value > old && !max_.compare_exchange_weak(old, value, std::memory_order_relaxed))
+      ;
+  }
+
+  void add_to(HistogramSnapshot &snapshot) const
+  {
+    HistogramSnapshot shard;
+    shard.count = count_.load(std::memory_order_relaxed);
+    if (shard.count == 0)
+      return;
+    for (int i = 0; i < LATENCY_BUCKET_NUM; i++)
+      shard.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    shard.sum = sum_.load(std::memory_order_relaxed);
+    shard.min = min_.load(std::memory_order_relaxed);
+    shard.max = max_.load(std::memory_order_relaxed);
+    snapshot.merge(shard);
+  }
+
+  void reset()
+  {
+    for (int i = 0; i < LATENCY_BUCKET_NUM; i++)
+      counts_[i].store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    min_.store(UINT64_MAX, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+};
+
+struct RequestMetricInfo
+{
+  const char *name;
+  const char *help;
+  double scale;   // of the exported values, the times are recorded in us and exported in seconds
+};
+
+inline const RequestMetricInfo &request_metric_info(const RequestMetric metric)
+{
+  static const RequestMetricInfo infos[REQUEST_METRIC_NUM] = {
+      {"queue_time_seconds", "Time from the arrival of a request to the start of its batch.", 1e-6},
+      {"encode_time_seconds", "Encoder time of a request.", 1e-6},
+      {"time_to_first_token_seconds", "Time from the arrival of a request to its first generated token.", 1e-6},
+      {"time_per_output_token_seconds", "Time between two generated tokens of a request.", 1e-6},
+      {"request_time_seconds", "Time from the arrival of a request to its last generated token.", 1e-6},
+      {"request_tokens_per_second", "Generated tokens per second of a request.", 1.0}};
+  return infos[(int)metric];
+}
+
+inline const RequestMetricInfo &request_counter_info(const RequestCounter counter)
+{
+  static const RequestMetricInfo infos[REQUEST_COUNTER_NUM] = {
+      {"requests_total", "Finished requests.", 1.0},
+      {"generated_tokens_total", "Generated tokens.", 1.0},
+      {"decoding_steps_total", "Decoding steps, or passes of the speculative decoding.", 1.0},
+      {"batches_total", "Batches.", 1.0}};
+  return infos[(int)counter];
+}
+
+struct MetricsSnapshot
+{
+  HistogramSnapshot histograms[REQUEST_METRIC_NUM];
+  uint64_t counters[REQUEST_COUNTER_NUM];
+
+  MetricsSnapshot()
+  {
+    for (int i = 0; i < REQUEST_COUNTER_NUM; i++)
+      counters[i] = 0;
+  }
+
+  const HistogramSnapshot &histogram(const RequestMetric metric) const { return histograms[(int)metric]; }
+
+  uint64_t counter(const RequestCounter counter) const { return counters[(int)counter]; }
+
+  /* Prometheus text exposition format. The buckets of the histograms are the powers of two
+     (le is 2^k - 1 in us) up to the largest recorded value. */
+  std::string prometheus_text(const std::string &prefix = "fastertransformer") const
+  {
+    std::string text;
+    char line[256];
+    for (int i = 0; i < REQUEST_COUNTER_NUM; i++)
+    {
+      const RequestMetricInfo &info = request_counter_info((RequestCounter)i);
+      snprintf(line, sizeof(line), "# HELP %s_%s %s\n# TYPE %s_%s counter\n%s_%s %llu\n",
+               prefix.c_str(), info.name, info.help, prefix.c_str(), info.name,
+               prefix.c_str(), info.name, (unsigned long long)counters[i]);
+      text += line;
+    }
+    for (int i = 0; i < REQUEST_METRIC_NUM; i++)
+    {
+      const RequestMetricInfo &info = request_metric_info((RequestMetric)i);
+      const HistogramSnapshot &h = histograms[i];
+      const std::string name = prefix + "_" + info.name;
+      snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name.c_str(), info.help, name.c_str());
+      text += line;
+      for (int k = 1; k <= LATENCY_MAX_BITS; k++)
+      {
+        const uint64_t le = (1ULL << k) - 1;
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name.c_str(), le * info.scale,
+                 (unsigned long long)h.count_below(le));
+        text += line;
+        if (le >= h.max)
+          break;
+      }
+      snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+               name.c_str(), (unsigned long long)h.count, name.c_str(), h.sum * info.scale,
+               name.c_str(), (unsigned long long)h.count);
+      text += line;
+    }
+    return text;
+  }
+
+  void print() const
+  {
+    static const char *names[REQUEST_METRIC_NUM] = {"queue (us)", "encode (us)", "first token (us)",
+                                                    "per token (us)", "request (us)", "tokens/s"};
+    printf("[INFO] %llu requests, %llu generated tokens, %llu decoding steps, %llu batches \n",
+           (unsigned long long)counters[0], (unsigned long long)counters[1],
+           (unsigned long long)counters[2], (unsigned long long)counters[3]);
+    for (int i = 0; i < REQUEST_METRIC_NUM; i++)
+    {
+      const HistogramSnapshot &h = histograms[i];
+      if (h.count == 0)
+        continue;
+      printf("[INFO] %-18s count %10llu mean %12.1f p50 %10llu p90 %10llu p99 %10llu max %10llu \n", names[i],
+             (unsigned long long)h.count, h.mean(), (unsigned long long)h.percentile(0.5),
+             (unsigned long long)h.percentile(0.9), (unsigned long long)h.percentile(0.99),
+             (unsigned long long)h.max);
+    }
+  }
+};
+
+class RequestMetrics
+{
+private:
+  struct Shard
+  {
+    LatencyHistogram histograms[REQUEST_METRIC_NUM];
+    std::atomic<uint64_t> counters[REQUEST_COUNTER_NUM];
+    char padding[64];   // the counters do not share a cache line with the next shard
+  };
+
+  const int shard_num_;
+  std::unique_ptr<Shard[]> shards_;
+
+  /* threads take the shards round robin, a thread always writes the same shard */
+  Shard &shard() const
+  {
+    static std::atomic<int> thread_num(0);
+    thread_local int thread_id = thread_num.fetch_add(1, std::memory_order_relaxed);
+    return shards_[thread_id % shard_num_];
+  }
+
+public:
+  explicit RequestMetrics(const int shard_num = 16) : shard_num_(shard_num)
+  {
+    if (shard_num_ <= 0)
+    {
+      printf("[ERROR][RequestMetrics] shard_num should be positive, but get %d. \n", shard_num_);
+      exit(-1);
+    }
+    shards_.reset(new Shard[shard_num_]);
+    reset();
+  }
+
+  RequestMetrics(const RequestMetrics &) = delete;
+  RequestMetrics &operator=(const RequestMetrics &) = delete;
+
+  static int64_t now_us()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(const RequestMetric metric, const uint64_t value, const uint64_t count = 1)
+  {
+    shard().histograms[(int)metric].record(value, count);
+  }
+
+  void add(const RequestCounter counter, const uint64_t value = 1)
+  {
+    shard().counters[(int)counter].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  /* the records that run concurrently may be missed, or only partly seen */
+  MetricsSnapshot snapshot() const
+  {
+    MetricsSnapshot snapshot;
+    for (int s = 0; s < shard_num_; s++)
+    {
+      for (int i = 0; i < REQUEST_METRIC_NUM; i++)
+        shards_[s].histograms[i].add_to(snapshot.histograms[i]);
+      for (int i = 0; i < REQUEST_COUNTER_NUM; i++)
+        snapshot.counters[i] += shards_[s].counters[i].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+  std::string prometheus_text(const std::string &prefix = "fastertransformer") const
+  {
+    return snapshot().prometheus_text(prefix);
+  }
+
+  void reset()
+  {
+    for (int s = 0; s < shard_num_; s++)
+    {
+      for (int i = 0; i < REQUEST_METRIC_NUM; i++)
+        shards_[s].histograms[i].reset();
+      for (int i = 0; i < REQUEST_COUNTER_NUM; i++)
+        shards_[s].counters[i].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+/**
+ * Per-sentence metrics of a decoding batch. begin() at the start of forward, step() after
+ * every step with the finished flags and end() at the end. A sentence gets its time to first
+ * token at the first step it generates a token, its time per output token at the later steps,
+ * and its request time and tokens per second at the step it finishes (or at end()). Every
+ * call returns at once if the metrics are disabled. The times default to now.
+ **/
+class DecodingMetricsTracker
+{
+private:
+  RequestMetrics *metrics_;
+  const int batch_size_;
+  const int beam_width_;
+  int64_t start_us_;
+  int64_t origin_us_;
+  int64_t last_us_;
+  std::vector<int> tokens_;
+  std::vector<bool> done_;
+
+  static int64_t resolve(const int64_t now_us) { return now_us < 0 ? RequestMetrics::now_us() : now_us; }
+
+  void finish(const int sentence, const int64_t now_us)
+  {
+    done_[sentence] = true;
+    const uint64_t elapsed = now_us > origin_us_ ? (uint64_t)(now_us - origin_us_) : 0;
+    metrics_->record(RequestMetric::REQUEST_TIME, elapsed);
+    if (tokens_[sentence] > 0 && elapsed > 0)
+      metrics_->record(RequestMetric::TOKENS_PER_SECOND, (uint64_t)(tokens_[sentence] * 1e6 / elapsed + 0.5));
+    metrics_->add(RequestCounter::REQUESTS);
+  }
+
+  /* step_tokens(b) tokens are generated by sentence b in steps steps, finished(b) after them */
+  template <typename Finished, typename StepTokens>
+  void update(const int64_t now_us, Finished finished, StepTokens step_tokens, const int steps)
+  {
+    const uint64_t elapsed = now_us > last_us_ ? (uint64_t)(now_us - last_us_) : 0;
+    const uint64_t first_token = now_us > origin_us_ ? (uint64_t)(now_us - origin_us_) : 0;
+    uint64_t first_num = 0;
+    uint64_t single_num = 0;
+    uint64_t generated = 0;
+    for (int b = 0; b < batch_size_; b++)
+    {
+      if (done_[b])
+        continue;
+      const int num = step_tokens(b);
+      if (num > 0)
+      {
+        if (tokens_[b] == 0)
+        {
+          // the other tokens of the first step come with the first one
+          first_num++;
+          metrics_->record(RequestMetric::TOKEN_TIME, 0, num - 1);
+        }
+        else if (num == 1)
+          single_num++;
+        else
+          metrics_->record(RequestMetric::TOKEN_TIME, elapsed / num, num);
+        tokens_[b] += num;
+        generated += num;
+      }
+      if (finished(b))
+        finish(b, now_us);
+    }
+    // most sentences generate one token per step, they share a record
+    metrics_->record(RequestMetric::FIRST_TOKEN_TIME, first_token, first_num);
+    metrics_->record(RequestMetric::TOKEN_TIME, elapsed, single_num);
+    metrics_->add(RequestCounter::GENERATED_TOKENS, generated);
+    metrics_->add(RequestCounter::DECODING_STEPS, steps);
+    last_us_ = now_us;
+  }
+
+public:
+  DecodingMetricsTracker(const int batch_size, const int beam_width = 1) : metrics_(nullptr),
+                                                                           batch_size_(batch_size),
+                                                                           beam_width_(beam_width),
+                                                                           start_us_(0),
+                                                                           origin_us_(0),
+                                                                           last_us_(0),
+                                                                           tokens_(batch_size, 0),
+                                                                           done_(batch_size, false)
+  {
+  }
+
+  bool enabled() const { return metrics_ != nullptr; }
+
+  /* the time begin() was called */
+  int64_t start_us() const { return start_us_; }
+
+  /* enqueue_us is the arrival of the batch, the origin of the time to first token and of the
+     request time, 0 for now */
+  void begin(RequestMetrics *metrics, const int64_t enqueue_us = 0, const int64_t now_us = -1)
+  {
+    metrics_ = metrics;
+    if (metrics_ == nullptr)
+      return;
+    start_us_ = resolve(now_us);
+    origin_us_ = enqueue_us > 0 && enqueue_us <= start_us_ ? enqueue_us : start_us_;
+    last_us_ = start_us_;
+    std::fill(tokens_.begin(), tokens_.end(), 0);
+    std::fill(done_.begin(), done_.end(), false);
+    metrics_->add(RequestCounter::BATCHES);
+  }
+
+  /* finished is [batch_size, beam_width] on the host, a sentence is finished when all its
+     beams are. Every unfinished sentence generated one token. */
+  void step(const bool *finished, const int64_t now_us = -1)
+  {
+    if (metrics_ == nullptr)
+      return;
+    const int beam_width = beam_width_;
+    update(resolve(now_us),
+           [finished, beam_width](const int b) {
+             for (int i = 0; i < beam_width; i++)
+               if (!finished[b * beam_width + i])
+                 return false;
+             return true;
+           },
+           [](const int) { return 1; }, 1);
+  }
+
+  /* a pass in which sentence b generated step_tokens[b] tokens, e.g. accepted drafts */
+  void step(const std::vector<bool> &finished, const std::vector<int> &step_tokens, const int64_t now_us = -1)
+  {
+    if (metrics_ == nullptr)
+      return;
+    update(resolve(now_us),
+           [&finished](const int b) { return (bool)finished[b]; },
+           [&step_tokens](const int b) { return step_tokens[b]; }, 1);
+  }
+
+  /* every unfinished sentence generated tokens tokens in steps steps, when the steps are not
+     seen one by one */
+  void step_all(const int tokens, const int steps, const int64_t now_us = -1)
+  {
+    if (metrics_ == nullptr)
+      return;
+    update(resolve(now_us), [](const int) { return false; }, [tokens](const int) { return tokens; }, steps);
+  }
+
+  /* the unfinished sentences stop, e.g. at the maximal length */
+  void end(const int64_t now_us = -1)
+  {
+    if (metrics_ == nullptr)
+      return;
+    const int64_t now = resolve(now_us);
+    for (int b = 0; b < batch_size_; b++)
+      if (!done_[b])
+        finish(b, now);
+    metrics_ = nullptr;
+  }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Shared memory front end of a serving process
+ *
+ * The serving process creates a ShmServer, the client processes (any
+ * language that can map the segment and use the layout below) attach with a
+ * ShmClient. Every client takes a channel of the segment: a request ring it
+ * produces and a response ring the server produces, see ShmRing. The client
+ * writes the payload of a request (token ids, tensors, ...) in place in the
+ * ring and rings the doorbell of the server; the server reads the payloads
+ * in place, e.g. ChunkedPrefillScheduler::add_sequence takes the prompt from
+ * the ring, or a batch of encoder inputs is copied to the device from it,
+ * and releases the requests once the engine does not need them.
+ *
+ * collect() gathers the waiting requests of all the channels into a batch,
+ * it sleeps on the doorbell while there is none. The server may register
+ * the segment with cudaHostRegister so that the copies of the payloads to
+ * the device are asynchronous. A channel is reused after its client
+ * detached or died, once the server holds none of its requests. A server
+ * waiting for space in a response ring checks that the client is alive
+ * every SHM_FRONTEND_LIVENESS_US and gives up at its timeout, so a client
+ * that stopped reading its responses does not stall the serving loop.
+ *
+ * Layout: ShmFrontendHeader, channel_num ShmChannelHeader, then for every
+ * channel the request ring and the response ring of ring_bytes each.
+ **/
+
+#pragma once
+#include "fastertransformer/shm_ring.h"
+#include <algorithm>
+#include <signal.h>
+#include <vector>
+
+namespace fastertransformer
+{
+
+struct ShmFrontendConfig
+{
+  int channel_num = 16;            // clients at once
+  uint32_t ring_bytes = 1 << 20;   // of each ring, a multiple of 64
+};
+
+static const uint32_t SHM_FRONTEND_MAGIC = 0x46545348u;   // "FTSH"
+static const uint32_t SHM_FRONTEND_VERSION = 1;
+static const int64_t SHM_FRONTEND_RESPONSE_TIMEOUT_US = 1000000;   // default wait of ShmServer::respond
+static const int64_t SHM_FRONTEND_LIVENESS_US = 10000;   // period of the client checks of a waiting server
+
+enum ShmChannelState : uint32_t
+{
+  SHM_CHANNEL_FREE = 0,
+  SHM_CHANNEL_ATTACHED = 1,
+  SHM_CHANNEL_DETACHED = 2   // the server resets it before it is free again
+};
+
+struct ShmFrontendHeader
+{
+  std::atomic<uint32_t> magic;   // set last, once the segment is formatted
+  uint32_t version;
+  uint32_t channel_num;
+  uint32_t ring_bytes;
+  alignas(64) ShmNotifier doorbell;   // the server sleeps on it, the clients notify it
+};
+
+struct ShmChannelHeader
+{
+  alignas(64) std::atomic<uint32_t> state;
+  std::atomic<int32_t> pid;
+};
+
+/* a request read in place, valid until the server releases it */
+struct ShmRequest
+{
+  int channel;
+  uint32_t type;
+  uint64_t tag;
+  const void *payload;
+  uint32_t size;
+  const ShmMessage *message;
+};
+
+inline size_t shm_frontend_bytes(const ShmFrontendConfig &config)
+{
+  return sizeof(ShmFrontendHeader) + sizeof(ShmChannelHeader) * config.channel_num +
+         2 * ShmRing::bytes(config.ring_bytes) * config.channel_num;
+}
+
+inline void *shm_frontend_ring(void *base, const uint32_t channel_num, const uint32_t ring_bytes,
+                               const int channel, const bool response)
+{
+  return (char *)base + sizeof(ShmFrontendHeader) + sizeof(ShmChannelHeader) * channel_num +
+         ShmRing::bytes(ring_bytes) * (2 * channel + (response ? 1 : 0));
+}
+
+class ShmServer
+{
+private:
+  const ShmFrontendConfig config_;
+  ShmSegment segment_;
+  ShmFrontendHeader *header_;
+  ShmChannelHeader *channels_;
+  std::vector<ShmRing> requests_;
+  std::vector<ShmRing> responses_;
+  std::vector<int> held_;    // requests read and not released, per channel
+  int next_channel_;         // round robin start of collect
+
+  bool any_readable()
+  {
+    for (int c = 0; c < config_.channel_num; c++)
+    {
+      if (channels_[c].state.load() == SHM_CHANNEL_ATTACHED && requests_[c].readable())
+        return true;
+    }
+    return false;
+  }
+
+  /* the client of an attached channel detached or died */
+  bool client_gone(const int c) const
+  {
+    const uint32_t state = channels_[c].state.load();
+    if (state == SHM_CHANNEL_DETACHED)
+      return true;
+    const int32_t pid = channels_[c].pid.load();
+    return state == SHM_CHANNEL_ATTACHED && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+  }
+
+  /* a channel whose client is gone and with no held request is emptied and freed */
+  void reclaim(const int c)
+  {
+    if (channels_[c].state.load() == SHM_CHANNEL_FREE || held_[c] > 0 || !client_gone(c))
+      return;
+    ShmRing::format(shm_frontend_ring(segment_.base(), config_.channel_num, config_.ring_bytes, c, false));
+    ShmRing::format(shm_frontend_ring(segment_.base(), config_.channel_num, config_.ring_bytes, c, true));
+    requests_[c] = ShmRing(shm_frontend_ring(segment_.base(), config_.channel_num, config_.ring_bytes, c, false),
+                           config_.ring_bytes);
+    responses_[c] = ShmRing(shm_frontend_ring(segment_.base(), config_.channel_num, config_.ring_bytes, c, true),
+                            config_.ring_bytes);
+    channels_[c].pid.store(0);
+    channels_[c].state.store(SHM_CHANNEL_FREE);
+  }
+
+  void reclaim()
+  {
+    for (int c = 0; c < config_.channel_num; c++)
+      reclaim(c);
+  }
+
+public:
+  ShmServer(const std::string &name, const ShmFrontendConfig &config) : config_(config),
+                                                                        segment_(name, shm_frontend_bytes(config)),
+                                                                        held_(config.channel_num, 0),
+                                                                        next_channel_(0)
+  {
+    if (config.channel_num <= 0 || config.ring_bytes < 128 || config.ring_bytes % 64 != 0)
+    {
+      printf("[ERROR][ShmServer] channel_num should be positive and ring_bytes a multiple of 64 (get %d and %u). \n",
+             config.channel_num, config.ring_bytes);
+      exit(-1);
+    }
+    header_ = new (segment_.base()) ShmFrontendHeader();
+    header_->version = SHM_FRONTEND_VERSION;
+    header_->channel_num = config.channel_num;
+    header_->ring_bytes = config.ring_bytes;
+    header_->doorbell.sequence.store(0);
+    header_->doorbell.waiters.store(0);
+    channels_ = (ShmChannelHeader *)(header_ + 1);
+    for (int c = 0; c < config.channel_num; c++)
+    {
+      new (channels_ + c) ShmChannelHeader();
+      channels_[c].state.store(SHM_CHANNEL_FREE);
+      channels_[c].pid.store(0);
+      void *request_ring = shm_frontend_ring(segment_.base(), config.channel_num, config.ring_bytes, c, false);
+      void *response_ring = shm_frontend_ring(segment_.base(), config.channel_num, config.ring_bytes, c, true);
+      ShmRing::format(request_ring);
+      ShmRing::format(response_ring);
+      requests_.push_back(ShmRing(request_ring, config.ring_bytes));
+      responses_.push_back(ShmRing(response_ring, config.ring_bytes));
+    }
+    header_->magic.store(SHM_FRONTEND_MAGIC, std::memory_order_release);
+  }
+
+  ShmServer(const ShmServer &) = delete;
+  ShmServer &operator=(const ShmServer &) = delete;
+
+  const ShmSegment &segment() const { return segment_; }
+
+  int attached_num() const
+  {
+    int num = 0;
+    for (int c = 0; c < config_.channel_num; c++)
+      num += channels_[c].state.load() == SHM_CHANNEL_ATTACHED;
+    return num;
+  }
+
+  /**
+   * Append at most max_requests waiting requests to requests, the channels in turn, and
+   * return their number. Without a waiting request, sleep up to timeout_us for one.
+   **/
+  int collect(std::vector<ShmRequest> &requests, const int max_requests, const int64_t timeout_us)
+  {
+    reclaim();
+    header_->doorbell.wait([&]() { return any_readable(); }, timeout_us);
+    int num = 0;
+    bool progress = true;
+    // one request of every channel per round, a busy client does not starve the others
+    while (num < max_requests && progress)
+    {
+      progress = false;
+      for (int i = 0; i < config_.channel_num && num < max_requests; i++)
+      {
+        const int c = (next_channel_ + i) % config_.channel_num;
+        if (channels_[c].state.load() != SHM_CHANNEL_ATTACHED)
+          continue;
+        const ShmMessage *message = requests_[c].next();
+        if (message == nullptr)
+          continue;
+        ShmRequest request = {c, message->type, message->tag, message->payload(), message->size, message};
+        requests.push_back(request);
+        held_[c]++;
+        num++;
+        progress = true;
+      }
+    }
+    next_channel_ = (next_channel_ + 1) % config_.channel_num;
+    return num;
+  }
+
+  /* the requests of a channel are released in the order they were collected */
+  void release(const ShmRequest &request)
+  {
+    requests_[request.channel].release(request.message);
+    held_[request.channel]--;
+  }
+
+  /**
+   * The payload of a response of size bytes written in place, nullptr if the client is gone or at the
+   * timeout (negative waits as long as the client is alive). A full ring is waited for in slices of
+   * SHM_FRONTEND_LIVENESS_US, the channel of a client that died meanwhile is reclaimed.
+   **/
+  void *reserve_response(const int channel, const uint32_t size, const int64_t timeout_us)
+  {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_us);
+    while (channels_[channel].state.load() == SHM_CHANNEL_ATTACHED && !client_gone(channel))
+    {
+      int64_t slice_us = SHM_FRONTEND_LIVENESS_US;
+      if (timeout_us >= 0)
+      {
+        const int64_t left_us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+        slice_us = std::max<int64_t>(0, std::min(slice_us, left_us));
+      }
+      void *payload = responses_[channel].reserve(size, slice_us);
+      if (payload != nullptr)
+        return payload;
+      if (timeout_us >= 0 && Clock::now() >= deadline)
+        return nullptr;
+    }
+    reclaim(channel);
+    return nullptr;
+  }
+
+  void commit_response(const int channel, const uint32_t type, const uint64_t tag)
+  {
+    responses_[channel].commit(type, tag);
+  }
+
+  /* copy a response, false if the client is gone or at the timeout */
+  bool respond(const int channel, const uint32_t type, const uint64_t tag, const void *payload, const uint32_t size,
+               const int64_t timeout_us = SHM_FRONTEND_RESPONSE_TIMEOUT_US)
+  {
+    void *out = reserve_response(channel, size, timeout_us);
+    if (out == nullptr)
+      return false;
+    memcpy(out, payload, size);
+    commit_response(channel, type, tag);
+    return true;
+  }
+};
+
+class ShmClient
+{
+private:
+  ShmSegment segment_;
+  ShmFrontendHeader *header_;
+  ShmChannelHeader *channel_header_;
+  int channel_;
+  ShmRing *requests_;
+  ShmRing *responses_;
+
+public:
+  /* attach to the server of the segment name, std::runtime_error if every channel is taken */
+  explicit ShmClient(const std::string &name) : segment_(name), requests_(nullptr), responses_(nullptr)
+  {
+    header_ = (ShmFrontendHeader *)segment_.base();
+    if (segment_.bytes() < sizeof(ShmFrontendHeader) ||
+        header_->magic.load(std::memory_order_acquire) != SHM_FRONTEND_MAGIC ||
+        header_->version != SHM_FRONTEND_VERSION)
+      throw std::runtime_error("[FT][ERROR] " + name + " is not a ready shared memory front end. ");
+    ShmChannelHeader *channels = (ShmChannelHeader *)(header_ + 1);
+    channel_ = -1;
+    for (uint32_t c = 0; c < header_->channel_num && channel_ < 0; c++)
+    {
+      uint32_t state = SHM_CHANNEL_FREE;
+      if (channels[c].state.compare_exchange_strong(state, SHM_CHANNEL_ATTACHED))
+        channel_ = (int)c;
+    }
+    if (channel_ < 0)
+      throw std::runtime_error("[FT][ERROR] every channel of " + name + " is taken. ");
+    channel_header_ = channels + channel_;
+    channel_header_->pid.store((int32_t)getpid());
+    requests_ = new ShmRing(shm_frontend_ring(segment_.base(), header_->channel_num, header_->ring_bytes, channel_, false),
+                            header_->ring_bytes);
+    responses_ = new ShmRing(shm_frontend_ring(segment_.base(), header_->channel_num, header_->ring_bytes, channel_, true),
+                             header_->ring_bytes);
+  }
+
+  ShmClient(const ShmClient &) = delete;
+  ShmClient &operator=(const ShmClient &) = delete;
+
+  int channel() const { return channel_; }
+
+  uint32_t max_payload() const { return ShmRing::max_payload(header_->ring_bytes); }
+
+  /* the payload of a request of size bytes to write in place, nullptr at the timeout */
+  void *reserve(const uint32_t size, const int64_t timeout_us = -1) { return requests_->reserve(size, timeout_us); }
+
+  /* send the reserved request and wake the server */
+  void submit(const uint32_t type, const uint64_t tag)
+  {
+    requests_->commit(type, tag);
+    header_->doorbell.notify();
+  }
+
+  /* the next response, read in place until release, nullptr at the timeout */
+  const ShmMessage *next_response(const int64_t timeout_us = -1) { return responses_->next(timeout_us); }
+
+  void release(const ShmMessage *response) { responses_->release(response); }
+
+  ~ShmClient()
+  {
+    delete requests_;
+    delete responses_;
+    channel_header_->state.store(SHM_CHANNEL_DETACHED);
+    header_->doorbell.notify();
+  }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Message ring in POSIX shared memory
+ *
+ * ShmSegment maps a named shared memory object. ShmRing is a single producer,
+ * single consumer ring of messages inside it, usable from two processes. A
+ * message is a ShmMessage header and its payload, contiguous in the ring (a
+ * wrap marker skips the end of the ring), so the producer writes the payload
+ * in place between reserve() and commit(), and the consumer reads it in place
+ * until release(). The consumer can hold several messages and releases them
+ * in order.
+ *
+ * The positions are atomics in the segment. A side that finds the ring empty
+ * or full sleeps on a futex word of the other side, which is woken only when
+ * the sleeper announced itself, so a busy ring costs no system call.
+ * Linux only, it does not depend on CUDA.
+ **/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace fastertransformer
+{
+
+/* sleep while *word == expected, at most timeout_us (negative waits without limit) */
+inline void futex_wait(std::atomic<uint32_t> *word, const uint32_t expected, const int64_t timeout_us)
+{
+  struct timespec timeout;
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+  // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected,
+          timeout_us < 0 ? nullptr : &timeout, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t> *word)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * A futex word with a waiter flag: notify() is a system call only when a waiter announced
+ * itself, wait() returns when the condition holds, after a notify or at the timeout.
+ **/
+struct ShmNotifier
+{
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> waiters;
+
+  void notify()
+  {
+    sequence.fetch_add(1);
+    if (waiters.load() != 0)
+      futex_wake(&sequence);
+  }
+
+  /* return ready() */
+  template <typename Ready>
+  bool wait(Ready ready, const int64_t timeout_us)
+  {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_us);
+    while (true)
+    {
+      const uint32_t seen = sequence.load();
+      if (ready())
+        return true;
+      int64_t left_us = -1;
+      if (timeout_us >= 0)
+      {
+        left_us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+        if (left_us <= 0)
+          return false;
+      }
+      waiters.fetch_add(1);
+      // a notify between the load of seen and the wait changes the sequence, the wait returns at once
+      if (!ready())
+        futex_wait(&sequence, seen, left_us);
+      waiters.fetch_sub(1);
+    }
+  }
+};
+
+/* a named shared memory object, created (and unlinked at destruction) or opened */
+class ShmSegment
+{
+private:
+  std::string name_;
+  void *base_;
+  size_t bytes_;
+  bool owner_;
+
+  static std::runtime_error error(const std::string &what, const std::string &name)
+  {
+    return std::runtime_error("[FT][ERROR] " + what + " " + name + ": " + strerror(errno));
+  }
+
+public:
+  /* create the object, it should not exist, the memory is zeroed */
+  ShmSegment(const std::string &name, const size_t bytes) : name_(name), base_(nullptr), bytes_(bytes), owner_(true)
+  {
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      throw error("shm_open failed to create", name);
+    if (ftruncate(fd, (off_t)bytes) != 0)
+    {
+      close(fd);
+      shm_unlink(name.c_str());
+      throw error("ftruncate failed on", name);
+    }
+    base_ = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED)
+    {
+      shm_unlink(name.c_str());
+      throw error("mmap failed on", name);
+    }
+  }
+
+  /* open an existing object */
+  explicit ShmSegment(const std::string &name) : name_(name), base_(nullptr), bytes_(0), owner_(false)
+  {
+    const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0)
+      throw error("shm_open failed to open", name);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throw error("fstat failed on", name);
+    }
+    bytes_ = (size_t)st.st_size;
+    base_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED)
+      throw error("mmap failed on", name);
+  }
+
+  ShmSegment(const ShmSegment &) = delete;
+  ShmSegment &operator=(const ShmSegment &) = delete;
+
+  void *base() const { return base_; }
+  size_t bytes() const { return bytes_; }
+  const std::string &name() const { return name_; }
+
+  ~ShmSegment()
+  {
+    munmap(base_, bytes_);
+    if (owner_)
+      shm_unlink(name_.c_str());
+  }
+};
+
+struct ShmMessage
+{
+  uint32_t size;   // bytes of the payload
+  uint32_t type;
+  uint64_t tag;
+
+  void *payload() { return this + 1; }
+  const void *payload() const { return this + 1; }
+};
+
+/* the shared part of a ring, the producer and consumer positions on their own cache lines */
+struct ShmRingControl
+{
+  alignas(64) std::atomic<uint64_t> head;   // end of the committed messages, written by the producer
+  ShmNotifier readable;                      // the consumer sleeps on it
+  alignas(64) std::atomic<uint64_t> tail;   // end of the released messages, written by the consumer
+  ShmNotifier writable;                      // the producer sleeps on it
+};
+
+class ShmRing
+{
+private:
+  static const uint32_t WRAP = 0xffffffffu;
+  static const uint64_t ALIGN = 64;
+
+  ShmRingControl *control_;
+  char *data_;
+  uint64_t capacity_;
+  uint64_t reserved_;        // producer: position of the reserved message, or -1
+  uint32_t reserved_size_;
+  uint64_t read_;            // consumer: position of the next message to read
+
+  static uint64_t record_bytes(const uint32_t size)
+  {
+    return (sizeof(ShmMessage) + size + ALIGN - 1) / ALIGN * ALIGN;
+  }
+
+  ShmMessage *at(const uint64_t position) const { return (ShmMessage *)(data_ + position % capacity_); }
+
+public:
+  /* bytes of a ring of capacity bytes, capacity should be a multiple of 64 */
+  static size_t bytes(const uint64_t capacity) { return sizeof(ShmRingControl) + capacity; }
+
+  /* the largest payload of a ring */
+  static uint32_t max_payload(const uint64_t capacity) { return (uint32_t)(capacity - sizeof(ShmMessage)); }
+
+  /* initialize the ring at base, once, before the producer and the consumer attach */
+  static void format(void *base)
+  {
+    ShmRingControl *control = new (base) ShmRingControl();
+    control->head.store(0);
+    control->tail.store(0);
+    control->readable.sequence.store(0);
+    control->readable.waiters.store(0);
+    control->writable.sequence.store(0);
+    control->writable.waiters.store(0);
+  }
+
+  ShmRing(void *base, const uint64_t capacity) : control_((ShmRingControl *)base),
+                                                 data_((char *)base + sizeof(ShmRingControl)),
+                                                 capacity_(capacity),
+                                                 reserved_((uint64_t)-1),
+                                                 reserved_size_(0)
+  {
+    if (capacity == 0 || capacity % ALIGN != 0)
+    {
+      printf("[ERROR][ShmRing] the capacity should be a positive multiple of %d (get %llu). \n",
+             (int)ALIGN, (unsigned long long)capacity);
+      exit(-1);
+    }
+    read_ = control_->tail.load(std::memory_order_acquire);
+  }
+
+  uint64_t capacity() const { return capacity_; }
+
+  /* producer: the payload of a message of size bytes, written in place, nullptr if the ring is full */
+  void *reserve(const uint32_t size)
+  {
+    const uint64_t record = record_bytes(size);
+    if (size > max_payload(capacity_))
+    {
+      printf("[ERROR][ShmRing] a payload of %u bytes does not fit in a ring of %llu bytes. \n",
+             size, (unsigned long long)capacity_);
+      exit(-1);
+    }
+    const uint64_t head = control_->head.load(std::memory_order_relaxed);
+    const uint64_t tail = control_->tail.load(std::memory_order_acquire);
+    // a message does not wrap, the end of the ring is skipped when it is too short
+    const uint64_t left = capacity_ - head % capacity_;
+    const uint64_t skip = left < record ? left : 0;
+    if (head + skip + record - tail > capacity_)
+      return nullptr;
+    if (skip > 0)
+      at(head)->size = WRAP;
+    reserved_ = head + skip;
+    reserved_size_ = size;
+    return at(reserved_)->payload();
+  }
+
+  /* producer: wait for the space of a message, nullptr at the timeout */
+  void *reserve(const uint32_t size, const int64_t timeout_us)
+  {
+    void *payload = nullptr;
+    control_->writable.wait([&]() { return (payload = reserve(size)) != nullptr; }, timeout_us);
+    return payload;
+  }
+
+  /* producer: publish the reserved message */
+  void commit(const uint32_t type, const uint64_t tag)
+  {
+    if (reserved_ == (uint64_t)-1)
+    {
+      printf("[ERROR][ShmRing] commit without reserve. \n");
+      exit(-1);
+    }
+    ShmMessage *message = at(reserved_);
+    message->size = reserved_size_;
+    message->type = type;
+    message->tag = tag;
+    control_->head.store(reserved_ + record_bytes(reserved_size_), std::memory_order_release);
+    reserved_ = (uint64_t)-1;
+    control_->readable.notify();
+  }
+
+  /* consumer: the next message, nullptr if there is none, it stays valid until it is released */
+  const ShmMessage *next()
+  {
+    const uint64_t head = control_->head.load(std::memory_order_acquire);
+    if (read_ == head)
+      return nullptr;
+    if (at(read_)->size == WRAP)
+    {
+      read_ += capacity_ - read_ % capacity_;
+      if (read_ == head)
+        return nullptr;
+    }
+    const ShmMessage *message = at(read_);
+    read_ += record_bytes(message->size);
+    return message;
+  }
+
+  /* consumer: wait for the next message, nullptr at the timeout */
+  const ShmMessage *next(const int64_t timeout_us)
+  {
+    const ShmMessage *message = nullptr;
+    control_->readable.wait([&]() { return (message = next()) != nullptr; }, timeout_us);
+    return message;
+  }
+
+  /* consumer: true if next() returns a message */
+  bool readable() const
+  {
+    return read_ != control_->head.load(std::memory_order_acquire);
+  }
+
+  /* consumer: give message and the messages read before it back to the producer */
+  void release(const ShmMessage *message)
+  {
+    const uint64_t offset = (uint64_t)((const char *)message - data_);
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    // the position of the message is the first one after the tail with its offset
+    uint64_t position = tail - tail % capacity_ + offset;
+    if (position < tail)
+      position += capacity_;
+    control_->tail.store(position + record_bytes(message->size), std::memory_order_release);
+    control_->writable.notify();
+  }
+
+  /* consumer: drop every message, read or not */
+  void release_all()
+  {
+    read_ = control_->head.load(std::memory_order_acquire);
+    control_->tail.store(read_, std::memory_order_release);
+    control_->writable.notify();
+  }
+};
+
+} // namespace fastertransformer
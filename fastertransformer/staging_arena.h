@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Bookkeeping of the pinned staging pool
+ *
+ * StagingArena hands out aligned ranges of a fixed size arena by first fit and
+ * coalesces them when they are freed. A range used by an asynchronous copy is
+ * freed with a fence, and it is only reused after reclaim() sees that the fence
+ * is done. StagingHeap is a list of arenas that grows by one arena when none
+ * has room, so one pool serves every op of a device. Both work on offsets and
+ * do not depend on CUDA.
+ **/
+
+#pragma once
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+#define STAGING_ALIGNMENT 256
+
+inline size_t staging_aligned_size(const size_t bytes)
+{
+  return (bytes + STAGING_ALIGNMENT - 1) / STAGING_ALIGNMENT * STAGING_ALIGNMENT;
+}
+
+class StagingArena
+{
+private:
+  size_t capacity_;
+  size_t used_bytes_;
+  size_t pending_bytes_;
+  size_t peak_bytes_;
+  std::map<size_t, size_t> free_blocks_;       // offset -> size
+  std::map<size_t, size_t> allocated_blocks_;  // offset -> size
+  std::deque<std::pair<size_t, unsigned long long>> pending_blocks_; // (offset, fence)
+
+  void insert_free_block(size_t offset, size_t size)
+  {
+    std::map<size_t, size_t>::iterator next = free_blocks_.lower_bound(offset);
+    if (next != free_blocks_.end() && offset + size == next->first)
+    {
+      size += next->second;
+      next = free_blocks_.erase(next);
+    }
+    if (next != free_blocks_.begin())
+    {
+      std::map<size_t, size_t>::iterator prev = next;
+      --prev;
+      if (prev->first + prev->second == offset)
+      {
+        prev->second += size;
+        return;
+      }
+    }
+    free_blocks_[offset] = size;
+  }
+
+  size_t take_allocated_block(const size_t offset)
+  {
+    std::map<size_t, size_t>::iterator it = allocated_blocks_.find(offset);
+    if (it == allocated_blocks_.end())
+    {
+      printf("[ERROR][StagingArena] offset %zu is not allocated. \n", offset);
+      exit(-1);
+    }
+    size_t size = it->second;
+    allocated_blocks_.erase(it);
+    return size;
+  }
+
+public:
+  StagingArena(const size_t capacity) : capacity_(capacity / STAGING_ALIGNMENT * STAGING_ALIGNMENT),
+                                        used_bytes_(0), pending_bytes_(0), peak_bytes_(0)
+  {
+    if (capacity_ > 0)
+      free_blocks_[0] = capacity_;
+  }
+
+  /* first fit, return false if no free range is large enough */
+  bool allocate(const size_t bytes, size_t &offset)
+  {
+    const size_t size = staging_aligned_size(bytes == 0 ? 1 : bytes);
+    for (std::map<size_t, size_t>::iterator it = free_blocks_.begin(); it != free_blocks_.end(); ++it)
+    {
+      if (it->second < size)
+        continue;
+      offset = it->first;
+      const size_t remain = it->second - size;
+      free_blocks_.erase(it);
+      if (remain > 0)
+        free_blocks_[offset + size] = remain;
+      allocated_blocks_[offset] = size;
+      used_bytes_ += size;
+      if (used_bytes_ > peak_bytes_)
+        peak_bytes_ = used_bytes_;
+      return true;
+    }
+    return false;
+  }
+
+  void free(const size_t offset)
+  {
+    const size_t size = take_allocated_block(offset);
+    used_bytes_ -= size;
+    insert_free_block(offset, size);
+  }
+
+  /* the range stays in use until reclaim() sees that the fence is done */
+  void free_after(const size_t offset, const unsigned long long fence)
+  {
+    std::map<size_t, size_t>::iterator it = allocated_blocks_.find(offset);
+    if (it == allocated_blocks_.end())
+    {
+      printf("[ERROR][StagingArena] offset %zu is not allocated. \n", offset);
+      exit(-1);
+    }
+    pending_bytes_ += it->second;
+    pending_blocks_.push_back(std::make_pair(offset, fence));
+  }
+
+  /* is_done(fence) returns true when the fence is completed. Return the number of reclaimed ranges. */
+  template <typename IsFenceDone>
+  int reclaim(IsFenceDone is_done)
+  {
+    int reclaimed = 0;
+    for (std::deque<std::pair<size_t, unsigned long long>>::iterator it = pending_blocks_.begin(); it != pending_blocks_.end();)
+    {
+      if (is_done(it->second))
+      {
+        const size_t size = take_allocated_block(it->first);
+        used_bytes_ -= size;
+        pending_bytes_ -= size;
+        insert_free_block(it->first, size);
+        it = pending_blocks_.erase(it);
+        reclaimed++;
+      }
+      else
+        ++it;
+    }
+    return reclaimed;
+  }
+
+  bool oldest_fence(unsigned long long &fence) const
+  {
+    if (pending_blocks_.empty())
+      return false;
+    fence = pending_blocks_.front().second;
+    return true;
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t used_bytes() const { return used_bytes_; }
+  size_t pending_bytes() const { return pending_bytes_; }
+  size_t peak_bytes() const { return peak_bytes_; }
+  size_t allocated_num() const { return allocated_blocks_.size(); }
+  size_t free_block_num() const { return free_blocks_.size(); }
+};
+
+/* a range of a StagingHeap: the arena it belongs to and its offset in the arena */
+struct StagingBlock
+{
+  int arena;
+  size_t offset;
+};
+
+class StagingHeap
+{
+private:
+  size_t arena_size_;
+  std::vector<StagingArena> arenas_;
+  size_t peak_bytes_;
+
+  StagingArena &arena(const StagingBlock &block)
+  {
+    if (block.arena < 0 || block.arena >= (int)arenas_.size())
+    {
+      printf("[ERROR][StagingHeap] arena %d does not exist. \n", block.arena);
+      exit(-1);
+    }
+    return arenas_[block.arena];
+  }
+
+public:
+  /* arenas are arena_size bytes, or larger for a larger request */
+  StagingHeap(const size_t arena_size) : arena_size_(staging_aligned_size(arena_size)), peak_bytes_(0) {}
+
+  /* first fit over the arenas in order, return false if none has room */
+  bool allocate(const size_t bytes, StagingBlock &block)
+  {
+    for (size_t i = 0; i < arenas_.size(); i++)
+    {
+      if (arenas_[i].allocate(bytes, block.offset))
+      {
+        block.arena = (int)i;
+        const size_t used = used_bytes();
+        if (used > peak_bytes_)
+          peak_bytes_ = used;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* the size of the arena grow(bytes) adds */
+  size_t arena_size_for(const size_t bytes) const
+  {
+    const size_t size = staging_aligned_size(bytes == 0 ? 1 : bytes);
+    return size > arena_size_ ? size : arena_size_;
+  }
+
+  /* add an arena that holds a range of bytes, return its index; the caller backs it with memory */
+  int grow(const size_t bytes)
+  {
+    arenas_.push_back(StagingArena(arena_size_for(bytes)));
+    return (int)arenas_.size() - 1;
+  }
+
+  void free(const StagingBlock &block) { arena(block).free(block.offset); }
+
+  void free_after(const StagingBlock &block, const unsigned long long fence) { arena(block).free_after(block.offset, fence); }
+
+  template <typename IsFenceDone>
+  int reclaim(IsFenceDone is_done)
+  {
+    int reclaimed = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+      reclaimed += arenas_[i].reclaim(is_done);
+    return reclaimed;
+  }
+
+  /* the fences increase, the oldest one is the smallest of the arenas */
+  bool oldest_fence(unsigned long long &fence) const
+  {
+    bool found = false;
+    for (size_t i = 0; i < arenas_.size(); i++)
+    {
+      unsigned long long f;
+      if (arenas_[i].oldest_fence(f) && (!found || f < fence))
+      {
+        fence = f;
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  int arena_num() const { return (int)arenas_.size(); }
+  size_t arena_capacity(const int i) const { return arenas_[i].capacity(); }
+
+  size_t capacity() const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+      total += arenas_[i].capacity();
+    return total;
+  }
+
+  size_t used_bytes() const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+      total += arenas_[i].used_bytes();
+    return total;
+  }
+
+  size_t pending_bytes() const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < arenas_.size(); i++)
+      total += arenas_[i].pending_bytes();
+    return total;
+  }
+
+  size_t peak_bytes() const { return peak_bytes_; }
+};
+
+} // namespace fastertransformer
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Aggregation of the steps of concurrent engines into batches
+ *
+ * The participants (engines running on their own threads) join the
+ * aggregator, and at every step each one submits a part of some rows. The
+ * parts are gathered in a batch and flush(parts, offsets, rows) runs once
+ * for the whole batch on the thread that closes it. A batch is closed when
+ * every participant has a part in it, when the next part does not fit in
+ * max_rows, or max_wait_us after its first part, so a participant between
+ * two decodings does not stall the others. submit() returns the offset of
+ * the part in its batch once the batch is flushed.
+ *
+ * The batches are flushed one at a time and in order. The aggregator does
+ * not depend on CUDA, LogitsAggregator uses it for the logits GEMM and the
+ * sampling.
+ **/
+
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+struct StepAggregatorConfig
+{
+  int max_rows = 256;
+  int max_wait_us = 200;   // 0 flushes a part at once unless every participant is in the batch
+};
+
+struct StepAggregatorStats
+{
+  long long batches = 0;
+  long long parts = 0;
+  long long rows = 0;
+  long long full_batches = 0;   // closed with a part of every participant
+};
+
+template <typename Part>
+class StepAggregator
+{
+public:
+  typedef std::function<void(const std::vector<Part> &parts, const std::vector<int> &offsets, const int rows)> FlushFunc;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  const StepAggregatorConfig config_;
+  FlushFunc flush_;
+  std::mutex mutex_;
+  std::condition_variable flushed_;
+  int participants_;
+  std::vector<Part> parts_;
+  std::vector<int> offsets_;
+  int rows_;
+  Clock::time_point deadline_;
+  long long generation_;   // of the open batch
+  StepAggregatorStats stats_;
+
+  /* flush the open batch under the lock, so that the batches are flushed in order */
+  void flush_locked()
+  {
+    if (parts_.empty())
+      return;
+    stats_.batches++;
+    stats_.parts += (long long)parts_.size();
+    stats_.rows += rows_;
+    if ((int)parts_.size() >= participants_)
+      stats_.full_batches++;
+    try
+    {
+      flush_(parts_, offsets_, rows_);
+    }
+    catch (...)
+    {
+      parts_.clear();
+      offsets_.clear();
+      rows_ = 0;
+      generation_++;
+      flushed_.notify_all();
+      throw;
+    }
+    parts_.clear();
+    offsets_.clear();
+    rows_ = 0;
+    generation_++;
+    flushed_.notify_all();
+  }
+
+public:
+  StepAggregator(const StepAggregatorConfig &config, FlushFunc flush)
+      : config_(config), flush_(flush), participants_(0), rows_(0), generation_(0)
+  {
+    if (config.max_rows <= 0 || config.max_wait_us < 0)
+    {
+      printf("[ERROR][StepAggregator] max_rows should be positive and max_wait_us non negative (get %d and %d). \n",
+             config.max_rows, config.max_wait_us);
+      exit(-1);
+    }
+  }
+
+  StepAggregator(const StepAggregator &) = delete;
+  StepAggregator &operator=(const StepAggregator &) = delete;
+
+  const StepAggregatorConfig &config() const { return config_; }
+
+  /* a participant submits one part per step until it leaves */
+  void join()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_++;
+  }
+
+  /* the open batch is flushed if the participants left are all in it */
+  void leave()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_--;
+    if (!parts_.empty() && (int)parts_.size() >= participants_)
+      flush_locked();
+  }
+
+  /* add part of rows rows to the open batch, return its offset once the batch is flushed */
+  int submit(const Part &part, const int rows)
+  {
+    if (rows <= 0 || rows > config_.max_rows)
+    {
+      printf("[ERROR][StepAggregator] a part has %d rows, it should be in [1, %d]. \n", rows, config_.max_rows);
+      exit(-1);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (rows_ + rows > config_.max_rows)
+      flush_locked();
+    const long long generation = generation_;
+    const int offset = rows_;
+    if (parts_.empty())
+      deadline_ = Clock::now() + std::chrono::microseconds(config_.max_wait_us);
+    parts_.push_back(part);
+    offsets_.push_back(offset);
+    rows_ += rows;
+
+    if ((int)parts_.size() >= participants_ || rows_ == config_.max_rows)
+    {
+      flush_locked();
+      return offset;
+    }
+    while (generation_ == generation)
+    {
+      if (flushed_.wait_until(lock, deadline_) == std::cv_status::timeout && generation_ == generation)
+        flush_locked();
+    }
+    return offset;
+  }
+
+  StepAggregatorStats stats()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+};
+
+} // namespace fastertransformer
@@ -19,6 +19,7 @@
 #include "fastertransformer/faster_transformer.h"
 #include "fastertransformer/tf_op/common_op.h"
 #include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/host_processing.h"
 
 namespace tensorflow
 {
@@ -229,7 +230,7 @@ REGISTER_GPU(Eigen::half);
 
 REGISTER_OP("BuildMaskRemovePadding")
     .Input("from_tensor: T") // shape: [batch_size, max_seq_len, hidden_dim]
-    .Input("sequence_length: int32") // shape: [batch_size]
+    .Input("sequence_length: int32") // shape: [batch_size], in host memory
     .Output("output: T") // shpae: [valid_word_num, hidden_dim]
     .Output("sequence_id_offset: int32") // shape: [valid_word_num]
     .Attr("T: {float, half}")
@@ -269,37 +270,27 @@ public:
     OP_REQUIRES(context, input_ptr != nullptr, errors::InvalidArgument("input_ptr is null"));
     OP_REQUIRES(context, sequence_length != nullptr, errors::InvalidArgument("sequence_length is null"));
     
+    for(int i = 0; i < batch_size; i++)
+      OP_REQUIRES(context, sequence_length[i] >= 0 && sequence_length[i] <= max_seq_len,
+                  errors::InvalidArgument("sequence_length should be in [0, max_seq_len]"));
+
+    // the lengths are in host memory, the offsets and valid_word_num are built on the host
+    // without waiting for the device
+    std::vector<int> h_sequence_id_offset(batch_size * max_seq_len);
+    const int valid_word_num = build_padding_offset_host(sequence_length, batch_size, max_seq_len,
+                                                         h_sequence_id_offset.data());
+
     Tensor buf;
-    long long int buf_size = (long long int)(ceil((batch_size * max_seq_len + 1) * sizeof(int) / 4.) * 4);
+    long long int buf_size = (long long int)(ceil((batch_size * max_seq_len) * sizeof(int) / 4.) * 4);
     tensorflow::Status status = context->allocate_temp(DT_UINT8, TensorShape{buf_size}, &buf);
     if (status != tensorflow::Status::OK())
       throw std::runtime_error("TF error: context->allocate_temp failed");
 
     int* tmp_sequence_id_offset = (int*)buf.flat<uint8>().data();
-    int* d_valid_word_num = tmp_sequence_id_offset + batch_size * max_seq_len;
     
     const cudaStream_t &stream = context->eigen_device<Device>().stream();
-
-    try
-    {
-      build_sequence_length_padding_offset_kernelLauncher(sequence_length, 
-          batch_size, max_seq_len, d_valid_word_num, tmp_sequence_id_offset, stream);
-    }
-    catch(std::runtime_error& error)
-    {
-      std::cout << errors::Internal(error.what());
-      exit(-1);
-    }
-    catch(...)
-    {
-      std::cout << errors::Internal("Runtime error");
-      exit(-1);
-    }
-
-    int* h_valid_word_num = new int[1];
-    cudaMemcpyAsync(h_valid_word_num, d_valid_word_num, sizeof(int), cudaMemcpyDeviceToHost, stream);
-    const int valid_word_num = h_valid_word_num[0];
-    delete h_valid_word_num;
+    check_cuda_error(cudaMemcpyAsync(tmp_sequence_id_offset, h_sequence_id_offset.data(), sizeof(int) * valid_word_num,
+                                     cudaMemcpyHostToDevice, stream));
 
     Tensor *output = nullptr;
     OP_REQUIRES_OK(
@@ -341,7 +332,7 @@ private:
 
 #define REGISTER_GPU(T)                                                  \
   REGISTER_KERNEL_BUILDER(                                               \
-      Name("BuildMaskRemovePadding").Device(DEVICE_GPU).TypeConstraint<T>("T"), \
+      Name("BuildMaskRemovePadding").Device(DEVICE_GPU).TypeConstraint<T>("T").HostMemory("sequence_length"), \
       BuildMaskRemovePaddingOp<GPUDevice, T>)
 REGISTER_GPU(float);
 REGISTER_GPU(Eigen::half);
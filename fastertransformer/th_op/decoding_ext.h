@@ -23,6 +23,7 @@
 
 #include "fastertransformer/open_decoder.h"
 #include "fastertransformer/decoding_beamsearch.h"
+#include "fastertransformer/host_processing.h"
 #include "fastertransformer/th_op/th_traits.h"
 #include "fastertransformer/th_op/utils.h"
 
@@ -151,13 +151,25 @@ std::vector<Tensor> FasterTransformerDecoding::get_pickle_info() const {
 }
 
 Tensor gather_tree(Tensor step_ids, Tensor parent_ids, Tensor max_sequence_lengths, int64_t end_token) {
-  CHECK_CUDA(step_ids); CHECK_CONTIGUOUS(step_ids); TORCH_CHECK(step_ids.dtype()==torch::kInt32, "step_ids dtype should be int32");
-  CHECK_CUDA(parent_ids); CHECK_CONTIGUOUS(parent_ids); TORCH_CHECK(parent_ids.dtype()==torch::kInt32, "parent_ids dtype should be int32");
-  CHECK_CUDA(max_sequence_lengths); CHECK_CONTIGUOUS(max_sequence_lengths); TORCH_CHECK(max_sequence_lengths.dtype()==torch::kInt32, "max_sequence_lengths dtype should be int32");
+  CHECK_CONTIGUOUS(step_ids); TORCH_CHECK(step_ids.dtype()==torch::kInt32, "step_ids dtype should be int32");
+  CHECK_CONTIGUOUS(parent_ids); TORCH_CHECK(parent_ids.dtype()==torch::kInt32, "parent_ids dtype should be int32");
+  CHECK_CONTIGUOUS(max_sequence_lengths); TORCH_CHECK(max_sequence_lengths.dtype()==torch::kInt32, "max_sequence_lengths dtype should be int32");
+  TORCH_CHECK(parent_ids.device()==step_ids.device() && max_sequence_lengths.device()==step_ids.device(),
+              "step_ids, parent_ids and max_sequence_lengths should be on the same device");
   int max_step = step_ids.size(0);
   int batch_size = step_ids.size(1);
   int beam_width = step_ids.size(2);
   auto beams = torch::empty_like(step_ids);
+  if (!step_ids.is_cuda()) {
+    // the outputs already copied to the host are gathered on the host thread pool
+    gather_tree_host(max_step, batch_size, beam_width,
+                     torch_ext::get_ptr<int>(step_ids),
+                     torch_ext::get_ptr<int>(parent_ids),
+                     torch_ext::get_ptr<int>(max_sequence_lengths),
+                     end_token,
+                     torch_ext::get_ptr<int>(beams));
+    return beams;
+  }
   auto stream = at::cuda::getCurrentCUDAStream().stream();
   torch_ext::gather_tree_kernel_launcher(max_step, batch_size, beam_width,
                                          torch_ext::get_ptr<int>(step_ids),
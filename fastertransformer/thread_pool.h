@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Work-stealing thread pool for the host stages around the engines
+ *
+ * Every worker owns a deque: it pushes and pops its own tasks at the back,
+ * and an idle worker steals from the front of the others, so the tasks a
+ * worker spawns stay on it while the load spreads to idle cores. Tasks
+ * pushed from other threads go round robin to the workers.
+ *
+ * TaskGroup waits for a set of tasks and rethrows the first exception. The
+ * waiting thread runs pending tasks meanwhile, so groups and parallel_for can
+ * be nested inside tasks without deadlock. ThreadPool::global() is the pool
+ * of the host stages (see host_processing.h), FT_HOST_THREAD_NUM sets its
+ * number of workers.
+ **/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+class ThreadPool
+{
+public:
+  typedef std::function<void()> Task;
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  struct ThreadIdentity
+  {
+    const ThreadPool *pool = nullptr;
+    int index = -1;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::atomic<int> queued_;          // tasks pushed and not taken yet
+  std::atomic<unsigned> next_worker_;
+  std::atomic<long long> steals_;
+  bool stop_;
+
+  static ThreadIdentity &identity()
+  {
+    thread_local ThreadIdentity id;
+    return id;
+  }
+
+  bool take(const int index, Task &task)
+  {
+    const int worker_num = (int)workers_.size();
+    if (index >= 0)
+    {
+      Worker &own = *workers_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty())
+      {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        queued_.fetch_sub(1);
+        return true;
+      }
+    }
+    const int start = index >= 0 ? index + 1 : (int)(next_worker_.load(std::memory_order_relaxed) % worker_num);
+    for (int i = 0; i < worker_num; i++)
+    {
+      const int victim = (start + i) % worker_num;
+      if (victim == index)
+        continue;
+      Worker &other = *workers_[victim];
+      std::lock_guard<std::mutex> lock(other.mutex);
+      if (!other.tasks.empty())
+      {
+        task = std::move(other.tasks.front());
+        other.tasks.pop_front();
+        queued_.fetch_sub(1);
+        steals_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(const int index)
+  {
+    identity().pool = this;
+    identity().index = index;
+    Task task;
+    while (true)
+    {
+      if (take(index, task))
+      {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      wake_.wait(lock, [this]() { return stop_ || queued_.load() > 0; });
+      if (stop_ && queued_.load() <= 0)
+        break;
+    }
+  }
+
+public:
+  /* thread_num workers, at least one */
+  explicit ThreadPool(const int thread_num) : queued_(0), next_worker_(0), steals_(0), stop_(false)
+  {
+    if (thread_num <= 0)
+    {
+      printf("[ERROR][ThreadPool] thread_num should be positive, but get %d. \n", thread_num);
+      exit(-1);
+    }
+    for (int i = 0; i < thread_num; i++)
+      workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+    for (int i = 0; i < thread_num; i++)
+      threads_.push_back(std::thread(&ThreadPool::work, this, i));
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /* the pending tasks are run before the workers exit */
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+      threads_[i].join();
+  }
+
+  /* FT_HOST_THREAD_NUM workers, or one less than the cores since the caller also works */
+  static ThreadPool &global()
+  {
+    static ThreadPool pool(default_thread_num());
+    return pool;
+  }
+
+  static int default_thread_num()
+  {
+    const char *env = getenv("FT_HOST_THREAD_NUM");
+    if (env != nullptr && atoi(env) > 0)
+      return atoi(env);
+    const int cores = (int)std::thread::hardware_concurrency();
+    return cores > 2 ? cores - 1 : 1;
+  }
+
+  int thread_num() const { return (int)workers_.size(); }
+
+  long long steal_count() const { return steals_.load(std::memory_order_relaxed); }
+
+  /* true on the workers of this pool */
+  bool in_pool() const { return identity().pool == this; }
+
+  void push(Task task)
+  {
+    const int index = in_pool() ? identity().index
+                                : (int)(next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size());
+    {
+      Worker &worker = *workers_[index];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      queued_.fetch_add(1);
+    }
+    wake_.notify_one();
+  }
+
+  /* run one pending task on the calling thread, false if there is none */
+  bool run_one()
+  {
+    Task task;
+    if (!take(in_pool() ? identity().index : -1, task))
+      return false;
+    task();
+    return true;
+  }
+
+  /* A task whose result is waited for with a future. A worker that waits on such a future
+     blocks, use a TaskGroup inside the tasks. */
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> submit(F f)
+  {
+    typedef typename std::result_of<F()>::type R;
+    std::shared_ptr<std::packaged_task<R()>> task = std::make_shared<std::packaged_task<R()>>(f);
+    std::future<R> future = task->get_future();
+    push([task]() { (*task)(); });
+    return future;
+  }
+};
+
+class TaskGroup
+{
+private:
+  ThreadPool &pool_;
+  std::atomic<int> pending_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::exception_ptr error_;
+
+  /* the last access of a task to the group is under mutex_, wait() takes it before returning */
+  void finish()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.fetch_sub(1) == 1)
+      done_.notify_all();
+  }
+
+  void wait_no_throw()
+  {
+    while (pending_.load() > 0)
+    {
+      if (pool_.run_one())
+        continue;
+      std::unique_lock<std::mutex> lock(mutex_);
+      // wake up now and then to help with the tasks the running ones spawn
+      done_.wait_for(lock, std::chrono::microseconds(200), [this]() { return pending_.load() == 0; });
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+
+public:
+  explicit TaskGroup(ThreadPool &pool = ThreadPool::global()) : pool_(pool), pending_(0) {}
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  ~TaskGroup() { wait_no_throw(); }
+
+  ThreadPool &pool() { return pool_; }
+
+  template <typename F>
+  void run(F f)
+  {
+    pending_.fetch_add(1);
+    pool_.push([this, f]() {
+      try
+      {
+        f();
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+          error_ = std::current_exception();
+      }
+      finish();
+    });
+  }
+
+  /* wait for the tasks, running pending ones meanwhile, and rethrow the first exception */
+  void wait()
+  {
+    wait_no_throw();
+    if (error_)
+    {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+/**
+ * f(chunk_begin, chunk_end) on chunks of [begin, end) of at least grain indices. The caller
+ * runs the first chunk and waits for the others, a range of at most grain runs inline.
+ **/
+template <typename F>
+void parallel_for(const int begin, const int end, const int grain, F f, ThreadPool &pool = ThreadPool::global())
+{
+  const int n = end - begin;
+  if (n <= 0)
+    return;
+  const int min_chunk = grain > 0 ? grain : 1;
+  if (n <= min_chunk)
+  {
+    f(begin, end);
+    return;
+  }
+  // a few chunks per thread balance uneven chunks
+  const int max_chunks = 4 * (pool.thread_num() + 1);
+  int chunks = (n + min_chunk - 1) / min_chunk;
+  chunks = chunks < max_chunks ? chunks : max_chunks;
+  const int chunk = (n + chunks - 1) / chunks;
+
+  TaskGroup group(pool);
+  for (int b = begin + chunk; b < end; b += chunk)
+  {
+    const int e = end - b > chunk ? b + chunk : end;
+    group.run([&f, b, e]() { f(b, e); });
+  }
+  f(begin, begin + chunk);
+  group.wait();
+}
+
+} // namespace fastertransformer
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Token automata of the constrained decoding
+ *
+ * A TokenAutomaton is a deterministic automaton over the token ids: a state
+ * allows the tokens of its transitions, and end_id if it is accepting. It is
+ * built from token sequences (a trie), from allow-lists or transition by
+ * transition, or lowered from a byte-level automaton (a grammar or a regular
+ * expression compiled elsewhere) and the strings of the vocabulary. compile()
+ * gives the compact table that TokenConstraint uploads: a bitset of the
+ * allowed tokens per state for the mask, and the sorted transitions per state
+ * for the advance after sampling. A sentence that takes a token without
+ * transition goes to TOKEN_AUTOMATON_DEAD_STATE, which only allows end_id.
+ * Everything here runs on the host and does not depend on CUDA.
+ **/
+
+#pragma once
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+/* the state after a token that is not allowed, only end_id is allowed from it */
+static const int TOKEN_AUTOMATON_DEAD_STATE = -2;
+
+struct TokenAutomatonTable
+{
+  int num_states = 0;
+  int vocab_size = 0;
+  int words_per_state = 0;              // 32 bit words of the bitset of a state
+  int end_id = 0;
+  std::vector<unsigned int> allowed_bits; // [num_states, words_per_state]
+  std::vector<int> offsets;               // [num_states + 1], transitions of state s are [offsets[s], offsets[s + 1])
+  std::vector<int> tokens;                // sorted in each state
+  std::vector<int> next_states;
+
+  /* the lookups of the kernels on the compiled arrays */
+  bool is_allowed(const int state, const int token) const
+  {
+    if (state == TOKEN_AUTOMATON_DEAD_STATE)
+      return token == end_id;
+    if (token < 0 || token >= vocab_size)
+      return false;
+    return (allowed_bits[(size_t)state * words_per_state + token / 32] >> (token % 32)) & 1u;
+  }
+
+  int next(const int state, const int token) const
+  {
+    if (state == TOKEN_AUTOMATON_DEAD_STATE || token == end_id)
+      return state;
+    const std::vector<int>::const_iterator begin = tokens.begin() + offsets[state];
+    const std::vector<int>::const_iterator end = tokens.begin() + offsets[state + 1];
+    const std::vector<int>::const_iterator it = std::lower_bound(begin, end, token);
+    return it != end && *it == token ? next_states[it - tokens.begin()] : TOKEN_AUTOMATON_DEAD_STATE;
+  }
+};
+
+class TokenAutomaton
+{
+private:
+  int vocab_size_;
+  int end_id_;
+  std::vector<std::map<int, int>> transitions_;
+  std::vector<bool> accepting_;
+
+  void check_state(const int state) const
+  {
+    if (state < 0 || state >= num_states())
+    {
+      printf("[ERROR][TokenAutomaton] state %d does not exist. \n", state);
+      exit(-1);
+    }
+  }
+
+public:
+  TokenAutomaton(const int vocab_size, const int end_id) : vocab_size_(vocab_size), end_id_(end_id)
+  {
+    if (vocab_size <= 0 || end_id < 0 || end_id >= vocab_size)
+    {
+      printf("[ERROR][TokenAutomaton] invalid vocab_size %d or end_id %d. \n", vocab_size, end_id);
+      exit(-1);
+    }
+  }
+
+  int add_state(const bool accepting = false)
+  {
+    transitions_.push_back(std::map<int, int>());
+    accepting_.push_back(accepting);
+    return num_states() - 1;
+  }
+
+  void set_accepting(const int state, const bool accepting = true)
+  {
+    check_state(state);
+    accepting_[state] = accepting;
+  }
+
+  /* end_id only finishes the sentence, it has no transition */
+  void add_transition(const int from, const int token, const int to)
+  {
+    check_state(from);
+    check_state(to);
+    if (token < 0 || token >= vocab_size_ || token == end_id_)
+    {
+      printf("[ERROR][TokenAutomaton] token %d is out of the vocabulary or is end_id. \n", token);
+      exit(-1);
+    }
+    std::map<int, int>::iterator it = transitions_[from].find(token);
+    if (it != transitions_[from].end() && it->second != to)
+    {
+      printf("[ERROR][TokenAutomaton] state %d has two transitions on token %d. \n", from, token);
+      exit(-1);
+    }
+    transitions_[from][token] = to;
+  }
+
+  /* A trie of the sequences, return its root. A sentence that starts at the root generates
+     exactly one of the sequences, then end_id. */
+  int add_sequences(const std::vector<std::vector<int>> &sequences)
+  {
+    const int root = add_state();
+    for (size_t i = 0; i < sequences.size(); i++)
+    {
+      int state = root;
+      for (size_t j = 0; j < sequences[i].size(); j++)
+      {
+        const int token = sequences[i][j];
+        std::map<int, int>::const_iterator it = transitions_[state].find(token);
+        int next;
+        if (it != transitions_[state].end())
+          next = it->second;
+        else
+        {
+          next = add_state();
+          add_transition(state, token, next);
+        }
+        state = next;
+      }
+      accepting_[state] = true;
+    }
+    return root;
+  }
+
+  /* one state that allows the tokens at every step, return it */
+  int add_allow_list(const std::vector<int> &tokens, const bool accepting = true)
+  {
+    const int state = add_state(accepting);
+    for (size_t i = 0; i < tokens.size(); i++)
+      add_transition(state, tokens[i], state);
+    return state;
+  }
+
+  bool is_allowed(const int state, const int token) const
+  {
+    if (state == TOKEN_AUTOMATON_DEAD_STATE)
+      return token == end_id_;
+    check_state(state);
+    if (token == end_id_)
+      return accepting_[state];
+    return transitions_[state].count(token) > 0;
+  }
+
+  /* the state after token, the state itself for end_id and the dead state for a token that
+     is not allowed */
+  int next(const int state, const int token) const
+  {
+    if (state == TOKEN_AUTOMATON_DEAD_STATE || token == end_id_)
+      return state;
+    check_state(state);
+    std::map<int, int>::const_iterator it = transitions_[state].find(token);
+    return it == transitions_[state].end() ? TOKEN_AUTOMATON_DEAD_STATE : it->second;
+  }
+
+  /* the state after the tokens from state */
+  int walk(int state, const std::vector<int> &tokens) const
+  {
+    for (size_t i = 0; i < tokens.size(); i++)
+      state = next(state, tokens[i]);
+    return state;
+  }
+
+  /* Every state should allow at least one token, else the sampling has nothing to choose. */
+  TokenAutomatonTable compile() const
+  {
+    TokenAutomatonTable table;
+    table.num_states = num_states();
+    table.vocab_size = vocab_size_;
+    table.words_per_state = (vocab_size_ + 31) / 32;
+    table.end_id = end_id_;
+    table.allowed_bits.assign((size_t)table.num_states * table.words_per_state, 0u);
+    table.offsets.push_back(0);
+    for (int s = 0; s < table.num_states; s++)
+    {
+      if (transitions_[s].empty() && !accepting_[s])
+      {
+        printf("[ERROR][TokenAutomaton] state %d allows no token. \n", s);
+        exit(-1);
+      }
+      unsigned int *bits = table.allowed_bits.data() + (size_t)s * table.words_per_state;
+      if (accepting_[s])
+        bits[end_id_ / 32] |= 1u << (end_id_ % 32);
+      // std::map is ordered, so the tokens of a state are sorted for the binary search
+      for (std::map<int, int>::const_iterator it = transitions_[s].begin(); it != transitions_[s].end(); ++it)
+      {
+        bits[it->first / 32] |= 1u << (it->first % 32);
+        table.tokens.push_back(it->first);
+        table.next_states.push_back(it->second);
+      }
+      table.offsets.push_back((int)table.tokens.size());
+    }
+    return table;
+  }
+
+  int num_states() const { return (int)transitions_.size(); }
+  int num_transitions() const
+  {
+    int num = 0;
+    for (size_t i = 0; i < transitions_.size(); i++)
+      num += (int)transitions_[i].size();
+    return num;
+  }
+  int vocab_size() const { return vocab_size_; }
+  int end_id() const { return end_id_; }
+};
+
+/* deterministic automaton over bytes, the input of compile_token_automaton */
+class ByteAutomaton
+{
+private:
+  std::vector<std::vector<int>> transitions_;  // [num_states, 256], -1 is no transition
+  std::vector<bool> accepting_;
+
+public:
+  int add_state(const bool accepting = false)
+  {
+    transitions_.push_back(std::vector<int>(256, -1));
+    accepting_.push_back(accepting);
+    return (int)transitions_.size() - 1;
+  }
+
+  void set_accepting(const int state, const bool accepting = true) { accepting_.at(state) = accepting; }
+
+  /* transitions on the bytes [lo, hi] */
+  void add_transition(const int from, const unsigned char lo, const unsigned char hi, const int to)
+  {
+    if (from < 0 || from >= num_states() || to < 0 || to >= num_states() || lo > hi)
+    {
+      printf("[ERROR][ByteAutomaton] invalid transition %d -> %d on [%d, %d]. \n", from, to, (int)lo, (int)hi);
+      exit(-1);
+    }
+    for (int c = lo; c <= hi; c++)
+      transitions_[from][c] = to;
+  }
+
+  void add_transition(const int from, const unsigned char c, const int to) { add_transition(from, c, c, to); }
+
+  /* the state after the bytes of str from state, -1 if it dies */
+  int run(int state, const std::string &str) const
+  {
+    for (size_t i = 0; i < str.size() && state >= 0; i++)
+      state = transitions_[state][(unsigned char)str[i]];
+    return state;
+  }
+
+  /* the states from which an accepting state can be reached */
+  std::vector<bool> live_states() const
+  {
+    std::vector<bool> live(accepting_);
+    for (bool changed = true; changed;)
+    {
+      changed = false;
+      for (int s = 0; s < num_states(); s++)
+      {
+        if (live[s])
+          continue;
+        for (int c = 0; c < 256 && !live[s]; c++)
+          live[s] = transitions_[s][c] >= 0 && live[transitions_[s][c]];
+        changed = changed || live[s];
+      }
+    }
+    return live;
+  }
+
+  bool is_accepting(const int state) const { return accepting_.at(state); }
+  int num_states() const { return (int)transitions_.size(); }
+};
+
+/**
+ * Lower a byte automaton to the tokens of a vocabulary. vocab[t] is the string of token t
+ * (empty for the special tokens, they are never allowed). From a state, token t is allowed
+ * if its bytes lead to a live state, so a sentence can always be completed. The token
+ * states are the live byte states reachable from start, the returned automaton starts at
+ * state 0.
+ **/
+inline TokenAutomaton compile_token_automaton(const ByteAutomaton &bytes, const int start,
+                                              const std::vector<std::string> &vocab, const int end_id)
+{
+  const std::vector<bool> live = bytes.live_states();
+  if (start < 0 || start >= bytes.num_states() || !live[start])
+  {
+    printf("[ERROR][compile_token_automaton] start state %d cannot reach an accepting state. \n", start);
+    exit(-1);
+  }
+
+  TokenAutomaton tokens((int)vocab.size(), end_id);
+  std::vector<int> state_of(bytes.num_states(), -1);  // byte state -> token state
+  std::vector<int> queue;
+  state_of[start] = tokens.add_state(bytes.is_accepting(start));
+  queue.push_back(start);
+  for (size_t head = 0; head < queue.size(); head++)
+  {
+    const int from = queue[head];
+    for (int t = 0; t < (int)vocab.size(); t++)
+    {
+      if (t == end_id || vocab[t].empty())
+        continue;
+      const int to = bytes.run(from, vocab[t]);
+      if (to < 0 || !live[to])
+        continue;
+      if (state_of[to] == -1)
+      {
+        state_of[to] = tokens.add_state(bytes.is_accepting(to));
+        queue.push_back(to);
+      }
+      tokens.add_transition(state_of[from], t, state_of[to]);
+    }
+  }
+  return tokens;
+}
+
+} // namespace fastertransformer
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Device copy of a compiled token automaton
+ *
+ * The table is uploaded once and shared by all the decodings that use it. The
+ * per-row states are owned by the caller: DecodingInitParam::constraint_states
+ * holds the start state of every row (-1 for an unconstrained row) and is
+ * advanced in place by the decoding, so it ends with the state after the last
+ * generated token, or TOKEN_AUTOMATON_DEAD_STATE if a row took a token without
+ * transition. DecodingGpt2 first advances the states over the prompt.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/token_automaton.h"
+#include "fastertransformer/cuda/constraint_kernels.h"
+#include <cuda_runtime.h>
+
+namespace fastertransformer
+{
+
+class TokenConstraint
+{
+private:
+  const IAllocator &allocator_;
+  TokenConstraintTable table_;
+  void *buf_;
+
+public:
+  TokenConstraint(const IAllocator &allocator, const TokenAutomatonTable &table,
+                  cudaStream_t stream) : allocator_(allocator)
+  {
+    if (table.num_states <= 0 || (int)table.offsets.size() != table.num_states + 1)
+    {
+      printf("[ERROR][TokenConstraint] the table is empty or not compiled. \n");
+      exit(-1);
+    }
+    // all the arrays are of 4 byte elements, so no padding is needed
+    const size_t bits_size = table.allowed_bits.size();
+    const size_t offsets_size = table.offsets.size();
+    const size_t transition_num = table.tokens.size();
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(sizeof(int) * (bits_size + offsets_size + transition_num * 2)));
+
+    unsigned int *allowed_bits = (unsigned int *)buf_;
+    int *offsets = (int *)(allowed_bits + bits_size);
+    int *tokens = offsets + offsets_size;
+    int *next_states = tokens + transition_num;
+    check_cuda_error(cudaMemcpyAsync(allowed_bits, table.allowed_bits.data(), sizeof(unsigned int) * bits_size,
+                                     cudaMemcpyHostToDevice, stream));
+    check_cuda_error(cudaMemcpyAsync(offsets, table.offsets.data(), sizeof(int) * offsets_size,
+                                     cudaMemcpyHostToDevice, stream));
+    if (transition_num > 0)
+    {
+      check_cuda_error(cudaMemcpyAsync(tokens, table.tokens.data(), sizeof(int) * transition_num,
+                                       cudaMemcpyHostToDevice, stream));
+      check_cuda_error(cudaMemcpyAsync(next_states, table.next_states.data(), sizeof(int) * transition_num,
+                                       cudaMemcpyHostToDevice, stream));
+    }
+    // the host table can be released once the copies are done
+    check_cuda_error(cudaStreamSynchronize(stream));
+
+    table_.allowed_bits = allowed_bits;
+    table_.offsets = offsets;
+    table_.tokens = tokens;
+    table_.next_states = next_states;
+    table_.num_states = table.num_states;
+    table_.words_per_state = table.words_per_state;
+    table_.vocab_size = table.vocab_size;
+    table_.end_id = table.end_id;
+  }
+
+  /* for DecodingInitParam::constraint_table */
+  const TokenConstraintTable &table() const { return table_; }
+
+  ~TokenConstraint()
+  {
+    allocator_.free(buf_);
+  }
+};
+
+} // namespace fastertransformer
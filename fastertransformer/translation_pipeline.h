@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Encoder-decoder translation pipeline
+ *
+ * The encoder and the beam search decoding run on two non-blocking streams with
+ * their own cuBLAS handles and workspaces. The encoder outputs are tiled to the
+ * beams into double-buffered memory tensors, and the two stages hand off through
+ * events, so the encoder of the next batch overlaps with the current decoding.
+ * With DecodingInitParam::metrics set, the queueing time of a batch is taken
+ * when its encoder is issued and the encoder time from timed events.
+ **/
+
+#pragma once
+
+#include "fastertransformer/common.h"
+#include "fastertransformer/allocator.h"
+#include "fastertransformer/bert_encoder_transformer.h"
+#include "fastertransformer/decoding_beamsearch.h"
+#include "fastertransformer/pipeline_scheduler.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include <cuda_runtime.h>
+#include <vector>
+
+namespace fastertransformer
+{
+
+template <typename T>
+struct TranslationBatch
+{
+  /* inputs of the encoder, they should be ready before forward is called */
+  const T *from_tensor = nullptr;          // [batch_size, mem_max_seq_len, hidden_units], embedded source
+  const T *attr_mask = nullptr;            // [batch_size, mem_max_seq_len, mem_max_seq_len]
+  const int *sequence_length = nullptr;    // [batch_size]
+
+  /* outputs of the decoding, see DecodingInitParam */
+  int *output_ids = nullptr;               // [seq_len, batch_size * beam_width]
+  int *parent_ids = nullptr;               // [seq_len, batch_size * beam_width]
+  int *output_sequence_length = nullptr;   // [batch_size * beam_width]
+
+  int64_t enqueue_us = 0;                  // arrival on the RequestMetrics::now_us() clock, 0 if unknown
+};
+
+template <OperationType OpType_>
+class TranslationPipeline
+{
+private:
+  typedef DecoderTransformerTraits<OpType_> Traits_;
+  typedef typename Traits_::DataType DataType_;
+  typedef BertEncoderTransformerTraits<OpType_, cuda::OpenMultiHeadAttention> EncoderTraits_;
+
+  IAllocator &allocator_;
+  const int batch_size_;
+  const int beam_width_;
+  const int mem_max_seq_len_;
+  const int hidden_units_;
+  const int encoder_layers_;
+  const int decoder_layers_;
+
+  PipelineScheduler scheduler_;
+  BertEncoderTransformer<EncoderTraits_> *encoder_;
+  DecodingBeamsearch<OpType_> *decoding_;
+
+  cudaStream_t encoder_stream_;
+  cudaStream_t decoding_stream_;
+  cublasHandle_t encoder_cublas_handle_;
+  cublasHandle_t decoding_cublas_handle_;
+  std::vector<cudaEvent_t> encoded_event_;
+  std::vector<cudaEvent_t> decoded_event_;
+  std::vector<cudaEvent_t> encode_start_event_;   // timed, only recorded with metrics
+  std::vector<cudaEvent_t> encode_end_event_;
+
+  void *buf_;
+  DataType_ *encoder_buf_[2];
+  std::vector<DataType_ *> memory_tensor_;
+  std::vector<int *> memory_sequence_length_;
+  std::vector<DecoderInitParam<DataType_>> decoder_param_;
+
+public:
+  TranslationPipeline(IAllocator &allocator, const int batch_size,
+                      const int beam_width, const int seq_len,
+                      const int head_num, const int size_per_head,
+                      const int vocab_size, const int encoder_layers,
+                      const int decoder_layers, const int mem_max_seq_len,
+                      const int start_id, const int end_id,
+                      const float beam_search_diversity_rate = -0.0f,
+                      const bool is_fuse_topk_softMax = false,
+                      const int slot_num = 2) : allocator_(allocator),
+                                                batch_size_(batch_size),
+                                                beam_width_(beam_width),
+                                                mem_max_seq_len_(mem_max_seq_len),
+                                                hidden_units_(head_num * size_per_head),
+                                                encoder_layers_(encoder_layers),
+                                                decoder_layers_(decoder_layers),
+                                                scheduler_(slot_num)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    /* The decoding blocks the host by a synchronous copy at every step, so both streams
+       must not synchronize with the legacy default stream. */
+    check_cuda_error(cudaStreamCreateWithFlags(&encoder_stream_, cudaStreamNonBlocking));
+    check_cuda_error(cudaStreamCreateWithFlags(&decoding_stream_, cudaStreamNonBlocking));
+    check_cuda_error(cublasCreate(&encoder_cublas_handle_));
+    check_cuda_error(cublasCreate(&decoding_cublas_handle_));
+    check_cuda_error(cublasSetStream(encoder_cublas_handle_, encoder_stream_));
+    check_cuda_error(cublasSetStream(decoding_cublas_handle_, decoding_stream_));
+
+    encoded_event_.resize(slot_num);
+    decoded_event_.resize(slot_num);
+    encode_start_event_.resize(slot_num);
+    encode_end_event_.resize(slot_num);
+    for (int i = 0; i < slot_num; i++)
+    {
+      check_cuda_error(cudaEventCreateWithFlags(&encoded_event_[i], cudaEventDisableTiming));
+      check_cuda_error(cudaEventCreateWithFlags(&decoded_event_[i], cudaEventDisableTiming));
+      check_cuda_error(cudaEventCreate(&encode_start_event_[i]));
+      check_cuda_error(cudaEventCreate(&encode_end_event_[i]));
+    }
+
+    encoder_ = new BertEncoderTransformer<EncoderTraits_>();
+    encoder_->allocateBuffer(&allocator_, batch_size_, mem_max_seq_len_, mem_max_seq_len_, head_num, size_per_head);
+
+    decoding_ = new DecodingBeamsearch<OpType_>(allocator_, batch_size_, beam_width_, seq_len,
+                                                head_num, size_per_head, vocab_size, decoder_layers_,
+                                                hidden_units_, mem_max_seq_len_, start_id, end_id,
+                                                beam_search_diversity_rate, is_fuse_topk_softMax);
+
+    int encoder_buf_size = batch_size_ * mem_max_seq_len_ * hidden_units_;                         // type T
+    int memory_tensor_size = batch_size_ * beam_width_ * mem_max_seq_len_ * hidden_units_;         // type T
+    int memory_sequence_length_size = (int)(ceil(batch_size_ * beam_width_ / 4.)) * 4;           // type int
+
+    // prevent memory misalinged address
+    encoder_buf_size = (int)(ceil(encoder_buf_size / 4.)) * 4;
+    memory_tensor_size = (int)(ceil(memory_tensor_size / 4.)) * 4;
+
+    buf_ = reinterpret_cast<void *>(allocator_.malloc(
+        sizeof(DataType_) * (encoder_buf_size * 2 + memory_tensor_size * slot_num) +
+        sizeof(int) * memory_sequence_length_size * slot_num));
+
+    encoder_buf_[0] = (DataType_ *)buf_;
+    encoder_buf_[1] = encoder_buf_[0] + encoder_buf_size;
+    memory_tensor_.resize(slot_num);
+    memory_sequence_length_.resize(slot_num);
+    for (int i = 0; i < slot_num; i++)
+      memory_tensor_[i] = encoder_buf_[1] + encoder_buf_size + i * memory_tensor_size;
+    for (int i = 0; i < slot_num; i++)
+      memory_sequence_length_[i] = (int *)(memory_tensor_[slot_num - 1] + memory_tensor_size) + i * memory_sequence_length_size;
+
+    decoder_param_.resize(decoder_layers_);
+  }
+
+  /**
+   * encoder_param and decoder_param are the weights of each layer, and decoding_params
+   * holds the weights of the embedding and the final layernorm. The streams, cuBLAS
+   * handles and the input/output pointers in them are replaced by the pipeline.
+   * All batches must have batch_size_ sentences.
+   **/
+  void forward(const EncoderInitParam<DataType_> *encoder_param,
+               const DecoderInitParam<DataType_> *decoder_param,
+               DecodingInitParam<DataType_> decoding_params,
+               const std::vector<TranslationBatch<DataType_>> &batches)
+  {
+#ifndef NDEBUG
+    PRINT_FUNC_NAME_();
+#endif
+    for (int i = 0; i < decoder_layers_; i++)
+    {
+      decoder_param_[i] = decoder_param[i];
+      decoder_param_[i].stream = decoding_stream_;
+      decoder_param_[i].cublas_handle = decoding_cublas_handle_;
+    }
+    decoding_params.stream = decoding_stream_;
+    decoding_params.cublas_handle = decoding_cublas_handle_;
+
+    std::vector<PipelineOp> ops = scheduler_.schedule((int)batches.size());
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+      if (ops[i].stage == PipelineStage::ENCODE)
+        encode(encoder_param, batches[ops[i].batch_id], ops[i], decoding_params.metrics);
+      else
+        decode(decoding_params, batches[ops[i].batch_id], ops[i]);
+    }
+    check_cuda_error(cudaStreamSynchronize(decoding_stream_));
+  }
+
+  ~TranslationPipeline()
+  {
+    delete encoder_;
+    delete decoding_;
+    allocator_.free(buf_);
+    for (size_t i = 0; i < encoded_event_.size(); i++)
+    {
+      cudaEventDestroy(encoded_event_[i]);
+      cudaEventDestroy(decoded_event_[i]);
+      cudaEventDestroy(encode_start_event_[i]);
+      cudaEventDestroy(encode_end_event_[i]);
+    }
+    cublasDestroy(encoder_cublas_handle_);
+    cublasDestroy(decoding_cublas_handle_);
+    cudaStreamDestroy(encoder_stream_);
+    cudaStreamDestroy(decoding_stream_);
+  }
+
+private:
+  void encode(const EncoderInitParam<DataType_> *encoder_param,
+              const TranslationBatch<DataType_> &batch, const PipelineOp &op, RequestMetrics *metrics)
+  {
+    if (metrics != nullptr)
+    {
+      const int64_t now_us = RequestMetrics::now_us();
+      if (batch.enqueue_us > 0 && batch.enqueue_us <= now_us)
+        metrics->record(RequestMetric::QUEUE_TIME, (uint64_t)(now_us - batch.enqueue_us), batch_size_);
+    }
+    /* the memory slot is still read by the decoding of an earlier batch */
+    if (op.wait_batch_id >= 0)
+      check_cuda_error(cudaStreamWaitEvent(encoder_stream_, decoded_event_[op.slot], 0));
+    if (metrics != nullptr)
+      check_cuda_error(cudaEventRecord(encode_start_event_[op.slot], encoder_stream_));
+
+    for (int layer = 0; layer < encoder_layers_; ++layer)
+    {
+      EncoderInitParam<DataType_> param = encoder_param[layer];
+      param.from_tensor = layer == 0 ? batch.from_tensor : encoder_buf_[(layer - 1) % 2];
+      param.to_tensor = param.from_tensor;
+      param.attr_mask = batch.attr_mask;
+      param.transformer_out = encoder_buf_[layer % 2];
+      param.cublas_handle = encoder_cublas_handle_;
+      param.stream = encoder_stream_;
+      param.sequence_id_offset = nullptr;
+      param.valid_word_num = batch_size_ * mem_max_seq_len_;
+      param.layer_idx = layer;
+      param.layer_num = encoder_layers_;
+      encoder_->initialize(param);
+      encoder_->forward();
+    }
+
+    tile_encoder_output_kernelLauncher(encoder_buf_[(encoder_layers_ - 1) % 2], batch.sequence_length,
+                                       memory_tensor_[op.slot], memory_sequence_length_[op.slot],
+                                       batch_size_, beam_width_, mem_max_seq_len_, hidden_units_,
+                                       encoder_stream_);
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+#endif
+    if (metrics != nullptr)
+      check_cuda_error(cudaEventRecord(encode_end_event_[op.slot], encoder_stream_));
+    check_cuda_error(cudaEventRecord(encoded_event_[op.slot], encoder_stream_));
+  }
+
+  void decode(DecodingInitParam<DataType_> decoding_params,
+              const TranslationBatch<DataType_> &batch, const PipelineOp &op)
+  {
+    check_cuda_error(cudaStreamWaitEvent(decoding_stream_, encoded_event_[op.slot], 0));
+
+    decoding_params.memory_tensor = memory_tensor_[op.slot];
+    decoding_params.memory_sequence_length = memory_sequence_length_[op.slot];
+    decoding_params.output_ids = batch.output_ids;
+    decoding_params.parent_ids = batch.parent_ids;
+    decoding_params.sequence_length = batch.output_sequence_length;
+    decoding_params.enqueue_us = batch.enqueue_us;
+    decoding_->forward(decoder_param_.data(), decoding_params);
+
+    // the decoding synchronized with the encoder of the batch at its first step
+    if (decoding_params.metrics != nullptr)
+    {
+      float encode_ms = 0.0f;
+      check_cuda_error(cudaEventElapsedTime(&encode_ms, encode_start_event_[op.slot], encode_end_event_[op.slot]));
+      decoding_params.metrics->record(RequestMetric::ENCODE_TIME, (uint64_t)(encode_ms * 1000.0f), batch_size_);
+    }
+
+    check_cuda_error(cudaEventRecord(decoded_event_[op.slot], decoding_stream_));
+  }
+};
+
+} // namespace fastertransformer
@@ -256,8 +256,47 @@ class TransformerPlugin: public IPluginV2
       }
     }
 
-    virtual size_t getSerializationSize() const override {return 0;}
-    virtual void serialize(void* buffer) const override {}
+    /* deserialized from an engine, the weights are read from data */
+    TransformerPlugin(const void* data, size_t length): TransformerPlugin(SerializedLayer(data, length)) {}
+
+    /* the data type, the dimensions, then the weights of the layer */
+    virtual size_t getSerializationSize() const override
+    {
+      size_t size = 5 * sizeof(int);
+      for(int i = 0; i < 16; ++i)
+        size += weight_count(i, hidden_dim_) * sizeof(T);
+      return size;
+    }
+    virtual void serialize(void* buffer) const override
+    {
+      int *header = (int*)buffer;
+      header[0] = (int)TransformerTrtTraits<T>::DataType;
+      header[1] = hidden_dim_;
+      header[2] = head_num_;
+      header[3] = seq_len_;
+      header[4] = max_batch_size_;
+      char *ptr = (char*)(header + 5);
+      const T *weights[16] = {d_attr_kernel_Q_, d_attr_kernel_K_, d_attr_kernel_V_,
+                              d_attr_bias_Q_, d_attr_bias_K_, d_attr_bias_V_,
+                              d_attr_output_kernel_, d_attr_output_bias_,
+                              d_attr_output_layernorm_beta_, d_attr_output_layernorm_gamma_,
+                              d_inter_kernel_, d_inter_bias_, d_output_kernel_, d_output_bias_,
+                              d_output_layernorm_beta_, d_output_layernorm_gamma_};
+      for(int i = 0; i < 16; ++i)
+      {
+        const size_t bytes = weight_count(i, hidden_dim_) * sizeof(T);
+        check_cuda_error(cudaMemcpy(ptr, weights[i], bytes, cudaMemcpyDeviceToHost));
+        ptr += bytes;
+      }
+    }
+
+    /* number of values of the i-th weight, in the order of the constructors */
+    static int weight_count(int i, int hidden_dim)
+    {
+      static const int kernel_scale[16] = {1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 4, 0, 4, 0, 0, 0};
+      static const int bias_scale[16] = {0, 0, 0, 1, 1, 1, 0, 1, 1, 1, 0, 4, 0, 1, 1, 1};
+      return kernel_scale[i] * hidden_dim * hidden_dim + bias_scale[i] * hidden_dim;
+    }
 
     int getNbOutputs() const override {return 1;}
 
@@ -340,10 +379,6 @@ class TransformerPlugin: public IPluginV2
       assert(w.count == nValue);
       check_cuda_error(cudaMalloc(&dpWeight, nValue * sizeof(T)));
       check_cuda_error(cudaMemcpy(dpWeight, w.values, nValue * sizeof(T), cudaMemcpyHostToDevice));
-
-      T* data = (T*)malloc(sizeof(T) * nValue);
-      cudaMemcpy(data, dpWeight, sizeof(T) * nValue, cudaMemcpyDeviceToHost);
-
     }
     static void cudaMallocAndCopy(T*&dpWeight, const T *&dpWeightOld, int nValue) 
     {
@@ -352,6 +387,36 @@ class TransformerPlugin: public IPluginV2
     }
 
   private:
+    /* the weights point into the serialized data, which outlives the construction */
+    struct SerializedLayer
+    {
+      int hidden_dim, head_num, seq_len, max_batch_size;
+      nvinfer1::Weights w[16];
+
+      SerializedLayer(const void* data, size_t length)
+      {
+        const int *header = (const int*)data;
+        assert(length >= 5 * sizeof(int) && header[0] == (int)TransformerTrtTraits<T>::DataType);
+        hidden_dim = header[1];
+        head_num = header[2];
+        seq_len = header[3];
+        max_batch_size = header[4];
+        const char *ptr = (const char*)(header + 5);
+        for(int i = 0; i < 16; ++i)
+        {
+          const int count = weight_count(i, hidden_dim);
+          w[i] = nvinfer1::Weights{TransformerTrtTraits<T>::DataType, ptr, (long)count};
+          ptr += count * sizeof(T);
+        }
+        assert((size_t)(ptr - (const char*)data) == length);
+      }
+    };
+
+    explicit TransformerPlugin(const SerializedLayer &layer): TransformerPlugin(
+        layer.hidden_dim, layer.head_num, layer.seq_len, layer.max_batch_size,
+        layer.w[0], layer.w[1], layer.w[2], layer.w[3], layer.w[4], layer.w[5], layer.w[6], layer.w[7],
+        layer.w[8], layer.w[9], layer.w[10], layer.w[11], layer.w[12], layer.w[13], layer.w[14], layer.w[15]) {}
+
     int hidden_dim_ = 0, head_num_ = 0, seq_len_ = 0, max_batch_size_;
     T *d_attr_kernel_Q_ = NULL, *d_attr_kernel_K_ = NULL, *d_attr_kernel_V_ = NULL;
     T *d_attr_bias_Q_ = NULL, *d_attr_bias_K_ = NULL, *d_attr_bias_V_ = NULL;
@@ -365,3 +430,42 @@ class TransformerPlugin: public IPluginV2
     BertEncoderTransformer<EncoderTraits_> *encoder_transformer_;
     fastertransformer::Allocator<AllocatorType::CUDA> *allocator_;
 };
+
+/* recreates the plugins of a serialized engine, the layers are only built from weights by TRT_Transformer */
+class TransformerPluginCreator: public IPluginCreator
+{
+  public:
+    TransformerPluginCreator()
+    {
+      field_collection_.nbFields = 0;
+      field_collection_.fields = nullptr;
+    }
+
+    const char* getPluginName() const override {return "TransformerPlugin";}
+    const char* getPluginVersion() const override {return "0";}
+    const PluginFieldCollection* getFieldNames() override {return &field_collection_;}
+
+    IPluginV2* createPlugin(const char* name, const PluginFieldCollection* fc) override {return nullptr;}
+
+    IPluginV2* deserializePlugin(const char* name, const void* serialData, size_t serialLength) override
+    {
+      const nvinfer1::DataType dtype = (nvinfer1::DataType)((const int*)serialData)[0];
+      if(dtype == nvinfer1::DataType::kHALF)
+        return new TransformerPlugin<half>(serialData, serialLength);
+      return new TransformerPlugin<float>(serialData, serialLength);
+    }
+
+    void setPluginNamespace(const char* szNamespace) override {}
+    const char* getPluginNamespace() const override {return "";}
+
+    /* once per process, before an engine is deserialized */
+    static void register_creator()
+    {
+      static TransformerPluginCreator creator;
+      static bool registered = getPluginRegistry()->registerCreator(creator, "");
+      (void)registered;
+    }
+
+  private:
+    PluginFieldCollection field_collection_;
+};
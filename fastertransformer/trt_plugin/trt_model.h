@@ -37,6 +37,7 @@ class TRT_Transformer
       :batch_size_(batch_size), seq_len_(seq_len), head_num_(head_num), hidden_dim_(hidden_dim), num_layers_(num_layers) 
     {
        dtype_ = TransformerTrtTraits<T>::DataType;
+       runtime_ = nullptr;
     }
 
     ~TRT_Transformer()
@@ -46,6 +47,8 @@ class TRT_Transformer
       check_cuda_error(cudaFree(buffers[output_index_]));
       context_->destroy();
       engine_->destroy();
+      if(runtime_ != nullptr)
+        runtime_->destroy();
     }
 
     nvinfer1::Weights point2weight(T* ptr, int size)
@@ -112,6 +115,39 @@ class TRT_Transformer
       network->destroy();
       builder->destroy();
 
+      setup_buffers();
+   }
+
+   /* the engine built by build_engine, to be loaded by load_engine */
+   void serialize(std::vector<char> &data)
+   {
+     nvinfer1::IHostMemory* memory = engine_->serialize();
+     assert(memory);
+     data.assign((const char*)memory->data(), (const char*)memory->data() + memory->size());
+     memory->destroy();
+   }
+
+   /* instead of build_engine, the engine should have been built for the same shapes */
+   bool load_engine(const void* data, size_t size)
+   {
+     TransformerPluginCreator::register_creator();
+     runtime_ = nvinfer1::createInferRuntime(gLogger);
+     assert(runtime_);
+     engine_ = runtime_->deserializeCudaEngine(data, size, nullptr);
+     if(engine_ == nullptr || engine_->getMaxBatchSize() != batch_size_)
+     {
+       if(engine_ != nullptr)
+         engine_->destroy();
+       runtime_->destroy();
+       runtime_ = nullptr;
+       return false;
+     }
+     setup_buffers();
+     return true;
+   }
+
+   void setup_buffers()
+   {
       input_index_ = engine_->getBindingIndex(INPUT_BLOB_NAME);
       mask_index_ = engine_->getBindingIndex(MASK_BLOB_NAME);
       output_index_ = engine_->getBindingIndex(OUTPUT_BLOB_NAME);
@@ -138,6 +174,7 @@ class TRT_Transformer
     const int batch_size_, seq_len_, head_num_, hidden_dim_, num_layers_;
     nvinfer1::DataType dtype_;
     int inputN_, outputN_, input_index_, mask_index_, output_index_;
+    nvinfer1::IRuntime* runtime_;
     nvinfer1::ICudaEngine* engine_;
     nvinfer1::IExecutionContext* context_;
     std::map<std::string, nvinfer1::Weights> weightMap_;
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Host quantization of the weights to the int8 layouts of cuBLASLt
+ *
+ * Shared by the WeightQuantize ops of TensorFlow and PyTorch. The columns of
+ * the weight are quantized in parallel on the ThreadPool, every column writes
+ * its own elements of the output.
+ **/
+
+#pragma once
+#include "fastertransformer/thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace fastertransformer
+{
+
+inline int index_CUBLASLT_ORDER_COL4_4R2_8C(int col_id, int row_id, int m_32){
+  int new_col = col_id >> 5;
+  int new_row =   //CUBLASLT_ORDER_COL4_4R2_8C
+                  ////row_id/8 is the number of tile of (8 rows 32 columns) -- column-major
+                  ////row_id%2 is even row, otherwise odd row
+                  ////col_id%COL32_/8 is the number tile of (8 rows 8 columns)
+                  (
+                  ((((row_id >> 3) << 3) + ((row_id&1) << 2) + ((col_id&31) >> 3)) << 5) +
+                  ////col_id%8 >= 4 is the right half of (8 rows 8 columns) tile
+                  ////(row_id%8/2) is (the row id of alternating 4 rows) - 1
+                  (((((col_id&7) >= 4)?4:0) + ((row_id&7) >> 1)) << 2) +
+                  ////col_id%4 is the id of 4 cols
+                  (col_id&3)
+                  )
+                  ;
+  return new_col*m_32 + new_row;
+}
+
+inline int index_CUBLASLT_ORDER_COL32_2R_4R4(int col_id, int row_id, int m_32){
+  int new_col = col_id >> 5;
+  int row_in_tile = row_id & 31;
+  int col_in_tile = col_id & 31;
+  int new_row =   //CUBLASLT_ORDER_COL32_2R_4R4
+                  (
+                  ((row_id >> 5) << 10) +
+                  //(((row%8)/2*4+row/8)*2+row%2)*32+col
+                  (((((((row_in_tile&7)>>1)<<2)+(row_in_tile>>3))<<1)+(row_in_tile&1))<<5)+col_in_tile
+                  )
+                  ;
+  return new_col*m_32 + new_row;
+}
+
+//be consistent with FasterTransformer
+inline int8_t float_to_int8_rn_host(float x){
+  int8_t res;
+  int32_t tmp;
+  if (x >= 0){
+    tmp = int(x + 0.5);
+    tmp = tmp > 127 ? 127 : tmp;
+    res = int8_t(tmp);
+  }
+  else{
+    tmp = int(x - 0.5);
+    tmp = tmp < -127 ? -127 : tmp;
+    res = int8_t(tmp);
+  }
+  return res;
+}
+
+/* amaxs [n] of the rows, the maximum of quant_max[0] and of the channels without per_channel_quantization */
+inline void quantization_amaxs(float* amaxs, const float* quant_max, const float *quant_min, int n, bool per_channel_quantization){
+  float amax_in_all = fabs(quant_max[0]);
+  if (per_channel_quantization){
+    for (int i = 0 ; i < n ; i++){
+      amaxs[i] = fabs(quant_min[i]);
+      if (fabs(quant_max[i]) > amaxs[i])
+        amaxs[i] = fabs(quant_max[i]);
+      if (amaxs[i] > amax_in_all)
+        amax_in_all = amaxs[i];
+    }
+  }
+  if (!per_channel_quantization){
+    for (int i = 0 ; i < n ; i++){
+      amaxs[i] = amax_in_all;
+    }
+  }
+}
+
+/* int8 dst of weight [k, n] with index(col, row, 32*n), k columns of n rows */
+template <typename T, typename Index>
+void quantization_in_order(T *dst, const float* amaxs, const T* weight, int n, int k, Index index, ThreadPool &pool){
+  int8_t* int8_dst = (int8_t*)dst;
+  const int grain = std::max(1, 16384 / std::max(n, 1));
+  parallel_for(0, k, grain, [&](const int col_begin, const int col_end){
+    for (int col = col_begin ; col < col_end ; col++){
+      const T* weight_col = weight + (long long)col*n;
+      for (int row = 0 ; row < n ; row++){
+        float element = float(weight_col[row]);
+        int8_dst[index(col, row, 32*n)] = float_to_int8_rn_host(element*127.0/amaxs[row]);
+      }
+    }
+  }, pool);
+}
+
+template <typename T>
+void quantization_CUBLASLT_ORDER_COL4_4R2_8C(T *dst, float* amaxs, const T* weight, const float* quant_max, const float *quant_min, int n, int k, bool per_channel_quantization,
+                                             ThreadPool &pool = ThreadPool::global()){
+  quantization_amaxs(amaxs, quant_max, quant_min, n, per_channel_quantization);
+  quantization_in_order(dst, amaxs, weight, n, k, index_CUBLASLT_ORDER_COL4_4R2_8C, pool);
+}
+
+template <typename T>
+void quantization_CUBLASLT_ORDER_COL32_2R_4R4(T *dst, float* amaxs, const T* weight, const float* quant_max, const float *quant_min, int n, int k, bool per_channel_quantization,
+                                              ThreadPool &pool = ThreadPool::global()){
+  quantization_amaxs(amaxs, quant_max, quant_min, n, per_channel_quantization);
+  quantization_in_order(dst, amaxs, weight, n, k, index_CUBLASLT_ORDER_COL32_2R_4R4, pool);
+}
+
+} // namespace fastertransformer
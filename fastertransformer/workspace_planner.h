@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Static workspace planner
+ *
+ * Each buffer of a workspace is registered with its size and the range of
+ * stages [first_use, last_use] in which it is live. plan() places the buffers
+ * by size, largest first, at the lowest aligned offset that does not overlap
+ * any placed buffer whose live range intersects, so buffers with disjoint
+ * lifetimes share memory. The planner only computes offsets and does not
+ * depend on CUDA.
+ **/
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastertransformer
+{
+
+#define WORKSPACE_ALIGNMENT 256
+
+struct WorkspaceTensor
+{
+  std::string name;
+  size_t bytes;
+  int first_use;
+  int last_use;
+  size_t offset;
+};
+
+class WorkspacePlanner
+{
+private:
+  size_t alignment_;
+  std::vector<WorkspaceTensor> tensors_;
+  size_t total_bytes_;
+  bool planned_;
+
+  size_t aligned(const size_t bytes) const
+  {
+    return (bytes + alignment_ - 1) / alignment_ * alignment_;
+  }
+
+  static bool is_live_together(const WorkspaceTensor &a, const WorkspaceTensor &b)
+  {
+    return a.first_use <= b.last_use && b.first_use <= a.last_use;
+  }
+
+public:
+  WorkspacePlanner(const size_t alignment = WORKSPACE_ALIGNMENT) : alignment_(alignment), total_bytes_(0), planned_(false)
+  {
+    if (alignment_ == 0 || (alignment_ & (alignment_ - 1)) != 0)
+    {
+      printf("[ERROR][WorkspacePlanner] alignment %zu is not a power of 2. \n", alignment_);
+      exit(-1);
+    }
+  }
+
+  /* return the id of the tensor, the tensor is live from stage first_use to stage last_use (inclusive) */
+  int add(const std::string &name, const size_t bytes, const int first_use, const int last_use)
+  {
+    if (planned_ || first_use > last_use)
+    {
+      printf("[ERROR][WorkspacePlanner] cannot add %s with live range [%d, %d]. \n", name.c_str(), first_use, last_use);
+      exit(-1);
+    }
+    WorkspaceTensor tensor;
+    tensor.name = name;
+    tensor.bytes = bytes;
+    tensor.first_use = first_use;
+    tensor.last_use = last_use;
+    tensor.offset = 0;
+    tensors_.push_back(tensor);
+    return (int)tensors_.size() - 1;
+  }
+
+  template <typename T>
+  int add(const std::string &name, const size_t num, const int first_use, const int last_use)
+  {
+    return add(name, sizeof(T) * num, first_use, last_use);
+  }
+
+  void plan()
+  {
+    std::vector<int> order(tensors_.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = (int)i;
+    // larger first, then the earlier one, then the registration order
+    std::stable_sort(order.begin(), order.end(), [this](const int a, const int b) {
+      if (tensors_[a].bytes != tensors_[b].bytes)
+        return tensors_[a].bytes > tensors_[b].bytes;
+      return tensors_[a].first_use < tensors_[b].first_use;
+    });
+
+    std::vector<int> placed;
+    total_bytes_ = 0;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      WorkspaceTensor &tensor = tensors_[order[i]];
+      std::vector<int> conflicts;
+      for (size_t j = 0; j < placed.size(); j++)
+        if (is_live_together(tensor, tensors_[placed[j]]))
+          conflicts.push_back(placed[j]);
+      std::sort(conflicts.begin(), conflicts.end(), [this](const int a, const int b) {
+        return tensors_[a].offset < tensors_[b].offset;
+      });
+
+      // first gap between the conflicting tensors that is large enough
+      size_t offset = 0;
+      const size_t size = aligned(tensor.bytes);
+      for (size_t j = 0; j < conflicts.size(); j++)
+      {
+        const WorkspaceTensor &other = tensors_[conflicts[j]];
+        if (offset + size <= other.offset)
+          break;
+        offset = std::max(offset, aligned(other.offset + other.bytes));
+      }
+      tensor.offset = offset;
+      total_bytes_ = std::max(total_bytes_, offset + size);
+      placed.push_back(order[i]);
+    }
+    planned_ = true;
+  }
+
+  size_t offset(const int id) const
+  {
+    if (!planned_)
+    {
+      printf("[ERROR][WorkspacePlanner] plan() should be called before offset(). \n");
+      exit(-1);
+    }
+    return tensors_[id].offset;
+  }
+
+  template <typename T>
+  T *get(void *base, const int id) const
+  {
+    return (T *)((char *)base + offset(id));
+  }
+
+  /* the size of the workspace, it is a multiple of the alignment */
+  size_t total_bytes() const { return total_bytes_; }
+
+  /* the size without sharing, every tensor has its own aligned range */
+  size_t unshared_bytes() const
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < tensors_.size(); i++)
+      bytes += aligned(tensors_[i].bytes);
+    return bytes;
+  }
+
+  /* Return false if two tensors that are live at the same stage overlap, or a tensor is misaligned. */
+  bool validate() const
+  {
+    for (size_t i = 0; i < tensors_.size(); i++)
+    {
+      const WorkspaceTensor &a = tensors_[i];
+      if (a.offset % alignment_ != 0 || a.offset + a.bytes > total_bytes_)
+        return false;
+      for (size_t j = i + 1; j < tensors_.size(); j++)
+      {
+        const WorkspaceTensor &b = tensors_[j];
+        if (a.bytes == 0 || b.bytes == 0 || !is_live_together(a, b))
+          continue;
+        if (a.offset < b.offset + b.bytes && b.offset < a.offset + a.bytes)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  void print() const
+  {
+    for (size_t i = 0; i < tensors_.size(); i++)
+      printf("[INFO] workspace %-28s offset %10zu bytes %10zu live [%d, %d] \n", tensors_[i].name.c_str(),
+             tensors_[i].offset, tensors_[i].bytes, tensors_[i].first_use, tensors_[i].last_use);
+    printf("[INFO] workspace total %zu bytes (%zu bytes without sharing) \n", total_bytes_, unshared_bytes());
+  }
+
+  size_t tensor_num() const { return tensors_.size(); }
+};
+
+} // namespace fastertransformer
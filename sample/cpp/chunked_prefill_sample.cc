@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Simulation of the chunked prefill scheduler on the host
+ *
+ * A small schedule is compared with the expected steps. Then a stream of
+ * short and long prompts is served with the time of the steps given by
+ * StepCostModel, once with chunked prefill and once with every prompt in a
+ * single step. The rows of every step are checked (budget, positions, every
+ * prompt token once, a token for every decoding sequence in every step), and
+ * the time between tokens and the time to the first token are printed.
+ **/
+
+#include "fastertransformer/chunked_prefill_scheduler.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] chunked prefill %s check. \n", name);
+  else
+    printf("[ERROR] chunked prefill %s fail \n", name);
+  return ok;
+}
+
+static bool same_entry(const StepEntry &entry, const int seq_id, const int position, const int token_num,
+                       const bool prefill, const bool sample)
+{
+  return entry.seq_id == seq_id && entry.position == position && entry.token_num == token_num &&
+         entry.prefill == prefill && entry.sample == sample;
+}
+
+/* 2 slots, 8 tokens per step and chunks of 4: sequence 0 has a prompt of 10 tokens, sequence 1
+   of 3 tokens, and sequence 2 waits for a slot */
+static bool plan_check()
+{
+  ChunkedPrefillConfig config;
+  config.slot_num = 2;
+  config.token_budget = 8;
+  config.chunk_size = 4;
+  config.max_seq_len = 32;
+  ChunkedPrefillScheduler scheduler(config);
+  std::vector<int> prompt(10);
+  for(int i = 0; i < 10; i++)
+    prompt[i] = 100 + i;
+  scheduler.add_sequence(prompt.data(), 10, 2);
+  scheduler.add_sequence(prompt.data(), 3, 2);
+  scheduler.add_sequence(prompt.data(), 2, 1);
+  const int end_id = 0;
+  int sampled[2] = {7, 8};
+
+  StepPlan plan = scheduler.schedule();
+  bool ok = plan.entries.size() == 2 && same_entry(plan.entries[0], 0, 0, 4, true, false) &&
+            same_entry(plan.entries[1], 1, 0, 3, true, true) && plan.token_num() == 7 &&
+            plan.sample_rows.size() == 1 && plan.sample_rows[0] == 6 && plan.row_slots[4] == 1 &&
+            plan.row_ids[3] == 103 && plan.context_positions == 10 + 6;
+  scheduler.complete(plan, sampled, end_id);
+
+  // the decode of sequence 1 comes first, the next chunk of sequence 0 takes the rest
+  plan = scheduler.schedule();
+  ok &= plan.entries.size() == 2 && same_entry(plan.entries[0], 1, 3, 1, false, true) &&
+        same_entry(plan.entries[1], 0, 4, 4, true, false) && plan.row_ids[0] == 7;
+  sampled[0] = end_id;
+  const std::vector<int> finished = scheduler.complete(plan, sampled, end_id);
+  ok &= finished.size() == 1 && finished[0] == 1 && scheduler.sequence(1).generated == 2;
+
+  // sequence 1 ended, sequence 2 takes its slot with the last chunk of sequence 0
+  plan = scheduler.schedule();
+  ok &= plan.entries.size() == 2 && same_entry(plan.entries[0], 0, 8, 2, true, true) &&
+        same_entry(plan.entries[1], 2, 0, 2, true, true) && plan.entries[1].slot == 1;
+  sampled[0] = 9;
+  sampled[1] = 10;
+  ok &= scheduler.complete(plan, sampled, end_id).size() == 1;   // sequence 2 wants 1 token
+
+  plan = scheduler.schedule();
+  ok &= plan.entries.size() == 1 && same_entry(plan.entries[0], 0, 10, 1, false, true) && plan.row_ids[0] == 9;
+  ok &= scheduler.complete(plan, sampled, end_id).size() == 1 && scheduler.idle();
+  ok &= scheduler.sequence(0).tokens.size() == 12 && scheduler.sequence(0).tokens[11] == 9;
+  return check_result("plan", ok);
+}
+
+struct ServeResult
+{
+  bool valid = true;
+  double total_ms = 0.0;
+  std::vector<double> token_gaps;     // between consecutive tokens of a sequence
+  std::vector<double> first_tokens;   // from the arrival
+  int max_step_tokens = 0;
+};
+
+static double percentile(std::vector<double> values, const double q)
+{
+  if(values.empty())
+    return 0.0;
+  std::sort(values.begin(), values.end());
+  const size_t index = std::min(values.size() - 1, (size_t)(q * values.size()));
+  return values[index];
+}
+
+/* every 8th request has a long prompt, a request arrives every interval_ms */
+static ServeResult serve(const ChunkedPrefillConfig &config, const StepCostModel &cost, const int request_num,
+                         const double interval_ms)
+{
+  ChunkedPrefillScheduler scheduler(config);
+  ServeResult result;
+  std::vector<double> arrivals(request_num), last_token(request_num, -1.0);
+  std::vector<int> prompt_lengths(request_num), covered(request_num, 0);
+  std::vector<int> prompt(config.max_seq_len);
+  for(int i = 0; i < config.max_seq_len; i++)
+    prompt[i] = 1 + i % 50000;
+  const int max_new_tokens = 64;
+  const int end_id = 0;
+
+  double now = 0.0;
+  int next = 0;
+  while(next < request_num || !scheduler.idle())
+  {
+    while(next < request_num && next * interval_ms <= now)
+    {
+      prompt_lengths[next] = next % 8 == 3 ? config.max_seq_len - max_new_tokens : 16 + next % 32;
+      arrivals[next] = next * interval_ms;
+      scheduler.add_sequence(prompt.data(), prompt_lengths[next], max_new_tokens);
+      next++;
+    }
+    StepPlan plan = scheduler.schedule();
+    if(plan.empty())
+    {
+      now = next * interval_ms;
+      continue;
+    }
+    result.max_step_tokens = std::max(result.max_step_tokens, plan.token_num());
+    result.valid &= plan.token_num() <= config.token_budget;
+
+    // a row of every decoding sequence, the chunks continue where the prompt stopped
+    int decoding = 0;
+    for(int s = 0; s < scheduler.sequence_num(); s++)
+      decoding += scheduler.sequence(s).state == ChunkedSequenceState::DECODE;
+    result.valid &= plan.decode_tokens == decoding;
+    for(size_t e = 0; e < plan.entries.size(); e++)
+    {
+      const StepEntry &entry = plan.entries[e];
+      if(entry.prefill)
+      {
+        result.valid &= entry.position == covered[entry.seq_id] && entry.token_num <= config.chunk_size;
+        covered[entry.seq_id] += entry.token_num;
+      }
+    }
+
+    now += cost.cost(plan);
+    std::vector<int> sampled(plan.sample_rows.size());
+    for(size_t i = 0; i < sampled.size(); i++)
+      sampled[i] = 1 + (int)(i * 7919 % 50000);
+    int sample = 0;
+    for(size_t e = 0; e < plan.entries.size(); e++)
+    {
+      const StepEntry &entry = plan.entries[e];
+      if(!entry.sample)
+        continue;
+      sample++;
+      if(last_token[entry.seq_id] < 0.0)
+        result.first_tokens.push_back(now - arrivals[entry.seq_id]);
+      else
+        result.token_gaps.push_back(now - last_token[entry.seq_id]);
+      last_token[entry.seq_id] = now;
+    }
+    result.valid &= sample == (int)sampled.size();
+    scheduler.complete(plan, sampled.data(), end_id);
+  }
+  for(int i = 0; i < request_num; i++)
+  {
+    const ChunkedSequence &seq = scheduler.sequence(i);
+    result.valid &= covered[i] == prompt_lengths[i] && seq.generated == max_new_tokens &&
+                    seq.state == ChunkedSequenceState::FINISHED;
+  }
+  result.total_ms = now;
+  return result;
+}
+
+static void print_result(const char *name, const ServeResult &result)
+{
+  printf("[INFO] %-10s max step %5d tokens, time between tokens p50 %6.2f p99 %6.2f max %7.2f ms, "
+         "first token p50 %7.2f p99 %7.2f ms, total %.0f ms \n",
+         name, result.max_step_tokens, percentile(result.token_gaps, 0.5), percentile(result.token_gaps, 0.99),
+         percentile(result.token_gaps, 1.0), percentile(result.first_tokens, 0.5),
+         percentile(result.first_tokens, 0.99), result.total_ms);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 4)
+  {
+    printf("[ERROR] chunked_prefill_sample token_budget chunk_size request_num \n");
+    printf("e.g., ./bin/chunked_prefill_sample 256 128 400\n");
+    return 0;
+  }
+  bool pass = plan_check();
+
+  ChunkedPrefillConfig config;
+  config.slot_num = 16;
+  config.max_seq_len = 1024;
+  config.token_budget = atoi(argv[1]);
+  config.chunk_size = atoi(argv[2]);
+  const int request_num = atoi(argv[3]);
+  StepCostModel cost;
+
+  // the whole prompt in one step, the budget holds the prompts of all the slots
+  ChunkedPrefillConfig whole = config;
+  whole.token_budget = config.slot_num * config.max_seq_len;
+  whole.chunk_size = config.max_seq_len;
+
+  const double interval_ms = 20.0;
+  const ServeResult chunked = serve(config, cost, request_num, interval_ms);
+  const ServeResult baseline = serve(whole, cost, request_num, interval_ms);
+  print_result("chunked", chunked);
+  print_result("whole", baseline);
+  pass &= check_result("steps", chunked.valid && baseline.valid);
+  // a step is bounded by the budget, a long prompt no longer stalls the decoding sequences
+  const double bound = cost.step_ms + cost.token_ms * config.token_budget +
+                       cost.context_ms * config.token_budget * config.max_seq_len;
+  pass &= check_result("time between tokens", percentile(chunked.token_gaps, 1.0) <= bound &&
+                       percentile(chunked.token_gaps, 1.0) < percentile(baseline.token_gaps, 1.0));
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,836 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Runs the kernel checks of decoding_kernel_check.h on synthetic inputs
+ *
+ * The checks compare the kernels with their CPU references and exit on the
+ * first mismatch. Without argument all checks run, else only the named one:
+ *
+ *   moe: routing and gather of the mixture-of-experts FFN with many ties, a
+ *        capacity that drops rows and more experts than the block size.
+ *   topk: top-k sampling frequencies for the register and the radix select
+ *         kernels on GPT-2 and BERT sized vocabularies, greedy k = 1 against
+ *         topk_sampling_cpu, and an unsupported k throws.
+ *   cross_attention: the opt kernels (head size 32, 64 and 128, half2 for half)
+ *                    and the generic kernel with mixed memory lengths, at the
+ *                    first step (K/V bias added to the caches) and later ones.
+ *   padded_vocab: the padded logit columns get the largest values and the
+ *                 masking of DecodingGpt2 (temperature kernel), DecodingSampling
+ *                 (padded bias, top-k and top-p) and DecodingBeamsearch (padded
+ *                 bias, fused and unfused top-k) never emits an id >= vocab_size.
+ *   pooling: CLS and mean pooling of the encoder output, padded and with the
+ *            padding removed, with empty, single token and full sentences.
+ *   embedding_search: FP32, FP16 and INT8 candidates, with duplicated
+ *                     candidates (tied scores) and queries equal to a candidate.
+ *   token_constraint: the mask and advance kernels of the constrained decoding
+ *                     against TokenAutomaton, with unconstrained and dead rows,
+ *                     padded vocab columns and the beam reorder by parent_ids.
+ *   stop_criteria: stop sequences and max_new_tokens per sentence, for sampling
+ *                  and for beams whose histories follow parent_ids.
+ **/
+
+#include "fastertransformer/cuda/decoding_kernel_check.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <cuda_fp16.h>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] decoding kernel %s check. \n", name);
+  else
+    printf("[ERROR] decoding kernel %s fail \n", name);
+  return ok;
+}
+
+static void from_float(const float x, float &y) { y = x; }
+static void from_float(const float x, half &y) { y = __float2half(x); }
+
+/* copy the [size] floats of h_buf to a new device buffer of T */
+template <typename T>
+static T *to_device(const float *h_buf, const int size)
+{
+  T *h_typed = new T[size];
+  for(int i = 0; i < size; i++)
+    from_float(h_buf[i], h_typed[i]);
+  T *d_buf;
+  check_cuda_error(cudaMalloc((void **)&d_buf, sizeof(T) * size));
+  check_cuda_error(cudaMemcpy(d_buf, h_typed, sizeof(T) * size, cudaMemcpyHostToDevice));
+  delete [] h_typed;
+  return d_buf;
+}
+
+/* The gating logits are small integers, so most tokens have tied experts (the smaller id
+   wins), and they are exact in half. A capacity factor below 1 always drops rows. */
+template <typename T>
+static bool moe_check(const int m, const int n, const int expert_num, const int moe_k,
+                      const float capacity_factor, const bool use_bias, cudaStream_t stream)
+{
+  printf("[INFO] moe check with m %d, expert_num %d, moe_k %d, capacity_factor %.2f. \n",
+         m, expert_num, moe_k, capacity_factor);
+  const int capacity = moe_expert_capacity(m, expert_num, moe_k, capacity_factor);
+
+  float *h_logits = new float[m * expert_num];
+  float *h_bias = new float[expert_num];
+  float *h_input = new float[m * n];
+  for(int i = 0; i < m * expert_num; i++) h_logits[i] = (float)(rand() % 4);
+  for(int e = 0; e < expert_num; e++) h_bias[e] = (float)(e % 2);
+  for(int i = 0; i < m * n; i++) h_input[i] = (float)(rand() % 100) / 10.f;
+
+  T *d_logits = to_device<T>(h_logits, m * expert_num);
+  T *d_bias = use_bias ? to_device<T>(h_bias, expert_num) : nullptr;
+  T *d_input = to_device<T>(h_input, m * n);
+  int *d_expert_ids, *d_expanded_slots, *d_expert_counts;
+  float *d_gate_weights;
+  T *d_permuted_input;
+  check_cuda_error(cudaMalloc((void **)&d_expert_ids, sizeof(int) * m * moe_k));
+  check_cuda_error(cudaMalloc((void **)&d_gate_weights, sizeof(float) * m * moe_k));
+  check_cuda_error(cudaMalloc((void **)&d_expanded_slots, sizeof(int) * m * moe_k));
+  check_cuda_error(cudaMalloc((void **)&d_expert_counts, sizeof(int) * expert_num));
+  check_cuda_error(cudaMalloc((void **)&d_permuted_input, sizeof(T) * expert_num * capacity * n));
+  check_cuda_error(cudaMemset(d_permuted_input, 0, sizeof(T) * expert_num * capacity * n));
+
+  moe_routing_kernel_check(d_logits, (const T *)d_bias, d_expert_ids, d_gate_weights, d_expanded_slots, d_expert_counts,
+                           m, expert_num, moe_k, capacity, stream);
+  moe_gather_kernel_check((const T *)d_input, d_expanded_slots, d_permuted_input, m, n, moe_k, stream);
+
+  // the checks agree with the CPU, make sure the overflow case really dropped some rows
+  int *h_expanded_slots = new int[m * moe_k];
+  check_cuda_error(cudaMemcpy(h_expanded_slots, d_expanded_slots, sizeof(int) * m * moe_k, cudaMemcpyDeviceToHost));
+  int dropped = 0;
+  for(int i = 0; i < m * moe_k; i++) dropped += h_expanded_slots[i] < 0 ? 1 : 0;
+  const bool ok = capacity_factor >= 1.0f || dropped > 0;
+
+  delete [] h_logits;
+  delete [] h_bias;
+  delete [] h_input;
+  delete [] h_expanded_slots;
+  check_cuda_error(cudaFree(d_logits));
+  if(d_bias != nullptr) check_cuda_error(cudaFree(d_bias));
+  check_cuda_error(cudaFree(d_input));
+  check_cuda_error(cudaFree(d_expert_ids));
+  check_cuda_error(cudaFree(d_gate_weights));
+  check_cuda_error(cudaFree(d_expanded_slots));
+  check_cuda_error(cudaFree(d_expert_counts));
+  check_cuda_error(cudaFree(d_permuted_input));
+  return check_result("moe", ok);
+}
+
+static bool moe_checks(cudaStream_t stream)
+{
+  bool ok = moe_check<float>(64, 128, 8, 2, 0.5f, true, stream);
+  ok &= moe_check<half>(64, 128, 8, 2, 1.25f, false, stream);
+  // more experts than the 32 lanes of the gating warp and the 256 threads of the permutation block
+  ok &= moe_check<float>(300, 64, 300, 2, 0.5f, true, stream);
+  ok &= moe_check<half>(97, 64, 1000, MOE_MAX_K, 1.0f, true, stream);
+  ok &= moe_check<float>(513, 32, 16, 1, 0.25f, false, stream);
+  return ok;
+}
+
+static DecodingSamplingArguments sampling_arguments(const int batch_size, const int vocab_size, const int k)
+{
+  DecodingSamplingArguments args;
+  memset(&args, 0, sizeof(args));
+  args.batch_size_ = batch_size;
+  args.vocab_size_ = vocab_size;
+  args.vocab_size_padded_ = vocab_size;
+  args.end_id_ = vocab_size - 1;
+  args.candidate_num_ = k;
+  args.probability_threshold_ = 0.0f;
+  return args;
+}
+
+/* random [batch_size, vocab_size] logits without ties, so the top k are well defined */
+static float *random_logits(const int batch_size, const int vocab_size)
+{
+  float *h_logits = new float[batch_size * vocab_size];
+  for(int i = 0; i < batch_size * vocab_size; i++)
+    h_logits[i] = 8.0f * rand() / RAND_MAX + 1e-7f * (i % vocab_size);
+  float *d_logits;
+  check_cuda_error(cudaMalloc((void **)&d_logits, sizeof(float) * batch_size * vocab_size));
+  check_cuda_error(cudaMemcpy(d_logits, h_logits, sizeof(float) * batch_size * vocab_size, cudaMemcpyHostToDevice));
+  delete [] h_logits;
+  return d_logits;
+}
+
+static bool topk_sampling_check(const int batch_size, const int vocab_size, const int k, const int trials, cudaStream_t stream)
+{
+  DecodingSamplingArguments args = sampling_arguments(batch_size, vocab_size, k);
+  float *d_logits = random_logits(batch_size, vocab_size);
+  int *d_ids;
+  check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * batch_size));
+  size_t workspace_size = 0;
+  void *workspace;
+  topK_sampling_kernel_kernelLauncher(nullptr, workspace_size, d_logits, d_ids, nullptr, nullptr, 0, args, stream);
+  check_cuda_error(cudaMalloc(&workspace, workspace_size > 0 ? workspace_size : 4));
+
+  topK_sampling_kernel_check(workspace, workspace_size, d_logits, d_ids, args, trials, stream);
+
+  bool ok = true;
+  if(k == 1)
+  {
+    // greedy, the GPU takes the same token as the CPU for any random number
+    float *h_logits = new float[batch_size * vocab_size];
+    int *h_ids = new int[batch_size];
+    check_cuda_error(cudaMemcpy(h_logits, d_logits, sizeof(float) * batch_size * vocab_size, cudaMemcpyDeviceToHost));
+    check_cuda_error(cudaMemcpy(h_ids, d_ids, sizeof(int) * batch_size, cudaMemcpyDeviceToHost));
+    for(int b = 0; b < batch_size; b++)
+      ok &= h_ids[b] == topk_sampling_cpu(h_logits + b * vocab_size, vocab_size, 1, 1.0f, 0.5f);
+    delete [] h_logits;
+    delete [] h_ids;
+  }
+
+  check_cuda_error(cudaFree(d_logits));
+  check_cuda_error(cudaFree(d_ids));
+  check_cuda_error(cudaFree(workspace));
+  return check_result("top-k sampling", ok);
+}
+
+/* k out of [1, min(TOPK_SAMPLING_MAX_K, vocab_size)] throws before any launch */
+static bool unsupported_topk_check(const int vocab_size, const int k)
+{
+  DecodingSamplingArguments args = sampling_arguments(1, vocab_size, k);
+  size_t workspace_size = 0;
+  int dummy = 0;
+  bool thrown = false;
+  try
+  {
+    topK_sampling_kernel_kernelLauncher((void *)&dummy, workspace_size, (float *)nullptr, (int *)nullptr,
+                                        nullptr, nullptr, 0, args, (cudaStream_t)0);
+  }
+  catch(std::runtime_error &e)
+  {
+    thrown = true;
+  }
+  return check_result("unsupported top-k", thrown);
+}
+
+static bool topk_checks(cudaStream_t stream)
+{
+  bool ok = true;
+  const int ks[] = {1, 3, 16, 40, 50, 1024};
+  const int vocab_sizes[] = {30000, 30522, 50257};
+  for(int i = 0; i < (int)(sizeof(ks) / sizeof(ks[0])); i++)
+    for(int j = 0; j < (int)(sizeof(vocab_sizes) / sizeof(vocab_sizes[0])); j++)
+      ok &= topk_sampling_check(4, vocab_sizes[j], ks[i], ks[i] > 50 ? 400 : 1000, stream);
+
+  ok &= unsupported_topk_check(50257, TOPK_SAMPLING_MAX_K + 1);
+  ok &= unsupported_topk_check(30, 40);
+  ok &= unsupported_topk_check(50257, -1);
+  return ok;
+}
+
+/* random values in [-1, 1) */
+static float *random_floats(const int size)
+{
+  float *h_buf = new float[size];
+  for(int i = 0; i < size; i++)
+    h_buf[i] = 2.0f * rand() / ((float)RAND_MAX + 1.0f) - 1.0f;
+  return h_buf;
+}
+
+template <typename T>
+static bool cross_attention_check(const int batch_size, const int head_num, const int size_per_head, const int seq_len,
+                                  cudaStream_t stream)
+{
+  printf("[INFO] cross attention check with size_per_head %d, seq_len %d. \n", size_per_head, seq_len);
+  const int hidden_units = head_num * size_per_head;
+  const int cache_size = batch_size * seq_len * hidden_units;
+
+  // the lengths cover a single position, the full memory and values in between
+  int *h_length = new int[batch_size];
+  for(int b = 0; b < batch_size; b++)
+    h_length[b] = b == 0 ? 1 : (b == 1 ? seq_len : 1 + rand() % seq_len);
+  int *d_length;
+  check_cuda_error(cudaMalloc((void **)&d_length, sizeof(int) * batch_size));
+  check_cuda_error(cudaMemcpy(d_length, h_length, sizeof(int) * batch_size, cudaMemcpyHostToDevice));
+
+  float *h_query = random_floats(batch_size * hidden_units);
+  float *h_bias = random_floats(hidden_units * 3);
+  float *h_key_cache = random_floats(cache_size);
+  float *h_value_cache = random_floats(cache_size);
+  T *d_query = to_device<T>(h_query, batch_size * hidden_units);
+  T *d_bias = to_device<T>(h_bias, hidden_units * 3);
+  T *d_key_cache = to_device<T>(h_key_cache, cache_size);
+  T *d_value_cache = to_device<T>(h_value_cache, cache_size);
+  T *d_context;
+  check_cuda_error(cudaMalloc((void **)&d_context, sizeof(T) * batch_size * hidden_units));
+
+  // step 1 adds the K/V bias to the caches, the next step reads the updated caches
+  for(int step = 1; step <= 2; step++)
+    cross_attention_kernel_check<T>(d_query, d_bias, d_key_cache, d_bias + hidden_units, d_value_cache, d_bias + 2 * hidden_units,
+                                    d_length, d_context, batch_size, head_num, size_per_head, step, seq_len, stream);
+
+  delete [] h_length;
+  delete [] h_query;
+  delete [] h_bias;
+  delete [] h_key_cache;
+  delete [] h_value_cache;
+  check_cuda_error(cudaFree(d_length));
+  check_cuda_error(cudaFree(d_query));
+  check_cuda_error(cudaFree(d_bias));
+  check_cuda_error(cudaFree(d_key_cache));
+  check_cuda_error(cudaFree(d_value_cache));
+  check_cuda_error(cudaFree(d_context));
+  return check_result("cross attention", true);
+}
+
+static bool cross_attention_checks(cudaStream_t stream)
+{
+  bool ok = true;
+  // 32, 64 and 128 take the opt kernels, 96 the generic one
+  const int sizes_per_head[] = {32, 64, 128, 96};
+  for(int i = 0; i < (int)(sizeof(sizes_per_head) / sizeof(sizes_per_head[0])); i++)
+  {
+    ok &= cross_attention_check<float>(6, 4, sizes_per_head[i], 37, stream);
+    ok &= cross_attention_check<half>(6, 4, sizes_per_head[i], 37, stream);
+    ok &= cross_attention_check<float>(3, 8, sizes_per_head[i], 300, stream);
+    ok &= cross_attention_check<half>(3, 8, sizes_per_head[i], 300, stream);
+  }
+  return ok;
+}
+
+/* [rows, vocab_size_padded] logits, the padded columns are larger than all the others */
+static float *padded_logits(const int rows, const int vocab_size, const int vocab_size_padded)
+{
+  float *h_logits = new float[rows * vocab_size_padded];
+  for(int i = 0; i < rows * vocab_size_padded; i++)
+    h_logits[i] = i % vocab_size_padded < vocab_size ? 10.0f * rand() / ((float)RAND_MAX + 1.0f) : 1e4f;
+  return h_logits;
+}
+
+static bool check_padded_ids(const char *name, const int *d_ids, const int size, const int vocab_size,
+                             const int vocab_size_padded)
+{
+  int *h_ids = new int[size];
+  check_cuda_error(cudaMemcpy(h_ids, d_ids, sizeof(int) * size, cudaMemcpyDeviceToHost));
+  bool ok = true;
+  for(int i = 0; i < size; i++)
+  {
+    // the beam search ids are beam * vocab_size_padded + token
+    const int id = h_ids[i] % vocab_size_padded;
+    if(h_ids[i] < 0 || id >= vocab_size)
+    {
+      printf("[ERROR] %s emits id %d on row %d with vocab_size %d. \n", name, id, i, vocab_size);
+      ok = false;
+    }
+  }
+  delete [] h_ids;
+  return ok;
+}
+
+/* DecodingGpt2 masks the padded columns to -inf in apply_temperature_penalty_kernelLauncher */
+static bool padded_gpt2_check(const int batch_size, const int vocab_size, const int k, cudaStream_t stream)
+{
+  const int vocab_size_padded = (vocab_size + 7) / 8 * 8;
+  DecodingSamplingArguments args = sampling_arguments(batch_size, vocab_size_padded, k);
+  float *d_logits;
+  int *d_ids;
+  check_cuda_error(cudaMalloc((void **)&d_logits, sizeof(float) * batch_size * vocab_size_padded));
+  check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * batch_size));
+  size_t workspace_size = 0;
+  void *workspace;
+  topK_sampling_kernel_kernelLauncher(nullptr, workspace_size, d_logits, d_ids, nullptr, nullptr, 0, args, stream);
+  check_cuda_error(cudaMalloc(&workspace, workspace_size > 0 ? workspace_size : 4));
+
+  padded_vocab_sampling_check(workspace, workspace_size, d_logits, d_ids, vocab_size, args, 20, stream);
+
+  check_cuda_error(cudaFree(d_logits));
+  check_cuda_error(cudaFree(d_ids));
+  check_cuda_error(cudaFree(workspace));
+  return check_result("padded vocab gpt2", true);
+}
+
+/* DecodingSampling adds the padded bias (lowest value of T on the padded columns) before
+   top-k sampling, or in the softmax before top-p sampling when k is 0 */
+template <typename T>
+static bool padded_sampling_check(const int batch_size, const int vocab_size, const int k, const float p,
+                                  cudaStream_t stream)
+{
+  const int vocab_size_padded = (vocab_size + 7) / 8 * 8;
+  DecodingSamplingArguments args = sampling_arguments(batch_size, vocab_size_padded, k);
+  args.probability_threshold_ = k == 0 ? p : 0.0f;
+
+  float *h_logits = padded_logits(batch_size, vocab_size, vocab_size_padded);
+  float *h_bias = random_floats(vocab_size);
+  T *d_logits = to_device<T>(h_logits, batch_size * vocab_size_padded);
+  T *d_bias = to_device<T>(h_bias, vocab_size);
+  T *d_bias_padded;
+  bool *d_finished;
+  int *d_sequence_length, *d_ids, *d_topp_id_vals, *d_topp_offsets;
+  check_cuda_error(cudaMalloc((void **)&d_bias_padded, sizeof(T) * vocab_size_padded));
+  check_cuda_error(cudaMalloc((void **)&d_finished, sizeof(bool) * batch_size));
+  check_cuda_error(cudaMalloc((void **)&d_sequence_length, sizeof(int) * batch_size));
+  check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * batch_size));
+  check_cuda_error(cudaMalloc((void **)&d_topp_id_vals, sizeof(int) * batch_size * vocab_size_padded));
+  check_cuda_error(cudaMalloc((void **)&d_topp_offsets, sizeof(int) * (batch_size + 1)));
+  check_cuda_error(cudaMemset(d_finished, 0, sizeof(bool) * batch_size));
+  check_cuda_error(cudaMemset(d_sequence_length, 0, sizeof(int) * batch_size));
+  pad_embedding_bias_kernelLauncher(d_bias_padded, (const T *)d_bias, vocab_size, vocab_size_padded, stream);
+
+  size_t workspace_size = 0;
+  void *workspace;
+  if(k != 0)
+    topK_sampling_kernel_kernelLauncher(nullptr, workspace_size, d_logits, d_ids, nullptr, nullptr, 0, args, stream);
+  else
+    topP_sampling_kernel_kernelLauncher(nullptr, workspace_size, d_logits, d_topp_id_vals, d_topp_offsets, d_finished,
+                                        0, args, nullptr, nullptr, vocab_size_padded, stream);
+  check_cuda_error(cudaMalloc(&workspace, workspace_size > 0 ? workspace_size : 4));
+
+  bool ok = true;
+  for(int trial = 0; trial < 20; trial++)
+  {
+    T *h_typed = new T[batch_size * vocab_size_padded];
+    for(int i = 0; i < batch_size * vocab_size_padded; i++)
+      from_float(h_logits[i], h_typed[i]);
+    check_cuda_error(cudaMemcpy(d_logits, h_typed, sizeof(T) * batch_size * vocab_size_padded, cudaMemcpyHostToDevice));
+    delete [] h_typed;
+    if(k != 0)
+    {
+      update_logits_without_softmax(d_logits, (const T *)d_bias_padded, vocab_size - 1, d_finished,
+                                    batch_size, vocab_size_padded, stream);
+      topK_sampling_kernel_kernelLauncher(workspace, workspace_size, d_logits, d_ids, d_sequence_length, d_finished,
+                                          trial, args, stream);
+    }
+    else
+    {
+      softmax_kernelLauncher(d_logits, (const T *)d_bias_padded, vocab_size - 1, d_finished,
+                             batch_size, vocab_size_padded, stream);
+      init_topp_id_val_kernel_kernelLauncher(d_topp_id_vals, d_topp_offsets, batch_size, vocab_size_padded, stream);
+      topP_sampling_kernel_kernelLauncher(workspace, workspace_size, d_logits, d_topp_id_vals, d_topp_offsets, d_finished,
+                                          trial, args, d_ids, d_sequence_length, vocab_size_padded, stream);
+    }
+    cudaDeviceSynchronize();
+    check_cuda_error(cudaGetLastError());
+    ok &= check_padded_ids("padded vocab sampling", d_ids, batch_size, vocab_size, vocab_size_padded);
+  }
+
+  delete [] h_logits;
+  delete [] h_bias;
+  check_cuda_error(cudaFree(d_logits));
+  check_cuda_error(cudaFree(d_bias));
+  check_cuda_error(cudaFree(d_bias_padded));
+  check_cuda_error(cudaFree(d_finished));
+  check_cuda_error(cudaFree(d_sequence_length));
+  check_cuda_error(cudaFree(d_ids));
+  check_cuda_error(cudaFree(d_topp_id_vals));
+  check_cuda_error(cudaFree(d_topp_offsets));
+  check_cuda_error(cudaFree(workspace));
+  return check_result(k != 0 ? "padded vocab top-k sampling" : "padded vocab top-p sampling", ok);
+}
+
+/* DecodingBeamsearch adds the padded float bias in the log softmax of update_logits or in
+   the fused topK_softMax, no beam may then keep a padded id */
+static bool padded_beamsearch_check(const int batch_size, const int beam_width, const int vocab_size,
+                                    const bool is_fuse_topk_softMax, cudaStream_t stream)
+{
+  const int vocab_size_padded = (vocab_size + 7) / 8 * 8;
+  const int m = batch_size * beam_width;
+  DecodingBeamsearchArguments args;
+  memset(&args, 0, sizeof(args));
+  args.batch_size_ = batch_size;
+  args.beam_width_ = beam_width;
+  args.vocab_size_ = vocab_size_padded;
+  args.vocab_size_padded_ = vocab_size_padded;
+  args.end_id_ = vocab_size - 1;
+  args.beam_search_diversity_rate_ = 0.0f;
+  args.temp_storage_size_ = m * (2 * beam_width + SMALL_TOP_K_SOFTMAX_MAX_VOC_PARTS * (2 * MAX_K + 2));
+  args.temp_storage_size_ = (int)(ceil(args.temp_storage_size_ / 4.)) * 4;
+
+  // only the first beam of each sentence is alive, as after init_kernelLauncher
+  float *h_logits = padded_logits(m, vocab_size, vocab_size_padded);
+  float *h_bias = random_floats(vocab_size);
+  float *h_cum_log_probs = new float[m];
+  for(int i = 0; i < m; i++)
+    h_cum_log_probs[i] = i % beam_width == 0 ? 0.0f : -1e20f;
+  float *d_logits = to_device<float>(h_logits, m * vocab_size_padded);
+  float *d_bias = to_device<float>(h_bias, vocab_size);
+  float *d_cum_log_probs = to_device<float>(h_cum_log_probs, m);
+  float *d_bias_padded, *d_temp_storage;
+  bool *d_finished;
+  int *d_ids;
+  check_cuda_error(cudaMalloc((void **)&d_bias_padded, sizeof(float) * vocab_size_padded));
+  check_cuda_error(cudaMalloc((void **)&d_temp_storage, sizeof(float) * args.temp_storage_size_));
+  check_cuda_error(cudaMalloc((void **)&d_finished, sizeof(bool) * m));
+  check_cuda_error(cudaMalloc((void **)&d_ids, sizeof(int) * m));
+  check_cuda_error(cudaMemset(d_finished, 0, sizeof(bool) * m));
+  pad_embedding_bias_kernelLauncher(d_bias_padded, (const float *)d_bias, vocab_size, vocab_size_padded, stream);
+
+  size_t workspace_size = 0;
+  void *workspace = nullptr;
+  if(is_fuse_topk_softMax)
+    topK_softMax(d_logits, d_bias_padded, d_finished, d_cum_log_probs, d_ids, d_temp_storage, args, stream);
+  else
+  {
+    topK_kernelLauncher(workspace, workspace_size, d_logits, d_ids, args, stream);
+    check_cuda_error(cudaMalloc(&workspace, workspace_size));
+    update_logits(d_logits, d_bias_padded, args.end_id_, d_finished, m, vocab_size_padded, stream);
+    broadcast_kernelLauncher(d_logits, d_cum_log_probs, batch_size, beam_width, vocab_size_padded, stream);
+    topK_kernelLauncher(workspace, workspace_size, d_logits, d_ids, args, stream);
+  }
+  cudaDeviceSynchronize();
+  check_cuda_error(cudaGetLastError());
+  const bool ok = check_padded_ids("padded vocab beam search", d_ids, m, vocab_size, vocab_size_padded);
+
+  delete [] h_logits;
+  delete [] h_bias;
+  delete [] h_cum_log_probs;
+  check_cuda_error(cudaFree(d_logits));
+  check_cuda_error(cudaFree(d_bias));
+  check_cuda_error(cudaFree(d_cum_log_probs));
+  check_cuda_error(cudaFree(d_bias_padded));
+  check_cuda_error(cudaFree(d_temp_storage));
+  check_cuda_error(cudaFree(d_finished));
+  check_cuda_error(cudaFree(d_ids));
+  if(workspace != nullptr) check_cuda_error(cudaFree(workspace));
+  return check_result(is_fuse_topk_softMax ? "padded vocab fused beam search" : "padded vocab beam search", ok);
+}
+
+static bool padded_vocab_checks(cudaStream_t stream)
+{
+  bool ok = true;
+  // vocab sizes that are not multiples of 8 (GPT-2, a BERT-like one and 7 padded ids)
+  const int vocab_sizes[] = {50257, 30001, 32003};
+  for(int i = 0; i < (int)(sizeof(vocab_sizes) / sizeof(vocab_sizes[0])); i++)
+  {
+    const int vocab_size = vocab_sizes[i];
+    ok &= padded_gpt2_check(8, vocab_size, 1, stream);
+    ok &= padded_gpt2_check(8, vocab_size, 40, stream);
+    ok &= padded_sampling_check<float>(8, vocab_size, 4, 0.0f, stream);
+    ok &= padded_sampling_check<half>(8, vocab_size, 50, 0.0f, stream);
+    ok &= padded_sampling_check<float>(8, vocab_size, 0, 0.9f, stream);
+    ok &= padded_sampling_check<half>(8, vocab_size, 0, 0.9f, stream);
+    ok &= padded_beamsearch_check(4, 4, vocab_size, false, stream);
+    ok &= padded_beamsearch_check(4, 4, vocab_size, true, stream);
+  }
+  return ok;
+}
+
+template <typename T>
+static bool encoder_pooling_check(const int batch_size, const int max_seq_len, const int hidden_units,
+                                  const bool remove_padding, const bool use_sequence_length, cudaStream_t stream)
+{
+  printf("[INFO] encoder pooling check with hidden_units %d, remove_padding %d. \n", hidden_units, (int)remove_padding);
+  // an empty sentence, a single token, a full one and random lengths
+  int *h_sequence_length = new int[batch_size];
+  for(int b = 0; b < batch_size; b++)
+    h_sequence_length[b] = !use_sequence_length ? max_seq_len :
+                           b == 0 ? 0 : (b == 1 ? 1 : (b == 2 ? max_seq_len : rand() % (max_seq_len + 1)));
+
+  // the padding words before each word, as build_sequence_length_padding_offset_kernelLauncher gives
+  int valid_word_num = 0;
+  int *h_padding_offset = new int[batch_size * max_seq_len];
+  for(int b = 0; b < batch_size; b++)
+  {
+    const int cum_offset = b * max_seq_len - valid_word_num;
+    for(int t = 0; t < h_sequence_length[b]; t++)
+      h_padding_offset[valid_word_num + t] = cum_offset;
+    valid_word_num += h_sequence_length[b];
+  }
+  const int rows = remove_padding ? valid_word_num : batch_size * max_seq_len;
+
+  float *h_encoder_out = random_floats(rows * hidden_units);
+  T *d_encoder_out = to_device<T>(h_encoder_out, rows * hidden_units);
+  T *d_pooled;
+  int *d_sequence_length = nullptr, *d_padding_offset = nullptr;
+  check_cuda_error(cudaMalloc((void **)&d_pooled, sizeof(T) * batch_size * hidden_units));
+  if(use_sequence_length)
+  {
+    check_cuda_error(cudaMalloc((void **)&d_sequence_length, sizeof(int) * batch_size));
+    check_cuda_error(cudaMemcpy(d_sequence_length, h_sequence_length, sizeof(int) * batch_size, cudaMemcpyHostToDevice));
+  }
+  if(remove_padding)
+  {
+    check_cuda_error(cudaMalloc((void **)&d_padding_offset, sizeof(int) * (valid_word_num > 0 ? valid_word_num : 1)));
+    check_cuda_error(cudaMemcpy(d_padding_offset, h_padding_offset, sizeof(int) * valid_word_num, cudaMemcpyHostToDevice));
+  }
+
+  encoder_pooling_kernel_check(d_pooled, (const T *)d_encoder_out, d_sequence_length, d_padding_offset, valid_word_num,
+                               PoolingType::CLS, batch_size, max_seq_len, hidden_units, stream);
+  encoder_pooling_kernel_check(d_pooled, (const T *)d_encoder_out, d_sequence_length, d_padding_offset, valid_word_num,
+                               PoolingType::MEAN, batch_size, max_seq_len, hidden_units, stream);
+
+  delete [] h_sequence_length;
+  delete [] h_padding_offset;
+  delete [] h_encoder_out;
+  check_cuda_error(cudaFree(d_encoder_out));
+  check_cuda_error(cudaFree(d_pooled));
+  if(d_sequence_length != nullptr) check_cuda_error(cudaFree(d_sequence_length));
+  if(d_padding_offset != nullptr) check_cuda_error(cudaFree(d_padding_offset));
+  return check_result("encoder pooling", true);
+}
+
+static bool pooling_checks(cudaStream_t stream)
+{
+  bool ok = true;
+  const int hidden_sizes[] = {768, 1024, 100};
+  for(int i = 0; i < (int)(sizeof(hidden_sizes) / sizeof(hidden_sizes[0])); i++)
+  {
+    for(int remove_padding = 0; remove_padding < 2; remove_padding++)
+    {
+      ok &= encoder_pooling_check<float>(9, 64, hidden_sizes[i], remove_padding == 1, true, stream);
+      ok &= encoder_pooling_check<half>(9, 64, hidden_sizes[i], remove_padding == 1, true, stream);
+    }
+    // without sequence_length all the max_seq_len tokens are pooled
+    ok &= encoder_pooling_check<float>(5, 32, hidden_sizes[i], false, false, stream);
+    ok &= encoder_pooling_check<half>(5, 32, hidden_sizes[i], false, false, stream);
+  }
+  return ok;
+}
+
+/* normalize the [rows, hidden_units] embeddings */
+static void l2_normalize(float *embeddings, const int rows, const int hidden_units)
+{
+  for(int i = 0; i < rows; i++)
+  {
+    float sum = 0.0f;
+    for(int j = 0; j < hidden_units; j++)
+      sum += embeddings[i * hidden_units + j] * embeddings[i * hidden_units + j];
+    const float inv_norm = 1.0f / sqrtf(sum + 1e-12f);
+    for(int j = 0; j < hidden_units; j++)
+      embeddings[i * hidden_units + j] *= inv_norm;
+  }
+}
+
+static bool embedding_search_check(const EmbeddingType embedding_type, const int batch_size, const int candidate_num,
+                                   const int hidden_units, const int k, cublasHandle_t cublas_handle, cudaStream_t stream)
+{
+  printf("[INFO] embedding search check with type %d, candidate_num %d, k %d. \n", (int)embedding_type, candidate_num, k);
+  // every 4th candidate repeats the previous one, so the scores tie; the queries are candidates or random
+  float *h_candidates = random_floats(candidate_num * hidden_units);
+  for(int c = 3; c < candidate_num; c += 4)
+    memcpy(h_candidates + c * hidden_units, h_candidates + (c - 1) * hidden_units, sizeof(float) * hidden_units);
+  l2_normalize(h_candidates, candidate_num, hidden_units);
+  float *h_queries = random_floats(batch_size * hidden_units);
+  for(int b = 0; b < batch_size; b += 2)
+    memcpy(h_queries + b * hidden_units, h_candidates + ((b * 4 + 2) % candidate_num) * hidden_units, sizeof(float) * hidden_units);
+  l2_normalize(h_queries, batch_size, hidden_units);
+
+  Allocator<AllocatorType::CUDA> allocator(0);
+  EmbeddingSearch search(allocator, batch_size, hidden_units, candidate_num, k, embedding_type);
+  embedding_search_check(search, h_queries, h_candidates, batch_size, candidate_num, hidden_units, cublas_handle, stream);
+
+  delete [] h_candidates;
+  delete [] h_queries;
+  return check_result("embedding search", true);
+}
+
+static bool embedding_search_checks(cudaStream_t stream)
+{
+  cublasHandle_t cublas_handle;
+  check_cuda_error(cublasCreate(&cublas_handle));
+  check_cuda_error(cublasSetStream(cublas_handle, stream));
+
+  bool ok = true;
+  const EmbeddingType embedding_types[] = {EmbeddingType::FP32, EmbeddingType::FP16, EmbeddingType::INT8};
+  for(int i = 0; i < 3; i++)
+  {
+    ok &= embedding_search_check(embedding_types[i], 8, 1000, 768, 1, cublas_handle, stream);
+    ok &= embedding_search_check(embedding_types[i], 8, 1000, 768, 10, cublas_handle, stream);
+    ok &= embedding_search_check(embedding_types[i], 3, 20000, 256, 100, cublas_handle, stream);
+    ok &= embedding_search_check(embedding_types[i], 16, 64, 128, 64, cublas_handle, stream);
+  }
+
+  check_cuda_error(cublasDestroy(cublas_handle));
+  return ok;
+}
+
+/* Rows of batch_size * beam_width beams; with beams, every row continues a random beam of
+   its sentence. The ids are mostly allowed by the state of the parent row, else end_id or
+   a token without transition, which leads to the dead state. */
+static bool token_constraint_check(const TokenAutomaton &automaton, const TokenConstraint &constraint,
+                                   const std::vector<int> &states, const int batch_size, const int beam_width,
+                                   const int n, cudaStream_t stream)
+{
+  const int m = batch_size * beam_width;
+  const int vocab_size = automaton.vocab_size();
+  std::vector<int> h_states(m), h_ids(m), h_parent_ids(m);
+  for(int i = 0; i < m; i++)
+  {
+    h_states[i] = states[rand() % states.size()];
+    h_parent_ids[i] = beam_width > 1 ? i / beam_width * beam_width + rand() % beam_width : i;
+  }
+  for(int i = 0; i < m; i++)
+  {
+    const int state = h_states[h_parent_ids[i]];
+    int token = rand() % vocab_size;
+    for(int retry = 0; retry < 64 && state >= 0 && rand() % 4 != 0 && !automaton.is_allowed(state, token); retry++)
+      token = rand() % vocab_size;
+    h_ids[i] = rand() % 8 == 0 ? automaton.end_id() : token;
+  }
+
+  token_constraint_kernel_check(automaton, constraint, h_states.data(), h_ids.data(),
+                                beam_width > 1 ? h_parent_ids.data() : nullptr, m, n, stream);
+  return check_result("token constraint", true);
+}
+
+static bool token_constraint_checks(cudaStream_t stream)
+{
+  const int vocab_size = 1001, end_id = 2;
+  TokenAutomaton automaton(vocab_size, end_id);
+  const int root = automaton.add_sequences({{3, 4, 5}, {3, 6}, {7, 1000}, {999}});
+  const int list = automaton.add_allow_list({8, 9, 10, 500});
+  Allocator<AllocatorType::CUDA> allocator(0);
+  TokenConstraint constraint(allocator, automaton.compile(), stream);
+
+  // unconstrained (-1), dead, the trie at several depths and the allow list
+  const std::vector<int> states = {-1, TOKEN_AUTOMATON_DEAD_STATE, root, automaton.walk(root, {3}),
+                                   automaton.walk(root, {3, 4, 5}), automaton.walk(root, {7}), list};
+  bool ok = true;
+  for(int i = 0; i < 4; i++)
+  {
+    ok &= token_constraint_check(automaton, constraint, states, 16, 1, vocab_size, stream);
+    // the padded columns of the vocab are never allowed
+    ok &= token_constraint_check(automaton, constraint, states, 16, 1, 1008, stream);
+    ok &= token_constraint_check(automaton, constraint, states, 8, 4, 1008, stream);
+    ok &= token_constraint_check(automaton, constraint, states, 3, 16, vocab_size, stream);
+  }
+  // more rows than the block of the advance kernel
+  ok &= token_constraint_check(automaton, constraint, states, 300, 5, 1008, stream);
+  ok &= token_constraint_check(automaton, constraint, states, 1500, 1, vocab_size, stream);
+  return ok;
+}
+
+/* The tokens come from a vocab of 4 so that the stop sequences often match. Some sentences have
+   no stop sequence, some have one longer than the history. */
+static bool stop_criteria_check(const int batch_size, const int beam_width, const int step,
+                                const bool use_stop_words, const bool use_max_new_tokens, cudaStream_t stream)
+{
+  printf("[INFO] stop criteria check with batch_size %d, beam_width %d, step %d. \n", batch_size, beam_width, step);
+  const int rows = batch_size * beam_width;
+  std::vector<int> h_output_ids(step * rows), h_parent_ids(step * rows), h_max_new_tokens(batch_size);
+  bool *h_finished = new bool[rows];
+  for(int i = 0; i < step * rows; i++)
+  {
+    h_output_ids[i] = rand() % 4;
+    h_parent_ids[i] = (i % rows) / beam_width * beam_width + rand() % beam_width;
+  }
+  for(int i = 0; i < rows; i++)
+    h_finished[i] = rand() % 8 == 0;
+
+  std::vector<std::vector<std::vector<int>>> stop_words(batch_size);
+  for(int b = 0; b < batch_size; b++)
+  {
+    const int num = rand() % 4;
+    for(int w = 0; w < num; w++)
+    {
+      std::vector<int> words(1 + rand() % (w == 2 ? step + 2 : 3));
+      for(size_t i = 0; i < words.size(); i++)
+        words[i] = rand() % 4;
+      stop_words[b].push_back(words);
+    }
+    h_max_new_tokens[b] = 1 + rand() % (step + 2);
+  }
+  int stop_words_len = 0;
+  const std::vector<int> h_stop_words = pack_stop_words(stop_words, stop_words_len);
+
+  stop_criteria_kernel_check(h_finished, h_output_ids.data(), beam_width > 1 ? h_parent_ids.data() : nullptr,
+                             use_stop_words ? h_stop_words.data() : nullptr, stop_words_len,
+                             use_max_new_tokens ? h_max_new_tokens.data() : nullptr, step, batch_size, beam_width, stream);
+  delete [] h_finished;
+  return check_result("stop criteria", true);
+}
+
+static bool stop_criteria_checks(cudaStream_t stream)
+{
+  bool ok = true;
+  const int steps[] = {1, 2, 5, 16};
+  for(int i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])); i++)
+  {
+    for(int trial = 0; trial < 4; trial++)
+    {
+      ok &= stop_criteria_check(16, 1, steps[i], true, trial % 2 == 0, stream);
+      ok &= stop_criteria_check(8, 4, steps[i], true, trial % 2 == 0, stream);
+    }
+    ok &= stop_criteria_check(8, 4, steps[i], false, true, stream);
+    ok &= stop_criteria_check(300, 1, steps[i], true, true, stream);
+  }
+  return ok;
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc > 2)
+  {
+    printf("[ERROR] decoding_kernel_check_sample [check] \n");
+    printf("e.g., ./bin/decoding_kernel_check_sample moe\n");
+    return 0;
+  }
+  const char *name = argc == 2 ? argv[1] : nullptr;
+  struct cudaDeviceProp prop;
+  check_cuda_error(cudaGetDeviceProperties(&prop, 0));
+  printf("Device %s\n", prop.name);
+
+  cudaStream_t stream;
+  check_cuda_error(cudaStreamCreate(&stream));
+  srand(0);
+
+  bool pass = true, ran = false;
+  if(name == nullptr || strcmp(name, "moe") == 0)
+  {
+    pass &= moe_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "topk") == 0)
+  {
+    pass &= topk_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "cross_attention") == 0)
+  {
+    pass &= cross_attention_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "padded_vocab") == 0)
+  {
+    pass &= padded_vocab_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "pooling") == 0)
+  {
+    pass &= pooling_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "embedding_search") == 0)
+  {
+    pass &= embedding_search_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "token_constraint") == 0)
+  {
+    pass &= token_constraint_checks(stream);
+    ran = true;
+  }
+  if(name == nullptr || strcmp(name, "stop_criteria") == 0)
+  {
+    pass &= stop_criteria_checks(stream);
+    ran = true;
+  }
+
+  if(!ran)
+  {
+    printf("[ERROR] unknown check %s. \n", name);
+    pass = false;
+  }
+
+  check_cuda_error(cudaStreamDestroy(stream));
+  return pass ? 0 : -1;
+}
@@ -38,7 +38,8 @@ void decoding_sample(int batch_size,
                     int vocab_size,
                     int seq_len,
                     int decoder_layers,
-                    int memory_hidden_units);
+                    int memory_hidden_units,
+                    bool with_metrics);
 
 int main(int argc, char* argv[])
 {
@@ -47,9 +48,9 @@ int main(int argc, char* argv[])
   check_cuda_error(cudaGetDeviceProperties(&prop, 0));
   printf("Device %s\n", prop.name);
   
-  if(argc != 11)
+  if(argc != 11 && argc != 12)
   {
-    printf("[ERROR] decoding_sample batch_size candidate_num probability_threshold head_num size_per_head vocab_size seq_len num_layer memory_hidden_units is_fp16\n");
+    printf("[ERROR] decoding_sample batch_size candidate_num probability_threshold head_num size_per_head vocab_size seq_len num_layer memory_hidden_units is_fp16 [with_metrics]\n");
     printf("e.g. ./bin/decoding_sample 32 1 0.0 8 64 30000 32 6 768 0\n");
     return 0;
   }
@@ -63,11 +64,12 @@ int main(int argc, char* argv[])
   const int seq_len = atoi(argv[7]);
   const int decoder_layers = atoi(argv[8]);
   const int memory_hidden_units = atoi(argv[9]);
+  const bool with_metrics = argc == 12 && atoi(argv[11]) != 0;
 
   if(atoi(argv[10]) == 0)
-    decoding_sample<float>(batch_size, candidate_num, probability_threshold, head_num, size_per_head, vocab_size, seq_len, decoder_layers, memory_hidden_units);
+    decoding_sample<float>(batch_size, candidate_num, probability_threshold, head_num, size_per_head, vocab_size, seq_len, decoder_layers, memory_hidden_units, with_metrics);
   else if(atoi(argv[10]) == 1)
-    decoding_sample<half>(batch_size, candidate_num, probability_threshold, head_num, size_per_head, vocab_size, seq_len, decoder_layers, memory_hidden_units);
+    decoding_sample<half>(batch_size, candidate_num, probability_threshold, head_num, size_per_head, vocab_size, seq_len, decoder_layers, memory_hidden_units, with_metrics);
   else
   {
     printf("[ERROR] is_fp16 should be 0 (use float) or 1 (use half). \n");
@@ -96,7 +98,8 @@ void decoding_sample(int batch_size,
                     int vocab_size,
                     int seq_len,
                     int decoder_layers,
-                    int memory_hidden_units)
+                    int memory_hidden_units,
+                    bool with_metrics)
 {
   const int max_seq_len = seq_len;
   const int memory_seq_len = seq_len; 
@@ -260,6 +263,19 @@ void decoding_sample(int batch_size,
     batch_size, candidate_num, probability_threshold, head_num, size_per_head, seq_len, decoder_layers, vocab_size,
     ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) * 0.001) / ite);
 
+  if(with_metrics)
+  {
+    // the same batches with the request metrics, out of the timed loop
+    RequestMetrics metrics;
+    decoding_params.metrics = &metrics;
+    for(int i = 0; i < ite; ++i)
+    {
+      decoding_params.enqueue_us = RequestMetrics::now_us();
+      decoding->forward(param, decoding_params);
+    }
+    metrics.snapshot().print();
+  }
+
   delete [] param;
   delete [] h_memory_sequence_lengths;
   delete decoding;
@@ -15,6 +15,7 @@
  */
 
 #include "fastertransformer/faster_transformer.h"
+#include "fastertransformer/host_processing.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cuda_profiler_api.h>
@@ -142,10 +143,9 @@ void encoder_sample(int batch_size,
   T *d_from_tensor_with_padding = NULL;
   T *d_transformer_out_with_padding = NULL;
 
-  int* d_sequence_length;
   int *d_sequence_id_offset;
   int *d_tmp_sequence_id_offset;
-  int *d_valid_word_num;
+  int *h_tmp_sequence_id_offset = new int[batch_size * from_seq_len];
 
   int* h_sequence_length = new int[batch_size];
   for(int i = 0; i < batch_size; i++)
@@ -153,40 +153,16 @@ void encoder_sample(int batch_size,
     h_sequence_length[i] = from_seq_len/2;
   }
 
-  int h_trt_seqlen_size = 0;
+  int* h_trt_seqlen_offset = new int[batch_size * 2 + 1];
+  const int h_trt_seqlen_size = build_trt_seqlen_offset_host(h_sequence_length, batch_size, seq_len,
+                                                             is_remove_padding, h_trt_seqlen_offset);
+  cudaMalloc(&d_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size));
+  cudaMemcpy(d_trt_seqlen_offset, h_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size), cudaMemcpyHostToDevice);
+  delete [] h_trt_seqlen_offset;
   if(is_remove_padding)
-  {
-    h_trt_seqlen_size = batch_size + 1;
-
-    int* h_trt_seqlen_offset = new int[h_trt_seqlen_size];
-    h_trt_seqlen_offset[0] = 0;
-    for(int i = 1; i < h_trt_seqlen_size; i++)
-    {
-      h_trt_seqlen_offset[i] = h_trt_seqlen_offset[i-1] + h_sequence_length[i - 1];
-    }
-    cudaMalloc(&d_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size));
-    cudaMemcpy(d_trt_seqlen_offset, h_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size), cudaMemcpyHostToDevice);
-    device_malloc_one(&d_attr_mask, batch_size, seq_len, seq_len/2);    
-    delete [] h_trt_seqlen_offset;
-  }
+    device_malloc_one(&d_attr_mask, batch_size, seq_len, seq_len/2);
   else
-  {
-    h_trt_seqlen_size = batch_size * 2 + 1;
-
-    int* h_trt_seqlen_offset = new int[h_trt_seqlen_size];
-    h_trt_seqlen_offset[0] = 0;
-    for(int i = 1; i < h_trt_seqlen_size; i++)
-    {
-      if(i % 2 == 1)
-        h_trt_seqlen_offset[i] = h_trt_seqlen_offset[i-1] + h_sequence_length[(i-1) / 2];
-      else
-        h_trt_seqlen_offset[i] = seq_len * (i / 2);
-    }
-    cudaMalloc(&d_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size));
-    cudaMemcpy(d_trt_seqlen_offset, h_trt_seqlen_offset, sizeof(int) * (h_trt_seqlen_size), cudaMemcpyHostToDevice);
     device_malloc_one(&d_attr_mask, batch_size, seq_len, seq_len);
-    delete [] h_trt_seqlen_offset;
-  }
 
   size_t free_bytes, total_bytes;
   check_cuda_error(cudaMemGetInfo(&free_bytes, &total_bytes));
@@ -194,8 +170,6 @@ void encoder_sample(int batch_size,
   float total = (float)(total_bytes) / 1024.0 / 1024.0 / 1024.0;
   printf("before allocate free %.2f GB total %.2f GB\n", free, total);
 
-  cudaMalloc((void**)&d_sequence_length, sizeof(int) * (ceil(batch_size/4.) * 4));
-
   device_malloc(&d_from_tensor, batch_size * seq_len * hidden_dim);
   device_malloc(&d_transformer_out, batch_size * seq_len * hidden_dim);
   device_malloc(&d_attr_kernel_Q, hidden_dim * hidden_dim * 3);
@@ -223,7 +197,6 @@ void encoder_sample(int batch_size,
     const int pre_process_buf_size = ceil((batch_size * from_seq_len + 1) * sizeof(int) / 4.) * 4;
     cudaMalloc((void**)&d_sequence_id_offset, sizeof(int) * batch_size * from_seq_len);
     cudaMalloc((void**)&d_tmp_sequence_id_offset, pre_process_buf_size);
-    d_valid_word_num = (int*)d_tmp_sequence_id_offset + batch_size * from_seq_len;
     device_malloc(&d_from_tensor_with_padding, batch_size * from_seq_len * hidden_dim);
     device_malloc(&d_transformer_out_with_padding, batch_size * from_seq_len * hidden_dim);
   }
@@ -289,13 +262,11 @@ void encoder_sample(int batch_size,
   {
     if(is_remove_padding == true)
     {
-      cudaMemcpyAsync(d_sequence_length, h_sequence_length, sizeof(int) * batch_size, cudaMemcpyHostToDevice, stream);
-      int* h_valid_word_num = new int[1];
-      build_sequence_length_padding_offset_kernelLauncher(d_sequence_length, 
-            batch_size, seq_len, d_valid_word_num, d_tmp_sequence_id_offset, stream);
-      cudaMemcpyAsync(h_valid_word_num, d_valid_word_num, sizeof(int), cudaMemcpyDeviceToHost, stream);
-      const int valid_word_num = h_valid_word_num[0];
-      delete h_valid_word_num;
+      // built on the host, valid_word_num is known without waiting for the device
+      const int valid_word_num = build_padding_offset_host(h_sequence_length, batch_size, seq_len,
+                                                           h_tmp_sequence_id_offset);
+      cudaMemcpyAsync(d_tmp_sequence_id_offset, h_tmp_sequence_id_offset, sizeof(int) * valid_word_num,
+                      cudaMemcpyHostToDevice, stream);
 
       remove_sequence_length_padding_kernelLauncher(d_from_tensor_with_padding, 
                                                     d_from_tensor,
@@ -334,13 +305,11 @@ void encoder_sample(int batch_size,
   {
     if(is_remove_padding == true)
     {
-      cudaMemcpyAsync(d_sequence_length, h_sequence_length, sizeof(int) * batch_size, cudaMemcpyHostToDevice, stream);
-      int* h_valid_word_num = new int[1];
-      build_sequence_length_padding_offset_kernelLauncher(d_sequence_length, 
-            batch_size, seq_len, d_valid_word_num, d_tmp_sequence_id_offset, stream);
-      cudaMemcpyAsync(h_valid_word_num, d_valid_word_num, sizeof(int), cudaMemcpyDeviceToHost, stream);
-      const int valid_word_num = h_valid_word_num[0];
-      delete h_valid_word_num;
+      // built on the host, valid_word_num is known without waiting for the device
+      const int valid_word_num = build_padding_offset_host(h_sequence_length, batch_size, seq_len,
+                                                           h_tmp_sequence_id_offset);
+      cudaMemcpyAsync(d_tmp_sequence_id_offset, h_tmp_sequence_id_offset, sizeof(int) * valid_word_num,
+                      cudaMemcpyHostToDevice, stream);
 
       remove_sequence_length_padding_kernelLauncher(d_from_tensor_with_padding, 
                                                     d_from_tensor,
@@ -382,6 +351,7 @@ void encoder_sample(int batch_size,
           ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) * 0.001) / ite);
 
   delete encoder_transformer_;
+  delete [] h_tmp_sequence_id_offset;
   return;
 }
 
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the bucket selection and of the engine cache on the host
+ *
+ * The engine is a fake one, its serialized form is its bucket and a
+ * signature, so the cache is checked without TensorRT: the engines are built
+ * lazily, a second cache finds them in the directory, and a file of another
+ * model, of another GPU or truncated is rebuilt.
+ **/
+
+#include "fastertransformer/engine_bucket_cache.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] engine cache %s check. \n", name);
+  else
+    printf("[ERROR] engine cache %s fail \n", name);
+  return ok;
+}
+
+struct FakeEngine
+{
+  EngineBucket bucket;
+  bool loaded;
+};
+
+static const int SIGNATURE = 0x7e57;
+
+static EngineBucketCache<FakeEngine> *new_cache(const EngineBuckets &buckets, const std::string &dir,
+                                                const uint64_t hash, const int arch)
+{
+  return new EngineBucketCache<FakeEngine>(
+      buckets, dir, hash, arch,
+      [](const EngineBucket &bucket) {
+        FakeEngine *engine = new FakeEngine;
+        engine->bucket = bucket;
+        engine->loaded = false;
+        return engine;
+      },
+      [](FakeEngine &engine, std::vector<char> &data) {
+        const int values[3] = {SIGNATURE, engine.bucket.batch_size, engine.bucket.seq_len};
+        data.assign((const char *)values, (const char *)values + sizeof(values));
+      },
+      [](const EngineBucket &, const void *data, size_t size) -> FakeEngine * {
+        const int *values = (const int *)data;
+        if(size != 3 * sizeof(int) || values[0] != SIGNATURE)
+          return nullptr;
+        FakeEngine *engine = new FakeEngine;
+        engine->bucket.batch_size = values[1];
+        engine->bucket.seq_len = values[2];
+        engine->loaded = true;
+        return engine;
+      });
+}
+
+static bool same(const EngineBucket &a, const int batch_size, const int seq_len)
+{
+  return a.batch_size == batch_size && a.seq_len == seq_len;
+}
+
+static bool bucket_check()
+{
+  EngineBuckets buckets(power_of_two_buckets(1, 24), power_of_two_buckets(16, 384));
+  bool ok = buckets.batch_buckets() == std::vector<int>({1, 2, 4, 8, 16, 24}) &&
+            buckets.seq_buckets() == std::vector<int>({16, 32, 64, 128, 256, 384}) && buckets.bucket_num() == 36;
+
+  EngineBucket bucket;
+  ok &= buckets.select(1, 1, bucket) && same(bucket, 1, 16);
+  ok &= buckets.select(3, 16, bucket) && same(bucket, 4, 16);
+  ok &= buckets.select(8, 17, bucket) && same(bucket, 8, 32);
+  ok &= buckets.select(17, 300, bucket) && same(bucket, 24, 384);
+  ok &= buckets.select(24, 384, bucket) && same(bucket, 24, 384);
+  ok &= !buckets.select(25, 16, bucket) && !buckets.select(1, 385, bucket) && !buckets.select(0, 16, bucket);
+
+  // every shape goes to the smallest bucket that holds it
+  for(int b = 1; b <= 24; b++)
+  {
+    for(int s = 1; s <= 384; s++)
+    {
+      ok &= buckets.select(b, s, bucket) && bucket.batch_size >= b && bucket.seq_len >= s;
+      for(size_t i = 0; i < buckets.batch_buckets().size(); i++)
+        ok &= buckets.batch_buckets()[i] < b || buckets.batch_buckets()[i] >= bucket.batch_size;
+      for(size_t i = 0; i < buckets.seq_buckets().size(); i++)
+        ok &= buckets.seq_buckets()[i] < s || buckets.seq_buckets()[i] >= bucket.seq_len;
+    }
+  }
+
+  const std::vector<EngineBucketSlice> slices = buckets.split(51, 100);
+  ok &= slices.size() == 3 &&
+        slices[0].offset == 0 && slices[0].batch_size == 24 && same(slices[0].bucket, 24, 128) &&
+        slices[1].offset == 24 && slices[1].batch_size == 24 && same(slices[1].bucket, 24, 128) &&
+        slices[2].offset == 48 && slices[2].batch_size == 3 && same(slices[2].bucket, 4, 128);
+  ok &= buckets.split(5, 1000).empty() && buckets.split(5, 20).size() == 1;
+  return check_result("bucket", ok);
+}
+
+static bool cache_check(const std::string &dir)
+{
+  EngineBuckets buckets(power_of_two_buckets(1, 8), power_of_two_buckets(32, 128));
+  const uint64_t hash = fnv1a_hash("model", 5);
+  bool ok = hash != fnv1a_hash("model2", 6);
+
+  // lazy build, then in memory
+  EngineBucketCache<FakeEngine> *cache = new_cache(buckets, dir, hash, 80);
+  ok &= cache->engine_num() == 0;
+  EngineBucket bucket;
+  FakeEngine *engine = cache->route(3, 40, bucket);
+  ok &= engine != nullptr && same(engine->bucket, 4, 64) && !engine->loaded;
+  ok &= cache->route(4, 64, bucket) == engine && cache->route(1, 10, bucket) != engine;
+  ok &= cache->route(9, 10, bucket) == nullptr;
+  ok &= cache->engine_num() == 2 && cache->stats().builds == 2 && cache->stats().hits == 1 &&
+        cache->stats().loads == 0;
+  delete cache;
+
+  // a second process finds the engines in the directory
+  cache = new_cache(buckets, dir, hash, 80);
+  engine = cache->route(3, 64, bucket);
+  ok &= engine->loaded && same(engine->bucket, 4, 64) && same(bucket, 4, 64);
+  ok &= cache->route(1, 32, bucket)->loaded && !cache->route(8, 128, bucket)->loaded;
+  ok &= cache->stats().loads == 2 && cache->stats().builds == 1 && cache->stats().rejected_files == 0;
+  delete cache;
+
+  // another model or another GPU has its own files
+  cache = new_cache(buckets, dir, fnv1a_hash("model2", 6), 80);
+  ok &= !cache->route(4, 64, bucket)->loaded;
+  delete cache;
+  cache = new_cache(buckets, dir, hash, 90);
+  ok &= !cache->route(4, 64, bucket)->loaded;
+  delete cache;
+
+  // a truncated file or a file renamed to another bucket is rebuilt and rewritten
+  cache = new_cache(buckets, dir, hash, 80);
+  EngineBucket b4s64 = {4, 64}, b1s32 = {1, 32}, b8s128 = {8, 128};
+  const std::string truncated = cache->path(b4s64);
+  FILE *fd = fopen(truncated.c_str(), "r+b");
+  ok &= fd != nullptr && ftruncate(fileno(fd), 20) == 0;
+  fclose(fd);
+  ok &= rename(cache->path(b8s128).c_str(), cache->path(b1s32).c_str()) == 0;
+  ok &= !cache->get(b4s64).loaded && !cache->get(b1s32).loaded;
+  ok &= cache->stats().rejected_files == 2 && cache->stats().builds == 2;
+  delete cache;
+  cache = new_cache(buckets, dir, hash, 80);
+  ok &= cache->get(b4s64).loaded && cache->get(b1s32).loaded && cache->stats().rejected_files == 0;
+  delete cache;
+
+  // no directory, in memory only
+  cache = new_cache(buckets, "", hash, 80);
+  ok &= !cache->route(4, 64, bucket)->loaded && cache->stats().builds == 1;
+  delete cache;
+  return check_result("cache", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  char dir[] = "/tmp/ft_engine_cache_XXXXXX";
+  if(mkdtemp(dir) == nullptr)
+  {
+    printf("[ERROR] cannot create a temporary directory \n");
+    return -1;
+  }
+  bool pass = bucket_check();
+  pass &= cache_check(dir);
+  const std::string cleanup = std::string("rm -rf ") + dir;
+  if(system(cleanup.c_str()) != 0)
+    printf("[WARNING] cannot remove %s \n", dir);
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the kernel variant table on the host
+ *
+ * A fake kernel with a host benchmark is registered: a lookup never runs the
+ * benchmark, a miss gives the default variant and only resolve() with tune
+ * times the variants and stores the fastest supported one. Entries that are
+ * out of range or do not support the shape, as a stale config can hold, fall
+ * back to the default. Last, a config file whose later lines replace the
+ * earlier ones is read, saved and read back.
+ **/
+
+#include "fastertransformer/kernel_variant_table.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] kernel variant table %s check. \n", name);
+  else
+    printf("[ERROR] kernel variant table %s fail \n", name);
+  return ok;
+}
+
+static int benchmark_calls = 0;
+
+/* variant 0 is slow, 1 fails, 2 is the fastest but only supports even d1 and 3 is in between */
+static float fake_benchmark(const int variant, const KernelShape &shape, const int is_fp16)
+{
+  benchmark_calls++;
+  const float times[4] = {3.0f, -1.0f, 1.0f, 2.0f};
+  return times[variant];
+}
+
+static bool fake_supported(const int variant, const KernelShape &shape, const int is_fp16)
+{
+  return variant != 2 || shape.d1 % 2 == 0;
+}
+
+static bool lookup_check()
+{
+  KernelVariantTable &table = KernelVariantTable::instance();
+  table.clear();
+  table.register_kernel("fake", 4, fake_benchmark, fake_supported);
+  benchmark_calls = 0;
+
+  // a miss gives the default and stores nothing, even if the online tuning is enabled
+  table.set_online_tuning(true);
+  bool ok = table.select("fake", 80, 1, KernelShape(64, 768), 0) == 0 && table.size() == 0;
+  ok &= table.resolve("fake", 80, 1, KernelShape(64, 768), 0, false) == 0 && table.size() == 0;
+  table.set_online_tuning(false);
+  ok &= benchmark_calls == 0;
+
+  // tune skips the failing and the unsupported variants, the winner is then a plain lookup
+  ok &= table.resolve("fake", 80, 1, KernelShape(64, 768), 0, true) == 2 && benchmark_calls == 4;
+  ok &= table.resolve("fake", 80, 1, KernelShape(64, 767), 0, true) == 3 && benchmark_calls == 7;
+  ok &= table.select("fake", 80, 1, KernelShape(64, 768), 0) == 2 &&
+        table.resolve("fake", 80, 1, KernelShape(64, 767), 1, true) == 3 && benchmark_calls == 7;
+
+  // the other SMs, data types and shapes are other keys
+  ok &= table.select("fake", 75, 1, KernelShape(64, 768), 0) == 0 &&
+        table.select("fake", 80, 0, KernelShape(64, 768), 0) == 0 &&
+        table.select("fake", 80, 1, KernelShape(128, 768), 0) == 0 && table.size() == 2;
+
+  // an unregistered kernel cannot be tuned
+  ok &= table.tune("none", 80, 1, KernelShape(64, 768)) == -1 &&
+        table.resolve("none", 80, 1, KernelShape(64, 768), 5, true) == 5 && table.size() == 2;
+  table.clear();
+  return check_result("lookup", ok);
+}
+
+static bool write_config(const char *path, const char *lines)
+{
+  FILE *fd = fopen(path, "w");
+  if(fd == NULL)
+    return false;
+  fputs(lines, fd);
+  fclose(fd);
+  return true;
+}
+
+static bool config_check()
+{
+  const char *path = "kernel_variant_table_sample.in";
+  KernelVariantTable &table = KernelVariantTable::instance();
+  table.clear();
+  table.register_kernel("fake", 4, fake_benchmark, fake_supported);
+  benchmark_calls = 0;
+
+  // a later line replaces an earlier one, the stale entries (out of range, unsupported) fall back
+  bool ok = write_config(path, "fake 80 1 64 768 0 ### 3 3.0\n"
+                               "fake 80 1 64 768 0 ### 2 1.0\n"
+                               "fake 80 1 64 1024 0 ### 4 1.0\n"
+                               "fake 80 1 64 767 0 ### 2 1.0\n"
+                               "fake 80 1 64 512 0 ### -1 1.0\n"
+                               "other 80 1 64 768 0 ### 7 1.0\n");
+  ok &= table.load(path) == 6 && table.size() == 5;
+  ok &= table.select("fake", 80, 1, KernelShape(64, 768), 0) == 2 &&
+        table.select("fake", 80, 1, KernelShape(64, 1024), 1) == 1 &&
+        table.select("fake", 80, 1, KernelShape(64, 767), 0) == 0 &&
+        table.select("fake", 80, 1, KernelShape(64, 512), 3) == 3;
+  // an unregistered kernel keeps any variant of the file
+  ok &= table.select("other", 80, 1, KernelShape(64, 768), 0) == 7 && benchmark_calls == 0;
+
+  // a stale entry is tuned again when asked to
+  ok &= table.resolve("fake", 80, 1, KernelShape(64, 767), 0, true) == 3 && benchmark_calls == 3;
+
+  // save, clear and load give back the same lookups
+  ok &= table.save(path);
+  table.clear();
+  ok &= table.size() == 0 && table.load(path) == 5;
+  ok &= table.select("fake", 80, 1, KernelShape(64, 768), 0) == 2 &&
+        table.select("fake", 80, 1, KernelShape(64, 767), 0) == 3 &&
+        table.select("other", 80, 1, KernelShape(64, 768), 0) == 7;
+  remove(path);
+  table.clear();
+  return check_result("config", ok);
+}
+
+static bool bucket_check()
+{
+  bool ok = kernel_shape_bucket(0) == 1 && kernel_shape_bucket(1) == 1 && kernel_shape_bucket(2) == 2 &&
+            kernel_shape_bucket(3) == 4 && kernel_shape_bucket(256) == 256 && kernel_shape_bucket(257) == 512;
+  return check_result("bucket", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = lookup_check();
+  pass &= config_check();
+  pass &= bucket_check();
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the KV cache preemption on the host
+ *
+ * The eviction and restore order of KVSwapScheduler is compared with the
+ * expected ops, then a small schedule of the chunked prefill scheduler
+ * preempts a sequence in the middle of its prompt and resumes it. Last,
+ * random traffic of several priorities is served with a simulated KV cache:
+ * the swaps copy the tags of the cached positions, and every row checks that
+ * the positions it attends to are the ones of its own sequence.
+ **/
+
+#include "fastertransformer/chunked_prefill_scheduler.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] kv swap %s check. \n", name);
+  else
+    printf("[ERROR] kv swap %s fail \n", name);
+  return ok;
+}
+
+static bool same_op(const SwapOp &op, const SwapOpType type, const int seq_id, const int device_slot,
+                    const int host_slot, const int length)
+{
+  return op.type == type && op.seq_id == seq_id && op.device_slot == device_slot && op.host_slot == host_slot &&
+         op.length == length;
+}
+
+static bool order_check()
+{
+  const SwapOpType START = SwapOpType::START, OUT = SwapOpType::SWAP_OUT, IN = SwapOpType::SWAP_IN;
+  KVSwapScheduler scheduler(2, 2);
+  scheduler.add_sequence(1, 32);
+  scheduler.add_sequence(0, 32);
+  std::vector<SwapOp> ops = scheduler.schedule();
+  bool ok = ops.size() == 2 && same_op(ops[0], START, 0, 0, -1, 0) && same_op(ops[1], START, 1, 1, -1, 0);
+  scheduler.advance(0, 5);
+  scheduler.advance(1, 3);
+
+  // the lowest priority is evicted for a higher one, an equal or lower one waits
+  scheduler.add_sequence(2, 32);
+  ops = scheduler.schedule();
+  ok &= ops.size() == 2 && same_op(ops[0], OUT, 1, 1, 0, 3) && same_op(ops[1], START, 2, 1, -1, 0);
+  scheduler.add_sequence(0, 32);
+  ok &= scheduler.schedule().empty() && scheduler.sequence(3).state == SequenceState::WAITING;
+
+  // sequence 0 is evicted next, the swapped sequence 0 comes before sequences 1 and 3
+  scheduler.add_sequence(3, 32);
+  ops = scheduler.schedule();
+  ok &= ops.size() == 2 && same_op(ops[0], OUT, 0, 0, 1, 5) && same_op(ops[1], START, 4, 0, -1, 0);
+  ok &= scheduler.free_host_slot_num() == 0;
+  scheduler.finish(4);
+  ops = scheduler.schedule();
+  ok &= ops.size() == 1 && same_op(ops[0], IN, 0, 0, 1, 5) && scheduler.free_host_slot_num() == 1;
+
+  // sequence 1 (swapped) arrived before sequence 3 (waiting), both have priority 0
+  scheduler.finish(2);
+  ops = scheduler.schedule();
+  ok &= ops.size() == 1 && same_op(ops[0], IN, 1, 1, 0, 3);
+  scheduler.finish(0);
+  ops = scheduler.schedule();
+  ok &= ops.size() == 1 && same_op(ops[0], START, 3, 0, -1, 0);
+  ok &= scheduler.stats().swap_out_num == 2 && scheduler.stats().swap_in_num == 2 &&
+        scheduler.stats().swapped_positions == 16;
+
+  // the same priority: the latest arrival is evicted, no host slot means no eviction
+  KVSwapScheduler tie(2, 1);
+  tie.add_sequence(0, 8);
+  tie.add_sequence(0, 8);
+  tie.schedule();
+  tie.add_sequence(1, 8);
+  ops = tie.schedule();
+  ok &= ops.size() == 2 && same_op(ops[0], OUT, 1, 1, 0, 0) && same_op(ops[1], START, 2, 1, -1, 0);
+  tie.add_sequence(2, 8);
+  ok &= tie.schedule().empty() && tie.running() == std::vector<int>({0, 2});
+  return check_result("order", ok);
+}
+
+/* 1 slot and 1 host slot: sequence 0 is preempted after its first chunk by sequence 1 */
+static bool preempt_check()
+{
+  ChunkedPrefillConfig config;
+  config.slot_num = 1;
+  config.token_budget = 8;
+  config.chunk_size = 4;
+  config.max_seq_len = 32;
+  config.host_slot_num = 1;
+  ChunkedPrefillScheduler scheduler(config);
+  const int prompt[6] = {100, 101, 102, 103, 104, 105};
+  const int end_id = 0;
+  int sampled[1] = {7};
+  scheduler.add_sequence(prompt, 6, 2);
+
+  StepPlan plan = scheduler.schedule();
+  bool ok = plan.swaps.size() == 1 && plan.swaps[0].type == SwapOpType::START && plan.entries.size() == 1 &&
+            plan.token_num() == 4;
+  scheduler.complete(plan, sampled, end_id);
+
+  scheduler.add_sequence(prompt + 4, 2, 1, 1);
+  plan = scheduler.schedule();
+  ok &= plan.swaps.size() == 2 && same_op(plan.swaps[0], SwapOpType::SWAP_OUT, 0, 0, 0, 4) &&
+        same_op(plan.swaps[1], SwapOpType::START, 1, 0, -1, 0);
+  ok &= plan.entries.size() == 1 && plan.entries[0].seq_id == 1 && plan.entries[0].slot == 0 &&
+        plan.row_ids[0] == 104 && scheduler.sequence(0).state == ChunkedSequenceState::SWAPPED &&
+        scheduler.waiting_num() == 1;
+  ok &= scheduler.complete(plan, sampled, end_id).size() == 1;
+
+  // sequence 0 comes back with its 4 cached positions and continues its prompt
+  plan = scheduler.schedule();
+  ok &= plan.swaps.size() == 1 && same_op(plan.swaps[0], SwapOpType::SWAP_IN, 0, 0, 0, 4);
+  ok &= plan.entries.size() == 1 && plan.entries[0].prefill && plan.entries[0].position == 4 &&
+        plan.entries[0].token_num == 2 && plan.entries[0].sample && plan.row_ids[1] == 105;
+  scheduler.complete(plan, sampled, end_id);
+  plan = scheduler.schedule();
+  ok &= plan.swaps.empty() && plan.entries.size() == 1 && !plan.entries[0].prefill && plan.entries[0].position == 6;
+  ok &= scheduler.complete(plan, sampled, end_id).size() == 1 && scheduler.idle();
+  return check_result("preempt", ok);
+}
+
+/* a cached position holds the id of its sequence and its position, -1 when empty */
+static int tag(const int seq_id, const int position)
+{
+  return seq_id * 1024 + position;
+}
+
+static bool traffic_check()
+{
+  ChunkedPrefillConfig config;
+  config.slot_num = 3;
+  config.token_budget = 16;
+  config.chunk_size = 8;
+  config.max_seq_len = 64;
+  config.host_slot_num = 4;
+  ChunkedPrefillScheduler scheduler(config);
+  std::vector<std::vector<int> > device(config.slot_num, std::vector<int>(config.max_seq_len, -1));
+  std::vector<std::vector<int> > host(config.host_slot_num, std::vector<int>(config.max_seq_len, -1));
+  std::vector<int> prompt(config.max_seq_len, 5);
+  std::vector<int> cached;   // positions in the cache of every sequence
+  const int end_id = 0;
+  const int request_num = 300;
+  bool ok = true;
+  srand(31);
+
+  for(int iter = 0; iter < 100000 && (cached.size() < (size_t)request_num || !scheduler.idle()); iter++)
+  {
+    if(cached.size() < (size_t)request_num && rand() % 3 == 0)
+    {
+      const int prompt_len = 1 + rand() % 40;
+      scheduler.add_sequence(prompt.data(), prompt_len, 1 + rand() % 20, rand() % 4);
+      cached.push_back(0);
+    }
+    const StepPlan plan = scheduler.schedule();
+    for(size_t i = 0; i < plan.swaps.size(); i++)
+    {
+      const SwapOp &op = plan.swaps[i];
+      ok &= op.length == cached[op.seq_id];
+      for(int p = 0; p < op.length; p++)
+      {
+        if(op.type == SwapOpType::SWAP_OUT)
+          host[op.host_slot][p] = device[op.device_slot][p];
+        else if(op.type == SwapOpType::SWAP_IN)
+          device[op.device_slot][p] = host[op.host_slot][p];
+      }
+    }
+    // a row attends to the positions before it and writes its own
+    for(size_t e = 0; e < plan.entries.size(); e++)
+    {
+      const StepEntry &entry = plan.entries[e];
+      ok &= entry.slot == scheduler.sequence(entry.seq_id).slot && entry.position == cached[entry.seq_id];
+      for(int r = 0; r < entry.token_num; r++)
+      {
+        for(int p = 0; p < entry.position + r; p++)
+          ok &= device[entry.slot][p] == tag(entry.seq_id, p);
+        device[entry.slot][entry.position + r] = tag(entry.seq_id, entry.position + r);
+      }
+      cached[entry.seq_id] += entry.token_num;
+    }
+    std::vector<int> sampled(plan.sample_rows.size() + 1, 1);
+    scheduler.complete(plan, sampled.data(), end_id);
+  }
+  for(int i = 0; i < scheduler.sequence_num(); i++)
+  {
+    const ChunkedSequence &seq = scheduler.sequence(i);
+    ok &= seq.state == ChunkedSequenceState::FINISHED && seq.prefilled == seq.prompt_len &&
+          seq.generated == seq.max_new_tokens;
+  }
+  const SwapStats &stats = scheduler.swap_stats();
+  ok &= scheduler.sequence_num() == request_num && stats.swap_out_num > 0 && stats.swap_in_num == stats.swap_out_num;
+  printf("[INFO] %lld swaps out, %lld swaps in, %lld positions copied \n", stats.swap_out_num, stats.swap_in_num,
+         stats.swapped_positions);
+  return check_result("traffic", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = order_check();
+  pass &= preempt_check();
+  pass &= traffic_check();
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Hidden size sweep of the layernorm and bias + activation kernels
+ *
+ * For every hidden size the kernels are checked against the CPU references,
+ * then add_bias_input_layernorm_kernelLauncher (the tuned kernels where they
+ * exist), the generic layernorm and the bias + GELU of the FFN (4 * hidden
+ * size) are timed on [m, hidden size] rows.
+ **/
+
+#include "fastertransformer/cuda/decoding_kernel_check.h"
+#include "fastertransformer/cuda/layernorm_kernels.h"
+#include <cstdio>
+#include <cstdlib>
+#include <sys/time.h>
+#include <cuda_fp16.h>
+
+using namespace fastertransformer;
+
+template <typename T>
+void layernorm_sweep_sample(const int m, const int ite);
+
+int main(int argc, char* argv[])
+{
+  struct cudaDeviceProp prop;
+  check_cuda_error(cudaGetDeviceProperties(&prop, 0));
+  if(argc != 3 && argc != 4)
+  {
+    printf("[ERROR] layernorm_sweep_sample m is_fp16 [ite] \n");
+    printf("e.g., ./bin/layernorm_sweep_sample 4096 1\n");
+    return 0;
+  }
+  printf("Device %s\n", prop.name);
+
+  const int m = atoi(argv[1]);
+  const int ite = argc == 4 ? atoi(argv[3]) : 100;
+  if(atoi(argv[2]) == 0)
+    layernorm_sweep_sample<float>(m, ite);
+  else if(atoi(argv[2]) == 1)
+    layernorm_sweep_sample<half>(m, ite);
+  else
+  {
+    printf("[ERROR] is_fp16 should be 0 (use float) or 1 (use half). \n");
+    return -1;
+  }
+  return 0;
+}
+
+static double diff_time_ms(const struct timeval& start, const struct timeval& end)
+{
+  return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) * 0.001;
+}
+
+template <typename T>
+void layernorm_sweep_sample(const int m, const int ite)
+{
+  // the sizes of the specialization table, GPT-2 XL (1600) and sizes out of any table
+  const int hidden_sizes[] = {512, 768, 1024, 1280, 1536, 1600, 2048, 2560, 3072, 4096,
+                              5120, 6144, 8192, 12288, 1000, 1601};
+  const int size_num = sizeof(hidden_sizes) / sizeof(hidden_sizes[0]);
+  int max_n = 0;
+  for(int i = 0; i < size_num; i++)
+    max_n = hidden_sizes[i] > max_n ? hidden_sizes[i] : max_n;
+
+  cudaStream_t stream;
+  check_cuda_error(cudaStreamCreate(&stream));
+
+  T *d_out, *d_input, *d_weight;
+  check_cuda_error(cudaMalloc((void **)&d_out, sizeof(T) * m * max_n * 4));
+  check_cuda_error(cudaMalloc((void **)&d_input, sizeof(T) * m * max_n));
+  check_cuda_error(cudaMalloc((void **)&d_weight, sizeof(T) * max_n * 4));
+  check_cuda_error(cudaMemset(d_out, 0, sizeof(T) * m * max_n * 4));
+  check_cuda_error(cudaMemset(d_input, 0, sizeof(T) * m * max_n));
+  check_cuda_error(cudaMemset(d_weight, 0, sizeof(T) * max_n * 4));
+
+  printf("%8s %12s %18s %18s %18s\n", "n", "specialized", "layernorm (us)", "generic (us)", "bias GELU 4n (us)");
+  for(int i = 0; i < size_num; i++)
+  {
+    const int n = hidden_sizes[i];
+    layernorm_kernel_check<T>(m < 64 ? m : 64, n, stream);
+
+    struct timeval start, end;
+    double time[3];
+    for(int k = 0; k < 3; k++)
+    {
+      // warm up
+      for(int j = 0; j < 2; j++)
+      {
+        if(k == 0)
+          add_bias_input_layernorm_kernelLauncher<T>(d_out, d_input, d_weight, d_weight, d_weight, m, n, stream);
+        else if(k == 1)
+          add_bias_input_layernorm_generic_kernelLauncher<T>(d_out, d_input, d_weight, d_weight, d_weight, m, n, stream);
+        else
+          add_bias_act_kernelLauncher<T>(d_out, d_weight, m, n * 4, stream);
+      }
+      cudaDeviceSynchronize();
+      gettimeofday(&start, NULL);
+      for(int j = 0; j < ite; j++)
+      {
+        if(k == 0)
+          add_bias_input_layernorm_kernelLauncher<T>(d_out, d_input, d_weight, d_weight, d_weight, m, n, stream);
+        else if(k == 1)
+          add_bias_input_layernorm_generic_kernelLauncher<T>(d_out, d_input, d_weight, d_weight, d_weight, m, n, stream);
+        else
+          add_bias_act_kernelLauncher<T>(d_out, d_weight, m, n * 4, stream);
+      }
+      cudaDeviceSynchronize();
+      gettimeofday(&end, NULL);
+      time[k] = diff_time_ms(start, end) * 1000 / ite;
+    }
+    check_cuda_error(cudaGetLastError());
+    printf("%8d %12s %18.2f %18.2f %18.2f\n", n, is_layernorm_specialized<T>(n) ? "yes" : "no", time[0], time[1], time[2]);
+  }
+
+  check_cuda_error(cudaFree(d_out));
+  check_cuda_error(cudaFree(d_input));
+  check_cuda_error(cudaFree(d_weight));
+  check_cuda_error(cudaStreamDestroy(stream));
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Device memory capacity planning of a model
+ *
+ * First the workspaces of the plans are checked against the allocations of
+ * BertEncoderTransformer, DecodingBeamsearch and DecodingSampling on small
+ * shapes, then the maximal (batch_size, seq_len) configurations of the
+ * encoder and of both decodings are printed for the budget.
+ **/
+
+#include "fastertransformer/faster_transformer.h"
+#include "fastertransformer/decoding_beamsearch.h"
+#include "fastertransformer/decoding_sampling.h"
+#include "fastertransformer/memory_planner.h"
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <cuda_fp16.h>
+
+using namespace fastertransformer;
+
+/* forwards to allocator and counts the bytes that are not freed */
+class RecordingAllocator : public IAllocator
+{
+  const IAllocator &allocator_;
+  mutable std::map<void *, size_t> sizes_;
+  mutable size_t bytes_;
+
+public:
+  RecordingAllocator(const IAllocator &allocator) : allocator_(allocator), bytes_(0) {}
+
+  void *malloc(size_t size, const bool is_set_zero=true) const
+  {
+    void *ptr = allocator_.malloc(size, is_set_zero);
+    sizes_[ptr] = size;
+    bytes_ += size;
+    return ptr;
+  }
+
+  void free(void *ptr) const
+  {
+    std::map<void *, size_t>::iterator it = sizes_.find(ptr);
+    if (it != sizes_.end())
+    {
+      bytes_ -= it->second;
+      sizes_.erase(it);
+    }
+    allocator_.free(ptr);
+  }
+
+  size_t bytes() const { return bytes_; }
+};
+
+template <OperationType OpType_>
+bool memory_plan_check(const MemoryPlanConfig &config);
+
+template <OperationType OpType_>
+void memory_plan_sample(MemoryPlanConfig config, const size_t budget);
+
+int main(int argc, char* argv[])
+{
+  struct cudaDeviceProp prop;
+  check_cuda_error(cudaGetDeviceProperties(&prop, 0));
+  if(argc != 8)
+  {
+    printf("[ERROR] memory_plan_sample budget_MB head_num size_per_head num_layer vocab_size beam_width is_fp16 \n");
+    printf("e.g., ./bin/memory_plan_sample 16000 8 64 6 30000 4 1\n");
+    return 0;
+  }
+  printf("Device %s\n", prop.name);
+
+  MemoryPlanConfig config;
+  const size_t budget = (size_t)atoi(argv[1]) * 1024 * 1024;
+  config.head_num = atoi(argv[2]);
+  config.size_per_head = atoi(argv[3]);
+  config.layer_num = atoi(argv[4]);
+  config.vocab_size = atoi(argv[5]);
+  config.beam_width = atoi(argv[6]);
+  config.is_fp16 = atoi(argv[7]);
+  config.memory_hidden_units = config.head_num * config.size_per_head;
+
+  if(config.is_fp16 == 0)
+    memory_plan_sample<OperationType::FP32>(config, budget);
+  else if(config.is_fp16 == 1)
+    memory_plan_sample<OperationType::FP16>(config, budget);
+  else
+  {
+    printf("[ERROR] is_fp16 should be 0 (use float) or 1 (use half). \n");
+    return -1;
+  }
+  return 0;
+}
+
+static bool report_check(const char *name, const size_t planned, const size_t allocated)
+{
+  if(planned != allocated)
+  {
+    printf("[ERROR] memory plan of %s fail: %zu bytes are planned, but %zu bytes are allocated. \n",
+           name, planned, allocated);
+    return false;
+  }
+  printf("[INFO] memory plan of %s check (%zu bytes). \n", name, planned);
+  return true;
+}
+
+template <OperationType OpType_>
+bool memory_plan_check(const MemoryPlanConfig &base)
+{
+  typedef BertEncoderTransformerTraits<OpType_, cuda::OpenMultiHeadAttention> EncoderTraits_;
+  Allocator<AllocatorType::CUDA> device_allocator(0);
+  const int batch_size = 3;
+  const int seq_len = 32;
+  bool pass = true;
+
+  // int8 only runs in FP16
+  for(int int8_mode = 0; int8_mode <= (OpType_ == OperationType::FP16 ? 2 : 0); int8_mode++)
+  {
+    MemoryPlanConfig config = base;
+    config.int8_mode = int8_mode;
+    RecordingAllocator allocator(device_allocator);
+    BertEncoderTransformer<EncoderTraits_> *encoder = new BertEncoderTransformer<EncoderTraits_>(int8_mode, false);
+    encoder->allocateBuffer(&allocator, batch_size, seq_len, seq_len, config.head_num, config.size_per_head);
+    const MemoryPlan plan = plan_encoder_memory(config, batch_size, seq_len);
+    char name[64];
+    sprintf(name, "encoder (int8_mode %d)", int8_mode);
+    pass &= report_check(name, plan.bytes(MemoryKind::WORKSPACE), allocator.bytes());
+    encoder->freeBuffer();
+    delete encoder;
+  }
+
+  {
+    RecordingAllocator allocator(device_allocator);
+    DecodingBeamsearch<OpType_> *decoding = new DecodingBeamsearch<OpType_>(
+        allocator, batch_size, base.beam_width, seq_len, base.head_num, base.size_per_head, base.vocab_size,
+        base.layer_num, base.memory_hidden_units, seq_len * 2, 0, 1);
+    MemoryPlanConfig config = base;
+    config.memory_max_seq_len = seq_len * 2;
+    const MemoryPlan plan = plan_decoding_beamsearch_memory(config, batch_size, seq_len);
+    pass &= report_check("decoding beam search", plan.bytes(MemoryKind::WORKSPACE), allocator.bytes());
+    delete decoding;
+  }
+
+  // register top k, radix select top k, top p and speculative greedy decoding
+  const int candidate_nums[] = {4, 50, 0, 1};
+  const float probability_thresholds[] = {0.0f, 0.0f, 0.9f, 0.0f};
+  const int max_draft_lens[] = {0, 0, 0, 4};
+  for(int i = 0; i < 4; i++)
+  {
+    RecordingAllocator allocator(device_allocator);
+    DecodingSampling<OpType_> *decoding = new DecodingSampling<OpType_>(
+        allocator, batch_size, seq_len, base.head_num, base.size_per_head, base.vocab_size, base.layer_num,
+        base.memory_hidden_units, seq_len, 0, 1, candidate_nums[i], probability_thresholds[i], max_draft_lens[i]);
+    MemoryPlanConfig config = base;
+    config.candidate_num = candidate_nums[i];
+    config.max_draft_len = max_draft_lens[i];
+    const MemoryPlan plan = plan_decoding_sampling_memory(config, batch_size, seq_len);
+    char name[96];
+    sprintf(name, "decoding sampling (candidate_num %d, max_draft_len %d)", candidate_nums[i], max_draft_lens[i]);
+    pass &= report_check(name, plan.bytes(MemoryKind::WORKSPACE), allocator.bytes());
+    delete decoding;
+  }
+  return pass;
+}
+
+static void print_frontier(const char *name, const std::vector<MemoryFrontierPoint> &points)
+{
+  printf("%s\n", name);
+  printf("%12s %12s %16s\n", "batch_size", "seq_len", "peak (MB)");
+  for(size_t i = 0; i < points.size(); i++)
+    printf("%12d %12d %16.1f\n", points[i].batch_size, points[i].seq_len, points[i].peak_bytes / 1024.0 / 1024.0);
+  if(points.empty())
+    printf("[WARNING] nothing fits the budget \n");
+}
+
+template <OperationType OpType_>
+void memory_plan_sample(MemoryPlanConfig config, const size_t budget)
+{
+  if(!memory_plan_check<OpType_>(config))
+    printf("[ERROR] the memory planner does not match the allocations \n");
+
+  print_frontier("encoder", solve_memory_frontier(plan_encoder_memory, config, budget, 512, 32));
+  print_frontier("decoding beam search", solve_memory_frontier(plan_decoding_beamsearch_memory, config, budget, 1024, 32));
+  config.candidate_num = 4;
+  print_frontier("decoding sampling (top 4)", solve_memory_frontier(plan_decoding_sampling_memory, config, budget, 1024, 32));
+
+  // the breakdown at the largest beam search batch of seq_len 128
+  const int batch_size = solve_max_batch_size(plan_decoding_beamsearch_memory, config, 128, budget);
+  if(batch_size > 0)
+  {
+    printf("decoding beam search, batch_size %d seq_len 128\n", batch_size);
+    plan_decoding_beamsearch_memory(config, batch_size, 128).print();
+  }
+}
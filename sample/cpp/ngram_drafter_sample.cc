@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the n-gram drafting on the host
+ *
+ * The drafts of NGramIndex are compared with the ones found by hand: the
+ * longest matching suffix wins, a later occurrence replaces an earlier one and
+ * a suffix seen only once gives no draft. accept_draft is checked on a full
+ * accept, a partial accept, a miss, an end_id and the max_new_tokens limit.
+ * Last, NGramDrafter drives a toy greedy model and its output is compared with
+ * the one of step by step decoding.
+ **/
+
+#include "fastertransformer/ngram_drafter.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] ngram drafter %s check. \n", name);
+  else
+    printf("[ERROR] ngram drafter %s fail \n", name);
+  return ok;
+}
+
+static bool same_tokens(const int *tokens, const int num, const std::vector<int> &expected)
+{
+  if(num != (int)expected.size())
+    return false;
+  for(int i = 0; i < num; i++)
+    if(tokens[i] != expected[i])
+      return false;
+  return true;
+}
+
+static int propose(const std::vector<int> &tokens, const int max_draft_len, int *draft)
+{
+  NGramIndex index(1, 3);
+  index.append(tokens.data(), (int)tokens.size());
+  return index.propose(max_draft_len, draft);
+}
+
+static bool lookup_check()
+{
+  int draft[8];
+
+  // "1 2" followed 3, the draft stops at max_draft_len
+  bool ok = same_tokens(draft, propose({1, 2, 3, 4, 1, 2}, 3, draft), {3, 4, 1});
+  ok &= same_tokens(draft, propose({1, 2, 3, 4, 1, 2}, 8, draft), {3, 4, 1, 2});
+
+  // "1 2" proposes 8 before "2" alone proposes 9
+  ok &= same_tokens(draft, propose({1, 2, 8, 5, 2, 9, 1, 2}, 8, draft), {8, 5, 2, 9, 1, 2});
+
+  // the latest earlier "1" wins
+  ok &= same_tokens(draft, propose({1, 5, 1, 6, 1}, 8, draft), {6, 1});
+  ok &= same_tokens(draft, propose({1, 5, 1, 6, 1}, 1, draft), {6});
+
+  // misses: no earlier occurrence, an empty index and a zero draft length
+  ok &= propose({1, 2, 3}, 8, draft) == 0 && propose({}, 8, draft) == 0;
+  ok &= propose({1, 2, 3, 4, 1, 2}, 0, draft) == 0;
+
+  // the index grows with the appended tokens
+  NGramIndex index(2, 2);
+  index.append(7);
+  index.append(8);
+  ok &= index.propose(8, draft) == 0;
+  const int next[3] = {9, 7, 8};
+  index.append(next, 3);
+  ok &= index.size() == 5 && same_tokens(draft, index.propose(8, draft), {9, 7, 8});
+  index.clear();
+  ok &= index.size() == 0 && index.propose(8, draft) == 0;
+  return check_result("lookup", ok);
+}
+
+static bool accept_check()
+{
+  const int end_id = 0;
+  const int draft[3] = {3, 4, 5};
+  int accepted[4];
+
+  // full accept: the draft and the verified token after it
+  const int full[4] = {3, 4, 5, 6};
+  bool ok = same_tokens(accepted, accept_draft(draft, 3, full, end_id, 16, accepted), {3, 4, 5, 6});
+
+  // partial accept: the matched prefix and the verified token at the mismatch
+  const int partial[4] = {3, 9, 5, 6};
+  ok &= same_tokens(accepted, accept_draft(draft, 3, partial, end_id, 16, accepted), {3, 9});
+
+  // miss: only the verified token after the last token
+  const int miss[4] = {8, 4, 5, 6};
+  ok &= same_tokens(accepted, accept_draft(draft, 3, miss, end_id, 16, accepted), {8});
+  ok &= same_tokens(accepted, accept_draft(draft, 0, full, end_id, 16, accepted), {3});
+
+  // the end_id ends the accepted tokens even if it matches the draft
+  const int end[4] = {3, end_id, 5, 6};
+  ok &= same_tokens(accepted, accept_draft(draft, 3, end, end_id, 16, accepted), {3, end_id});
+  const int draft_end[3] = {3, end_id, 5};
+  ok &= same_tokens(accepted, accept_draft(draft_end, 3, end, end_id, 16, accepted), {3, end_id});
+
+  // max_new_tokens
+  ok &= same_tokens(accepted, accept_draft(draft, 3, full, end_id, 2, accepted), {3, 4});
+  ok &= accept_draft(draft, 3, full, end_id, 0, accepted) == 0;
+  return check_result("accept", ok);
+}
+
+/* a toy greedy model: the next token depends on the last token and, now and then, on the length */
+static int greedy_token(const std::vector<int> &tokens)
+{
+  const int len = (int)tokens.size();
+  return (tokens[len - 1] * 7 + 3 + (len % 9 == 0 ? 1 : 0)) % 13 + 1;
+}
+
+static bool decode_check()
+{
+  const int end_id = 0;   // never produced by the toy model
+  const int max_new_tokens = 200;
+  bool ok = true;
+  for(int max_draft_len = 0; max_draft_len <= 6; max_draft_len++)
+  {
+    const std::vector<int> prompt = {2, 5, 11, 2, 5};
+
+    std::vector<int> reference = prompt;
+    for(int i = 0; i < max_new_tokens; i++)
+      reference.push_back(greedy_token(reference));
+
+    NGramDrafter drafter(1, max_draft_len);
+    const int prompt_length = (int)prompt.size();
+    drafter.reset(prompt.data(), &prompt_length, prompt_length);
+    std::vector<int> tokens = prompt;
+    std::vector<int> draft(max_draft_len + 1), verified(max_draft_len + 1), accepted(max_draft_len + 1);
+    int generated = 0;
+    while(generated < max_new_tokens)
+    {
+      const int draft_len = drafter.propose(0, max_new_tokens - generated - 1, draft.data());
+      // the multi-token pass: verified[j] is the greedy token after the draft prefix of length j
+      std::vector<int> context = tokens;
+      for(int j = 0; j <= draft_len; j++)
+      {
+        verified[j] = greedy_token(context);
+        if(j < draft_len)
+          context.push_back(draft[j]);
+      }
+      drafter.count_pass();
+      const int num = drafter.accept(0, draft.data(), draft_len, verified.data(), end_id,
+                                     max_new_tokens - generated, accepted.data());
+      ok &= num >= 1 && num <= draft_len + 1;
+      tokens.insert(tokens.end(), accepted.begin(), accepted.begin() + num);
+      generated += num;
+    }
+    const SpeculativeStats &stats = drafter.stats();
+    ok &= tokens == reference && stats.generated_tokens == max_new_tokens &&
+          stats.accepted_tokens <= stats.drafted_tokens &&
+          stats.passes == stats.generated_tokens - stats.accepted_tokens;
+    if(max_draft_len == 0)
+      ok &= stats.drafted_tokens == 0 && stats.passes == max_new_tokens;
+    else
+      ok &= stats.passes < max_new_tokens;
+    printf("[INFO] max draft %d: %lld passes for %lld tokens, %lld of %lld drafted tokens accepted \n",
+           max_draft_len, stats.passes, stats.generated_tokens, stats.accepted_tokens, stats.drafted_tokens);
+  }
+  return check_result("decode", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = lookup_check();
+  pass &= accept_check();
+  pass &= decode_check();
+  return pass ? 0 : -1;
+}
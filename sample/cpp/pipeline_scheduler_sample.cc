@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the encoder-decoder pipeline scheduler on the host
+ *
+ * The issue order of small schedules is compared with the expected one, and
+ * the simulated timelines of a decode-bound and of an encode-bound case are
+ * compared with the values computed by hand. Then random durations check
+ * that a slot is never rewritten before its decode ended.
+ **/
+
+#include "fastertransformer/pipeline_scheduler.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] pipeline scheduler %s check. \n", name);
+  else
+    printf("[ERROR] pipeline scheduler %s fail \n", name);
+  return ok;
+}
+
+static bool same_op(const PipelineOp &op, const PipelineStage stage, const int batch_id, const int slot,
+                    const int wait_batch_id)
+{
+  return op.stage == stage && op.batch_id == batch_id && op.slot == slot && op.wait_batch_id == wait_batch_id;
+}
+
+static bool near(const float a, const float b)
+{
+  return fabsf(a - b) < 1e-5f;
+}
+
+static bool order_check()
+{
+  const PipelineStage E = PipelineStage::ENCODE, D = PipelineStage::DECODE;
+
+  // double buffer: the encoder of the next batch is issued before the decode of the current one
+  std::vector<PipelineOp> ops = PipelineScheduler(2).schedule(3);
+  bool ok = ops.size() == 6 &&
+            same_op(ops[0], E, 0, 0, -1) && same_op(ops[1], E, 1, 1, -1) && same_op(ops[2], D, 0, 0, 0) &&
+            same_op(ops[3], E, 2, 0, 0) && same_op(ops[4], D, 1, 1, 1) && same_op(ops[5], D, 2, 0, 2);
+
+  // 3 slots, the encoder runs 2 batches ahead
+  ops = PipelineScheduler(3).schedule(4);
+  ok &= ops.size() == 8 &&
+        same_op(ops[0], E, 0, 0, -1) && same_op(ops[1], E, 1, 1, -1) && same_op(ops[2], E, 2, 2, -1) &&
+        same_op(ops[3], D, 0, 0, 0) && same_op(ops[4], E, 3, 0, 0) && same_op(ops[5], D, 1, 1, 1) &&
+        same_op(ops[6], D, 2, 2, 2) && same_op(ops[7], D, 3, 0, 3);
+
+  // a single batch, and fewer batches than slots
+  ops = PipelineScheduler(2).schedule(1);
+  ok &= ops.size() == 2 && same_op(ops[0], E, 0, 0, -1) && same_op(ops[1], D, 0, 0, 0);
+  ops = PipelineScheduler(4).schedule(2);
+  ok &= ops.size() == 4 && same_op(ops[0], E, 0, 0, -1) && same_op(ops[1], E, 1, 1, -1) &&
+        same_op(ops[2], D, 0, 0, 0) && same_op(ops[3], D, 1, 1, 1);
+  ok &= PipelineScheduler(2).schedule(0).empty();
+  return check_result("order", ok);
+}
+
+static bool timeline_check()
+{
+  PipelineScheduler scheduler(2);
+
+  // decode bound: E0 [0, 2], E1 [2, 4], D0 [2, 5], E2 waits for D0 [5, 7], D1 [5, 8], D2 [8, 11]
+  PipelineTimeline t = scheduler.simulate(std::vector<float>(3, 2.0f), std::vector<float>(3, 3.0f));
+  bool ok = near(t.encode_start[0], 0.0f) && near(t.encode_start[1], 2.0f) && near(t.encode_start[2], 5.0f) &&
+            near(t.decode_start[0], 2.0f) && near(t.decode_start[1], 5.0f) && near(t.decode_start[2], 8.0f) &&
+            near(t.makespan, 11.0f) && near(t.serial_makespan, 15.0f) &&
+            t.bubble_num == 0 && near(t.bubble_time, 0.0f);
+
+  // encode bound: E0 [0, 4], E1 [4, 8], D0 [4, 5], E2 [8, 12], D1 [8, 9], D2 [12, 13],
+  // D1 and D2 each wait 3 for their encoder
+  t = scheduler.simulate(std::vector<float>(3, 4.0f), std::vector<float>(3, 1.0f));
+  ok &= near(t.encode_start[2], 8.0f) && near(t.decode_start[1], 8.0f) && near(t.decode_start[2], 12.0f) &&
+        near(t.makespan, 13.0f) && near(t.serial_makespan, 15.0f) &&
+        t.bubble_num == 2 && near(t.bubble_time, 6.0f);
+  return check_result("timeline", ok);
+}
+
+static bool slot_check()
+{
+  bool ok = true;
+  srand(17);
+  for(int slot_num = 2; slot_num <= 4; slot_num++)
+  {
+    PipelineScheduler scheduler(slot_num);
+    for(int iter = 0; iter < 100; iter++)
+    {
+      const int batch_num = 1 + rand() % 16;
+      std::vector<float> encode_time(batch_num), decode_time(batch_num);
+      float serial = 0.0f;
+      for(int i = 0; i < batch_num; i++)
+      {
+        encode_time[i] = 0.1f + (rand() % 100) * 0.1f;
+        decode_time[i] = 0.1f + (rand() % 100) * 0.1f;
+        serial += encode_time[i] + decode_time[i];
+      }
+      const PipelineTimeline t = scheduler.simulate(encode_time, decode_time);
+      for(int i = 0; i < batch_num; i++)
+      {
+        // the encoder output is ready, the slot was released by the previous batch of the slot
+        ok &= t.decode_start[i] >= t.encode_end[i] - 1e-4f;
+        if(i >= slot_num)
+          ok &= t.encode_start[i] >= t.decode_end[i - slot_num] - 1e-4f;
+        if(i > 0)
+          ok &= t.decode_start[i] >= t.decode_end[i - 1] - 1e-4f && t.encode_start[i] >= t.encode_end[i - 1] - 1e-4f;
+      }
+      ok &= t.makespan <= serial + 1e-3f && fabsf(t.serial_makespan - serial) < 1e-3f &&
+            t.bubble_num >= 0 && t.bubble_num < batch_num;
+    }
+  }
+  return check_result("slot", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = order_check();
+  pass &= timeline_check();
+  pass &= slot_check();
+  return pass ? 0 : -1;
+}
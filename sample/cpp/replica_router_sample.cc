@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the replica router on simulated devices
+ *
+ * Requests are replayed with simulate_replicas() on equal devices (the work
+ * is balanced), heterogeneous devices (the work follows their speed and beats
+ * a round robin) and a device that fails for a while (its requests are
+ * retried and it comes back), then the admission limit is checked. None of it
+ * needs a GPU.
+ **/
+
+#include "fastertransformer/replica_router.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static std::vector<SimulatedRequest> simulated_requests(const int request_num, const double interval_ms)
+{
+  std::vector<SimulatedRequest> requests(request_num);
+  for(int i = 0; i < request_num; i++)
+  {
+    requests[i].arrival_ms = i * interval_ms;
+    requests[i].estimate = ReplicaRequestCost(16 + rand() % 112, 32 + rand() % 96, 1 + (i % 2) * 3);
+    // sentences stop before max new tokens
+    requests[i].real_tokens = 0.1f * requests[i].estimate.input_tokens +
+                              (float)requests[i].estimate.output_tokens * requests[i].estimate.beam_width * (0.5f + 0.5f * (rand() % 100) / 100.0f);
+  }
+  return requests;
+}
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] replica router %s check. \n", name);
+  else
+    printf("[ERROR] replica router %s fail \n", name);
+  return ok;
+}
+
+static bool router_check()
+{
+  bool pass = true;
+  const std::vector<SimulatedRequest> requests = simulated_requests(2000, 50.0);
+
+  // equal devices share the work
+  {
+    ReplicaRouter router(4);
+    const SimulatedResult result = simulate_replicas(router, std::vector<SimulatedDevice>(4), requests);
+    const double max_busy = *std::max_element(result.busy_ms.begin(), result.busy_ms.end());
+    const double min_busy = *std::min_element(result.busy_ms.begin(), result.busy_ms.end());
+    printf("[INFO] equal devices: busy %.1f - %.1f ms, makespan %.1f ms \n", min_busy, max_busy, result.makespan_ms);
+    pass &= check_result("balance", min_busy > 0.9 * max_busy);
+  }
+
+  // the work follows the speed of the devices, and beats sending every device the same number
+  {
+    std::vector<SimulatedDevice> devices;
+    devices.push_back(SimulatedDevice(0.5f));
+    devices.push_back(SimulatedDevice(1.0f));
+    devices.push_back(SimulatedDevice(2.0f));
+    devices.push_back(SimulatedDevice(4.0f));
+    ReplicaRouter router(4);
+    const SimulatedResult result = simulate_replicas(router, devices, requests);
+
+    std::vector<double> device_free(devices.size(), 0.0);
+    double round_robin_makespan = 0.0;
+    for(size_t i = 0; i < requests.size(); i++)
+    {
+      const int d = (int)(i % devices.size());
+      device_free[d] = std::max(device_free[d], requests[i].arrival_ms) + requests[i].real_tokens / devices[d].tokens_per_ms;
+      round_robin_makespan = std::max(round_robin_makespan, device_free[d]);
+    }
+    printf("[INFO] heterogeneous devices: busy %.1f %.1f %.1f %.1f ms, makespan %.1f ms (round robin %.1f ms) \n",
+           result.busy_ms[0], result.busy_ms[1], result.busy_ms[2], result.busy_ms[3],
+           result.makespan_ms, round_robin_makespan);
+    pass &= check_result("heterogeneous devices", result.makespan_ms < round_robin_makespan &&
+                         router.stats(3).completed_requests > router.stats(0).completed_requests);
+  }
+
+  // device 1 fails for a while: it goes down, its requests are retried, and it comes back
+  {
+    ReplicaRouterConfig config;
+    config.cooldown_ms = 1000.0;
+    std::vector<SimulatedDevice> devices(4);
+    devices[1] = SimulatedDevice(1.0f, 10000.0, 12000.0);
+    ReplicaRouter router(4, config);
+    const SimulatedResult result = simulate_replicas(router, devices, requests);
+    int failed = 0;
+    int recovered = 0;
+    for(size_t i = 0; i < requests.size(); i++)
+    {
+      failed += result.success[i] ? 0 : 1;
+      recovered += result.replica[i] == 1 && result.finish_ms[i] >= devices[1].fail_until_ms ? 1 : 0;
+    }
+    const ReplicaStats stats = router.stats(1);
+    printf("[INFO] failing device: %lld failures, %d retried, %d failed requests, device 1 finished %d requests after the failures \n",
+           stats.failed_requests, result.retried_requests, failed, recovered);
+    pass &= check_result("failing device", failed == 0 && stats.failed_requests >= config.max_failures &&
+                         result.retried_requests == stats.failed_requests && recovered > 0 &&
+                         stats.health == ReplicaHealth::HEALTHY);
+  }
+
+  // nothing is routed when every replica is full
+  {
+    ReplicaRouterConfig config;
+    config.max_outstanding_requests = 2;
+    ReplicaRouter router(2, config);
+    int routed = 0;
+    for(int i = 0; i < 5; i++)
+      routed += router.route(ReplicaRequestCost(10, 10), 0.0) >= 0 ? 1 : 0;
+    pass &= check_result("admission", routed == 4);
+  }
+  return pass;
+}
+
+int main(int argc, char* argv[])
+{
+  srand(0);
+  return router_check() ? 0 : -1;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Replicas of the encoder on all devices
+ *
+ * One encoder replica is built on every visible device from a single host
+ * copy of the weights, and thread_num threads send ite requests each through
+ * the ReplicaManager. The router itself is checked on simulated devices by
+ * replica_router_sample, which does not need a GPU.
+ **/
+
+#include "fastertransformer/faster_transformer.h"
+#include "fastertransformer/replica_manager.h"
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <sys/time.h>
+#include <cuda_fp16.h>
+
+using namespace fastertransformer;
+
+template <OperationType OpType_>
+void replica_sample(const int batch_size, const int seq_len, const int head_num, const int size_per_head,
+                    const int num_layers, const int thread_num, const int ite);
+
+int main(int argc, char* argv[])
+{
+  if(argc != 9)
+  {
+    printf("[ERROR] replica_sample batch_size seq_len head_num size_per_head num_layer is_fp16 thread_num ite \n");
+    printf("e.g., ./bin/replica_sample 8 128 12 64 12 1 16 100\n");
+    return 0;
+  }
+  srand(0);
+
+  int device_num = 0;
+  if(cudaGetDeviceCount(&device_num) != cudaSuccess || device_num == 0)
+  {
+    printf("[ERROR] no device \n");
+    return -1;
+  }
+
+  const int batch_size = atoi(argv[1]);
+  const int seq_len = atoi(argv[2]);
+  const int head_num = atoi(argv[3]);
+  const int size_per_head = atoi(argv[4]);
+  const int num_layers = atoi(argv[5]);
+  const int thread_num = atoi(argv[7]);
+  const int ite = atoi(argv[8]);
+  if(atoi(argv[6]) == 0)
+    replica_sample<OperationType::FP32>(batch_size, seq_len, head_num, size_per_head, num_layers, thread_num, ite);
+  else if(atoi(argv[6]) == 1)
+    replica_sample<OperationType::FP16>(batch_size, seq_len, head_num, size_per_head, num_layers, thread_num, ite);
+  else
+  {
+    printf("[ERROR] is_fp16 should be 0 (use float) or 1 (use half). \n");
+    return -1;
+  }
+  return 0;
+}
+
+template <OperationType OpType_>
+struct EncoderReplica
+{
+  typedef BertEncoderTransformerTraits<OpType_, cuda::OpenMultiHeadAttention> EncoderTraits_;
+  typedef typename EncoderTraits_::DataType DataType_;
+
+  BertEncoderTransformer<EncoderTraits_> *encoder;
+  EncoderInitParam<DataType_> param;
+  DataType_ *buf;
+  int num_layers;
+
+  ~EncoderReplica()
+  {
+    delete encoder;
+    cudaFree(buf);
+  }
+};
+
+template <OperationType OpType_>
+void replica_sample(const int batch_size, const int seq_len, const int head_num, const int size_per_head,
+                    const int num_layers, const int thread_num, const int ite)
+{
+  typedef EncoderReplica<OpType_> Engine;
+  typedef typename Engine::EncoderTraits_ EncoderTraits_;
+  typedef typename Engine::DataType_ T;
+  const int hidden_units = head_num * size_per_head;
+  const size_t h = hidden_units;
+
+  // the weights of one layer, used by all layers as in encoder_sample
+  const size_t weight_num = 12 * h * h + 13 * h;
+  std::vector<T> h_weights(weight_num);
+  for(size_t i = 0; i < weight_num; i++)
+    h_weights[i] = (T)((rand() % 100 - 50) * 0.0002f);
+
+  int device_num = 0;
+  check_cuda_error(cudaGetDeviceCount(&device_num));
+  std::vector<int> devices;
+  for(int i = 0; i < device_num; i++)
+    devices.push_back(i);
+
+  typename ReplicaManager<Engine>::EngineFactory factory = [&](const ReplicaContext &context) {
+    Engine *replica = new Engine();
+    replica->num_layers = num_layers;
+    replica->encoder = new BertEncoderTransformer<EncoderTraits_>(0, false);
+    replica->encoder->allocateBuffer(context.allocator, batch_size, seq_len, seq_len, head_num, size_per_head, false);
+
+    const size_t tensor_size = (size_t)batch_size * seq_len * hidden_units;
+    const size_t mask_size = (size_t)batch_size * seq_len * seq_len;
+    check_cuda_error(cudaMalloc((void **)&replica->buf, sizeof(T) * (tensor_size * 2 + mask_size)));
+    check_cuda_error(cudaMemset(replica->buf, 0, sizeof(T) * tensor_size));
+    std::vector<T> h_mask(mask_size, (T)1.0f);
+    check_cuda_error(cudaMemcpy(replica->buf + tensor_size * 2, h_mask.data(), sizeof(T) * mask_size, cudaMemcpyHostToDevice));
+
+    const T *w = (const T *)context.weights;
+    EncoderInitParam<T> &param = replica->param;
+    param.from_tensor = replica->buf;
+    param.to_tensor = replica->buf;
+    param.transformer_out = replica->buf + tensor_size;
+    param.attr_mask = replica->buf + tensor_size * 2;
+    param.self_attention.query_weight.kernel = w;
+    param.self_attention.key_weight.kernel = w + h * h;
+    param.self_attention.value_weight.kernel = w + 2 * h * h;
+    param.self_attention.query_weight.bias = w + 3 * h * h;
+    param.self_attention.key_weight.bias = w + 3 * h * h + h;
+    param.self_attention.value_weight.bias = w + 3 * h * h + 2 * h;
+    param.self_attention.attention_output_weight.kernel = w + 3 * h * h + 3 * h;
+    param.self_attention.attention_output_weight.bias = w + 4 * h * h + 3 * h;
+    param.self_layernorm.gamma = w + 4 * h * h + 4 * h;
+    param.self_layernorm.beta = w + 4 * h * h + 5 * h;
+    param.ffn.intermediate_weight.kernel = w + 4 * h * h + 6 * h;
+    param.ffn.intermediate_weight.bias = w + 8 * h * h + 6 * h;
+    param.ffn.output_weight.kernel = w + 8 * h * h + 10 * h;
+    param.ffn.output_weight.bias = w + 12 * h * h + 10 * h;
+    param.ffn_layernorm.gamma = w + 12 * h * h + 11 * h;
+    param.ffn_layernorm.beta = w + 12 * h * h + 12 * h;
+    param.cublas_handle = context.cublas_handle;
+    param.cublaslt_handle = context.cublaslt_handle;
+    param.stream = context.stream;
+    param.layer_idx = 0;
+    param.layer_num = num_layers;
+    param.valid_word_num = batch_size * seq_len;
+    return replica;
+  };
+
+  ReplicaManager<Engine> manager(h_weights.data(), sizeof(T) * weight_num, devices, factory);
+  printf("[INFO] %d encoder replicas \n", manager.replica_num());
+
+  const ReplicaRequestCost cost(batch_size * seq_len, 0);
+  std::vector<int> rejected(thread_num, 0);
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++)
+  {
+    threads.push_back(std::thread([&, t]() {
+      for(int i = 0; i < ite; i++)
+      {
+        const int replica = manager.run(cost, [](Engine &engine, const ReplicaContext &context) {
+          engine.encoder->initialize(engine.param);
+          for(int l = 0; l < engine.num_layers; l++)
+            engine.encoder->forward();
+        });
+        rejected[t] += replica < 0 ? 1 : 0;
+      }
+    }));
+  }
+  for(int t = 0; t < thread_num; t++)
+    threads[t].join();
+  gettimeofday(&end, NULL);
+
+  const double time_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) * 0.001;
+  int rejected_num = 0;
+  for(int t = 0; t < thread_num; t++)
+    rejected_num += rejected[t];
+  printf("[INFO] %d requests in %.2f ms (%.2f requests / s), %d rejected \n", thread_num * ite, time_ms,
+         thread_num * ite * 1000.0 / time_ms, rejected_num);
+  for(int i = 0; i < manager.replica_num(); i++)
+  {
+    const ReplicaStats stats = manager.router().stats(i);
+    printf("[INFO] replica %d (device %d): %lld requests, %lld failures, throughput %.1f tokens / ms \n", i,
+           manager.context(i).device_id, stats.completed_requests, stats.failed_requests, stats.throughput);
+  }
+}
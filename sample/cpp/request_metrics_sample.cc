@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the request metrics on the host
+ *
+ * The buckets and the percentiles of the histograms are compared with exact
+ * values, thread_num threads record concurrently and the totals are checked,
+ * DecodingMetricsTracker is fed a decoding with known step times, and the
+ * Prometheus text is checked to be cumulative. The cost of a record and of a
+ * disabled tracker is printed at the end.
+ **/
+
+#include "fastertransformer/request_metrics.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] request metrics %s check. \n", name);
+  else
+    printf("[ERROR] request metrics %s fail \n", name);
+  return ok;
+}
+
+static bool bucket_check()
+{
+  bool ok = true;
+  for(int i = 0; i < LATENCY_BUCKET_NUM; i++)
+  {
+    const uint64_t lower = latency_bucket_lower(i);
+    const uint64_t upper = latency_bucket_upper(i);
+    ok &= latency_bucket(lower) == i && latency_bucket(upper) == i;
+    ok &= i == 0 || latency_bucket_upper(i - 1) + 1 == lower;
+    // the width of a bucket is at most 1/16 of its values
+    ok &= (upper - lower) * LATENCY_SUB_BUCKET_NUM <= lower;
+  }
+  ok &= latency_bucket(UINT64_MAX) == LATENCY_BUCKET_NUM - 1;
+  return check_result("buckets", ok);
+}
+
+static bool percentile_check()
+{
+  LatencyHistogram histogram;
+  std::vector<uint64_t> values(100000);
+  for(size_t i = 0; i < values.size(); i++)
+  {
+    // log-uniform from 1 us to 1 s
+    values[i] = (uint64_t)exp(rand() / (RAND_MAX + 1.0) * log(1e6));
+    histogram.record(values[i]);
+  }
+  HistogramSnapshot snapshot;
+  histogram.add_to(snapshot);
+  std::sort(values.begin(), values.end());
+
+  bool ok = snapshot.count == values.size() && snapshot.min == values.front() && snapshot.max == values.back();
+  uint64_t sum = 0;
+  for(size_t i = 0; i < values.size(); i++)
+    sum += values[i];
+  ok &= snapshot.sum == sum;
+  const double qs[] = {0.0, 0.5, 0.9, 0.99, 0.999, 1.0};
+  for(int i = 0; i < 6; i++)
+  {
+    const size_t rank = std::max((size_t)1, (size_t)ceil(qs[i] * values.size()));
+    const uint64_t exact = values[rank - 1];
+    const uint64_t p = snapshot.percentile(qs[i]);
+    printf("[INFO] p%g exact %llu histogram %llu \n", qs[i] * 100, (unsigned long long)exact, (unsigned long long)p);
+    ok &= p >= exact && p <= exact + exact / LATENCY_SUB_BUCKET_NUM;
+  }
+  return check_result("percentiles", ok);
+}
+
+static bool concurrency_check(const int thread_num)
+{
+  RequestMetrics metrics(4);   // fewer shards than threads, some of them share a shard
+  const int record_num = 200000;
+  std::vector<std::thread> threads;
+  for(int t = 0; t < thread_num; t++)
+  {
+    threads.push_back(std::thread([&metrics, t, record_num]() {
+      for(int i = 0; i < record_num; i++)
+      {
+        metrics.record(RequestMetric::TOKEN_TIME, (uint64_t)(t * 1000 + i % 1000));
+        metrics.add(RequestCounter::GENERATED_TOKENS, 2);
+      }
+    }));
+  }
+  for(size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  const MetricsSnapshot snapshot = metrics.snapshot();
+  const HistogramSnapshot &h = snapshot.histogram(RequestMetric::TOKEN_TIME);
+  uint64_t sum = 0;
+  for(int t = 0; t < thread_num; t++)
+    sum += (uint64_t)(record_num / 1000) * (t * 1000 * 1000 + 999 * 1000 / 2);
+  const uint64_t count = (uint64_t)thread_num * record_num;
+  bool ok = h.count == count && h.sum == sum && h.min == 0 && h.max == (uint64_t)(thread_num * 1000 - 1);
+  ok &= snapshot.counter(RequestCounter::GENERATED_TOKENS) == 2 * count;
+  uint64_t bucket_total = 0;
+  for(int i = 0; i < LATENCY_BUCKET_NUM; i++)
+    bucket_total += h.counts[i];
+  ok &= bucket_total == count;
+  metrics.reset();
+  ok &= metrics.snapshot().histogram(RequestMetric::TOKEN_TIME).count == 0;
+  return check_result("concurrent records", ok);
+}
+
+/* 3 sentences of 2 beams arrive at 1 us and start at 1000 us, a step takes 100 us. Sentence 0
+   finishes at step 2, sentence 1 at step 4 and sentence 2 reaches the maximal length (5 steps). */
+static bool tracker_check()
+{
+  RequestMetrics metrics;
+  DecodingMetricsTracker tracker(3, 2);
+  bool finished[6] = {false, false, false, false, false, false};
+  tracker.begin(&metrics, 1, 1000);
+  for(int step = 1; step <= 5; step++)
+  {
+    if(step == 2)
+      finished[0] = finished[1] = true;
+    if(step == 4)
+      finished[2] = finished[3] = true;
+    if(step == 3)
+      finished[4] = true;   // one beam of sentence 2 is not finished
+    tracker.step(finished, 1000 + step * 100);
+  }
+  tracker.end(1500);
+
+  MetricsSnapshot snapshot = metrics.snapshot();
+  const HistogramSnapshot &first = snapshot.histogram(RequestMetric::FIRST_TOKEN_TIME);
+  const HistogramSnapshot &token = snapshot.histogram(RequestMetric::TOKEN_TIME);
+  const HistogramSnapshot &request = snapshot.histogram(RequestMetric::REQUEST_TIME);
+  const HistogramSnapshot &speed = snapshot.histogram(RequestMetric::TOKENS_PER_SECOND);
+  bool ok = first.count == 3 && first.min == 1099 && first.max == 1099;
+  ok &= token.count == 3 + 2 + 2 + 1 && token.min == 100 && token.max == 100;
+  ok &= request.count == 3 && request.min == 1199 && request.max == 1499 && request.sum == 1199 + 1399 + 1499;
+  // sentence 2 generates 5 tokens in 1499 us
+  ok &= speed.count == 3 && speed.max == (uint64_t)(5 * 1e6 / 1499 + 0.5);
+  ok &= snapshot.counter(RequestCounter::REQUESTS) == 3 && snapshot.counter(RequestCounter::GENERATED_TOKENS) == 11 &&
+        snapshot.counter(RequestCounter::DECODING_STEPS) == 5 && snapshot.counter(RequestCounter::BATCHES) == 1;
+
+  // a speculative pass gives the first tokens at once, the others are spread over the pass
+  metrics.reset();
+  DecodingMetricsTracker speculative(2);
+  std::vector<bool> done(2, false);
+  std::vector<int> step_tokens(2, 3);
+  speculative.begin(&metrics, 0, 0);
+  speculative.step(done, step_tokens, 300);
+  step_tokens[0] = 4;
+  step_tokens[1] = 1;
+  done[0] = done[1] = true;
+  speculative.step(done, step_tokens, 500);
+  speculative.end(600);
+  snapshot = metrics.snapshot();
+  const HistogramSnapshot &spec_token = snapshot.histogram(RequestMetric::TOKEN_TIME);
+  ok &= snapshot.histogram(RequestMetric::FIRST_TOKEN_TIME).count == 2 &&
+        spec_token.count == 2 * 2 + 4 + 1 && spec_token.sum == 4 * 50 + 200 &&
+        snapshot.histogram(RequestMetric::REQUEST_TIME).max == 500 &&
+        snapshot.counter(RequestCounter::GENERATED_TOKENS) == 11;
+
+  // a disabled tracker records nothing
+  metrics.reset();
+  DecodingMetricsTracker disabled(3, 2);
+  disabled.begin(nullptr);
+  disabled.step(finished);
+  disabled.end();
+  ok &= metrics.snapshot().counter(RequestCounter::BATCHES) == 0;
+  return check_result("decoding tracker", ok);
+}
+
+static bool prometheus_check()
+{
+  RequestMetrics metrics;
+  for(int i = 0; i < 1000; i++)
+    metrics.record(RequestMetric::FIRST_TOKEN_TIME, 100 + i * 37);
+  metrics.add(RequestCounter::REQUESTS, 1000);
+  const std::string text = metrics.prometheus_text("ft");
+
+  std::istringstream lines(text);
+  std::string line;
+  bool ok = text.find("# TYPE ft_requests_total counter\nft_requests_total 1000\n") != std::string::npos;
+  unsigned long long previous = 0;
+  int bucket_num = 0;
+  bool inf_seen = false;
+  while(std::getline(lines, line))
+  {
+    const std::string bucket = "ft_time_to_first_token_seconds_bucket{le=\"";
+    if(line.compare(0, bucket.size(), bucket) != 0)
+      continue;
+    const unsigned long long value = strtoull(line.c_str() + line.rfind(' ') + 1, nullptr, 10);
+    ok &= value >= previous;
+    previous = value;
+    bucket_num++;
+    inf_seen = line.find("+Inf") != std::string::npos;
+  }
+  ok &= inf_seen && previous == 1000 && bucket_num > 2;
+  ok &= text.find("ft_time_to_first_token_seconds_count 1000\n") != std::string::npos;
+  if(!ok)
+    printf("%s", text.c_str());
+  return check_result("prometheus text", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 2)
+  {
+    printf("[ERROR] request_metrics_sample thread_num \n");
+    printf("e.g., ./bin/request_metrics_sample 8\n");
+    return 0;
+  }
+  const int thread_num = atoi(argv[1]);
+  srand(0);
+
+  bool pass = bucket_check();
+  pass &= percentile_check();
+  pass &= concurrency_check(thread_num);
+  pass &= tracker_check();
+  pass &= prometheus_check();
+
+  // the cost of the recording, and of the calls made by a decoding without metrics
+  {
+    RequestMetrics metrics;
+    const int ite = 10000000;
+    int64_t start = RequestMetrics::now_us();
+    for(int i = 0; i < ite; i++)
+      metrics.record(RequestMetric::TOKEN_TIME, (uint64_t)i);
+    const double record_ns = (RequestMetrics::now_us() - start) * 1000.0 / ite;
+
+    DecodingMetricsTracker tracker(64);
+    bool finished[64] = {false};
+    start = RequestMetrics::now_us();
+    for(int i = 0; i < ite; i++)
+    {
+      tracker.begin(nullptr);
+      tracker.step(finished);
+      tracker.end();
+    }
+    const double disabled_ns = (RequestMetrics::now_us() - start) * 1000.0 / ite;
+    printf("[INFO] record %.1f ns, disabled tracker %.1f ns per step \n", record_ns, disabled_ns);
+  }
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the shared memory front end on the host
+ *
+ * The ring is checked in one process (wrap, full ring, messages held and
+ * released in order). Then client processes are forked: each one sends
+ * prompts written in place in its request ring, the server process feeds
+ * them to a ChunkedPrefillScheduler straight from the ring, "samples" the
+ * next tokens with a fixed function instead of the GPT-2 engine and sends
+ * the generated tokens back. The clients check the tokens, one client dies
+ * without detaching and its channel is reclaimed. Last, a client stops
+ * reading its responses: the server gives up at its timeout while the client
+ * is alive, and reclaims the channel once the client dies with a full ring.
+ **/
+
+#include "fastertransformer/shm_frontend.h"
+#include "fastertransformer/chunked_prefill_scheduler.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include <sys/wait.h>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] shm front end %s check. \n", name);
+  else
+    printf("[ERROR] shm front end %s fail \n", name);
+  return ok;
+}
+
+/* the engine of the sample, never the end id 0 */
+static int next_token(const int token)
+{
+  return 1 + (int)(((long long)token * 7919 + 13) % 50000);
+}
+
+static bool ring_check()
+{
+  const uint64_t capacity = 1024;
+  const std::string name = "/ft_shm_ring_sample_" + std::to_string(getpid());
+  ShmSegment segment(name, ShmRing::bytes(capacity));
+  ShmRing::format(segment.base());
+  ShmRing producer(segment.base(), capacity);
+  ShmRing consumer(segment.base(), capacity);
+  bool ok = consumer.next() == nullptr;
+
+  // messages of 1 to 300 bytes, up to 3 held by the consumer, the ring wraps many times
+  std::vector<const ShmMessage *> held;
+  int sent = 0, received = 0, full = 0;
+  while(received < 2000)
+  {
+    const uint32_t size = 1 + (uint32_t)(sent * 37 % 300);
+    unsigned char *payload = sent < 2000 ? (unsigned char *)producer.reserve(size) : nullptr;
+    if(payload != nullptr)
+    {
+      for(uint32_t i = 0; i < size; i++)
+        payload[i] = (unsigned char)(sent + i);
+      producer.commit(7, (uint64_t)sent);
+      sent++;
+    }
+    else if(sent < 2000)
+      full++;
+    const ShmMessage *message = consumer.next();
+    if(message != nullptr)
+    {
+      const unsigned char *data = (const unsigned char *)message->payload();
+      ok &= message->tag == (uint64_t)received && message->type == 7 &&
+            message->size == 1 + (uint32_t)(received * 37 % 300);
+      for(uint32_t i = 0; i < message->size; i++)
+        ok &= data[i] == (unsigned char)(received + i);
+      received++;
+      held.push_back(message);
+    }
+    if(held.size() == 3 || (message == nullptr && !held.empty()))
+    {
+      consumer.release(held.back());
+      held.clear();
+    }
+  }
+  if(!held.empty())
+    consumer.release(held.back());
+  // the ring is free again, a message of half of it fits wherever the head is
+  ok &= producer.reserve((uint32_t)(capacity / 2 - sizeof(ShmMessage))) != nullptr && full > 0;
+  return check_result("ring", ok);
+}
+
+struct PromptHeader
+{
+  int prompt_len;
+  int max_new_tokens;
+};
+
+/* a client process: request_num prompts with at most 4 in flight, return the exit code */
+static int run_client(const std::string &name, const int client_id, const int request_num)
+{
+  ShmClient client(name);
+  std::map<uint64_t, std::vector<int>> expected;
+  int sent = 0, received = 0;
+  bool ok = true;
+  while(received < request_num)
+  {
+    while(sent < request_num && sent - received < 4)
+    {
+      const int prompt_len = 8 + (client_id * 31 + sent * 17) % 200;
+      const int max_new_tokens = 1 + (client_id + sent) % 32;
+      PromptHeader *header = (PromptHeader *)client.reserve(sizeof(PromptHeader) + sizeof(int) * prompt_len);
+      header->prompt_len = prompt_len;
+      header->max_new_tokens = max_new_tokens;
+      int *prompt = (int *)(header + 1);
+      for(int i = 0; i < prompt_len; i++)
+        prompt[i] = 1 + (client_id * 1000 + sent * 13 + i) % 50000;
+      std::vector<int> tokens(max_new_tokens);
+      int token = prompt[prompt_len - 1];
+      for(int i = 0; i < max_new_tokens; i++)
+        tokens[i] = token = next_token(token);
+      expected[(uint64_t)sent] = tokens;
+      client.submit(0, (uint64_t)sent);
+      sent++;
+    }
+    const ShmMessage *response = client.next_response(5000000);
+    if(response == nullptr)
+      return 2;
+    const std::vector<int> &tokens = expected[response->tag];
+    ok &= response->size == sizeof(int) * tokens.size() &&
+          memcmp(response->payload(), tokens.data(), response->size) == 0;
+    client.release(response);
+    received++;
+  }
+  return ok ? 0 : 1;
+}
+
+/* the client dies after a request, without detaching */
+static void run_crashing_client(const std::string &name)
+{
+  ShmClient *client = new ShmClient(name);
+  PromptHeader *header = (PromptHeader *)client->reserve(sizeof(PromptHeader) + sizeof(int));
+  header->prompt_len = 1;
+  header->max_new_tokens = 1;
+  *(int *)(header + 1) = 5;
+  client->submit(0, 0);
+  _exit(0);
+}
+
+static bool serve_check(const int client_num, const int request_num)
+{
+  const std::string name = "/ft_shm_frontend_sample_" + std::to_string(getpid());
+  ShmFrontendConfig config;
+  config.channel_num = client_num + 1;
+  config.ring_bytes = 2048;   // small, the clients wait for space
+  ShmServer server(name, config);
+
+  ChunkedPrefillConfig scheduler_config;
+  scheduler_config.slot_num = 16;
+  scheduler_config.token_budget = 256;
+  scheduler_config.chunk_size = 64;
+  scheduler_config.max_seq_len = 512;
+  ChunkedPrefillScheduler scheduler(scheduler_config);
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<pid_t> pids;
+  for(int i = 0; i <= client_num; i++)
+  {
+    const pid_t pid = fork();
+    if(pid == 0)
+    {
+      // the child does not run the destructor of the server, which would unlink the segment
+      if(i == client_num)
+        run_crashing_client(name);
+      _exit(run_client(name, i, request_num));
+    }
+    pids.push_back(pid);
+  }
+
+  struct Owner
+  {
+    int channel;
+    uint64_t tag;
+  };
+  std::vector<Owner> owners;
+  std::vector<ShmRequest> requests;
+  int running = (int)pids.size();
+  bool ok = true;
+  long long served = 0, steps = 0;
+  while(running > 0 || !scheduler.idle())
+  {
+    requests.clear();
+    server.collect(requests, 64, scheduler.idle() ? 1000 : 0);
+    for(size_t i = 0; i < requests.size(); i++)
+    {
+      // the prompt is read in place from the ring of the client
+      const PromptHeader *header = (const PromptHeader *)requests[i].payload;
+      scheduler.add_sequence((const int *)(header + 1), header->prompt_len, header->max_new_tokens);
+      Owner owner = {requests[i].channel, requests[i].tag};
+      owners.push_back(owner);
+      server.release(requests[i]);
+    }
+    if(!scheduler.idle())
+    {
+      const StepPlan plan = scheduler.schedule();
+      std::vector<int> sampled(plan.sample_rows.size());
+      for(size_t i = 0; i < sampled.size(); i++)
+        sampled[i] = next_token(plan.row_ids[plan.sample_rows[i]]);
+      const std::vector<int> finished = scheduler.complete(plan, sampled.data(), 0);
+      for(size_t i = 0; i < finished.size(); i++)
+      {
+        const ChunkedSequence &seq = scheduler.sequence(finished[i]);
+        const Owner &owner = owners[finished[i]];
+        server.respond(owner.channel, 1, owner.tag, seq.tokens.data() + seq.prompt_len, sizeof(int) * seq.generated,
+                       1000000);
+        served++;
+      }
+      steps++;
+    }
+    int status = 0;
+    const pid_t pid = waitpid(-1, &status, WNOHANG);
+    if(pid > 0)
+    {
+      running--;
+      ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+  }
+  const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  requests.clear();
+  server.collect(requests, 64, 0);
+  // the request of the crashing client is dropped if its channel was reclaimed first
+  const long long lost = (long long)client_num * request_num + 1 - served;
+  ok &= (lost == 0 || lost == 1) && server.attached_num() == 0;
+  printf("[INFO] %d client processes, %lld requests in %lld steps, %.1f ms (%.0f requests/s) \n",
+         client_num, served, steps, ms, served * 1000.0 / ms);
+  return check_result("serve", ok);
+}
+
+/* the client sends a request, never reads the responses and dies after 300 ms */
+static bool stall_check()
+{
+  const std::string name = "/ft_shm_stall_sample_" + std::to_string(getpid());
+  ShmFrontendConfig config;
+  config.channel_num = 1;
+  config.ring_bytes = 256;
+  ShmServer server(name, config);
+  // the dead client is not left a zombie, which kill() would still find
+  signal(SIGCHLD, SIG_IGN);
+  const pid_t pid = fork();
+  if(pid == 0)
+  {
+    ShmClient *client = new ShmClient(name);
+    client->reserve(sizeof(int));
+    client->submit(0, 0);
+    usleep(300000);
+    _exit(0);
+  }
+
+  std::vector<ShmRequest> requests;
+  for(int i = 0; i < 100 && requests.empty(); i++)
+    server.collect(requests, 1, 100000);
+  bool ok = requests.size() == 1;
+  if(ok)
+    server.release(requests[0]);
+  const int channel = ok ? requests[0].channel : 0;
+  const int payload[8] = {0};
+  int sent = 0;
+  while(ok && server.respond(channel, 1, 0, payload, sizeof(payload), 0))
+    sent++;
+
+  // a live client: the timeout
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  ok &= sent > 0 && !server.respond(channel, 1, 0, payload, sizeof(payload), 50000);
+  const double timeout_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  ok &= timeout_ms >= 50.0 && server.attached_num() == 1;
+
+  // no limit: the wait ends when the client dies, and its channel is free again
+  start = Clock::now();
+  ok &= !server.respond(channel, 1, 0, payload, sizeof(payload), -1);
+  const double dead_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  ok &= server.attached_num() == 0;
+  signal(SIGCHLD, SIG_DFL);
+  printf("[INFO] %d responses fill the ring, timeout after %.1f ms, dead client found after %.1f ms \n", sent,
+         timeout_ms, dead_ms);
+  return check_result("stall", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 3)
+  {
+    printf("[ERROR] shm_frontend_sample client_num request_num \n");
+    printf("e.g., ./bin/shm_frontend_sample 8 200\n");
+    return 0;
+  }
+  const int client_num = atoi(argv[1]);
+  const int request_num = atoi(argv[2]);
+  bool pass = ring_check();
+  pass &= serve_check(client_num, request_num);
+  pass &= stall_check();
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the bookkeeping of the pinned staging pool on the host
+ *
+ * StagingArena: first fit, alignment, coalescing of freed ranges and ranges
+ * freed with a fence that are only reused once the fence is done.
+ * StagingHeap: growth by arenas, a request larger than the arena size, the
+ * reuse of the ranges freed by another op and the oldest fence of all arenas.
+ * Then random traffic is replayed against a reference of the live ranges.
+ **/
+
+#include "fastertransformer/staging_arena.h"
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] staging arena %s check. \n", name);
+  else
+    printf("[ERROR] staging arena %s fail \n", name);
+  return ok;
+}
+
+static bool arena_check()
+{
+  StagingArena arena(4 * STAGING_ALIGNMENT + 100);   // rounded down to 4 blocks
+  bool ok = arena.capacity() == 4 * STAGING_ALIGNMENT;
+
+  size_t a, b, c, d;
+  ok &= arena.allocate(1, a) && a == 0;
+  ok &= arena.allocate(STAGING_ALIGNMENT + 1, b) && b == STAGING_ALIGNMENT;   // 2 blocks
+  ok &= arena.allocate(STAGING_ALIGNMENT, c) && c == 3 * STAGING_ALIGNMENT;
+  ok &= !arena.allocate(1, d) && arena.used_bytes() == arena.capacity() && arena.allocated_num() == 3;
+
+  // a and c are not adjacent, then freeing b merges the three ranges into one
+  arena.free(a);
+  arena.free(c);
+  ok &= arena.free_block_num() == 2 && !arena.allocate(2 * STAGING_ALIGNMENT, d);
+  arena.free(b);
+  ok &= arena.free_block_num() == 1 && arena.used_bytes() == 0 && arena.peak_bytes() == arena.capacity();
+  ok &= arena.allocate(4 * STAGING_ALIGNMENT, d) && d == 0;
+  arena.free(d);
+
+  // a range freed with a fence is reused only after its fence is done
+  ok &= arena.allocate(4 * STAGING_ALIGNMENT, a);
+  arena.free_after(a, 7);
+  unsigned long long fence = 0;
+  ok &= arena.oldest_fence(fence) && fence == 7 && arena.pending_bytes() == arena.capacity();
+  ok &= !arena.allocate(1, b);
+  ok &= arena.reclaim([](unsigned long long) { return false; }) == 0 && !arena.allocate(1, b);
+  ok &= arena.reclaim([](unsigned long long f) { return f == 7; }) == 1;
+  ok &= arena.pending_bytes() == 0 && arena.used_bytes() == 0 && !arena.oldest_fence(fence);
+  ok &= arena.allocate(1, b) && b == 0;
+  return check_result("arena", ok);
+}
+
+static bool heap_check()
+{
+  StagingHeap heap(4 * STAGING_ALIGNMENT);
+  StagingBlock a, b, c, d;
+  bool ok = heap.arena_num() == 0 && heap.capacity() == 0 && !heap.allocate(1, a);
+
+  // the first op grows the heap by one arena, a second op shares it
+  ok &= heap.grow(1) == 0 && heap.arena_capacity(0) == 4 * STAGING_ALIGNMENT;
+  ok &= heap.allocate(3 * STAGING_ALIGNMENT, a) && a.arena == 0 && a.offset == 0;
+  ok &= heap.allocate(STAGING_ALIGNMENT, b) && b.arena == 0 && b.offset == 3 * STAGING_ALIGNMENT;
+  ok &= !heap.allocate(1, c);
+
+  // a request larger than the arena size gets an arena of its size
+  ok &= heap.arena_size_for(10 * STAGING_ALIGNMENT) == 10 * STAGING_ALIGNMENT && heap.grow(10 * STAGING_ALIGNMENT) == 1;
+  ok &= heap.allocate(10 * STAGING_ALIGNMENT, c) && c.arena == 1 && c.offset == 0;
+  ok &= heap.capacity() == 14 * STAGING_ALIGNMENT && heap.used_bytes() == 14 * STAGING_ALIGNMENT;
+
+  // the ranges freed by one op are reused by the next, first fit goes to the first arena
+  heap.free(a);
+  ok &= heap.allocate(2 * STAGING_ALIGNMENT, d) && d.arena == 0 && d.offset == 0;
+  heap.free(d);
+
+  // fences of several arenas, the oldest is the smallest
+  heap.free_after(c, 5);
+  heap.free_after(b, 3);
+  unsigned long long fence = 0;
+  ok &= heap.oldest_fence(fence) && fence == 3 && heap.pending_bytes() == 11 * STAGING_ALIGNMENT;
+  ok &= heap.reclaim([](unsigned long long f) { return f <= 3; }) == 1 && heap.oldest_fence(fence) && fence == 5;
+  ok &= heap.reclaim([](unsigned long long) { return true; }) == 1 && !heap.oldest_fence(fence);
+  ok &= heap.used_bytes() == 0 && heap.peak_bytes() == 14 * STAGING_ALIGNMENT;
+  ok &= heap.allocate(10 * STAGING_ALIGNMENT, c) && c.arena == 1;
+  return check_result("heap", ok);
+}
+
+/* random acquire / release / release after a fence, the live ranges never overlap */
+static bool traffic_check()
+{
+  StagingHeap heap(16 * STAGING_ALIGNMENT);
+  struct Live
+  {
+    StagingBlock block;
+    size_t size;
+  };
+  std::vector<Live> live;
+  std::vector<std::pair<Live, unsigned long long> > pending;
+  unsigned long long next_fence = 0, done_fence = 0;
+  bool ok = true;
+  srand(5);
+  for(int iter = 0; iter < 20000; iter++)
+  {
+    const int action = rand() % 3;
+    if(action == 0 || live.empty())
+    {
+      Live l;
+      l.size = 1 + rand() % (6 * STAGING_ALIGNMENT);
+      if(!heap.allocate(l.size, l.block))
+      {
+        if(heap.capacity() < 64 * STAGING_ALIGNMENT)
+        {
+          heap.grow(l.size);
+          ok &= heap.allocate(l.size, l.block);
+        }
+        else
+          continue;
+      }
+      ok &= l.block.offset % STAGING_ALIGNMENT == 0 &&
+            l.block.offset + l.size <= heap.arena_capacity(l.block.arena);
+      for(size_t i = 0; i < live.size(); i++)
+        ok &= live[i].block.arena != l.block.arena ||
+              l.block.offset + l.size <= live[i].block.offset ||
+              live[i].block.offset + live[i].size <= l.block.offset;
+      for(size_t i = 0; i < pending.size(); i++)
+        ok &= pending[i].first.block.arena != l.block.arena ||
+              l.block.offset + l.size <= pending[i].first.block.offset ||
+              pending[i].first.block.offset + pending[i].first.size <= l.block.offset;
+      live.push_back(l);
+    }
+    else
+    {
+      const size_t i = rand() % live.size();
+      if(action == 1)
+        heap.free(live[i].block);
+      else
+      {
+        heap.free_after(live[i].block, next_fence);
+        pending.push_back(std::make_pair(live[i], next_fence++));
+      }
+      live.erase(live.begin() + i);
+    }
+    // the fences complete in order, a few at a time
+    if(rand() % 4 == 0 && done_fence < next_fence)
+    {
+      done_fence += 1 + rand() % 3;
+      const unsigned long long done = done_fence;
+      heap.reclaim([done](unsigned long long f) { return f < done; });
+      for(size_t i = 0; i < pending.size();)
+      {
+        if(pending[i].second < done)
+          pending.erase(pending.begin() + i);
+        else
+          i++;
+      }
+    }
+  }
+  heap.reclaim([](unsigned long long) { return true; });
+  for(size_t i = 0; i < live.size(); i++)
+    heap.free(live[i].block);
+  ok &= heap.used_bytes() == 0 && heap.pending_bytes() == 0 && heap.peak_bytes() <= heap.capacity();
+  printf("[INFO] %d arenas, peak %zu of %zu bytes \n", heap.arena_num(), heap.peak_bytes(), heap.capacity());
+  return check_result("traffic", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = arena_check();
+  pass &= heap_check();
+  pass &= traffic_check();
+  return pass ? 0 : -1;
+}
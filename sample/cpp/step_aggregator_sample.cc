@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the step aggregation protocol on the host
+ *
+ * Engines on their own threads submit the rows of their steps to one
+ * StepAggregator, the flush runs a greedy "logits GEMM" of all the rows on the
+ * host and scatters the ids back, like LogitsAggregator does on the device.
+ * The ids are compared with the ones of every engine alone, then the batches
+ * are checked when an engine stops submitting and when the parts exceed
+ * max_rows.
+ **/
+
+#include "fastertransformer/step_aggregator.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] step aggregator %s check. \n", name);
+  else
+    printf("[ERROR] step aggregator %s fail \n", name);
+  return ok;
+}
+
+struct HostPart
+{
+  const float *normed;   // [rows, hidden]
+  int *ids;              // [rows]
+  int engine;
+};
+
+/* ids[r] = argmax_v sum_h normed[r, h] * embedding[h, v] */
+static void greedy_logits(const float *normed, const float *embedding, const int rows, const int hidden,
+                          const int vocab, int *ids)
+{
+  std::vector<float> logits(vocab);
+  for(int r = 0; r < rows; r++)
+  {
+    for(int v = 0; v < vocab; v++)
+      logits[v] = 0.0f;
+    for(int h = 0; h < hidden; h++)
+    {
+      const float x = normed[r * hidden + h];
+      for(int v = 0; v < vocab; v++)
+        logits[v] += x * embedding[h * vocab + v];
+    }
+    int best = 0;
+    for(int v = 1; v < vocab; v++)
+      if(logits[v] > logits[best])
+        best = v;
+    ids[r] = best;
+  }
+}
+
+static float value(const int engine, const int step, const int r, const int h)
+{
+  return (float)((engine * 131 + step * 31 + r * 17 + h * 7) % 97) / 97.0f - 0.5f;
+}
+
+/* every engine runs step_num steps of 1 + (engine + step) % 4 rows */
+static bool gather_scatter_check(const int engine_num, const int step_num, const int max_wait_us)
+{
+  const int hidden = 16;
+  const int vocab = 50;
+  std::vector<float> embedding(hidden * vocab);
+  for(int i = 0; i < hidden * vocab; i++)
+    embedding[i] = (float)((i * 7919) % 101) / 101.0f - 0.5f;
+
+  StepAggregatorConfig config;
+  config.max_rows = 4 * engine_num;
+  config.max_wait_us = max_wait_us;
+  std::vector<float> combined(config.max_rows * hidden);
+  std::vector<int> combined_ids(config.max_rows);
+  std::atomic<bool> valid(true);
+  StepAggregator<HostPart> aggregator(config,
+      [&](const std::vector<HostPart> &parts, const std::vector<int> &offsets, const int rows) {
+        // gather, one GEMM for the batch, scatter
+        int next = 0;
+        for(size_t i = 0; i < parts.size(); i++)
+        {
+          const int part_rows = (i + 1 < parts.size() ? offsets[i + 1] : rows) - offsets[i];
+          valid = valid && offsets[i] == next && part_rows > 0;
+          next += part_rows;
+          std::copy(parts[i].normed, parts[i].normed + part_rows * hidden, combined.begin() + offsets[i] * hidden);
+        }
+        valid = valid && next == rows && rows <= config.max_rows;
+        greedy_logits(combined.data(), embedding.data(), rows, hidden, vocab, combined_ids.data());
+        for(size_t i = 0; i < parts.size(); i++)
+        {
+          const int part_rows = (i + 1 < parts.size() ? offsets[i + 1] : rows) - offsets[i];
+          std::copy(combined_ids.begin() + offsets[i], combined_ids.begin() + offsets[i] + part_rows, parts[i].ids);
+        }
+      });
+
+  std::vector<std::vector<int>> aggregated(engine_num), alone(engine_num);
+  std::vector<std::thread> threads;
+  for(int e = 0; e < engine_num; e++)
+    aggregator.join();
+  for(int e = 0; e < engine_num; e++)
+  {
+    threads.push_back(std::thread([&, e]() {
+      std::vector<float> normed(4 * hidden);
+      std::vector<int> ids(4);
+      for(int step = 0; step < step_num; step++)
+      {
+        const int rows = 1 + (e + step) % 4;
+        for(int r = 0; r < rows; r++)
+          for(int h = 0; h < hidden; h++)
+            normed[r * hidden + h] = value(e, step, r, h);
+        HostPart part = {normed.data(), ids.data(), e};
+        aggregator.submit(part, rows);
+        aggregated[e].insert(aggregated[e].end(), ids.begin(), ids.begin() + rows);
+
+        greedy_logits(normed.data(), embedding.data(), rows, hidden, vocab, ids.data());
+        alone[e].insert(alone[e].end(), ids.begin(), ids.begin() + rows);
+      }
+      aggregator.leave();
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  bool ok = valid;
+  for(int e = 0; e < engine_num; e++)
+    ok &= aggregated[e] == alone[e];
+  const StepAggregatorStats stats = aggregator.stats();
+  ok &= stats.parts == (long long)engine_num * step_num;
+  printf("[INFO] %d engines, %d steps: %lld parts in %lld batches (%.2f parts per batch, %lld with every engine) \n",
+         engine_num, step_num, stats.parts, stats.batches, (double)stats.parts / stats.batches, stats.full_batches);
+  return check_result("gather and scatter", ok);
+}
+
+/* an engine that joined and does not submit delays the others by max_wait_us only */
+static bool idle_engine_check()
+{
+  StepAggregatorConfig config;
+  config.max_rows = 8;
+  config.max_wait_us = 1000;
+  std::atomic<int> flushes(0);
+  StepAggregator<int> aggregator(config, [&](const std::vector<int> &, const std::vector<int> &, const int) {
+    flushes++;
+  });
+  aggregator.join();   // the idle engine
+  aggregator.join();
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const int steps = 20;
+  for(int step = 0; step < steps; step++)
+    aggregator.submit(step, 2);
+  const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  aggregator.leave();
+  aggregator.leave();
+  printf("[INFO] %d steps next to an idle engine in %.1f ms \n", steps, ms);
+  return check_result("idle engine", flushes == steps && ms >= steps * config.max_wait_us / 1000.0);
+}
+
+/* the batch is closed before a part that does not fit, a full batch is flushed at once */
+static bool max_rows_check()
+{
+  StepAggregatorConfig config;
+  config.max_rows = 6;
+  config.max_wait_us = 200000;
+  std::vector<std::vector<int>> batches;
+  StepAggregator<int> aggregator(config, [&](const std::vector<int> &parts, const std::vector<int> &offsets, const int rows) {
+    std::vector<int> batch(parts);
+    batch.push_back(rows);
+    batches.push_back(batch);
+  });
+  for(int e = 0; e < 3; e++)
+    aggregator.join();
+  std::vector<int> offsets(3, -1);
+  std::vector<std::thread> threads;
+  for(int e = 0; e < 3; e++)
+  {
+    threads.push_back(std::thread([&, e]() {
+      // 4 rows each, the engines submit one after the other
+      std::this_thread::sleep_for(std::chrono::milliseconds(20 * e));
+      offsets[e] = aggregator.submit(e, 4);
+      aggregator.leave();
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  // a part never fits next to another one, the last batch is closed when engine 1 leaves
+  bool ok = batches.size() == 3 && batches[0] == std::vector<int>({0, 4}) && batches[1] == std::vector<int>({1, 4}) &&
+            batches[2] == std::vector<int>({2, 4});
+  ok &= offsets == std::vector<int>({0, 0, 0});
+  return check_result("max rows", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 4)
+  {
+    printf("[ERROR] step_aggregator_sample engine_num step_num max_wait_us \n");
+    printf("e.g., ./bin/step_aggregator_sample 8 200 200\n");
+    return 0;
+  }
+  const int engine_num = atoi(argv[1]);
+  const int step_num = atoi(argv[2]);
+  const int max_wait_us = atoi(argv[3]);
+
+  bool pass = gather_scatter_check(engine_num, step_num, max_wait_us);
+  pass &= gather_scatter_check(engine_num, step_num, 0);
+  pass &= idle_engine_check();
+  pass &= max_rows_check();
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Stress checks of the host thread pool and of the host stages
+ *
+ * Several threads push many small task groups at once, task groups and
+ * parallel_for are nested inside the tasks, every index of parallel_for is
+ * checked to run once and the exceptions of the tasks to reach the waiting
+ * thread. The host stages are compared with serial versions of the kernels
+ * and of the former host loops, and the time of the weight quantization is
+ * printed with and without the pool.
+ **/
+
+#include "fastertransformer/thread_pool.h"
+#include "fastertransformer/host_processing.h"
+#include "fastertransformer/weight_quantization.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] thread pool %s check. \n", name);
+  else
+    printf("[ERROR] thread pool %s fail \n", name);
+  return ok;
+}
+
+static double now_ms()
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* threads outside of the pool run task groups of tiny tasks and futures at the same time */
+static bool task_check(ThreadPool &pool)
+{
+  const int caller_num = 4;
+  const int group_num = 200;
+  const int task_num = 100;
+  std::atomic<long long> sum(0);
+  std::atomic<int> bad_futures(0);
+  std::vector<std::thread> callers;
+  for(int c = 0; c < caller_num; c++)
+  {
+    callers.push_back(std::thread([&pool, &sum, &bad_futures, c]() {
+      for(int g = 0; g < group_num; g++)
+      {
+        TaskGroup group(pool);
+        for(int t = 0; t < task_num; t++)
+          group.run([&sum, t]() { sum.fetch_add(t); });
+        std::future<int> future = pool.submit([c, g]() { return c * group_num + g; });
+        group.wait();
+        if(future.get() != c * group_num + g)
+          bad_futures.fetch_add(1);
+      }
+    }));
+  }
+  for(size_t c = 0; c < callers.size(); c++)
+    callers[c].join();
+  const long long expected = (long long)caller_num * group_num * (task_num * (task_num - 1) / 2);
+  return check_result("concurrent task groups", sum.load() == expected && bad_futures.load() == 0);
+}
+
+/* a binary tree of task groups, every task waits for its children */
+static void spawn_tree(ThreadPool &pool, const int depth, std::atomic<int> &leaves)
+{
+  if(depth == 0)
+  {
+    leaves.fetch_add(1);
+    return;
+  }
+  TaskGroup group(pool);
+  group.run([&pool, depth, &leaves]() { spawn_tree(pool, depth - 1, leaves); });
+  group.run([&pool, depth, &leaves]() { spawn_tree(pool, depth - 1, leaves); });
+  group.wait();
+}
+
+static bool nested_check(ThreadPool &pool)
+{
+  const int outer = 64;
+  const int inner = 1000;
+  std::vector<long long> sums(outer, 0);
+  parallel_for(0, outer, 1, [&](const int begin, const int end) {
+    for(int i = begin; i < end; i++)
+    {
+      std::atomic<long long> sum(0);
+      parallel_for(0, inner, 10, [&sum, i](const int b, const int e) {
+        long long local = 0;
+        for(int j = b; j < e; j++)
+          local += (long long)i * j;
+        sum.fetch_add(local);
+      }, pool);
+      sums[i] = sum.load();
+    }
+  }, pool);
+  bool ok = true;
+  for(int i = 0; i < outer; i++)
+    ok &= sums[i] == (long long)i * inner * (inner - 1) / 2;
+
+  std::atomic<int> leaves(0);
+  spawn_tree(pool, 12, leaves);
+  ok &= leaves.load() == 1 << 12;
+  return check_result("nested groups", ok);
+}
+
+static bool coverage_check(ThreadPool &pool)
+{
+  const int sizes[] = {0, 1, 7, 1000, 100003};
+  const int grains[] = {0, 1, 13, 1000, 1 << 20};
+  bool ok = true;
+  for(int s = 0; s < 5; s++)
+  {
+    for(int g = 0; g < 5; g++)
+    {
+      std::vector<std::atomic<int>> visits(sizes[s] + 2);
+      for(size_t i = 0; i < visits.size(); i++)
+        visits[i].store(0);
+      // the range is shifted by one so that the indices out of it can be seen
+      parallel_for(1, sizes[s] + 1, grains[g], [&visits](const int begin, const int end) {
+        for(int i = begin; i < end; i++)
+          visits[i].fetch_add(1);
+      }, pool);
+      for(size_t i = 0; i < visits.size(); i++)
+        ok &= visits[i].load() == ((i >= 1 && (int)i <= sizes[s]) ? 1 : 0);
+    }
+  }
+  return check_result("parallel_for coverage", ok);
+}
+
+static bool exception_check(ThreadPool &pool)
+{
+  bool ok = true;
+  std::atomic<int> done(0);
+  {
+    TaskGroup group(pool);
+    for(int t = 0; t < 100; t++)
+    {
+      group.run([&done, t]() {
+        if(t % 37 == 5)
+          throw std::runtime_error("task " + std::to_string(t));
+        done.fetch_add(1);
+      });
+    }
+    bool caught = false;
+    try
+    {
+      group.wait();
+    }
+    catch(std::runtime_error &error)
+    {
+      caught = std::string(error.what()).compare(0, 5, "task ") == 0;
+    }
+    // the other tasks still run, and the group can be used again
+    ok &= caught && done.load() == 97;
+    group.run([&done]() { done.fetch_add(1); });
+    group.wait();
+    ok &= done.load() == 98;
+  }
+
+  bool caught = false;
+  try
+  {
+    parallel_for(0, 1000, 1, [](const int begin, const int end) {
+      if(begin <= 500 && 500 < end)
+        throw std::runtime_error("index 500");
+    }, pool);
+  }
+  catch(std::runtime_error &error)
+  {
+    caught = std::string(error.what()) == "index 500";
+  }
+  ok &= caught;
+
+  std::future<int> future = pool.submit([]() -> int { throw std::runtime_error("future"); });
+  caught = false;
+  try
+  {
+    future.get();
+  }
+  catch(std::runtime_error &error)
+  {
+    caught = std::string(error.what()) == "future";
+  }
+  ok &= caught;
+  return check_result("exceptions", ok);
+}
+
+/* build_sequence_length_padding_offset of cuda_kernels.cu */
+static int padding_offset_reference(const int *sequence_length, const int batch_size, const int max_seq_len,
+                                    int *tmp_mask_offset)
+{
+  int total_seq_len = 0;
+  int cum_offset = 0;
+  int index = 0;
+  for(int i = 0; i < batch_size; i++)
+  {
+    const int seq_len = sequence_length[i];
+    for(int j = 0; j < seq_len; j++)
+    {
+      tmp_mask_offset[index] = cum_offset;
+      index++;
+    }
+    cum_offset += max_seq_len - seq_len;
+    total_seq_len += seq_len;
+  }
+  return total_seq_len;
+}
+
+/* gather_tree_kernel of decoding_kernels.cu */
+static void gather_tree_reference(const int max_time, const int batch_size, const int beam_width, const int *step_ids,
+                                  const int *parent_ids, const int *max_sequence_lengths, const int end_token, int *beams)
+{
+  for(int i = 0; i < batch_size * beam_width; i++)
+  {
+    const int batch = i / beam_width;
+    const int beam = i % beam_width;
+    const int max_seq_len_b = std::min(max_time, max_sequence_lengths[batch]);
+    if(max_seq_len_b <= 0)
+      continue;
+#define GET_IX(time_ix, beam_ix) (batch_size * beam_width * (time_ix) + beam_width * batch + (beam_ix))
+    const int initial_beam_ix = GET_IX(max_seq_len_b - 1, beam);
+    beams[initial_beam_ix] = step_ids[initial_beam_ix];
+    int parent = parent_ids[initial_beam_ix] % beam_width;
+    bool found_bad = false;
+    for(int level = max_seq_len_b - 2; level >= 0; --level)
+    {
+      const int level_beam_ix = GET_IX(level, beam);
+      const int level_parent_ix = GET_IX(level, parent);
+      if(parent < 0 || parent > beam_width)
+      {
+        beams[level_beam_ix] = -1;
+        parent = -1;
+        found_bad = true;
+      }
+      else
+      {
+        beams[level_beam_ix] = step_ids[level_parent_ix];
+        parent = parent_ids[level_parent_ix] % beam_width;
+      }
+    }
+    if(!found_bad)
+    {
+      bool finished = false;
+      for(int time = 0; time < max_seq_len_b; ++time)
+      {
+        const int level_beam_ix = GET_IX(time, beam);
+        if(finished)
+          beams[level_beam_ix] = end_token;
+        else if(beams[level_beam_ix] == end_token)
+          finished = true;
+      }
+    }
+#undef GET_IX
+  }
+}
+
+/* the serial quantization loop the ops used before */
+template <typename Index>
+static void quantization_reference(int8_t *dst, const float *amaxs, const float *weight, const int n, const int k,
+                                   Index index)
+{
+  for(int col = 0; col < k; col++)
+    for(int row = 0; row < n; row++)
+      dst[index(col, row, 32 * n)] = float_to_int8_rn_host(weight[col * n + row] * 127.0 / amaxs[row]);
+}
+
+static bool host_stage_check(ThreadPool &pool)
+{
+  bool ok = true;
+
+  // offsets of the encoder
+  const int batch_size = 257;
+  const int max_seq_len = 128;
+  std::vector<int> sequence_length(batch_size);
+  for(int i = 0; i < batch_size; i++)
+    sequence_length[i] = rand() % (max_seq_len + 1);
+  std::vector<int> offset(batch_size * max_seq_len, -1), offset_ref(batch_size * max_seq_len, -1);
+  const int valid_word_num = build_padding_offset_host(sequence_length.data(), batch_size, max_seq_len, offset.data(), pool);
+  ok &= valid_word_num == padding_offset_reference(sequence_length.data(), batch_size, max_seq_len, offset_ref.data());
+  ok &= offset == offset_ref;
+
+  std::vector<int> trt(2 * batch_size + 1), trt_ref(2 * batch_size + 1);
+  ok &= build_trt_seqlen_offset_host(sequence_length.data(), batch_size, max_seq_len, true, trt.data()) == batch_size + 1;
+  trt_ref[0] = 0;
+  for(int i = 1; i < batch_size + 1; i++)
+    trt_ref[i] = trt_ref[i - 1] + sequence_length[i - 1];
+  ok &= std::equal(trt.begin(), trt.begin() + batch_size + 1, trt_ref.begin());
+  ok &= build_trt_seqlen_offset_host(sequence_length.data(), batch_size, max_seq_len, false, trt.data()) == 2 * batch_size + 1;
+  for(int i = 1; i < 2 * batch_size + 1; i++)
+    trt_ref[i] = i % 2 == 1 ? trt_ref[i - 1] + sequence_length[(i - 1) / 2] : max_seq_len * (i / 2);
+  ok &= trt == trt_ref;
+  ok &= check_result("encoder offsets", ok);
+
+  // start ids of GPT-2, [batch_size, start_len] to [start_len, batch_size]
+  const int start_len = 333;
+  std::vector<int> start_ids(batch_size * start_len), transposed(batch_size * start_len);
+  for(size_t i = 0; i < start_ids.size(); i++)
+    start_ids[i] = rand();
+  transpose_host(start_ids.data(), batch_size, start_len, transposed.data(), pool);
+  bool transpose_ok = true;
+  for(int i = 0; i < start_len; i++)
+    for(int j = 0; j < batch_size; j++)
+      transpose_ok &= transposed[i * batch_size + j] == start_ids[j * start_len + i];
+  ok &= check_result("transpose", transpose_ok);
+
+  // gather_tree with finished beams, broken parents and short sentences
+  const int max_time = 50;
+  const int beam_width = 4;
+  const int end_token = 7;
+  const int size = max_time * batch_size * beam_width;
+  std::vector<int> step_ids(size), parent_ids(size), max_lengths(batch_size);
+  for(int i = 0; i < size; i++)
+  {
+    step_ids[i] = rand() % 32;
+    parent_ids[i] = rand() % 1000 == 0 ? -beam_width - 1 : rand() % beam_width;
+  }
+  for(int i = 0; i < batch_size; i++)
+    max_lengths[i] = rand() % (max_time + 10) - 5;
+  std::vector<int> beams(size, -7), beams_ref(size, -7);
+  gather_tree_host(max_time, batch_size, beam_width, step_ids.data(), parent_ids.data(), max_lengths.data(), end_token,
+                   beams.data(), pool);
+  gather_tree_reference(max_time, batch_size, beam_width, step_ids.data(), parent_ids.data(), max_lengths.data(),
+                        end_token, beams_ref.data());
+  ok &= check_result("gather_tree", beams == beams_ref);
+
+  // a callback per sentence, the way a detokenizer is run
+  std::vector<std::string> texts(batch_size * beam_width);
+  for_each_sentence(beams_ref.data(), max_time, batch_size * beam_width, end_token,
+                    [&texts](const int sentence, const int *ids, const int length) {
+                      for(int t = 0; t < length; t++)
+                        texts[sentence] += std::to_string(ids[t]) + " ";
+                    }, pool);
+  bool sentence_ok = true;
+  for(int s = 0; s < batch_size * beam_width; s++)
+  {
+    std::string text;
+    for(int t = 0; t < max_time && beams_ref[t * batch_size * beam_width + s] != end_token; t++)
+      text += std::to_string(beams_ref[t * batch_size * beam_width + s]) + " ";
+    sentence_ok &= text == texts[s];
+  }
+  ok &= check_result("sentence callbacks", sentence_ok);
+
+  // weight quantization in both layouts
+  const int n = 96;
+  const int k = 160;
+  std::vector<float> weight(n * k), quant_max(n), quant_min(n), amaxs(n);
+  for(int i = 0; i < n * k; i++)
+    weight[i] = rand() / (float)RAND_MAX * 4.0f - 2.0f;
+  for(int i = 0; i < n; i++)
+  {
+    quant_max[i] = 1.0f + rand() / (float)RAND_MAX;
+    quant_min[i] = -1.0f - rand() / (float)RAND_MAX;
+  }
+  bool quantize_ok = true;
+  for(int per_channel = 0; per_channel < 2; per_channel++)
+  {
+    std::vector<float> out(n * k / 4), out_ref(n * k / 4);
+    quantization_CUBLASLT_ORDER_COL4_4R2_8C(out.data(), amaxs.data(), weight.data(), quant_max.data(), quant_min.data(),
+                                            n, k, per_channel == 1, pool);
+    quantization_reference((int8_t *)out_ref.data(), amaxs.data(), weight.data(), n, k, index_CUBLASLT_ORDER_COL4_4R2_8C);
+    quantize_ok &= memcmp(out.data(), out_ref.data(), n * k) == 0;
+    quantization_CUBLASLT_ORDER_COL32_2R_4R4(out.data(), amaxs.data(), weight.data(), quant_max.data(), quant_min.data(),
+                                             n, k, per_channel == 1, pool);
+    quantization_reference((int8_t *)out_ref.data(), amaxs.data(), weight.data(), n, k, index_CUBLASLT_ORDER_COL32_2R_4R4);
+    quantize_ok &= memcmp(out.data(), out_ref.data(), n * k) == 0;
+  }
+  ok &= check_result("weight quantization", quantize_ok);
+  return ok;
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 2)
+  {
+    printf("[ERROR] thread_pool_sample thread_num \n");
+    printf("e.g., ./bin/thread_pool_sample 8\n");
+    return 0;
+  }
+  const int thread_num = atoi(argv[1]);
+  srand(0);
+
+  ThreadPool pool(thread_num);
+  bool pass = task_check(pool);
+  pass &= nested_check(pool);
+  pass &= coverage_check(pool);
+  pass &= exception_check(pool);
+  pass &= host_stage_check(pool);
+
+  // the quantization of a 4096 x 4096 weight, serial and on the pool
+  {
+    const int n = 4096;
+    const int k = 4096;
+    std::vector<float> weight(n * k), quant_max(1, 2.0f), quant_min(1, -2.0f), amaxs(n), out(n * k / 4);
+    for(int i = 0; i < n * k; i++)
+      weight[i] = (i % 401) / 100.0f - 2.0f;
+    quantization_amaxs(amaxs.data(), quant_max.data(), quant_min.data(), n, false);
+    double start = now_ms();
+    quantization_reference((int8_t *)out.data(), amaxs.data(), weight.data(), n, k, index_CUBLASLT_ORDER_COL32_2R_4R4);
+    const double serial_ms = now_ms() - start;
+    start = now_ms();
+    quantization_CUBLASLT_ORDER_COL32_2R_4R4(out.data(), amaxs.data(), weight.data(), quant_max.data(), quant_min.data(),
+                                             n, k, false, pool);
+    const double pool_ms = now_ms() - start;
+    printf("[INFO] quantization serial %.2f ms, %d threads %.2f ms, %lld steals \n", serial_ms, thread_num, pool_ms,
+           pool.steal_count());
+  }
+  return pass ? 0 : -1;
+}
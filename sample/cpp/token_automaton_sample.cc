@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the token automata of the constrained decoding on the host
+ *
+ * A trie of token sequences and an automaton lowered from bytes are walked
+ * token by token and compared with the states found by hand, a token without
+ * transition leads to the dead state that only allows end_id. Then random
+ * automata are compiled and random walks compare the lookups of the compiled
+ * table, the ones of the kernels, with the ones of TokenAutomaton.
+ **/
+
+#include "fastertransformer/token_automaton.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] token automaton %s check. \n", name);
+  else
+    printf("[ERROR] token automaton %s fail \n", name);
+  return ok;
+}
+
+/* the lookups of the table agree with the automaton for all the states and tokens */
+static bool same_lookups(const TokenAutomaton &automaton, const TokenAutomatonTable &table)
+{
+  bool ok = table.num_states == automaton.num_states() && (int)table.tokens.size() == automaton.num_transitions();
+  for(int s = -1; s < automaton.num_states() && ok; s++)
+  {
+    const int state = s < 0 ? TOKEN_AUTOMATON_DEAD_STATE : s;
+    for(int t = 0; t < automaton.vocab_size(); t++)
+      ok &= table.is_allowed(state, t) == automaton.is_allowed(state, t) &&
+            table.next(state, t) == automaton.next(state, t);
+  }
+  return ok;
+}
+
+static bool sequence_check()
+{
+  const int end_id = 0;
+  TokenAutomaton automaton(16, end_id);
+  const int root = automaton.add_sequences({{3, 4, 5}, {3, 6}, {7}});
+  const TokenAutomatonTable table = automaton.compile();
+
+  // root, 3, 3 4, 3 4 5, 3 6 and 7 are the 6 states, the end of a sequence is accepting
+  bool ok = root == 0 && automaton.num_states() == 6 && automaton.num_transitions() == 5;
+  const int s345 = automaton.walk(root, {3, 4, 5});
+  ok &= s345 >= 0 && automaton.is_allowed(s345, end_id) && !automaton.is_allowed(s345, 5);
+  ok &= !automaton.is_allowed(automaton.walk(root, {3, 4}), end_id) && automaton.is_allowed(root, 3) &&
+        automaton.is_allowed(root, 7) && !automaton.is_allowed(root, 4) && !automaton.is_allowed(root, end_id);
+
+  // end_id keeps the state, a token without transition leads to the dead state which only allows end_id
+  ok &= automaton.next(s345, end_id) == s345 && table.next(s345, end_id) == s345;
+  ok &= automaton.walk(root, {3, 9}) == TOKEN_AUTOMATON_DEAD_STATE &&
+        automaton.walk(root, {3, 4, 5, 5}) == TOKEN_AUTOMATON_DEAD_STATE;
+  ok &= automaton.walk(root, {3, 9, 4, end_id, 5}) == TOKEN_AUTOMATON_DEAD_STATE &&
+        automaton.is_allowed(TOKEN_AUTOMATON_DEAD_STATE, end_id) &&
+        !automaton.is_allowed(TOKEN_AUTOMATON_DEAD_STATE, 3);
+  ok &= same_lookups(automaton, table);
+
+  // an allow-list loops on its tokens
+  const int list = automaton.add_allow_list({8, 9});
+  ok &= automaton.walk(list, {8, 9, 9, 8}) == list && automaton.is_allowed(list, end_id) &&
+        automaton.next(list, 3) == TOKEN_AUTOMATON_DEAD_STATE;
+  ok &= same_lookups(automaton, automaton.compile());
+  return check_result("sequence", ok);
+}
+
+/* digits then a '.' then digits: "1" "23" "4." ".5" "." "a" "1a" over the byte automaton of [0-9]+\.[0-9]+ */
+static bool byte_check()
+{
+  ByteAutomaton bytes;
+  const int start = bytes.add_state();
+  const int integer = bytes.add_state();
+  const int dot = bytes.add_state();
+  const int fraction = bytes.add_state(true);
+  const int unreachable = bytes.add_state();
+  bytes.add_transition(start, '0', '9', integer);
+  bytes.add_transition(integer, '0', '9', integer);
+  bytes.add_transition(integer, '.', dot);
+  bytes.add_transition(dot, '0', '9', fraction);
+  bytes.add_transition(fraction, '0', '9', fraction);
+  bytes.add_transition(unreachable, 'a', unreachable);
+
+  const int end_id = 0;
+  const std::vector<std::string> vocab = {"", "1", "23", "4.", ".5", ".", "a", "1a"};
+  const TokenAutomaton automaton = compile_token_automaton(bytes, start, vocab, end_id);
+  const TokenAutomatonTable table = automaton.compile();
+
+  // the token states are start, integer, dot and fraction, the dead byte state is not lowered
+  bool ok = automaton.num_states() == 4 && !bytes.live_states()[unreachable];
+  const int s_integer = automaton.next(0, 1);
+  ok &= s_integer > 0 && automaton.next(0, 2) == s_integer && automaton.next(s_integer, 2) == s_integer;
+  ok &= !automaton.is_allowed(0, 4) && !automaton.is_allowed(0, 5) && !automaton.is_allowed(0, 6) &&
+        !automaton.is_allowed(0, 7) && !automaton.is_allowed(0, end_id);
+
+  // "4." and "." both lead to the dot, ".5" jumps to the fraction
+  const int s_fraction = automaton.walk(0, {2, 4});
+  ok &= automaton.walk(0, {1, 5, 1}) == s_fraction && automaton.walk(0, {3, 2}) == s_fraction &&
+        automaton.is_allowed(s_fraction, end_id) && !automaton.is_allowed(automaton.walk(0, {3}), end_id);
+  ok &= automaton.walk(0, {2, 4, 5}) == TOKEN_AUTOMATON_DEAD_STATE && automaton.walk(0, {7}) == TOKEN_AUTOMATON_DEAD_STATE;
+  ok &= same_lookups(automaton, table);
+  return check_result("byte", ok);
+}
+
+static bool random_check()
+{
+  bool ok = true;
+  srand(29);
+  for(int iter = 0; iter < 200; iter++)
+  {
+    const int vocab_size = 1 + rand() % 100;
+    const int end_id = rand() % vocab_size;
+    TokenAutomaton automaton(vocab_size, end_id);
+    const int num_states = 1 + rand() % 12;
+    for(int s = 0; s < num_states; s++)
+      automaton.add_state(rand() % 3 == 0);
+    for(int s = 0; s < num_states; s++)
+    {
+      const int transition_num = rand() % 6;
+      int added = 0;
+      for(int i = 0; i < transition_num; i++)
+      {
+        const int token = rand() % vocab_size;
+        if(token != end_id && automaton.next(s, token) == TOKEN_AUTOMATON_DEAD_STATE)
+        {
+          automaton.add_transition(s, token, rand() % num_states);
+          added++;
+        }
+      }
+      // compile() needs every state to allow a token
+      if(added == 0)
+        automaton.set_accepting(s);
+    }
+    const TokenAutomatonTable table = automaton.compile();
+    ok &= same_lookups(automaton, table) && (int)table.offsets.size() == num_states + 1;
+    for(int s = 0; s < num_states; s++)
+      for(int i = table.offsets[s] + 1; i < table.offsets[s + 1]; i++)
+        ok &= table.tokens[i - 1] < table.tokens[i];
+
+    // random walks, mostly on allowed tokens, follow the same states in the table
+    for(int walk = 0; walk < 20; walk++)
+    {
+      const int start = rand() % num_states;
+      int state = start, table_state = start;
+      std::vector<int> tokens;
+      for(int step = 0; step < 16; step++)
+      {
+        int token = rand() % vocab_size;
+        for(int retry = 0; retry < 8 && rand() % 8 != 0 && !automaton.is_allowed(state, token); retry++)
+          token = rand() % vocab_size;
+        tokens.push_back(token);
+        const int next = automaton.next(state, token);
+        if(token == end_id)
+          ok &= next == state;
+        else if(automaton.is_allowed(state, token))
+          ok &= next >= 0 && next < num_states;
+        else
+          ok &= next == TOKEN_AUTOMATON_DEAD_STATE;
+        state = next;
+        table_state = table.next(table_state, token);
+        ok &= table_state == state;
+      }
+      ok &= automaton.walk(start, tokens) == state;
+    }
+  }
+  return check_result("random", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = sequence_check();
+  pass &= byte_check();
+  pass &= random_check();
+  return pass ? 0 : -1;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * Checks of the static workspace planner on the host
+ *
+ * The offsets of a small plan are compared with the ones computed by hand,
+ * buffers whose live ranges do not intersect share memory and the offsets
+ * follow the alignment. Then random plans are checked against a reference of
+ * the overlaps, and the plans of OpenDecoder and BertEncoderTransformer are
+ * compared with their hand-written layouts.
+ **/
+
+#include "fastertransformer/memory_planner.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fastertransformer;
+
+static bool check_result(const char *name, const bool ok)
+{
+  if(ok)
+    printf("[INFO] workspace planner %s check. \n", name);
+  else
+    printf("[ERROR] workspace planner %s fail \n", name);
+  return ok;
+}
+
+static size_t round_up(const size_t bytes, const size_t alignment)
+{
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+static bool offset_check()
+{
+  // a [0, 1] at 0, c [1, 2] after a, b [2, 3] only meets c and goes before it
+  WorkspacePlanner planner;
+  const int a = planner.add("a", 1000, 0, 1);
+  const int b = planner.add("b", 300, 2, 3);
+  const int c = planner.add<float>("c", 150, 1, 2);
+  planner.plan();
+  bool ok = planner.offset(a) == 0 && planner.offset(c) == 1024 && planner.offset(b) == 0;
+  ok &= planner.total_bytes() == 1024 + 768 && planner.unshared_bytes() == 1024 + 512 + 768;
+
+  // the same size, the earlier one is placed first and a later one fills the gap of a dead one
+  WorkspacePlanner tie;
+  const int x = tie.add("x", 256, 1, 2);
+  const int y = tie.add("y", 256, 0, 1);
+  const int z = tie.add("z", 256, 2, 2);
+  tie.plan();
+  ok &= tie.offset(y) == 0 && tie.offset(x) == 256 && tie.offset(z) == 0 && tie.total_bytes() == 512;
+
+  char base[1];
+  ok &= tie.get<char>(base, x) == base + 256 && planner.get<float>(base, c) == (float *)(base + 1024);
+  ok &= planner.validate() && tie.validate();
+  return check_result("offset", ok);
+}
+
+static bool alignment_check()
+{
+  WorkspacePlanner planner(64);
+  const int a = planner.add("a", 1, 0, 0);
+  const int b = planner.add("b", 65, 0, 0);
+  const int c = planner.add("c", 0, 0, 0);
+  const int d = planner.add("d", 64, 0, 0);
+  planner.plan();
+  // b [0, 65) takes 128 bytes, d and a follow, an empty buffer gets any aligned offset
+  bool ok = planner.offset(b) == 0 && planner.offset(d) == 128 && planner.offset(a) == 192;
+  ok &= planner.offset(c) % 64 == 0 && planner.total_bytes() == 256 && planner.validate();
+  return check_result("alignment", ok);
+}
+
+/* buffers live in disjoint stages all start at 0, the workspace is the largest of them */
+static bool overlap_check()
+{
+  WorkspacePlanner planner;
+  std::vector<int> ids;
+  for(int stage = 0; stage < 6; stage++)
+    ids.push_back(planner.add("stage", 1000 * (stage + 1), stage, stage));
+  planner.plan();
+  bool ok = planner.total_bytes() == round_up(6000, WORKSPACE_ALIGNMENT);
+  for(size_t i = 0; i < ids.size(); i++)
+    ok &= planner.offset(ids[i]) == 0;
+
+  // one buffer live for all the stages pushes all the others after it
+  WorkspacePlanner shared;
+  const int whole = shared.add("whole", 10000, 0, 5);
+  for(int stage = 0; stage < 6; stage++)
+    ids[stage] = shared.add("stage", 1000, stage, stage);
+  shared.plan();
+  ok &= shared.offset(whole) == 0 && shared.total_bytes() == round_up(10000, WORKSPACE_ALIGNMENT) + 1024;
+  for(size_t i = 0; i < ids.size(); i++)
+    ok &= shared.offset(ids[i]) == round_up(10000, WORKSPACE_ALIGNMENT);
+  return check_result("overlap", ok);
+}
+
+static bool random_check()
+{
+  bool ok = true;
+  srand(23);
+  for(int iter = 0; iter < 500; iter++)
+  {
+    const size_t alignment = (size_t)1 << (rand() % 9);
+    WorkspacePlanner planner(alignment);
+    std::vector<WorkspaceTensor> tensors(1 + rand() % 24);
+    for(size_t i = 0; i < tensors.size(); i++)
+    {
+      tensors[i].bytes = rand() % 5000;
+      tensors[i].first_use = rand() % 8;
+      tensors[i].last_use = tensors[i].first_use + rand() % 4;
+      planner.add("tensor", tensors[i].bytes, tensors[i].first_use, tensors[i].last_use);
+    }
+    planner.plan();
+    ok &= planner.validate() && planner.total_bytes() % alignment == 0 &&
+          planner.total_bytes() <= planner.unshared_bytes();
+    for(size_t i = 0; i < tensors.size(); i++)
+    {
+      const size_t a = planner.offset((int)i);
+      ok &= a % alignment == 0 && a + tensors[i].bytes <= planner.total_bytes();
+      for(size_t j = 0; j < i; j++)
+      {
+        const size_t b = planner.offset((int)j);
+        const bool live_together = tensors[i].first_use <= tensors[j].last_use &&
+                                   tensors[j].first_use <= tensors[i].last_use;
+        if(live_together && tensors[i].bytes > 0 && tensors[j].bytes > 0)
+          ok &= a + tensors[i].bytes <= b || b + tensors[j].bytes <= a;
+      }
+    }
+  }
+  return check_result("random", ok);
+}
+
+static bool layer_check()
+{
+  // the encoder FFN inner buffer reuses attr_out, attr_matmul stays live for the residual
+  const size_t ts = sizeof(float), m = 8 * 32, n = 768;
+  WorkspacePlanner encoder;
+  plan_encoder_workspace(encoder, ts, m, n);
+  bool ok = encoder.offset(0) == encoder.offset(2) && encoder.offset(1) == ts * 4 * m * n &&
+            encoder.total_bytes() == ts * 5 * m * n && ts * 9 * m * n > encoder.total_bytes();
+
+  // the decoder fits in less than the 13 * buf_size of the hand-written layout
+  const int batch_size = 16, hidden_units = 512;
+  WorkspacePlanner decoder;
+  plan_decoder_workspace(decoder, ts, batch_size, hidden_units);
+  ok &= decoder.total_bytes() < ts * 13 * batch_size * hidden_units &&
+        decoder_workspace_bytes(ts, batch_size, hidden_units) >= decoder.total_bytes();
+  printf("[INFO] encoder %zu of %zu bytes, decoder %zu of %zu bytes without sharing \n", encoder.total_bytes(),
+         encoder.unshared_bytes(), decoder.total_bytes(), decoder.unshared_bytes());
+  return check_result("layer", ok);
+}
+
+int main(int argc, char* argv[])
+{
+  bool pass = offset_check();
+  pass &= alignment_check();
+  pass &= overlap_check();
+  pass &= random_check();
+  pass &= layer_check();
+  return pass ? 0 : -1;
+}
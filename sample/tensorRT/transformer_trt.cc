@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 #include "fastertransformer/trt_plugin/trt_model.h"
+#include "fastertransformer/engine_bucket_cache.h"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cuda_profiler_api.h>
 #include <iostream>
 #include <sys/time.h>
@@ -34,8 +36,93 @@ void host_malloc(T** ptr, int size)
 }
 
 
+/* the hash of the weights and the shapes, an engine of the cache is reused only for the same model */
 template <typename T>
-void run_bert_transformer(int batch_size, int seq_len, int layers, int head_num, int size_per_head){
+uint64_t model_hash(const std::vector<std::vector<T *> > &params, int head_num, int hidden_dim)
+{
+  int shape[4] = {(int)params.size(), head_num, hidden_dim, (int)sizeof(T)};
+  uint64_t hash = fnv1a_hash(shape, sizeof(shape));
+  for(size_t i = 0; i < params.size(); ++i)
+    for(int j = 0; j < 16; ++j)
+      hash = fnv1a_hash(params[i][j], TransformerPlugin<T>::weight_count(j, hidden_dim) * sizeof(T), hash);
+  return hash;
+}
+
+/* requests of several shapes, each one padded to the smallest engine that holds it */
+template <typename T>
+void run_bucketed_transformer(std::vector<std::vector<T *> > &params, int max_batch_size, int max_seq_len,
+                              int layers, int head_num, int hidden_dim, const char *cache_dir)
+{
+  int device_id;
+  cudaDeviceProp prop;
+  check_cuda_error(cudaGetDevice(&device_id));
+  check_cuda_error(cudaGetDeviceProperties(&prop, device_id));
+
+  EngineBuckets buckets(power_of_two_buckets(1, max_batch_size),
+                        power_of_two_buckets(max_seq_len < 16 ? max_seq_len : 16, max_seq_len));
+  EngineBucketCache<TRT_Transformer<T> > cache(
+      buckets, cache_dir, model_hash(params, head_num, hidden_dim), prop.major * 10 + prop.minor,
+      [&](const EngineBucket &bucket) {
+        TRT_Transformer<T> *engine = new TRT_Transformer<T>(bucket.batch_size, bucket.seq_len, head_num, hidden_dim, layers);
+        engine->build_engine(params);
+        return engine;
+      },
+      [](TRT_Transformer<T> &engine, std::vector<char> &data) { engine.serialize(data); },
+      [&](const EngineBucket &bucket, const void *data, size_t size) -> TRT_Transformer<T> * {
+        TRT_Transformer<T> *engine = new TRT_Transformer<T>(bucket.batch_size, bucket.seq_len, head_num, hidden_dim, layers);
+        if(engine->load_engine(data, size))
+          return engine;
+        delete engine;
+        return nullptr;
+      });
+
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+
+  const int shapes[][2] = {{1, max_seq_len / 3 + 1}, {max_batch_size, max_seq_len},
+                           {max_batch_size / 2 + 1, max_seq_len / 2 + 1}, {1, max_seq_len / 3 + 1},
+                           {max_batch_size * 2 + 1, max_seq_len}};
+  for(const auto &shape : shapes)
+  {
+    const int batch_size = shape[0], seq_len = shape[1];
+    const std::vector<EngineBucketSlice> slices = buckets.split(batch_size, seq_len);
+    std::vector<T> out((size_t)batch_size * seq_len * hidden_dim);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for(const EngineBucketSlice &slice : slices)
+    {
+      // the rows of the slice padded to the sequence length of the bucket, the padding is masked
+      const int padded_len = slice.bucket.seq_len;
+      std::vector<T> from((size_t)slice.batch_size * padded_len * hidden_dim, (T)0.0f);
+      std::vector<T> mask((size_t)slice.batch_size * padded_len * padded_len);
+      std::vector<T> padded_out(from.size());
+      for(int b = 0; b < slice.batch_size; ++b)
+      {
+        for(int i = 0; i < seq_len * hidden_dim; ++i)
+          from[(size_t)b * padded_len * hidden_dim + i] = (T)0.001f;
+        for(int i = 0; i < padded_len * padded_len; ++i)
+          mask[(size_t)b * padded_len * padded_len + i] = (T)(i % padded_len < seq_len ? 1.0f : 0.0f);
+      }
+      TRT_Transformer<T> &engine = cache.get(slice.bucket);
+      engine.do_inference(slice.batch_size, from.data(), mask.data(), padded_out.data(), stream);
+      check_cuda_error(cudaStreamSynchronize(stream));
+      for(int b = 0; b < slice.batch_size; ++b)
+        memcpy(&out[((size_t)(slice.offset + b) * seq_len) * hidden_dim], &padded_out[(size_t)b * padded_len * hidden_dim],
+               sizeof(T) * seq_len * hidden_dim);
+    }
+    gettimeofday(&end, NULL);
+    printf("[INFO] request batch %d seq_len %d: %d slice(s), first engine b%d s%d, %.2f ms\n", batch_size, seq_len,
+           (int)slices.size(), slices[0].bucket.batch_size, slices[0].bucket.seq_len, diffTime(start, end));
+  }
+  const EngineCacheStats &stats = cache.stats();
+  printf("[INFO] engine cache %s: %d engines, %d hits, %d loads, %d builds, %d rejected files\n", cache_dir,
+         cache.engine_num(), stats.hits, stats.loads, stats.builds, stats.rejected_files);
+  cudaStreamDestroy(stream);
+}
+
+template <typename T>
+void run_bert_transformer(int batch_size, int seq_len, int layers, int head_num, int size_per_head,
+                          const char *engine_cache_dir){
 
   int hidden_dim = head_num * size_per_head;
 
@@ -125,6 +212,13 @@ void run_bert_transformer(int batch_size, int seq_len, int layers, int head_num,
     params.push_back(layer_param);
   }
 
+  if(engine_cache_dir != NULL)
+  {
+    run_bucketed_transformer(params, batch_size, seq_len, layers, head_num, hidden_dim, engine_cache_dir);
+    printf("finished!\n");
+    return;
+  }
+
   cudaStream_t stream;
   cudaStreamCreate(&stream);
 
@@ -140,22 +234,25 @@ void run_bert_transformer(int batch_size, int seq_len, int layers, int head_num,
 
 int main(int argc, char* argv[])
 {
-  if(argc != 7)
+  if(argc != 7 && argc != 8)
   {
-    printf("./transformer_trt batch_size num_layers seq_len head_num size_per_head fp32/fp16\n");
+    printf("./transformer_trt batch_size num_layers seq_len head_num size_per_head fp32/fp16 [engine_cache_dir]\n");
     printf("e.g., ./transformer_trt 1 12 32 12 64 fp32\n");
     printf("e.g., ./transformer_trt 1 12 32 12 64 fp16\n");
+    printf("with engine_cache_dir, batch_size and seq_len are the largest buckets of engines built on demand and kept in the directory\n");
+    printf("e.g., ./transformer_trt 8 12 128 12 64 fp16 /tmp/ft_engines\n");
     return 0;
   }
+  const char *engine_cache_dir = argc == 8 ? argv[7] : NULL;
   int batch_size = atoi(argv[1]);
   int num_layers = atoi(argv[2]);
   int seq_len = atoi(argv[3]);
   int head_num = atoi(argv[4]);
   int size_per_head = atoi(argv[5]);
   if(strcmp(argv[6], "fp16") == 0)
-    run_bert_transformer<half>(batch_size, seq_len, num_layers, head_num, size_per_head);
+    run_bert_transformer<half>(batch_size, seq_len, num_layers, head_num, size_per_head, engine_cache_dir);
   else if(strcmp(argv[6], "fp32") == 0)
-    run_bert_transformer<float>(batch_size, seq_len, num_layers, head_num, size_per_head);
+    run_bert_transformer<float>(batch_size, seq_len, num_layers, head_num, size_per_head, engine_cache_dir);
   else
   {
     printf("the last argument is invalid, it should be fp16 or fp32\n");
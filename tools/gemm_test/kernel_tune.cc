@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastertransformer/cuda/kernel_tuner.h"
+#include "fastertransformer/cuda/cuda_kernels.h"
+#include "fastertransformer/cuda/open_attention.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace fastertransformer;
+
+/* Tunes the kernel variants of the encoder for a shape and writes kernel_config.in. The entries
+   of an existing kernel_config.in are kept, those of the same keys are replaced. */
+int main(int argc, char* argv[])
+{
+  if(argc != 6)
+  {
+    printf("[ERROR] kernel_tune batch_size seq_len head_number size_per_head is_fp16. \n");
+    printf("e.g. ./bin/kernel_tune 1 32 12 64 0\n");
+    return 0;
+  }
+
+  const int batch_size = atoi(argv[1]);
+  const int seq_len = atoi(argv[2]);
+  const int head_num = atoi(argv[3]);
+  const int size_per_head = atoi(argv[4]);
+  const int is_fp16 = atoi(argv[5]);
+  if(is_fp16 != 0 && is_fp16 != 1)
+  {
+    printf("[ERROR] is_fp16 should be 0 (use float) or 1 (use half). \n");
+    return -1;
+  }
+
+  struct cudaDeviceProp prop;
+  check_cuda_error(cudaGetDeviceProperties(&prop, 0));
+  printf("Device %s\n", prop.name);
+
+  register_layernorm_variants();
+  cuda::register_attention_softmax_variants();
+
+  KernelVariantTable& table = KernelVariantTable::instance();
+  const int sm = current_sm_version();
+  const KernelShape layernorm_shape(kernel_shape_bucket(batch_size * seq_len), head_num * size_per_head);
+  const KernelShape softmax_shape(kernel_shape_bucket(batch_size * head_num), seq_len);
+  if(table.tune("layernorm", sm, is_fp16, layernorm_shape) < 0)
+    printf("[WARNING] no layernorm variant supports the shape \n");
+  if(table.tune("attn_softmax", sm, is_fp16, softmax_shape) < 0)
+    printf("[WARNING] no attention softmax variant supports the shape \n");
+
+  if(!table.save(KERNEL_CONFIG))
+    return -1;
+  printf("[INFO] %d entries are written to %s \n", table.size(), KERNEL_CONFIG);
+  return 0;
+}